@@ -1180,9 +1180,11 @@ static int arm64_mmu_fork(PML *parent_table, PML *child_table, unsigned int pt_l
  *
  * @param old_region Old vm_area_struct
  * @param addr_space Current address space
+ * @param batch Fork batch (unused, arm64_mmu_fork invalidates as it goes)
  * @return 0 on success, negative error codes
  */
-int mmu_fork_tables(struct vm_area_struct *old_region, struct mm_address_space *addr_space)
+int mmu_fork_tables(struct vm_area_struct *old_region, struct mm_address_space *addr_space,
+                    struct mmu_fork_batch *batch)
 {
     page_table_iterator it{old_region->vm_start, vma_pages(old_region) << PAGE_SHIFT, addr_space};
 
@@ -1191,6 +1193,10 @@ int mmu_fork_tables(struct vm_area_struct *old_region, struct mm_address_space *
                           arm64_paging_levels - 1, it, old_region);
 }
 
+void mmu_fork_batch_end(struct mmu_fork_batch *batch)
+{
+}
+
 unsigned int mmu_get_clear_referenced(struct mm_address_space *mm, void *addr, struct page *page)
 {
     /* TODO: arm64 AF is way less trivial than riscv or x86, as we need to emulate AF (or not!
@@ -38,6 +38,11 @@ int platform_allocate_msi_interrupts(unsigned int num_vectors, bool addr64,
     UNIMPLEMENTED;
 }
 
+int platform_msi_set_target(struct pci_msi_data *data, unsigned int target_cpu)
+{
+    UNIMPLEMENTED;
+}
+
 thread *sched_create_thread(thread_callback_t callback, uint32_t flags, void *args)
 {
     UNIMPLEMENTED;
@@ -17,6 +17,7 @@
 atomic<int> curr_id = 1;
 constexpr unsigned long kernel_stack_size = 0x4000;
 constexpr bool adding_guard_page = true;
+constexpr size_t kernel_stack_pages = adding_guard_page ? 6 : 4;
 
 extern "C" unsigned long get_kernel_gp();
 
@@ -69,7 +70,7 @@ extern "C" void thread_finish_destruction(struct rcu_head *head)
     if (adding_guard_page)
         stack_base -= PAGE_SIZE;
 
-    vfree((void *) stack_base);
+    vfree_stack((void *) stack_base, kernel_stack_pages);
 #endif
     /* Free the fpu area */
     free(thread->fpu_area);
@@ -95,7 +96,6 @@ thread *sched_spawn_thread(registers_t *regs, unsigned int flags, void *tp)
     new_thread->fpu_area = nullptr;
 
     bool is_user = !(flags & THREAD_KERNEL);
-    auto pages = adding_guard_page ? 6 : 4;
     void *original_entry = (void *) regs->epc;
 
     if (is_user)
@@ -128,7 +128,7 @@ thread *sched_spawn_thread(registers_t *regs, unsigned int flags, void *tp)
     new_thread->refcount = 1;
 
     new_thread->kernel_stack =
-        static_cast<uintptr_t *>(vmalloc(pages, VM_TYPE_STACK, VM_READ | VM_WRITE, GFP_KERNEL));
+        static_cast<uintptr_t *>(vmalloc_stack(kernel_stack_pages, GFP_KERNEL));
 
     if (!new_thread->kernel_stack)
     {
@@ -26,6 +26,11 @@ int platform_allocate_msi_interrupts(unsigned int num_vectors, bool addr64,
     UNIMPLEMENTED;
 }
 
+int platform_msi_set_target(struct pci_msi_data *data, unsigned int target_cpu)
+{
+    UNIMPLEMENTED;
+}
+
 void arch_vm_init()
 {
 }
@@ -129,3 +129,29 @@ fault:
     CLEAR_USER_MEMORY_ACCESS;
     return -EFAULT;
 }
+
+long cmpxchg_user32(unsigned int *uaddr, unsigned int *expected, unsigned int newval)
+{
+    DO_USER_POINTER_CHECKS(uaddr, sizeof(uint32_t));
+    ALLOW_USER_MEMORY_ACCESS;
+    /* Same trick as get_user32: the old value gets stored through an input memory operand */
+    __asm__ goto("%=: lr.w.aqrl t1, (%1)\n\t"
+                 "    bne t1, %2, 1f\n\t"
+                 "2:  sc.w.aqrl t2, %3, (%1)\n\t"
+                 "    bnez t2, %=b\n\t"
+                 "1:  sw t1, %0\n\t"
+                 ".pushsection .ehtable\n\t"
+                 ".dword %=b\n\t"
+                 ".dword %l4\n\t"
+                 ".dword 2b\n\t"
+                 ".dword %l4\n\t"
+                 ".popsection\n\t" ::"m"(*expected),
+                 "r"(uaddr), "r"((long) (int) *expected), "r"(newval)
+                 : "t1", "t2", "memory"
+                 : fault);
+    CLEAR_USER_MEMORY_ACCESS;
+    return 0;
+fault:
+    CLEAR_USER_MEMORY_ACCESS;
+    return -EFAULT;
+}
@@ -0,0 +1,252 @@
+/*
+ * Copyright (c) 2025 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the GPLv2 License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include <onyx/acpi.h>
+#include <onyx/mm/numa.h>
+#include <onyx/vm.h>
+#include <onyx/x86/numa.h>
+
+/*
+ * The SRAT and SLIT get parsed way before ACPICA is up (we need them to set up the page
+ * allocator), so we walk the RSDT ourselves. All of physical memory is mapped by now.
+ */
+
+struct x86_apic_node
+{
+    u32 apic_id;
+    int nid;
+};
+
+static struct x86_apic_node apic_nodes[CONFIG_SMP_NR_CPUS];
+static unsigned int nr_apic_nodes;
+
+/* Proximity domains, indexed by node id */
+static u32 node_pxms[CONFIG_NUMA_NR_NODES];
+static unsigned int nr_pxms;
+
+static acpi_table_header *x86_numa_find_table(const char *signature)
+{
+    unsigned long rsdp_phys = acpi_get_rsdp();
+    if (!rsdp_phys)
+        return nullptr;
+
+    auto rsdp = (acpi_table_rsdp *) PHYS_TO_VIRT(rsdp_phys);
+    bool xsdt = rsdp->revision >= 2 && rsdp->xsdt_physical_address;
+    auto root = (acpi_table_header *) PHYS_TO_VIRT(xsdt ? rsdp->xsdt_physical_address
+                                                        : (u64) rsdp->rsdt_physical_address);
+    size_t entry_size = xsdt ? ACPI_XSDT_ENTRY_SIZE : ACPI_RSDT_ENTRY_SIZE;
+    size_t nr_entries = (root->length - sizeof(acpi_table_header)) / entry_size;
+
+    for (size_t i = 0; i < nr_entries; i++)
+    {
+        u64 table = xsdt ? ((acpi_table_xsdt *) root)->table_offset_entry[i]
+                         : ((acpi_table_rsdt *) root)->table_offset_entry[i];
+        auto header = (acpi_table_header *) PHYS_TO_VIRT(table);
+        if (!memcmp(header->signature, signature, ACPI_NAMESEG_SIZE))
+            return header;
+    }
+
+    return nullptr;
+}
+
+static int x86_numa_pxm_to_node(u32 pxm)
+{
+    for (unsigned int i = 0; i < nr_pxms; i++)
+    {
+        if (node_pxms[i] == pxm)
+            return i;
+    }
+
+    return -1;
+}
+
+static int x86_numa_add_pxm(u32 pxm)
+{
+    int nid = x86_numa_pxm_to_node(pxm);
+    if (nid >= 0)
+        return nid;
+
+    if (nr_pxms == CONFIG_NUMA_NR_NODES)
+        return -1;
+    node_pxms[nr_pxms] = pxm;
+    return nr_pxms++;
+}
+
+template <typename Callable>
+static void x86_srat_for_each(acpi_table_srat *srat, Callable c)
+{
+    auto end = (char *) srat + srat->header.length;
+    for (auto sub = (acpi_subtable_header *) (srat + 1); (char *) sub < end;
+         sub = (acpi_subtable_header *) ((char *) sub + sub->length))
+    {
+        if (sub->length == 0)
+            break;
+        c(sub);
+    }
+}
+
+/**
+ * @brief Get a subtable's proximity domain. Returns false if the subtable doesn't have a (enabled)
+ * one.
+ */
+static bool x86_srat_get_pxm(acpi_table_srat *srat, acpi_subtable_header *sub, u32 *pxm)
+{
+    switch (sub->type)
+    {
+        case ACPI_SRAT_TYPE_CPU_AFFINITY: {
+            auto cpu = (acpi_srat_cpu_affinity *) sub;
+            if (!(cpu->flags & ACPI_SRAT_CPU_USE_AFFINITY))
+                return false;
+            *pxm = cpu->proximity_domain_lo;
+            // The high bits only exist since SRAT revision 2
+            if (srat->header.revision >= 2)
+            {
+                *pxm |= cpu->proximity_domain_hi[0] << 8 | cpu->proximity_domain_hi[1] << 16 |
+                        cpu->proximity_domain_hi[2] << 24;
+            }
+            return true;
+        }
+        case ACPI_SRAT_TYPE_X2APIC_CPU_AFFINITY: {
+            auto cpu = (acpi_srat_x2apic_cpu_affinity *) sub;
+            if (!(cpu->flags & ACPI_SRAT_CPU_ENABLED))
+                return false;
+            *pxm = cpu->proximity_domain;
+            return true;
+        }
+        case ACPI_SRAT_TYPE_MEMORY_AFFINITY: {
+            auto mem = (acpi_srat_mem_affinity *) sub;
+            if (!(mem->flags & ACPI_SRAT_MEM_ENABLED) || mem->length == 0)
+                return false;
+            *pxm = mem->proximity_domain;
+            if (srat->header.revision < 2)
+                *pxm &= 0xff;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static void x86_numa_add_cpu(u32 apic_id, int nid)
+{
+    if (nr_apic_nodes == CONFIG_SMP_NR_CPUS)
+        return;
+    apic_nodes[nr_apic_nodes].apic_id = apic_id;
+    apic_nodes[nr_apic_nodes].nid = nid;
+    nr_apic_nodes++;
+}
+
+static void x86_numa_parse_slit()
+{
+    auto slit = (acpi_table_slit *) x86_numa_find_table(ACPI_SIG_SLIT);
+    if (!slit)
+        return;
+
+    // Localities are proximity domains
+    u64 nr = slit->locality_count;
+    if (sizeof(*slit) - 1 + nr * nr > slit->header.length)
+    {
+        pr_warn("x86/numa: Firmware bug: SLIT too short for %lu localities\n", nr);
+        return;
+    }
+
+    for (unsigned int i = 0; i < nr_pxms; i++)
+    {
+        for (unsigned int j = 0; j < nr_pxms; j++)
+        {
+            if (node_pxms[i] >= nr || node_pxms[j] >= nr)
+                continue;
+            numa_set_distance(i, j, slit->entry[node_pxms[i] * nr + node_pxms[j]]);
+        }
+    }
+}
+
+/**
+ * @brief Parse the NUMA topology out of the SRAT and SLIT. Needs the RSDP and the physical
+ * memory map, and must run before page_init.
+ */
+void x86_numa_init()
+{
+    auto srat = (acpi_table_srat *) x86_numa_find_table(ACPI_SIG_SRAT);
+    bool has_memory = false;
+    bool too_many = false;
+
+    if (!srat)
+        return;
+
+    // First, see how many domains there are. Only domains with CPUs or memory become nodes.
+    x86_srat_for_each(srat, [&](acpi_subtable_header *sub) {
+        u32 pxm;
+        if (!x86_srat_get_pxm(srat, sub, &pxm))
+            return;
+        if (x86_numa_add_pxm(pxm) < 0)
+            too_many = true;
+        if (sub->type == ACPI_SRAT_TYPE_MEMORY_AFFINITY)
+            has_memory = true;
+    });
+
+    if (too_many || !has_memory)
+    {
+        if (too_many)
+            pr_warn("x86/numa: More than %u NUMA nodes, ignoring the SRAT\n",
+                    CONFIG_NUMA_NR_NODES);
+        nr_pxms = 0;
+        return;
+    }
+
+    x86_srat_for_each(srat, [&](acpi_subtable_header *sub) {
+        u32 pxm;
+        if (!x86_srat_get_pxm(srat, sub, &pxm))
+            return;
+
+        int nid = x86_numa_pxm_to_node(pxm);
+        switch (sub->type)
+        {
+            case ACPI_SRAT_TYPE_CPU_AFFINITY:
+                x86_numa_add_cpu(((acpi_srat_cpu_affinity *) sub)->apic_id, nid);
+                break;
+            case ACPI_SRAT_TYPE_X2APIC_CPU_AFFINITY:
+                x86_numa_add_cpu(((acpi_srat_x2apic_cpu_affinity *) sub)->apic_id, nid);
+                break;
+            case ACPI_SRAT_TYPE_MEMORY_AFFINITY: {
+                auto mem = (acpi_srat_mem_affinity *) sub;
+                pr_info("x86/numa: SRAT: PXM %u -> [%016lx, %016lx]\n", pxm, mem->base_address,
+                        mem->base_address + mem->length - 1);
+                if (numa_add_memblk(nid, mem->base_address, mem->base_address + mem->length) < 0)
+                    pr_warn("x86/numa: Out of memory blocks, memory may end up in node 0\n");
+                break;
+            }
+        }
+    });
+
+    numa_set_nr_nodes(nr_pxms);
+    x86_numa_parse_slit();
+}
+
+/**
+ * @brief Get the node of a local APIC
+ *
+ * @param apic_id APIC id
+ * @return Node id, 0 if the SRAT didn't say
+ */
+int x86_numa_apic_to_node(u32 apic_id)
+{
+    // numa_init may have thrown the topology away
+    if (nr_numa_nodes == 1)
+        return 0;
+
+    for (unsigned int i = 0; i < nr_apic_nodes; i++)
+    {
+        if (apic_nodes[i].apic_id == apic_id)
+            return apic_nodes[i].nid;
+    }
+
+    return 0;
+}
@@ -15,6 +15,7 @@
 #include <onyx/cpu.h>
 #include <onyx/irq.h>
 #include <onyx/log.h>
+#include <onyx/mm/numa.h>
 #include <onyx/panic.h>
 #include <onyx/percpu.h>
 #include <onyx/process.h>
@@ -26,6 +27,7 @@
 #include <onyx/x86/apic.h>
 #include <onyx/x86/idt.h>
 #include <onyx/x86/msr.h>
+#include <onyx/x86/numa.h>
 #include <onyx/x86/pit.h>
 #include <onyx/x86/tsc.h>
 
@@ -352,6 +354,9 @@ static void parse_lapics()
 
     x86_fixup_lapic_list(x86_get_current_lapic_id());
 
+    for (unsigned int i = 0; i < cul::min(lapic_ids.size(), (size_t) CONFIG_SMP_NR_CPUS); i++)
+        numa_set_cpu_node(i, x86_numa_apic_to_node(lapic_ids[i]));
+
     // Take this time to do brief init of some SMP stuff that needed the number of CPUs
 
     smp::set_number_of_cpus(nr_cpus);
@@ -12,6 +12,7 @@
 #include <onyx/smbios.h>
 #include <onyx/types.h>
 #include <onyx/vm.h>
+#include <onyx/x86/numa.h>
 #include <onyx/x86/pat.h>
 
 #include <efi/efi.h>
@@ -101,16 +102,18 @@ static void efi_enumerate_memory_map()
     printf("MAXPFN: %lx\n", maxpfn);
 
     paging_map_all_phys();
+    x86_numa_init();
 
     page_init(memory, maxpfn);
 }
 
 void efi_boot_init(EFI_SYSTEM_TABLE *systable)
 {
-    efi_enumerate_memory_map();
-
+    // The NUMA topology needs ACPI tables before the page allocator is up
     if (efi_state.acpi_table)
         acpi_set_rsdp((uintptr_t) efi_state.acpi_table);
+
+    efi_enumerate_memory_map();
     smbios_set_tables((unsigned long) efi_state.smbios_table,
                       (unsigned long) efi_state.smbios30_table);
 }
@@ -66,6 +66,7 @@ int x86_allocate_vectors(int nr)
 }
 
 extern unsigned long x86_isr_table[];
+extern "C" void x86_nmi_entry();
 
 #include <stdio.h>
 
@@ -75,7 +76,7 @@ void idt_init(void)
 
     x86_reserve_vector(0, isr0);
     x86_reserve_vector(1, isr1);
-    x86_reserve_vector(2, isr2);
+    x86_reserve_vector(2, x86_nmi_entry);
     idt_set_system_gate(3, (unsigned long) isr3, 0x8, 0x8e);
     x86_reserve_vector(4, isr4);
     x86_reserve_vector(5, isr5);
@@ -122,6 +123,8 @@ void idt_init(void)
     /* Double fault handlers use a separate stack */
     /* TODO: Set this up better. */
     idt_entries[8].zero = 1;
+    /* NMIs too, see x86_nmi_entry */
+    idt_entries[2].zero = 3;
 
     idt_load();
 }
@@ -77,31 +77,36 @@ unsigned long irq_handler(struct registers *regs)
     return (unsigned long) context.registers;
 }
 
+int platform_msi_set_target(struct pci_msi_data *data, unsigned int target_cpu)
+{
+    /* See section 10.11.1 of the intel software developer manuals */
+    u16 target_lapic = cpu2lapicid(target_cpu);
+
+    /* We can only target lapics over 255 with an IOMMU, and we don't have support for that yet.
+     * Shame. */
+    if (WARN_ON_ONCE(target_lapic > 255))
+        return -EIO;
+
+    data->address = PCI_MSI_BASE_ADDRESS | (u32) target_lapic << PCI_MSI_APIC_ID_SHIFT;
+    data->address_high = 0;
+    return 0;
+}
+
 int platform_allocate_msi_interrupts(unsigned int num_vectors, bool addr64,
                                      struct pci_msi_data *data, unsigned int flags,
                                      unsigned int target_cpu)
 {
-    u16 target_lapic;
     int vecs = x86_allocate_vectors(num_vectors);
     if (vecs < 0)
         return -1;
-    /* See section 10.11.1 of the intel software developer manuals */
-    target_lapic = cpu2lapicid(target_cpu);
-
-    /* We can only target lapics over 255 with an IOMMU, and we don't have support for that yet.
-     * Shame. */
-    if (WARN_ON_ONCE(target_lapic > 255))
+    if (platform_msi_set_target(data, target_cpu) < 0)
         return -EIO;
-    uint32_t address = PCI_MSI_BASE_ADDRESS;
-    address |= (u32) target_lapic << PCI_MSI_APIC_ID_SHIFT;
 
     printf("x86/msi: Routing %u vectors to cpu%u\n", num_vectors, target_cpu);
 
     /* See section 10.11.2 of the intel software developer manuals */
     uint32_t data_val = vecs;
 
-    data->address = address;
-    data->address_high = 0;
     data->data = data_val;
     data->vector_start = vecs;
 
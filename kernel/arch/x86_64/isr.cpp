@@ -26,6 +26,7 @@
 #include <onyx/x86/ktrace.h>
 #include <onyx/x86/mce.h>
 #include <onyx/x86/msr.h>
+#include <onyx/x86/pmu.h>
 
 /* TODO: Move scope_guard somewhere else */
 #include <onyx/trace/trace_base.h>
@@ -151,6 +152,19 @@ void nmi_exception(struct registers *ctx)
     panic("Unexpected NMI exception\n");
 }
 
+/**
+ * @brief Handle an NMI, from x86_nmi_entry. We can interrupt anything (including code holding
+ * locks, with irqs disabled), so whatever runs here can't take locks or sleep.
+ *
+ * @param regs Registers at the time of the NMI
+ */
+extern "C" void x86_handle_nmi(struct registers *regs)
+{
+    if (x86_pmu_handle_nmi(regs))
+        return;
+    nmi_exception(regs);
+}
+
 void overflow_trap(struct registers *ctx)
 {
     if (is_kernel_exception(ctx))
@@ -55,6 +55,7 @@
 #include <onyx/x86/idt.h>
 #include <onyx/x86/kvm.h>
 #include <onyx/x86/msr.h>
+#include <onyx/x86/numa.h>
 #include <onyx/x86/pat.h>
 
 #include <acpica/acpi.h>
@@ -389,6 +390,7 @@ extern "C" void multiboot2_kernel_entry(uintptr_t addr, uint32_t magic)
     max_pfn = mb2_get_maxpfn();
 
     paging_map_all_phys();
+    x86_numa_init();
     page_init(total_mem, max_pfn);
     x86_late_vm_init();
 
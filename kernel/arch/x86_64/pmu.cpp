@@ -0,0 +1,323 @@
+/*
+ * Copyright (c) 2025 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the GPLv2 License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+#include <cpuid.h>
+#include <errno.h>
+#include <stdio.h>
+
+#include <onyx/compiler.h>
+#include <onyx/cpu.h>
+#include <onyx/init.h>
+#include <onyx/percpu.h>
+#include <onyx/perf_event.h>
+#include <onyx/registers.h>
+#include <onyx/x86/apic.h>
+#include <onyx/x86/msr.h>
+#include <onyx/x86/pmu.h>
+
+/*
+ * x86 PMU: the general purpose counters of Intel's architectural perfmon (CPUID leaf 0xa) and of
+ * AMD's core PMU. Counters are preset to -period, and interrupt when they wrap. The interrupt is an
+ * NMI (through the LAPIC's performance counter LVT entry), so we get samples of irqs-disabled code
+ * too.
+ */
+
+#define PMU_MAX_COUNTERS 8
+
+/* Event select bits, the same on Intel and AMD */
+#define EVTSEL_USR (1 << 16)
+#define EVTSEL_OS  (1 << 17)
+#define EVTSEL_INT (1 << 20)
+#define EVTSEL_EN  (1 << 22)
+
+#define PMU_LVT_NMI (ICR_DELIVERY_NMI << 8)
+
+struct x86_pmu_cpu
+{
+    /* Events by counter. The NMI handler looks at these, so counters get programmed before being
+     * published here, and stopped before being unpublished. */
+    struct perf_event *events[PMU_MAX_COUNTERS];
+    bool lvt_set;
+};
+
+PER_CPU_VAR(static struct x86_pmu_cpu pmu_cpu);
+
+static unsigned int nr_counters;
+static unsigned int counter_width;
+static u32 evtsel_base;
+static u32 counter_base;
+static u32 msr_stride;
+/* Architectural perfmon version, 0 on AMD */
+static unsigned int intel_version;
+/* CPUID.0AH:EBX, events that are *not* available */
+static u32 intel_unavailable;
+static unsigned int intel_unavailable_len;
+static const u16 *event_map;
+
+/* Event select codes, as umask << 8 | event, indexed by PERF_COUNT_HW_*. 0 is unsupported. */
+static const u16 intel_event_map[PERF_COUNT_HW_MAX] = {
+    0x003c, /* UnHalted Core Cycles */
+    0x00c0, /* Instructions Retired */
+    0,
+    0x412e, /* LLC Misses */
+    0,
+    0x00c5, /* Branch Misses Retired */
+};
+
+/* Bits in CPUID.0AH:EBX for the events above */
+static const u8 intel_event_bit[PERF_COUNT_HW_MAX] = {0, 1, 0, 4, 0, 6};
+
+static const u16 amd_event_map[PERF_COUNT_HW_MAX] = {
+    0x0076, /* CPU Clocks not Halted */
+    0x00c0, /* Retired Instructions */
+    0,
+    0x077e, /* L2 cache misses */
+    0,
+    0x00c3, /* Retired Mispredicted Branch Instructions */
+};
+
+static const u16 amd_zen_event_map[PERF_COUNT_HW_MAX] = {
+    0x0076, /* Cycles not in Halt */
+    0x00c0, /* Retired Instructions */
+    0,
+    0x0964, /* L2 cache misses, from the L1s */
+    0,
+    0x00c3, /* Retired Branch Instructions Mispredicted */
+};
+
+static void x86_pmu_write_evtsel(int idx, u64 val)
+{
+    wrmsr(evtsel_base + idx * msr_stride, val);
+}
+
+static void x86_pmu_write_counter(int idx, u64 val)
+{
+    wrmsr(counter_base + idx * msr_stride, val);
+}
+
+static u64 x86_pmu_read_counter(int idx)
+{
+    return rdmsr(counter_base + idx * msr_stride);
+}
+
+static u64 x86_pmu_counter_mask()
+{
+    return (1UL << counter_width) - 1;
+}
+
+static u64 x86_pmu_start_value(struct perf_event *ev)
+{
+    return -ev->period & x86_pmu_counter_mask();
+}
+
+static u64 x86_pmu_evtsel(struct perf_event *ev)
+{
+    u64 evtsel = event_map[ev->attr.config] | EVTSEL_INT;
+
+    if (!(ev->attr.flags & PERF_ATTR_EXCLUDE_USER))
+        evtsel |= EVTSEL_USR;
+    if (!(ev->attr.flags & PERF_ATTR_EXCLUDE_KERNEL))
+        evtsel |= EVTSEL_OS;
+    return evtsel;
+}
+
+static bool x86_pmu_has_event(u64 config)
+{
+    if (!event_map[config])
+        return false;
+
+    if (intel_version)
+    {
+        unsigned int bit = intel_event_bit[config];
+        return bit < intel_unavailable_len && !(intel_unavailable & (1U << bit));
+    }
+
+    return true;
+}
+
+static int x86_pmu_add(struct perf_event *ev)
+{
+    struct x86_pmu_cpu *pc = get_per_cpu_ptr(pmu_cpu);
+
+    for (unsigned int i = 0; i < nr_counters; i++)
+    {
+        if (pc->events[i])
+            continue;
+
+        x86_pmu_write_evtsel(i, x86_pmu_evtsel(ev));
+        x86_pmu_write_counter(i, x86_pmu_start_value(ev));
+        ev->hwc = i;
+
+        if (!pc->lvt_set)
+        {
+            lapic_write(LAPIC_PERFCI, PMU_LVT_NMI);
+            pc->lvt_set = true;
+        }
+
+        if (intel_version >= 2)
+            wrmsr(IA32_PERF_GLOBAL_CTRL, rdmsr(IA32_PERF_GLOBAL_CTRL) | (1UL << i));
+
+        WRITE_ONCE(pc->events[i], ev);
+        return 0;
+    }
+
+    return -EBUSY;
+}
+
+static void x86_pmu_del(struct perf_event *ev)
+{
+    struct x86_pmu_cpu *pc = get_per_cpu_ptr(pmu_cpu);
+
+    x86_pmu_write_evtsel(ev->hwc, 0);
+    if (intel_version >= 2)
+        wrmsr(IA32_PERF_GLOBAL_CTRL, rdmsr(IA32_PERF_GLOBAL_CTRL) & ~(1UL << ev->hwc));
+
+    WRITE_ONCE(pc->events[ev->hwc], nullptr);
+    ev->hwc = -1;
+}
+
+static void x86_pmu_start(struct perf_event *ev)
+{
+    x86_pmu_write_evtsel(ev->hwc, x86_pmu_evtsel(ev) | EVTSEL_EN);
+}
+
+static void x86_pmu_stop(struct perf_event *ev)
+{
+    x86_pmu_write_evtsel(ev->hwc, x86_pmu_evtsel(ev));
+}
+
+static void x86_pmu_reset(struct perf_event *ev)
+{
+    x86_pmu_write_counter(ev->hwc, x86_pmu_start_value(ev));
+}
+
+static u64 x86_pmu_read(struct perf_event *ev)
+{
+    return (x86_pmu_read_counter(ev->hwc) - x86_pmu_start_value(ev)) & x86_pmu_counter_mask();
+}
+
+static struct pmu x86_pmu = {
+    .name = nullptr,
+    .max_period = 0,
+    .has_event = x86_pmu_has_event,
+    .add = x86_pmu_add,
+    .del = x86_pmu_del,
+    .start = x86_pmu_start,
+    .stop = x86_pmu_stop,
+    .reset = x86_pmu_reset,
+    .read = x86_pmu_read,
+};
+
+/**
+ * @brief Handle a PMU NMI
+ *
+ * @param regs Registers at the time of the NMI
+ * @return True if it was ours, else false
+ */
+bool x86_pmu_handle_nmi(struct registers *regs)
+{
+    struct x86_pmu_cpu *pc = get_per_cpu_ptr(pmu_cpu);
+    bool active = false;
+
+    for (unsigned int i = 0; i < nr_counters; i++)
+    {
+        struct perf_event *ev = READ_ONCE(pc->events[i]);
+        if (!ev)
+            continue;
+
+        active = true;
+        // Counters start out with their top bit set (period <= max_period), so a clear top bit
+        // means it wrapped around.
+        if (x86_pmu_read_counter(i) & (1UL << (counter_width - 1)))
+            continue;
+
+        x86_pmu_write_counter(i, x86_pmu_start_value(ev));
+        perf_event_overflow(ev, regs);
+    }
+
+    // Overflows may get coalesced into a single NMI, so we can get NMIs for counters we already
+    // handled. While we have counters running, eat them instead of panicking.
+    if (!active)
+        return false;
+
+    if (intel_version >= 2)
+        wrmsr(IA32_PERF_GLOBAL_STATUS_RST, rdmsr(IA32_PERF_GLOBAL_STATUS));
+
+    // Intel masks the LVT entry when delivering a PMI
+    lapic_write(LAPIC_PERFCI, PMU_LVT_NMI);
+    return true;
+}
+
+static bool x86_pmu_init_intel()
+{
+    u32 eax, ebx, ecx, edx;
+
+    if (!__get_cpuid(CPUID_ARCH_PERFMON, &eax, &ebx, &ecx, &edx))
+        return false;
+
+    intel_version = eax & 0xff;
+    if (!intel_version)
+        return false;
+
+    nr_counters = cul::min((eax >> 8) & 0xff, (u32) PMU_MAX_COUNTERS);
+    counter_width = (eax >> 16) & 0xff;
+    intel_unavailable_len = eax >> 24;
+    intel_unavailable = ebx;
+    evtsel_base = IA32_PERFEVTSEL0;
+    counter_base = IA32_PMC0;
+    msr_stride = 1;
+    event_map = intel_event_map;
+    x86_pmu.name = "intel";
+    // Writes to IA32_PMCx only take the low 32 bits (and sign extend them)
+    x86_pmu.max_period = (1UL << 31) - 1;
+    return true;
+}
+
+static bool x86_pmu_init_amd()
+{
+    if (x86_has_cap(X86_FEATURE_PERFCTR_CORE))
+    {
+        nr_counters = 6;
+        evtsel_base = AMD_MSR_PERF_CTL0_EXT;
+        counter_base = AMD_MSR_PERF_CTR0_EXT;
+        msr_stride = 2;
+    }
+    else
+    {
+        nr_counters = 4;
+        evtsel_base = AMD_MSR_PERF_EVTSEL0;
+        counter_base = AMD_MSR_PERF_CTR0;
+        msr_stride = 1;
+    }
+
+    counter_width = 48;
+    event_map = bootcpu_info.family >= 0x17 ? amd_zen_event_map : amd_event_map;
+    x86_pmu.name = "amd";
+    x86_pmu.max_period = (1UL << (counter_width - 1)) - 1;
+    return true;
+}
+
+static void x86_pmu_init()
+{
+    bool found = false;
+
+    if (bootcpu_info.manufacturer == X86_CPU_MANUFACTURER_INTEL)
+        found = x86_pmu_init_intel();
+    else if (bootcpu_info.manufacturer == X86_CPU_MANUFACTURER_AMD)
+        found = x86_pmu_init_amd();
+
+    if (!found || !nr_counters)
+    {
+        nr_counters = 0;
+        return;
+    }
+
+    pr_info("pmu: %s PMU, %u counters, %u bits wide\n", x86_pmu.name, nr_counters, counter_width);
+    perf_register_pmu(&x86_pmu);
+}
+
+INIT_LEVEL_CORE_KERNEL_ENTRY(x86_pmu_init);
@@ -127,6 +127,9 @@ int sys_arch_prctl(int code, unsigned long *addr)
             break;
         }
         case ARCH_SET_GS: {
+            /* x86_nmi_entry tells user and kernel GS bases apart by their sign */
+            if ((unsigned long) addr >= VM_USER_ADDR_LIMIT)
+                return -EPERM;
             current->gs = (void *) addr;
             wrmsr(KERNEL_GS_BASE, (uintptr_t) current->gs);
             break;
@@ -142,6 +145,7 @@ int sys_arch_prctl(int code, unsigned long *addr)
 }
 
 constexpr bool adding_guard_page = false;
+constexpr size_t kernel_stack_pages = adding_guard_page ? 6 : 4;
 
 extern "C" void thread_finish_destruction(struct rcu_head *head)
 {
@@ -153,7 +157,7 @@ extern "C" void thread_finish_destruction(struct rcu_head *head)
     if (adding_guard_page)
         stack_base -= PAGE_SIZE;
 
-    vfree((void *) stack_base);
+    vfree_stack((void *) stack_base, kernel_stack_pages);
 #endif
     /* Free the fpu area */
     free(thread->fpu_area);
@@ -179,7 +183,6 @@ thread *sched_spawn_thread(registers_t *regs, unsigned int flags, void *fs)
     new_thread->canary = THREAD_STRUCT_CANARY;
 
     bool is_user = !(flags & THREAD_KERNEL);
-    auto pages = adding_guard_page ? 6 : 4;
     void *original_entry = (void *) regs->rip;
 
     if (is_user)
@@ -212,7 +215,7 @@ thread *sched_spawn_thread(registers_t *regs, unsigned int flags, void *fs)
     new_thread->refcount = 1;
 
     thr_stack_alloc =
-        static_cast<uintptr_t *>(vmalloc(pages, VM_TYPE_STACK, VM_READ | VM_WRITE, GFP_KERNEL));
+        static_cast<uintptr_t *>(vmalloc_stack(kernel_stack_pages, GFP_KERNEL));
 
     new_thread->kernel_stack = thr_stack_alloc;
     if (!new_thread->kernel_stack)
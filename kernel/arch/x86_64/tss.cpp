@@ -37,6 +37,8 @@ void set_kernel_stack(uintptr_t stack0)
 unsigned char double_fault_stack[2048];
 unsigned char *double_fault_stack_top = &double_fault_stack[2047];
 
+#define NMI_STACK_SIZE 0x4000
+
 void init_percpu_tss(uint64_t *gdt)
 {
     tss_entry_t *new_tss = new tss_entry_t;
@@ -66,4 +68,10 @@ void init_percpu_tss(uint64_t *gdt)
     write_per_cpu(tss, new_tss);
 
     new_tss->ist[1] = (unsigned long) double_fault_stack_top;
+
+    /* NMIs can come in at any point, even with a bogus %rsp, so they get their own stack (IST3) */
+    unsigned char *nmi_stack = new unsigned char[NMI_STACK_SIZE];
+    if (!nmi_stack)
+        panic("Out of memory allocating a per-cpu NMI stack");
+    new_tss->ist[2] = ((unsigned long) nmi_stack + NMI_STACK_SIZE) & -16UL;
 }
@@ -0,0 +1,288 @@
+/*
+ * Copyright (c) 2024 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the GPLv2 License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#define pr_fmt(fmt) "null_blk: " fmt
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <onyx/block.h>
+#include <onyx/block/io-queue.h>
+#include <onyx/block/multiqueue.h>
+#include <onyx/block/request.h>
+#include <onyx/clock.h>
+#include <onyx/cmdline.h>
+#include <onyx/cpu.h>
+#include <onyx/driver.h>
+#include <onyx/mm/slab.h>
+#include <onyx/timer.h>
+#include <onyx/vector.h>
+
+#include <onyx/memory.hpp>
+
+/* nullb0: a block device that doesn't do any I/O. Everything above the driver (bio_reqs,
+ * requests, merging, io_queues and completion) still runs, so this measures the block layer's
+ * own overhead. */
+
+#define NULLB_COMPLETE_INLINE  0
+#define NULLB_COMPLETE_SOFTIRQ 1
+#define NULLB_COMPLETE_TIMER   2
+
+static unsigned long nullb_nr_queues = CONFIG_BLK_NULL_QUEUES;
+static unsigned long nullb_queue_depth = CONFIG_BLK_NULL_QUEUE_DEPTH;
+static unsigned long nullb_completion = CONFIG_BLK_NULL_COMPLETION;
+static unsigned long nullb_completion_nsec = CONFIG_BLK_NULL_COMPLETION_NSEC;
+static unsigned long nullb_size_mb = CONFIG_BLK_NULL_SIZE_MB;
+
+static int nullb_parse(const char *val, unsigned long *out)
+{
+    char *end;
+
+    if (!val)
+        return 0;
+
+    unsigned long res = strtoul(val, &end, 0);
+    if (*end != '\0')
+    {
+        pr_err("bad parameter value %s\n", val);
+        return 1;
+    }
+
+    *out = res;
+    return 1;
+}
+
+static int nullb_queues_param(const char *val)
+{
+    return nullb_parse(val, &nullb_nr_queues);
+}
+
+static int nullb_depth_param(const char *val)
+{
+    return nullb_parse(val, &nullb_queue_depth);
+}
+
+static int nullb_completion_param(const char *val)
+{
+    if (val && !strcmp(val, "inline"))
+        nullb_completion = NULLB_COMPLETE_INLINE;
+    else if (val && !strcmp(val, "softirq"))
+        nullb_completion = NULLB_COMPLETE_SOFTIRQ;
+    else if (val && !strcmp(val, "timer"))
+        nullb_completion = NULLB_COMPLETE_TIMER;
+    else
+        return nullb_parse(val, &nullb_completion);
+    return 1;
+}
+
+static int nullb_completion_nsec_param(const char *val)
+{
+    return nullb_parse(val, &nullb_completion_nsec);
+}
+
+static int nullb_size_param(const char *val)
+{
+    return nullb_parse(val, &nullb_size_mb);
+}
+
+kernel_param("null_blk.queues", nullb_queues_param);
+kernel_param("null_blk.depth", nullb_depth_param);
+kernel_param("null_blk.completion", nullb_completion_param);
+kernel_param("null_blk.completion_nsec", nullb_completion_nsec_param);
+kernel_param("null_blk.size_mb", nullb_size_param);
+
+struct nullb_pdu
+{
+    /* When the request completes, in timer mode */
+    hrtime_t deadline;
+};
+
+static inline nullb_pdu *request_to_pdu(struct request *req)
+{
+    return (nullb_pdu *) b_request_to_data(req);
+}
+
+class nullb_queue final : public io_queue
+{
+private:
+    /* Requests waiting for their deadline. They all get the same latency, so this is sorted. */
+    struct list_head timer_list_;
+    struct clockevent timer_;
+    bool timer_armed_{false};
+
+    static void timer_fire(struct clockevent *ev);
+
+protected:
+    int device_io_submit(struct request *req) override;
+
+public:
+    nullb_queue(unsigned int depth) : io_queue{depth}
+    {
+        INIT_LIST_HEAD(&timer_list_);
+    }
+};
+
+struct nullb_dev
+{
+    cul::vector<unique_ptr<nullb_queue>> queues;
+    unique_ptr<blockdev> bdev;
+};
+
+static nullb_dev *nullb;
+
+int nullb_queue::device_io_submit(struct request *req)
+{
+    if (nullb_completion != NULLB_COMPLETE_TIMER)
+    {
+        /* Done already. complete_request() punts the rest to the block softirq. */
+        req->r_flags |= BIO_REQ_DONE;
+        complete_request(req);
+        return 0;
+    }
+
+    request_to_pdu(req)->deadline = clocksource_get_time() + nullb_completion_nsec;
+    list_add_tail(&req->r_queue_list_node, &timer_list_);
+
+    if (!timer_armed_)
+    {
+        timer_armed_ = true;
+        timer_.callback = timer_fire;
+        timer_.priv = this;
+        timer_.flags = 0;
+        timer_.deadline = request_to_pdu(req)->deadline;
+        timer_queue_clockevent(&timer_);
+    }
+
+    return 0;
+}
+
+void nullb_queue::timer_fire(struct clockevent *ev)
+{
+    nullb_queue *queue = (nullb_queue *) ev->priv;
+    hrtime_t now = clocksource_get_time();
+    scoped_lock<spinlock, true> g{queue->lock_};
+
+    list_for_every_safe (&queue->timer_list_)
+    {
+        struct request *req = list_head_to_request(l);
+        if (request_to_pdu(req)->deadline > now)
+            break;
+        list_remove(&req->r_queue_list_node);
+        req->r_flags |= BIO_REQ_DONE;
+        queue->complete_request(req);
+    }
+
+    if (list_is_empty(&queue->timer_list_))
+    {
+        queue->timer_armed_ = false;
+        ev->flags &= ~CLOCKEVENT_FLAG_PULSE;
+        return;
+    }
+
+    /* Go again for the next one */
+    ev->deadline = request_to_pdu(list_head_to_request(list_first_element(&queue->timer_list_)))
+                       ->deadline;
+    ev->flags |= CLOCKEVENT_FLAG_PULSE;
+}
+
+static struct io_queue *nullb_pick_queue(struct blockdev *bdev)
+{
+    return nullb->queues[get_cpu_nr() % nullb->queues.size()].get();
+}
+
+static const struct blk_mq_ops nullb_mq_ops = {.pick_queue = nullb_pick_queue};
+
+/**
+ * @brief Submit a bio, in inline completion mode
+ * No requests, no queues, just the bio_req and its completion.
+ *
+ * @param dev Block device
+ * @param bio bio_req to submit
+ * @return 0
+ */
+static int nullb_submit_inline(struct blockdev *dev, struct bio_req *bio)
+{
+    struct blockdev *disk = blkdev_is_partition(dev) ? dev->actual_blockdev : dev;
+    sector_t nsectors = 0;
+
+    for (size_t i = 0; i < bio->nr_vecs; i++)
+        nsectors += bio->vec[i].length / 512;
+
+    hrtime_t start = clocksource_get_time();
+    blk_stats_start(&disk->stats, start);
+    blk_stats_done(&disk->stats, blk_stat_op(bio->flags), nsectors, start, start);
+
+    bio_get(bio);
+    bio_do_complete(bio);
+    return 0;
+}
+
+static int nullb_init()
+{
+    static const char *const modes[] = {"inline", "softirq", "timer"};
+
+    if (nullb_completion > NULLB_COMPLETE_TIMER || !nullb_queue_depth)
+    {
+        pr_err("bad configuration (completion mode %lu, depth %lu)\n", nullb_completion,
+               nullb_queue_depth);
+        return -EINVAL;
+    }
+
+    unsigned int nr_queues = nullb_nr_queues ?: get_nr_cpus();
+
+    nullb = new nullb_dev;
+    if (!nullb)
+        return -ENOMEM;
+
+    auto bdev = make_unique<blockdev>();
+    if (!bdev)
+        return -ENOMEM;
+
+    bdev->name = "nullb0";
+    bdev->partition_prefix = "p";
+    bdev->sector_size = 512;
+    bdev->nr_sectors = nullb_size_mb * (0x100000 / 512);
+
+    if (nullb_completion == NULLB_COMPLETE_INLINE)
+        bdev->submit_request = nullb_submit_inline;
+    else
+    {
+        if (!nullb->queues.reserve(nr_queues))
+            return -ENOMEM;
+
+        for (unsigned int i = 0; i < nr_queues; i++)
+        {
+            auto queue = make_unique<nullb_queue>(nullb_queue_depth);
+            if (!queue || !nullb->queues.push_back(cul::move(queue)))
+                return -ENOMEM;
+        }
+
+        auto &qp = bdev->bdev_queue_properties;
+        qp.request_extra_headroom = sizeof(nullb_pdu);
+        qp.request_cache = kmem_cache_create(
+            "nullb-request-cache", sizeof(struct request) + sizeof(nullb_pdu), 0, 0, nullptr);
+        if (!qp.request_cache)
+            return -ENOMEM;
+
+        bdev->submit_request = blk_mq_submit_request;
+        bdev->mq_ops = &nullb_mq_ops;
+    }
+
+    if (int st = blkdev_init(bdev.get()); st < 0)
+        return st;
+
+    nullb->bdev = cul::move(bdev);
+
+    pr_info("nullb0: %lu MiB, %s completion, %zu queues of depth %lu, %lu ns latency\n",
+            nullb_size_mb, modes[nullb_completion], nullb->queues.size(), nullb_queue_depth,
+            nullb_completion == NULLB_COMPLETE_TIMER ? nullb_completion_nsec : 0);
+    return 0;
+}
+
+DRIVER_INIT(nullb_init);
@@ -0,0 +1,240 @@
+/*
+ * Copyright (c) 2024 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the GPLv2 License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#define pr_fmt(fmt) "ramdisk: " fmt
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <onyx/block.h>
+#include <onyx/clock.h>
+#include <onyx/cmdline.h>
+#include <onyx/driver.h>
+#include <onyx/page.h>
+#include <onyx/radix.h>
+#include <onyx/rwlock.h>
+
+#include <onyx/memory.hpp>
+
+/* ram0: a block device backed by pages. Pages get allocated when first written to, reads of
+ * anything else return zeroes. Being memory, it also supports direct page access. */
+
+static unsigned long ramdisk_size_mb = CONFIG_BLK_RAMDISK_SIZE_MB;
+
+static int ramdisk_size_param(const char *val)
+{
+    char *end;
+
+    if (!val)
+        return 0;
+
+    unsigned long res = strtoul(val, &end, 0);
+    if (*end != '\0')
+    {
+        pr_err("bad parameter value %s\n", val);
+        return 1;
+    }
+
+    ramdisk_size_mb = res;
+    return 1;
+}
+
+kernel_param("ramdisk.size_mb", ramdisk_size_param);
+
+#define RAMDISK_SECTORS_PER_PAGE (PAGE_SIZE / 512)
+
+struct ramdisk
+{
+    /* Page index -> struct page */
+    radix_tree pages;
+    /* Lookups take it for reading, inserting a new page takes it for writing */
+    struct rwlock lock;
+    unique_ptr<blockdev> bdev;
+};
+
+static ramdisk *ram0;
+
+/**
+ * @brief Look up the page at an index
+ *
+ * @param rd Ramdisk
+ * @param index Page index
+ * @param alloc If true, allocate (zeroed) pages that aren't there yet
+ * @return The page, or nullptr if it's not there (and !alloc) or we're out of memory
+ */
+static struct page *ramdisk_get_page(struct ramdisk *rd, unsigned long index, bool alloc)
+{
+    rw_lock_read(&rd->lock);
+    auto ex = rd->pages.get(index);
+    rw_unlock_read(&rd->lock);
+
+    if (ex.has_value())
+        return (struct page *) ex.value();
+
+    if (!alloc)
+        return nullptr;
+
+    struct page *page = alloc_page(GFP_NOIO);
+    if (!page)
+        return nullptr;
+
+    rw_lock_write(&rd->lock);
+
+    /* Someone might have beaten us to it */
+    ex = rd->pages.get(index);
+    if (ex.has_value())
+    {
+        rw_unlock_write(&rd->lock);
+        free_page(page);
+        return (struct page *) ex.value();
+    }
+
+    if (rd->pages.store(index, (rt_entry_t) page) < 0)
+    {
+        free_page(page);
+        page = nullptr;
+    }
+
+    rw_unlock_write(&rd->lock);
+    return page;
+}
+
+/**
+ * @brief Copy a page_iov to or from the disk
+ *
+ * @param rd Ramdisk
+ * @param v page_iov
+ * @param sector Starting sector
+ * @param write True if writing to the disk
+ * @return 0 on success, -ENOMEM
+ */
+static int ramdisk_do_iov(struct ramdisk *rd, const struct page_iov *v, sector_t sector,
+                          bool write)
+{
+    u8 *buf = (u8 *) PAGE_TO_VIRT(v->page) + v->page_off;
+    unsigned int len = v->length;
+
+    while (len)
+    {
+        unsigned int off = (sector % RAMDISK_SECTORS_PER_PAGE) * 512;
+        unsigned int to_copy = cul::min(len, (unsigned int) PAGE_SIZE - off);
+        struct page *page = ramdisk_get_page(rd, sector / RAMDISK_SECTORS_PER_PAGE, write);
+
+        if (write)
+        {
+            if (!page)
+                return -ENOMEM;
+            memcpy((u8 *) PAGE_TO_VIRT(page) + off, buf, to_copy);
+        }
+        else if (page)
+            memcpy(buf, (u8 *) PAGE_TO_VIRT(page) + off, to_copy);
+        else
+            memset(buf, 0, to_copy);
+
+        buf += to_copy;
+        len -= to_copy;
+        sector += to_copy / 512;
+    }
+
+    return 0;
+}
+
+static int ramdisk_submit_request(struct blockdev *dev, struct bio_req *bio)
+{
+    struct blockdev *disk = dev;
+    u8 op = bio->flags & BIO_REQ_OP_MASK;
+
+    if (blkdev_is_partition(dev))
+    {
+        bio->sector_number += dev->offset / dev->sector_size;
+        disk = dev->actual_blockdev;
+    }
+
+    struct ramdisk *rd = (struct ramdisk *) disk->device_info;
+    sector_t nsectors = 0;
+    for (size_t i = 0; i < bio->nr_vecs; i++)
+        nsectors += bio->vec[i].length / 512;
+
+    bio_get(bio);
+
+    if (op != BIO_REQ_READ_OP && op != BIO_REQ_WRITE_OP)
+    {
+        bio->flags |= BIO_REQ_NOT_SUPP;
+        bio_do_complete(bio);
+        return 0;
+    }
+
+    if (bio->sector_number + nsectors > disk->nr_sectors)
+    {
+        bio->flags |= BIO_REQ_EIO;
+        bio_do_complete(bio);
+        return 0;
+    }
+
+    sector_t sector = bio->sector_number;
+    hrtime_t start = clocksource_get_time();
+    blk_stats_start(&disk->stats, start);
+
+    for (size_t i = 0; i < bio->nr_vecs; i++)
+    {
+        if (ramdisk_do_iov(rd, &bio->vec[i], sector, op == BIO_REQ_WRITE_OP) < 0)
+        {
+            bio->flags |= BIO_REQ_EIO;
+            break;
+        }
+
+        sector += bio->vec[i].length / 512;
+    }
+
+    blk_stats_done(&disk->stats, blk_stat_op(bio->flags), sector - bio->sector_number, start,
+                   clocksource_get_time());
+    bio_do_complete(bio);
+    return 0;
+}
+
+static int ramdisk_direct_access(struct blockdev *dev, sector_t sector, struct page **page,
+                                 unsigned int *offset)
+{
+    struct ramdisk *rd = (struct ramdisk *) dev->device_info;
+    struct page *p = ramdisk_get_page(rd, sector / RAMDISK_SECTORS_PER_PAGE, true);
+    if (!p)
+        return -ENOMEM;
+
+    *page = p;
+    *offset = (sector % RAMDISK_SECTORS_PER_PAGE) * 512;
+    return 0;
+}
+
+static int ramdisk_init()
+{
+    ram0 = new ramdisk;
+    if (!ram0)
+        return -ENOMEM;
+
+    auto bdev = make_unique<blockdev>();
+    if (!bdev)
+        return -ENOMEM;
+
+    bdev->name = "ram0";
+    bdev->partition_prefix = "p";
+    bdev->sector_size = 512;
+    bdev->nr_sectors = ramdisk_size_mb * (0x100000 / 512);
+    bdev->submit_request = ramdisk_submit_request;
+    bdev->direct_access = ramdisk_direct_access;
+    bdev->device_info = ram0;
+
+    if (int st = blkdev_init(bdev.get()); st < 0)
+        return st;
+
+    ram0->bdev = cul::move(bdev);
+    pr_info("ram0: %lu MiB\n", ramdisk_size_mb);
+    return 0;
+}
+
+DRIVER_INIT(ramdisk_init);
@@ -56,6 +56,8 @@ private:
         uint32_t sq_head_{0};
         uint16_t index_;
         bool phase{true};
+        /* Created without an interrupt, completions are reaped by poll() */
+        bool polled_{false};
         cul::vector<nvmecmd *> queued_commands_{};
         Bitmap<0> queued_bitmap_;
 
@@ -67,8 +69,10 @@ private:
          * @param index Index of the queue
          * @param sq_size Size of the submission queue
          * @param cq_size Size of the completion queue
+         * @param polled True if the queue has no interrupt
          */
-        nvme_queue(nvme_device *dev, uint16_t index, unsigned int sq_size, unsigned int cq_size);
+        nvme_queue(nvme_device *dev, uint16_t index, unsigned int sq_size, unsigned int cq_size,
+                   bool polled = false);
 
         nvme_queue() : io_queue(0)
         {
@@ -101,6 +105,7 @@ private:
             sq_tail_ = q.sq_tail_;
             index_ = q.index_;
             phase = q.phase;
+            polled_ = q.polled_;
             queued_commands_ = cul::move(q.queued_commands_);
             queued_bitmap_ = cul::move(q.queued_bitmap_);
             return *this;
@@ -125,6 +130,7 @@ private:
             sq_tail_ = q.sq_tail_;
             index_ = q.index_;
             phase = q.phase;
+            polled_ = q.polled_;
             queued_commands_ = cul::move(q.queued_commands_);
             queued_bitmap_ = cul::move(q.queued_bitmap_);
         }
@@ -154,6 +160,16 @@ private:
          */
         bool handle_cq();
 
+        /**
+         * @brief Reap the completion queue, for poll queues
+         *
+         * @return True if anything completed
+         */
+        bool poll_cq() override
+        {
+            return polled_ && handle_cq();
+        }
+
         /**
          * @brief Allocates a CID
          *
@@ -226,6 +242,11 @@ private:
     page *identify_page_;
 
     cul::vector<unique_ptr<nvme_queue>> queues_;
+    /* cpu -> IO queue index (ignoring the admin queue), see init_io_queues */
+    cul::vector<u16> queue_map_;
+    /* IO queues [0, nr_irq_queues_) have interrupts, the nr_poll_queues_ after them don't */
+    uint16_t nr_irq_queues_{0};
+    uint16_t nr_poll_queues_{0};
 
     /**
      * @brief Identify and list namespaces
@@ -275,9 +296,25 @@ private:
      * @brief Create an IO queue
      *
      * @param queue_index The queue's index (ignoring the admin queue)
+     * @param polled Create the queue without an interrupt
      * @return 0 on success, negative error codes
      */
-    int create_io_queue(uint16_t queue_index);
+    int create_io_queue(uint16_t queue_index, bool polled);
+
+    /**
+     * @brief Do a SET_FEATURES command
+     *
+     * @param fid Feature ID
+     * @param cdw11 Feature-specific value
+     * @param result If not nullptr, gets the completion's dword 0
+     * @return 0 on success, negative error codes
+     */
+    int cmd_set_features(uint8_t fid, uint32_t cdw11, uint32_t *result);
+
+    /**
+     * @brief Set up interrupt coalescing for the IO queues
+     */
+    void setup_irq_coalescing();
 
     /**
      * @brief Do a CREATE_IO_SUBMISSION_QUEUE command
@@ -297,11 +334,11 @@ private:
      * @param queue Queue number
      * @param queue_address Queue's address
      * @param queue_size Queue size
-     * @param interrupt_vector Interrupt vector to use for the queue
+     * @param interrupt_vector Interrupt vector to use for the queue, or -1 for no interrupts
      * @return 0 on success, negative error codes
      */
     int cmd_create_io_completion_queue(uint16_t queue, uint64_t queue_address, uint16_t queue_size,
-                                       uint16_t interrupt_vector);
+                                       int interrupt_vector);
 
     /**
      * @brief Setup a PRP for a bio request
@@ -367,6 +404,22 @@ public:
      */
     static struct io_queue *pick_queue(blockdev *bdev);
 
+    /**
+     * @brief Pick a poll queue for a polled request
+     *
+     * @param bdev Block device
+     * @return IO queue, or nullptr if there are no poll queues
+     */
+    static struct io_queue *pick_poll_queue(blockdev *bdev);
+
+    /**
+     * @brief Get the interrupt vector for an IO queue
+     *
+     * @param queue_index The queue's index (ignoring the admin queue)
+     * @return Interrupt vector
+     */
+    uint16_t io_queue_vector(uint16_t queue_index);
+
     static irqstatus_t nvme_irq(struct irq_context *ctx, void *cookie);
 };
 
@@ -695,7 +748,11 @@ static_assert(sizeof(nvme_identify_namespace) == 4096);
 
 #define NVME_LBA_LBASIZE(n) (((n) >> 16) & 0xff)
 
-#define NVME_SET_FEATURES_NUMBER_QUEUES 7
+#define NVME_SET_FEATURES_NUMBER_QUEUES  7
+#define NVME_SET_FEATURES_IRQ_COALESCING 8
+
+/* Interrupt coalescing: aggregation threshold (0's based) and time (100us units) */
+#define NVME_IRQ_COALESCING(thr, time) ((((thr) - 1) & 0xff) | (((time) & 0xff) << 8))
 
 #define NVME_MAX_QUEUES UINT16_MAX
 
@@ -151,7 +151,10 @@ int nvme_device::probe()
         return -EINVAL;
     }
 
-    if (int st = pci_alloc_irqs(dev_, 1, get_nr_cpus(), PCI_IRQ_DEFAULT); st < 0)
+    /* Vector 0 is the admin queue's, the rest get spread over the cpus along with the IO queues */
+    const struct pci_irq_affinity affd = {.pre_vectors = 1};
+    if (int st = pci_alloc_irqs_affinity(dev_, 1, get_nr_cpus() + 1, PCI_IRQ_DEFAULT, &affd);
+        st < 0)
     {
         dev_err(dev_, "Failed to enable IRQs: %d\n", st);
         return st;
@@ -273,7 +276,8 @@ void nvme_device::set_queue_properties(blockdev *bdev)
     qp.request_cache = request_cache;
 }
 
-static const struct blk_mq_ops nvme_mq_ops = {.pick_queue = nvme_device::pick_queue};
+static const struct blk_mq_ops nvme_mq_ops = {.pick_queue = nvme_device::pick_queue,
+                                              .pick_poll_queue = nvme_device::pick_poll_queue};
 
 /**
  * @brief Initialise a new "drive" (namespace)
@@ -445,9 +449,37 @@ int nvme_device::setup_prp(struct request *breq, nvme_namespace *ns)
 struct io_queue *nvme_device::pick_queue(blockdev *bdev)
 {
     nvme_device *dev = ((nvme_namespace *) bdev->device_info)->nvme_dev_;
-    // Primitive algo: Use the cpu nr as an index
-    u16 index = (get_cpu_nr() % (dev->queues_.size() - 1)) + 1;
-    return dev->queues_[index].get();
+    return dev->queues_[dev->queue_map_[get_cpu_nr()] + 1].get();
+}
+
+/**
+ * @brief Pick a poll queue for a polled request
+ *
+ * @param bdev Block device
+ * @return IO queue, or nullptr if there are no poll queues
+ */
+struct io_queue *nvme_device::pick_poll_queue(blockdev *bdev)
+{
+    nvme_device *dev = ((nvme_namespace *) bdev->device_info)->nvme_dev_;
+    if (!dev->nr_poll_queues_)
+        return nullptr;
+    u16 index = dev->nr_irq_queues_ + get_cpu_nr() % dev->nr_poll_queues_;
+    return dev->queues_[index + 1].get();
+}
+
+/**
+ * @brief Get the interrupt vector for an IO queue
+ *
+ * @param queue_index The queue's index (ignoring the admin queue)
+ * @return Interrupt vector
+ */
+uint16_t nvme_device::io_queue_vector(uint16_t queue_index)
+{
+    const int nr_vecs = pci_get_nr_vectors(dev_);
+    // With a single vector, everything shares it with the admin queue
+    if (nr_vecs <= 1)
+        return 0;
+    return (queue_index % (nr_vecs - 1)) + 1;
 }
 
 #define NVME_DEFAULT_SQ_SIZE 128UL
@@ -500,11 +532,11 @@ int nvme_device::cmd_create_io_submission_queue(uint16_t queue, uint64_t queue_a
  * @param queue Queue number
  * @param queue_address Queue's address
  * @param queue_size Queue size
- * @param interrupt_vector Interrupt vector to use for the queue
+ * @param interrupt_vector Interrupt vector to use for the queue, or -1 for no interrupts
  * @return 0 on success, negative error codes
  */
 int nvme_device::cmd_create_io_completion_queue(uint16_t queue, uint64_t queue_address,
-                                                uint16_t queue_size, uint16_t interrupt_vector)
+                                                uint16_t queue_size, int interrupt_vector)
 {
     nvmecmd cmd;
     memset(&cmd, 0, sizeof(cmd));
@@ -513,8 +545,9 @@ int nvme_device::cmd_create_io_completion_queue(uint16_t queue, uint64_t queue_a
     cmd.cmd.nsid = 0;
     cmd.cmd.dptr.prp[0] = queue_address;
     cmd.cmd.cdw10 = (queue_size - 1U) << 16 | queue;
-    cmd.cmd.cdw11 = (unsigned int) interrupt_vector << 16 | NVME_CREATE_IOCQ_IEN |
-                    NVME_CREATE_IOCQ_PHYS_CONTIG; // Set bit0 (physically contiguous)
+    cmd.cmd.cdw11 = NVME_CREATE_IOCQ_PHYS_CONTIG; // Set bit0 (physically contiguous)
+    if (interrupt_vector >= 0)
+        cmd.cmd.cdw11 |= (unsigned int) interrupt_vector << 16 | NVME_CREATE_IOCQ_IEN;
     cmd.cmd.cdw12 = 0;
     cmd.req = nullptr;
 
@@ -539,20 +572,22 @@ int nvme_device::cmd_create_io_completion_queue(uint16_t queue, uint64_t queue_a
  * @brief Create an IO queue
  *
  * @param queue_index The queue's index (ignoring the admin queue)
+ * @param polled Create the queue without an interrupt
  * @return 0 on success, negative error codes
  */
-int nvme_device::create_io_queue(uint16_t queue_index)
+int nvme_device::create_io_queue(uint16_t queue_index, bool polled)
 {
     const auto caps = read_caps();
     bool needs_contiguous = caps & NVME_CAP_CQR;
     const uint16_t sq_size = cul::clamp(NVME_CAP_MQES(caps), NVME_DEFAULT_SQ_SIZE);
     const uint16_t cq_size = cul::clamp(NVME_CAP_MQES(caps), NVME_DEFAULT_CQ_SIZE);
-    auto q = make_unique<nvme_queue>(this, (uint16_t) (queue_index + 1), sq_size, cq_size);
+    auto q =
+        make_unique<nvme_queue>(this, (uint16_t) (queue_index + 1), sq_size, cq_size, polled);
 
     if (!q->init(needs_contiguous))
         return -ENOMEM;
 
-    const uint16_t interrupt_vector = queue_index % pci_get_nr_vectors(dev_);
+    const int interrupt_vector = polled ? -1 : io_queue_vector(queue_index);
     if (int st = cmd_create_io_completion_queue(queue_index + 1,
                                                 (uint64_t) page_to_phys(q->get_cq_pages()),
                                                 q->get_cq_queue_size(), interrupt_vector);
@@ -571,12 +606,15 @@ int nvme_device::create_io_queue(uint16_t queue_index)
         return st;
     }
 
-    if (int st = pci_install_irq(dev_, interrupt_vector, nvme_irq, 0, q.get(), "nvme-cq%hd",
-                                 queue_index);
-        st < 0)
+    if (!polled)
     {
-        dev_err(dev_, "Error: Failed to install irq: %d\n", st);
-        return st;
+        if (int st = pci_install_irq(dev_, interrupt_vector, nvme_irq, 0, q.get(), "nvme-cq%hd",
+                                     queue_index);
+            st < 0)
+        {
+            dev_err(dev_, "Error: Failed to install irq: %d\n", st);
+            return st;
+        }
     }
 
     struct cblk
@@ -600,23 +638,22 @@ int nvme_device::create_io_queue(uint16_t queue_index)
 }
 
 /**
- * @brief Initialise the IO queues
+ * @brief Do a SET_FEATURES command
  *
+ * @param fid Feature ID
+ * @param cdw11 Feature-specific value
+ * @param result If not nullptr, gets the completion's dword 0
  * @return 0 on success, negative error codes
  */
-int nvme_device::init_io_queues()
+int nvme_device::cmd_set_features(uint8_t fid, uint32_t cdw11, uint32_t *result)
 {
-    // Note: We clamp the number of queues to the max NVME queues (UINT16_MAX)
-    const uint16_t desired_nr_queues = cul::clamp(get_nr_cpus(), (unsigned int) NVME_MAX_QUEUES);
-
-    // Do set features to see if we can get the desired number of IO queues
     nvmecmd cmd;
     memset(&cmd, 0, sizeof(cmd));
     cmd.cmd.cdw0.cdw0 =
         NVME_CMD_OPCODE(NVME_ADMIN_OPC_SET_FEATURE) | NVME_CMD_FUSE_NORMAL | NVME_CMD_PSDT_PRP;
     cmd.cmd.nsid = 0;
-    cmd.cmd.cdw10 = NVME_SET_FEATURES_NUMBER_QUEUES;
-    cmd.cmd.cdw11 = (desired_nr_queues << 16) | desired_nr_queues;
+    cmd.cmd.cdw10 = fid;
+    cmd.cmd.cdw11 = cdw11;
     cmd.req = nullptr;
 
     wait_queue wq;
@@ -629,29 +666,91 @@ int nvme_device::init_io_queues()
 
     if (auto status = NVME_CQE_STATUS_CODE(cmd.response.dw3); status != 0)
     {
-        dev_err(dev_, "namespace set features (number of queues): Status error %u\n", status);
+        dev_err(dev_, "set features %u: Status error %u\n", fid, status);
         return -EIO;
     }
 
-    const uint16_t allocated_cq = cmd.response.dw0 >> 16;
-    const uint16_t allocated_sq = (uint16_t) cmd.response.dw0;
+    if (result)
+        *result = cmd.response.dw0;
+    return 0;
+}
+
+/**
+ * @brief Set up interrupt coalescing for the IO queues
+ */
+void nvme_device::setup_irq_coalescing()
+{
+#ifdef CONFIG_NVME_IRQ_COALESCING
+    // The admin queue is never coalesced, and the poll queues have no interrupt to coalesce, so
+    // this only affects the interrupt-driven IO queues. Not fatal if the controller says no.
+    if (cmd_set_features(NVME_SET_FEATURES_IRQ_COALESCING,
+                         NVME_IRQ_COALESCING(CONFIG_NVME_IRQ_COALESCE_THRESHOLD,
+                                             CONFIG_NVME_IRQ_COALESCE_TIME),
+                         nullptr) < 0)
+        dev_warn(dev_, "Failed to set up interrupt coalescing\n");
+#endif
+}
+
+/**
+ * @brief Initialise the IO queues
+ *
+ * @return 0 on success, negative error codes
+ */
+int nvme_device::init_io_queues()
+{
+    // Note: We clamp the number of queues to the max NVME queues (UINT16_MAX)
+    const uint16_t desired_nr_queues =
+        cul::clamp(get_nr_cpus() + CONFIG_NVME_POLL_QUEUES, (unsigned int) NVME_MAX_QUEUES);
+
+    // Do set features to see if we can get the desired number of IO queues. Counts are 0's based.
+    const uint32_t nr_queues_val = desired_nr_queues - 1U;
+    uint32_t result;
+    if (int st = cmd_set_features(NVME_SET_FEATURES_NUMBER_QUEUES,
+                                  (nr_queues_val << 16) | nr_queues_val, &result);
+        st < 0)
+    {
+        dev_err(dev_, "namespace set features (number of queues): error %d\n", st);
+        return st;
+    }
+
+    const uint16_t allocated_cq = (result >> 16) + 1;
+    const uint16_t allocated_sq = (uint16_t) result + 1;
 
     // Note: Due to the current design, we require sq = cq
     // Maybe we should change this
     const uint16_t allocated_queues =
         cul::min(desired_nr_queues, cul::min(allocated_cq, allocated_sq));
 
-    dev_info(dev_, "Allocated %u queues\n", allocated_queues);
+    // Poll queues come out of the top, but we always keep an interrupt-driven queue
+    nr_poll_queues_ =
+        cul::min((unsigned int) CONFIG_NVME_POLL_QUEUES, (unsigned int) allocated_queues - 1);
+    nr_irq_queues_ = allocated_queues - nr_poll_queues_;
+
+    dev_info(dev_, "Allocated %u queues (%u poll queues)\n", allocated_queues, nr_poll_queues_);
 
     for (uint16_t i = 0; i < allocated_queues; i++)
     {
-        if (int st = create_io_queue(i); st < 0)
+        if (int st = create_io_queue(i, i >= nr_irq_queues_); st < 0)
         {
             dev_err(dev_, "create_io_queue: error %d\n", st);
             return st;
         }
     }
 
+    setup_irq_coalescing();
+
+    // Submit on the queue whose completion interrupt lands on our cpu
+    if (!queue_map_.resize(get_nr_cpus()))
+        return -ENOMEM;
+
+    blk_mq_map_queues(
+        queue_map_.begin(), nr_irq_queues_,
+        [](void *ctx, unsigned int queue) -> const struct cpumask * {
+            nvme_device *dev = (nvme_device *) ctx;
+            return pci_irq_get_affinity(dev->dev_, dev->io_queue_vector(queue));
+        },
+        this);
+
     return 0;
 }
 
@@ -747,10 +846,12 @@ int nvme_device::identify_namespaces()
  * @param index Index of the queue
  * @param sq_size Size of the submission queue
  * @param cq_size Size of the completion queue
+ * @param polled True if the queue has no interrupt
  */
 nvme_device::nvme_queue::nvme_queue(nvme_device *dev, uint16_t index, unsigned int sq_size,
-                                    unsigned int cq_size)
-    : io_queue{sq_size - 1}, dev_{dev}, sq_size_{sq_size}, cq_size_{cq_size}, index_{index}
+                                    unsigned int cq_size, bool polled)
+    : io_queue{sq_size - 1}, dev_{dev}, sq_size_{sq_size}, cq_size_{cq_size}, index_{index},
+      polled_{polled}
 {
     const auto caps = dev->read_caps();
     sq_tail_doorbell_ = (volatile uint32_t *) (dev_->regs_.as_ptr() +
@@ -965,6 +1066,8 @@ void nvme_device::nvme_queue::do_complete(struct request *req)
  */
 int nvme_device::nvme_queue::pull_sq()
 {
+    const uint32_t old_tail = sq_tail_;
+
     for (u32 i = used_entries_; i < nr_entries_; i++)
     {
         struct request *req = pull_sqe();
@@ -993,8 +1096,9 @@ int nvme_device::nvme_queue::pull_sq()
         memcpy(&sq_[next_entry], &cmd->cmd, sizeof(nvmesqe));
     }
 
-    /* Queue is full, ring the doorbell */
-    *sq_tail_doorbell_ = sq_tail_;
+    /* Ring the doorbell once for the whole batch */
+    if (sq_tail_ != old_tail)
+        *sq_tail_doorbell_ = sq_tail_;
     return 0;
 }
 
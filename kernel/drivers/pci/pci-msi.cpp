@@ -67,8 +67,98 @@ int pci_device::enable_msi(irq_t handler, void *cookie)
 
 } // namespace pci
 
+/**
+ * @brief Work out where a vector goes
+ *
+ * @param vec Vector
+ * @param nr_vecs Number of vectors
+ * @param affd Spreading parameters, or nullptr for plain round-robin
+ * @param mask Affinity mask (output)
+ * @return IRQ_AFFINITY_* flags for the vector
+ */
+static unsigned int pci_irq_spread(unsigned int vec, unsigned int nr_vecs,
+                                   const struct pci_irq_affinity *affd, struct cpumask *mask)
+{
+    unsigned int nr_cpus = get_nr_cpus();
+
+    if (!affd)
+    {
+        /* We round-robin the irqs between cpus, starting from 0 -> 0, and so on */
+        *mask = cpumask::one(vec % nr_cpus);
+        return 0;
+    }
+
+    if (vec < affd->pre_vectors)
+    {
+        for (unsigned int cpu = 0; cpu < nr_cpus; cpu++)
+            mask->set_cpu(cpu);
+        return 0;
+    }
+
+    /* Give every vector a contiguous range of cpus, so a queue's submitters and its completion
+     * interrupt share caches. With more vectors than cpus, they just wrap around. */
+    unsigned int idx = vec - affd->pre_vectors;
+    unsigned int nr_spread = nr_vecs - affd->pre_vectors;
+    if (nr_spread >= nr_cpus)
+    {
+        *mask = cpumask::one(idx % nr_cpus);
+        return IRQ_AFFINITY_MANAGED;
+    }
+
+    for (unsigned int cpu = idx * nr_cpus / nr_spread; cpu < (idx + 1) * nr_cpus / nr_spread;
+         cpu++)
+        mask->set_cpu(cpu);
+    return IRQ_AFFINITY_MANAGED;
+}
+
+static unsigned int pci_irq_first_cpu(const struct cpumask *mask)
+{
+    unsigned int nr_cpus = get_nr_cpus();
+    for (unsigned int cpu = 0; cpu < nr_cpus; cpu++)
+    {
+        if (mask->is_cpu_set(cpu))
+            return cpu;
+    }
+
+    return 0;
+}
+
+static void pci_msix_write_addr(pci::pci_device *dev, unsigned int vec, struct pci_msi_data *data)
+{
+    mmio_writel((unsigned long) &dev->msix_table[vec].msg_addr, data->address);
+    mmio_writel((unsigned long) &dev->msix_table[vec].msg_upper_addr, data->address_high);
+}
+
+static int pci_msix_set_affinity(unsigned int irq, unsigned int cpu, void *arg)
+{
+    pci::pci_device *dev = (pci::pci_device *) arg;
+    struct pci_msi_data data;
+    unsigned int vec;
+
+    for (vec = 0; vec < dev->nr_msix_vectors; vec++)
+    {
+        if (dev->msix_irqs[vec] == irq)
+            break;
+    }
+
+    if (vec == dev->nr_msix_vectors)
+        return -EINVAL;
+
+    data.data = mmio_readl((unsigned long) &dev->msix_table[vec].msg_data);
+    if (int st = platform_msi_set_target(&data, cpu); st < 0)
+        return st;
+
+    /* The entry must be masked while it's being changed (PCI spec 6.8.2.9) */
+    unsigned long ctl = (unsigned long) &dev->msix_table[vec].msg_vec_ctl;
+    u32 old_ctl = mmio_readl(ctl);
+    mmio_writel(ctl, old_ctl | MSIX_VEC_CTL_MASKED);
+    pci_msix_write_addr(dev, vec, &data);
+    mmio_writel(ctl, old_ctl);
+    return 0;
+}
+
 int pci_enable_msix(pci::pci_device *dev, unsigned int min_vecs, unsigned int max_vecs,
-                    unsigned int flags)
+                    unsigned int flags, const struct pci_irq_affinity *affd)
 {
     size_t off;
     u16 msg_ctrl;
@@ -106,14 +196,17 @@ int pci_enable_msix(pci::pci_device *dev, unsigned int min_vecs, unsigned int ma
 
     struct pci_msi_data data;
 
-    /* We round-robin the irqs between cpus, starting from 0 -> 0, and so on */
     for (unsigned int i = 0; i < max_vecs; i++)
     {
-        if (platform_allocate_msi_interrupts(1, true, &data, 0, i % get_nr_cpus()) < 0)
+        struct cpumask mask;
+        unsigned int aff_flags = pci_irq_spread(i, max_vecs, affd, &mask);
+        unsigned int cpu = pci_irq_first_cpu(&mask);
+
+        if (platform_allocate_msi_interrupts(1, true, &data, 0, cpu) < 0)
             return -EIO;
         dev->msix_irqs[i] = data.irq_offset;
-        mmio_writel((unsigned long) &dev->msix_table[i].msg_addr, data.address);
-        mmio_writel((unsigned long) &dev->msix_table[i].msg_upper_addr, data.address_high);
+        irq_init_affinity(data.irq_offset, &mask, cpu, aff_flags, pci_msix_set_affinity, dev);
+        pci_msix_write_addr(dev, i, &data);
         mmio_writel((unsigned long) &dev->msix_table[i].msg_data, data.data);
         mmio_writel((unsigned long) &dev->msix_table[i].msg_vec_ctl,
                     mmio_readl((unsigned long) &dev->msix_table[i].msg_vec_ctl) &
@@ -146,9 +239,15 @@ static int pci_enable_msi(pci::pci_device *dev, unsigned int min_vecs, unsigned
     num_vecs = cul::min(max_vecs, (unsigned int) num_vecs);
 
     struct pci_msi_data data;
-    if (platform_allocate_msi_interrupts(num_vecs, addr64, &data, 0, get_cpu_nr()) < 0)
+    unsigned int cpu = get_cpu_nr();
+    if (platform_allocate_msi_interrupts(num_vecs, addr64, &data, 0, cpu) < 0)
         return -1;
 
+    /* Every MSI vector shares the same address, so they can't be moved individually */
+    struct cpumask mask = cpumask::one(cpu);
+    for (unsigned int i = 0; i < num_vecs; i++)
+        irq_init_affinity(data.irq_offset + i, &mask, cpu, 0, nullptr, nullptr);
+
     message_control |= ilog2(num_vecs) << 4;
     message_control |= PCI_MSI_MSGCTRL_ENABLE;
     u32 message_addr = data.address;
@@ -171,11 +270,29 @@ static int pci_enable_msi(pci::pci_device *dev, unsigned int min_vecs, unsigned
 
 int pci_alloc_irqs(pci::pci_device *dev, unsigned int min_vecs, unsigned int max_vecs,
                    unsigned int flags)
+{
+    return pci_alloc_irqs_affinity(dev, min_vecs, max_vecs, flags, nullptr);
+}
+
+/**
+ * @brief Allocate IRQ vectors, spreading them over the cpus
+ * Only MSI-X can target vectors individually. MSI and INTx fallbacks get a single target, like
+ * pci_alloc_irqs.
+ *
+ * @param dev PCI device
+ * @param min_vecs Minimum number of vectors
+ * @param max_vecs Maximum number of vectors
+ * @param flags PCI_IRQ_* flags
+ * @param affd How to spread the vectors
+ * @return 0 on success, negative error code
+ */
+int pci_alloc_irqs_affinity(pci::pci_device *dev, unsigned int min_vecs, unsigned int max_vecs,
+                            unsigned int flags, const struct pci_irq_affinity *affd)
 {
     int st = 0;
     if (flags & PCI_IRQ_MSIX)
     {
-        st = pci_enable_msix(dev, min_vecs, max_vecs, flags);
+        st = pci_enable_msix(dev, min_vecs, max_vecs, flags, affd);
         if (!st)
             return st;
     }
@@ -243,3 +360,18 @@ int pci_get_nr_vectors(pci::pci_device *dev)
         return -EIO;
     return 1;
 }
+
+/**
+ * @brief Get the cpus a vector is delivered to
+ *
+ * @param dev PCI device
+ * @param vec Vector (device-relative)
+ * @return The vector's affinity, or nullptr if unknown
+ */
+const struct cpumask *pci_irq_get_affinity(pci::pci_device *dev, unsigned int vec)
+{
+    int irq = pci_get_irq(dev, vec);
+    if (irq < 0)
+        return nullptr;
+    return irq_get_affinity(irq);
+}
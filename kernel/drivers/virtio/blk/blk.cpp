@@ -8,8 +8,13 @@
 
 #include "blk.hpp"
 
+#include <onyx/block/multiqueue.h>
+#include <onyx/block/request.h>
+#include <onyx/cpu.h>
 #include <onyx/id.h>
 #include <onyx/log.h>
+#include <onyx/mm/slab.h>
+#include <onyx/new.h>
 
 namespace virtio
 {
@@ -17,7 +22,8 @@ namespace virtio
 static blk_features supported_features[] = {blk_features::size_max, blk_features::seg_max,
                                             blk_features::geometry, blk_features::ro,
                                             blk_features::blk_size, blk_features::topology,
-                                            blk_features::discard,  blk_features::write_zeroes};
+                                            blk_features::discard,  blk_features::write_zeroes,
+                                            blk_features::mq,       blk_features::flush};
 
 static uint32_t bio_req_to_virtio_blk_type(uint8_t op)
 {
@@ -28,104 +34,216 @@ static uint32_t bio_req_to_virtio_blk_type(uint8_t op)
         return VIRTIO_BLK_T_IN;
     case BIO_REQ_WRITE_OP:
         return VIRTIO_BLK_T_OUT;
+    case BIO_REQ_FLUSH_OP:
+        return VIRTIO_BLK_T_FLUSH;
     default:
         return (uint32_t) -1;
     }
 }
 
-int blk_vdev::submit_request(struct bio_req *req)
+struct virtio_blk_pdu : public virtio_completion
 {
-    uint8_t op = req->flags & BIO_REQ_OP_MASK;
+    struct request *req;
+    struct page *meta;
+    /* Where fill_function is at in the request's bios */
+    struct bio_req *bio;
+    size_t vec;
 
-    // We allocate a meta page that will hold the header and status
+    void wake() override
+    {
+        static_cast<virtio_blk_queue *>(req->r_queue)->complete(req);
+    }
+};
+
+static inline virtio_blk_pdu *request_to_pdu(struct request *req)
+{
+    return (virtio_blk_pdu *) b_request_to_data(req);
+}
+
+static virtio_desc_info virtio_blk_fill(size_t vec_nr, virtio_allocation_info &context)
+{
+    page_iov v;
+    auto pdu = (virtio_blk_pdu *) context.context;
+    virtio_blk_request *req = (virtio_blk_request *) PAGE_TO_VIRT(pdu->meta);
+    bool write = req->type == VIRTIO_BLK_T_IN;
+
+    if (vec_nr == 0)
+    {
+        // First descriptor
+        v.length = sizeof(virtio_blk_request);
+        v.page_off = 0;
+        v.page = pdu->meta;
+        write = false;
+    }
+    else if (vec_nr == (context.nr_vecs - 1))
+    {
+        // Last descriptor
+        v.length = sizeof(virtio_blk_tail);
+        v.page = pdu->meta;
+        v.page_off = sizeof(virtio_blk_request);
+        write = true;
+    }
+    else
+    {
+        // We're called in order, so just walk the request's bios
+        v = pdu->bio->vec[pdu->vec++];
+        if (pdu->vec == pdu->bio->nr_vecs)
+        {
+            pdu->bio = container_of(pdu->bio->list_node.next, struct bio_req, list_node);
+            pdu->vec = 0;
+        }
+    }
+
+    uint32_t alloc_flags = write ? VIRTIO_ALLOCATION_FLAG_WRITE : 0;
+
+    return {v, alloc_flags};
+}
+
+/**
+ * @brief Add a request to the virtqueue, without notifying the device
+ * Must be called with the queue's lock held. Requests the device can't do are completed right
+ * away, with BIO_REQ_NOT_SUPP.
+ *
+ * @param req Request
+ * @return 0 on success, -EAGAIN if the virtqueue is out of descriptors, negative error codes
+ */
+int virtio_blk_queue::queue_request(struct request *req)
+{
+    virtio_blk_pdu *pdu = new (request_to_pdu(req)) virtio_blk_pdu;
+    pdu->req = req;
+    pdu->meta = nullptr;
+
+    uint32_t type = bio_req_to_virtio_blk_type(req->r_flags & BIO_REQ_OP_MASK);
+    if (type == (uint32_t) -1)
+    {
+        req->r_flags |= BIO_REQ_NOT_SUPP;
+        complete_request(req);
+        return 0;
+    }
+
+    // We allocate a meta page that will hold the header, status and indirect table
     // Yes, it's a bit wasteful, but much faster than walking page tables for stack
     // variables' physical addresses
     struct page *meta_page = alloc_page(PAGE_ALLOC_NO_ZERO);
     if (!meta_page)
+    {
+        pdu->~virtio_blk_pdu();
         return -ENOMEM;
+    }
 
     virtio_blk_request *breq = (virtio_blk_request *) PAGE_TO_VIRT(meta_page);
     virtio_blk_tail *btail = (virtio_blk_tail *) (breq + 1);
 
-    breq->type = bio_req_to_virtio_blk_type(op);
+    breq->type = type;
+    breq->sector = req->r_sector;
+    breq->reserved = 0;
+    btail->status = 0;
 
-    if (breq->type == (uint32_t) -1)
+    pdu->meta = meta_page;
+    pdu->bio = container_of(list_first_element(&req->r_bio_list), struct bio_req, list_node);
+    pdu->vec = 0;
+
+    virtio_allocation_info alloc_info;
+    alloc_info.nr_vecs = req->r_nr_sgls + 2;
+    alloc_info.context = pdu;
+    alloc_info.fill_function = virtio_blk_fill;
+    alloc_info.completion = pdu;
+    alloc_info.indirect_table =
+        (virtq_desc *) ((u8 *) PAGE_TO_VIRT(meta_page) + VIRTIO_BLK_META_INDIRECT_OFF);
+    alloc_info.indirect_paddr =
+        (unsigned long) page_to_phys(meta_page) + VIRTIO_BLK_META_INDIRECT_OFF;
+
+    if (!vq_->try_allocate_descriptors(alloc_info))
     {
+        pdu->~virtio_blk_pdu();
         free_page(meta_page);
-        return -EIO;
+        return -EAGAIN;
     }
 
-    breq->sector = req->sector_number;
-    breq->reserved = 0;
-    btail->status = 0;
+    vq_->put_buffer(alloc_info, false);
+    return 0;
+}
 
-    const auto &requestq = get_vq(0);
+int virtio_blk_queue::device_io_submit(struct request *req)
+{
+    int st = queue_request(req);
+    if (st == -EAGAIN)
+    {
+        /* No descriptors left. Someone's holding them, and their completion restarts us. */
+        list_add(&req->r_queue_list_node, &req_list_);
+        used_entries_--;
+        return 0;
+    }
 
-    virtio_allocation_info alloc_info;
-    virtio_completion completion;
+    if (st < 0)
+        return st;
+
+    vq_->notify();
+    return 0;
+}
 
-    alloc_info.nr_vecs = req->nr_vecs + 2;
-    alloc_info.vec = req->vec;
-    alloc_info.context = meta_page;
-    alloc_info.alloc_flags = VIRTIO_ALLOCATION_FLAG_WRITE;
+/**
+ * @brief Restart the submission queue by "pulling"
+ *
+ * @return Error code
+ */
+int virtio_blk_queue::pull_sq()
+{
+    bool queued = false;
 
-    alloc_info.fill_function = [](size_t vec_nr,
-                                  virtio_allocation_info &context) -> virtio_desc_info {
-        page_iov v;
-        auto meta_page = (page *) context.context;
-        virtio_blk_request *req = (virtio_blk_request *) PAGE_TO_VIRT(meta_page);
-        bool write = req->type == VIRTIO_BLK_T_IN;
+    for (u32 i = used_entries_; i < nr_entries_; i++)
+    {
+        struct request *req = pull_sqe();
+        if (!req)
+            break;
 
-        if (vec_nr == 0)
-        {
-            // First descriptor
-            v.length = sizeof(virtio_blk_request);
-            v.page_off = 0;
-            v.page = meta_page;
-            write = false;
-        }
-        else if (vec_nr == (context.nr_vecs - 1))
+        if (int st = queue_request(req); st < 0)
         {
-            // Last descriptor
-            v.length = sizeof(virtio_blk_tail);
-            v.page = meta_page;
-            v.page_off = sizeof(virtio_blk_request);
-            write = true;
+            if (st != -EAGAIN)
+                MPRINTF("blk: failed to queue request: %d\n", st);
+            unpull_seq(req);
+            break;
         }
-        else
-        {
-            v = *(context.vec + vec_nr - 1);
-        }
-
-        uint32_t alloc_flags = write ? VIRTIO_ALLOCATION_FLAG_WRITE : 0;
-
-        return {v, alloc_flags};
-    };
-
-    alloc_info.completion = &completion;
 
-    requestq->allocate_descriptors(alloc_info, false);
+        queued = true;
+    }
 
-    requestq->put_buffer(alloc_info, true);
+    /* Kick the device once for the whole batch */
+    if (queued)
+        vq_->notify();
+    return 0;
+}
 
-    completion.wait();
+void virtio_blk_queue::complete(struct request *req)
+{
+    virtio_blk_pdu *pdu = request_to_pdu(req);
+    virtio_blk_tail *btail =
+        (virtio_blk_tail *) ((virtio_blk_request *) PAGE_TO_VIRT(pdu->meta) + 1);
 
     if (btail->status == VIRTIO_BLK_S_OK)
-    {
-        req->flags |= BIO_REQ_DONE;
-    }
+        req->r_flags |= BIO_REQ_DONE;
     else if (btail->status == VIRTIO_BLK_S_UNSUPP)
-    {
-        req->flags |= BIO_REQ_NOT_SUPP;
-    }
-    else if (btail->status == VIRTIO_BLK_S_IOERR)
-    {
-        req->flags |= BIO_REQ_EIO;
-    }
+        req->r_flags |= BIO_REQ_NOT_SUPP;
+    else
+        req->r_flags |= BIO_REQ_EIO;
 
-    free_page(meta_page);
+    scoped_lock<spinlock, true> g{lock_};
+    complete_request(req);
+}
 
-    return 0;
+/**
+ * @brief Complete a request
+ * Called from softirq context. Frees the meta page.
+ *
+ * @param req Request to complete
+ */
+void virtio_blk_queue::do_complete(struct request *req)
+{
+    virtio_blk_pdu *pdu = request_to_pdu(req);
+    if (pdu->meta)
+        free_page(pdu->meta);
+    pdu->~virtio_blk_pdu();
+    block_request_complete(req);
 }
 
 void blk_vdev::handle_used_buffer(const virtq_used_elem &elem, virtq *vq)
@@ -136,18 +254,63 @@ void blk_vdev::handle_used_buffer(const virtq_used_elem &elem, virtq *vq)
     completion->wake();
 }
 
-namespace blk
+/**
+ * @brief Pick an IO queue for a request
+ *
+ * @param bdev Block device
+ * @return IO queue
+ */
+struct io_queue *blk_vdev::pick_queue(struct blockdev *bdev)
 {
+    blk_vdev *dev = (blk_vdev *) bdev->device_info;
+    return dev->queues_[get_cpu_nr() % dev->queues_.size()].get();
+}
+
+static const struct blk_mq_ops virtio_blk_mq_ops = {.pick_queue = blk_vdev::pick_queue};
 
-int blk_submit_request(struct blockdev *dev, struct bio_req *req)
+/**
+ * @brief Get the number of request queues to use
+ * One per cpu, if the device has that many.
+ *
+ * @return Number of queues
+ */
+unsigned int blk_vdev::get_nr_queues()
 {
-    auto blkdev = reinterpret_cast<virtio::blk_vdev *>(dev->device_info);
+    if (!has_feature(static_cast<unsigned long>(blk_features::mq)))
+        return 1;
 
-    req->sector_number += dev->offset / 512;
-    return blkdev->submit_request(req);
+    unsigned int nr = read<uint16_t>(static_cast<unsigned long>(blk_registers::num_queues));
+    return nr ? cul::min(nr, get_nr_cpus()) : 1;
 }
 
-} // namespace blk
+void blk_vdev::set_queue_properties(blockdev *bdev)
+{
+    auto &qp = bdev->bdev_queue_properties;
+    unsigned long max_sgls;
+
+    /* With indirect descriptors, a request takes a single descriptor and the meta page's table
+     * limits its size. Without, it needs to fit in the ring by itself. */
+    if (has_feature(device_features::ring_indirect_desc))
+        max_sgls = VIRTIO_BLK_MAX_INDIRECT - 2;
+    else
+        max_sgls = get_vq(0)->get_queue_size() - 2;
+
+    if (seg_max)
+        max_sgls = cul::min(max_sgls, seg_max);
+
+    qp.max_sgls_per_request = max_sgls;
+    qp.max_sgl_desc_length = size_max ? cul::min(size_max, (size_t) PAGE_SIZE) : PAGE_SIZE;
+    qp.request_extra_headroom = sizeof(virtio_blk_pdu);
+    /* Without VIRTIO_BLK_F_FLUSH, the device is write-through */
+    qp.volatile_write_cache = has_feature(static_cast<unsigned long>(blk_features::flush));
+
+    static slab_cache *request_cache =
+        kmem_cache_create("virtio-blk-request-cache",
+                          sizeof(struct request) + sizeof(virtio_blk_pdu), 0, 0, nullptr);
+    CHECK(request_cache != nullptr);
+
+    qp.request_cache = request_cache;
+}
 
 bool blk_vdev::perform_subsystem_initialization()
 {
@@ -163,13 +326,36 @@ bool blk_vdev::perform_subsystem_initialization()
         return false;
     }
 
-    // Create the requestq queue
-    if (!create_virtqueue(0, get_max_virtq_size(0)))
+    if (has_feature(static_cast<unsigned long>(blk_features::seg_max)))
+        seg_max = read<uint32_t>(static_cast<unsigned long>(blk_registers::seg_max));
+    if (has_feature(static_cast<unsigned long>(blk_features::size_max)))
+        size_max = read<uint32_t>(static_cast<unsigned long>(blk_registers::size_max));
+
+    // Create the request queues, one per cpu if we can
+    unsigned int nr_queues = get_nr_queues();
+
+    if (!queues_.reserve(nr_queues))
     {
         set_failure();
         return false;
     }
 
+    for (unsigned int i = 0; i < nr_queues; i++)
+    {
+        if (!create_virtqueue(i, get_max_virtq_size(i)))
+        {
+            set_failure();
+            return false;
+        }
+
+        auto queue = make_unique<virtio_blk_queue>(this, get_vq(i).get());
+        if (!queue || !queues_.push_back(cul::move(queue)))
+        {
+            set_failure();
+            return false;
+        }
+    }
+
     finalise_driver_init();
 
     auto dev = blkdev_create_scsi_like_dev();
@@ -177,8 +363,11 @@ bool blk_vdev::perform_subsystem_initialization()
     if (!dev)
         return false;
 
-    dev->submit_request = blk::blk_submit_request;
+    dev->device_info = this;
+    dev->submit_request = blk_mq_submit_request;
+    dev->mq_ops = &virtio_blk_mq_ops;
     dev->sector_size = 512;
+    set_queue_properties(dev.get());
 
     if (blkdev_init(dev.get()) < 0)
         return false;
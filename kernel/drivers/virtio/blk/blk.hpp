@@ -10,6 +10,7 @@
 #include <stdint.h>
 
 #include <onyx/block.h>
+#include <onyx/block/io-queue.h>
 
 #include "../virtio.hpp"
 #include <onyx/memory.hpp>
@@ -33,6 +34,7 @@ enum class blk_registers
     topo_opt_io_size = 28,
     writeback = 32,
     unused0 = 33,
+    num_queues = 34,
     max_discard_sectors = 36,
     max_discard_seg = 40,
     discard_sector_alignment = 44,
@@ -52,16 +54,57 @@ enum class blk_features
     flush = 9,
     topology = 10,
     wce = 11,
-    discard = 12,
+    mq = 12,
+    discard = 13,
     write_zeroes = 14
 };
 
+class blk_vdev;
+
+/**
+ * @brief A virtio-blk request queue, as a blk-mq hardware queue
+ * Requests are added to the virtqueue and the device is kicked once per batch, so a plug's worth
+ * of requests costs a single notification.
+ */
+class virtio_blk_queue final : public io_queue
+{
+private:
+    blk_vdev *dev_;
+    virtq *vq_;
+
+    int queue_request(struct request *req);
+
+protected:
+    int device_io_submit(struct request *req) override;
+
+public:
+    virtio_blk_queue(blk_vdev *dev, virtq *vq)
+        : io_queue{vq->get_queue_size()}, dev_{dev}, vq_{vq}
+    {
+    }
+
+    int pull_sq() override;
+    void do_complete(struct request *req) override;
+
+    /**
+     * @brief Complete a request the device is done with
+     * Called from the virtqueue's IRQ handler.
+     *
+     * @param req Request
+     */
+    void complete(struct request *req);
+};
+
 class blk_vdev : public vdev
 {
 private:
     size_t block_size;
     size_t disk_size;
     size_t size_max, seg_max;
+    cul::vector<unique_ptr<virtio_blk_queue>> queues_;
+
+    unsigned int get_nr_queues();
+    void set_queue_properties(blockdev *bdev);
 
 public:
     blk_vdev(pci::pci_device *d) : vdev(d), block_size{512}, disk_size{}, size_max{0}, seg_max{0}
@@ -72,7 +115,8 @@ public:
     bool perform_subsystem_initialization() override;
 
     void handle_used_buffer(const virtq_used_elem &elem, virtq *vq) override;
-    int submit_request(struct bio_req *req);
+
+    static struct io_queue *pick_queue(struct blockdev *bdev);
 };
 
 struct virtio_blk_request
@@ -97,6 +141,12 @@ struct virtio_blk_tail
 #define VIRTIO_BLK_S_IOERR  1
 #define VIRTIO_BLK_S_UNSUPP 2
 
+/* Every request gets a meta page, with the header, the status byte and then the indirect
+ * descriptor table (when the device supports those) */
+#define VIRTIO_BLK_META_INDIRECT_OFF 64
+#define VIRTIO_BLK_MAX_INDIRECT \
+    ((PAGE_SIZE - VIRTIO_BLK_META_INDIRECT_OFF) / sizeof(virtq_desc))
+
 } // namespace virtio
 
 #endif
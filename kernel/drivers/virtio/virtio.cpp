@@ -9,6 +9,7 @@
 #include <stdio.h>
 
 #include <onyx/acpi.h>
+#include <onyx/atomic.h>
 #include <onyx/byteswap.h>
 #include <onyx/compiler.h>
 #include <onyx/cpu.h>
@@ -250,17 +251,23 @@ bool vdev::do_device_independent_negotiation()
         signal_feature(device_features::ring_indirect_desc);
     }
 
+    if (raw_has_feature(device_features::ring_event_idx))
+    {
+        signal_feature(device_features::ring_event_idx);
+    }
+
     return true;
 }
 
 bool virtq_split::init()
 {
     /* Described in section 2.6 - keep in mind that we align the
-     * previous virtq segment's size to the next segment's alignment(also described in 2.6)
+     * previous virtq segment's size to the next segment's alignment(also described in 2.6).
+     * The rings always have room for used_event/avail_event, whether we use them or not.
      */
     size_t descriptor_table_length = ALIGN_TO(queue_size * sizeof(virtq_desc), 2);
-    size_t avail_ring_length = ALIGN_TO(queue_size * sizeof(uint16_t) + 4, 4);
-    size_t used_ring_length = queue_size * sizeof(virtq_used_elem) + sizeof(uint16_t) * 2;
+    size_t avail_ring_length = ALIGN_TO(queue_size * sizeof(uint16_t) + 6, 4);
+    size_t used_ring_length = queue_size * sizeof(virtq_used_elem) + sizeof(uint16_t) * 3;
     size_t total_pages =
         vm_size_to_pages(descriptor_table_length + avail_ring_length + used_ring_length);
 
@@ -307,6 +314,9 @@ bool virtq_split::init()
     avail = reinterpret_cast<virtq_avail *>(PHYS_TO_VIRT(_avail));
     used = reinterpret_cast<virtq_used *>(PHYS_TO_VIRT(_used));
 
+    event_idx = device->has_feature(device_features::ring_event_idx);
+    indirect_desc = device->has_feature(device_features::ring_indirect_desc);
+
     return true;
 }
 
@@ -322,7 +332,7 @@ void virtq::allocate_descriptors(virtio_allocation_info &info, bool irq_context)
     auto flags = irq_save_and_disable();
     spin_lock(&desc_alloc_lock);
 
-    auto nr_descs = info.nr_vecs;
+    auto nr_descs = descs_needed(info);
 
     if (!irq_context)
     {
@@ -342,6 +352,17 @@ void virtq::allocate_descriptors(virtio_allocation_info &info, bool irq_context)
     irq_restore(flags);
 }
 
+bool virtq::try_allocate_descriptors(virtio_allocation_info &info)
+{
+    scoped_lock<spinlock, true> g{desc_alloc_lock};
+
+    if (!has_available_descriptors(descs_needed(info)))
+        return false;
+
+    allocate_buffer_list(info);
+    return true;
+}
+
 unsigned int virtq::alloc_descriptor_internal()
 {
     unsigned long desc;
@@ -351,32 +372,70 @@ unsigned int virtq::alloc_descriptor_internal()
     return (unsigned int) desc;
 }
 
+static virtio_desc_info virtq_get_desc_info(virtio_allocation_info &info, size_t i)
+{
+    if (info.fill_function)
+        return info.fill_function(i, info);
+
+    return {info.vec[i], info.alloc_flags};
+}
+
+/**
+ * @brief Fill an indirect descriptor table and point a single ring descriptor at it
+ *
+ * @param info Allocation info
+ */
+void virtq_split::allocate_indirect(virtio_allocation_info &info)
+{
+    uint16_t index = alloc_descriptor_internal();
+
+    for (size_t i = 0; i < info.nr_vecs; i++)
+    {
+        virtio_desc_info dinfo = virtq_get_desc_info(info, i);
+        virtq_desc *desc = info.indirect_table + i;
+        bool has_next_desc = i + 1 != info.nr_vecs;
+
+        desc->paddr = (unsigned long) page_to_phys(dinfo.v.page) + dinfo.v.page_off;
+        desc->length = dinfo.v.length;
+        desc->flags = (has_next_desc ? VIRTQ_DESC_F_NEXT : 0) |
+                      (dinfo.flags & VIRTIO_ALLOCATION_FLAG_WRITE ? VIRTQ_DESC_F_WRITE : 0);
+        desc->next = has_next_desc ? i + 1 : 0;
+    }
+
+    virtq_desc *desc = descs + index;
+    desc->paddr = info.indirect_paddr;
+    desc->length = info.nr_vecs * sizeof(virtq_desc);
+    desc->flags = VIRTQ_DESC_F_INDIRECT;
+    desc->next = 0;
+
+    completions[index] = info.completion;
+    info.first_desc = index;
+    if (info.completion)
+        info.completion->descs_pending = 1;
+}
+
 void virtq_split::allocate_buffer_list(virtio_allocation_info &info)
 {
     MUST_HOLD_LOCK(&desc_alloc_lock);
+
+    if (use_indirect(info))
+    {
+        allocate_indirect(info);
+        return;
+    }
+
     uint16_t desc_head = 0;
     uint16_t seq = 0;
     uint16_t index = alloc_descriptor_internal();
-    auto vec = info.vec;
 
-    for (size_t i = 0; i < info.nr_vecs; i++, vec++)
+    for (size_t i = 0; i < info.nr_vecs; i++)
     {
         if (seq++ == 0)
         {
             desc_head = index;
         }
 
-        virtio_desc_info dinfo;
-
-        if (info.fill_function)
-        {
-            dinfo = info.fill_function(i, info);
-        }
-        else
-        {
-            dinfo.v = *vec;
-            dinfo.flags = info.alloc_flags;
-        }
+        virtio_desc_info dinfo = virtq_get_desc_info(info, i);
 
         auto v = &dinfo.v;
 
@@ -432,6 +491,22 @@ void virtq::resubmit_buffer(uint32_t desc, bool should_notify)
 
 void virtq_split::notify()
 {
+    /* The new avail->idx must be visible before we look at whether the device wants a kick,
+     * or we might race with it going to sleep. */
+    smp_mb();
+
+    uint16_t new_idx = avail->idx;
+    uint16_t old_idx = last_notify_idx;
+    last_notify_idx = new_idx;
+
+    if (event_idx)
+    {
+        if (!virtq_need_event(*avail_event(), new_idx, old_idx))
+            return;
+    }
+    else if (used->flags & VIRTQ_USED_F_NO_NOTIFY)
+        return;
+
     device->notify_cfg().write<uint32_t>(eff_queue_notify_off, nr);
 }
 
@@ -466,29 +541,54 @@ void virtq_split::free_chain(uint32_t id)
 
 void virtq_split::handle_irq()
 {
-    while (used->idx != last_seen_used_idx)
+    for (;;)
     {
-        auto &elem = used->ring[last_seen_used_idx % this->queue_size];
-
-        device->handle_used_buffer(elem, this);
+        while (used->idx != (uint16_t) last_seen_used_idx)
         {
-            scoped_lock<spinlock, true> g{desc_alloc_lock};
-            reset_completion(elem.id);
-            free_chain(elem.id);
+            auto &elem = used->ring[last_seen_used_idx % this->queue_size];
+
+            device->handle_used_buffer(elem, this);
+            {
+                scoped_lock<spinlock, true> g{desc_alloc_lock};
+                reset_completion(elem.id);
+                free_chain(elem.id);
+            }
+
+            last_seen_used_idx++;
         }
 
-        last_seen_used_idx++;
+        if (!event_idx || irqs_disabled)
+            break;
+
+        /* Ask for an interrupt on the next used buffer, then look again in case the device
+         * slipped one in before it saw the new used_event. */
+        *used_event() = last_seen_used_idx;
+        smp_mb();
+
+        if (used->idx == (uint16_t) last_seen_used_idx)
+            break;
     }
 }
 
 void virtq_split::disable_interrupts()
 {
-    avail->flags |= VIRTQ_AVAIL_F_NO_INTERRUPT;
+    irqs_disabled = true;
+    /* With VIRTIO_F_EVENT_IDX, the flag is ignored. Not moving used_event along is enough, the
+     * device won't cross it again until the ring wraps. */
+    if (!event_idx)
+        avail->flags |= VIRTQ_AVAIL_F_NO_INTERRUPT;
 }
 
 void virtq_split::enable_interrupts()
 {
-    avail->flags &= ~VIRTQ_AVAIL_F_NO_INTERRUPT;
+    irqs_disabled = false;
+    if (event_idx)
+    {
+        *used_event() = last_seen_used_idx;
+        smp_mb();
+    }
+    else
+        avail->flags &= ~VIRTQ_AVAIL_F_NO_INTERRUPT;
 }
 
 void vdev::handle_vq_irq()
@@ -69,6 +69,8 @@ struct virtq_desc
 };
 
 #define VIRTQ_AVAIL_F_NO_INTERRUPT (1 << 0)
+#define VIRTQ_USED_F_NO_NOTIFY     (1 << 0)
+
 struct virtq_avail
 {
     uint16_t flags;
@@ -89,8 +91,22 @@ struct virtq_used
     uint16_t flags;
     uint16_t idx;
     struct virtq_used_elem ring[];
+    /* At the end there's a uint16_t avail_event if VIRTIO_F_EVENT_IDX */
 };
 
+/**
+ * @brief Check if the other side asked to be notified (2.7.10)
+ *
+ * @param event_idx The other side's event index (used_event or avail_event)
+ * @param new_idx Our ring index, after the update
+ * @param old_idx Our ring index, as it was when we last notified
+ * @return True if event_idx lies in [old_idx, new_idx)
+ */
+static inline bool virtq_need_event(uint16_t event_idx, uint16_t new_idx, uint16_t old_idx)
+{
+    return (uint16_t) (new_idx - event_idx - 1) < (uint16_t) (new_idx - old_idx);
+}
+
 #pragma GCC diagnostic pop
 
 class vdev;
@@ -150,8 +166,15 @@ struct virtio_allocation_info
 
     virtio_completion *completion;
 
+    // Optional: a table of at least nr_vecs descriptors, for the queue to place the buffer list in
+    // as an indirect descriptor (if the device supports those). The chain then takes up a single
+    // descriptor in the ring.
+    struct virtq_desc *indirect_table;
+    unsigned long indirect_paddr;
+
     constexpr virtio_allocation_info()
-        : vec{}, nr_vecs{}, alloc_flags{}, first_desc{}, fill_function{}, context{}, completion{}
+        : vec{}, nr_vecs{}, alloc_flags{}, first_desc{}, fill_function{}, context{}, completion{},
+          indirect_table{}, indirect_paddr{}
     {
     }
 };
@@ -173,9 +196,29 @@ protected:
     bool has_available_descriptors(size_t nr) const;
     unsigned int alloc_descriptor_internal();
 
+    /**
+     * @brief Get the number of ring descriptors an allocation is going to take up
+     *
+     * @param info Allocation info
+     * @return Number of descriptors
+     */
+    virtual size_t descs_needed(const virtio_allocation_info &info) const
+    {
+        return info.nr_vecs;
+    }
+
 public:
     void allocate_descriptors(virtio_allocation_info &info, bool irq_context);
 
+    /**
+     * @brief Allocate descriptors, if there are enough available
+     * Unlike allocate_descriptors, this never waits.
+     *
+     * @param info Allocation info [in and out parameter]
+     * @return True if the descriptors were allocated, else false
+     */
+    bool try_allocate_descriptors(virtio_allocation_info &info);
+
     virtual unsigned int get_queue_size() = 0;
     virtq(vdev *dev, unsigned int nr)
         : device{dev}, nr{nr}, desc_bitmap{}, avail_descs(), desc_alloc_lock{}
@@ -246,8 +289,35 @@ private:
     unsigned long eff_queue_notify_off;
     /* The driver keeps track of the last used_idx in order to track progress for used buffers */
     unsigned int last_seen_used_idx;
+    /* avail->idx as of the last notification, for VIRTIO_F_EVENT_IDX */
+    uint16_t last_notify_idx;
+    bool event_idx;
+    bool indirect_desc;
+    bool irqs_disabled;
 
     void free_chain(uint32_t id);
+    void allocate_indirect(virtio_allocation_info &info);
+
+    /* used_event lives right after the avail ring, avail_event right after the used ring */
+    volatile uint16_t *used_event()
+    {
+        return &avail->ring[queue_size];
+    }
+
+    volatile uint16_t *avail_event()
+    {
+        return (volatile uint16_t *) &used->ring[queue_size];
+    }
+
+    bool use_indirect(const virtio_allocation_info &info) const
+    {
+        return indirect_desc && info.indirect_table && info.nr_vecs > 1;
+    }
+
+    size_t descs_needed(const virtio_allocation_info &info) const override
+    {
+        return use_indirect(info) ? 1 : info.nr_vecs;
+    }
 
     virtq_desc *get_desc(uint32_t id)
     {
@@ -257,7 +327,8 @@ private:
 public:
     virtq_split(vdev *dev, unsigned int qsize, unsigned int nr)
         : virtq{dev, nr}, vq_pages{nullptr}, queue_size{qsize}, descs{nullptr}, avail{nullptr},
-          used{nullptr}, eff_queue_notify_off{0}, last_seen_used_idx{0}
+          used{nullptr}, eff_queue_notify_off{0}, last_seen_used_idx{0}, last_notify_idx{0},
+          event_idx{false}, indirect_desc{false}, irqs_disabled{false}
     {
         avail_descs = queue_size;
     }
@@ -393,12 +464,6 @@ protected:
 
     void cache_features();
 
-    bool has_feature(unsigned long feature) const
-    {
-        assert(feature < 64);
-        return feature_cache[0] & (1UL << feature);
-    }
-
     static constexpr unsigned long feature_to_bit(unsigned long feature)
     {
         return 1UL << feature;
@@ -468,6 +533,13 @@ public:
 
     bool raw_has_feature(unsigned long feature);
 
+    /* Only valid after finish_feature_negotiation() */
+    bool has_feature(unsigned long feature) const
+    {
+        assert(feature < 64);
+        return feature_cache[0] & (1UL << feature);
+    }
+
     /* To be used by drivers to negotiate features */
     void signal_feature(unsigned long feature);
 
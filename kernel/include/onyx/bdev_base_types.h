@@ -25,6 +25,9 @@ typedef u64 sector_t;
 #define BIO_REQ_READ_OP         0
 #define BIO_REQ_WRITE_OP        1
 #define BIO_REQ_DEVICE_SPECIFIC 2
+/* Make every write that completed so far durable (flush the volatile write cache). Carries no
+ * data. See blkdev_flush. */
+#define BIO_REQ_FLUSH_OP 3
 
 /* BIO flags start at bit 8 since bits 0 - 7 are reserved for operations */
 /* Note that we still have 24 bits for flags, which should be More Than Enough(tm) */
@@ -34,6 +37,9 @@ typedef u64 sector_t;
 #define BIO_REQ_NOT_SUPP     (1 << 11)
 #define BIO_REQ_PINNED_PAGES (1 << 12)
 #define BIO_REQ_CLONED       (1 << 13)
+/* The submitter wants to poll for completion. Only honoured if the device has poll queues, see
+ * blk_mq_ops::pick_poll_queue. */
+#define BIO_REQ_POLLED (1 << 14)
 
 #define BIO_STATUS_MASK (BIO_REQ_DONE | BIO_REQ_EIO | BIO_REQ_TIMEOUT | BIO_REQ_NOT_SUPP)
 
@@ -49,6 +55,8 @@ struct bio_req
     struct list_head list_node;
     void (*b_end_io)(struct bio_req *req);
     void *b_private;
+    /* Set if the bio went to a poll queue. No interrupt will complete it, the submitter polls. */
+    struct io_queue *b_poll_queue;
     struct page_iov b_inline_vec[];
 };
 
@@ -80,6 +88,8 @@ struct request
     struct list_head r_bio_list;
     struct list_head r_queue_list_node;
     size_t r_nr_sgls;
+    /* Time the request was submitted to its queue, for latency accounting */
+    u64 r_start_ns;
     /* Anything can come after this. Block devices specify their request's sizes, and data is
      * allocated inline. */
 };
@@ -14,6 +14,7 @@
 
 #include <onyx/bdev_base_types.h>
 #include <onyx/bio.h>
+#include <onyx/block/stats.h>
 #include <onyx/culstring.h>
 #include <onyx/dev.h>
 #include <onyx/list.h>
@@ -55,6 +56,8 @@ struct queue_properties
     /* Individual SGL descriptors can't cross this boundary. AKA start & ~dma_boundary == end &
      * ~dma_boundary. */
     unsigned long dma_boundary;
+    /* The device has a volatile write cache, and understands BIO_REQ_FLUSH_OP */
+    bool volatile_write_cache;
 };
 
 constexpr void bdev_set_default_queue_properties(struct queue_properties &props)
@@ -68,6 +71,7 @@ constexpr void bdev_set_default_queue_properties(struct queue_properties &props)
     props.max_sgl_desc_length = -1UL;
     props.bounce_highmem = false;
     props.dma_boundary = -1UL;
+    props.volatile_write_cache = false;
 }
 
 struct io_queue;
@@ -76,6 +80,8 @@ struct request;
 struct blk_mq_ops
 {
     struct io_queue *(*pick_queue)(struct blockdev *bdev);
+    /* Optional: pick a queue without interrupts, for BIO_REQ_POLLED bios. May return nullptr. */
+    struct io_queue *(*pick_poll_queue)(struct blockdev *bdev);
 };
 
 struct blockdev
@@ -92,6 +98,9 @@ struct blockdev
     struct blockdev *actual_blockdev{};
     size_t offset{};
     int (*submit_request)(struct blockdev *dev, struct bio_req *req){};
+    /* Optional: get the page backing a sector, for memory-backed devices (DAX-like access) */
+    int (*direct_access)(struct blockdev *dev, sector_t sector, struct page **page,
+                         unsigned int *offset){};
     /* Inode backing this block dev. This mostly matters when doing internal I/O to this block dev,
      * without it being a device file that userspace opened.
      */
@@ -111,6 +120,8 @@ struct blockdev
     struct mutex bdev_lock;
     unsigned int nr_open_partitions;
     unsigned int nr_busy;
+    /* I/O statistics. Partitions have none of their own, their I/O is accounted to the disk. */
+    struct blk_iostats stats{};
 
     /* A block device cannot be a partition and be partitioned */
     union {
@@ -171,6 +182,30 @@ static inline bool block_get_device_letter_from_id(unsigned int id, cul::slice<c
  */
 unique_ptr<blockdev> blkdev_create_scsi_like_dev();
 
+/**
+ * @brief Get direct access to the page backing a sector
+ * Only memory-backed devices support this. The page stays valid for as long as the device
+ * exists, and loads and stores to it are I/O to the device.
+ *
+ * @param dev Block device (or partition)
+ * @param sector Sector, relative to dev
+ * @param page Pointer to the page [out]
+ * @param offset Offset of the sector in the page [out]
+ * @return 0 on success, -EOPNOTSUPP if the device can't, negative error codes
+ */
+int blkdev_direct_access(struct blockdev *dev, sector_t sector, struct page **page,
+                         unsigned int *offset);
+
+/**
+ * @brief Flush a block device's volatile write cache
+ * Every write that completed before the call is on stable storage once this returns. A no-op for
+ * devices without a volatile write cache.
+ *
+ * @param dev Block device (or partition)
+ * @return 0 on success, negative error codes
+ */
+int blkdev_flush(struct blockdev *dev);
+
 // Read-write user and group, no permissions to others
 #define BLOCK_DEVICE_PERMISSIONS 0660
 
@@ -181,8 +216,10 @@ flush::writeback_dev *bdev_get_wbdev(struct inode *ino);
 /**
  * @brief Handle block IO completion (called from softirqs)
  *
+ * @param budget Maximum number of requests to complete
+ * @return True if there are still requests to complete
  */
-void block_handle_completion();
+bool block_handle_completion(unsigned int budget);
 
 /**
  * @brief Queue a pending io_queue to get looked at after the bio_reqs
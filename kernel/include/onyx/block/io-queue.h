@@ -11,6 +11,7 @@
 
 #include <onyx/bio.h>
 #include <onyx/block/request.h>
+#include <onyx/block/stats.h>
 #include <onyx/list.h>
 #include <onyx/spinlock.h>
 
@@ -31,6 +32,13 @@ protected:
     spinlock lock_;
     unsigned int flags_{0};
     struct list_head req_list_;
+    /* Polled requests the device completed, waiting for poll() to finish them off */
+    struct list_head polled_done_;
+    struct blk_iostats stats_{};
+    /* Block device that first submitted to us. Queues may be shared between devices (e.g NVMe
+     * namespaces), this is only used to give the queue a name. */
+    struct blockdev *owner_{nullptr};
+    unsigned int id_{0};
 
     /**
      * @brief Submits IO to a device
@@ -61,13 +69,58 @@ protected:
      */
     void __restart_queue();
 
+    /**
+     * @brief Reap the device's completion queue, for queues without interrupts
+     * Completed requests go through complete_request(), as they would from an IRQ.
+     *
+     * @return True if anything completed
+     */
+    virtual bool poll_cq()
+    {
+        return false;
+    }
+
 public:
     list_head_cpp<io_queue> pending_node_{this};
+    list_head_cpp<io_queue> queue_list_node_{this};
 
-    io_queue(unsigned int nr_entries) : nr_entries_{nr_entries}, pending_node_{this}
+    io_queue(unsigned int nr_entries) : nr_entries_{nr_entries}, pending_node_{this}, queue_list_node_{this}
     {
         INIT_LIST_HEAD(&req_list_);
+        INIT_LIST_HEAD(&polled_done_);
         spinlock_init(&lock_);
+        blk_iostats_init(&stats_);
+        blk_stats_add_queue(this);
+    }
+
+    ~io_queue()
+    {
+        blk_stats_remove_queue(this);
+    }
+
+    struct blk_iostats *stats()
+    {
+        return &stats_;
+    }
+
+    unsigned int id() const
+    {
+        return id_;
+    }
+
+    void set_id(unsigned int id)
+    {
+        id_ = id;
+    }
+
+    struct blockdev *owner() const
+    {
+        return owner_;
+    }
+
+    unsigned int nr_entries() const
+    {
+        return nr_entries_;
     }
 
     /**
@@ -84,6 +137,14 @@ public:
      */
     int submit_request(struct request *req);
 
+    /**
+     * @brief Poll the queue for completions
+     * Completes polled requests in the caller's context, instead of the block softirq.
+     *
+     * @return Number of requests completed
+     */
+    unsigned int poll();
+
     /**
      * @brief Set an io_queue as holding pending completed requests.
      * This queues it in a percpu queue and raises a softirq, if needed.
@@ -9,9 +9,26 @@
 #ifndef _ONYX_BLOCK_MULTIQUEUE_H
 #define _ONYX_BLOCK_MULTIQUEUE_H
 
+#include <onyx/types.h>
+
 struct blockdev;
 struct bio_req;
+struct cpumask;
 
 int blk_mq_submit_request(struct blockdev *dev, struct bio_req *bio);
 
+/**
+ * @brief Build a cpu -> hardware queue map from the queues' interrupt affinity
+ * Every cpu gets the queue whose completions are delivered to it, so submission and completion
+ * stay on the same cpus. CPUs no queue covers are spread round-robin.
+ *
+ * @param map Array of get_nr_cpus() entries, filled with queue indices
+ * @param nr_queues Number of hardware queues
+ * @param get_affinity Returns the cpus queue i's interrupt goes to (or nullptr if unknown)
+ * @param ctx Context for get_affinity
+ */
+void blk_mq_map_queues(u16 *map, unsigned int nr_queues,
+                       const struct cpumask *(*get_affinity)(void *ctx, unsigned int queue),
+                       void *ctx);
+
 #endif
@@ -0,0 +1,145 @@
+/*
+ * Copyright (c) 2024 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the GPLv2 License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+#ifndef _ONYX_BLOCK_STATS_H
+#define _ONYX_BLOCK_STATS_H
+
+#include <onyx/bdev_base_types.h>
+#include <onyx/clock.h>
+#include <onyx/spinlock.h>
+
+#define BLK_STAT_READ   0
+#define BLK_STAT_WRITE  1
+#define BLK_STAT_OTHER  2
+#define BLK_STAT_NR_OPS 3
+
+/* Latency buckets are log2(microseconds): bucket n holds latencies in [2^n, 2^(n + 1)) us, bucket 0
+ * holds anything under 2us and the last bucket (~8s) is open-ended. */
+#define BLK_LAT_BUCKETS 24
+
+/**
+ * @brief I/O statistics, kept for every block device and every hardware queue.
+ * Everything is protected by lock, which is taken from IRQ context.
+ */
+struct blk_iostats
+{
+    struct spinlock lock;
+    /* Completed requests, sectors transferred and time spent, per op */
+    unsigned long ios[BLK_STAT_NR_OPS];
+    unsigned long sectors[BLK_STAT_NR_OPS];
+    unsigned long merges[BLK_STAT_NR_OPS];
+    hrtime_t time_ns[BLK_STAT_NR_OPS];
+    unsigned long lat_hist[BLK_STAT_NR_OPS][BLK_LAT_BUCKETS];
+    unsigned long in_flight;
+    /* Time spent with at least one request in flight, and that time weighted by in_flight */
+    hrtime_t busy_ns;
+    hrtime_t weighted_ns;
+    /* Last time busy_ns and weighted_ns were brought up to date */
+    hrtime_t stamp;
+};
+
+static inline void blk_iostats_init(struct blk_iostats *st)
+{
+    spinlock_init(&st->lock);
+}
+
+static inline unsigned int blk_stat_op(u32 flags)
+{
+    switch (flags & BIO_REQ_OP_MASK)
+    {
+    case BIO_REQ_READ_OP:
+        return BLK_STAT_READ;
+    case BIO_REQ_WRITE_OP:
+        return BLK_STAT_WRITE;
+    default:
+        return BLK_STAT_OTHER;
+    }
+}
+
+/**
+ * @brief Account for the start of a request
+ *
+ * @param st Stats to update
+ * @param now Current time
+ */
+void blk_stats_start(struct blk_iostats *st, hrtime_t now);
+
+/**
+ * @brief Account for the completion of a request
+ *
+ * @param st Stats to update
+ * @param op BLK_STAT_* op
+ * @param nsectors Number of sectors transferred
+ * @param start Time the request was started at
+ * @param now Current time
+ */
+void blk_stats_done(struct blk_iostats *st, unsigned int op, sector_t nsectors, hrtime_t start,
+                    hrtime_t now);
+
+/**
+ * @brief Account for a bio that got merged into an existing request
+ *
+ * @param st Stats to update
+ * @param op BLK_STAT_* op
+ */
+void blk_stats_merge(struct blk_iostats *st, unsigned int op);
+
+/**
+ * @brief Take a consistent snapshot of a blk_iostats, with busy time brought up to date
+ *
+ * @param st Stats to read
+ * @param out Snapshot
+ */
+void blk_stats_read(struct blk_iostats *st, struct blk_iostats *out);
+
+struct request;
+struct io_queue;
+struct blockdev;
+
+/**
+ * @brief Account for a request getting submitted to its hardware queue
+ *
+ * @param req Request
+ */
+void blk_account_start(struct request *req);
+
+/**
+ * @brief Account for a request's completion, on its block device and hardware queue
+ *
+ * @param req Request
+ */
+void blk_account_done(struct request *req);
+
+/**
+ * @brief Make a block device's statistics visible in procfs
+ *
+ * @param bdev Block device
+ */
+void blk_stats_add_dev(struct blockdev *bdev);
+
+/**
+ * @brief Remove a block device from procfs' statistics
+ *
+ * @param bdev Block device
+ */
+void blk_stats_remove_dev(struct blockdev *bdev);
+
+/**
+ * @brief Register a hardware queue, assigning it an ID
+ *
+ * @param queue Queue
+ */
+void blk_stats_add_queue(struct io_queue *queue);
+
+/**
+ * @brief Unregister a hardware queue
+ *
+ * @param queue Queue
+ */
+void blk_stats_remove_queue(struct io_queue *queue);
+
+#endif
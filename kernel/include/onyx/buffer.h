@@ -50,6 +50,8 @@ struct block_buf
 #define BLOCKBUF_FLAG_UPTODATE  (1 << 2)
 #define BLOCKBUF_FLAG_AREAD     (1 << 3)
 #define BLOCKBUF_FLAG_HOLE      (1 << 4)
+/* Space for the block was reserved, but it doesn't have a block number yet (delayed allocation) */
+#define BLOCKBUF_FLAG_DELALLOC  (1 << 5)
 
 static inline bool bb_test_and_set(struct block_buf *buf, unsigned int flag)
 {
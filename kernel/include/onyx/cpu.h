@@ -35,6 +35,7 @@ __BEGIN_CDECLS
 #define CPUID_SIGN                 0x00000001
 #define CPUID_FEATURES             0x00000001
 #define CPUID_FEATURES_EXT         0x00000007
+#define CPUID_ARCH_PERFMON         0x0000000a
 #define CPUID_EXTENDED_PROC_INFO   0x80000001
 
 #define X86_FEATURE_FPU                  (0)
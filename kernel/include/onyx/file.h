@@ -45,6 +45,8 @@ void file_free(struct file *file);
 
 int allocate_file_descriptor_table(struct process *process);
 int copy_file_descriptors(struct process *process, struct ioctx *ctx);
+int copy_file_descriptors_filter(struct process *process, struct ioctx *ctx,
+                                 bool (*keep_cloexec)(int fd, void *arg), void *arg);
 int get_dirfd(int dirfd, struct path *cwd);
 void exit_files(struct process *process);
 
@@ -85,7 +85,9 @@ struct inode_operations
 };
 
 /* For directio's flags */
-#define DIRECT_IO_OP(op) ((op) << 0)
+#define DIRECT_IO_OP(op) ((op) & 0xff)
+/* Poll for completion instead of sleeping, if the device can */
+#define DIRECT_IO_POLL (1 << 8)
 
 enum
 {
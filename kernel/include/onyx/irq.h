@@ -10,6 +10,7 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+#include <onyx/cpumask.h>
 #include <onyx/registers.h>
 #include <onyx/spinlock.h>
 
@@ -43,12 +44,40 @@ struct irqstats
     unsigned long spurious;
 };
 
+/* The affinity was picked by the kernel (e.g spread over a device's queues), don't let userspace
+ * move it around */
+#define IRQ_AFFINITY_MANAGED (1 << 0)
+
+/**
+ * @brief Retarget an interrupt line to a cpu
+ *
+ * @param irq IRQ number
+ * @param cpu Target cpu
+ * @param data Data passed to irq_init_affinity
+ * @return 0 on success, negative error code
+ */
+typedef int (*irq_set_affinity_t)(unsigned int irq, unsigned int cpu, void *data);
+
+struct procfs_entry;
+
 struct irq_line
 {
     struct interrupt_handler *irq_handlers;
-    /* Here to stop race conditions with uninstalling and installing irq handlers */
+    /* Here to stop race conditions with uninstalling and installing irq handlers. Also protects
+     * the affinity. */
     struct spinlock list_lock;
     struct irqstats stats;
+    /* CPUs this line may be delivered to (empty if no one ever set it), and the one it actually
+     * gets delivered to */
+    struct cpumask affinity;
+    unsigned int effective_cpu;
+    unsigned int affinity_flags;
+    irq_set_affinity_t set_affinity;
+    void *affinity_data;
+    /* /proc/irq/N */
+    struct procfs_entry *proc_dir;
+    struct procfs_entry *proc_affinity;
+    struct procfs_entry *proc_effective;
 };
 
 extern bool in_irq;
@@ -64,4 +93,38 @@ int install_irq(unsigned int irq, irq_t handler, struct device *device, unsigned
 void free_irq(unsigned int irq, struct device *device);
 void irq_init(void);
 
+/**
+ * @brief Set up an interrupt line's affinity
+ * Called by whoever routed the line (e.g MSI-X setup) to record where it is routed to, and how it
+ * can be moved.
+ *
+ * @param irq IRQ number
+ * @param mask CPUs the line is meant to be delivered to
+ * @param cpu CPU it is currently routed to
+ * @param flags IRQ_AFFINITY_* flags
+ * @param set_affinity Callback that retargets the line, or NULL if it can't be moved
+ * @param data Data for set_affinity
+ */
+void irq_init_affinity(unsigned int irq, const struct cpumask *mask, unsigned int cpu,
+                       unsigned int flags, irq_set_affinity_t set_affinity, void *data);
+
+/**
+ * @brief Move an interrupt line
+ * The line is routed to the first online cpu in mask.
+ *
+ * @param irq IRQ number
+ * @param mask New affinity
+ * @return 0 on success, -EIO if the line is managed or can't be moved, -EINVAL if mask has no
+ * online cpus
+ */
+int irq_set_affinity(unsigned int irq, const struct cpumask *mask);
+
+/**
+ * @brief Get an interrupt line's affinity
+ *
+ * @param irq IRQ number
+ * @return The affinity mask, or NULL if it was never set up
+ */
+const struct cpumask *irq_get_affinity(unsigned int irq);
+
 #endif
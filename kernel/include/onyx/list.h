@@ -128,6 +128,11 @@ static inline bool list_is_empty(const struct list_head *head)
     return head->next == head;
 }
 
+static inline bool list_is_singular(const struct list_head *head)
+{
+    return !list_is_empty(head) && head->next == head->prev;
+}
+
 void list_assert_correct(struct list_head *head);
 
 static inline struct list_head *list_first_element(struct list_head *head)
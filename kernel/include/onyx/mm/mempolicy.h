@@ -0,0 +1,44 @@
+/*
+ * Copyright (c) 2025 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the GPLv2 License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+#ifndef _ONYX_MM_MEMPOLICY_H
+#define _ONYX_MM_MEMPOLICY_H
+
+#include <onyx/compiler.h>
+
+#include <uapi/mempolicy.h>
+
+/**
+ * @brief A NUMA memory policy, for a process or a mapping. These are small enough to be copied
+ * around by value.
+ */
+struct mempolicy
+{
+    int mode;
+    /* Nodes, as a bitmask. Unused for MPOL_DEFAULT and MPOL_LOCAL. */
+    unsigned long nodes;
+};
+
+struct vm_area_struct;
+struct page;
+
+__BEGIN_CDECLS
+
+/**
+ * @brief Allocate a page for a user mapping, following the mapping's memory policy (or the
+ * process', if the mapping doesn't have one)
+ *
+ * @param vma Mapping
+ * @param addr Address the page is for
+ * @param flags GFP flags
+ * @return Allocated page, or NULL
+ */
+struct page *alloc_page_vma(struct vm_area_struct *vma, unsigned long addr, unsigned long flags);
+
+__END_CDECLS
+
+#endif
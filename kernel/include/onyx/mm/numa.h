@@ -0,0 +1,131 @@
+/*
+ * Copyright (c) 2025 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the GPLv2 License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+#ifndef _ONYX_MM_NUMA_H
+#define _ONYX_MM_NUMA_H
+
+#include <stddef.h>
+
+#include <onyx/compiler.h>
+#include <onyx/page.h>
+#include <onyx/smp.h>
+#include <onyx/types.h>
+
+#ifndef CONFIG_NUMA_NR_NODES
+#define CONFIG_NUMA_NR_NODES 8
+#endif
+
+/* Node masks are unsigned longs, so we can't do more than 64 nodes */
+#define NUMA_NODEMASK_ALL (~0UL)
+
+/* SLIT distances (in ACPI units, where local = 10) we assume if the firmware doesn't tell us */
+#define NUMA_LOCAL_DISTANCE  10
+#define NUMA_REMOTE_DISTANCE 20
+
+__BEGIN_CDECLS
+
+extern unsigned int nr_numa_nodes;
+extern u8 numa_cpu_nodes[CONFIG_SMP_NR_CPUS];
+
+/**
+ * @brief Set the number of NUMA nodes (called by the arch topology parser, before numa_init)
+ *
+ * @param nr Number of nodes
+ */
+void numa_set_nr_nodes(unsigned int nr);
+
+/**
+ * @brief Add a memory block to a node (called by the arch topology parser, before numa_init)
+ *
+ * @param nid Node
+ * @param start Start of the block (physical address)
+ * @param end End of the block (exclusive)
+ * @return 0 on success, -ENOSPC if we're out of memory blocks
+ */
+int numa_add_memblk(int nid, unsigned long start, unsigned long end);
+
+/**
+ * @brief Set the distance between two nodes, in ACPI SLIT units
+ */
+void numa_set_distance(int from, int to, u8 distance);
+
+/**
+ * @brief Get the distance between two nodes, in ACPI SLIT units
+ */
+unsigned int numa_distance(int from, int to);
+
+/**
+ * @brief Set a CPU's node
+ *
+ * @param cpu CPU
+ * @param nid Node
+ */
+void numa_set_cpu_node(unsigned int cpu, int nid);
+
+/**
+ * @brief Get the nodes in order of distance from nid, nid first
+ *
+ * @param nid Node
+ * @return Array of nr_numa_nodes node ids
+ */
+const u8 *numa_node_order(int nid);
+
+/**
+ * @brief Split a physical range into per-node ranges
+ *
+ * @param start Start of the range
+ * @param size Size of the range
+ * @param cb Callback, called for every part of the range, in order
+ */
+void numa_for_each_range(unsigned long start, size_t size,
+                         void (*cb)(unsigned long start, size_t size, int nid));
+
+/**
+ * @brief Validate the topology the arch gave us and set up fallback orders. Called by page_init,
+ * before any memory gets added.
+ */
+void numa_init(void);
+
+int __phys_to_nid(unsigned long phys);
+
+/**
+ * @brief Get the node of a physical address. Memory no node covers belongs to node 0.
+ */
+static inline int phys_to_nid(unsigned long phys)
+{
+    if (likely(nr_numa_nodes == 1))
+        return 0;
+    return __phys_to_nid(phys);
+}
+
+static inline int page_to_nid(struct page *page)
+{
+    return phys_to_nid((unsigned long) page_to_phys(page));
+}
+
+static inline int cpu_to_node(unsigned int cpu)
+{
+    return numa_cpu_nodes[cpu];
+}
+
+/**
+ * @brief Get the current CPU's node. The caller must be prepared to be migrated off it, unless
+ * preemption is disabled.
+ */
+static inline int numa_node_id(void)
+{
+    return cpu_to_node(get_cpu_nr());
+}
+
+static inline unsigned long numa_nodemask_valid(void)
+{
+    return nr_numa_nodes == 64 ? NUMA_NODEMASK_ALL : (1UL << nr_numa_nodes) - 1;
+}
+
+__END_CDECLS
+
+#endif
@@ -10,11 +10,13 @@
 #define _ONYX_MM_PAGE_NODE_H
 
 #include <onyx/list.h>
+#include <onyx/mm/numa.h>
 #include <onyx/mm/page_zone.h>
 #include <onyx/spinlock.h>
 
 struct page_node
 {
+    int nid;
     struct spinlock node_lock;
     struct list_head cpu_list_node;
     unsigned long used_pages;
@@ -24,22 +26,23 @@ struct page_node
 #ifdef __cplusplus
     struct page_zone *pick_zone(unsigned long page);
 
-    constexpr page_node() : node_lock{}, cpu_list_node{}, used_pages{}, total_pages{}
+    constexpr page_node() : nid{}, node_lock{}, cpu_list_node{}, used_pages{}, total_pages{}
     {
         spinlock_init(&node_lock);
         page_zone_init(&zones[0], "DMA32", 0, UINT32_MAX);
         page_zone_init(&zones[1], "Normal", (u64) UINT32_MAX + 1, UINT64_MAX);
     }
 
-    void init()
+    void init(int nid)
     {
+        this->nid = nid;
+        for (auto &zone : zones)
+            zone.nid = nid;
         INIT_LIST_HEAD(&cpu_list_node);
     }
 
     void add_region(unsigned long base, size_t size);
     struct page *alloc_order(unsigned int order, unsigned long flags);
-    struct page *allocate_pages(unsigned long nr_pages, unsigned long flags);
-    struct page *alloc_page(unsigned long flags);
     void free_page(struct page *p);
 
     template <typename Callable>
@@ -56,10 +59,25 @@ struct page_node
 #endif
 };
 
-/* ugh */
-
 __BEGIN_CDECLS
-extern struct page_node main_node;
+/* Indexed by node id. Only the first nr_numa_nodes are in use. */
+extern struct page_node page_nodes[CONFIG_NUMA_NR_NODES];
+
+/**
+ * @brief Get the mask of nodes that have memory. Nodes may be CPU-only.
+ */
+static inline unsigned long numa_nodemask_memory(void)
+{
+    unsigned long mask = 0;
+
+    for (unsigned int i = 0; i < nr_numa_nodes; i++)
+    {
+        if (page_nodes[i].total_pages)
+            mask |= 1UL << i;
+    }
+
+    return mask;
+}
 
 #define for_zones_in_node(node, zone) \
     for (zone = node->zones; zone < node->zones + NR_ZONES; zone++)
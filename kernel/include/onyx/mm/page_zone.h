@@ -72,6 +72,7 @@ struct page_pcpu_data
 struct page_zone
 {
     const char *name;
+    int nid;
     unsigned long start;
     unsigned long end;
     unsigned long min_watermark;
@@ -92,6 +93,7 @@ constexpr void page_zone_init(page_zone *zone, const char *name, unsigned long s
                               unsigned long end)
 {
     zone->name = name;
+    zone->nid = 0;
     zone->start = start;
     zone->end = end;
     zone->high_watermark = zone->min_watermark = zone->low_watermark = 0;
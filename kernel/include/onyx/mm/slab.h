@@ -30,11 +30,18 @@ struct slab_cache_percpu_context
 
 #undef ATOMIC_TYPE
 
-struct slab_cache
+/* Partial and free slabs are kept per NUMA node, so we can hand out local memory first */
+struct slab_cache_node
 {
-    const char *name;
     struct list_head partial_slabs;
     struct list_head free_slabs;
+    size_t npartialslabs;
+    size_t nfreeslabs;
+};
+
+struct slab_cache
+{
+    const char *name;
     struct list_head full_slabs;
     size_t nr_objects;
     size_t active_objects;
@@ -51,6 +58,7 @@ struct slab_cache
     struct spinlock lock;
     int mag_limit;
     void (*ctor)(void *);
+    struct slab_cache_node nodes[CONFIG_NUMA_NR_NODES];
     // TODO: This is horrible. We need a way to allocate percpu memory,
     // and then either trim it or grow it when CPUs come online.
     struct slab_cache_percpu_context pcpu[CONFIG_SMP_NR_CPUS] __align_cache;
@@ -0,0 +1,302 @@
+/*
+ * Copyright (c) 2024 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the GPLv2 License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#ifndef _ONYX_NET_FIB_H
+#define _ONYX_NET_FIB_H
+
+#include <errno.h>
+#include <string.h>
+
+#include <onyx/compiler.h>
+#include <onyx/mm/slab.h>
+#include <onyx/mutex.h>
+#include <onyx/page.h>
+#include <onyx/rcupdate.h>
+#include <onyx/scoped_lock.h>
+#include <onyx/types.h>
+
+#include <onyx/utility.hpp>
+
+/* Bumped every time a routing table (of any family) changes. Sockets cache their route along with
+ * the generation it was looked up in, and look it up again when it goes stale. */
+extern unsigned long inet_route_gen;
+
+static inline unsigned long inet_route_generation()
+{
+    return __atomic_load_n(&inet_route_gen, __ATOMIC_ACQUIRE);
+}
+
+static inline void inet_route_table_changed()
+{
+    __atomic_add_fetch(&inet_route_gen, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Longest-prefix-match forwarding table
+ * A path-compressed binary (PATRICIA) trie, keyed by the address in network byte order. Lookups
+ * are lockless and run under rcu_read_lock(); insertions are serialized by a mutex and publish
+ * fully built nodes with rcu_assign_pointer. Routes and nodes are never removed.
+ *
+ * Route must have a Route *fib_next and an int metric.
+ *
+ * @tparam Route Route type
+ * @tparam KeyBytes Length of the address, in bytes
+ */
+template <typename Route, unsigned int KeyBytes>
+class fib_trie
+{
+    static constexpr unsigned int key_bits = KeyBytes * 8;
+
+    struct fib_node
+    {
+        struct fib_node __rcu *child[2];
+        /* Routes for exactly this prefix. Nodes without routes just glue the trie together. */
+        Route __rcu *routes;
+        unsigned int plen;
+        u8 key[KeyBytes];
+    };
+
+    struct fib_node __rcu *root_{nullptr};
+    struct mutex lock_;
+
+    static unsigned int key_bit(const u8 *key, unsigned int bit)
+    {
+        return (key[bit / 8] >> (7 - (bit % 8))) & 1;
+    }
+
+    /* Number of leading bits a and b have in common, up to max */
+    static unsigned int common_bits(const u8 *a, const u8 *b, unsigned int max)
+    {
+        for (unsigned int i = 0; i < max; i += 8)
+        {
+            u8 diff = a[i / 8] ^ b[i / 8];
+            if (diff)
+                return cul::min(i + __builtin_clz(diff) - 24, max);
+        }
+
+        return max;
+    }
+
+    static void mask_key(u8 *key, unsigned int plen)
+    {
+        for (unsigned int i = 0; i < KeyBytes; i++)
+        {
+            if (plen >= (i + 1) * 8)
+                continue;
+            if (plen <= i * 8)
+                key[i] = 0;
+            else
+                key[i] &= (u8) (0xff << (8 - (plen % 8)));
+        }
+    }
+
+    static struct fib_node *alloc_node(const u8 *key, unsigned int plen, Route *route)
+    {
+        struct fib_node *node = (struct fib_node *) kmalloc(sizeof(struct fib_node), GFP_KERNEL);
+        if (!node)
+            return nullptr;
+        node->child[0] = node->child[1] = nullptr;
+        node->routes = route;
+        node->plen = plen;
+        memcpy(node->key, key, KeyBytes);
+        mask_key(node->key, plen);
+        return node;
+    }
+
+    static void free_subtree(struct fib_node *node)
+    {
+        if (!node)
+            return;
+
+        free_subtree(node->child[0]);
+        free_subtree(node->child[1]);
+
+        for (Route *r = node->routes; r;)
+        {
+            Route *next = r->fib_next;
+            kfree(r);
+            r = next;
+        }
+
+        kfree(node);
+    }
+
+public:
+    constexpr fib_trie() = default;
+
+    /* Tables get torn down when no one can possibly be looking at them anymore (e.g tests) */
+    ~fib_trie()
+    {
+        free_subtree(root_);
+    }
+
+    CLASS_DISALLOW_COPY(fib_trie);
+    CLASS_DISALLOW_MOVE(fib_trie);
+
+    /**
+     * @brief Insert a route
+     *
+     * @param route Route to insert. Owned by the table from now on.
+     * @param addr Destination address (network order); bits past plen are ignored
+     * @param plen Prefix length
+     * @return 0 on success, negative error code
+     */
+    int insert(Route *route, const void *addr, unsigned int plen)
+    {
+        u8 key[KeyBytes];
+
+        if (plen > key_bits)
+            return -EINVAL;
+
+        memcpy(key, addr, KeyBytes);
+        mask_key(key, plen);
+
+        scoped_mutex g{lock_};
+        struct fib_node __rcu **pp = &root_;
+
+        for (;;)
+        {
+            struct fib_node *node = rcu_dereference_protected(*pp, mutex_holds_lock(&lock_));
+
+            if (!node)
+            {
+                route->fib_next = nullptr;
+                struct fib_node *leaf = alloc_node(key, plen, route);
+                if (!leaf)
+                    return -ENOMEM;
+                rcu_assign_pointer(*pp, leaf);
+                break;
+            }
+
+            unsigned int common = common_bits(node->key, key, cul::min(node->plen, plen));
+
+            if (common == node->plen)
+            {
+                if (node->plen == plen)
+                {
+                    /* Same prefix, chain it */
+                    route->fib_next = node->routes;
+                    rcu_assign_pointer(node->routes, route);
+                    break;
+                }
+
+                pp = &node->child[key_bit(key, node->plen)];
+                continue;
+            }
+
+            /* The new prefix diverges from node's somewhere inside node's prefix. Build the
+             * replacement subtree on the side and swap it in with a single store. */
+            route->fib_next = nullptr;
+
+            if (common == plen)
+            {
+                /* We're a prefix of node, and become its parent */
+                struct fib_node *parent = alloc_node(key, plen, route);
+                if (!parent)
+                    return -ENOMEM;
+                parent->child[key_bit(node->key, plen)] = node;
+                rcu_assign_pointer(*pp, parent);
+                break;
+            }
+
+            struct fib_node *leaf = alloc_node(key, plen, route);
+            if (!leaf)
+                return -ENOMEM;
+            struct fib_node *glue = alloc_node(key, common, nullptr);
+            if (!glue)
+            {
+                kfree(leaf);
+                return -ENOMEM;
+            }
+
+            glue->child[key_bit(node->key, common)] = node;
+            glue->child[key_bit(key, common)] = leaf;
+            rcu_assign_pointer(*pp, glue);
+            break;
+        }
+
+        inet_route_table_changed();
+        return 0;
+    }
+
+    /**
+     * @brief Find the longest prefix match for an address
+     * Must be called under rcu_read_lock(). The route stays valid until rcu_read_unlock().
+     *
+     * @param addr Address to look up (network order)
+     * @param accept Filter, for routes that can't be used (e.g wrong interface)
+     * @return The route with the longest prefix (highest metric on ties) that accept() took, or
+     * nullptr
+     */
+    template <typename Filter>
+    Route *lookup(const void *addr, Filter accept) const
+    {
+        const u8 *key = (const u8 *) addr;
+        Route *best = nullptr;
+        struct fib_node *node = rcu_dereference(root_);
+
+        while (node)
+        {
+            if (common_bits(node->key, key, node->plen) != node->plen)
+                break;
+
+            Route *match = nullptr;
+            for (Route *r = rcu_dereference(node->routes); r; r = rcu_dereference(r->fib_next))
+            {
+                if (accept(r) && (!match || r->metric > match->metric))
+                    match = r;
+            }
+
+            /* Deeper nodes have longer prefixes */
+            if (match)
+                best = match;
+
+            if (node->plen == key_bits)
+                break;
+            node = rcu_dereference(node->child[key_bit(key, node->plen)]);
+        }
+
+        return best;
+    }
+};
+
+/**
+ * @brief Convert a netmask to a prefix length
+ *
+ * @param mask Mask, in network order
+ * @param len Length of the mask, in bytes
+ * @return Prefix length, or -1 if the mask isn't contiguous
+ */
+static inline int fib_mask_to_prefix(const void *mask, unsigned int len)
+{
+    const u8 *m = (const u8 *) mask;
+    unsigned int plen = 0;
+    unsigned int i = 0;
+
+    for (; i < len && m[i] == 0xff; i++)
+        plen += 8;
+
+    if (i == len)
+        return plen;
+
+    /* Partial byte: must be of the form 1..10..0 */
+    u8 partial = m[i];
+    if ((u8) (partial | (partial - 1)) != 0xff && partial != 0)
+        return -1;
+    plen += partial ? __builtin_clz((unsigned int) (u8) ~partial) - 24 : 0;
+
+    for (i++; i < len; i++)
+    {
+        if (m[i])
+            return -1;
+    }
+
+    return plen;
+}
+
+#endif
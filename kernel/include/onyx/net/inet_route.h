@@ -25,6 +25,8 @@ struct inet4_route
     netif *nif;
     int metric;
     unsigned short flags;
+    /* Next route with the same prefix, in the FIB */
+    struct inet4_route *fib_next;
 };
 
 struct inet6_route
@@ -35,6 +37,7 @@ struct inet6_route
     netif *nif;
     int metric;
     unsigned short flags;
+    struct inet6_route *fib_next;
 };
 
 #define INET4_ROUTE_FLAG_GATEWAY     (1 << 0)
@@ -43,10 +43,13 @@ struct inet_socket : public socket
 
     unsigned int ipv4_on_inet6 : 1, ipv6_only : 1, route_cache_valid : 1;
     int ttl;
+    /* Routing table generation route_cache was looked up in */
+    unsigned long route_cache_gen;
 
     inet_socket()
         : socket{}, src_addr{}, dest_addr{}, bind_table_node{this}, proto_info{}, proto_domain{},
-          ipv4_on_inet6{}, ipv6_only{}, route_cache_valid{}, ttl{INET_DEFAULT_TTL}
+          ipv4_on_inet6{}, ipv6_only{}, route_cache_valid{}, ttl{INET_DEFAULT_TTL},
+          route_cache_gen{}
     {
         INIT_LIST_HEAD(&rx_packet_list);
         init_wait_queue_head(&rx_wq);
@@ -110,6 +113,15 @@ struct inet_socket : public socket
         return true;
     }
 
+    /**
+     * @brief Check if this socket takes part in SO_REUSEPORT load balancing
+     * Connected sockets don't, they only ever get their own 4-tuple.
+     */
+    bool in_reuseport_group() const
+    {
+        return reuse_port && !connected;
+    }
+
     const struct inet_proto_family *get_proto_fam()
     {
         return proto_domain;
@@ -117,6 +129,24 @@ struct inet_socket : public socket
 
     void append_inet_rx_pbuf(packetbuf *buf);
 
+    /**
+     * @brief Cache a route to dest_addr
+     * Takes the socket lock, so senders never see a half-written route.
+     *
+     * @param route Route
+     * @param gen Routing table generation the route was looked up in
+     */
+    void set_route_cache(const inet_route &route, unsigned long gen);
+
+    /**
+     * @brief Get the cached route, looking it up again if the routing table changed since it was
+     * cached. The copy is done under the socket lock.
+     *
+     * @param route Where to copy the route to
+     * @return 0 on success, negative error code
+     */
+    int revalidate_route_cache(inet_route &route);
+
     virtual ~inet_socket();
 
     int setsockopt_inet(int level, int opt, const void *optval, socklen_t len);
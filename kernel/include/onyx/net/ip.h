@@ -137,7 +137,7 @@ inline T *inet_resolve_socket(in_addr_t src, in_port_t port_src, in_port_t port_
 {
     in_addr __src;
     __src.s_addr = src;
-    auto flags = (!ign_dst ? GET_SOCKET_DSTADDR_VALID : 0);
+    auto flags = (!ign_dst ? GET_SOCKET_DSTADDR_VALID : GET_SOCKET_REUSEPORT);
 
     const inet_sock_address socket_dst{__src, port_src};
     const inet_sock_address socket_src{nif->local_ip.sin_addr, port_dst};
@@ -170,7 +170,7 @@ inline T *inet6_resolve_socket(const in6_addr &src, in_port_t port_src, const in
                                const inet_proto *proto_info, unsigned int instance = 0)
 {
     const in6_addr &__src = src;
-    auto flags = (!ign_dst ? GET_SOCKET_DSTADDR_VALID : 0);
+    auto flags = (!ign_dst ? GET_SOCKET_DSTADDR_VALID : GET_SOCKET_REUSEPORT);
 
     const inet_sock_address socket_dst{__src, port_src, nif->if_id};
     const inet_sock_address socket_src{dst, port_dst, nif->if_id};
@@ -24,13 +24,14 @@ struct netif;
 #define NETIF_SUPPORTS_CSUM_OFFLOAD (1 << 1)
 #define NETIF_SUPPORTS_TSO4         (1 << 3)
 #define NETIF_SUPPORTS_TSO6         (1 << 4)
-#define NETIF_SUPPORTS_UFO          (1 << 5)
+#define NETIF_SUPPORTS_UFO          (1 << 2)
 #define NETIF_LOOPBACK              (1 << 5)
 #define NETIF_HAS_RX_AVAILABLE      (1 << 6)
 #define NETIF_DOING_RX_POLL         (1 << 7)
 #define NETIF_SCHEDULED             (1 << 8)
 
 struct packetbuf;
+struct qdisc;
 
 struct netif_inet6_addr
 {
@@ -85,10 +86,18 @@ struct netif
     struct list_head rx_queue_node;
     data_link_layer_ops *dll_ops;
 
+    /* Deterministic packet drops on transmit (SIOSETDROPINJ), for testing */
+    unsigned int drop_every;
+    unsigned int drop_burst;
+    unsigned long drop_counter;
+
+    /* Packet scheduler, NULL (noqueue) sends straight to the driver. RCU protected. */
+    struct qdisc *qdisc;
+
     netif()
         : name{}, device_file{}, priv{}, if_id{}, flags{}, mtu{}, mac_address{}, local_ip{},
           inet6_addr_list_lock{}, inet6_addr_list{}, sendpacket{}, poll_rx{}, rx_end{}, list_node{},
-          rx_queue_node{}, dll_ops{}
+          rx_queue_node{}, dll_ops{}, drop_every{}, drop_burst{}, drop_counter{}, qdisc{}
     {
         INIT_LIST_HEAD(&inet6_addr_list);
     }
@@ -117,6 +126,8 @@ struct inet_socket;
 #define GET_SOCKET_UNLOCKED        (1 << 0)
 #define GET_SOCKET_DSTADDR_VALID   (1 << 1)
 #define GET_SOCKET_CHECK_EXISTENCE (1 << 2)
+/* Only match one (hashed on the 4-tuple) socket out of each SO_REUSEPORT group */
+#define GET_SOCKET_REUSEPORT       (1 << 3)
 
 #define ADD_SOCKET_UNLOCKED    (1 << 0)
 #define REMOVE_SOCKET_UNLOCKED (1 << 0)
@@ -138,7 +149,7 @@ netif *netif_from_if(uint32_t oif);
 cul::vector<netif *> &netif_lock_and_get_list(void);
 void netif_unlock_list(void);
 struct netif *netif_from_name(const char *name);
-int netif_do_rx(void);
+bool netif_do_rx(unsigned int budget);
 void netif_signal_rx(netif *nif);
 int netif_process_pbuf(netif *nif, packetbuf *buf);
 
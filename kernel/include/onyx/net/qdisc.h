@@ -0,0 +1,120 @@
+/*
+ * Copyright (c) 2025 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the GPLv2 License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#ifndef _ONYX_NET_QDISC_H
+#define _ONYX_NET_QDISC_H
+
+#include <onyx/clock.h>
+#include <onyx/rcupdate.h>
+#include <onyx/spinlock.h>
+#include <onyx/timer.h>
+#include <onyx/types.h>
+
+struct netif;
+struct packetbuf;
+struct qdisc;
+
+/* How many packets qdisc_run sends before letting someone else have the cpu */
+#define QDISC_RUN_BUDGET 64
+
+struct qdisc_ops
+{
+    const char *name;
+    /* Size of the discipline's private data (qdisc_priv) */
+    size_t priv_size;
+
+    int (*init)(struct qdisc *q);
+    /**
+     * @brief Queue a packet. Called with the qdisc lock held.
+     * Takes over the caller's reference, even on failure.
+     *
+     * @return 0 if the packet got queued, -ENOBUFS if it got dropped
+     */
+    int (*enqueue)(struct qdisc *q, struct packetbuf *pbf);
+    /**
+     * @brief Dequeue the next packet to send. Called with the qdisc lock held.
+     *
+     * @param now Current time
+     * @param wakeup If there are packets but none of them may go out yet (pacing), set to when
+     * the next one may
+     * @return The packet (and its reference), or NULL
+     */
+    struct packetbuf *(*dequeue)(struct qdisc *q, hrtime_t now, hrtime_t *wakeup);
+    /* Drop every queued packet */
+    void (*reset)(struct qdisc *q);
+    void (*destroy)(struct qdisc *q);
+};
+
+struct qdisc
+{
+    const struct qdisc_ops *ops;
+    struct netif *nif;
+    struct spinlock lock;
+    /* Someone is feeding the driver (single feeder, see qdisc_run) */
+    bool running;
+    /* Detached from the interface, don't send anything else */
+    bool dead;
+    /* Packets and bytes queued */
+    unsigned int qlen;
+    unsigned long backlog;
+    /* Maximum number of packets queued */
+    unsigned int limit;
+    unsigned long drops;
+    /* Wakes us up when pacing lets the next packet out */
+    struct clockevent watchdog;
+    alignas(16) unsigned char priv[];
+};
+
+template <typename T>
+static inline T *qdisc_priv(struct qdisc *q)
+{
+    return (T *) q->priv;
+}
+
+/**
+ * @brief Hash a packet's flow (addresses, protocol and ports)
+ *
+ * @param pbf Packet, with net_header set
+ * @return Flow hash, 0 if it's not IP
+ */
+u32 qdisc_flow_hash(struct packetbuf *pbf);
+
+/**
+ * @brief Drop a packet the qdisc owns (accounts for it and puts the reference)
+ */
+void qdisc_drop(struct qdisc *q, struct packetbuf *pbf);
+
+/**
+ * @brief Send a packet through the interface's qdisc
+ * The caller keeps its reference, as with netif_send_packet.
+ *
+ * @param q qdisc
+ * @param pbf Packet
+ * @return 0 on success (queued or sent), negative error codes
+ */
+int qdisc_xmit(struct qdisc *q, struct packetbuf *pbf);
+
+/**
+ * @brief Attach a qdisc to an interface, replacing (and draining) the old one
+ *
+ * @param nif Network interface
+ * @param name Name of the qdisc, "noqueue" to send directly to the driver
+ * @return 0 on success, negative error codes
+ */
+int qdisc_attach(struct netif *nif, const char *name);
+
+/**
+ * @brief Attach the default qdisc (net.default_qdisc=) to a newly registered interface
+ */
+void qdisc_attach_default(struct netif *nif);
+
+extern const struct qdisc_ops pfifo_fast_qdisc_ops;
+extern const struct qdisc_ops fq_codel_qdisc_ops;
+extern const struct qdisc_ops fq_qdisc_ops;
+
+#endif
@@ -83,6 +83,10 @@ public:
     bool dead : 1 {0};
     bool sndbuf_locked : 1 {0};
     bool rcvbuf_locked : 1 {0};
+    bool reuse_port : 1 {0};
+    /* Owner of the socket when SO_REUSEPORT was set. Only sockets with the same owner get to share
+     * a port. */
+    uid_t reuseport_uid{0};
 
     struct list_head socket_backlog;
 
@@ -90,6 +94,8 @@ public:
     unsigned int sk_sndbuf;
     unsigned sk_send_queued;
     unsigned sk_rmem;
+    /* SO_MAX_PACING_RATE, in bytes per second (~0UL is unlimited). Enforced by the fq qdisc. */
+    unsigned long sk_pacing_rate;
     int backlog;
     unsigned int shutdown_state;
 
@@ -111,6 +117,7 @@ public:
         pfi_init(&sock_pfi);
         sk_send_queued = 0;
         sk_rmem = 0;
+        sk_pacing_rate = ~0UL;
     }
 
     virtual ~socket()
@@ -205,7 +212,7 @@ public:
 
 #define SOL_ICMP   800
 #define SOL_TCP    6
-#define SOL_UDP    21
+#define SOL_UDP    17
 #define SOL_ICMPV6 58
 
 void socket_init(struct socket *socket);
@@ -395,7 +402,7 @@ static inline bool sock_charge_rmem_bytes(struct socket *sock, unsigned int byte
     {
         expected = queued;
         new_space = queued + bytes;
-        if (new_space > sock->sk_sndbuf)
+        if (new_space > sock->sk_rcvbuf)
             return false;
         queued = cmpxchg_relaxed(&sock->sk_rmem, expected, new_space);
     } while (queued != expected);
@@ -426,6 +433,18 @@ static inline void sock_discharge_rmem_pbf(struct socket *sock, struct packetbuf
 
 int sock_stream_error(struct socket *sock, int err, int flags);
 
+/**
+ * @brief Append a control message to a (kernel copy of a) msghdr, for recvmsg
+ *
+ * @param msg msghdr
+ * @param level Level (e.g SOL_SOCKET)
+ * @param type Type of control message
+ * @param data Payload
+ * @param len Length of the payload
+ * @return 0 (running out of space sets MSG_CTRUNC)
+ */
+int put_cmsg(struct msghdr *msg, int level, int type, void *data, int len);
+
 __END_CDECLS
 
 #endif
@@ -54,6 +54,19 @@ public:
     }
 
     inet_socket *get_socket(const socket_id &id, unsigned int flags, unsigned int inst = 0);
+
+    /**
+     * @brief Check if binding a socket to id would conflict with an already bound socket
+     * Sockets may only share an address if all of them have SO_REUSEPORT set, and the same
+     * owner. The bucket lock must be held.
+     *
+     * @param id Address we want to bind to
+     * @param sock Socket being bound
+     * @param flags GET_SOCKET_* flags, for matching
+     * @return True if it conflicts
+     */
+    bool bind_conflicts(const socket_id &id, const inet_socket *sock, unsigned int flags);
+
     bool add_socket(inet_socket *sock, unsigned int flags);
     bool remove_socket(inet_socket *sock, unsigned int flags);
 };
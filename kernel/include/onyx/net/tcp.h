@@ -92,6 +92,10 @@ struct tcp_header
 #define TCP_OPTION_SACK           (5)
 #define TCP_OPTION_TIMESTAMP      (8)
 
+#define TCP_OPTION_TIMESTAMP_LEN 10
+/* Timestamps on non-SYN segments go in as NOP NOP TS, for alignment */
+#define TCP_TIMESTAMP_ALIGNED_LEN 12
+
 #define TCP_GET_DATA_OFF(off) (off >> TCP_DATA_OFFSET_SHIFT)
 
 #ifdef __cplusplus
@@ -134,7 +138,9 @@ struct tcp_synack_options
 {
     u16 mss;
     u8 snd_wnd_shift;
-    u8 has_mss : 1, sacking : 1, has_window_scale : 1;
+    u8 has_mss : 1, sacking : 1, has_window_scale : 1, has_timestamp : 1;
+    /* The peer's timestamp option, if has_timestamp */
+    u32 ts_val, ts_ecr;
 };
 
 struct tcp_connreq
@@ -152,9 +158,13 @@ struct tcp_connreq
     struct packetbuf *tc_syndata;
     struct inet_route tc_route;
     struct tcp_synack_options tc_opts;
+    /* The connreq gets reaped if the handshake isn't done by then */
+    hrtime_t tc_expires;
     u32 tc_our_mss;
     u32 tc_rcv_nxt;
     u32 tc_iss;
+    u32 tc_ts_offset;
+    u8 tc_rcv_wscale;
     int tc_domain;
     int tc_dead : 1;
 };
@@ -164,6 +174,31 @@ struct tcp_sack_range
     unsigned int start, end;
 };
 
+/* What the retransmit timer is doing at the moment */
+enum tcp_timer_mode
+{
+    /* Retransmission timeout */
+    TCP_TIMER_RTO = 0,
+    /* RACK reordering window expiry. Segments may be deemed lost then. */
+    TCP_TIMER_REO,
+    /* Tail loss probe */
+    TCP_TIMER_TLP,
+};
+
+#define TCP_RTO_MIN     (200 * NS_PER_MS)
+#define TCP_RTO_MAX     (120 * NS_PER_SEC)
+#define TCP_RTO_INITIAL NS_PER_SEC
+/* Worst case delayed ACK timer, for the tail loss probe timeout */
+#define TCP_WC_DELACK (200 * NS_PER_MS)
+
+/* TS.Recent goes stale after 24 days of idleness, PAWS can't be trusted past that (RFC7323) */
+#define TCP_PAWS_IDLE (24UL * 24 * 3600 * NS_PER_SEC)
+
+/* Receive buffer autotuning starts at TCP_RCVBUF_INITIAL and grows up to TCP_RCVBUF_MAX, unless
+ * SO_RCVBUF was set. */
+#define TCP_RCVBUF_INITIAL 0x20000
+#define TCP_RCVBUF_MAX     0x1000000
+
 struct tcp_socket : public inet_socket
 {
     enum tcp_state state;
@@ -195,6 +230,9 @@ struct tcp_socket : public inet_socket
     int sacking : 1, sack_needs_send : 1;
 
     int retransmit_try{0};
+    u8 timer_mode{TCP_TIMER_RTO};
+    /* A tail loss probe was sent and we haven't heard back since */
+    u8 tlp_pending : 1 {0};
     struct clockevent retransmit_timer;
     struct clockevent delack_timer;
     struct list_head output_queue;
@@ -209,9 +247,46 @@ struct tcp_socket : public inet_socket
     unsigned int nr_sacks;
     int mss_for_ack;
 
+    /* RTT estimation (RFC6298), from segments that were never retransmitted */
+    hrtime_t srtt{0};
+    hrtime_t rttvar{0};
+    hrtime_t rto{TCP_RTO_INITIAL};
+    hrtime_t min_rtt{0};
+
+    /* RACK (RFC8985): send time and end sequence of the most recently sent segment that got
+     * delivered (ACK'd or SACK'd), and its RTT. */
+    hrtime_t rack_xmit_time{0};
+    u32 rack_end_seq{0};
+    hrtime_t rack_rtt{0};
+
+    /* RFC7323 timestamps. Our TSval is the millisecond clock plus ts_offset. ts_recent is the
+     * peer's last TSval (for echoing and PAWS), updated at ts_recent_stamp. */
+    u8 ts_ok : 1 {0};
+    u32 ts_offset{0};
+    u32 ts_recent{0};
+    hrtime_t ts_recent_stamp{0};
+
+    /* Receive side RTT estimate, from TSecr or from how long it takes to get a window's worth */
+    hrtime_t rcv_rtt{0};
+    u32 rcv_rtt_seq{0};
+    hrtime_t rcv_rtt_time{0};
+
+    /* Receive buffer autotuning: bytes the application read since rcvq_time, and how many it read
+     * in the last RTT */
+    u32 rcvq_copied{0};
+    u32 rcvq_space{0};
+    hrtime_t rcvq_time{0};
+
     struct list_head accept_queue;
-    struct list_head conn_queue;
+    /* Head of the connreq list on listeners, our node in the parent's accept_queue on children */
+    list_head_cpp<tcp_socket> conn_queue{this};
+    /* Both queues are bounded by the listen backlog. connqueue_len counts connreqs (SYN queue),
+     * acceptq_len counts sockets in accept_queue. */
     int connqueue_len;
+    int acceptq_len;
+    /* Last time we answered a SYN with a cookie. ACKs on the listener are only checked for
+     * cookies for a while after that. */
+    hrtime_t last_syncookie;
 };
 
 constexpr inline uint16_t tcp_header_length_to_data_off(uint16_t len)
@@ -243,6 +318,9 @@ enum tcp_drop_reason
     TCP_DROP_OOO_DUP,
     TCP_DROP_RST_ON_LISTEN,
     TCP_DROP_NO_RMEM,
+    TCP_DROP_LISTEN_OVERFLOW,
+    TCP_DROP_BAD_COOKIE,
+    TCP_DROP_PAWS,
 };
 
 static inline bool tcp_state_is_fl(struct tcp_socket *sock, int flags)
@@ -262,6 +340,11 @@ extern const inet_proto tcp_proto;
 bool validate_tcp_packet(const tcp_header *header, size_t size);
 int tcp_input(struct tcp_socket *sock, struct packetbuf *pbf);
 void tcp_stop_retransmit(struct tcp_socket *sock);
+void tcp_arm_timer(struct tcp_socket *sock, enum tcp_timer_mode mode, hrtime_t timeout);
+void tcp_rearm_timer(struct tcp_socket *sock);
+void tcp_retransmit_lost(struct tcp_socket *sock);
+void tcp_rack_recover(struct tcp_socket *sock);
+u32 tcp_ts_now(struct tcp_socket *sock);
 
 /*
  * The next routines deal with comparing 32 bit unsigned ints
@@ -282,7 +365,9 @@ static inline bool between(__u32 seq1, __u32 seq2, __u32 seq3)
 
 int tcp_send_ack(struct tcp_socket *sock);
 int tcp_output(struct tcp_socket *sock);
+int tcp_connreq_route(struct tcp_connreq *conn);
 int tcp_send_synack(struct tcp_connreq *conn);
+void tcp_listen_stop(struct tcp_socket *sock);
 void __tcp_send_rst(struct packetbuf *pbf, u32 seq, u32 ack_nr, int ack);
 void tcp_send_rst(struct tcp_socket *sock, struct packetbuf *pbf);
 void tcp_done_error(struct tcp_socket *sock, int err);
@@ -298,6 +383,7 @@ static inline u32 tcp_receive_window(const struct tcp_socket *tp)
 
 u32 tcp_select_initial_win(struct tcp_socket *tp);
 u8 tcp_calculate_win_scale(u32 win);
+u8 tcp_select_wscale(struct tcp_socket *tp);
 
 static inline u32 tcp_wnd_end(struct tcp_socket *tp)
 {
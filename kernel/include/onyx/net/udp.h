@@ -32,8 +32,13 @@ struct udp_packet
     struct udp_packet *next;
 };
 
-#define UDP_CORK  1
-#define UDP_ENCAP 100
+#define UDP_CORK    1
+#define UDP_ENCAP   100
+#define UDP_SEGMENT 103
+#define UDP_GRO     104
+
+/* Most datagrams a single UDP_SEGMENT send (or UDP_GRO receive) can carry */
+#define UDP_MAX_SEGMENTS 64
 
 #define UDP_ENCAP_ESPINUDP_NON_IKE 1
 #define UDP_ENCAP_ESPINUDP         2
@@ -68,12 +73,18 @@ class udp_socket : public inet_socket
     template <typename AddrType>
     ssize_t udp_sendmsg(const msghdr *msg, int flags, const inet_sock_address &dst);
 
+    ssize_t recvmsg_gro(msghdr *msg, int flags, ssize_t iovlen, packetbuf *buf);
+
     unsigned int wants_cork : 1;
+    /* UDP_GRO: hand back runs of same-sized datagrams from the same sender in one go */
+    unsigned int gro_enabled : 1;
+    /* UDP_SEGMENT: split sends into datagrams of this size */
+    u16 gso_size;
 
     inet_cork cork;
 
 public:
-    udp_socket() : wants_cork{0}, cork{SOCK_DGRAM}
+    udp_socket() : wants_cork{0}, gro_enabled{0}, gso_size{0}, cork{SOCK_DGRAM}
     {
         sock_ops = &udp_ops;
     }
@@ -88,6 +99,7 @@ public:
     ssize_t recvmsg(msghdr *msg, int flags);
 
     void rx_dgram(packetbuf *buf);
+    void deliver(packetbuf *buf);
 
     short poll(void *poll_file, short events);
 
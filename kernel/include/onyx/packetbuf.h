@@ -31,6 +31,11 @@ struct tcp_packetbuf_info
 {
     u32 seq, seq_len;
     u8 ack : 1, syn : 1, fin : 1, rst : 1;
+    /* Send side scoreboard: SACK'd by the peer, retransmitted at least once, deemed lost and
+     * waiting for a retransmission */
+    u8 sacked : 1, retrans : 1, lost : 1;
+    /* Time of the last (re)transmission */
+    u64 xmit_time;
 };
 
 struct packetbuf;
@@ -101,6 +106,8 @@ struct packetbuf
 
     unsigned int needs_csum : 1;
     unsigned int zero_copy : 1;
+    /* Shares its pages (headroom included) with another packetbuf, see packetbuf_clone */
+    unsigned int cloned : 1;
     int domain;
     unsigned int total_len;
 
@@ -124,6 +131,12 @@ struct packetbuf
     struct socket *sock;
     void (*dtor)(struct packetbuf *pbf);
 
+    /* Transmit scheduling state, filled in by qdisc_xmit */
+    unsigned long tx_pacing_rate;
+    u64 tx_enqueue_time;
+    unsigned int tx_len;
+    u32 tx_flow_hash;
+
 #ifdef __cplusplus
     /**
      * @brief Construct a new default packetbuf object.
@@ -132,7 +145,8 @@ struct packetbuf
     packetbuf()
         : refcount{1}, page_vec{}, phy_header{}, link_header{}, net_header{}, transport_header{},
           data{}, tail{}, end{}, buffer_start{}, csum_offset{nullptr}, csum_start{nullptr},
-          header_length{}, gso_size{}, gso_flags{}, needs_csum{0}, zero_copy{0}, domain{0}
+          header_length{}, gso_size{}, gso_flags{}, needs_csum{0}, zero_copy{0}, cloned{0},
+          domain{0}
     {
         route = {};
         sock = NULL;
@@ -318,6 +332,16 @@ __BEGIN_CDECLS
  */
 struct packetbuf *packetbuf_clone(struct packetbuf *original);
 
+/**
+ * @brief Clone a packetbuf, but give the clone its own copy of the linear area (the headers)
+ * The pages past the first one are still shared.
+ *
+ * @param original The original packetbuf.
+ * @param gfp GFP flags
+ * @return The new packetbuf, or NULL if we ran out of memory.
+ */
+struct packetbuf *pbf_copy_head(struct packetbuf *original, gfp_t gfp);
+
 static inline bool pbf_can_try_put(struct packetbuf *pbf)
 {
     /* Using put with other page vecs is bound to break something */
@@ -222,6 +222,29 @@ static inline struct page *alloc_page(unsigned long flags)
     return alloc_pages(0, flags);
 }
 
+/**
+ * @brief Allocate pages, preferably from a given node. Falls back to other nodes, by distance.
+ *
+ * @param nid Node
+ * @param order Order of the allocation
+ * @param flags GFP flags
+ * @return Allocated pages, or nullptr
+ */
+struct page *alloc_pages_node(int nid, unsigned int order, unsigned long flags);
+
+/**
+ * @brief Allocate pages from the nodes in nodemask, going through them in order of distance from
+ * nid. Only reclaims if none of them can satisfy the allocation.
+ *
+ * @param order Order of the allocation
+ * @param flags GFP flags
+ * @param nid Preferred node
+ * @param nodemask Nodes we may allocate from
+ * @return Allocated pages, or nullptr
+ */
+struct page *__alloc_pages_nodemask(unsigned int order, unsigned long flags, int nid,
+                                    unsigned long nodemask);
+
 __always_inline unsigned int pages2order(unsigned long pages)
 {
     if (pages == 1)
@@ -91,6 +91,16 @@ void paging_free_page_tables(struct mm_address_space *mm);
 bool paging_write_protect(void *addr, struct mm_address_space *mm);
 int vm_mmu_unmap(struct mm_address_space *as, void *addr, size_t pages, struct vm_area_struct *vma);
 
+/**
+ * @brief Clear a range of kernel PTEs, without flushing the TLB
+ * Page tables are left in place. The caller must flush the TLB (see mmu_invalidate_range) before
+ * the range gets mapped again.
+ *
+ * @param addr Start of the range
+ * @param pages Number of pages
+ */
+void vm_mmu_unmap_noflush(void *addr, size_t pages);
+
 /**
  * @brief Directly maps a page into the paging tables.
  *
@@ -110,14 +120,36 @@ void *x86_placement_map(unsigned long _phys);
 
 #endif
 
+/* Parent TLB invalidation, accumulated over a whole fork. Write-protecting the parent's ptes
+ * only needs a single shootdown, at the end. */
+struct mmu_fork_batch
+{
+    unsigned long start, end;
+};
+
+static inline void mmu_fork_batch_init(struct mmu_fork_batch *batch)
+{
+    batch->start = -1UL;
+    batch->end = 0;
+}
+
 /**
  * @brief Fork MMU page tables
  *
  * @param old_region Old vm_area_struct
  * @param addr_space Current address space
+ * @param batch Fork batch, for TLB invalidation of the old address space
  * @return 0 on success, negative error codes
  */
-int mmu_fork_tables(struct vm_area_struct *old_region, struct mm_address_space *addr_space);
+int mmu_fork_tables(struct vm_area_struct *old_region, struct mm_address_space *addr_space,
+                    struct mmu_fork_batch *batch);
+
+/**
+ * @brief Finish a fork batch, and invalidate the TLB for every pte that got write-protected
+ *
+ * @param batch Fork batch
+ */
+void mmu_fork_batch_end(struct mmu_fork_batch *batch);
 
 #define PAGE_PRESENT    (1 << 0)
 #define PAGE_GLOBAL     (1 << 1)
@@ -0,0 +1,97 @@
+/*
+ * Copyright (c) 2025 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the GPLv2 License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+#ifndef _ONYX_PERF_EVENT_H
+#define _ONYX_PERF_EVENT_H
+
+#include <onyx/mutex.h>
+#include <onyx/types.h>
+
+#include <uapi/perf_event.h>
+
+struct registers;
+
+/**
+ * @brief A hardware event, counting on a single CPU.
+ * Counting goes in periods of period events: the PMU counts up from -period and interrupts on
+ * overflow, at which point count gets bumped. The event count is count + however much we are into
+ * the current period.
+ */
+struct perf_event
+{
+    struct perf_event_attr attr;
+    unsigned int cpu;
+    /* Serializes enable/disable/reset and readers */
+    struct mutex lock;
+    bool enabled;
+    /* Hardware counter, assigned by the PMU. -1 if none. */
+    int hwc;
+    u64 period;
+    /* Events counted in past periods */
+    u64 count;
+
+    /* Sample ring. Written by the PMU interrupt, on cpu, read by read(). */
+    struct perf_sample *samples;
+    unsigned long nr_samples;
+    unsigned long head;
+    unsigned long tail;
+    u64 lost;
+};
+
+/**
+ * @brief A hardware PMU. All of the ops except the event mapping are called on the event's CPU,
+ * with irqs disabled.
+ */
+struct pmu
+{
+    const char *name;
+    /* Largest sample period we can program */
+    u64 max_period;
+
+    /**
+     * @brief Check if the PMU can count a PERF_COUNT_HW_* event
+     */
+    bool (*has_event)(u64 config);
+    /**
+     * @brief Assign a counter to the event and program it, stopped
+     *
+     * @return 0 on success, -EBUSY if we're out of counters
+     */
+    int (*add)(struct perf_event *ev);
+    /**
+     * @brief Stop the event and release its counter
+     */
+    void (*del)(struct perf_event *ev);
+    void (*start)(struct perf_event *ev);
+    void (*stop)(struct perf_event *ev);
+    /**
+     * @brief Restart the current period from scratch
+     */
+    void (*reset)(struct perf_event *ev);
+    /**
+     * @brief Read how far into the current period we are
+     */
+    u64 (*read)(struct perf_event *ev);
+};
+
+/**
+ * @brief Register the system's PMU
+ *
+ * @param pmu PMU
+ */
+void perf_register_pmu(struct pmu *pmu);
+
+/**
+ * @brief Account for a period's worth of events and take a sample, if it's a sampling event.
+ * Called by PMU drivers from the overflow interrupt (possibly an NMI).
+ *
+ * @param ev Event that overflowed
+ * @param regs Registers at the time of the overflow
+ */
+void perf_event_overflow(struct perf_event *ev, struct registers *regs);
+
+#endif
@@ -18,6 +18,16 @@ int platform_allocate_msi_interrupts(unsigned int num_vectors, bool addr64,
                                      struct pci_msi_data *data, unsigned int flags,
                                      unsigned int target_cpu);
 
+/**
+ * @brief Retarget an already allocated MSI to another cpu
+ * Only the address changes, the vector (data) stays the same.
+ *
+ * @param data MSI data, as returned by platform_allocate_msi_interrupts. Updated in place.
+ * @param target_cpu New target cpu
+ * @return 0 on success, negative error code
+ */
+int platform_msi_set_target(struct pci_msi_data *data, unsigned int target_cpu);
+
 int platform_install_irq(unsigned int irqn, struct interrupt_handler *h);
 void platform_mask_irq(unsigned int irq);
 
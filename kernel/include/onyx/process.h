@@ -98,6 +98,8 @@ struct signal_struct
     struct tty *ctty;
     struct itimer timers[ITIMER_COUNT];
     struct wait_queue wait_child_event;
+    /* signalfd readers and pollers wait here for new signals */
+    struct wait_queue signalfd_wq;
     struct sigqueue shared_signals;
     /* These utime and stime store the utime and stime of *dead* tasks (zombie or not) */
     seqlock_t stats_lock;
@@ -173,6 +175,9 @@ struct process
     /* Process personality */
     unsigned long personality;
 
+    /* NUMA memory policy, for mappings that don't have their own */
+    struct mempolicy mempolicy;
+
     /* This process' parent */
     struct process __rcu *parent;
 
@@ -381,6 +386,8 @@ static inline bool task_is_pgrp_leader(struct process *task)
 struct process *get_process_from_pid(pid_t pid);
 struct thread *process_fork_thread(thread_t *src, struct process *dest, unsigned int flags,
                                    unsigned long stack, unsigned long tls);
+pid_t process_spawn_clone(void (*entry)(void *), void *arg,
+                          bool (*keep_cloexec)(int fd, void *arg));
 int process_attach(struct process *tracer, struct process *tracee);
 struct process *process_find_tracee(struct process *tracer, pid_t pid);
 __attribute__((noreturn)) void process_exit_from_signal(int signum);
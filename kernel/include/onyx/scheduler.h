@@ -81,9 +81,19 @@ typedef struct thread
     /* Used by the block subsystem to plug up incoming requests */
     struct blk_plug *plug;
 
+    /* Filesystem journal handle this thread is running under, if any */
+    void *journal_info;
+
     struct registers *regs;
     unsigned int pagefault_disabled;
 
+    /* Priority inheritance (PI futexes). While boosted, pi_normal_prio holds the priority to go
+     * back to (-1 if not boosted) and pi_inherited_prio the one we got from our waiters.
+     * futex_pi_owned lists the PI futexes this thread owns. */
+    int pi_normal_prio;
+    int pi_inherited_prio;
+    struct list_head futex_pi_owned;
+
 #ifdef CONFIG_KCOV
     struct kcov_data *kcov_data;
 #endif
@@ -103,7 +113,8 @@ typedef struct thread
     thread()
         : refcount{}, canary{}, kernel_stack{}, kernel_stack_top{}, owner{}, entry{}, flags{}, id{},
           status{}, priority{}, cpu{}, next{}, prev_prio{}, next_prio{}, fpu_area{}, sem_prev{},
-          sem_next{}, lock{}, errno_val{}, addr_limit{}, ctid{}, cputime_info{}, aspace{}, plug{}
+          sem_next{}, lock{}, errno_val{}, addr_limit{}, ctid{}, cputime_info{}, aspace{}, plug{},
+          journal_info{}
 #ifdef __x86_64__
           ,
           fs{}, gs{}
@@ -117,6 +128,9 @@ typedef struct thread
 #endif
         active_mm = NULL;
         pagefault_disabled = 0;
+        pi_normal_prio = -1;
+        pi_inherited_prio = -1;
+        INIT_LIST_HEAD(&futex_pi_owned);
     }
 
     /**
@@ -146,6 +160,8 @@ typedef struct thread
 #define THREAD_SHOULD_DIE    (1 << 3)
 #define THREAD_ACTIVE        (1 << 4)
 #define THREAD_RUNNING       (1 << 5)
+/* Never migrated off thread->cpu (per-cpu kernel threads) */
+#define THREAD_PINNED (1 << 6)
 
 int sched_init(void);
 
@@ -209,6 +225,10 @@ void *sched_preempt_thread(void *current_stack);
 
 int sched_transition_to_user_thread(struct thread *thread);
 
+void sched_set_inherited_prio(struct thread *thread, int prio);
+
+void sched_set_priority(struct thread *thread, int prio);
+
 #define SCHED_NO_CPU_PREFERENCE (unsigned int) -1
 
 static inline bool sched_needs_resched(struct thread *thread)
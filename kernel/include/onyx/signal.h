@@ -236,6 +236,25 @@ bool notify_process_stop_cont(struct process *task, unsigned int exit_code);
 
 void force_sigsegv(int sig);
 
+/**
+ * @brief Check if any of the signals in set are pending for the current thread
+ * Blocked signals count, this is meant for signalfd.
+ *
+ * @param set Set of signals
+ * @return True if one of them is pending, else false
+ */
+bool signal_pending_in_set(const sigset_t *set);
+
+/**
+ * @brief Dequeue a pending signal that's in set, for the current thread
+ * Blocked signals count, this is meant for signalfd.
+ *
+ * @param set Set of signals
+ * @param info Filled with the signal's siginfo
+ * @return Signal number, or 0 if none of them are pending
+ */
+int signal_dequeue_set(const sigset_t *set, siginfo_t *info);
+
 /* Used when forcing signals, such that no one racing with us can change this signal while another
  * thread is trying to catch a fault */
 #define SA_IMMUTABLE 0x00800000
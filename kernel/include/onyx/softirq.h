@@ -17,7 +17,8 @@ enum softirq_vector
     SOFTIRQ_VECTOR_NETRX,
     SOFTIRQ_VECTOR_TASKLET,
     SOFTIRQ_VECTOR_BLOCK,
-    SOFTIRQ_VECTOR_RCU
+    SOFTIRQ_VECTOR_RCU,
+    SOFTIRQ_VECTOR_NR
 };
 
 void softirq_raise(enum softirq_vector vec);
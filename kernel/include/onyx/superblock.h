@@ -27,6 +27,9 @@ struct fs_mount;
 
 #define SB_FLAG_NODIRTY   (1 << 0)
 #define SB_FLAG_IN_MEMORY (1 << 1)
+/* The filesystem updates link counts in ->link and ->unlink itself (e.g so they land in the same
+ * journal transaction as the directory change), the VFS must not */
+#define SB_FLAG_FS_NLINK  (1 << 2)
 
 struct superblock
 {
@@ -39,6 +42,11 @@ struct superblock
     int (*statfs)(struct statfs *buf, struct superblock *sb);
     int (*umount)(struct mount *mnt);
     int (*shutdown)(struct superblock *sb);
+    /* Optional: called whenever an inode's metadata gets dirtied. May be called with spinlocks
+     * held. */
+    void (*dirty_inode)(struct inode *inode);
+    /* Optional: make an inode's metadata durable, after inode_sync (fsync, fdatasync) */
+    int (*fsync)(struct inode *inode);
     unsigned int s_block_size;
     struct blockdev *s_bdev;
     dev_t s_devnr;
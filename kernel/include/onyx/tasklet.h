@@ -27,7 +27,7 @@ struct tasklet
     }
 };
 
-void tasklet_run();
+bool tasklet_run(unsigned int budget);
 void tasklet_schedule(tasklet *t);
 
 #endif
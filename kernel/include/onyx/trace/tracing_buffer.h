@@ -13,54 +13,77 @@
 #include <onyx/types.h>
 #include <onyx/vm.h>
 
+#include <uapi/ktrace.h>
+
+struct vm_object;
+
+/**
+ * @brief Single-producer ring of trace records. The producer is the owning CPU (with irqs
+ * disabled), consumers may be anyone, including userspace through an mmap of the buffer's vmo.
+ * See struct ktrace_ring_header for the protocol.
+ */
 class tracing_buffer
 {
+    /* The header page, followed by the data area */
+    u8* mem_;
+    struct ktrace_ring_header* hdr_;
     u8* buf_;
-    size_t rd;
-    size_t wr;
     size_t buflen;
     size_t mask;
+    struct vm_object* vmo_;
+    /* The producer's state. The header is mapped writable by readers, so we never read these back
+     * from it, we only publish them there. */
+    u64 head_;
+    u64 lost_;
 
-    size_t overruns;
+    void copy_in(u64 pos, const u8* buf, size_t len);
+    void copy_out(u64 pos, u8* buf, size_t len) const;
+    bool make_room(u64 head, size_t len);
+    void release();
 
 public:
-    tracing_buffer(size_t len) : buflen{len}
+    tracing_buffer()
+        : mem_{nullptr}, hdr_{nullptr}, buf_{nullptr}, buflen{0}, mask{0}, vmo_{nullptr}, head_{0},
+          lost_{0}
     {
-        buf_ =
-            (u8*) vmalloc(vm_size_to_pages(len), VM_TYPE_REGULAR, VM_READ | VM_WRITE, GFP_KERNEL);
-        rd = wr = 0;
-
-        mask = len - 1;
     }
 
-    ~tracing_buffer()
-    {
-        // TODO
-    }
+    ~tracing_buffer();
 
-    bool full() const
-    {
-        return wr - rd == buflen;
-    }
+    /**
+     * @brief Allocate the buffer
+     *
+     * @param len Size of the data area, a power of 2
+     * @param mode KTRACE_RING_OVERWRITE or KTRACE_RING_DROP
+     * @param cpu CPU the buffer belongs to
+     * @return 0 on success, negative error codes
+     */
+    int init(size_t len, u32 mode, u32 cpu);
 
     bool empty() const
     {
-        return wr == rd;
+        return __atomic_load_n(&head_, __ATOMIC_ACQUIRE) ==
+               __atomic_load_n(&hdr_->tail, __ATOMIC_ACQUIRE);
     }
 
-    void read_no_consume(u8* buf, size_t len)
+    /**
+     * @brief Get the vmo backing the buffer (header page + data area), for mmap
+     *
+     * @return The vmo
+     */
+    struct vm_object* vmo() const
     {
-        size_t i = 0;
-        while (len--)
-        {
-            size_t j = (rd + i) & mask;
-            buf[i++] = buf_[j];
-        }
+        return vmo_;
     }
 
-    size_t read(u8* buf, size_t len);
-
-    void discard_next_record();
+    /**
+     * @brief Consume whole records into a user buffer
+     *
+     * @param ubuf User buffer
+     * @param len Length of the buffer
+     * @return Bytes read, or negative error code
+     */
+    ssize_t read(u8* ubuf, size_t len);
 
     void write(const u8* buf, size_t len);
 };
@@ -22,6 +22,16 @@ ssize_t strlen_user(const char *user);
 long get_user32(unsigned int *uaddr, unsigned int *dest);
 long get_user64(unsigned long *uaddr, unsigned long *dest);
 
+/**
+ * @brief Atomically compare-and-exchange a 32-bit value in user space
+ *
+ * @param uaddr User address
+ * @param expected Expected value. Gets the value that was actually there.
+ * @param newval Value to store if *uaddr == *expected
+ * @return 0 on success (whether or not the store happened), -EFAULT
+ */
+long cmpxchg_user32(unsigned int *uaddr, unsigned int *expected, unsigned int newval);
+
 #ifdef __cplusplus
 }
 #endif
@@ -16,6 +16,7 @@
 
 #include <onyx/interval_tree.h>
 #include <onyx/list.h>
+#include <onyx/mm/mempolicy.h>
 #include <onyx/mm_address_space.h>
 #include <onyx/mutex.h>
 #include <onyx/paging.h>
@@ -130,6 +131,7 @@ struct vm_area_struct
     struct interval_tree_node vm_objhead;
     struct anon_vma *anon_vma;
     struct list_head anon_vma_node;
+    struct mempolicy vm_policy;
 };
 
 static inline unsigned long vma_pages(const struct vm_area_struct *vma)
@@ -254,6 +256,24 @@ void *vmalloc(size_t pages, int type, int perms, unsigned int gfp_flags);
  */
 void vfree(void *ptr);
 
+/**
+ * @brief Allocate a kernel stack
+ * Stacks are surrounded by guard pages (see VM_TYPE_STACK), and recycled through a per-cpu cache.
+ *
+ * @param pages Size of the stack, in pages
+ * @param gfp_flags GFP flags
+ * @return A pointer to the base of the stack, or NULL with errno set on failure.
+ */
+void *vmalloc_stack(size_t pages, unsigned int gfp_flags);
+
+/**
+ * @brief Free a kernel stack allocated by vmalloc_stack
+ *
+ * @param stack Base of the stack
+ * @param pages Size of the stack, in pages
+ */
+void vfree_stack(void *stack, size_t pages);
+
 bool is_vmalloc_addr(void *ptr);
 
 /**
@@ -58,6 +58,8 @@ void apic_send_ipi(uint32_t id, uint32_t type, uint32_t page,
 );
 void apic_send_ipi_all(uint32_t type, uint32_t page);
 void lapic_send_eoi(void);
+void lapic_write(uint32_t addr, uint32_t val);
+uint32_t lapic_read(uint32_t addr);
 uint32_t apic_get_lapic_id(unsigned int cpu);
 void apic_set_lapic_id(unsigned int cpu, uint32_t lapic_id);
 volatile uint32_t *apic_get_lapic(unsigned int cpu);
@@ -24,6 +24,19 @@
 #define IA32_MISC_ENABLE  0x000001a0
 #define IA32_X2APIC_BASE  0x00000800
 
+/* Architectural perfmon */
+#define IA32_PERFEVTSEL0            0x00000186
+#define IA32_PMC0                   0x000000c1
+#define IA32_PERF_GLOBAL_STATUS     0x0000038e
+#define IA32_PERF_GLOBAL_CTRL       0x0000038f
+#define IA32_PERF_GLOBAL_STATUS_RST 0x00000390
+
+/* AMD core performance counters (legacy, and PerfCtrExtCore's, interleaved CTL/CTR) */
+#define AMD_MSR_PERF_EVTSEL0  0xc0010000
+#define AMD_MSR_PERF_CTR0     0xc0010004
+#define AMD_MSR_PERF_CTL0_EXT 0xc0010200
+#define AMD_MSR_PERF_CTR0_EXT 0xc0010201
+
 #define IA32_MISC_ENABLE_FAST_STRINGS_ENABLE      (1 << 0)
 #define IA32_MISC_ENABLE_AUTO_TCC_ENABLE          (1 << 3)
 #define IA32_MISC_ENABLE_PM_AVAIALBLE             (1 << 7)
@@ -0,0 +1,42 @@
+/*
+ * Copyright (c) 2025 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the GPLv2 License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+#ifndef _ONYX_X86_NUMA_H
+#define _ONYX_X86_NUMA_H
+
+#include <onyx/types.h>
+
+#ifdef CONFIG_ACPI
+
+/**
+ * @brief Parse the NUMA topology out of the SRAT and SLIT. Needs the RSDP and the physical
+ * memory map, and must run before page_init.
+ */
+void x86_numa_init();
+
+/**
+ * @brief Get the node of a local APIC
+ *
+ * @param apic_id APIC id
+ * @return Node id, 0 if the SRAT didn't say
+ */
+int x86_numa_apic_to_node(u32 apic_id);
+
+#else
+
+static inline void x86_numa_init()
+{
+}
+
+static inline int x86_numa_apic_to_node(u32 apic_id)
+{
+    return 0;
+}
+
+#endif
+
+#endif
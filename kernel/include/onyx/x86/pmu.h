@@ -0,0 +1,21 @@
+/*
+ * Copyright (c) 2025 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the GPLv2 License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+#ifndef _ONYX_X86_PMU_H
+#define _ONYX_X86_PMU_H
+
+struct registers;
+
+/**
+ * @brief Handle a PMU NMI
+ *
+ * @param regs Registers at the time of the NMI
+ * @return True if it was ours, else false
+ */
+bool x86_pmu_handle_nmi(struct registers *regs);
+
+#endif
@@ -332,12 +332,35 @@ void write_config(const device_address &addr, uint64_t value, uint16_t off, size
 void register_driver(struct driver *driver);
 } // namespace pci
 
+/* Spread a device's vectors over the cpus, for devices with a queue per cpu (or per group of
+ * cpus). The spread vectors are managed: their affinity is fixed, and userspace can't move them. */
+struct pci_irq_affinity
+{
+    /* Vectors at the start that don't get spread (e.g an admin queue's). These go anywhere. */
+    unsigned int pre_vectors;
+};
+
 int pci_enable_msix(pci::pci_device *dev, unsigned int min_vecs, unsigned int max_vecs,
-                    unsigned int flags);
+                    unsigned int flags, const struct pci_irq_affinity *affd);
 
 int pci_alloc_irqs(pci::pci_device *dev, unsigned int min_vecs, unsigned int max_vecs,
                    unsigned int flags);
 
+/**
+ * @brief Allocate IRQ vectors, spreading them over the cpus
+ * Only MSI-X can target vectors individually. MSI and INTx fallbacks get a single target, like
+ * pci_alloc_irqs.
+ *
+ * @param dev PCI device
+ * @param min_vecs Minimum number of vectors
+ * @param max_vecs Maximum number of vectors
+ * @param flags PCI_IRQ_* flags
+ * @param affd How to spread the vectors
+ * @return 0 on success, negative error code
+ */
+int pci_alloc_irqs_affinity(pci::pci_device *dev, unsigned int min_vecs, unsigned int max_vecs,
+                            unsigned int flags, const struct pci_irq_affinity *affd);
+
 #define PCI_IRQ_INTX (1 << 0)
 #define PCI_IRQ_MSI  (1 << 1)
 #define PCI_IRQ_MSIX (1 << 2)
@@ -350,4 +373,13 @@ int pci_install_irq(pci::pci_device *dev, unsigned int irq, irq_t handler, unsig
 
 int pci_get_nr_vectors(pci::pci_device *dev);
 
+/**
+ * @brief Get the cpus a vector is delivered to
+ *
+ * @param dev PCI device
+ * @param vec Vector (device-relative)
+ * @return The vector's affinity, or nullptr if unknown
+ */
+const struct cpumask *pci_irq_get_affinity(pci::pci_device *dev, unsigned int vec);
+
 #endif
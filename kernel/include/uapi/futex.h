@@ -10,6 +10,8 @@
 #ifndef _UAPI_FUTEX_H
 #define _UAPI_FUTEX_H
 
+#include <stdint.h>
+
 #define FUTEX_WAIT            0
 #define FUTEX_WAKE            1
 #define FUTEX_FD              2
@@ -28,4 +30,47 @@
 #define FUTEX_CLOCK_REALTIME 256
 #define FUTEX_OP_MASK        ~(FUTEX_PRIVATE_FLAG | FUTEX_CLOCK_REALTIME)
 
+/* FUTEX_WAIT_BITSET/FUTEX_WAKE_BITSET, FUTEX_WAIT and FUTEX_WAKE use this bitset */
+#define FUTEX_BITSET_MATCH_ANY 0xffffffff
+
+/* PI futexes: the futex word holds the owner's TID, plus these bits */
+#define FUTEX_WAITERS    0x80000000
+#define FUTEX_OWNER_DIED 0x40000000
+#define FUTEX_TID_MASK   0x3fffffff
+
+/* FUTEX_WAKE_OP: val3 is FUTEX_OP(op, oparg, cmp, cmparg) */
+#define FUTEX_OP_SET  0 /* uaddr2 = oparg */
+#define FUTEX_OP_ADD  1 /* uaddr2 += oparg */
+#define FUTEX_OP_OR   2 /* uaddr2 |= oparg */
+#define FUTEX_OP_ANDN 3 /* uaddr2 &= ~oparg */
+#define FUTEX_OP_XOR  4 /* uaddr2 ^= oparg */
+
+/* Use (1 << oparg) as the operand */
+#define FUTEX_OP_OPARG_SHIFT 8
+
+#define FUTEX_OP_CMP_EQ 0
+#define FUTEX_OP_CMP_NE 1
+#define FUTEX_OP_CMP_LT 2
+#define FUTEX_OP_CMP_LE 3
+#define FUTEX_OP_CMP_GT 4
+#define FUTEX_OP_CMP_GE 5
+
+#define FUTEX_OP(op, oparg, cmp, cmparg) \
+    (((op & 0xf) << 28) | ((cmp & 0xf) << 24) | ((oparg & 0xfff) << 12) | (cmparg & 0xfff))
+
+/* futex_waitv(2) */
+#define FUTEX_WAITV_MAX 128
+
+/* futex_waitv.flags: the size of the futex (only 32-bit ones are supported), and
+ * FUTEX_PRIVATE_FLAG */
+#define FUTEX_32 2
+
+struct futex_waitv
+{
+    uint64_t val;
+    uint64_t uaddr;
+    uint32_t flags;
+    uint32_t __reserved;
+};
+
 #endif
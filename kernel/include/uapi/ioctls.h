@@ -95,6 +95,9 @@
 #define SIOGETMAC       0x9004
 #define SIOGETIFNAME    0x9005
 #define SIOGETINDEX     0x9006
+#define SIOSETDROPINJ   0x9007
+#define SIOSETQDISC     0x9008
+#define SIOGETQDISC     0x9009
 
 #define SIOCGIFNAME  0x8910
 #define SIOCGIFCONF  0x8912
@@ -143,6 +146,23 @@ struct winsize
 #define N_SYNC_PPP     14
 #define N_HCI          15
 
+/* SIOSETDROPINJ: drop burst out of every `every` packets sent on the interface. For testing
+ * loss recovery, every = 0 turns it off. */
+struct if_drop_inject
+{
+    unsigned int every;
+    unsigned int burst;
+};
+
+/* SIOSETQDISC/SIOGETQDISC: the interface's packet scheduler, by name ("noqueue", "pfifo_fast",
+ * "fq_codel", "fq"). */
+#define IF_QDISC_NAMESIZE 16
+
+struct if_qdisc
+{
+    char name[IF_QDISC_NAMESIZE];
+};
+
 #ifdef __is_onyx_kernel
 #include <uapi/netinet.h>
 
@@ -47,6 +47,36 @@ struct ktrace_getevid_format
 #define KTRACE_ENABLE_STATUS_ENABLED  1
 #define KTRACE_ENABLE_STATUS_DISABLED 0
 
+/* ktrace_enable flags. The buffer mode only applies when tracing gets enabled for the first time,
+ * i.e when the per-cpu buffers get created. */
+#define KTRACE_ENABLE_DROP (1 << 16)
+
+#define KTRACE_RING_OVERWRITE 0
+#define KTRACE_RING_DROP      1
+
+/**
+ * @brief Header of a per-cpu trace buffer, at offset 0 of its mmap. The data area follows it, at
+ * data_offset.
+ *
+ * head and tail are free-running byte counts; a record at position pos starts at data_offset +
+ * (pos & (data_size - 1)), and may wrap around the end of the data area. The kernel only appends
+ * at head. Readers consume a record by loading tail, copying the record out and then
+ * compare-and-swapping tail to tail + record size. In KTRACE_RING_OVERWRITE mode, the kernel makes
+ * room by pushing tail forward itself (counting the overwritten records in lost), so a failed
+ * compare-and-swap means the copy may be torn and must be discarded. In KTRACE_RING_DROP mode, new
+ * records that don't fit are dropped and counted in lost.
+ */
+struct ktrace_ring_header
+{
+    __u64 head;
+    __u64 tail;
+    __u64 lost;
+    __u64 data_offset;
+    __u64 data_size;
+    __u32 mode;
+    __u32 cpu;
+};
+
 #ifndef TRACE_EVENT_TIME
 #define TRACE_EVENT_TIME (1 << 1)
 #endif
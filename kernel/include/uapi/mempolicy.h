@@ -0,0 +1,30 @@
+/*
+ * Copyright (c) 2025 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#ifndef _UAPI_MEMPOLICY_H
+#define _UAPI_MEMPOLICY_H
+
+/* Memory policies, same numbers as Linux's */
+/* Use the process' policy (or, for the process' policy, MPOL_LOCAL) */
+#define MPOL_DEFAULT    0
+/* Allocate from the (first) node in the nodemask, fall back to others */
+#define MPOL_PREFERRED  1
+/* Only allocate from the nodes in the nodemask */
+#define MPOL_BIND       2
+/* Spread pages over the nodes in the nodemask, by their offset in the mapping */
+#define MPOL_INTERLEAVE 3
+/* Allocate from the node of the CPU that faults the page in (first-touch) */
+#define MPOL_LOCAL      4
+#define MPOL_MAX        5
+
+/* get_mempolicy flags */
+/* Return the node instead of the policy (only with MPOL_F_ADDR) */
+#define MPOL_F_NODE (1 << 0)
+/* Look up the policy of the mapping at addr */
+#define MPOL_F_ADDR (1 << 1)
+
+#endif
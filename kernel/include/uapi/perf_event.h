@@ -0,0 +1,67 @@
+/*
+ * Copyright (c) 2025 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#ifndef _UAPI_PERF_EVENT_H
+#define _UAPI_PERF_EVENT_H
+
+#include <onyx/types.h>
+
+#include <uapi/ioctl.h>
+
+#define PERF_TYPE_HARDWARE 0
+
+/* Hardware events, same numbers as Linux's */
+#define PERF_COUNT_HW_CPU_CYCLES    0
+#define PERF_COUNT_HW_INSTRUCTIONS  1
+#define PERF_COUNT_HW_CACHE_MISSES  3
+#define PERF_COUNT_HW_BRANCH_MISSES 5
+#define PERF_COUNT_HW_MAX           6
+
+/* perf_event_attr flags */
+/* Create the event disabled, PERF_EVENT_IOC_ENABLE starts it */
+#define PERF_ATTR_DISABLED       (1 << 0)
+#define PERF_ATTR_EXCLUDE_USER   (1 << 1)
+#define PERF_ATTR_EXCLUDE_KERNEL (1 << 2)
+
+/**
+ * @brief Describes the event to perf_event_open. A sample_period of 0 makes a counting event:
+ * read() returns the count, as a __u64. Otherwise, the counter interrupts every sample_period
+ * events and read() returns struct perf_samples.
+ */
+struct perf_event_attr
+{
+    __u32 type;
+    /* sizeof(struct perf_event_attr) */
+    __u32 size;
+    __u64 config;
+    __u64 sample_period;
+    __u64 flags;
+};
+
+#define PERF_SAMPLE_MAX_STACK 32
+
+struct perf_sample
+{
+    /* Number of events this sample stands for */
+    __u64 period;
+    __u32 cpu;
+    /* ips[0] is where the counter overflowed, the rest is the (kernel) call chain */
+    __u32 nr_ips;
+    __u64 ips[PERF_SAMPLE_MAX_STACK];
+};
+
+#define PERF_FLAG_FD_CLOEXEC (1UL << 3)
+
+#define PERF_EVENT_IOC_ENABLE  _IO('$', 0)
+#define PERF_EVENT_IOC_DISABLE _IO('$', 1)
+#define PERF_EVENT_IOC_RESET   _IO('$', 3)
+/* Get the event count of a sampling event */
+#define PERF_EVENT_IOC_COUNT _IOR('$', 16, __u64)
+/* Get the number of samples dropped because the sample buffer was full */
+#define PERF_EVENT_IOC_LOST _IOR('$', 17, __u64)
+
+#endif
@@ -0,0 +1,61 @@
+/*
+ * Copyright (c) 2025 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#ifndef _UAPI_SPAWN_H
+#define _UAPI_SPAWN_H
+
+#include <stdint.h>
+
+/* spawn(2): create a process straight from an executable, posix_spawn style. The child never gets
+ * a copy of the parent's address space, and only gets the file descriptors it can still use after
+ * exec. */
+
+/* File actions, run in order in the child before exec */
+#define SPAWN_FA_CLOSE  0
+#define SPAWN_FA_DUP2   1
+#define SPAWN_FA_OPEN   2
+#define SPAWN_FA_CHDIR  3
+#define SPAWN_FA_FCHDIR 4
+
+struct spawn_file_action
+{
+    /* SPAWN_FA_* */
+    int type;
+    /* Target fd (CLOSE, DUP2, OPEN) or directory fd (FCHDIR) */
+    int fd;
+    /* Source fd (DUP2) */
+    int srcfd;
+    /* open(2) flags and mode (OPEN) */
+    int oflag;
+    unsigned int mode;
+    /* Path (OPEN, CHDIR) */
+    const char *path;
+};
+
+/* spawn_args.flags */
+#define SPAWN_SETPGROUP  (1 << 0)
+#define SPAWN_SETSIGMASK (1 << 1)
+#define SPAWN_SETSIGDEF  (1 << 2)
+#define SPAWN_SETSID     (1 << 3)
+
+#define SPAWN_MAX_FILE_ACTIONS 1024
+
+struct spawn_args
+{
+    const char *path;
+    char *const *argv;
+    char *const *envp;
+    const struct spawn_file_action *actions;
+    unsigned int nr_actions;
+    unsigned int flags;
+    /* Signal n is bit (n - 1) */
+    uint64_t sigmask;
+    uint64_t sigdefault;
+    int pgroup;
+};
+
+#endif
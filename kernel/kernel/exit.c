@@ -210,6 +210,7 @@ __attribute__((noreturn)) void do_exit(unsigned int exit_code)
     current->exit_code = exit_code;
     current->flags |= PROCESS_EXITING;
 
+    futex_exit_pi();
     exit_do_ctid();
     exit_files(current);
     exit_fs(current);
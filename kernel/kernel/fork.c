@@ -56,6 +56,11 @@ struct clone_args
     int __user *child_tid;
     unsigned long tls;
     unsigned long stack;
+    /* If set, the child starts in the kernel, at kentry(karg), instead of returning to userspace */
+    void (*kentry)(void *);
+    void *karg;
+    /* Filter for O_CLOEXEC fds, see copy_file_descriptors_filter */
+    bool (*keep_cloexec)(int fd, void *arg);
 };
 
 void process_copy_current_sigmask(struct process *dest)
@@ -69,7 +74,7 @@ static void ioctx_init(struct ioctx *ctx)
     ctx->refs = REFCOUNT_INIT(1);
 }
 
-static int dup_files(struct process *child)
+static int dup_files(struct process *child, struct clone_args *args)
 {
     int err;
     struct ioctx *ctx = kmalloc(sizeof(struct ioctx), GFP_KERNEL);
@@ -78,7 +83,7 @@ static int dup_files(struct process *child)
 
     ioctx_init(ctx);
     child->ctx = ctx;
-    err = copy_file_descriptors(child, current->ctx);
+    err = copy_file_descriptors_filter(child, current->ctx, args->keep_cloexec, args->karg);
     if (err)
     {
         kfree(ctx);
@@ -144,6 +149,7 @@ static int dup_signal(struct process *child)
     child->sig = sig;
     spin_lock_init(&sig->pgrp_lock);
     init_wait_queue_head(&sig->wait_child_event);
+    init_wait_queue_head(&sig->signalfd_wq);
     sigqueue_init(&sig->shared_signals);
     seqlock_init(&sig->stats_lock);
     sig->cutime = sig->cstime = sig->stime = sig->utime = 0;
@@ -175,6 +181,19 @@ static void process_append_children(struct process *parent, struct process *chil
     list_add_tail(&children->sibbling_node, &parent->children_head);
 }
 
+static struct thread *kernel_clone_kthread(struct process *child, struct clone_args *args)
+{
+    struct thread *thread = sched_create_thread(args->kentry, THREAD_KERNEL, args->karg);
+    if (!thread)
+        return NULL;
+
+    thread->owner = child;
+    thread->aspace = child->address_space;
+    child->thr = thread;
+    thread_get(thread);
+    return thread;
+}
+
 static pid_t kernel_clone(struct clone_args *args)
 {
     pid_t pid;
@@ -212,7 +231,7 @@ static pid_t kernel_clone(struct clone_args *args)
         child->ctx = current->ctx;
     }
     else
-        err = dup_files(child);
+        err = dup_files(child, args);
     if (err < 0)
         goto err_put_pid;
 
@@ -269,7 +288,8 @@ static pid_t kernel_clone(struct clone_args *args)
 
     /* Fork and create the new thread */
     struct thread *new_thread =
-        process_fork_thread(to_be_forked, child, flags, args->stack, args->tls);
+        args->kentry ? kernel_clone_kthread(child, args)
+                     : process_fork_thread(to_be_forked, child, flags, args->stack, args->tls);
     if (!new_thread)
         goto err_put_mm;
 
@@ -281,6 +301,7 @@ static pid_t kernel_clone(struct clone_args *args)
 
     /* Inherit the parent process' properties */
     child->personality = current->personality;
+    child->mempolicy = current->mempolicy;
     child->vdso = current->vdso;
     process_inherit_creds(child, current);
 
@@ -418,3 +439,26 @@ int sys_newclone(unsigned long clone_flags, unsigned long newsp, int __user *par
 
     return kernel_clone(&args);
 }
+
+/**
+ * @brief Create a process for spawn()
+ * The child shares our address space until it execs or exits (like vfork, we wait for that), and
+ * starts in the kernel at entry(arg).
+ *
+ * @param entry Kernel entry point for the child
+ * @param arg Argument for entry and keep_cloexec
+ * @param keep_cloexec Filter for O_CLOEXEC fds (see copy_file_descriptors_filter)
+ * @return The child's pid, or negative error code
+ */
+pid_t process_spawn_clone(void (*entry)(void *), void *arg, bool (*keep_cloexec)(int fd, void *arg))
+{
+    struct clone_args args = {
+        .exit_signal = SIGCHLD,
+        .flags = CLONE_VM | CLONE_VFORK,
+        .kentry = entry,
+        .karg = arg,
+        .keep_cloexec = keep_cloexec,
+    };
+
+    return kernel_clone(&args);
+}
@@ -361,6 +361,7 @@ static const struct inode_operations buffer_ino_ops = {};
 int blkdev_init(struct blockdev *blk)
 {
     blk->block_size = blk->sector_size;
+    blk_iostats_init(&blk->stats);
     auto ex = dev_register_blockdevs(0, 1, 0, &buffer_ops, cul::string{blk->name});
     if (ex.has_error())
         return ex.error();
@@ -407,6 +408,7 @@ int blkdev_init(struct blockdev *blk)
         list_add_tail(&blk->partition_head, &parent->partition_list);
     }
 
+    blk_stats_add_dev(blk);
     return 0;
 }
 
@@ -423,6 +425,8 @@ int bio_submit_request(struct blockdev *dev, struct bio_req *req)
         return -EIO;
     else if (unlikely(result == BIO_NEEDS_BOUNCE))
     {
+        /* Whoever waits on the original bio can't see which queue the bounce went to */
+        req->flags &= ~BIO_REQ_POLLED;
         req = bio_bounce(req, GFP_NOIO);
         if (!req)
             return -ENOMEM;
@@ -431,6 +435,74 @@ int bio_submit_request(struct blockdev *dev, struct bio_req *req)
     return dev->submit_request(dev, req);
 }
 
+/**
+ * @brief Get direct access to the page backing a sector
+ * Only memory-backed devices support this. The page stays valid for as long as the device
+ * exists, and loads and stores to it are I/O to the device.
+ *
+ * @param dev Block device (or partition)
+ * @param sector Sector, relative to dev
+ * @param page Pointer to the page [out]
+ * @param offset Offset of the sector in the page [out]
+ * @return 0 on success, -EOPNOTSUPP if the device can't, negative error codes
+ */
+int blkdev_direct_access(struct blockdev *dev, sector_t sector, struct page **page,
+                         unsigned int *offset)
+{
+    if (blkdev_is_partition(dev))
+    {
+        sector += dev->offset / dev->sector_size;
+        dev = dev->actual_blockdev;
+    }
+
+    if (!dev->direct_access)
+        return -EOPNOTSUPP;
+
+    if (sector >= dev->nr_sectors)
+        return -ERANGE;
+
+    return dev->direct_access(dev, sector, page, offset);
+}
+
+/**
+ * @brief Flush a block device's volatile write cache
+ * Every write that completed before the call is on stable storage once this returns. A no-op for
+ * devices without a volatile write cache.
+ *
+ * @param dev Block device (or partition)
+ * @return 0 on success, negative error codes
+ */
+int blkdev_flush(struct blockdev *dev)
+{
+    struct blockdev *disk = blkdev_is_partition(dev) ? dev->actual_blockdev : dev;
+
+    if (!disk->bdev_queue_properties.volatile_write_cache)
+        return 0;
+
+    struct bio_req *bio = bio_alloc(GFP_NOIO, 0);
+    if (!bio)
+        return -ENOMEM;
+
+    bio->flags = BIO_REQ_FLUSH_OP;
+    bio->sector_number = 0;
+    int st = bio_submit_req_wait(dev, bio);
+    bio_put(bio);
+    return st;
+}
+
+/* Poll queues have no interrupt, so we reap the completions ourselves until ours shows up */
+static void bio_poll_wait(struct io_queue *queue, u32 *flags)
+{
+    while (!(__atomic_load_n(flags, __ATOMIC_ACQUIRE) & BIO_REQ_DONE))
+    {
+        if (!queue->poll())
+            cpu_relax();
+
+        if (sched_needs_resched(get_current_thread()))
+            sched_yield();
+    }
+}
+
 static void bio_submit_sync_end_io(struct bio_req *req)
 {
     u32 *flags = (u32 *) req->b_private;
@@ -457,13 +529,18 @@ int bio_submit_req_wait(struct blockdev *dev, struct bio_req *req)
     if (st < 0)
         return st;
 
-    wait_for(
-        &flags,
-        [](void *pflags) -> bool {
-            u32 fl = *(u32 *) pflags;
-            return fl & BIO_REQ_DONE;
-        },
-        WAIT_FOR_FOREVER, 0);
+    if (req->b_poll_queue)
+        bio_poll_wait(req->b_poll_queue, &flags);
+    else
+    {
+        wait_for(
+            &flags,
+            [](void *pflags) -> bool {
+                u32 fl = *(u32 *) pflags;
+                return fl & BIO_REQ_DONE;
+            },
+            WAIT_FOR_FOREVER, 0);
+    }
 
     if (flags & (BIO_REQ_EIO | BIO_REQ_NOT_SUPP))
         return -EIO;
@@ -557,7 +634,7 @@ __init static void bio_cache_init()
 
 static struct slab_cache *bio_pick_cache(size_t nr_vecs)
 {
-    DCHECK(nr_vecs != 0);
+    /* Data-less bios (flushes) get the smallest cache too */
     if (nr_vecs < 2)
         return bio_cache_inline[0];
     size_t order = ilog2(nr_vecs - 1) + 1;
@@ -710,8 +787,10 @@ void bio_queue_pending_req(struct request *req)
 /**
  * @brief Handle block IO completion (called from softirqs)
  *
+ * @param budget Maximum number of requests to complete
+ * @return True if there are still requests to complete
  */
-void block_handle_completion()
+bool block_handle_completion(unsigned int budget)
 {
     DEFINE_LIST(pending_queues);
     DEFINE_LIST(pending_reqs);
@@ -723,10 +802,22 @@ void block_handle_completion()
 
     list_for_every_safe (&pending_reqs)
     {
+        if (budget == 0)
+            break;
         struct request *req = container_of(l, struct request, r_queue_list_node);
         list_remove(&req->r_queue_list_node);
         req->r_queue->do_complete(req);
         data->completed_reqs++;
+        budget--;
+    }
+
+    bool more = !list_is_empty(&pending_reqs);
+    if (more)
+    {
+        /* Out of budget, the rest goes back to the front of the line */
+        flags = local_lock_irqsave(&data->lock);
+        list_splice(&pending_reqs, &data->pending_reqs);
+        local_unlock_irqrestore(&data->lock, flags);
     }
 
     list_for_every_safe (&pending_queues)
@@ -737,6 +828,8 @@ void block_handle_completion()
         queue->restart_sq();
         data->completed_sq++;
     }
+
+    return more;
 }
 
 /**
@@ -922,6 +1015,7 @@ static void bdev_teardown(struct blockdev *bdev)
     /* TODO: Currently, we're leaking blockdevs. This is /okay/ for the time being, but it really
      * shouldn't be the case. We need to handle device teardown. */
     list_remove(&bdev->partition_head);
+    blk_stats_remove_dev(bdev);
     CHECK(dev_unregister_dev(bdev->dev, true) == 0);
     bdev_sync(bdev);
 }
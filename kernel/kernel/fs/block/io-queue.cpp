@@ -16,10 +16,52 @@
 void io_queue::complete_request(struct request *req)
 {
     used_entries_--;
+    blk_account_done(req);
+
+    if (req->r_flags & BIO_REQ_POLLED)
+    {
+        /* Someone's spinning on this one, poll() completes it */
+        list_add_tail(&req->r_queue_list_node, &polled_done_);
+        return;
+    }
+
     bio_queue_pending_req(req);
     set_pending();
 }
 
+/**
+ * @brief Poll the queue for completions
+ * Completes polled requests in the caller's context, instead of the block softirq.
+ *
+ * @return Number of requests completed
+ */
+unsigned int io_queue::poll()
+{
+    DEFINE_LIST(done);
+    unsigned int nr = 0;
+
+    if (!poll_cq())
+        return 0;
+
+    {
+        scoped_lock<spinlock, true> g{lock_};
+        list_splice_tail_init(&polled_done_, &done);
+        /* Entries got freed up, let anyone waiting in line in */
+        if (!list_is_empty(&req_list_))
+            __restart_queue();
+    }
+
+    list_for_every_safe (&done)
+    {
+        struct request *req = list_head_to_request(l);
+        list_remove(&req->r_queue_list_node);
+        do_complete(req);
+        nr++;
+    }
+
+    return nr;
+}
+
 /**
  * @brief Submits a request
  *
@@ -29,6 +71,9 @@ int io_queue::submit_request(struct request *req)
 {
     scoped_lock<spinlock, true> g{lock_};
     req->r_queue = this;
+    if (!owner_) [[unlikely]]
+        owner_ = req->r_bdev;
+    blk_account_start(req);
 
     if (used_entries_ < nr_entries_ && list_is_empty(&req_list_))
     {
@@ -115,6 +160,14 @@ void io_queue::__restart_queue()
 void io_queue::submit_batch(struct list_head *req_list, u32 nr_reqs)
 {
     scoped_lock<spinlock, true> g{lock_};
+    list_for_every (req_list)
+    {
+        struct request *req = list_head_to_request(l);
+        if (!owner_) [[unlikely]]
+            owner_ = req->r_bdev;
+        blk_account_start(req);
+    }
+
     list_splice_tail_init(req_list, &req_list_);
     if (nr_entries_ - used_entries_ > 0)
         __restart_queue();
@@ -8,7 +8,10 @@
 #include <onyx/block.h>
 #include <onyx/block/blk_plug.h>
 #include <onyx/block/io-queue.h>
+#include <onyx/block/multiqueue.h>
 #include <onyx/block/request.h>
+#include <onyx/cpu.h>
+#include <onyx/cpumask.h>
 
 int plug_merges = 0;
 
@@ -23,6 +26,25 @@ int blk_mq_submit_request(struct blockdev *dev, struct bio_req *bio)
 
     DCHECK(dev->mq_ops && dev->mq_ops->pick_queue);
 
+    if (bio->flags & BIO_REQ_POLLED)
+    {
+        /* Polled I/O skips the plug, the submitter is going to spin on it right away */
+        struct io_queue *ioq =
+            dev->mq_ops->pick_poll_queue ? dev->mq_ops->pick_poll_queue(dev) : nullptr;
+        if (ioq)
+        {
+            struct request *req = bio_req_to_request(bio);
+            if (!req)
+                return -ENOMEM;
+
+            bio_get(bio);
+            bio->b_poll_queue = ioq;
+            return ioq->submit_request(req);
+        }
+
+        bio->flags &= ~BIO_REQ_POLLED;
+    }
+
     struct blk_plug *plug = blk_get_current_plug();
     if (plug)
     {
@@ -30,6 +52,7 @@ int blk_mq_submit_request(struct blockdev *dev, struct bio_req *bio)
         if (blk_merge_plug(plug, bio))
         {
             plug_merges++;
+            blk_stats_merge(&dev->stats, blk_stat_op(bio->flags));
             bio_get(bio);
             return 0;
         }
@@ -54,3 +77,43 @@ int blk_mq_submit_request(struct blockdev *dev, struct bio_req *bio)
 
     return ioq->submit_request(req);
 }
+
+/**
+ * @brief Build a cpu -> hardware queue map from the queues' interrupt affinity
+ * Every cpu gets the queue whose completions are delivered to it, so submission and completion
+ * stay on the same cpus. CPUs no queue covers are spread round-robin.
+ *
+ * @param map Array of get_nr_cpus() entries, filled with queue indices
+ * @param nr_queues Number of hardware queues
+ * @param get_affinity Returns the cpus queue i's interrupt goes to (or nullptr if unknown)
+ * @param ctx Context for get_affinity
+ */
+void blk_mq_map_queues(u16 *map, unsigned int nr_queues,
+                       const struct cpumask *(*get_affinity)(void *ctx, unsigned int queue),
+                       void *ctx)
+{
+    unsigned int nr_cpus = get_nr_cpus();
+    DCHECK(nr_queues > 0);
+
+    for (unsigned int cpu = 0; cpu < nr_cpus; cpu++)
+        map[cpu] = (u16) -1;
+
+    for (unsigned int queue = 0; queue < nr_queues; queue++)
+    {
+        const struct cpumask *mask = get_affinity(ctx, queue);
+        if (!mask)
+            continue;
+
+        for (unsigned int cpu = 0; cpu < nr_cpus; cpu++)
+        {
+            if (mask->is_cpu_set(cpu) && map[cpu] == (u16) -1)
+                map[cpu] = queue;
+        }
+    }
+
+    for (unsigned int cpu = 0; cpu < nr_cpus; cpu++)
+    {
+        if (map[cpu] == (u16) -1)
+            map[cpu] = cpu % nr_queues;
+    }
+}
@@ -225,6 +225,9 @@ static bool block_may_merge(struct request *req, struct bio_req *bio, size_t bio
 
     if ((req->r_flags & BIO_REQ_OP_MASK) != (bio->flags & BIO_REQ_OP_MASK))
         return false;
+    /* Flushes carry no data, there's nothing to merge */
+    if ((bio->flags & BIO_REQ_OP_MASK) == BIO_REQ_FLUSH_OP)
+        return false;
     return true;
 }
 
@@ -0,0 +1,351 @@
+/*
+ * Copyright (c) 2024 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the GPLv2 License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+#include <onyx/block.h>
+#include <onyx/block/io-queue.h>
+#include <onyx/block/stats.h>
+#include <onyx/init.h>
+#include <onyx/majorminor.h>
+#include <onyx/proc.h>
+#include <onyx/seq_file.h>
+
+static DEFINE_LIST(blk_stats_devs);
+static struct spinlock blk_stats_devs_lock;
+static DEFINE_LIST(blk_stats_queues);
+static struct spinlock blk_stats_queues_lock;
+static unsigned int blk_stats_next_queue_id;
+
+/* Must be called with the lock held */
+static void blk_stats_update_busy(struct blk_iostats *st, hrtime_t now)
+{
+    if (st->in_flight > 0 && now > st->stamp)
+    {
+        hrtime_t delta = now - st->stamp;
+        st->busy_ns += delta;
+        st->weighted_ns += delta * st->in_flight;
+    }
+
+    st->stamp = now;
+}
+
+static unsigned int blk_lat_bucket(hrtime_t lat)
+{
+    hrtime_t us = lat / NS_PER_US;
+    if (us < 2)
+        return 0;
+
+    unsigned int bucket = 63 - __builtin_clzl(us);
+    return cul::min(bucket, (unsigned int) BLK_LAT_BUCKETS - 1);
+}
+
+/**
+ * @brief Account for the start of a request
+ *
+ * @param st Stats to update
+ * @param now Current time
+ */
+void blk_stats_start(struct blk_iostats *st, hrtime_t now)
+{
+    scoped_lock<spinlock, true> g{st->lock};
+    blk_stats_update_busy(st, now);
+    st->in_flight++;
+}
+
+/**
+ * @brief Account for the completion of a request
+ *
+ * @param st Stats to update
+ * @param op BLK_STAT_* op
+ * @param nsectors Number of sectors transferred
+ * @param start Time the request was started at
+ * @param now Current time
+ */
+void blk_stats_done(struct blk_iostats *st, unsigned int op, sector_t nsectors, hrtime_t start,
+                    hrtime_t now)
+{
+    hrtime_t lat = now > start ? now - start : 0;
+    scoped_lock<spinlock, true> g{st->lock};
+    blk_stats_update_busy(st, now);
+    DCHECK(st->in_flight > 0);
+    st->in_flight--;
+    st->ios[op]++;
+    st->sectors[op] += nsectors;
+    st->time_ns[op] += lat;
+    st->lat_hist[op][blk_lat_bucket(lat)]++;
+}
+
+/**
+ * @brief Account for a bio that got merged into an existing request
+ *
+ * @param st Stats to update
+ * @param op BLK_STAT_* op
+ */
+void blk_stats_merge(struct blk_iostats *st, unsigned int op)
+{
+    scoped_lock<spinlock, true> g{st->lock};
+    st->merges[op]++;
+}
+
+/**
+ * @brief Take a consistent snapshot of a blk_iostats, with busy time brought up to date
+ *
+ * @param st Stats to read
+ * @param out Snapshot
+ */
+void blk_stats_read(struct blk_iostats *st, struct blk_iostats *out)
+{
+    scoped_lock<spinlock, true> g{st->lock};
+    blk_stats_update_busy(st, clocksource_get_time());
+    memcpy(out, st, sizeof(*st));
+}
+
+/**
+ * @brief Account for a request getting submitted to its hardware queue
+ *
+ * @param req Request
+ */
+void blk_account_start(struct request *req)
+{
+    hrtime_t now = clocksource_get_time();
+    req->r_start_ns = now;
+    blk_stats_start(&req->r_bdev->stats, now);
+    blk_stats_start(req->r_queue->stats(), now);
+}
+
+/**
+ * @brief Account for a request's completion, on its block device and hardware queue
+ *
+ * @param req Request
+ */
+void blk_account_done(struct request *req)
+{
+    hrtime_t now = clocksource_get_time();
+    unsigned int op = blk_stat_op(req->r_flags);
+    blk_stats_done(&req->r_bdev->stats, op, req->r_nsectors, req->r_start_ns, now);
+    blk_stats_done(req->r_queue->stats(), op, req->r_nsectors, req->r_start_ns, now);
+}
+
+/**
+ * @brief Make a block device's statistics visible in procfs
+ *
+ * @param bdev Block device
+ */
+void blk_stats_add_dev(struct blockdev *bdev)
+{
+    scoped_lock g{blk_stats_devs_lock};
+    list_add_tail(&bdev->block_dev_head, &blk_stats_devs);
+}
+
+/**
+ * @brief Remove a block device from procfs' statistics
+ *
+ * @param bdev Block device
+ */
+void blk_stats_remove_dev(struct blockdev *bdev)
+{
+    scoped_lock g{blk_stats_devs_lock};
+    list_remove(&bdev->block_dev_head);
+}
+
+/**
+ * @brief Register a hardware queue, assigning it an ID
+ *
+ * @param queue Queue
+ */
+void blk_stats_add_queue(struct io_queue *queue)
+{
+    scoped_lock g{blk_stats_queues_lock};
+    queue->set_id(blk_stats_next_queue_id++);
+    list_add_tail(&queue->queue_list_node_, &blk_stats_queues);
+}
+
+/**
+ * @brief Unregister a hardware queue
+ *
+ * @param queue Queue
+ */
+void blk_stats_remove_queue(struct io_queue *queue)
+{
+    scoped_lock g{blk_stats_queues_lock};
+    list_remove(&queue->queue_list_node_);
+}
+
+static const char *blk_stat_op_names[BLK_STAT_NR_OPS] = {"read", "write", "other"};
+
+static void *diskstats_start(struct seq_file *m, off_t *pos)
+{
+    spin_lock(&blk_stats_devs_lock);
+    return seq_list_start(&blk_stats_devs, *pos);
+}
+
+static void diskstats_stop(struct seq_file *m, void *v)
+{
+    spin_unlock(&blk_stats_devs_lock);
+}
+
+static void *diskstats_next(struct seq_file *m, void *v, off_t *pos)
+{
+    return seq_list_next(v, &blk_stats_devs, pos);
+}
+
+/* Same layout as Linux's /proc/diskstats, with the "other" ops where discards would go. Times are
+ * in milliseconds. Partitions are skipped, their I/O is accounted to the whole disk. */
+static int diskstats_show(struct seq_file *m, void *v)
+{
+    struct blockdev *bdev = container_of(v, struct blockdev, block_dev_head);
+    struct blk_iostats st;
+
+    if (blkdev_is_partition(bdev))
+        return 0;
+
+    blk_stats_read(&bdev->stats, &st);
+    dev_t dev = bdev->dev->dev();
+    seq_printf(m, "%4u %7u %s", MAJOR(dev), MINOR(dev), bdev->name.c_str());
+    for (unsigned int op = 0; op < BLK_STAT_NR_OPS; op++)
+    {
+        seq_printf(m, " %lu %lu %lu %lu", st.ios[op], st.merges[op], st.sectors[op],
+                   st.time_ns[op] / NS_PER_MS);
+        if (op == BLK_STAT_WRITE)
+            seq_printf(m, " %lu %lu %lu", st.in_flight, st.busy_ns / NS_PER_MS,
+                       st.weighted_ns / NS_PER_MS);
+    }
+
+    seq_printf(m, "\n");
+    return 0;
+}
+
+static struct seq_operations diskstats_seq_ops = {
+    .start = diskstats_start,
+    .stop = diskstats_stop,
+    .next = diskstats_next,
+    .show = diskstats_show,
+};
+
+static int diskstats_open(struct file *filp)
+{
+    return seq_open(filp, &diskstats_seq_ops);
+}
+
+const static struct proc_file_ops diskstats_proc_ops = {
+    .open = diskstats_open,
+    .release = seq_release,
+    .read_iter = seq_read_iter,
+};
+
+static void blk_print_hist(struct seq_file *m, const char *name, unsigned int id,
+                           struct blk_iostats *st)
+{
+    for (unsigned int op = 0; op < BLK_STAT_NR_OPS; op++)
+    {
+        seq_printf(m, "%s", name);
+        if (id != -1U)
+            seq_printf(m, "%u", id);
+        seq_printf(m, " %s", blk_stat_op_names[op]);
+        for (unsigned int i = 0; i < BLK_LAT_BUCKETS; i++)
+            seq_printf(m, " %lu", st->lat_hist[op][i]);
+        seq_printf(m, "\n");
+    }
+}
+
+/* blklat: log2 latency histograms (see BLK_LAT_BUCKETS), one line per op, for every disk and
+ * then every hardware queue. */
+static int blklat_show(struct seq_file *m, void *v)
+{
+    struct blk_iostats st;
+
+    spin_lock(&blk_stats_devs_lock);
+    list_for_every (&blk_stats_devs)
+    {
+        struct blockdev *bdev = container_of(l, struct blockdev, block_dev_head);
+        if (blkdev_is_partition(bdev))
+            continue;
+        blk_stats_read(&bdev->stats, &st);
+        blk_print_hist(m, bdev->name.c_str(), -1U, &st);
+    }
+
+    spin_unlock(&blk_stats_devs_lock);
+
+    spin_lock(&blk_stats_queues_lock);
+    list_for_every (&blk_stats_queues)
+    {
+        struct io_queue *queue = list_head_cpp<io_queue>::self_from_list_head(l);
+        blk_stats_read(queue->stats(), &st);
+        blk_print_hist(m, "queue", queue->id(), &st);
+    }
+
+    spin_unlock(&blk_stats_queues_lock);
+    return 0;
+}
+
+static int blklat_open(struct file *filp)
+{
+    return single_open(filp, blklat_show, nullptr);
+}
+
+const static struct proc_file_ops blklat_proc_ops = {
+    .open = blklat_open,
+    .release = single_release,
+    .read_iter = seq_read_iter,
+};
+
+static void *blkqueues_start(struct seq_file *m, off_t *pos)
+{
+    spin_lock(&blk_stats_queues_lock);
+    return seq_list_start(&blk_stats_queues, *pos);
+}
+
+static void blkqueues_stop(struct seq_file *m, void *v)
+{
+    spin_unlock(&blk_stats_queues_lock);
+}
+
+static void *blkqueues_next(struct seq_file *m, void *v, off_t *pos)
+{
+    return seq_list_next(v, &blk_stats_queues, pos);
+}
+
+/* blkqueues: queue id, the device that first used it, depth, requests in flight, busy time (ms)
+ * and then ios, sectors and total latency (ms) for every op. */
+static int blkqueues_show(struct seq_file *m, void *v)
+{
+    struct io_queue *queue = list_head_cpp<io_queue>::self_from_list_head((struct list_head *) v);
+    struct blockdev *owner = queue->owner();
+    struct blk_iostats st;
+
+    blk_stats_read(queue->stats(), &st);
+    seq_printf(m, "%u %s %u %lu %lu", queue->id(), owner ? owner->name.c_str() : "-",
+               queue->nr_entries(), st.in_flight, st.busy_ns / NS_PER_MS);
+    for (unsigned int op = 0; op < BLK_STAT_NR_OPS; op++)
+        seq_printf(m, " %lu %lu %lu", st.ios[op], st.sectors[op], st.time_ns[op] / NS_PER_MS);
+    seq_printf(m, "\n");
+    return 0;
+}
+
+static struct seq_operations blkqueues_seq_ops = {
+    .start = blkqueues_start,
+    .stop = blkqueues_stop,
+    .next = blkqueues_next,
+    .show = blkqueues_show,
+};
+
+static int blkqueues_open(struct file *filp)
+{
+    return seq_open(filp, &blkqueues_seq_ops);
+}
+
+const static struct proc_file_ops blkqueues_proc_ops = {
+    .open = blkqueues_open,
+    .release = seq_release,
+    .read_iter = seq_read_iter,
+};
+
+static __init void blk_stats_setup_proc(void)
+{
+    procfs_add_entry("diskstats", 0444, NULL, &diskstats_proc_ops);
+    procfs_add_entry("blklat", 0444, NULL, &blklat_proc_ops);
+    procfs_add_entry("blkqueues", 0444, NULL, &blkqueues_proc_ops);
+}
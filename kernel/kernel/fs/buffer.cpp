@@ -403,6 +403,8 @@ static ssize_t buffer_directio(struct file *filp, size_t off, iovec_iter *iter,
     struct bio_req *bio = ex.value();
     bio->sector_number = off / blkdev->sector_size;
     bio->flags |= (DIRECT_IO_OP(flags) == DIRECT_IO_READ ? BIO_REQ_READ_OP : BIO_REQ_WRITE_OP);
+    if (flags & DIRECT_IO_POLL)
+        bio->flags |= BIO_REQ_POLLED;
     st = bio_submit_req_wait(blkdev, bio);
 
     if (bio->flags & BIO_REQ_EIO)
@@ -721,7 +721,7 @@ void dentry_do_unlink(dentry *entry)
         d_remove_lru(entry);
     entry->d_parent = nullptr;
 
-    if (!d_is_negative(entry))
+    if (!d_is_negative(entry) && !(entry->d_inode->i_sb->s_flags & SB_FLAG_FS_NLINK))
     {
         inode_dec_nlink(entry->d_inode);
 
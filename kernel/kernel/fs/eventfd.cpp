@@ -0,0 +1,180 @@
+/*
+ * Copyright (c) 2025 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the GPLv2 License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+#include <errno.h>
+#include <stdlib.h>
+
+#include <onyx/anon_inode.h>
+#include <onyx/file.h>
+#include <onyx/iovec_iter.h>
+#include <onyx/poll.h>
+#include <onyx/spinlock.h>
+#include <onyx/vfs.h>
+#include <onyx/wait_queue.h>
+
+#include <uapi/eventfd.h>
+#include <uapi/poll.h>
+
+/*
+ * eventfd: a 64-bit counter behind a file descriptor. Writes add to it, reads return it and reset
+ * it to 0 (or return 1 and decrement it, with EFD_SEMAPHORE). Waking up an event loop is one 8-byte
+ * copy each way, instead of going through a self-pipe's page-sized buffers.
+ */
+
+#define EVENTFD_MAX ((u64) -2)
+
+struct eventfd_ctx
+{
+    struct spinlock lock;
+    /* Readers and writers both wait here */
+    struct wait_queue wq;
+    u64 count;
+    unsigned int flags;
+};
+
+static ssize_t eventfd_read_iter(struct file *filp, size_t off, iovec_iter *iter,
+                                 unsigned int flags)
+{
+    struct eventfd_ctx *ctx = (struct eventfd_ctx *) filp->private_data;
+    u64 val;
+
+    if (iter->bytes < sizeof(u64))
+        return -EINVAL;
+
+    spin_lock(&ctx->lock);
+
+    if (ctx->count == 0)
+    {
+        if (filp->f_flags & O_NONBLOCK)
+        {
+            spin_unlock(&ctx->lock);
+            return -EAGAIN;
+        }
+
+        if (wait_for_event_locked_interruptible(&ctx->wq, ctx->count != 0, &ctx->lock) ==
+            -ERESTARTSYS)
+        {
+            spin_unlock(&ctx->lock);
+            return -ERESTARTSYS;
+        }
+    }
+
+    val = ctx->flags & EFD_SEMAPHORE ? 1 : ctx->count;
+    ctx->count -= val;
+    spin_unlock(&ctx->lock);
+
+    /* There's room now, let the writers know */
+    wait_queue_wake_all(&ctx->wq);
+
+    if (copy_to_iter(iter, &val, sizeof(val)) != sizeof(val))
+        return -EFAULT;
+    return sizeof(val);
+}
+
+static ssize_t eventfd_write_iter(struct file *filp, size_t off, iovec_iter *iter,
+                                  unsigned int flags)
+{
+    struct eventfd_ctx *ctx = (struct eventfd_ctx *) filp->private_data;
+    u64 val;
+
+    if (iter->bytes < sizeof(u64))
+        return -EINVAL;
+    if (copy_from_iter(iter, &val, sizeof(val)) != sizeof(val))
+        return -EFAULT;
+    if (val == (u64) -1)
+        return -EINVAL;
+
+    spin_lock(&ctx->lock);
+
+    if (EVENTFD_MAX - ctx->count < val)
+    {
+        if (filp->f_flags & O_NONBLOCK)
+        {
+            spin_unlock(&ctx->lock);
+            return -EAGAIN;
+        }
+
+        if (wait_for_event_locked_interruptible(&ctx->wq, EVENTFD_MAX - ctx->count >= val,
+                                                &ctx->lock) == -ERESTARTSYS)
+        {
+            spin_unlock(&ctx->lock);
+            return -ERESTARTSYS;
+        }
+    }
+
+    ctx->count += val;
+    spin_unlock(&ctx->lock);
+
+    if (val)
+        wait_queue_wake_all(&ctx->wq);
+    return sizeof(val);
+}
+
+static short eventfd_poll(void *poll_file, short events, struct file *filp)
+{
+    struct eventfd_ctx *ctx = (struct eventfd_ctx *) filp->private_data;
+    short revents = 0;
+
+    spin_lock(&ctx->lock);
+    if (ctx->count > 0)
+        revents |= POLLIN | POLLRDNORM;
+    if (ctx->count < EVENTFD_MAX)
+        revents |= POLLOUT | POLLWRNORM;
+    spin_unlock(&ctx->lock);
+
+    revents &= events;
+    if (!revents)
+        poll_wait_helper(poll_file, &ctx->wq);
+    return revents;
+}
+
+static void eventfd_release(struct file *filp)
+{
+    free(filp->private_data);
+}
+
+static const struct file_ops eventfd_ops = {
+    .poll = eventfd_poll,
+    .release = eventfd_release,
+    .read_iter = eventfd_read_iter,
+    .write_iter = eventfd_write_iter,
+};
+
+#define EVENTFD_VALID_FLAGS (EFD_SEMAPHORE | EFD_CLOEXEC | EFD_NONBLOCK)
+
+int sys_eventfd2(unsigned int initval, int flags)
+{
+    struct eventfd_ctx *ctx;
+    struct file *filp;
+    int fd;
+
+    if (flags & ~EVENTFD_VALID_FLAGS)
+        return -EINVAL;
+
+    ctx = (struct eventfd_ctx *) malloc(sizeof(*ctx));
+    if (!ctx)
+        return -ENOMEM;
+
+    spinlock_init(&ctx->lock);
+    init_wait_queue_head(&ctx->wq);
+    ctx->count = initval;
+    ctx->flags = flags & EFD_SEMAPHORE;
+
+    filp = anon_inode_open(S_IFREG, (struct file_ops *) &eventfd_ops, "[eventfd]");
+    if (!filp)
+    {
+        free(ctx);
+        return -ENOMEM;
+    }
+
+    filp->f_ino->i_flags = INODE_FLAG_NO_SEEK;
+    filp->private_data = ctx;
+
+    fd = open_with_vnode(filp, O_RDWR | (flags & (EFD_CLOEXEC | EFD_NONBLOCK)));
+    fd_put(filp);
+    return fd;
+}
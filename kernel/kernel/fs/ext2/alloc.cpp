@@ -16,6 +16,9 @@
 #include <onyx/panic.h>
 
 #include "ext2.h"
+#include "journal.h"
+
+#include <onyx/utility.hpp>
 
 /**
  * @brief Alocates an inode
@@ -73,7 +76,8 @@ void ext2_superblock::free_inode(ext2_inode_no inode)
     block_groups[bg_no].free_inode(inode, this);
 }
 
-ext2_block_no ext2_superblock::try_allocate_block_from_bg(ext2_block_group_no nr)
+ext2_block_no ext2_superblock::try_allocate_blocks_from_bg(ext2_block_group_no nr,
+                                                           ext2_block_no goal, unsigned int *count)
 {
     if (nr >= number_of_block_groups)
     {
@@ -85,42 +89,122 @@ ext2_block_no ext2_superblock::try_allocate_block_from_bg(ext2_block_group_no nr
     if (bg.get_bgd()->unallocated_blocks_in_group == 0)
         return EXT2_ERR_INV_BLOCK;
 
-    auto res = bg.allocate_block(this);
+    auto res = bg.allocate_blocks(this, goal, count);
 
 #if 0
-	printk("Allocated block %u from bg %u\n", res.value_or(EXT2_ERR_INV_BLOCK), nr);
+	printk("Allocated %u blocks at %u from bg %u\n", *count, res.value_or(EXT2_ERR_INV_BLOCK), nr);
 #endif
     return res.value_or(EXT2_ERR_INV_BLOCK);
 }
 
 /**
- * @brief Allocates a block, taking into account the preferred block group
+ * @brief Allocates a run of contiguous blocks, as close as possible to goal
  *
- * @param preferred The preferred block group. If -1, no preferrence
- * @return Block number, or EXT2_ERR_INV_BLOCK if we couldn't allocate one.
+ * @param goal Block we would like the run to start at, or EXT2_ERR_INV_BLOCK for no goal
+ * @param count Number of blocks we want; on success, updated with the number we got
+ * (at least 1, but possibly less than asked for)
+ * @param preferred The preferred block group, if there's no goal. If -1, no preferrence
+ * @return First block of the run, or EXT2_ERR_INV_BLOCK if we couldn't allocate one.
  */
-ext2_block_no ext2_superblock::allocate_block(ext2_block_group_no preferred)
+static bool ext2_may_use_reserved_blocks(const superblock_t *sb)
 {
-    if (sb->s_free_blocks_count == 0) [[unlikely]]
-        return EXT2_ERR_INV_BLOCK;
+    auto c = creds_get();
+
+    bool may_use_blocks = c->euid == sb->s_def_resuid || c->egid == sb->s_def_resgid;
+
+    creds_put(c);
+    return may_use_blocks;
+}
+
+/**
+ * @brief Get the number of free blocks not spoken for by reservations
+ */
+unsigned long ext2_superblock::unreserved_free_blocks() const
+{
+    unsigned long free = __atomic_load_n(&sb->s_free_blocks_count, __ATOMIC_RELAXED);
+    unsigned long reserved = __atomic_load_n(&delalloc_reserved, __ATOMIC_RELAXED);
+    return free > reserved ? free - reserved : 0;
+}
+
+/**
+ * @brief Reserve blocks for delayed allocation
+ * Reserved blocks are not handed out by allocate_blocks, unless the allocation says it was
+ * reserved.
+ *
+ * @param nr Number of blocks
+ * @param nofail Don't check for free space. Used when giving back blocks we're about to free.
+ * @return 0 on success, -ENOSPC if there isn't enough free space
+ */
+int ext2_superblock::reserve_blocks(unsigned long nr, bool nofail)
+{
+    unsigned long r_blocks = sb->s_r_blocks_count;
 
-    if (sb->s_free_blocks_count <= sb->s_r_blocks_count) [[unlikely]]
+    /* Only look at creds when we're getting close, and do it outside the spinlock */
+    if (unreserved_free_blocks() < nr + r_blocks) [[unlikely]]
     {
-        auto c = creds_get();
+        if (ext2_may_use_reserved_blocks(sb))
+            r_blocks = 0;
+    }
 
-        bool may_use_blocks = c->euid == sb->s_def_resuid || c->egid == sb->s_def_resgid;
+    scoped_lock g{delalloc_lock};
 
-        creds_put(c);
+    if (!nofail && unreserved_free_blocks() < nr + r_blocks)
+        return -ENOSPC;
 
-        if (!may_use_blocks)
+    delalloc_reserved += nr;
+    return 0;
+}
+
+/**
+ * @brief Release blocks reserved with reserve_blocks
+ *
+ * @param nr Number of blocks
+ */
+void ext2_superblock::release_blocks(unsigned long nr)
+{
+    scoped_lock g{delalloc_lock};
+    DCHECK(delalloc_reserved >= nr);
+    delalloc_reserved -= nr;
+}
+
+ext2_block_no ext2_superblock::allocate_blocks(ext2_block_no goal, unsigned int *count,
+                                               ext2_block_group_no preferred, bool reserved)
+{
+    DCHECK(*count > 0);
+
+    if (sb->s_free_blocks_count == 0) [[unlikely]]
+        return EXT2_ERR_INV_BLOCK;
+
+    /* Reserved allocations were already checked against the free space when reserving. Everyone
+     * else needs to leave the reservations alone. */
+    unsigned long free = reserved ? sb->s_free_blocks_count : unreserved_free_blocks();
+
+    if (free <= sb->s_r_blocks_count + *count && !reserved) [[unlikely]]
+    {
+        if (!ext2_may_use_reserved_blocks(sb))
+        {
+            /* Don't dip into the reserved blocks just to fill a preallocation */
+            if (free <= sb->s_r_blocks_count)
+                return EXT2_ERR_INV_BLOCK;
+            *count = cul::min((unsigned long) *count, free - sb->s_r_blocks_count);
+        }
+        else if (free == 0)
             return EXT2_ERR_INV_BLOCK;
+        else
+            *count = cul::min((unsigned long) *count, free);
     }
 
+    if (goal != EXT2_ERR_INV_BLOCK && goal >= first_data_block() && goal < total_blocks)
+        preferred = (goal - first_data_block()) / blocks_per_block_group;
+    else
+        goal = EXT2_ERR_INV_BLOCK;
+
     if (preferred == (ext2_block_group_no) -1)
         preferred = 0;
 
     /* Our algorithm works like this: We take the preferred block group, and then we'll
      * iterate the block groups inside-out, trying them according to the distance.
+     * Only the preferred block group gets the goal, the others hand out their best free extent.
      */
 
     auto max_block_group = this->number_of_block_groups - 1;
@@ -136,13 +220,14 @@ ext2_block_no ext2_superblock::allocate_block(ext2_block_group_no preferred)
          * we'll only need to try once, since both tries will point to the same block group.
          */
         if (dist && dist_start >= 0)
-            block = try_allocate_block_from_bg(preferred - dist);
+            block = try_allocate_blocks_from_bg(preferred - dist, EXT2_ERR_INV_BLOCK, count);
 
         if (block != EXT2_ERR_INV_BLOCK)
             return block;
 
         if (dist_end >= 0)
-            block = try_allocate_block_from_bg(preferred + dist);
+            block = try_allocate_blocks_from_bg(preferred + dist, dist ? EXT2_ERR_INV_BLOCK : goal,
+                                                count);
 
         if (block != EXT2_ERR_INV_BLOCK)
             return block;
@@ -152,17 +237,30 @@ ext2_block_no ext2_superblock::allocate_block(ext2_block_group_no preferred)
 }
 
 /**
- * @brief Frees a block
+ * @brief Frees a run of contiguous blocks
  *
- * @param block Block number to free
+ * @param block First block of the run
+ * @param count Number of blocks
  */
-void ext2_superblock::free_block(ext2_block_no block)
+void ext2_superblock::free_blocks(ext2_block_no block, unsigned int count)
 {
     assert(block != EXT2_ERR_INV_BLOCK);
 
-    auto block_group = (block - first_data_block()) / blocks_per_block_group;
+    /* Make sure the journal doesn't write old metadata over these, once they get reused */
+    ext2_journal_revoke(this, block, count);
 
-    assert(block_group < number_of_block_groups);
+    while (count)
+    {
+        auto block_group = (block - first_data_block()) / blocks_per_block_group;
+
+        assert(block_group < number_of_block_groups);
 
-    block_groups[block_group].free_block(block, this);
+        /* Runs can't cross block groups, split them if needed */
+        auto bg_end = (block_group + 1) * blocks_per_block_group + first_data_block();
+        auto nr = cul::min(count, bg_end - block);
+
+        block_groups[block_group].free_blocks(block, nr, this);
+        block += nr;
+        count -= nr;
+    }
 }
@@ -11,9 +11,12 @@
 
 #include <onyx/compiler.h>
 #include <onyx/limits.h>
+#include <onyx/log.h>
 
 #include "ext2.h"
 
+#include <onyx/utility.hpp>
+
 bool ext2_block_group::init(ext2_superblock *sb)
 {
     auto bgdt_block_start = sb->block_size == 1024 ? 2 : 1;
@@ -29,6 +32,8 @@ bool ext2_block_group::init(ext2_superblock *sb)
     return true;
 }
 
+static constexpr auto bits_per_long = WORD_SIZE * CHAR_BIT;
+
 /* This is the max reserved inode number, everything below it is reserved */
 #define EXT2_UNDEL_DIR_INO 6
 
@@ -52,8 +57,6 @@ expected<ext2_inode_no, int> ext2_block_group::allocate_inode(ext2_superblock *s
     if (bit == SCAN_ZERO_NOT_FOUND)
         return unexpected{-ENOSPC};
 
-    static constexpr auto bits_per_long = WORD_SIZE * CHAR_BIT;
-
     /* Set the corresponding bit */
     bitmap[bit / bits_per_long] |= (1UL << (bit % bits_per_long));
     /* Change the block group and superblock
@@ -68,13 +71,161 @@ expected<ext2_inode_no, int> ext2_block_group::allocate_inode(ext2_superblock *s
      * shutdown at any time,
      * and this is the most important part */
 
-    block_buf_dirty(buf);
+    ext2_dirty_buffer(buf);
     ext2_dirty_sb(sb);
 
     return nr * sb->inodes_per_block_group + bit + 1;
 }
 
-expected<ext2_inode_no, int> ext2_block_group::allocate_block(ext2_superblock *sb)
+/**
+ * @brief Find the next bit in the bitmap that's equal to val
+ *
+ * @param bitmap Pointer to the bitmap
+ * @param nbits Number of bits in the bitmap
+ * @param start Bit to start at
+ * @param val Value to look for
+ * @return Index of the bit, or nbits if not found
+ */
+static unsigned long ext2_find_next_bit(const unsigned long *bitmap, unsigned long nbits,
+                                        unsigned long start, bool val)
+{
+    while (start < nbits)
+    {
+        unsigned long word = bitmap[start / bits_per_long];
+        if (!val)
+            word = ~word;
+        word >>= start % bits_per_long;
+
+        if (word)
+            return cul::min(start + __builtin_ctzl(word), nbits);
+
+        start = cul::align_down2(start, bits_per_long) + bits_per_long;
+    }
+
+    return nbits;
+}
+
+static void ext2_set_bits(unsigned long *bitmap, unsigned long start, unsigned long len)
+{
+    for (unsigned long bit = start; bit < start + len; bit++)
+        bitmap[bit / bits_per_long] |= (1UL << (bit % bits_per_long));
+}
+
+/**
+ * @brief Get the number of blocks the block group covers (the last one may be shorter)
+ */
+static unsigned long ext2_bg_nr_blocks(ext2_block_group_no nr, const ext2_superblock *sb)
+{
+    unsigned long start = nr * (unsigned long) sb->blocks_per_block_group;
+    return cul::min((unsigned long) sb->blocks_per_block_group,
+                    sb->total_blocks - sb->first_data_block() - start);
+}
+
+void ext2_block_group::free_extents_add(uint32_t start, uint32_t len)
+{
+    if (nr_free_extents < EXT2_FREE_EXTENT_CACHE_SIZE)
+    {
+        free_extents[nr_free_extents++] = {start, len};
+        return;
+    }
+
+    /* Full, replace the smallest extent if we're bigger */
+    unsigned int smallest = 0;
+    for (unsigned int i = 1; i < nr_free_extents; i++)
+    {
+        if (free_extents[i].len < free_extents[smallest].len)
+            smallest = i;
+    }
+
+    if (free_extents[smallest].len < len)
+        free_extents[smallest] = {start, len};
+}
+
+void ext2_block_group::rebuild_free_extents(const unsigned long *bitmap, unsigned long nbits)
+{
+    nr_free_extents = 0;
+
+    for (unsigned long bit = 0; bit < nbits;)
+    {
+        auto start = ext2_find_next_bit(bitmap, nbits, bit, false);
+        if (start == nbits)
+            break;
+        auto end = ext2_find_next_bit(bitmap, nbits, start, true);
+        free_extents_add(start, end - start);
+        bit = end;
+    }
+
+    free_extents_valid = true;
+}
+
+/**
+ * @brief Remove [start, start + len) from the free extent cache
+ */
+void ext2_block_group::free_extents_take(uint32_t start, uint32_t len)
+{
+    uint32_t end = start + len;
+
+    for (unsigned int i = 0; i < nr_free_extents; i++)
+    {
+        auto &ext = free_extents[i];
+        uint32_t ext_end = ext.start + ext.len;
+
+        if (end <= ext.start || start >= ext_end)
+            continue;
+
+        ext2_free_extent left{ext.start, start > ext.start ? start - ext.start : 0};
+        ext2_free_extent right{end, ext_end > end ? ext_end - end : 0};
+
+        if (left.len && right.len)
+        {
+            ext = left;
+            free_extents_add(right.start, right.len);
+        }
+        else if (left.len || right.len)
+            ext = left.len ? left : right;
+        else
+        {
+            /* Fully consumed, swap it with the last one and look at this slot again */
+            ext = free_extents[--nr_free_extents];
+            i--;
+        }
+    }
+}
+
+/**
+ * @brief Add a freed [start, start + len) to the free extent cache, merging it with neighbours
+ */
+void ext2_block_group::free_extents_give(uint32_t start, uint32_t len)
+{
+    int left = -1, right = -1;
+
+    for (unsigned int i = 0; i < nr_free_extents; i++)
+    {
+        if (free_extents[i].start + free_extents[i].len == start)
+            left = i;
+        else if (free_extents[i].start == start + len)
+            right = i;
+    }
+
+    if (left >= 0 && right >= 0)
+    {
+        free_extents[left].len += len + free_extents[right].len;
+        free_extents[right] = free_extents[--nr_free_extents];
+    }
+    else if (left >= 0)
+        free_extents[left].len += len;
+    else if (right >= 0)
+    {
+        free_extents[right].start = start;
+        free_extents[right].len += len;
+    }
+    else
+        free_extents_add(start, len);
+}
+
+expected<ext2_block_no, int> ext2_block_group::allocate_blocks(ext2_superblock *sb,
+                                                               ext2_block_no goal,
+                                                               unsigned int *count)
 {
     scoped_mutex g{block_bitmap_lock};
 
@@ -88,43 +239,87 @@ expected<ext2_inode_no, int> ext2_block_group::allocate_block(ext2_superblock *s
     }
 
     auto bitmap = static_cast<unsigned long *>(block_buf_data(buf));
+    auto nbits = ext2_bg_nr_blocks(nr, sb);
+    ext2_block_no first_block = nr * sb->blocks_per_block_group + sb->first_data_block();
+    unsigned long want = *count;
+    unsigned long bit = nbits;
+    unsigned long len = 0;
+
+    /* First, try to extend right from the goal. This is what keeps files contiguous. */
+    if (goal != EXT2_ERR_INV_BLOCK && goal >= first_block && goal - first_block < nbits)
+    {
+        bit = goal - first_block;
+        len = ext2_find_next_bit(bitmap, cul::min(nbits, bit + want), bit, true) - bit;
+    }
 
-    auto bit = ext2_scan_zero(bitmap, sb->s_block_size);
+    /* Then, look in the free extent cache. Pick the smallest extent that fits the whole request,
+     * else the largest one. If the cache doesn't know of any extent, rebuild it from the bitmap.
+     */
+    for (int tries = 0; len == 0 && tries < 2; tries++)
+    {
+        if (!free_extents_valid || nr_free_extents == 0)
+            rebuild_free_extents(bitmap, nbits);
+
+        int best = -1;
+        for (unsigned int i = 0; i < nr_free_extents; i++)
+        {
+            const auto &ext = free_extents[i];
+            if (best < 0)
+            {
+                best = i;
+                continue;
+            }
+
+            const auto &b = free_extents[best];
+            bool fits = ext.len >= want;
+            bool best_fits = b.len >= want;
+
+            if ((fits && (!best_fits || ext.len < b.len)) || (!fits && !best_fits && ext.len > b.len))
+                best = i;
+        }
+
+        if (best < 0)
+            break;
+
+        /* The cache is just a hint, so double check the extent against the bitmap */
+        bit = free_extents[best].start;
+        len = ext2_find_next_bit(bitmap, cul::min(nbits, bit + want), bit, true) - bit;
+
+        if (len == 0) [[unlikely]]
+        {
+            pr_warn("ext2: block group %u: stale free extent cache\n", nr);
+            free_extents_valid = false;
+        }
+    }
 
-    if (bit == SCAN_ZERO_NOT_FOUND)
+    if (len == 0)
         return unexpected{-ENOSPC};
 
-    static constexpr auto bits_per_long = WORD_SIZE * CHAR_BIT;
-
-    /* Set the corresponding bit */
-#if 0
-	printk("Got bit %lu\n", bit);
-	printk("setting %lu on word %lu\n", (bit % bits_per_long), bit / bits_per_long);
-#endif
-
-    bitmap[bit / bits_per_long] |= (1UL << (bit % bits_per_long));
-
-    assert(ext2_scan_zero(bitmap, sb->s_block_size) != bit);
+    ext2_set_bits(bitmap, bit, len);
+    if (free_extents_valid)
+        free_extents_take(bit, len);
 
     /* Change the block group and superblock
        structures in order to reflect it */
 
-    dec_unallocated_blocks();
+    dec_unallocated_blocks(len);
 
-    EXT2_ATOMIC_SUB(sb->sb->s_free_blocks_count, 1);
+    EXT2_ATOMIC_SUB(sb->sb->s_free_blocks_count, len);
     /* Actually register the changes on disk */
     /* We give the bitmap priority here,
      * since there can be a disk failure or a
      * shutdown at any time,
      * and this is the most important part */
 
-    block_buf_dirty(buf);
+    ext2_dirty_buffer(buf);
     ext2_dirty_sb(sb);
 
-    return nr * sb->blocks_per_block_group + bit + sb->first_data_block();
+    *count = len;
+    return first_block + bit;
 }
 
-void ext2_block_group::free_block(ext2_block_no block, ext2_superblock *sb)
+void ext2_block_group::free_blocks(ext2_block_no block, unsigned int count,
+                                   ext2_superblock *sb)
 {
     scoped_mutex g{block_bitmap_lock};
 
@@ -141,24 +336,37 @@ void ext2_block_group::free_block(ext2_block_no block, ext2_superblock *sb)
 
     auto bitmap = static_cast<uint8_t *>(block_buf_data(buf));
 
-    auto bit = (block - sb->first_data_block()) % sb->blocks_per_block_group;
-    auto byte_idx = bit / CHAR_BIT;
-    auto bit_idx = bit % CHAR_BIT;
+    auto first_bit = (block - sb->first_data_block()) % sb->blocks_per_block_group;
 
-    /* Let's check for corruption, if it's already free we'll have to error. */
-    if (!(bitmap[byte_idx] & (1 << bit_idx)))
+    for (auto bit = first_bit; bit < first_bit + count; bit++)
     {
-        sb->error("Corruption detected: Block already freed");
-        return;
+        auto byte_idx = bit / CHAR_BIT;
+        auto bit_idx = bit % CHAR_BIT;
+
+        /* Let's check for corruption, if it's already free we'll have to error. */
+        if (!(bitmap[byte_idx] & (1 << bit_idx)))
+        {
+            sb->error("Corruption detected: Block already freed");
+            /* Don't trust the cache anymore, and account for what we did free */
+            free_extents_valid = false;
+            count = bit - first_bit;
+            break;
+        }
+
+        bitmap[byte_idx] &= ~(1 << bit_idx);
     }
 
-    bitmap[byte_idx] &= ~(1 << bit_idx);
+    if (count == 0)
+        return;
+
+    if (free_extents_valid)
+        free_extents_give(first_bit, count);
 
-    block_buf_dirty(buf);
+    ext2_dirty_buffer(buf);
 
-    inc_unallocated_blocks();
+    inc_unallocated_blocks(count);
 
-    EXT2_ATOMIC_ADD(sb->sb->s_free_blocks_count, 1);
+    EXT2_ATOMIC_ADD(sb->sb->s_free_blocks_count, count);
 
     ext2_dirty_sb(sb);
 }
@@ -191,7 +399,7 @@ void ext2_block_group::free_inode(ext2_inode_no inode, ext2_superblock *sb)
 
     bitmap[byte_idx] &= ~(1 << bit_idx);
 
-    block_buf_dirty(buf);
+    ext2_dirty_buffer(buf);
 
     inc_unallocated_inodes();
 
@@ -0,0 +1,1167 @@
+/*
+ * Copyright (c) 2024 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the GPLv2 License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <onyx/err.h>
+#include <onyx/log.h>
+#include <onyx/mm/slab.h>
+#include <onyx/pagecache.h>
+#include <onyx/vm.h>
+
+#include "ext2.h"
+
+/* Hashed directory (HTree) support. The on-disk format is the one introduced by ext3's dir_index
+ * feature: the first block of the directory holds the root of a (at most) two level b-tree of
+ * (hash, block) pairs, hidden behind the "." and ".." entries so that code that doesn't know about
+ * the index just sees an unusually big "..". Leaf blocks are regular directory blocks. We keep the
+ * leaf format 100% compatible with linear directories, so readdir doesn't need to care. */
+
+#define EXT2_DX_HASH_LEGACY            0
+#define EXT2_DX_HASH_HALF_MD4          1
+#define EXT2_DX_HASH_TEA               2
+#define EXT2_DX_HASH_LEGACY_UNSIGNED   3
+#define EXT2_DX_HASH_HALF_MD4_UNSIGNED 4
+#define EXT2_DX_HASH_TEA_UNSIGNED      5
+
+#define EXT2_HTREE_EOF 0x7fffffffU
+
+/* Without largedir, trees can only be two levels deep (root + one level of nodes) */
+#define EXT2_DX_MAX_LEVELS 2
+
+struct ext2_dx_fake_dirent
+{
+    uint32_t inode;
+    uint16_t rec_len;
+    uint8_t name_len;
+    uint8_t file_type;
+} __attribute__((packed));
+
+struct ext2_dx_dot_dirent
+{
+    ext2_dx_fake_dirent d;
+    char name[4];
+} __attribute__((packed));
+
+struct ext2_dx_root_info
+{
+    uint32_t reserved_zero;
+    uint8_t hash_version;
+    uint8_t info_length;
+    uint8_t indirect_levels;
+    uint8_t unused_flags;
+} __attribute__((packed));
+
+struct ext2_dx_root
+{
+    ext2_dx_dot_dirent dot;
+    ext2_dx_dot_dirent dotdot;
+    ext2_dx_root_info info;
+} __attribute__((packed));
+
+struct ext2_dx_entry
+{
+    uint32_t hash;
+    uint32_t block;
+} __attribute__((packed));
+
+/* The first dx_entry of every index block has its hash field replaced by count + limit */
+struct ext2_dx_countlimit
+{
+    uint16_t limit;
+    uint16_t count;
+} __attribute__((packed));
+
+struct ext2_dx_hash_info
+{
+    uint32_t hash;
+    uint32_t minor_hash;
+    unsigned int hash_version;
+    const uint32_t *seed;
+};
+
+struct ext2_dx_frame
+{
+    char *buf;
+    ext2_block_no lblk;
+    ext2_dx_entry *entries;
+    ext2_dx_entry *at;
+};
+
+/* Maps a live dirent in a leaf to its hash, for splitting */
+struct ext2_dx_map_entry
+{
+    uint32_t hash;
+    uint16_t offs;
+    uint16_t size;
+};
+
+static inline uint32_t rol32(uint32_t word, unsigned int shift)
+{
+    return (word << shift) | (word >> ((-shift) & 31));
+}
+
+#define DELTA 0x9E3779B9
+
+static void ext2_tea_transform(uint32_t buf[4], const uint32_t in[4])
+{
+    uint32_t sum = 0;
+    uint32_t b0 = buf[0], b1 = buf[1];
+    uint32_t a = in[0], b = in[1], c = in[2], d = in[3];
+    int n = 16;
+
+    do
+    {
+        sum += DELTA;
+        b0 += ((b1 << 4) + a) ^ (b1 + sum) ^ ((b1 >> 5) + b);
+        b1 += ((b0 << 4) + c) ^ (b0 + sum) ^ ((b0 >> 5) + d);
+    } while (--n);
+
+    buf[0] += b0;
+    buf[1] += b1;
+}
+
+/* F, G and H are basic MD4 functions: selection, majority, parity */
+#define F(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define G(x, y, z) (((x) & (y)) + (((x) ^ (y)) & (z)))
+#define H(x, y, z) ((x) ^ (y) ^ (z))
+
+#define ROUND(f, a, b, c, d, x, s) (a += f(b, c, d) + x, a = rol32(a, s))
+#define K1                         0
+#define K2                         013240474631U
+#define K3                         015666365641U
+
+static void ext2_half_md4_transform(uint32_t buf[4], const uint32_t in[8])
+{
+    uint32_t a = buf[0], b = buf[1], c = buf[2], d = buf[3];
+
+    /* Round 1 */
+    ROUND(F, a, b, c, d, in[0] + K1, 3);
+    ROUND(F, d, a, b, c, in[1] + K1, 7);
+    ROUND(F, c, d, a, b, in[2] + K1, 11);
+    ROUND(F, b, c, d, a, in[3] + K1, 19);
+    ROUND(F, a, b, c, d, in[4] + K1, 3);
+    ROUND(F, d, a, b, c, in[5] + K1, 7);
+    ROUND(F, c, d, a, b, in[6] + K1, 11);
+    ROUND(F, b, c, d, a, in[7] + K1, 19);
+
+    /* Round 2 */
+    ROUND(G, a, b, c, d, in[1] + K2, 3);
+    ROUND(G, d, a, b, c, in[3] + K2, 5);
+    ROUND(G, c, d, a, b, in[5] + K2, 9);
+    ROUND(G, b, c, d, a, in[7] + K2, 13);
+    ROUND(G, a, b, c, d, in[0] + K2, 3);
+    ROUND(G, d, a, b, c, in[2] + K2, 5);
+    ROUND(G, c, d, a, b, in[4] + K2, 9);
+    ROUND(G, b, c, d, a, in[6] + K2, 13);
+
+    /* Round 3 */
+    ROUND(H, a, b, c, d, in[3] + K3, 3);
+    ROUND(H, d, a, b, c, in[7] + K3, 9);
+    ROUND(H, c, d, a, b, in[2] + K3, 11);
+    ROUND(H, b, c, d, a, in[6] + K3, 15);
+    ROUND(H, a, b, c, d, in[1] + K3, 3);
+    ROUND(H, d, a, b, c, in[5] + K3, 9);
+    ROUND(H, c, d, a, b, in[0] + K3, 11);
+    ROUND(H, b, c, d, a, in[4] + K3, 15);
+
+    buf[0] += a;
+    buf[1] += b;
+    buf[2] += c;
+    buf[3] += d;
+}
+
+#undef ROUND
+#undef K1
+#undef K2
+#undef K3
+#undef F
+#undef G
+#undef H
+
+/* The old legacy hash */
+template <typename CharType>
+static uint32_t ext2_dx_hack_hash(const char *name, size_t len)
+{
+    uint32_t hash, hash0 = 0x12a3fe2d, hash1 = 0x37abe8f9;
+    const CharType *ucp = (const CharType *) name;
+
+    while (len--)
+    {
+        hash = hash1 + (hash0 ^ (((int) *ucp++) * 7152373));
+
+        if (hash & 0x80000000)
+            hash -= 0x7fffffff;
+        hash1 = hash0;
+        hash0 = hash;
+    }
+
+    return hash0 << 1;
+}
+
+template <typename CharType>
+static void ext2_str2hashbuf(const char *msg, size_t len, uint32_t *buf, int num)
+{
+    uint32_t pad, val;
+    const CharType *scp = (const CharType *) msg;
+
+    pad = (uint32_t) len | ((uint32_t) len << 8);
+    pad |= pad << 16;
+
+    val = pad;
+    if (len > (size_t) num * 4)
+        len = num * 4;
+
+    for (size_t i = 0; i < len; i++)
+    {
+        val = ((int) scp[i]) + (val << 8);
+        if ((i % 4) == 3)
+        {
+            *buf++ = val;
+            val = pad;
+            num--;
+        }
+    }
+
+    if (--num >= 0)
+        *buf++ = val;
+    while (--num >= 0)
+        *buf++ = pad;
+}
+
+/**
+ * @brief Hash a directory entry name, using the dir_index hash functions
+ *
+ * @param name Name of the entry
+ * @param len Length of the name
+ * @param hinfo Hash info, with hash_version and seed filled in. hash and minor_hash get filled.
+ * @return 0 on success, EXT2_ERR_BAD_DX_DIR if the hash version is not known.
+ */
+static int ext2_dx_hash(const char *name, size_t len, ext2_dx_hash_info *hinfo)
+{
+    uint32_t hash;
+    uint32_t minor_hash = 0;
+    uint32_t buf[4];
+    uint32_t in[8];
+    const char *p;
+    bool is_unsigned = false;
+
+    /* Initialize the default seed for the hash checksum functions */
+    buf[0] = 0x67452301;
+    buf[1] = 0xefcdab89;
+    buf[2] = 0x98badcfe;
+    buf[3] = 0x10325476;
+
+    /* Check to see if the seed is all zero's */
+    if (hinfo->seed)
+    {
+        for (int i = 0; i < 4; i++)
+        {
+            if (hinfo->seed[i])
+            {
+                memcpy(buf, hinfo->seed, sizeof(buf));
+                break;
+            }
+        }
+    }
+
+    switch (hinfo->hash_version)
+    {
+        case EXT2_DX_HASH_LEGACY_UNSIGNED:
+            hash = ext2_dx_hack_hash<unsigned char>(name, len);
+            break;
+        case EXT2_DX_HASH_LEGACY:
+            hash = ext2_dx_hack_hash<signed char>(name, len);
+            break;
+        case EXT2_DX_HASH_HALF_MD4_UNSIGNED:
+            is_unsigned = true;
+            [[fallthrough]];
+        case EXT2_DX_HASH_HALF_MD4:
+            p = name;
+            while (len > 0)
+            {
+                if (is_unsigned)
+                    ext2_str2hashbuf<unsigned char>(p, len, in, 8);
+                else
+                    ext2_str2hashbuf<signed char>(p, len, in, 8);
+                ext2_half_md4_transform(buf, in);
+                len -= cul::min(len, (size_t) 32);
+                p += 32;
+            }
+
+            minor_hash = buf[2];
+            hash = buf[1];
+            break;
+        case EXT2_DX_HASH_TEA_UNSIGNED:
+            is_unsigned = true;
+            [[fallthrough]];
+        case EXT2_DX_HASH_TEA:
+            p = name;
+            while (len > 0)
+            {
+                if (is_unsigned)
+                    ext2_str2hashbuf<unsigned char>(p, len, in, 4);
+                else
+                    ext2_str2hashbuf<signed char>(p, len, in, 4);
+                ext2_tea_transform(buf, in);
+                len -= cul::min(len, (size_t) 16);
+                p += 16;
+            }
+
+            hash = buf[0];
+            minor_hash = buf[1];
+            break;
+        default:
+            hinfo->hash = 0;
+            return EXT2_ERR_BAD_DX_DIR;
+    }
+
+    hash = hash & ~1;
+    if (hash == (EXT2_HTREE_EOF << 1))
+        hash = (EXT2_HTREE_EOF - 1) << 1;
+    hinfo->hash = hash;
+    hinfo->minor_hash = minor_hash;
+    return 0;
+}
+
+static inline unsigned int dx_get_count(ext2_dx_entry *entries)
+{
+    return ((ext2_dx_countlimit *) entries)->count;
+}
+
+static inline unsigned int dx_get_limit(ext2_dx_entry *entries)
+{
+    return ((ext2_dx_countlimit *) entries)->limit;
+}
+
+static inline void dx_set_count(ext2_dx_entry *entries, unsigned int value)
+{
+    ((ext2_dx_countlimit *) entries)->count = value;
+}
+
+static inline void dx_set_limit(ext2_dx_entry *entries, unsigned int value)
+{
+    ((ext2_dx_countlimit *) entries)->limit = value;
+}
+
+static inline ext2_block_no dx_get_block(ext2_dx_entry *entry)
+{
+    /* The top 8 bits are reserved */
+    return entry->block & 0x00ffffff;
+}
+
+static inline void dx_set_block(ext2_dx_entry *entry, ext2_block_no block)
+{
+    entry->block = block;
+}
+
+static inline unsigned int dx_root_limit(ext2_superblock *sb, unsigned int infosize)
+{
+    unsigned int entry_space = sb->block_size - ext2_calculate_dirent_size(1) -
+                               ext2_calculate_dirent_size(2) - infosize;
+    return entry_space / sizeof(ext2_dx_entry);
+}
+
+static inline unsigned int dx_node_limit(ext2_superblock *sb)
+{
+    unsigned int entry_space = sb->block_size - ext2_calculate_dirent_size(0);
+    return entry_space / sizeof(ext2_dx_entry);
+}
+
+static inline ext2_dx_entry *dx_node_entries(char *buf)
+{
+    return (ext2_dx_entry *) (buf + sizeof(ext2_dx_fake_dirent));
+}
+
+static inline ext2_dx_entry *dx_root_entries(char *buf)
+{
+    ext2_dx_root *root = (ext2_dx_root *) buf;
+    return (ext2_dx_entry *) ((char *) &root->info + root->info.info_length);
+}
+
+/**
+ * @brief Check if the directory has a usable hashed index
+ *
+ * @param dir Directory inode
+ * @param sb ext2 superblock
+ * @return True if we should use the index, else false
+ */
+bool ext2_dir_is_indexed(struct inode *dir, ext2_superblock *sb)
+{
+    if (!(sb->features_compat & EXT2_FEATURE_COMPAT_DIR_INDEX))
+        return false;
+    return ext2_get_inode_from_node(dir)->i_flags & EXT2_INDEX_FL;
+}
+
+static int ext2_dx_read_block(struct inode *dir, ext2_block_no lblk, char *buf,
+                              ext2_superblock *sb)
+{
+    size_t off = (size_t) lblk << sb->block_size_shift;
+    /* Index entries pointing past the end of the directory mean the index is corrupted */
+    if (off + sb->block_size > dir->i_size)
+        return EXT2_ERR_BAD_DX_DIR;
+
+    auto old = thread_change_addr_limit(VM_KERNEL_ADDR_LIMIT);
+    ssize_t st = file_read_cache(buf, sb->block_size, dir, off);
+    thread_change_addr_limit(old);
+
+    if (st < 0)
+        return st;
+    return (size_t) st == sb->block_size ? 0 : -EIO;
+}
+
+static int ext2_dx_write_block(struct inode *dir, ext2_block_no lblk, char *buf,
+                               ext2_superblock *sb)
+{
+    size_t off = (size_t) lblk << sb->block_size_shift;
+    auto old = thread_change_addr_limit(VM_KERNEL_ADDR_LIMIT);
+    ssize_t st = ext2_dir_write(buf, sb->block_size, dir, off);
+    thread_change_addr_limit(old);
+
+    return st < 0 ? st : 0;
+}
+
+static void ext2_dx_release(ext2_dx_frame *frames)
+{
+    for (int i = 0; i < EXT2_DX_MAX_LEVELS; i++)
+    {
+        free(frames[i].buf);
+        frames[i].buf = nullptr;
+    }
+}
+
+static void ext2_dx_init_hinfo(ext2_dx_hash_info *hinfo, unsigned int version, ext2_superblock *sb)
+{
+    hinfo->hash_version = version;
+    if (hinfo->hash_version <= EXT2_DX_HASH_TEA && sb->sb->s_flags & EXT2_FLAGS_UNSIGNED_HASH)
+        hinfo->hash_version += 3;
+    hinfo->seed = sb->sb->s_hash_seed;
+}
+
+/**
+ * @brief Walk the index down to the leaf that may contain name
+ *
+ * @param dir Directory inode
+ * @param name Name to look up
+ * @param len Length of the name
+ * @param hinfo Hash info, gets filled with the name's hash
+ * @param frames Array of EXT2_DX_MAX_LEVELS frames, that get filled with the path
+ * @param sb ext2 superblock
+ * @return Pointer to the deepest frame, or an ERR_PTR (EXT2_ERR_BAD_DX_DIR if the index looks
+ * corrupted)
+ */
+static ext2_dx_frame *ext2_dx_probe(struct inode *dir, const char *name, size_t len,
+                                    ext2_dx_hash_info *hinfo, ext2_dx_frame *frames,
+                                    ext2_superblock *sb)
+{
+    ext2_dx_frame *frame = frames;
+    ext2_dx_entry *entries, *p, *q, *m;
+    unsigned int count, indirect;
+    ext2_dx_root *root;
+    int st;
+
+    memset(frames, 0, sizeof(ext2_dx_frame) * EXT2_DX_MAX_LEVELS);
+
+    frame->buf = (char *) kmalloc(sb->block_size, GFP_NOFS);
+    if (!frame->buf)
+        return (ext2_dx_frame *) ERR_PTR(-ENOMEM);
+
+    if (st = ext2_dx_read_block(dir, 0, frame->buf, sb); st < 0)
+        goto err;
+
+    st = EXT2_ERR_BAD_DX_DIR;
+    root = (ext2_dx_root *) frame->buf;
+    if (root->info.reserved_zero != 0 || root->info.info_length != sizeof(ext2_dx_root_info) ||
+        root->info.unused_flags & 1)
+    {
+        pr_warn("ext2: directory inode %lu: bad htree root\n", dir->i_inode);
+        goto err;
+    }
+
+    if (root->info.hash_version > EXT2_DX_HASH_TEA)
+    {
+        pr_warn("ext2: directory inode %lu: unrecognised hash version %u\n", dir->i_inode,
+                root->info.hash_version);
+        goto err;
+    }
+
+    indirect = root->info.indirect_levels;
+    if (indirect >= EXT2_DX_MAX_LEVELS)
+    {
+        pr_warn("ext2: directory inode %lu: htree depth %u not supported\n", dir->i_inode,
+                indirect);
+        goto err;
+    }
+
+    ext2_dx_init_hinfo(hinfo, root->info.hash_version, sb);
+    if (name)
+    {
+        if (st = ext2_dx_hash(name, len, hinfo); st < 0)
+            goto err;
+    }
+
+    entries = dx_root_entries(frame->buf);
+    if (dx_get_limit(entries) != dx_root_limit(sb, root->info.info_length))
+    {
+        pr_warn("ext2: directory inode %lu: htree root limit mismatch\n", dir->i_inode);
+        st = EXT2_ERR_BAD_DX_DIR;
+        goto err;
+    }
+
+    while (true)
+    {
+        count = dx_get_count(entries);
+        if (!count || count > dx_get_limit(entries))
+        {
+            pr_warn("ext2: directory inode %lu: htree has a bad entry count\n", dir->i_inode);
+            st = EXT2_ERR_BAD_DX_DIR;
+            goto err;
+        }
+
+        /* Binary search for the last entry with hash <= ours. entries[0] has no hash, and covers
+         * everything below entries[1].hash. */
+        p = entries + 1;
+        q = entries + count - 1;
+        while (p <= q)
+        {
+            m = p + (q - p) / 2;
+            if (m->hash > hinfo->hash)
+                q = m - 1;
+            else
+                p = m + 1;
+        }
+
+        frame->entries = entries;
+        frame->at = p - 1;
+
+        if (indirect-- == 0)
+            return frame;
+
+        frame++;
+        frame->lblk = dx_get_block(frame[-1].at);
+        frame->buf = (char *) kmalloc(sb->block_size, GFP_NOFS);
+        if (!frame->buf)
+        {
+            st = -ENOMEM;
+            goto err;
+        }
+
+        if (st = ext2_dx_read_block(dir, frame->lblk, frame->buf, sb); st < 0)
+            goto err;
+
+        entries = dx_node_entries(frame->buf);
+        if (dx_get_limit(entries) != dx_node_limit(sb))
+        {
+            pr_warn("ext2: directory inode %lu: htree node limit mismatch\n", dir->i_inode);
+            st = EXT2_ERR_BAD_DX_DIR;
+            goto err;
+        }
+    }
+
+err:
+    ext2_dx_release(frames);
+    return (ext2_dx_frame *) ERR_PTR(st);
+}
+
+/**
+ * @brief Advance the path to the next leaf, if it may contain entries with our hash
+ * (this happens when a run of entries with colliding hashes got split across leaves).
+ *
+ * @return 1 if we moved on to the next leaf, 0 if there's nothing left to search, negative error
+ * codes
+ */
+static int ext2_dx_next_block(struct inode *dir, uint32_t hash, ext2_dx_frame *frames,
+                              ext2_dx_frame *frame, ext2_superblock *sb)
+{
+    ext2_dx_frame *p = frame;
+    int num_frames = 0;
+
+    while (true)
+    {
+        p->at++;
+        if (p->at < p->entries + dx_get_count(p->entries))
+            break;
+        if (p == frames)
+            return 0;
+        num_frames++;
+        p--;
+    }
+
+    /* The low bit of the hash marks a continuation of the previous leaf's hash run */
+    if ((p->at->hash & ~1) != hash)
+        return 0;
+
+    while (num_frames--)
+    {
+        ext2_block_no lblk = dx_get_block(p->at);
+        p++;
+        p->lblk = lblk;
+        if (int st = ext2_dx_read_block(dir, lblk, p->buf, sb); st < 0)
+            return st;
+        p->at = p->entries = dx_node_entries(p->buf);
+    }
+
+    return 1;
+}
+
+static int ext2_dx_search_leaf(char *buf, const char *name, size_t len, ext2_superblock *sb)
+{
+    for (size_t off = 0; off < sb->block_size;)
+    {
+        ext2_dir_entry_t *entry = (ext2_dir_entry_t *) (buf + off);
+        if (!sb->valid_dirent(entry, off))
+        {
+            sb->error("Invalid directory entry");
+            return -EIO;
+        }
+
+        if (entry->inode != 0 && entry->name_len == len && !memcmp(entry->name, name, len))
+            return off;
+
+        off += entry->rec_len;
+    }
+
+    return -ENOENT;
+}
+
+/**
+ * @brief Look up a directory entry using the hashed index
+ *
+ * @param dir Directory inode
+ * @param name Name of the entry
+ * @param sb ext2 superblock
+ * @param res Result, filled in the same way as ext2_retrieve_dirent does
+ * @return 1 if found, -ENOENT if not found, EXT2_ERR_BAD_DX_DIR if the index is unusable,
+ * other negative error codes
+ */
+int ext2_dx_find_entry(struct inode *dir, const char *name, ext2_superblock *sb,
+                       ext2_dirent_result *res)
+{
+    ext2_dx_frame frames[EXT2_DX_MAX_LEVELS];
+    ext2_dx_hash_info hinfo;
+    size_t len = strlen(name);
+    ext2_dx_frame *frame;
+    int st;
+
+    frame = ext2_dx_probe(dir, name, len, &hinfo, frames, sb);
+    if (IS_ERR(frame))
+        return PTR_ERR(frame);
+
+    char *buf = (char *) kmalloc(sb->block_size, GFP_NOFS);
+    if (!buf)
+    {
+        ext2_dx_release(frames);
+        return -ENOMEM;
+    }
+
+    do
+    {
+        ext2_block_no lblk = dx_get_block(frame->at);
+        if (st = ext2_dx_read_block(dir, lblk, buf, sb); st < 0)
+            goto out;
+
+        st = ext2_dx_search_leaf(buf, name, len, sb);
+        if (st >= 0)
+        {
+            res->block_off = st;
+            res->file_off = ((off_t) lblk << sb->block_size_shift) + st;
+            res->buf = buf;
+            buf = nullptr;
+            st = 1;
+            goto out;
+        }
+
+        if (st != -ENOENT)
+            goto out;
+
+        st = ext2_dx_next_block(dir, hinfo.hash, frames, frame, sb);
+        if (st < 0)
+            goto out;
+    } while (st == 1);
+
+    st = -ENOENT;
+out:
+    free(buf);
+    ext2_dx_release(frames);
+    return st;
+}
+
+static void ext2_dx_insert_block(ext2_dx_frame *frame, uint32_t hash, ext2_block_no block)
+{
+    ext2_dx_entry *entries = frame->entries;
+    ext2_dx_entry *old = frame->at, *new_entry = old + 1;
+    unsigned int count = dx_get_count(entries);
+
+    DCHECK(count < dx_get_limit(entries));
+    DCHECK(old < entries + count);
+    memmove(new_entry + 1, new_entry, (char *) (entries + count) - (char *) new_entry);
+    new_entry->hash = hash;
+    new_entry->block = block;
+    dx_set_count(entries, count + 1);
+}
+
+static void ext2_dx_sort_map(ext2_dx_map_entry *map, unsigned int count)
+{
+    /* Leaves hold a few hundred entries at most, insertion sort does the job */
+    for (unsigned int i = 1; i < count; i++)
+    {
+        ext2_dx_map_entry tmp = map[i];
+        unsigned int j = i;
+        for (; j > 0 && map[j - 1].hash > tmp.hash; j--)
+            map[j] = map[j - 1];
+        map[j] = tmp;
+    }
+}
+
+/**
+ * @brief Pack a set of dirents (described by map) at the start of a block
+ *
+ * @param to Destination block
+ * @param from Source block
+ * @param map Map entries to copy
+ * @param count Number of map entries
+ * @param sb ext2 superblock
+ */
+static void ext2_dx_pack_dirents(char *to, const char *from, ext2_dx_map_entry *map,
+                                 unsigned int count, ext2_superblock *sb)
+{
+    ext2_dir_entry_t *last = nullptr;
+    size_t off = 0;
+
+    memset(to, 0, sb->block_size);
+
+    for (unsigned int i = 0; i < count; i++)
+    {
+        ext2_dir_entry_t *d = (ext2_dir_entry_t *) (to + off);
+        memcpy(d, from + map[i].offs, map[i].size);
+        d->rec_len = map[i].size;
+        off += map[i].size;
+        last = d;
+    }
+
+    if (last)
+        last->rec_len += sb->block_size - off;
+    else
+    {
+        ext2_dir_entry_t *d = (ext2_dir_entry_t *) to;
+        d->inode = 0;
+        d->rec_len = sb->block_size;
+    }
+}
+
+/**
+ * @brief Split a full leaf in two, by hash
+ *
+ * @param dir Directory inode
+ * @param leaf Leaf contents (gets rewritten with the lower half)
+ * @param leaf_lblk Logical block number of the leaf
+ * @param frame Deepest index frame, at points to the leaf. Must have room for a new entry.
+ * @param hinfo Hash info for the name that is going to be inserted
+ * @param out Gets filled with the block the new name should go to (leaf or a new block)
+ * @param out_lblk Logical block number of out
+ * @param sb ext2 superblock
+ * @return 0 on success, negative error codes
+ */
+static int ext2_dx_split_leaf(struct inode *dir, char *leaf, ext2_block_no leaf_lblk,
+                              ext2_dx_frame *frame, ext2_dx_hash_info *hinfo, char **out,
+                              ext2_block_no *out_lblk, ext2_superblock *sb)
+{
+    unsigned int count = 0, move = 0, split;
+    ext2_dx_map_entry *map = nullptr;
+    uint32_t hash2, continued;
+    size_t size = 0;
+    ext2_block_no new_lblk = dir->i_size >> sb->block_size_shift;
+    char *copy = nullptr;
+    char *new_leaf = nullptr;
+    int st = -ENOMEM;
+
+    map = (ext2_dx_map_entry *) kcalloc(sb->block_size / EXT2_MIN_DIR_ENTRY_LEN,
+                                        sizeof(ext2_dx_map_entry), GFP_NOFS);
+    copy = (char *) kmalloc(sb->block_size, GFP_NOFS);
+    new_leaf = (char *) kmalloc(sb->block_size, GFP_NOFS);
+    if (!map || !copy || !new_leaf)
+        goto err;
+
+    memcpy(copy, leaf, sb->block_size);
+
+    for (size_t off = 0; off < sb->block_size;)
+    {
+        ext2_dir_entry_t *entry = (ext2_dir_entry_t *) (copy + off);
+        if (!sb->valid_dirent(entry, off))
+        {
+            sb->error("Invalid directory entry");
+            st = -EIO;
+            goto err;
+        }
+
+        if (entry->inode != 0)
+        {
+            ext2_dx_hash_info h = *hinfo;
+            ext2_dx_hash(entry->name, entry->name_len, &h);
+            map[count].hash = h.hash;
+            map[count].offs = off;
+            map[count].size = ext2_calculate_dirent_size(entry->name_len);
+            count++;
+        }
+
+        off += entry->rec_len;
+    }
+
+    if (count < 2)
+    {
+        /* A full leaf with less than two entries can't happen on a sane directory */
+        st = EXT2_ERR_BAD_DX_DIR;
+        goto err;
+    }
+
+    ext2_dx_sort_map(map, count);
+
+    /* Split the existing block in the middle, size-wise */
+    for (int i = count - 1; i >= 0; i--)
+    {
+        /* is more than half of this entry in 2nd half of the block? */
+        if (size + map[i].size / 2 > sb->block_size / 2)
+            break;
+        size += map[i].size;
+        move++;
+    }
+
+    split = count - move;
+    if (split == 0)
+        split = 1;
+    else if (split == count)
+        split = count - 1;
+    hash2 = map[split].hash;
+    continued = hash2 == map[split - 1].hash;
+
+    ext2_dx_pack_dirents(new_leaf, copy, map + split, count - split, sb);
+    ext2_dx_pack_dirents(leaf, copy, map, split, sb);
+
+    /* Write the new leaf first, so the directory is already big enough when the index points
+     * to it. */
+    if (st = ext2_dx_write_block(dir, new_lblk, new_leaf, sb); st < 0)
+        goto err;
+    if (st = ext2_dx_write_block(dir, leaf_lblk, leaf, sb); st < 0)
+        goto err;
+
+    ext2_dx_insert_block(frame, hash2 + continued, new_lblk);
+    if (st = ext2_dx_write_block(dir, frame->lblk, frame->buf, sb); st < 0)
+        goto err;
+
+    if (hinfo->hash >= hash2)
+    {
+        memcpy(leaf, new_leaf, sb->block_size);
+        *out_lblk = new_lblk;
+    }
+    else
+        *out_lblk = leaf_lblk;
+
+    *out = leaf;
+    st = 0;
+err:
+    free(map);
+    free(copy);
+    free(new_leaf);
+    return st;
+}
+
+/**
+ * @brief Make room for a new entry in the deepest index block, splitting index nodes or growing
+ * the tree as needed
+ *
+ * @param dir Directory inode
+ * @param frames Path to the leaf
+ * @param frame Deepest frame
+ * @param sb ext2 superblock
+ * @return Pointer to the (possibly new) deepest frame, or an ERR_PTR
+ */
+static ext2_dx_frame *ext2_dx_make_room(struct inode *dir, ext2_dx_frame *frames,
+                                        ext2_dx_frame *frame, ext2_superblock *sb)
+{
+    ext2_dx_entry *entries = frame->entries;
+    unsigned int count = dx_get_count(entries);
+    ext2_block_no new_lblk = dir->i_size >> sb->block_size_shift;
+    char *node;
+    int st;
+
+    if (count < dx_get_limit(entries))
+        return frame;
+
+    if (frame != frames && dx_get_count(frames[0].entries) == dx_get_limit(frames[0].entries))
+    {
+        pr_warn("ext2: directory inode %lu: directory index full\n", dir->i_inode);
+        return (ext2_dx_frame *) ERR_PTR(-ENOSPC);
+    }
+
+    node = (char *) kcalloc(sb->block_size, 1, GFP_NOFS);
+    if (!node)
+        return (ext2_dx_frame *) ERR_PTR(-ENOMEM);
+
+    ((ext2_dx_fake_dirent *) node)->rec_len = sb->block_size;
+    ext2_dx_entry *entries2 = dx_node_entries(node);
+
+    if (frame != frames)
+    {
+        /* Split the index node in two, and link the new one from the root */
+        unsigned int count1 = count / 2, count2 = count - count1;
+        uint32_t hash2 = entries[count1].hash;
+
+        memcpy(entries2, entries + count1, count2 * sizeof(ext2_dx_entry));
+        dx_set_count(entries, count1);
+        dx_set_count(entries2, count2);
+        dx_set_limit(entries2, dx_node_limit(sb));
+
+        if (st = ext2_dx_write_block(dir, new_lblk, node, sb); st < 0)
+            goto err;
+
+        if (frame->at >= entries + count1)
+        {
+            /* Our path now goes through the new node, swap the buffers around */
+            unsigned int idx = frame->at - (entries + count1);
+            if (st = ext2_dx_write_block(dir, frame->lblk, frame->buf, sb); st < 0)
+                goto err;
+
+            cul::swap(frame->buf, node);
+            frame->lblk = new_lblk;
+            frame->entries = dx_node_entries(frame->buf);
+            frame->at = frame->entries + idx;
+            ext2_dx_insert_block(&frames[0], hash2, new_lblk);
+            frames[0].at++;
+        }
+        else
+        {
+            if (st = ext2_dx_write_block(dir, frame->lblk, frame->buf, sb); st < 0)
+                goto err;
+            ext2_dx_insert_block(&frames[0], hash2, new_lblk);
+        }
+
+        if (st = ext2_dx_write_block(dir, 0, frames[0].buf, sb); st < 0)
+            goto err;
+    }
+    else
+    {
+        /* The root is full, move its entries to a new node and add a level to the tree */
+        ext2_dx_root *root = (ext2_dx_root *) frames[0].buf;
+
+        memcpy(entries2, entries, count * sizeof(ext2_dx_entry));
+        dx_set_limit(entries2, dx_node_limit(sb));
+
+        if (st = ext2_dx_write_block(dir, new_lblk, node, sb); st < 0)
+            goto err;
+
+        dx_set_count(entries, 1);
+        dx_set_block(entries, new_lblk);
+        root->info.indirect_levels = 1;
+        if (st = ext2_dx_write_block(dir, 0, frames[0].buf, sb); st < 0)
+            goto err;
+
+        frame = &frames[1];
+        frame->lblk = new_lblk;
+        frame->buf = node;
+        frame->entries = entries2;
+        frame->at = entries2 + (frames[0].at - entries);
+        frames[0].at = entries;
+        node = nullptr;
+    }
+
+    free(node);
+    return frame;
+err:
+    free(node);
+    return (ext2_dx_frame *) ERR_PTR(st);
+}
+
+/**
+ * @brief Add a directory entry to an indexed directory
+ *
+ * @param dir Directory inode
+ * @param entry Directory entry to add
+ * @param sb ext2 superblock
+ * @return 0 on success, EXT2_ERR_BAD_DX_DIR if the index is unusable, other negative error codes
+ */
+int ext2_dx_add_entry(struct inode *dir, const ext2_dir_entry_t *entry, ext2_superblock *sb)
+{
+    ext2_dx_frame frames[EXT2_DX_MAX_LEVELS];
+    ext2_dx_hash_info hinfo;
+    ext2_dx_frame *frame;
+    ext2_block_no lblk;
+    char *leaf, *target;
+    int st;
+
+    frame = ext2_dx_probe(dir, entry->name, entry->name_len, &hinfo, frames, sb);
+    if (IS_ERR(frame))
+        return PTR_ERR(frame);
+
+    leaf = (char *) kmalloc(sb->block_size, GFP_NOFS);
+    if (!leaf)
+    {
+        st = -ENOMEM;
+        goto out;
+    }
+
+    lblk = dx_get_block(frame->at);
+    if (st = ext2_dx_read_block(dir, lblk, leaf, sb); st < 0)
+        goto out;
+
+    st = ext2_insert_dirent_in_block(leaf, entry, sb);
+    if (st < 0)
+        goto out;
+    if (st == 1)
+    {
+        st = ext2_dx_write_block(dir, lblk, leaf, sb);
+        goto out;
+    }
+
+    /* The leaf is full, we need to split it (and maybe its parents) */
+    frame = ext2_dx_make_room(dir, frames, frame, sb);
+    if (IS_ERR(frame))
+    {
+        st = PTR_ERR(frame);
+        goto out;
+    }
+
+    if (st = ext2_dx_split_leaf(dir, leaf, lblk, frame, &hinfo, &target, &lblk, sb); st < 0)
+        goto out;
+
+    st = ext2_insert_dirent_in_block(target, entry, sb);
+    if (st == 0)
+    {
+        /* Both halves are at most half full, this can't happen */
+        st = EXT2_ERR_BAD_DX_DIR;
+        goto out;
+    }
+
+    if (st > 0)
+        st = ext2_dx_write_block(dir, lblk, target, sb);
+out:
+    free(leaf);
+    ext2_dx_release(frames);
+    return st;
+}
+
+/**
+ * @brief Convert a full, single block directory into an indexed one, and add an entry to it
+ *
+ * @param dir Directory inode
+ * @param block Contents of the directory's only block
+ * @param entry Directory entry to add
+ * @param sb ext2 superblock
+ * @return 0 on success, EXT2_ERR_BAD_DX_DIR if the directory can't be indexed (and should be
+ * grown linearly), other negative error codes
+ */
+int ext2_dx_make_indexed_dir(struct inode *dir, char *block, const ext2_dir_entry_t *entry,
+                             ext2_superblock *sb)
+{
+    ext2_dx_root *root = (ext2_dx_root *) block;
+    ext2_dx_frame frames[EXT2_DX_MAX_LEVELS];
+    ext2_dx_frame *frame = frames;
+    ext2_dx_hash_info hinfo;
+    ext2_dir_entry_t *de, *last;
+    ext2_block_no lblk = 1;
+    ext2_dx_entry *entries;
+    char *leaf, *target;
+    size_t len, off;
+    int st;
+
+    /* The root layout requires "." and ".." to be the first two entries, with minimal sizes */
+    if (root->dot.d.name_len != 1 || root->dot.name[0] != '.' ||
+        root->dot.d.rec_len != ext2_calculate_dirent_size(1) || root->dotdot.d.name_len != 2 ||
+        root->dotdot.name[0] != '.' || root->dotdot.name[1] != '.')
+        return EXT2_ERR_BAD_DX_DIR;
+
+    de = (ext2_dir_entry_t *) ((char *) &root->dotdot + root->dotdot.d.rec_len);
+    if ((char *) de >= block + sb->block_size)
+        return EXT2_ERR_BAD_DX_DIR;
+
+    memset(frames, 0, sizeof(frames));
+    leaf = (char *) kcalloc(sb->block_size, 1, GFP_NOFS);
+    if (!leaf)
+        return -ENOMEM;
+
+    /* The 0th block becomes the root, move the dirents out */
+    len = block + sb->block_size - (char *) de;
+    memcpy(leaf, de, len);
+
+    last = nullptr;
+    for (off = 0; off < len;)
+    {
+        de = (ext2_dir_entry_t *) (leaf + off);
+        if (!sb->valid_dirent(de, off))
+        {
+            sb->error("Invalid directory entry");
+            st = -EIO;
+            goto out;
+        }
+
+        last = de;
+        off += de->rec_len;
+    }
+
+    if (last)
+        last->rec_len += sb->block_size - len;
+    else
+    {
+        de = (ext2_dir_entry_t *) leaf;
+        de->inode = 0;
+        de->rec_len = sb->block_size;
+    }
+
+    /* Initialize the root; the dot dirents already exist */
+    root->dotdot.d.rec_len = sb->block_size - ext2_calculate_dirent_size(1);
+    memset(&root->info, 0, sizeof(root->info));
+    root->info.info_length = sizeof(ext2_dx_root_info);
+    root->info.hash_version = sb->sb->s_def_hash_version;
+    if (root->info.hash_version > EXT2_DX_HASH_TEA)
+        root->info.hash_version = EXT2_DX_HASH_HALF_MD4;
+
+    entries = dx_root_entries(block);
+    memset(entries, 0, block + sb->block_size - (char *) entries);
+    dx_set_block(entries, lblk);
+    dx_set_count(entries, 1);
+    dx_set_limit(entries, dx_root_limit(sb, sizeof(ext2_dx_root_info)));
+
+    if (st = ext2_dx_write_block(dir, lblk, leaf, sb); st < 0)
+        goto out;
+    if (st = ext2_dx_write_block(dir, 0, block, sb); st < 0)
+        goto out;
+
+    ext2_get_inode_from_node(dir)->i_flags |= EXT2_INDEX_FL;
+    inode_mark_dirty(dir);
+
+    ext2_dx_init_hinfo(&hinfo, root->info.hash_version, sb);
+    if (st = ext2_dx_hash(entry->name, entry->name_len, &hinfo); st < 0)
+        goto out;
+
+    /* The root block is owned by the caller, so give the frame a copy of it */
+    frame->buf = (char *) kmalloc(sb->block_size, GFP_NOFS);
+    if (!frame->buf)
+    {
+        st = -ENOMEM;
+        goto out;
+    }
+
+    memcpy(frame->buf, block, sb->block_size);
+    frame->lblk = 0;
+    frame->entries = frame->at = dx_root_entries(frame->buf);
+
+    /* Now split the old contents by hash, so the index is actually useful */
+    if (st = ext2_dx_split_leaf(dir, leaf, lblk, frame, &hinfo, &target, &lblk, sb); st < 0)
+        goto out;
+
+    st = ext2_insert_dirent_in_block(target, entry, sb);
+    if (st == 0)
+        st = -ENOSPC;
+    if (st > 0)
+        st = ext2_dx_write_block(dir, lblk, target, sb);
+out:
+    free(leaf);
+    ext2_dx_release(frames);
+    return st;
+}
@@ -7,6 +7,7 @@
  */
 
 #include "ext2.h"
+#include "journal.h"
 
 #include <errno.h>
 #include <stdio.h>
@@ -98,6 +99,14 @@ void ext2_close(struct inode *vfs_ino)
 {
     struct ext2_inode *inode = ext2_get_inode_from_node(vfs_ino);
 
+    {
+        ext2_handle handle{ext2_superblock_from_inode(vfs_ino)};
+        ext2_discard_prealloc(vfs_ino);
+    }
+
+    ext2_da_release_all(vfs_ino);
+    ext2_journal_forget_inode(vfs_ino);
+
     /* TODO: It would be better, cache-wise and memory allocator-wise if we
      * had ext2_inode incorporate a struct inode inside it, and have everything in the same
      * location.
@@ -107,10 +116,8 @@ void ext2_close(struct inode *vfs_ino)
     free(inode);
 }
 
-static void ext2_writepage_endio(struct bio_req *req)
+static void ext2_writepage_end_buf(struct page *page, struct block_buf *buf)
 {
-    struct page *page = req->vec[0].page;
-    struct block_buf *buf = (struct block_buf *) req->b_private;
     struct block_buf *head = (struct block_buf *) page->priv;
     DCHECK(head != nullptr);
 
@@ -121,6 +128,28 @@ static void ext2_writepage_endio(struct bio_req *req)
     spin_unlock(&head->pagestate_lock);
 }
 
+static void ext2_writepage_endio(struct bio_req *req)
+{
+    ext2_writepage_end_buf(req->vec[0].page, (struct block_buf *) req->b_private);
+}
+
+/* Ordered data write: the transaction that allocated the blocks can't commit until we're done */
+struct ext2_ordered_io
+{
+    struct block_buf *buf;
+    struct ext2_transaction *txn;
+};
+
+static void ext2_writepage_ordered_endio(struct bio_req *req)
+{
+    struct ext2_ordered_io *io = (struct ext2_ordered_io *) req->b_private;
+    struct ext2_transaction *txn = io->txn;
+
+    ext2_writepage_end_buf(req->vec[0].page, io->buf);
+    delete io;
+    ext2_journal_ordered_end(txn);
+}
+
 static ssize_t ext2_writepage(struct vm_object *obj, page *page, size_t off) REQUIRES(page)
     RELEASE(page)
 {
@@ -128,11 +157,60 @@ static ssize_t ext2_writepage(struct vm_object *obj, page *page, size_t off) REQ
     struct inode *ino = obj->ino;
     auto sb = ext2_superblock_from_inode(ino);
     unsigned int nr_ios = 0;
+    struct ext2_transaction *txn = nullptr;
+    struct ext2_ordered_io *ordered[PAGE_SIZE / EXT2_MIN_BLOCK_SIZE] = {};
+    unsigned int nr_ordered = 0;
     DCHECK(buf != nullptr);
 
+    if (sb->journal && !S_ISREG(ino->i_mode))
+    {
+        /* Directory and symlink blocks are journaled, the journal writes them back */
+        unlock_page(page);
+        return PAGE_SIZE;
+    }
+
+    ext2_handle handle{sb};
+
+    /* Allocate blocks for delalloc buffers. The first one allocates for everything the inode has
+     * reserved, the rest come out of the preallocation window. */
+    for (auto b = buf; b != nullptr; b = b->next)
+    {
+        if (!bb_test_flag(b, BLOCKBUF_FLAG_DELALLOC))
+            continue;
+
+        auto res = ext2_create_path(ino, (off + b->page_off) >> sb->block_size_shift, sb);
+        if (res.has_error())
+        {
+            sb->error("Failed to allocate delalloc block");
+            unlock_page(page);
+            return res.error();
+        }
+
+        b->block_nr = res.value();
+        bb_clear_flag(b, BLOCKBUF_FLAG_DELALLOC);
+        ext2_da_release_block(ino, true);
+        /* Ordered mode: the data must hit the disk before the allocation commits */
+        txn = ext2_journal_current(sb);
+    }
+
+    if (txn)
+    {
+        for (auto b = buf; b != nullptr; b = b->next, nr_ordered++)
+        {
+            ordered[nr_ordered] = new ext2_ordered_io{b, txn};
+            if (!ordered[nr_ordered])
+            {
+                for (unsigned int i = 0; i < nr_ordered; i++)
+                    delete ordered[i];
+                unlock_page(page);
+                return -ENOMEM;
+            }
+        }
+    }
+
     page_start_writeback(page);
 
-    while (buf)
+    for (unsigned int i = 0; buf; i++)
     {
         page_iov v[1];
         v->length = buf->block_size;
@@ -151,8 +229,23 @@ static ssize_t ext2_writepage(struct vm_object *obj, page *page, size_t off) REQ
 		printk("Writing to block %lu\n", buf->block_nr);
 #endif
 
-        if (sb_write_bio(sb, v, 1, buf->block_nr, ext2_writepage_endio, buf) < 0)
+        int st;
+        if (txn)
         {
+            ext2_journal_ordered_start(txn);
+            st = sb_write_bio(sb, v, 1, buf->block_nr, ext2_writepage_ordered_endio, ordered[i]);
+            if (st < 0)
+                ext2_journal_ordered_end(txn);
+            else
+                ordered[i] = nullptr;
+        }
+        else
+            st = sb_write_bio(sb, v, 1, buf->block_nr, ext2_writepage_endio, buf);
+
+        if (st < 0)
+        {
+            for (unsigned int j = 0; j < nr_ordered; j++)
+                delete ordered[j];
             page_end_writeback(page);
             sb->error("Error writing back page");
             unlock_page(page);
@@ -163,6 +256,9 @@ static ssize_t ext2_writepage(struct vm_object *obj, page *page, size_t off) REQ
         buf = buf->next;
     }
 
+    for (unsigned int i = 0; i < nr_ordered; i++)
+        delete ordered[i];
+
     /* For this to have been a valid dirty page, we must've been able to submit more than 0 ios (a
      * page full of zero blocks cannot be dirty, as prepare_write must be called). */
     CHECK_PAGE(nr_ios > 0, page);
@@ -370,6 +466,7 @@ struct ext2_inode_info *ext2_cache_inode_info(struct inode *ino, struct ext2_ino
         return nullptr;
 
     inf->inode = fs_ino;
+    INIT_LIST_HEAD(&inf->j_node);
 
     return inf;
 }
@@ -433,8 +530,27 @@ int ext2_open(struct dentry *dir, const char *name, struct dentry *dentry)
 
 void ext2_truncate_partial(struct vm_object *vmobj, struct page *page, size_t offset, size_t len);
 
+static void ext2_free_page(struct vm_object *vmo, struct page *page)
+{
+    /* Pages with delalloc buffers can get truncated before ever being written back, give back
+     * their reservations. */
+    if (page_flag_set(page, PAGE_FLAG_BUFFER))
+    {
+        for (auto b = block_buf_from_page(page); b != nullptr; b = b->next)
+        {
+            if (bb_test_flag(b, BLOCKBUF_FLAG_DELALLOC))
+            {
+                bb_clear_flag(b, BLOCKBUF_FLAG_DELALLOC);
+                ext2_da_release_block(vmo->ino, false);
+            }
+        }
+    }
+
+    buffer_free_page(vmo, page);
+}
+
 static const struct vm_object_ops ext2_vm_obj_ops = {
-    .free_page = buffer_free_page,
+    .free_page = ext2_free_page,
     .truncate_partial = ext2_truncate_partial,
     .writepage = ext2_writepage,
     .writepages = filemap_writepages,
@@ -532,6 +648,7 @@ struct inode *ext2_create_file(const char *name, mode_t mode, dev_t dev, struct
 {
     struct inode *vfs_ino = dir->d_inode;
     struct ext2_superblock *fs = ext2_superblock_from_inode(vfs_ino);
+    ext2_handle handle{fs};
     uint32_t inumber = 0;
     struct inode *ino = nullptr;
 
@@ -627,7 +744,13 @@ struct inode *ext2_creat(struct dentry *dentry, int mode, struct dentry *dir)
     return i;
 }
 
-int ext2_flush_inode(struct inode *inode, bool in_sync)
+/**
+ * @brief Copy the in-core inode into the inode table
+ *
+ * @param inode Inode to write
+ * @param in_sync If this is part of a sync/fsync call
+ */
+void ext2_write_inode(struct inode *inode, bool in_sync)
 {
     struct ext2_inode *ino = ext2_get_inode_from_node(inode);
     struct ext2_superblock *fs = ext2_superblock_from_inode(inode);
@@ -646,14 +769,36 @@ int ext2_flush_inode(struct inode *inode, bool in_sync)
     ino->i_uid = inode->i_uid;
 
     fs->update_inode(ino, (ext2_inode_no) inode->i_inode, in_sync);
+}
 
+int ext2_flush_inode(struct inode *inode, bool in_sync)
+{
+    struct ext2_superblock *fs = ext2_superblock_from_inode(inode);
+
+    if (fs->journal)
+    {
+        /* The inode gets written when the transaction commits. A sync just wants it to happen
+         * soon; fsync waits for the commit through ->fsync. */
+        ext2_journal_dirty_inode(inode);
+        if (in_sync)
+            ext2_journal_kick(fs);
+        return 0;
+    }
+
+    ext2_write_inode(inode, in_sync);
     return 0;
 }
 
+static int ext2_fsync(struct inode *inode)
+{
+    return ext2_journal_commit_inode(inode);
+}
+
 int ext2_kill_inode(struct inode *inode)
 {
     struct ext2_superblock *fs = ext2_superblock_from_inode(inode);
 
+    ext2_handle handle{fs};
     ext2_delete_inode(inode, (uint32_t) inode->i_inode, fs);
     return 0;
 }
@@ -669,6 +814,7 @@ static int ext2_shutdown_sb(struct superblock *sb_)
     /* Shutdown the sb generically first, then tear down the ext2_superblock. This is required for
      * e.g sync purposes. */
     sb_generic_shutdown(sb);
+    ext2_journal_destroy(sb);
     sb->~ext2_superblock();
     return 0;
 }
@@ -791,6 +937,11 @@ struct superblock *ext2_mount_partition(struct vfs_mount_info *info)
             goto error;
     }
 
+    /* Replays the journal if needed, so it must come before we look at any inode */
+    if (err = ext2_journal_load(sb); err < 0)
+        goto error;
+    err = -EIO;
+
     root_inode = ext2_load_inode_from_disk(2, sb);
     if (!root_inode)
         goto error;
@@ -800,11 +951,17 @@ struct superblock *ext2_mount_partition(struct vfs_mount_info *info)
     sb->kill_inode = ext2_kill_inode;
     sb->statfs = ext2_statfs;
     sb->shutdown = ext2_shutdown_sb;
+    sb->s_flags |= SB_FLAG_FS_NLINK;
+    if (sb->journal)
+    {
+        sb->dirty_inode = ext2_journal_dirty_inode;
+        sb->fsync = ext2_fsync;
+    }
 
     sb->sb->s_mtime = clock_get_posix_time();
     sb->sb->s_mnt_count++;
 
-    block_buf_dirty(sb->sb_bb);
+    ext2_dirty_sb(sb);
 
     root_inode->i_fops = &ext2_ops;
     root_inode->i_op = &ext2_ino_ops;
@@ -814,6 +971,8 @@ struct superblock *ext2_mount_partition(struct vfs_mount_info *info)
 error:
     if (b)
         block_buf_put(b);
+    if (sb)
+        ext2_journal_destroy(sb);
     delete sb;
 
     return (struct superblock *) ERR_PTR(err);
@@ -885,6 +1044,7 @@ struct inode *ext2_mknod(struct dentry *dentry, mode_t mode, dev_t dev, struct d
 
 struct inode *ext2_mkdir(struct dentry *dentry, mode_t mode, struct dentry *dir)
 {
+    ext2_handle handle{ext2_superblock_from_inode(dir->d_inode)};
     struct inode *new_dir = ext2_create_file(dentry->d_name, (mode & 0777) | S_IFDIR, 0, dir);
     if (!new_dir)
         return nullptr;
@@ -939,8 +1099,9 @@ int ext2_superblock::stat_fs(struct statfs *buf)
     buf->f_type = EXT2_SIGNATURE;
     buf->f_bsize = block_size;
     buf->f_blocks = sb->s_blocks_count;
-    buf->f_bfree = sb->s_free_blocks_count;
-    buf->f_bavail = sb->s_free_blocks_count - sb->s_r_blocks_count;
+    /* Blocks reserved for delayed allocation are as good as used */
+    buf->f_bfree = unreserved_free_blocks();
+    buf->f_bavail = buf->f_bfree > sb->s_r_blocks_count ? buf->f_bfree - sb->s_r_blocks_count : 0;
     buf->f_files = sb->s_inodes_count;
     buf->f_ffree = sb->s_free_inodes_count;
 
@@ -953,8 +1114,8 @@ static int ext2_fsyncdata(struct inode *ino, struct writepages_info *wpinfo)
     if (int st = filemap_writepages(ino, wpinfo); st < 0)
         return st;
     /* If not a block device, sync indirect blocks (that have been associated with the vm
-     * object) */
-    if (!S_ISBLK(ino->i_mode))
+     * object). Journaled filesystems get them on disk with the commit. */
+    if (!S_ISBLK(ino->i_mode) && !ext2_superblock_from_inode(ino)->journal)
         block_buf_sync_assoc(ino->i_pages);
     return 0;
 }
@@ -1016,6 +1177,13 @@ static int ext2_do_bmap_from_inode(struct file *file, unsigned int logical_block
 
 static int do_bmap(struct file *file, unsigned int logical_block, unsigned int *ret)
 {
+    /* Delalloc blocks don't have a block number until writeback, so write them back first */
+    if (S_ISREG(file->f_ino->i_mode))
+    {
+        if (int st = filemap_fdatasync(file->f_ino, 0, -1UL); st < 0)
+            return st;
+    }
+
     /* First, try to get it from the block_buf. If not possible, we'll do actual block map
      * traversal. */
     if (ext2_do_bmap_from_page_cache(file, logical_block, ret) == 0)
@@ -1062,6 +1230,11 @@ void ext2_truncate_partial(struct vm_object *vmobj, struct page *page, size_t of
         {
             /* "Unmap" the block. This is now a hole */
             b->block_nr = 0;
+            if (bb_test_flag(b, BLOCKBUF_FLAG_DELALLOC))
+            {
+                bb_clear_flag(b, BLOCKBUF_FLAG_DELALLOC);
+                ext2_da_release_block(ino, false);
+            }
         }
 
         if (b->block_nr != 0)
@@ -26,6 +26,7 @@
 #include <onyx/pair.hpp>
 
 #define EXT2_SUPERBLOCK_OFFSET 1024
+#define EXT2_MIN_BLOCK_SIZE    1024
 
 #define EXT2_SIGNATURE 0xef53
 
@@ -84,7 +85,8 @@
 #define EXT2_NOCOMPR_FL      0x400
 #define EXT2_ECOMPR_FL       0x800
 #define EXT2_BTREE_FL        0x1000
-#define EXT2_INDEX_FL        0x2000
+#define EXT2_INDEX_FL        0x1000
+#define EXT2_IMAGIC_FL       0x2000
 #define EXT3_JOURNAL_DATA_FL 0x4000
 #define EXT2_RESERVED_FL     0x80000000
 
@@ -147,10 +149,24 @@ typedef struct
     uint32_t s_last_orphan;
     uint32_t s_hash_seed[4];
     uint8_t s_def_hash_version;
+    uint8_t s_jnl_backup_type;
+    uint16_t s_desc_size;
     uint32_t s_default_mount_options;
     uint32_t s_first_meta_bg;
+    uint32_t s_mkfs_time;
+    uint32_t s_jnl_blocks[17];
+    uint32_t s_blocks_count_hi;
+    uint32_t s_r_blocks_count_hi;
+    uint32_t s_free_blocks_count_hi;
+    uint16_t s_min_extra_isize;
+    uint16_t s_want_extra_isize;
+    uint32_t s_flags;
 } __attribute__((aligned(1024), packed)) superblock_t;
 
+/* s_flags */
+#define EXT2_FLAGS_SIGNED_HASH   0x1
+#define EXT2_FLAGS_UNSIGNED_HASH 0x2
+
 typedef struct
 {
     uint32_t block_usage_addr;
@@ -232,10 +248,31 @@ typedef struct
 
 struct ext2_superblock;
 
+/**
+ * @brief Mark a metadata buffer dirty
+ * If the filesystem is journaled, the buffer joins the running transaction instead.
+ *
+ * @param buf Buffer
+ * @param ino Inode the buffer belongs to, if any (indirect blocks)
+ */
+void ext2_dirty_buffer(struct block_buf *buf, struct inode *ino = nullptr);
+
 using ext2_block_group_no = uint32_t;
 using ext2_inode_no = uint32_t;
 using ext2_block_no = uint32_t;
 
+#define EXT2_ERR_INV_BLOCK   0
+#define EXT2_FILE_HOLE_BLOCK 0
+
+/* A run of free blocks inside a block group, in bitmap bit units */
+struct ext2_free_extent
+{
+    uint32_t start;
+    uint32_t len;
+};
+
+#define EXT2_FREE_EXTENT_CACHE_SIZE 8
+
 class ext2_block_group
 {
 private:
@@ -245,6 +282,13 @@ private:
     mutex inode_bitmap_lock{};
     mutex block_bitmap_lock{};
 
+    /* Cache of the largest free extents in the group, so we don't need to rescan the bitmap
+     * on every allocation. Protected by block_bitmap_lock. It's only a hint: if it runs dry, we
+     * rebuild it from the bitmap. */
+    ext2_free_extent free_extents[EXT2_FREE_EXTENT_CACHE_SIZE];
+    unsigned int nr_free_extents{0};
+    bool free_extents_valid{false};
+
     /* Protects used_dirs, unallocated inodes and blocks */
     spinlock lock_{};
 
@@ -273,6 +317,8 @@ public:
         nr = cul::move(rhs.nr);
         mutex_init(&inode_bitmap_lock);
         mutex_init(&block_bitmap_lock);
+        nr_free_extents = 0;
+        free_extents_valid = false;
 
         rhs.bgd = nullptr;
         rhs.buf = nullptr;
@@ -312,7 +358,7 @@ public:
 
     void dirty()
     {
-        block_buf_dirty(buf);
+        ext2_dirty_buffer(buf);
     }
 
     void dec_used_dirs()
@@ -353,22 +399,22 @@ public:
         dirty();
     }
 
-    void dec_unallocated_blocks()
+    void dec_unallocated_blocks(unsigned int count = 1)
     {
         lock();
 
-        bgd->unallocated_blocks_in_group--;
+        bgd->unallocated_blocks_in_group -= count;
 
         unlock();
 
         dirty();
     }
 
-    void inc_unallocated_blocks()
+    void inc_unallocated_blocks(unsigned int count = 1)
     {
         lock();
 
-        bgd->unallocated_blocks_in_group++;
+        bgd->unallocated_blocks_in_group += count;
 
         unlock();
 
@@ -382,8 +428,26 @@ public:
 
     expected<ext2_inode_no, int> allocate_inode(ext2_superblock *sb);
     void free_inode(ext2_inode_no inode, ext2_superblock *sb);
-    expected<ext2_block_no, int> allocate_block(ext2_superblock *sb);
-    void free_block(ext2_block_no block, ext2_superblock *sb);
+    /**
+     * @brief Allocates a run of contiguous blocks from the block group
+     *
+     * @param sb Pointer to the ext2 superblock
+     * @param goal Block we would like the run to start at, or EXT2_ERR_INV_BLOCK for no goal
+     * @param count Number of blocks we want; on success, updated with the number we got
+     * (at least 1)
+     * @return First block of the run, or an unexpected negative error code
+     */
+    expected<ext2_block_no, int> allocate_blocks(ext2_superblock *sb, ext2_block_no goal,
+                                                 unsigned int *count);
+    void free_blocks(ext2_block_no block, unsigned int count, ext2_superblock *sb);
+
+private:
+    void rebuild_free_extents(const unsigned long *bitmap, unsigned long nbits);
+    void free_extents_take(uint32_t start, uint32_t len);
+    void free_extents_give(uint32_t start, uint32_t len);
+    void free_extents_add(uint32_t start, uint32_t len);
+
+public:
 
     auto_block_buf get_inode_table(const ext2_superblock *sb, uint32_t off) const;
 };
@@ -410,12 +474,21 @@ struct ext2_superblock : public superblock
     unsigned int entry_shift;
     cul::vector<ext2_block_group> block_groups;
 
-    ext2_block_no try_allocate_block_from_bg(ext2_block_group_no nr);
+    /* Blocks reserved by delayed allocation, but not yet allocated */
+    spinlock delalloc_lock{};
+    unsigned long delalloc_reserved{0};
+
+    /* Journal, if the filesystem has one and we're using it */
+    struct ext2_journal *journal{nullptr};
+
+    ext2_block_no try_allocate_blocks_from_bg(ext2_block_group_no nr, ext2_block_no goal,
+                                              unsigned int *count);
 
 public:
     ext2_superblock()
     {
         superblock_init(this);
+        spinlock_init(&delalloc_lock);
     }
 
     /**
@@ -446,14 +519,65 @@ public:
      * @param preferred The preferred block group. If -1, no preferrence
      * @return Block number, or EXT2_ERR_INV_BLOCK if we couldn't allocate one.
      */
-    ext2_block_no allocate_block(ext2_block_group_no preferred = -1);
+    ext2_block_no allocate_block(ext2_block_group_no preferred = -1)
+    {
+        unsigned int count = 1;
+        return allocate_blocks(EXT2_ERR_INV_BLOCK, &count, preferred);
+    }
+
+    /**
+     * @brief Reserve blocks for delayed allocation
+     * Reserved blocks are not handed out by allocate_blocks, unless the allocation says it was
+     * reserved.
+     *
+     * @param nr Number of blocks
+     * @param nofail Don't check for free space. Used when giving back blocks we're about to free.
+     * @return 0 on success, -ENOSPC if there isn't enough free space
+     */
+    int reserve_blocks(unsigned long nr, bool nofail = false);
+
+    /**
+     * @brief Release blocks reserved with reserve_blocks
+     *
+     * @param nr Number of blocks
+     */
+    void release_blocks(unsigned long nr);
+
+    /**
+     * @brief Get the number of free blocks not spoken for by reservations
+     */
+    unsigned long unreserved_free_blocks() const;
+
+    /**
+     * @brief Allocates a run of contiguous blocks, as close as possible to goal
+     *
+     * @param goal Block we would like the run to start at, or EXT2_ERR_INV_BLOCK for no goal
+     * @param count Number of blocks we want; on success, updated with the number we got
+     * (at least 1, but possibly less than asked for)
+     * @param preferred The preferred block group, if there's no goal. If -1, no preferrence
+     * @param reserved If true, the blocks were previously reserved with reserve_blocks
+     * @return First block of the run, or EXT2_ERR_INV_BLOCK if we couldn't allocate one.
+     */
+    ext2_block_no allocate_blocks(ext2_block_no goal, unsigned int *count,
+                                  ext2_block_group_no preferred = -1, bool reserved = false);
 
     /**
      * @brief Frees a block
      *
      * @param block Block number to free
      */
-    void free_block(ext2_block_no block);
+    void free_block(ext2_block_no block)
+    {
+        free_blocks(block, 1);
+    }
+
+    /**
+     * @brief Frees a run of contiguous blocks
+     *
+     * @param block First block of the run
+     * @param count Number of blocks
+     */
+    void free_blocks(ext2_block_no block, unsigned int count);
 
     /**
      * @brief Read an ext2_inode from disk
@@ -515,8 +639,37 @@ struct ext2_inode_info
 {
     /* Cached copy of the on-disk inode */
     struct ext2_inode *inode;
+
+    /* Protects block mapping and the allocation state below */
+    struct mutex alloc_lock;
+    /* Last data block we allocated, used to pick the next allocation goal */
+    ext2_block_no last_alloc_logical{0};
+    ext2_block_no last_alloc_physical{EXT2_ERR_INV_BLOCK};
+    /* Preallocation window: blocks marked used in the bitmap but not yet mapped by the inode */
+    ext2_block_no prealloc_block{EXT2_ERR_INV_BLOCK};
+    unsigned int prealloc_count{0};
+
+    /* Delayed allocation: data blocks reserved but not yet allocated, and the total number of
+     * blocks (data + worst-case indirect blocks) we reserved for them */
+    unsigned long da_data_blocks{0};
+    unsigned long da_reserved{0};
+    /* Last indirect block slot we reserved metadata for */
+    ext2_block_no da_last_ind{(ext2_block_no) -1};
+
+    /* Journaling: transaction the in-core inode needs to be written back in, and the last
+     * transaction that touched it (what fsync needs to wait for) */
+    struct list_head j_node;
+    struct inode *j_inode{nullptr};
+    struct ext2_transaction *j_txn{nullptr};
+    uint32_t j_tid{0};
 };
 
+static inline struct ext2_inode_info *ext2_inode_info_from_node(struct inode *ino)
+{
+    assert(ino->i_helper != NULL);
+    return (struct ext2_inode_info *) ino->i_helper;
+}
+
 static inline struct ext2_inode *ext2_get_inode_from_node(struct inode *ino)
 {
     assert(ino->i_helper != NULL);
@@ -530,9 +683,6 @@ static inline struct ext2_inode *ext2_get_inode_from_node(struct inode *ino)
 
 #define EXT2_DIRECT_BLOCK_COUNT 12
 
-#define EXT2_ERR_INV_BLOCK   0
-#define EXT2_FILE_HOLE_BLOCK 0
-
 #define EXT2_GET_FILE_TYPE(mode)   (mode & S_IFMT)
 #define EXT2_CALCULATE_SIZE64(ino) (((uint64_t) ino->i_size_hi << 32) | ino->i_size_lo)
 
@@ -554,6 +704,8 @@ struct inode *ext2_fs_ino_to_vfs_ino(struct ext2_inode *inode, uint32_t inumber,
 void ext2_free_inode_space(struct inode *inode, struct ext2_superblock *fs);
 expected<ext2_block_no, int> ext2_get_block_from_inode(ext2_inode *ino, ext2_block_no block,
                                                        ext2_superblock *sb);
+expected<ext2_block_no, int> ext2_create_path(struct inode *ino, ext2_block_no block,
+                                              ext2_superblock *sb);
 
 struct ext2_dirent_result
 {
@@ -565,7 +717,27 @@ struct ext2_dirent_result
 int ext2_retrieve_dirent(inode *inode, const char *name, ext2_superblock *sb,
                          ext2_dirent_result *res);
 
+size_t ext2_calculate_dirent_size(size_t len_name);
+int ext2_insert_dirent_in_block(char *block, const ext2_dir_entry_t *entry, ext2_superblock *fs);
+
+/* Returned by the dir_index code when the hashed index can't be used, and we should fall back to
+ * linear directory operations */
+#define EXT2_ERR_BAD_DX_DIR (-EUCLEAN)
+
+bool ext2_dir_is_indexed(inode *dir, ext2_superblock *sb);
+int ext2_dx_find_entry(inode *dir, const char *name, ext2_superblock *sb,
+                       ext2_dirent_result *res);
+int ext2_dx_add_entry(inode *dir, const ext2_dir_entry_t *entry, ext2_superblock *sb);
+int ext2_dx_make_indexed_dir(inode *dir, char *block, const ext2_dir_entry_t *entry,
+                             ext2_superblock *sb);
+
 struct inode *ext2_load_inode_from_disk(uint32_t inum, ext2_superblock *fs);
+void ext2_write_inode(struct inode *inode, bool in_sync);
+ssize_t ext2_dir_write(void *buf, size_t len, struct inode *dir, size_t off);
+void ext2_discard_prealloc(struct inode *ino);
+int ext2_da_reserve_block(struct inode *ino, ext2_block_no block);
+void ext2_da_release_block(struct inode *ino, bool allocated);
+void ext2_da_release_all(struct inode *ino);
 
 static inline ext2_superblock *ext2_superblock_from_inode(inode *ino)
 {
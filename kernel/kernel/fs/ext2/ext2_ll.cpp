@@ -9,9 +9,11 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#include <onyx/block.h>
 #include <onyx/compiler.h>
 #include <onyx/dentry.h>
 #include <onyx/dev.h>
+#include <onyx/filemap.h>
 #include <onyx/log.h>
 #include <onyx/mm/slab.h>
 #include <onyx/pagecache.h>
@@ -24,6 +26,7 @@
 #include <uapi/fcntl.h>
 
 #include "ext2.h"
+#include "journal.h"
 
 const unsigned int direct_block_count = 12;
 
@@ -126,20 +129,85 @@ void ext2_superblock::update_inode(const ext2_inode *ino, ext2_inode_no inode_no
     ext2_inode *on_disk = (ext2_inode *) ((char *) block_buf_data(buf) + off);
     memcpy(on_disk, ino, min(inode_size, (u16) sizeof(struct ext2_inode)));
 
-    block_buf_dirty(buf);
+    ext2_dirty_buffer(buf);
 
-    if (in_sync)
+    /* The journal makes it durable when the transaction commits */
+    if (in_sync && !journal)
         block_buf_sync(buf);
 }
 
 void ext2_dirty_sb(ext2_superblock *fs)
 {
-    block_buf_dirty(fs->sb_bb);
+    ext2_dirty_buffer(fs->sb_bb);
+}
+
+void ext2_dirty_buffer(struct block_buf *buf, struct inode *ino)
+{
+    auto sb = (ext2_superblock *) buf->dev->sb;
+
+    if (sb->journal)
+    {
+        ext2_journal_dirty_block(sb, buf->this_page, buf->page_off, buf->block_nr);
+        return;
+    }
+
+    if (ino)
+        block_buf_dirty_inode(buf, ino);
+    else
+        block_buf_dirty(buf);
+}
+
+/**
+ * @brief Write to a directory (or a slow symlink)
+ * Directory blocks go through the directory's page cache. When journaling, they're metadata like
+ * any other, so they join the running transaction instead of being written back by the page
+ * cache.
+ *
+ * @param buf Buffer to write
+ * @param len Length of the write
+ * @param dir Directory (or symlink) inode
+ * @param off Offset inside the directory
+ * @return Number of bytes written, or negative error code
+ */
+ssize_t ext2_dir_write(void *buf, size_t len, struct inode *dir, size_t off)
+{
+    auto sb = ext2_superblock_from_inode(dir);
+    ssize_t st = file_write_cache_unlocked(buf, len, dir, off);
+    if (st <= 0 || !sb->journal)
+        return st;
+
+    for (size_t pgoff = off >> PAGE_SHIFT; pgoff <= (off + st - 1) >> PAGE_SHIFT; pgoff++)
+    {
+        struct page *page;
+        if (filemap_find_page(dir, pgoff,
+                              FIND_PAGE_NO_CREATE | FIND_PAGE_LOCK | FIND_PAGE_NO_RA |
+                                  FIND_PAGE_NO_READPAGE,
+                              &page, nullptr) < 0)
+        {
+            sb->error("Directory page vanished after writing to it");
+            return -EIO;
+        }
+
+        const size_t page_start = pgoff << PAGE_SHIFT;
+        for (auto b = block_buf_from_page(page); b != nullptr; b = b->next)
+        {
+            size_t boff = page_start + b->page_off;
+            if (boff + b->block_size <= off || boff >= off + st)
+                continue;
+            if (b->block_nr != EXT2_FILE_HOLE_BLOCK)
+                ext2_journal_dirty_block(sb, page, b->page_off, b->block_nr);
+        }
+
+        unlock_page(page);
+        page_unref(page);
+    }
+
+    return st;
 }
 
 size_t ext2_calculate_dirent_size(size_t len_name)
 {
-    size_t dirent_size = sizeof(ext2_dir_entry_t) - (255 - len_name);
+    size_t dirent_size = EXT2_MIN_DIR_ENTRY_LEN + len_name;
 
     /* Dirent sizes need to be 4-byte aligned */
 
@@ -201,120 +269,131 @@ bool ext2_superblock::valid_dirent(const ext2_dir_entry_t *entry, size_t offset)
     return true;
 }
 
-int ext2_add_direntry(const char *name, uint32_t inum, struct ext2_inode *ino, inode *dir,
-                      ext2_superblock *fs)
+/**
+ * @brief Tries to fit a directory entry in a directory block
+ *
+ * @param block Pointer to the block's contents
+ * @param entry Directory entry to insert (rec_len is ignored)
+ * @param fs Pointer to the ext2 superblock
+ * @return 1 if inserted, 0 if the block doesn't have space, negative error codes
+ */
+int ext2_insert_dirent_in_block(char *block, const ext2_dir_entry_t *entry, ext2_superblock *fs)
 {
-    uint8_t *buffer;
-    uint8_t *buf = buffer = (uint8_t *) kcalloc(fs->block_size, 1, GFP_NOFS);
-    if (!buf)
-        return -ENOMEM;
-
-    if (inum == 0)
-        panic("Bad inode number passed to ext2_add_direntry");
+    size_t dirent_size = ext2_calculate_dirent_size(entry->name_len);
 
-    size_t off = 0;
-
-    ext2_dir_entry_t entry;
-
-    size_t dirent_size = ext2_calculate_dirent_size(strlen(name));
-
-    entry.inode = inum;
-    entry.name_len = strlen(name);
-    entry.file_type = ext2_file_type_to_type_indicator(ino->i_mode);
-    strlcpy(entry.name, name, entry.name_len + 1);
-
-    while (true)
+    for (size_t i = 0; i < fs->block_size;)
     {
-        if (off < dir->i_size)
+        ext2_dir_entry_t *e = (ext2_dir_entry_t *) (block + i);
+
+        if (!fs->valid_dirent(e, i))
         {
-            auto old = thread_change_addr_limit(VM_KERNEL_ADDR_LIMIT);
+            fs->error("Invalid directory entry");
+            return -EIO;
+        }
 
-            auto st = file_read_cache(buffer, fs->block_size, dir, off);
+        size_t actual_size = ext2_calculate_dirent_size(e->name_len);
 
-            thread_change_addr_limit(old);
+        if (e->inode == 0 && e->rec_len >= dirent_size)
+        {
+            /* This direntry is unused, so use it */
+            e->inode = entry->inode;
+            e->name_len = entry->name_len;
+            memcpy(e->name, entry->name, entry->name_len);
+            e->file_type = entry->file_type;
+            return 1;
+        }
+        else if (e->rec_len > actual_size && e->rec_len - actual_size >= dirent_size)
+        {
+            ext2_dir_entry_t *d = (ext2_dir_entry_t *) ((char *) e + actual_size);
+            memcpy(d, entry, dirent_size);
+            d->rec_len = e->rec_len - actual_size;
+            e->rec_len = actual_size;
+            return 1;
+        }
 
-            if (st < 0)
-            {
-                free(buffer);
-                return st;
-            }
+        i += e->rec_len;
+    }
 
-            for (size_t i = 0; i < fs->block_size;)
-            {
-                ext2_dir_entry_t *e = (ext2_dir_entry_t *) buf;
+    return 0;
+}
 
-                if (!fs->valid_dirent(e, i))
-                {
-                    free(buffer);
-                    fs->error("Invalid directory entry");
-                    return -EIO;
-                }
+static bool ext2_is_dot_or_dotdot(const char *name)
+{
+    return !strcmp(name, ".") || !strcmp(name, "..");
+}
 
-                size_t actual_size = ext2_calculate_dirent_size(e->name_len);
+int ext2_add_direntry(const char *name, uint32_t inum, struct ext2_inode *ino, inode *dir,
+                      ext2_superblock *fs)
+{
+    if (inum == 0)
+        panic("Bad inode number passed to ext2_add_direntry");
 
-#if 0
-				printk("Entry %s size %u - actual size %lu\n", e->name, e->size, actual_size);
-#endif
+    ext2_dir_entry_t entry;
+    entry.inode = inum;
+    entry.rec_len = 0;
+    entry.name_len = strlen(name);
+    entry.file_type = ext2_file_type_to_type_indicator(ino->i_mode);
+    memcpy(entry.name, name, entry.name_len);
 
-                if (e->inode == 0 && e->rec_len >= dirent_size)
-                {
-                    /* This direntry is unused, so use it */
-                    e->inode = entry.inode;
-                    e->name_len = entry.name_len;
-                    strlcpy(e->name, entry.name, sizeof(entry.name));
-                    e->file_type = entry.file_type;
+    if (ext2_dir_is_indexed(dir, fs))
+    {
+        int st = ext2_dx_add_entry(dir, &entry, fs);
+        if (st != EXT2_ERR_BAD_DX_DIR)
+            return st;
 
-                    if (st = file_write_cache_unlocked(buffer, fs->block_size, dir, off); st < 0)
-                    {
-                        free(buffer);
-                        return st;
-                    }
+        /* The index is unusable, stop using it and treat this as a linear directory from now
+         * on. e2fsck -D can rebuild it. */
+        pr_warn("ext2: directory inode %lu: clearing htree index\n", dir->i_inode);
+        ext2_get_inode_from_node(dir)->i_flags &= ~EXT2_INDEX_FL;
+        inode_mark_dirty(dir);
+    }
 
-                    free(buffer);
+    char *buf = (char *) kcalloc(fs->block_size, 1, GFP_NOFS);
+    if (!buf)
+        return -ENOMEM;
 
-                    return 0;
-                }
-                else if (e->rec_len > actual_size && e->rec_len - actual_size >= dirent_size)
-                {
-                    ext2_dir_entry_t *d = (ext2_dir_entry_t *) (buf + actual_size);
-                    entry.rec_len = e->rec_len - actual_size;
-                    e->rec_len = actual_size;
-                    memcpy(d, &entry, dirent_size);
+    size_t off = 0;
+    ssize_t st;
 
-                    if (st = file_write_cache_unlocked(buffer, fs->block_size, dir, off); st < 0)
-                    {
-                        free(buffer);
-                        return st;
-                    }
+    for (; off < dir->i_size; off += fs->block_size)
+    {
+        auto old = thread_change_addr_limit(VM_KERNEL_ADDR_LIMIT);
+        st = file_read_cache(buf, fs->block_size, dir, off);
+        thread_change_addr_limit(old);
 
-                    free(buffer);
+        if (st < 0)
+            goto out;
 
-                    return 0;
-                }
+        st = ext2_insert_dirent_in_block(buf, &entry, fs);
+        if (st < 0)
+            goto out;
 
-                buf += e->rec_len;
-                i += e->rec_len;
-            }
-        }
-        else
+        if (st == 1)
         {
-            entry.rec_len = fs->block_size;
-            memcpy(buf, &entry, dirent_size);
-
-            if (int st = file_write_cache_unlocked(buf, fs->block_size, dir, off); st < 0)
-            {
-                return st;
-            }
-
-            break;
+            st = ext2_dir_write(buf, fs->block_size, dir, off);
+            goto out;
         }
+    }
 
-        off += fs->block_size;
-        buf = buffer;
+    /* No space in the existing blocks. If this is a single block directory, convert it to an
+     * indexed one instead of growing it linearly. */
+    if (dir->i_size == fs->block_size && fs->features_compat & EXT2_FEATURE_COMPAT_DIR_INDEX &&
+        !ext2_is_dot_or_dotdot(name))
+    {
+        st = ext2_dx_make_indexed_dir(dir, buf, &entry, fs);
+        if (st != EXT2_ERR_BAD_DX_DIR)
+            goto out;
     }
 
-    free(buffer);
-    return 0;
+    memset(buf, 0, fs->block_size);
+    entry.rec_len = fs->block_size;
+    memcpy(buf, &entry, ext2_calculate_dirent_size(entry.name_len));
+
+    st = ext2_dir_write(buf, fs->block_size, dir, off);
+
+out:
+    free(buf);
+    return st < 0 ? st : 0;
 }
 
 void ext2_unlink_dirent(ext2_dir_entry_t *before, ext2_dir_entry_t *entry)
@@ -370,7 +449,7 @@ int ext2_remove_direntry(uint32_t inum, struct inode *dir, struct ext2_superbloc
 
                 st = 0;
 
-                if (file_write_cache_unlocked(buf, fs->block_size, dir, off) < 0)
+                if (ext2_dir_write(buf, fs->block_size, dir, off) < 0)
                 {
                     st = -errno;
                 }
@@ -411,6 +490,15 @@ int ext2_file_present(inode *inode, const char *name, ext2_superblock *fs)
 int ext2_retrieve_dirent(inode *inode, const char *name, ext2_superblock *fs,
                          ext2_dirent_result *res)
 {
+    /* "." and ".." always live in the first block, so don't bother with the index for those */
+    if (ext2_dir_is_indexed(inode, fs) && !ext2_is_dot_or_dotdot(name))
+    {
+        int st = ext2_dx_find_entry(inode, name, fs, res);
+        if (st != EXT2_ERR_BAD_DX_DIR)
+            return st;
+        /* Fall back to a linear search */
+    }
+
     int st = -ENOENT;
     char *buf = static_cast<char *>(kcalloc(fs->block_size, 1, GFP_NOFS));
     if (!buf)
@@ -474,6 +562,7 @@ int ext2_link(struct inode *target, const char *name, struct inode *dir)
     assert(target->i_sb == dir->i_sb);
     struct ext2_superblock *fs = ext2_superblock_from_inode(dir);
     struct ext2_inode *target_ino = ext2_get_inode_from_node(target);
+    ext2_handle handle{fs};
 
     int st = ext2_file_present(dir, name, fs);
     if (st < 0)
@@ -505,7 +594,7 @@ int ext2_link(struct inode *target, const char *name, struct inode *dir)
         ext2_dir_entry_t *dentry = (ext2_dir_entry_t *) (res.buf + res.block_off);
         dentry->inode = (uint32_t) dir->i_inode;
 
-        st = file_write_cache_unlocked(dentry, sizeof(ext2_dir_entry_t), target, res.file_off);
+        st = ext2_dir_write(dentry, sizeof(ext2_dir_entry_t), target, res.file_off);
     }
 
     thread_change_addr_limit(old);
@@ -517,7 +606,13 @@ int ext2_link(struct inode *target, const char *name, struct inode *dir)
 
 int ext2_link_fops(struct dentry *old_dentry, struct dentry *new_dentry)
 {
-    return ext2_link(old_dentry->d_inode, new_dentry->d_name, new_dentry->d_parent->d_inode);
+    struct inode *target = old_dentry->d_inode;
+    /* The link count must change in the same transaction as the directory (SB_FLAG_FS_NLINK) */
+    ext2_handle handle{ext2_superblock_from_inode(target)};
+    int st = ext2_link(target, new_dentry->d_name, new_dentry->d_parent->d_inode);
+    if (st == 0)
+        inode_inc_nlink(target);
+    return st;
 }
 
 struct inode *ext2_load_inode_from_disk(uint32_t inum, struct ext2_superblock *fs)
@@ -590,6 +685,7 @@ int ext2_unlink(const char *name, int flags, struct dentry *dir)
 {
     struct inode *ino = dir->d_inode;
     struct ext2_superblock *fs = ext2_superblock_from_inode(ino);
+    ext2_handle handle{fs};
 
     struct ext2_dirent_result res;
     int st = ext2_retrieve_dirent(ino, name, fs, &res);
@@ -651,7 +747,7 @@ int ext2_unlink(const char *name, int flags, struct dentry *dir)
     /* Flush to disk */
     /* TODO: Maybe we can optimize things by not flushing the whole block? */
     auto old = thread_change_addr_limit(VM_KERNEL_ADDR_LIMIT);
-    if (st = file_write_cache_unlocked(res.buf, fs->block_size, ino, res.file_off - res.block_off);
+    if (st = ext2_dir_write(res.buf, fs->block_size, ino, res.file_off - res.block_off);
         st < 0)
     {
         thread_change_addr_limit(old);
@@ -664,6 +760,14 @@ int ext2_unlink(const char *name, int flags, struct dentry *dir)
 
     free(res.buf);
 
+    /* The link counts must change in the same transaction as the directory (SB_FLAG_FS_NLINK) */
+    inode_dec_nlink(target);
+    if (S_ISDIR(target->i_mode))
+    {
+        inode_dec_nlink(ino);
+        inode_dec_nlink(target);
+    }
+
     close_vfs(target);
 
     return 0;
@@ -677,7 +781,7 @@ int ext2_fallocate(int mode, off_t off, off_t len, struct file *ino)
 static int ext2_flush_dirents(ext2_dirent_result *res, struct inode *ino)
 {
     auto old = thread_change_addr_limit(VM_KERNEL_ADDR_LIMIT);
-    if (int st = file_write_cache_unlocked(res->buf, ((ext2_superblock *) ino->i_sb)->block_size,
+    if (int st = ext2_dir_write(res->buf, ((ext2_superblock *) ino->i_sb)->block_size,
                                            ino, res->file_off - res->block_off);
         st < 0)
     {
@@ -760,6 +864,7 @@ int ext2_rename(struct dentry *src_parent, struct dentry *src, struct dentry *ds
 {
     /* Note: we don't adjust nlinks until later on (to avoid disk activity). We partially adjust
      * them if failure happens for some reason (TODO). */
+    ext2_handle handle{ext2_superblock_from_inode(src_parent->d_inode)};
     int st = 0;
     st = ext2_raw_unlink(src_parent, src);
     if (st < 0)
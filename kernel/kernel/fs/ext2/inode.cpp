@@ -16,6 +16,7 @@
 #include <onyx/pagecache.h>
 
 #include "ext2.h"
+#include "journal.h"
 
 #include <onyx/utility.hpp>
 
@@ -123,11 +124,189 @@ expected<ext2_block_no, int> ext2_get_block_from_inode(ext2_inode *ino, ext2_blo
     return dest_block_nr;
 }
 
+/* Number of blocks we try to preallocate past the one we need, for regular files */
+#define EXT2_PREALLOC_BLOCKS 8
+
+static void ext2_discard_prealloc_locked(ext2_inode_info *info, ext2_superblock *sb)
+{
+    if (info->prealloc_count == 0)
+        return;
+
+    /* If delalloc blocks are still waiting on this window, turn it back into a reservation */
+    if (info->da_data_blocks)
+    {
+        sb->reserve_blocks(info->prealloc_count, true);
+        info->da_reserved += info->prealloc_count;
+    }
+
+    sb->free_blocks(info->prealloc_block, info->prealloc_count);
+    info->prealloc_block = EXT2_ERR_INV_BLOCK;
+    info->prealloc_count = 0;
+}
+
+/**
+ * @brief Give back the inode's preallocated blocks
+ *
+ * @param ino Pointer to the inode
+ */
+void ext2_discard_prealloc(struct inode *ino)
+{
+    auto info = ext2_inode_info_from_node(ino);
+    scoped_mutex g{info->alloc_lock};
+    ext2_discard_prealloc_locked(info, ext2_superblock_from_inode(ino));
+}
+
+/**
+ * @brief Allocate a block for an inode, as close as possible to goal
+ * Blocks are taken from the inode's preallocation window when it lines up with the goal, else
+ * we allocate a new run and keep the tail of it as the new window.
+ *
+ * @param ino Pointer to the inode
+ * @param goal Block we would like to get, or EXT2_ERR_INV_BLOCK
+ * @param sb Pointer to the ext2 superblock
+ * @return The block number, or EXT2_ERR_INV_BLOCK if we couldn't allocate one
+ */
+static ext2_block_no ext2_alloc_inode_block(struct inode *ino, ext2_block_no goal,
+                                            ext2_superblock *sb)
+{
+    auto info = ext2_inode_info_from_node(ino);
+
+    if (info->prealloc_count)
+    {
+        /* Delalloc writeback always takes from the window, it was sized for it */
+        if (goal == EXT2_ERR_INV_BLOCK || goal == info->prealloc_block || info->da_data_blocks)
+        {
+            auto block = info->prealloc_block++;
+            if (--info->prealloc_count == 0)
+                info->prealloc_block = EXT2_ERR_INV_BLOCK;
+            return block;
+        }
+
+        /* The window doesn't line up with what we want, don't leave a gap behind */
+        ext2_discard_prealloc_locked(info, sb);
+    }
+
+    /* If we're allocating for delayed allocation, grab everything the inode has reserved in one
+     * go. Writeback then maps the rest of the dirty blocks from the preallocation window, which
+     * gets us a single contiguous extent. */
+    bool reserved = info->da_reserved > 0;
+    unsigned int count = S_ISREG(ino->i_mode) ? 1 + EXT2_PREALLOC_BLOCKS : 1;
+    if (reserved)
+        count = cul::min(info->da_reserved, (unsigned long) sb->blocks_per_block_group);
+
+    auto block =
+        sb->allocate_blocks(goal, &count, ext2_inode_number_to_bg(ino->i_inode, sb), reserved);
+    if (block == EXT2_ERR_INV_BLOCK)
+        return block;
+
+    if (reserved)
+    {
+        /* These blocks are now really allocated, drop them from the reservation */
+        sb->release_blocks(count);
+        info->da_reserved -= count;
+    }
+
+    if (count > 1)
+    {
+        info->prealloc_block = block + 1;
+        info->prealloc_count = count - 1;
+    }
+
+    return block;
+}
+
+/**
+ * @brief Reserve space for a block that will be allocated at writeback time
+ * We reserve the data block, plus the indirect blocks it may need if it's the first block we see
+ * in its indirect block (like ext4 does for indirect-mapped files).
+ *
+ * @param ino Pointer to the inode
+ * @param block Logical block number
+ * @return 0 on success, negative error code (-ENOSPC)
+ */
+int ext2_da_reserve_block(struct inode *ino, ext2_block_no block)
+{
+    auto info = ext2_inode_info_from_node(ino);
+    auto sb = ext2_superblock_from_inode(ino);
+    scoped_mutex g{info->alloc_lock};
+    unsigned long nr = 1;
+    ext2_block_no ind = (ext2_block_no) -1;
+
+    if (block >= direct_block_count)
+    {
+        ind = (block - direct_block_count) >> sb->entry_shift;
+        if (ind != info->da_last_ind)
+            nr += ext2_detect_block_type(block, sb);
+    }
+
+    if (int st = sb->reserve_blocks(nr); st < 0)
+        return st;
+
+    if (ind != (ext2_block_no) -1)
+        info->da_last_ind = ind;
+    info->da_data_blocks++;
+    info->da_reserved += nr;
+    return 0;
+}
+
+/**
+ * @brief Release the reservation for a delalloc block
+ *
+ * @param ino Pointer to the inode
+ * @param allocated True if the block was allocated (its reservation was already converted into
+ * real blocks when allocating), false if the block is just going away
+ */
+void ext2_da_release_block(struct inode *ino, bool allocated)
+{
+    auto info = ext2_inode_info_from_node(ino);
+    auto sb = ext2_superblock_from_inode(ino);
+    scoped_mutex g{info->alloc_lock};
+
+    DCHECK(info->da_data_blocks > 0);
+    info->da_data_blocks--;
+
+    if (!allocated && info->da_reserved)
+    {
+        info->da_reserved--;
+        sb->release_blocks(1);
+    }
+
+    if (info->da_data_blocks == 0)
+    {
+        /* No more delalloc blocks, give back whatever metadata reservation we didn't use */
+        sb->release_blocks(info->da_reserved);
+        info->da_reserved = 0;
+        info->da_last_ind = (ext2_block_no) -1;
+    }
+}
+
+/**
+ * @brief Release every reservation the inode still holds
+ *
+ * @param ino Pointer to the inode
+ */
+void ext2_da_release_all(struct inode *ino)
+{
+    auto info = ext2_inode_info_from_node(ino);
+    scoped_mutex g{info->alloc_lock};
+
+    if (info->da_reserved)
+        ext2_superblock_from_inode(ino)->release_blocks(info->da_reserved);
+    info->da_data_blocks = info->da_reserved = 0;
+    info->da_last_ind = (ext2_block_no) -1;
+}
+
 expected<ext2_block_no, int> ext2_create_path(struct inode *ino, ext2_block_no block,
                                               ext2_superblock *sb)
 {
-    auto preferred_bg = ext2_inode_number_to_bg(ino->i_inode, sb);
     auto raw_inode = ext2_get_inode_from_node(ino);
+    auto info = ext2_inode_info_from_node(ino);
+    scoped_mutex g{info->alloc_lock};
+
+    /* Sequential writes continue right after the last block we allocated */
+    ext2_block_no goal = EXT2_ERR_INV_BLOCK;
+    if (info->last_alloc_physical != EXT2_ERR_INV_BLOCK && block == info->last_alloc_logical + 1)
+        goal = info->last_alloc_physical + 1;
 
     ext2_block_no offsets[4];
 
@@ -149,12 +328,16 @@ expected<ext2_block_no, int> ext2_create_path(struct inode *ino, ext2_block_no b
 
             if (b == EXT2_ERR_INV_BLOCK)
             {
-                auto block = sb->allocate_block(preferred_bg);
+                /* Indirect blocks go inline with the data, like ext2 always did */
+                auto block = ext2_alloc_inode_block(ino, goal, sb);
                 if (block == EXT2_ERR_INV_BLOCK)
                 {
                     return unexpected<int>{-ENOSPC};
                 }
 
+                goal = block + 1;
+                info->last_alloc_physical = block;
+
                 should_zero_block = true;
 
                 b = curr_block[off] = block;
@@ -162,7 +345,7 @@ expected<ext2_block_no, int> ext2_create_path(struct inode *ino, ext2_block_no b
                 ino->i_blocks += sb->block_size >> 9;
 
                 if (buf)
-                    block_buf_dirty_inode(buf, ino);
+                    ext2_dirty_buffer(buf, ino);
                 else
                 {
                     inode_update_ctime(ino);
@@ -179,7 +362,7 @@ expected<ext2_block_no, int> ext2_create_path(struct inode *ino, ext2_block_no b
             if (should_zero_block) [[unlikely]]
             {
                 memset(curr_block, 0, sb->block_size);
-                block_buf_dirty_inode(buf, ino);
+                ext2_dirty_buffer(buf, ino);
             }
         }
         else
@@ -188,15 +371,18 @@ expected<ext2_block_no, int> ext2_create_path(struct inode *ino, ext2_block_no b
 
             if (dest_block_nr == EXT2_FILE_HOLE_BLOCK)
             {
-                auto block = sb->allocate_block();
-                if (block == EXT2_ERR_INV_BLOCK)
+                auto new_block = ext2_alloc_inode_block(ino, goal, sb);
+                if (new_block == EXT2_ERR_INV_BLOCK)
                     return unexpected<int>{-ENOSPC};
 
-                dest_block_nr = curr_block[off] = block;
+                info->last_alloc_logical = block;
+                info->last_alloc_physical = new_block;
+
+                dest_block_nr = curr_block[off] = new_block;
 
                 ino->i_blocks += sb->block_size >> 9;
                 if (buf)
-                    block_buf_dirty_inode(buf, ino);
+                    ext2_dirty_buffer(buf, ino);
                 else
                 {
                     inode_update_ctime(ino);
@@ -227,6 +413,10 @@ int ext2_prepare_write(inode *ino, struct page *page, size_t page_off, size_t of
             return st;
     }
 
+    /* Regular files delay block allocation until writeback, when we know how much data there
+     * is. We only reserve the space here, so we can still report ENOSPC from write(). */
+    const bool delalloc = S_ISREG(ino->i_mode);
+
     while (bufs)
     {
         if (bufs->page_off >= offset && bufs->page_off < end)
@@ -235,14 +425,27 @@ int ext2_prepare_write(inode *ino, struct page *page, size_t page_off, size_t of
             sector_t block_number = bufs->block_nr;
             if (block_number == EXT2_FILE_HOLE_BLOCK)
             {
-                auto res = ext2_create_path(ino, base_block + relative_block, sb);
-                if (res.has_error())
-                    return res.error();
-                bufs->block_nr = res.value();
+                if (delalloc)
+                {
+                    if (!bb_test_flag(bufs, BLOCKBUF_FLAG_DELALLOC))
+                    {
+                        if (int st = ext2_da_reserve_block(ino, base_block + relative_block);
+                            st < 0)
+                            return st;
+                        bb_test_and_set(bufs, BLOCKBUF_FLAG_DELALLOC);
+                    }
+                }
+                else
+                {
+                    auto res = ext2_create_path(ino, base_block + relative_block, sb);
+                    if (res.has_error())
+                        return res.error();
+                    bufs->block_nr = res.value();
+                }
             }
         }
 
-        if (bufs->block_nr != 0)
+        if (bufs->block_nr != 0 || bb_test_flag(bufs, BLOCKBUF_FLAG_DELALLOC))
             allocated++;
         bufs = bufs->next;
     }
@@ -348,7 +551,11 @@ int ext2_truncate_branch(ext2_block_no block, ext2_block_coords &curr_coords, st
     /* Reset the coord */
     curr_coords.coords[coord_idx] = 0;
     if (partial_block)
+    {
+        /* We may have cleared some of the entries */
+        ext2_dirty_buffer(buf, ino);
         return EXT2_TRUNCATED_PARTIALLY;
+    }
     /* Truncated fully, we can free this block */
     /* Note: we must "forget" the inode block buf */
     block_buf_forget_inode(buf.release());
@@ -362,6 +569,9 @@ int ext2_free_space(size_t new_len, inode *ino)
     auto sb = ext2_superblock_from_inode(ino);
     auto raw_inode = ext2_get_inode_from_node(ino);
 
+    /* Give back preallocated blocks first, we don't want them hanging around past EOF */
+    ext2_discard_prealloc(ino);
+
     // If the inode only has inline data, just return success.
     if (!ext2_has_data_blocks(ino, raw_inode, sb))
         return 0;
@@ -417,14 +627,17 @@ int ext2_truncate(size_t len, inode *ino)
     ino->i_size = len;
     vmo_truncate(ino->i_pages, len, 0);
 
-    if (old_size > len)
     {
-        if ((st = ext2_free_space(len, ino)) < 0)
-            goto out;
-    }
+        ext2_handle handle{ext2_superblock_from_inode(ino)};
+        if (old_size > len)
+        {
+            if ((st = ext2_free_space(len, ino)) < 0)
+                goto out;
+        }
 
-    inode_mark_dirty(ino);
-    /* TODO: Update mtime and ctime, per POSIX */
+        inode_mark_dirty(ino);
+        /* TODO: Update mtime and ctime, per POSIX */
+    }
 out:
     rw_unlock_write(&ino->i_pages->truncate_lock);
     return st;
@@ -0,0 +1,1596 @@
+/*
+ * Copyright (c) 2024 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the GPLv2 License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#include "journal.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <onyx/block.h>
+#include <onyx/block/blk_plug.h>
+#include <onyx/buffer.h>
+#include <onyx/byteswap.h>
+#include <onyx/clock.h>
+#include <onyx/log.h>
+#include <onyx/page.h>
+#include <onyx/scheduler.h>
+#include <onyx/vfs.h>
+
+#include <onyx/utility.hpp>
+
+/* ext3-compatible (JBD2) journaling for ext2.
+ *
+ * Every operation that changes metadata runs under a handle, which pins the running transaction.
+ * Metadata blocks dirtied under a handle join the running transaction instead of being marked
+ * dirty in the buffer cache, so they never get written in place behind the journal's back.
+ *
+ * Committing a transaction (from the commit thread, every few seconds, or from fsync) goes like:
+ *  1) Set the barrier and wait for open handles to drain.
+ *  2) Copy the in-core inodes that were dirtied into the inode table, then take a frozen copy of
+ *     every block in the transaction. Open a new transaction and drop the barrier.
+ *  3) Wait for ordered data (data blocks the transaction allocated) to hit the disk.
+ *  4) Write descriptor blocks + frozen copies + revoke blocks to the log, coalesced into large
+ *     sequential bios, wait, then write the commit block.
+ * Concurrent fsyncs just wait for the commit of the transaction they care about (group commit).
+ *
+ * Checkpointing writes the frozen copies of every committed transaction to their home locations,
+ * then moves the log tail forward.
+ */
+
+/* How often the commit thread commits the running transaction */
+static constexpr unsigned long ext2_journal_commit_interval_ms = 5000;
+
+/* Max vectors we put in a single journal bio */
+static constexpr size_t ext2_journal_max_bio_vecs = 256;
+
+static unsigned int ext2_journal_hash(ext2_block_no block)
+{
+    return (uint32_t) (block * 0x9e3779b1U) % EXT2_JOURNAL_HASH_SIZE;
+}
+
+static struct ext2_transaction *ext2_txn_alloc(struct ext2_journal *j, ext2_tid_t tid)
+{
+    struct ext2_transaction *txn = new ext2_transaction;
+    if (!txn)
+        return nullptr;
+
+    txn->t_journal = j;
+    txn->t_tid = tid;
+    txn->t_state = EXT2_TXN_RUNNING;
+    txn->t_updates = 0;
+    txn->t_ordered_io = 0;
+    txn->t_nr_buffers = 0;
+    txn->t_nr_revokes = 0;
+    txn->t_log_start = 0;
+    txn->t_log_blocks = 0;
+    INIT_LIST_HEAD(&txn->t_buffers);
+    INIT_LIST_HEAD(&txn->t_revokes);
+    INIT_LIST_HEAD(&txn->t_inodes);
+    INIT_LIST_HEAD(&txn->t_checkpoint_node);
+    return txn;
+}
+
+static void ext2_jbuf_free(struct ext2_jbuf *jb)
+{
+    if (jb->page)
+        page_unref(jb->page);
+    delete jb;
+}
+
+static void ext2_txn_free(struct ext2_transaction *txn)
+{
+    list_for_every_safe (&txn->t_buffers)
+        ext2_jbuf_free(container_of(l, ext2_jbuf, txn_node));
+    list_for_every_safe (&txn->t_revokes)
+        ext2_jbuf_free(container_of(l, ext2_jbuf, txn_node));
+
+    for (struct page *page : txn->t_pages)
+        free_page(page);
+    delete txn;
+}
+
+static bool ext2_txn_empty(const struct ext2_transaction *txn)
+{
+    return txn->t_nr_buffers == 0 && txn->t_nr_revokes == 0 && list_is_empty(&txn->t_inodes);
+}
+
+/**
+ * @brief Map a journal block to a filesystem block
+ *
+ * @param j Pointer to the journal
+ * @param lblk Journal block
+ * @return Filesystem block, or EXT2_ERR_INV_BLOCK if not mapped
+ */
+static ext2_block_no ext2_journal_bmap(struct ext2_journal *j, uint32_t lblk)
+{
+    size_t lo = 0, hi = j->j_extents.size();
+
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        const auto &ext = j->j_extents[mid];
+        if (lblk < ext.logical)
+            hi = mid;
+        else if (lblk >= ext.logical + ext.len)
+            lo = mid + 1;
+        else
+            return ext.physical + (lblk - ext.logical);
+    }
+
+    return EXT2_ERR_INV_BLOCK;
+}
+
+static uint32_t ext2_journal_next(struct ext2_journal *j, uint32_t blk)
+{
+    return ++blk == j->j_last ? j->j_first : blk;
+}
+
+static struct ext2_jbuf *ext2_journal_find(struct ext2_journal *j, ext2_block_no block,
+                                           struct ext2_transaction *txn, unsigned int type)
+    REQUIRES(j->j_lock)
+{
+    list_for_every (&j->j_hash[ext2_journal_hash(block)])
+    {
+        struct ext2_jbuf *jb = container_of(l, ext2_jbuf, hash_node);
+        if (jb->block == block && jb->txn == txn && (jb->flags & EXT2_JBUF_REVOKE) == type)
+            return jb;
+    }
+
+    return nullptr;
+}
+
+/**
+ * @brief Mark the journal as aborted. We stop committing, the fs gets marked with errors.
+ */
+static void ext2_journal_abort(struct ext2_journal *j, int err, const char *why)
+{
+    spin_lock(&j->j_lock);
+    if (!j->j_errno)
+        j->j_errno = err;
+    wait_queue_wake_all(&j->j_wait_done);
+    wait_queue_wake_all(&j->j_wait_barrier);
+    spin_unlock(&j->j_lock);
+    pr_err("ext2: journal aborted: %s (error %d)\n", why, err);
+    j->j_sb->error("Journal aborted");
+}
+
+/* Handles */
+
+static ext2_handle *ext2_journal_find_handle(struct ext2_journal *j)
+{
+    struct thread *curr = get_current_thread();
+    if (!curr)
+        return nullptr;
+
+    for (auto h = (ext2_handle *) curr->journal_info; h; h = h->prev)
+    {
+        if (h->journal == j)
+            return h;
+    }
+
+    return nullptr;
+}
+
+void ext2_journal_kick(struct ext2_superblock *sb)
+{
+    struct ext2_journal *j = sb->journal;
+    if (!j)
+        return;
+
+    scoped_lock g{j->j_lock};
+    if (ext2_tid_before(j->j_commit_request, j->j_running->t_tid))
+        j->j_commit_request = j->j_running->t_tid;
+    wait_queue_wake_all(&j->j_wait_commit);
+}
+
+static bool ext2_journal_may_start(struct ext2_journal *j) REQUIRES(j->j_lock)
+{
+    if (j->j_errno)
+        return true;
+    return !j->j_barrier && j->j_running->t_nr_buffers < j->j_max_txn_buffers;
+}
+
+void ext2_journal_start(struct ext2_superblock *sb, ext2_handle *handle)
+{
+    struct ext2_journal *j = sb->journal;
+    if (!j)
+        return;
+
+    handle->journal = j;
+
+    if (auto outer = ext2_journal_find_handle(j))
+    {
+        /* Nested handle, just join the outer handle's transaction */
+        handle->nested = true;
+        handle->txn = outer->txn;
+        return;
+    }
+
+    spin_lock(&j->j_lock);
+
+    if (!ext2_journal_may_start(j))
+    {
+        /* The running transaction is full, get it committed */
+        if (!j->j_barrier && ext2_tid_before(j->j_commit_request, j->j_running->t_tid))
+        {
+            j->j_commit_request = j->j_running->t_tid;
+            wait_queue_wake_all(&j->j_wait_commit);
+        }
+
+        wait_for_event_locked(&j->j_wait_barrier, ext2_journal_may_start(j), &j->j_lock);
+    }
+
+    handle->txn = j->j_running;
+    handle->txn->t_updates++;
+    spin_unlock(&j->j_lock);
+
+    struct thread *curr = get_current_thread();
+    handle->prev = (ext2_handle *) curr->journal_info;
+    curr->journal_info = handle;
+}
+
+void ext2_journal_stop(ext2_handle *handle)
+{
+    struct ext2_journal *j = handle->journal;
+    if (!j || handle->nested)
+        return;
+
+    struct thread *curr = get_current_thread();
+    DCHECK(curr->journal_info == handle);
+    curr->journal_info = handle->prev;
+
+    scoped_lock g{j->j_lock};
+    if (--handle->txn->t_updates == 0 && j->j_barrier)
+        wait_queue_wake_all(&j->j_wait_updates);
+}
+
+struct ext2_transaction *ext2_journal_current(struct ext2_superblock *sb)
+{
+    if (!sb->journal)
+        return nullptr;
+    auto handle = ext2_journal_find_handle(sb->journal);
+    return handle ? handle->txn : nullptr;
+}
+
+void ext2_journal_ordered_start(struct ext2_transaction *txn)
+{
+    __atomic_add_fetch(&txn->t_ordered_io, 1, __ATOMIC_RELAXED);
+}
+
+void ext2_journal_ordered_end(struct ext2_transaction *txn)
+{
+    if (__atomic_sub_fetch(&txn->t_ordered_io, 1, __ATOMIC_RELEASE) == 0)
+        wait_queue_wake_all(&txn->t_journal->j_wait_ordered);
+}
+
+/* Adding things to transactions */
+
+void ext2_journal_dirty_block(struct ext2_superblock *sb, struct page *page,
+                              unsigned int page_off, ext2_block_no block)
+{
+    struct ext2_journal *j = sb->journal;
+    struct ext2_jbuf *jb = new ext2_jbuf;
+    struct ext2_jbuf *revoke = nullptr;
+
+    spin_lock(&j->j_lock);
+
+    /* Without a handle (e.g writeback), we can't add to a transaction that's being frozen */
+    if (j->j_barrier && !ext2_journal_find_handle(j))
+        wait_for_event_locked(&j->j_wait_barrier, !j->j_barrier, &j->j_lock);
+
+    struct ext2_transaction *txn = j->j_running;
+
+    if (ext2_journal_find(j, block, txn, 0))
+    {
+        /* Already part of the transaction, the commit will pick up the new contents */
+        spin_unlock(&j->j_lock);
+        delete jb;
+        return;
+    }
+
+    if (!jb)
+    {
+        spin_unlock(&j->j_lock);
+        ext2_journal_abort(j, -ENOMEM, "out of memory adding a block to the transaction");
+        return;
+    }
+
+    /* If we revoked this block earlier in the transaction, it's metadata again. Cancel the revoke
+     * record, else replay would skip the new contents. */
+    if ((revoke = ext2_journal_find(j, block, txn, EXT2_JBUF_REVOKE)))
+    {
+        list_remove(&revoke->txn_node);
+        list_remove(&revoke->hash_node);
+        txn->t_nr_revokes--;
+    }
+
+    jb->block = block;
+    jb->txn = txn;
+    jb->page = page;
+    jb->page_off = page_off;
+    jb->frozen = nullptr;
+    jb->frozen_off = 0;
+    jb->flags = 0;
+    page_ref(page);
+    list_add_tail(&jb->txn_node, &txn->t_buffers);
+    list_add_tail(&jb->hash_node, &j->j_hash[ext2_journal_hash(block)]);
+    txn->t_nr_buffers++;
+    spin_unlock(&j->j_lock);
+
+    if (revoke)
+        ext2_jbuf_free(revoke);
+}
+
+/**
+ * @brief Revoke a single block
+ *
+ * @param j Pointer to the journal
+ * @param block Block number
+ */
+static void ext2_journal_revoke_one(struct ext2_journal *j, ext2_block_no block)
+{
+    struct ext2_jbuf *record = nullptr;
+    struct ext2_jbuf *dropped = nullptr;
+
+    spin_lock(&j->j_lock);
+
+retry:
+    struct ext2_transaction *txn = j->j_running;
+    bool older = false;
+    bool checkpointing = false;
+    bool has_record = false;
+
+    list_for_every_safe (&j->j_hash[ext2_journal_hash(block)])
+    {
+        struct ext2_jbuf *jb = container_of(l, ext2_jbuf, hash_node);
+        if (jb->block != block)
+            continue;
+
+        if (jb->flags & EXT2_JBUF_REVOKE)
+        {
+            if (jb->txn == txn)
+                has_record = true;
+            continue;
+        }
+
+        if (jb->txn == txn)
+        {
+            /* Never made it to the log, just forget about it */
+            DCHECK(dropped == nullptr);
+            list_remove(&jb->txn_node);
+            list_remove(&jb->hash_node);
+            txn->t_nr_buffers--;
+            dropped = jb;
+            continue;
+        }
+
+        /* An older transaction has it. Don't checkpoint it, and don't replay it. */
+        jb->flags |= EXT2_JBUF_REVOKED;
+        older = true;
+        if (jb->txn->t_state == EXT2_TXN_COMMITTED && j->j_checkpointing)
+            checkpointing = true;
+    }
+
+    if (older && !has_record)
+    {
+        if (!record)
+        {
+            spin_unlock(&j->j_lock);
+            record = new ext2_jbuf;
+            spin_lock(&j->j_lock);
+            if (!record)
+            {
+                spin_unlock(&j->j_lock);
+                ext2_journal_abort(j, -ENOMEM, "out of memory revoking a block");
+                goto out;
+            }
+
+            goto retry;
+        }
+
+        record->block = block;
+        record->txn = txn;
+        record->page = nullptr;
+        record->page_off = 0;
+        record->frozen = nullptr;
+        record->frozen_off = 0;
+        record->flags = EXT2_JBUF_REVOKE;
+        list_add_tail(&record->txn_node, &txn->t_revokes);
+        list_add_tail(&record->hash_node, &j->j_hash[ext2_journal_hash(block)]);
+        txn->t_nr_revokes++;
+        record = nullptr;
+    }
+
+    /* A checkpoint may have the old contents in flight. Wait for it, the caller may reuse the
+     * block as soon as we return. */
+    if (checkpointing)
+        wait_for_event_locked(&j->j_wait_checkpoint, !j->j_checkpointing, &j->j_lock);
+
+    spin_unlock(&j->j_lock);
+out:
+    delete record;
+    if (dropped)
+        ext2_jbuf_free(dropped);
+}
+
+void ext2_journal_revoke(struct ext2_superblock *sb, ext2_block_no block, unsigned int count)
+{
+    struct ext2_journal *j = sb->journal;
+    if (!j)
+        return;
+
+    for (unsigned int i = 0; i < count; i++)
+        ext2_journal_revoke_one(j, block + i);
+}
+
+void ext2_journal_dirty_inode(struct inode *ino)
+{
+    struct ext2_journal *j = ext2_superblock_from_inode(ino)->journal;
+    /* Inodes still being set up don't have their ext2 info yet */
+    if (!j || !ino->i_helper)
+        return;
+
+    auto info = ext2_inode_info_from_node(ino);
+    scoped_lock g{j->j_lock};
+    struct ext2_transaction *txn = j->j_running;
+
+    info->j_tid = txn->t_tid;
+    if (info->j_txn == txn)
+        return;
+
+    if (info->j_txn)
+        list_remove(&info->j_node);
+    list_add_tail(&info->j_node, &txn->t_inodes);
+    info->j_txn = txn;
+    info->j_inode = ino;
+}
+
+void ext2_journal_forget_inode(struct inode *ino)
+{
+    struct ext2_superblock *sb = ext2_superblock_from_inode(ino);
+    struct ext2_journal *j = sb->journal;
+    if (!j)
+        return;
+
+    auto info = ext2_inode_info_from_node(ino);
+    bool pending = false;
+
+    {
+        scoped_lock g{j->j_lock};
+        wait_for_event_locked(&j->j_wait_done, j->j_flushing != ino, &j->j_lock);
+        if (info->j_txn)
+        {
+            list_remove(&info->j_node);
+            info->j_txn = nullptr;
+            pending = true;
+        }
+    }
+
+    /* The commit won't see the inode anymore, so write it into the transaction ourselves.
+     * Deleted inodes were already written by ext2_delete_inode. */
+    if (pending && ino->i_nlink != 0)
+    {
+        ext2_handle handle{sb};
+        ext2_write_inode(ino, false);
+    }
+}
+
+/* I/O */
+
+static void ext2_journal_endio(struct bio_req *bio)
+{
+    struct ext2_journal *j = (struct ext2_journal *) bio->b_private;
+
+    if ((bio->flags & BIO_STATUS_MASK) != BIO_REQ_DONE)
+        __atomic_store_n(&j->j_io_error, -EIO, __ATOMIC_RELAXED);
+    if (__atomic_sub_fetch(&j->j_io_pending, 1, __ATOMIC_RELEASE) == 0)
+        wait_queue_wake_all(&j->j_wait_io);
+}
+
+static void ext2_journal_io_begin(struct ext2_journal *j)
+{
+    /* Bias the count so it can't hit zero while we're still submitting */
+    j->j_io_pending = 1;
+    j->j_io_error = 0;
+}
+
+static void ext2_journal_submit(struct ext2_journal *j, struct page_iov *vec, size_t nr_vecs,
+                                ext2_block_no block)
+{
+    __atomic_add_fetch(&j->j_io_pending, 1, __ATOMIC_RELAXED);
+    if (int st = sb_write_bio(j->j_sb, vec, nr_vecs, block, ext2_journal_endio, j); st < 0)
+    {
+        __atomic_store_n(&j->j_io_error, st, __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&j->j_io_pending, 1, __ATOMIC_RELEASE);
+    }
+}
+
+static int ext2_journal_io_wait(struct ext2_journal *j)
+{
+    __atomic_sub_fetch(&j->j_io_pending, 1, __ATOMIC_RELEASE);
+    wait_for_event(&j->j_wait_io, __atomic_load_n(&j->j_io_pending, __ATOMIC_ACQUIRE) == 0);
+    return __atomic_load_n(&j->j_io_error, __ATOMIC_RELAXED);
+}
+
+static int ext2_journal_write_sb(struct ext2_journal *j)
+{
+    j->j_jsb->s_start = htonl(j->j_tail);
+    j->j_jsb->s_sequence = htonl(j->j_tail_sequence);
+    block_buf_dirty(j->j_sb_bb);
+    block_buf_sync(j->j_sb_bb);
+    return 0;
+}
+
+/**
+ * @brief Get space for a block in the transaction's private pages
+ *
+ * @param j Pointer to the journal
+ * @param txn Transaction
+ * @param page Pointer to store the page in
+ * @param off Pointer to store the offset in the page in
+ * @return Mapped address of the block, or nullptr on ENOMEM
+ */
+static void *ext2_txn_get_block(struct ext2_journal *j, struct ext2_transaction *txn,
+                                struct page **page, unsigned int *off)
+{
+    const unsigned int bsize = j->j_sb->block_size;
+    static_assert(PAGE_SIZE >= MAX_BLOCK_SIZE);
+
+    /* t_log_blocks counts the blocks we handed out so far while building the commit */
+    unsigned int used = (txn->t_log_blocks * bsize) % PAGE_SIZE;
+    if (used == 0)
+    {
+        struct page *p = alloc_page(GFP_NOFS | PAGE_ALLOC_NO_ZERO);
+        if (!p)
+            return nullptr;
+        if (!txn->t_pages.push_back(p))
+        {
+            free_page(p);
+            return nullptr;
+        }
+    }
+
+    *page = txn->t_pages.back();
+    *off = used;
+    txn->t_log_blocks++;
+    return (char *) PAGE_TO_VIRT(*page) + used;
+}
+
+/* Committing */
+
+/**
+ * @brief Copy the in-core metadata of the transaction's inodes into the inode table
+ * Runs under the barrier. Inodes can still get dirtied (without a handle) while we're at it, so
+ * we keep going until the list is empty.
+ */
+static void ext2_journal_flush_inodes(struct ext2_journal *j, struct ext2_transaction *txn)
+{
+    /* Pretend we're a handle on the transaction, so our inode table updates go through the
+     * barrier */
+    struct thread *curr = get_current_thread();
+    ext2_handle handle{j, txn};
+    handle.prev = (ext2_handle *) curr->journal_info;
+    curr->journal_info = &handle;
+
+    spin_lock(&j->j_lock);
+
+    while (!list_is_empty(&txn->t_inodes))
+    {
+        auto info = container_of(list_first_element(&txn->t_inodes), ext2_inode_info, j_node);
+        list_remove(&info->j_node);
+        info->j_txn = nullptr;
+        struct inode *ino = info->j_inode;
+        /* ext2_journal_forget_inode waits for us, so the inode can't go away */
+        j->j_flushing = ino;
+        spin_unlock(&j->j_lock);
+
+        ext2_write_inode(ino, false);
+
+        spin_lock(&j->j_lock);
+        j->j_flushing = nullptr;
+        wait_queue_wake_all(&j->j_wait_done);
+    }
+
+    spin_unlock(&j->j_lock);
+    curr->journal_info = handle.prev;
+}
+
+/**
+ * @brief Take frozen copies of every block in the transaction
+ * Runs under the barrier, so nobody is modifying metadata.
+ *
+ * @return 0 on success, negative error code
+ */
+static int ext2_journal_freeze(struct ext2_journal *j, struct ext2_transaction *txn)
+{
+    const unsigned int bsize = j->j_sb->block_size;
+
+    list_for_every (&txn->t_buffers)
+    {
+        struct ext2_jbuf *jb = container_of(l, ext2_jbuf, txn_node);
+        void *frozen = ext2_txn_get_block(j, txn, &jb->frozen, &jb->frozen_off);
+        if (!frozen)
+            return -ENOMEM;
+
+        memcpy(frozen, (char *) PAGE_TO_VIRT(jb->page) + jb->page_off, bsize);
+
+        /* Blocks that look like journal blocks need to be escaped, or replay gets confused */
+        if (*(uint32_t *) frozen == htonl(JBD2_MAGIC_NUMBER))
+        {
+            jb->flags |= EXT2_JBUF_ESCAPED;
+            *(uint32_t *) frozen = 0;
+        }
+    }
+
+    return 0;
+}
+
+static void ext2_journal_fill_header(struct jbd2_header *hdr, unsigned int type, ext2_tid_t tid)
+{
+    hdr->h_magic = htonl(JBD2_MAGIC_NUMBER);
+    hdr->h_blocktype = htonl(type);
+    hdr->h_sequence = htonl(tid);
+}
+
+struct ext2_log_block
+{
+    struct page *page;
+    unsigned int off;
+};
+
+/**
+ * @brief Build the log image of the transaction: descriptors + data, revoke blocks
+ * The commit block is written separately.
+ */
+static int ext2_journal_build_log(struct ext2_journal *j, struct ext2_transaction *txn,
+                                  cul::vector<ext2_log_block> &log)
+{
+    const unsigned int bsize = j->j_sb->block_size;
+    struct page *page;
+    unsigned int off;
+    struct jbd2_block_tag *tag = nullptr;
+    char *desc = nullptr;
+    unsigned int ntags = 0;
+
+    list_for_every (&txn->t_buffers)
+    {
+        struct ext2_jbuf *jb = container_of(l, ext2_jbuf, txn_node);
+
+        if (!desc || ntags == j->j_tags_per_desc)
+        {
+            if (tag)
+                tag->t_flags |= htons(JBD2_FLAG_LAST_TAG);
+
+            desc = (char *) ext2_txn_get_block(j, txn, &page, &off);
+            if (!desc)
+                return -ENOMEM;
+            memset(desc, 0, bsize);
+            ext2_journal_fill_header((struct jbd2_header *) desc, JBD2_DESCRIPTOR_BLOCK,
+                                     txn->t_tid);
+            if (!log.push_back(ext2_log_block{page, off}))
+                return -ENOMEM;
+            ntags = 0;
+            tag = nullptr;
+        }
+
+        char *next = tag ? (char *) (tag + 1) : desc + sizeof(struct jbd2_header);
+        if (tag && !(ntohs(tag->t_flags) & JBD2_FLAG_SAME_UUID))
+            next += sizeof(j->j_uuid);
+
+        tag = (struct jbd2_block_tag *) next;
+        tag->t_blocknr = htonl((uint32_t) jb->block);
+        tag->t_checksum = 0;
+        uint16_t flags = 0;
+        if (ntags == 0)
+            memcpy(tag + 1, j->j_uuid, sizeof(j->j_uuid));
+        else
+            flags |= JBD2_FLAG_SAME_UUID;
+        if (jb->flags & EXT2_JBUF_ESCAPED)
+            flags |= JBD2_FLAG_ESCAPE;
+        tag->t_flags = htons(flags);
+        ntags++;
+
+        if (!log.push_back(ext2_log_block{jb->frozen, jb->frozen_off}))
+            return -ENOMEM;
+    }
+
+    if (tag)
+        tag->t_flags |= htons(JBD2_FLAG_LAST_TAG);
+
+    struct jbd2_revoke_header *rh = nullptr;
+    unsigned int nrecords = 0;
+
+    list_for_every (&txn->t_revokes)
+    {
+        struct ext2_jbuf *jb = container_of(l, ext2_jbuf, txn_node);
+
+        if (!rh || nrecords == j->j_revokes_per_block)
+        {
+            rh = (struct jbd2_revoke_header *) ext2_txn_get_block(j, txn, &page, &off);
+            if (!rh)
+                return -ENOMEM;
+            memset(rh, 0, bsize);
+            ext2_journal_fill_header(&rh->r_header, JBD2_REVOKE_BLOCK, txn->t_tid);
+            if (!log.push_back(ext2_log_block{page, off}))
+                return -ENOMEM;
+            nrecords = 0;
+        }
+
+        uint32_t *records = (uint32_t *) (rh + 1);
+        records[nrecords++] = htonl((uint32_t) jb->block);
+        rh->r_count = htonl(sizeof(*rh) + nrecords * sizeof(uint32_t));
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Write a run of log blocks starting at the journal head, as large sequential bios
+ */
+static void ext2_journal_write_log(struct ext2_journal *j, const ext2_log_block *blocks,
+                                   size_t nr, uint32_t start)
+{
+    const unsigned int bsize = j->j_sb->block_size;
+    struct page_iov vec[ext2_journal_max_bio_vecs];
+    size_t nr_vecs = 0;
+    ext2_block_no first = 0, last = 0;
+    uint32_t pos = start;
+
+    for (size_t i = 0; i < nr; i++, pos = ext2_journal_next(j, pos))
+    {
+        ext2_block_no phys = ext2_journal_bmap(j, pos);
+
+        if (nr_vecs && (phys != last + 1 || nr_vecs == ext2_journal_max_bio_vecs))
+        {
+            ext2_journal_submit(j, vec, nr_vecs, first);
+            nr_vecs = 0;
+        }
+
+        if (nr_vecs == 0)
+            first = phys;
+        last = phys;
+        vec[nr_vecs].page = blocks[i].page;
+        vec[nr_vecs].page_off = blocks[i].off;
+        vec[nr_vecs].length = bsize;
+        nr_vecs++;
+    }
+
+    if (nr_vecs)
+        ext2_journal_submit(j, vec, nr_vecs, first);
+}
+
+static int ext2_journal_checkpoint(struct ext2_journal *j);
+
+static void ext2_journal_wait_ordered(struct ext2_journal *j, struct ext2_transaction *txn)
+{
+    wait_for_event(&j->j_wait_ordered, __atomic_load_n(&txn->t_ordered_io, __ATOMIC_ACQUIRE) == 0);
+}
+
+/**
+ * @brief Commit the running transaction
+ *
+ * @param j Pointer to the journal
+ * @return 0 on success, negative error code
+ */
+static int ext2_journal_commit(struct ext2_journal *j)
+{
+    scoped_mutex g{j->j_commit_mutex};
+    struct ext2_transaction *txn, *next;
+    cul::vector<ext2_log_block> log;
+    struct page *cpage;
+    unsigned int coff;
+    struct jbd2_commit_header *commit;
+    uint32_t needed;
+    int st;
+
+    next = ext2_txn_alloc(j, 0);
+    if (!next)
+        return -ENOMEM;
+
+    spin_lock(&j->j_lock);
+    txn = j->j_running;
+    if (j->j_errno || ext2_txn_empty(txn))
+    {
+        /* Nothing to do. Make sure nobody keeps asking for it. */
+        j->j_commit_request = j->j_commit_done;
+        st = j->j_errno;
+        spin_unlock(&j->j_lock);
+        ext2_txn_free(next);
+        return st;
+    }
+
+    /* 1) Close the transaction to new handles, wait for the current ones to finish */
+    j->j_barrier = true;
+    wait_for_event_locked(&j->j_wait_updates, txn->t_updates == 0, &j->j_lock);
+    spin_unlock(&j->j_lock);
+
+    /* 2) Get the dirty inodes into the transaction, freeze it, and open the next one */
+    ext2_journal_flush_inodes(j, txn);
+    st = ext2_journal_freeze(j, txn);
+
+    spin_lock(&j->j_lock);
+    next->t_tid = txn->t_tid + 1;
+    /* Inodes that got dirtied after we flushed them belong to the next transaction */
+    list_for_every_safe (&txn->t_inodes)
+    {
+        auto info = container_of(l, ext2_inode_info, j_node);
+        list_remove(&info->j_node);
+        list_add_tail(&info->j_node, &next->t_inodes);
+        info->j_txn = next;
+    }
+
+    txn->t_state = EXT2_TXN_COMMITTING;
+    j->j_running = next;
+    j->j_barrier = false;
+    wait_queue_wake_all(&j->j_wait_barrier);
+    spin_unlock(&j->j_lock);
+
+    if (st < 0)
+        goto abort;
+
+    /* 3) Ordered mode: data blocks allocated by this transaction must be on disk before the
+     * metadata that points to them */
+    ext2_journal_wait_ordered(j, txn);
+
+    /* 4) Write the log */
+    if (st = ext2_journal_build_log(j, txn, log); st < 0)
+        goto abort;
+
+    commit = (struct jbd2_commit_header *) ext2_txn_get_block(j, txn, &cpage, &coff);
+    if (!commit)
+    {
+        st = -ENOMEM;
+        goto abort;
+    }
+
+    memset(commit, 0, j->j_sb->block_size);
+    ext2_journal_fill_header(&commit->h_header, JBD2_COMMIT_BLOCK, txn->t_tid);
+    commit->h_commit_sec = bswap64((uint64_t) clock_get_posix_time());
+
+    needed = log.size() + 1;
+    if (needed > j->j_free)
+    {
+        if (st = ext2_journal_checkpoint(j); st < 0)
+            goto abort;
+        if (needed > j->j_free)
+        {
+            st = -ENOSPC;
+            goto abort;
+        }
+    }
+
+    txn->t_log_start = j->j_head;
+    ext2_journal_io_begin(j);
+    ext2_journal_write_log(j, log.begin(), log.size(), j->j_head);
+    if (st = ext2_journal_io_wait(j); st < 0)
+        goto abort;
+
+    /* The ordered data and the log must be on stable storage before the commit block can be */
+    if (st = blkdev_flush(j->j_sb->s_bdev); st < 0)
+        goto abort;
+
+    /* Everything else is on disk, now the commit block makes the transaction valid */
+    {
+        ext2_log_block cblock{cpage, coff};
+        uint32_t pos = j->j_head;
+        for (size_t i = 0; i < log.size(); i++)
+            pos = ext2_journal_next(j, pos);
+
+        ext2_journal_io_begin(j);
+        ext2_journal_write_log(j, &cblock, 1, pos);
+        if (st = ext2_journal_io_wait(j); st < 0)
+            goto abort;
+
+        /* And the transaction isn't committed until the commit block is durable */
+        if (st = blkdev_flush(j->j_sb->s_bdev); st < 0)
+            goto abort;
+    }
+
+    /* Undo the escaping, the frozen copies are what we checkpoint */
+    list_for_every (&txn->t_buffers)
+    {
+        struct ext2_jbuf *jb = container_of(l, ext2_jbuf, txn_node);
+        if (jb->flags & EXT2_JBUF_ESCAPED)
+            *(uint32_t *) ((char *) PAGE_TO_VIRT(jb->frozen) + jb->frozen_off) =
+                htonl(JBD2_MAGIC_NUMBER);
+    }
+
+    spin_lock(&j->j_lock);
+    txn->t_log_blocks = needed;
+    for (uint32_t i = 0; i < needed; i++)
+        j->j_head = ext2_journal_next(j, j->j_head);
+    j->j_free -= needed;
+    txn->t_state = EXT2_TXN_COMMITTED;
+    list_add_tail(&txn->t_checkpoint_node, &j->j_checkpoint);
+    j->j_commit_done = txn->t_tid;
+    wait_queue_wake_all(&j->j_wait_done);
+    spin_unlock(&j->j_lock);
+
+    /* Keep at least half of the log free, so commits don't have to wait on checkpoints */
+    if (j->j_free < (j->j_last - j->j_first) / 2)
+        return ext2_journal_checkpoint(j);
+    return 0;
+abort:
+    ext2_journal_abort(j, st, "error committing transaction");
+    return st;
+}
+
+/* Checkpointing */
+
+/**
+ * @brief Check if a newer committed transaction has the same block, so we can skip writing this
+ * one back
+ */
+static bool ext2_jbuf_superseded(struct ext2_journal *j, struct ext2_jbuf *jb) REQUIRES(j->j_lock)
+{
+    list_for_every (&j->j_hash[ext2_journal_hash(jb->block)])
+    {
+        struct ext2_jbuf *other = container_of(l, ext2_jbuf, hash_node);
+        if (other == jb || other->block != jb->block || other->flags & EXT2_JBUF_REVOKE)
+            continue;
+        if (other->txn->t_state == EXT2_TXN_COMMITTED &&
+            ext2_tid_before(jb->txn->t_tid, other->txn->t_tid))
+            return true;
+    }
+
+    return false;
+}
+
+static void ext2_checkpoint_txn(struct ext2_journal *j, struct ext2_transaction *txn)
+{
+    const unsigned int bsize = j->j_sb->block_size;
+
+    list_for_every (&txn->t_buffers)
+    {
+        struct ext2_jbuf *jb = container_of(l, ext2_jbuf, txn_node);
+
+        spin_lock(&j->j_lock);
+        bool skip = jb->flags & EXT2_JBUF_REVOKED || ext2_jbuf_superseded(j, jb);
+        spin_unlock(&j->j_lock);
+        if (skip)
+            continue;
+
+        struct page_iov v;
+        v.page = jb->frozen;
+        v.page_off = jb->frozen_off;
+        v.length = bsize;
+        ext2_journal_submit(j, &v, 1, jb->block);
+    }
+}
+
+static void ext2_txn_unhash(struct ext2_transaction *txn)
+{
+    list_for_every (&txn->t_buffers)
+        list_remove(&container_of(l, ext2_jbuf, txn_node)->hash_node);
+    list_for_every (&txn->t_revokes)
+        list_remove(&container_of(l, ext2_jbuf, txn_node)->hash_node);
+}
+
+/**
+ * @brief Write every committed transaction back to its home location, and free up the log
+ * Called with j_commit_mutex held.
+ *
+ * @param j Pointer to the journal
+ * @return 0 on success, negative error code
+ */
+static int ext2_journal_checkpoint(struct ext2_journal *j)
+{
+    DEFINE_LIST(done);
+    struct blk_plug plug;
+    int st;
+
+    spin_lock(&j->j_lock);
+    if (list_is_empty(&j->j_checkpoint))
+    {
+        spin_unlock(&j->j_lock);
+        return 0;
+    }
+
+    j->j_checkpointing = true;
+    spin_unlock(&j->j_lock);
+
+    ext2_journal_io_begin(j);
+    blk_start_plug(&plug);
+
+    /* Nobody adds to j_checkpoint but us (under j_commit_mutex), so walking it is safe */
+    list_for_every (&j->j_checkpoint)
+        ext2_checkpoint_txn(j, container_of(l, ext2_transaction, t_checkpoint_node));
+
+    blk_end_plug(&plug);
+    st = ext2_journal_io_wait(j);
+    /* Checkpointed blocks must be durable before the tail moves past their transactions */
+    if (st == 0)
+        st = blkdev_flush(j->j_sb->s_bdev);
+
+    spin_lock(&j->j_lock);
+    j->j_checkpointing = false;
+    wait_queue_wake_all(&j->j_wait_checkpoint);
+
+    if (st < 0)
+    {
+        spin_unlock(&j->j_lock);
+        ext2_journal_abort(j, st, "error checkpointing");
+        return st;
+    }
+
+    /* Everything committed is home. Take it out of the hash and move the tail. */
+    list_for_every_safe (&j->j_checkpoint)
+    {
+        struct ext2_transaction *txn = container_of(l, ext2_transaction, t_checkpoint_node);
+        ext2_txn_unhash(txn);
+        list_remove(&txn->t_checkpoint_node);
+        list_add_tail(&txn->t_checkpoint_node, &done);
+    }
+
+    j->j_tail = j->j_head;
+    j->j_tail_sequence = j->j_commit_done + 1;
+    j->j_free = j->j_last - j->j_first;
+    spin_unlock(&j->j_lock);
+
+    ext2_journal_write_sb(j);
+
+    list_for_every_safe (&done)
+        ext2_txn_free(container_of(l, ext2_transaction, t_checkpoint_node));
+    return 0;
+}
+
+/* Commit thread and fsync */
+
+static void ext2_journal_thread(void *arg)
+{
+    struct ext2_journal *j = (struct ext2_journal *) arg;
+
+    for (;;)
+    {
+        spin_lock(&j->j_lock);
+        wait_for_event_locked_timeout_interruptible(
+            &j->j_wait_commit,
+            j->j_stop || ext2_tid_before(j->j_commit_done, j->j_commit_request),
+            ext2_journal_commit_interval_ms * NS_PER_MS, &j->j_lock);
+        bool stop = j->j_stop;
+        spin_unlock(&j->j_lock);
+
+        if (stop)
+            break;
+
+        ext2_journal_commit(j);
+    }
+
+    spin_lock(&j->j_lock);
+    j->j_thread_done = true;
+    wait_queue_wake_all(&j->j_wait_done);
+    spin_unlock(&j->j_lock);
+    thread_exit();
+}
+
+/**
+ * @brief Wait until a transaction has committed, kicking the commit thread
+ *
+ * @param j Pointer to the journal
+ * @param tid Transaction ID
+ * @return 0 on success, negative error code
+ */
+static int ext2_journal_wait_commit(struct ext2_journal *j, ext2_tid_t tid)
+{
+    scoped_lock g{j->j_lock};
+
+    /* An empty running transaction has nothing to make durable */
+    if (tid == j->j_running->t_tid && ext2_txn_empty(j->j_running))
+        return 0;
+
+    if (ext2_tid_before(j->j_commit_request, tid))
+    {
+        j->j_commit_request = tid;
+        wait_queue_wake_all(&j->j_wait_commit);
+    }
+
+    wait_for_event_locked(&j->j_wait_done,
+                          !ext2_tid_before(j->j_commit_done, tid) || j->j_errno, &j->j_lock);
+    return j->j_errno;
+}
+
+int ext2_journal_commit_inode(struct inode *ino)
+{
+    struct ext2_journal *j = ext2_superblock_from_inode(ino)->journal;
+    if (!j)
+        return 0;
+
+    ext2_tid_t tid;
+    {
+        scoped_lock g{j->j_lock};
+        tid = ext2_inode_info_from_node(ino)->j_tid;
+        if (!ext2_tid_before(j->j_commit_done, tid))
+            return 0;
+    }
+
+    return ext2_journal_wait_commit(j, tid);
+}
+
+/* Recovery */
+
+struct ext2_revoke_entry
+{
+    ext2_block_no block;
+    ext2_tid_t tid;
+    struct list_head node;
+};
+
+struct ext2_recovery
+{
+    struct ext2_journal *j;
+    struct page *page;
+    struct page *data;
+    ext2_tid_t start;
+    ext2_tid_t end;
+    unsigned long replayed;
+    struct list_head revokes[EXT2_JOURNAL_HASH_SIZE];
+};
+
+#define EXT2_PASS_SCAN   0
+#define EXT2_PASS_REVOKE 1
+#define EXT2_PASS_REPLAY 2
+
+static int ext2_journal_read(struct ext2_journal *j, uint32_t lblk, struct page *page)
+{
+    ext2_block_no block = ext2_journal_bmap(j, lblk);
+    if (block == EXT2_ERR_INV_BLOCK)
+        return -EIO;
+
+    struct page_iov v;
+    v.page = page;
+    v.page_off = 0;
+    v.length = j->j_sb->block_size;
+    return sb_read_bio(j->j_sb, &v, 1, block);
+}
+
+static bool ext2_recovery_revoked(struct ext2_recovery *r, ext2_block_no block, ext2_tid_t tid)
+{
+    list_for_every (&r->revokes[ext2_journal_hash(block)])
+    {
+        auto rev = container_of(l, ext2_revoke_entry, node);
+        if (rev->block == block)
+            return !ext2_tid_before(rev->tid, tid);
+    }
+
+    return false;
+}
+
+static int ext2_recovery_add_revoke(struct ext2_recovery *r, ext2_block_no block, ext2_tid_t tid)
+{
+    list_for_every (&r->revokes[ext2_journal_hash(block)])
+    {
+        auto rev = container_of(l, ext2_revoke_entry, node);
+        if (rev->block == block)
+        {
+            if (ext2_tid_before(rev->tid, tid))
+                rev->tid = tid;
+            return 0;
+        }
+    }
+
+    auto rev = new ext2_revoke_entry;
+    if (!rev)
+        return -ENOMEM;
+    rev->block = block;
+    rev->tid = tid;
+    list_add_tail(&rev->node, &r->revokes[ext2_journal_hash(block)]);
+    return 0;
+}
+
+static int ext2_recovery_replay_block(struct ext2_recovery *r, ext2_block_no block, bool escaped)
+{
+    struct ext2_superblock *sb = r->j->j_sb;
+    void *src = PAGE_TO_VIRT(r->data);
+
+    if (escaped)
+        *(uint32_t *) src = htonl(JBD2_MAGIC_NUMBER);
+
+    /* Go through the buffer cache, so whatever we already have cached (e.g the superblock)
+     * stays coherent */
+    struct block_buf *buf = sb_read_block(sb, block);
+    if (!buf)
+        return -EIO;
+
+    memcpy(block_buf_data(buf), src, sb->block_size);
+    block_buf_dirty(buf);
+    block_buf_sync(buf);
+    block_buf_put(buf);
+    r->replayed++;
+    return 0;
+}
+
+static int ext2_recovery_pass(struct ext2_recovery *r, int pass)
+{
+    struct ext2_journal *j = r->j;
+    const unsigned int bsize = j->j_sb->block_size;
+    uint32_t blk = ntohl(j->j_jsb->s_start);
+    ext2_tid_t seq = r->start;
+    int st;
+
+    for (;;)
+    {
+        if (pass != EXT2_PASS_SCAN && seq == r->end)
+            break;
+
+        if (st = ext2_journal_read(j, blk, r->page); st < 0)
+            return st;
+
+        auto hdr = (struct jbd2_header *) PAGE_TO_VIRT(r->page);
+        if (ntohl(hdr->h_magic) != JBD2_MAGIC_NUMBER || ntohl(hdr->h_sequence) != seq)
+            break;
+
+        blk = ext2_journal_next(j, blk);
+        unsigned int type = ntohl(hdr->h_blocktype);
+
+        if (type == JBD2_DESCRIPTOR_BLOCK)
+        {
+            char *p = (char *) (hdr + 1);
+            char *end = (char *) hdr + bsize;
+
+            while (p + sizeof(struct jbd2_block_tag) <= end)
+            {
+                auto tag = (struct jbd2_block_tag *) p;
+                unsigned int flags = ntohs(tag->t_flags);
+                ext2_block_no block = ntohl(tag->t_blocknr);
+
+                if (pass == EXT2_PASS_REPLAY && !ext2_recovery_revoked(r, block, seq))
+                {
+                    if (st = ext2_journal_read(j, blk, r->data); st < 0)
+                        return st;
+                    if (st = ext2_recovery_replay_block(r, block, flags & JBD2_FLAG_ESCAPE);
+                        st < 0)
+                        return st;
+                }
+
+                blk = ext2_journal_next(j, blk);
+                p += sizeof(struct jbd2_block_tag);
+                if (!(flags & JBD2_FLAG_SAME_UUID))
+                    p += sizeof(j->j_uuid);
+                if (flags & JBD2_FLAG_LAST_TAG)
+                    break;
+            }
+        }
+        else if (type == JBD2_REVOKE_BLOCK)
+        {
+            if (pass == EXT2_PASS_REVOKE)
+            {
+                auto rh = (struct jbd2_revoke_header *) hdr;
+                uint32_t count = cul::min(ntohl(rh->r_count), bsize);
+                auto records = (uint32_t *) (rh + 1);
+
+                for (uint32_t off = sizeof(*rh); off + sizeof(uint32_t) <= count;
+                     off += sizeof(uint32_t), records++)
+                {
+                    if (st = ext2_recovery_add_revoke(r, ntohl(*records), seq); st < 0)
+                        return st;
+                }
+            }
+        }
+        else if (type == JBD2_COMMIT_BLOCK)
+            seq++;
+        else
+            break;
+    }
+
+    if (pass == EXT2_PASS_SCAN)
+        r->end = seq;
+    return 0;
+}
+
+/**
+ * @brief Replay the journal
+ *
+ * @param j Pointer to the journal
+ * @param next_tid Pointer to store the next transaction ID in
+ * @return 0 on success, negative error code
+ */
+static int ext2_journal_recover(struct ext2_journal *j, ext2_tid_t *next_tid)
+{
+    struct ext2_recovery *r = new ext2_recovery;
+    int st = -ENOMEM;
+    if (!r)
+        return -ENOMEM;
+
+    r->j = j;
+    r->start = ntohl(j->j_jsb->s_sequence);
+    r->end = r->start;
+    r->replayed = 0;
+    for (auto &head : r->revokes)
+        INIT_LIST_HEAD(&head);
+
+    r->page = alloc_page(GFP_KERNEL);
+    r->data = alloc_page(GFP_KERNEL);
+    if (!r->page || !r->data)
+        goto out;
+
+    for (int pass = EXT2_PASS_SCAN; pass <= EXT2_PASS_REPLAY; pass++)
+    {
+        if (st = ext2_recovery_pass(r, pass); st < 0)
+            goto out;
+    }
+
+    pr_info("ext2: journal recovery: replayed %lu blocks from transactions %u-%u\n", r->replayed,
+            r->start, r->end - 1);
+    *next_tid = r->end + 1;
+out:
+    if (r->page)
+        free_page(r->page);
+    if (r->data)
+        free_page(r->data);
+    for (auto &head : r->revokes)
+    {
+        list_for_every_safe (&head)
+            delete container_of(l, ext2_revoke_entry, node);
+    }
+
+    delete r;
+    return st;
+}
+
+/* Setup and teardown */
+
+static int ext2_journal_map(struct ext2_journal *j, ext2_inode_no inum)
+{
+    struct ext2_superblock *sb = j->j_sb;
+    struct inode *ino = ext2_get_inode(sb, inum);
+    if (!ino)
+        return -errno;
+
+    auto raw = ext2_get_inode_from_node(ino);
+    uint32_t nr_blocks = ino->i_size >> sb->block_size_shift;
+    int st = 0;
+
+    for (uint32_t lblk = 0; lblk < nr_blocks; lblk++)
+    {
+        auto res = ext2_get_block_from_inode(raw, lblk, sb);
+        if (res.has_error())
+        {
+            st = res.error();
+            break;
+        }
+
+        ext2_block_no block = res.value();
+        if (block == EXT2_FILE_HOLE_BLOCK)
+        {
+            pr_err("ext2: journal inode has a hole at block %u\n", lblk);
+            st = -EINVAL;
+            break;
+        }
+
+        if (j->j_extents.size())
+        {
+            auto &last = j->j_extents.back();
+            if (last.physical + last.len == block)
+            {
+                last.len++;
+                continue;
+            }
+        }
+
+        if (!j->j_extents.push_back(ext2_journal_extent{lblk, block, 1}))
+        {
+            st = -ENOMEM;
+            break;
+        }
+    }
+
+    inode_unref(ino);
+    return st;
+}
+
+static void ext2_journal_free(struct ext2_journal *j)
+{
+    if (j->j_running)
+        ext2_txn_free(j->j_running);
+    if (j->j_sb_bb)
+        block_buf_put(j->j_sb_bb);
+    delete j;
+}
+
+static void ext2_set_needs_recovery(struct ext2_superblock *sb, bool set)
+{
+    if (set)
+        sb->sb->s_feature_incompat |= EXT2_FEATURE_INCOMPAT_RECOVER;
+    else
+        sb->sb->s_feature_incompat &= ~EXT2_FEATURE_INCOMPAT_RECOVER;
+    sb->features_incompat = sb->sb->s_feature_incompat;
+
+    /* Not journaled, this one is written in place: it tells fsck (and us) whether the journal
+     * needs replaying */
+    block_buf_dirty(sb->sb_bb);
+    block_buf_sync(sb->sb_bb);
+}
+
+int ext2_journal_load(struct ext2_superblock *sb)
+{
+    const bool needs_recovery = sb->features_incompat & EXT2_FEATURE_INCOMPAT_RECOVER;
+    struct ext2_journal *j;
+    ext2_tid_t next_tid;
+    ext2_block_no jsb_block;
+    unsigned long capacity;
+    int st;
+
+    if (!(sb->features_compat & EXT3_FEATURE_COMPAT_HAS_JOURNAL))
+        return 0;
+
+    if (sb->features_incompat & EXT2_FEATURE_INCOMPAT_JOURNAL_DEV || sb->sb->s_journal_inum == 0)
+    {
+        pr_warn("ext2: external journals are not supported\n");
+        return needs_recovery ? -EINVAL : 0;
+    }
+
+    j = new ext2_journal;
+    if (!j)
+        return -ENOMEM;
+
+    j->j_sb = sb;
+    j->j_sb_bb = nullptr;
+    j->j_running = nullptr;
+    j->j_barrier = false;
+    j->j_checkpointing = false;
+    j->j_stop = false;
+    j->j_thread_done = false;
+    j->j_errno = 0;
+    j->j_flushing = nullptr;
+    j->j_thread = nullptr;
+    j->j_io_pending = 0;
+    j->j_io_error = 0;
+    spinlock_init(&j->j_lock);
+    mutex_init(&j->j_commit_mutex);
+    INIT_LIST_HEAD(&j->j_checkpoint);
+    for (auto &head : j->j_hash)
+        INIT_LIST_HEAD(&head);
+    init_wait_queue_head(&j->j_wait_updates);
+    init_wait_queue_head(&j->j_wait_barrier);
+    init_wait_queue_head(&j->j_wait_commit);
+    init_wait_queue_head(&j->j_wait_done);
+    init_wait_queue_head(&j->j_wait_ordered);
+    init_wait_queue_head(&j->j_wait_checkpoint);
+    init_wait_queue_head(&j->j_wait_io);
+
+    if (st = ext2_journal_map(j, sb->sb->s_journal_inum); st < 0)
+        goto err;
+
+    st = -EINVAL;
+    jsb_block = ext2_journal_bmap(j, 0);
+    if (jsb_block == EXT2_ERR_INV_BLOCK)
+        goto unsupported;
+
+    j->j_sb_bb = sb_read_block(sb, jsb_block);
+    if (!j->j_sb_bb)
+    {
+        st = -EIO;
+        goto err;
+    }
+
+    j->j_jsb = (struct jbd2_superblock *) block_buf_data(j->j_sb_bb);
+
+    if (ntohl(j->j_jsb->s_header.h_magic) != JBD2_MAGIC_NUMBER ||
+        ntohl(j->j_jsb->s_header.h_blocktype) != JBD2_SUPERBLOCK_V2)
+    {
+        pr_warn("ext2: journal superblock is invalid or v1\n");
+        goto unsupported;
+    }
+
+    if (ntohl(j->j_jsb->s_feature_incompat) & ~JBD2_KNOWN_INCOMPAT)
+    {
+        pr_warn("ext2: journal has unsupported features %x\n",
+                ntohl(j->j_jsb->s_feature_incompat));
+        goto unsupported;
+    }
+
+    j->j_first = ntohl(j->j_jsb->s_first);
+    j->j_last = ntohl(j->j_jsb->s_maxlen);
+    if (ntohl(j->j_jsb->s_blocksize) != sb->block_size || j->j_first == 0 ||
+        j->j_first >= j->j_last || ext2_journal_bmap(j, j->j_last - 1) == EXT2_ERR_INV_BLOCK)
+    {
+        pr_warn("ext2: journal superblock has a bad geometry\n");
+        goto unsupported;
+    }
+
+    memcpy(j->j_uuid, j->j_jsb->s_uuid, sizeof(j->j_uuid));
+
+    if (needs_recovery || j->j_jsb->s_start != 0)
+    {
+        pr_info("ext2: recovering journal\n");
+        if (st = ext2_journal_recover(j, &next_tid); st < 0)
+        {
+            pr_err("ext2: journal recovery failed: %d\n", st);
+            goto err;
+        }
+    }
+    else
+        next_tid = ntohl(j->j_jsb->s_sequence);
+
+    j->j_tags_per_desc = (sb->block_size - sizeof(struct jbd2_header) - sizeof(j->j_uuid)) /
+                         sizeof(struct jbd2_block_tag);
+    j->j_revokes_per_block =
+        (sb->block_size - sizeof(struct jbd2_revoke_header)) / sizeof(uint32_t);
+    j->j_head = j->j_tail = j->j_first;
+    j->j_free = j->j_last - j->j_first;
+    j->j_tail_sequence = next_tid;
+    j->j_commit_done = j->j_commit_request = next_tid - 1;
+
+    /* A transaction (plus its descriptors and revoke blocks) needs to fit in a quarter of the
+     * log, so there's always room to commit after a checkpoint */
+    capacity = j->j_free / 4;
+    j->j_max_txn_buffers = capacity - capacity / j->j_tags_per_desc - 8;
+    if ((long) j->j_max_txn_buffers <= 0)
+    {
+        pr_warn("ext2: journal is too small\n");
+        goto unsupported;
+    }
+
+    j->j_running = ext2_txn_alloc(j, next_tid);
+    if (!j->j_running)
+    {
+        st = -ENOMEM;
+        goto err;
+    }
+
+    /* We write revoke records */
+    j->j_jsb->s_feature_incompat |= htonl(JBD2_FEATURE_INCOMPAT_REVOKE);
+    ext2_journal_write_sb(j);
+    ext2_set_needs_recovery(sb, true);
+
+    sb->journal = j;
+
+    j->j_thread = sched_create_thread(ext2_journal_thread, THREAD_KERNEL, j);
+    if (!j->j_thread)
+    {
+        sb->journal = nullptr;
+        st = -ENOMEM;
+        goto err;
+    }
+
+    sched_start_thread(j->j_thread);
+    pr_info("ext2: journal of %u blocks loaded (ordered data mode)\n", j->j_last);
+    return 0;
+
+unsupported:
+    if (!needs_recovery)
+    {
+        pr_warn("ext2: mounting without the journal\n");
+        st = 0;
+    }
+err:
+    ext2_journal_free(j);
+    return st;
+}
+
+void ext2_journal_destroy(struct ext2_superblock *sb)
+{
+    struct ext2_journal *j = sb->journal;
+    if (!j)
+        return;
+
+    spin_lock(&j->j_lock);
+    j->j_stop = true;
+    wait_queue_wake_all(&j->j_wait_commit);
+    wait_for_event_locked(&j->j_wait_done, j->j_thread_done, &j->j_lock);
+    spin_unlock(&j->j_lock);
+
+    ext2_journal_commit(j);
+
+    {
+        scoped_mutex g{j->j_commit_mutex};
+        ext2_journal_checkpoint(j);
+    }
+
+    if (!j->j_errno)
+    {
+        /* Clean journal */
+        j->j_tail = 0;
+        ext2_journal_write_sb(j);
+        ext2_set_needs_recovery(sb, false);
+    }
+
+    sb->journal = nullptr;
+    ext2_journal_free(j);
+}
@@ -0,0 +1,380 @@
+/*
+ * Copyright (c) 2024 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the GPLv2 License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+#ifndef _EXT2_JOURNAL_H
+#define _EXT2_JOURNAL_H
+
+#include <stdint.h>
+
+#include <onyx/list.h>
+#include <onyx/mutex.h>
+#include <onyx/spinlock.h>
+#include <onyx/types.h>
+#include <onyx/vector.h>
+#include <onyx/wait_queue.h>
+
+#include "ext2.h"
+
+/* On-disk JBD2 structures, as used by ext3/ext4. Everything in the journal is big endian. */
+#define JBD2_MAGIC_NUMBER 0xc03b3998U
+
+#define JBD2_DESCRIPTOR_BLOCK 1
+#define JBD2_COMMIT_BLOCK     2
+#define JBD2_SUPERBLOCK_V1    3
+#define JBD2_SUPERBLOCK_V2    4
+#define JBD2_REVOKE_BLOCK     5
+
+/* Descriptor tag flags */
+#define JBD2_FLAG_ESCAPE    1
+#define JBD2_FLAG_SAME_UUID 2
+#define JBD2_FLAG_DELETED   4
+#define JBD2_FLAG_LAST_TAG  8
+
+#define JBD2_FEATURE_INCOMPAT_REVOKE       0x1
+#define JBD2_FEATURE_INCOMPAT_64BIT        0x2
+#define JBD2_FEATURE_INCOMPAT_ASYNC_COMMIT 0x4
+#define JBD2_FEATURE_INCOMPAT_CSUM_V2      0x8
+#define JBD2_FEATURE_INCOMPAT_CSUM_V3      0x10
+#define JBD2_FEATURE_INCOMPAT_FAST_COMMIT  0x20
+
+/* We don't verify checksums, so async commit journals replay just fine */
+#define JBD2_KNOWN_INCOMPAT (JBD2_FEATURE_INCOMPAT_REVOKE | JBD2_FEATURE_INCOMPAT_ASYNC_COMMIT)
+
+struct jbd2_header
+{
+    uint32_t h_magic;
+    uint32_t h_blocktype;
+    uint32_t h_sequence;
+};
+
+struct jbd2_superblock
+{
+    struct jbd2_header s_header;
+    uint32_t s_blocksize;
+    /* Total number of blocks in the journal */
+    uint32_t s_maxlen;
+    /* First block of log information */
+    uint32_t s_first;
+    /* First commit ID expected in the log */
+    uint32_t s_sequence;
+    /* Block number of the start of the log, 0 if the journal is clean */
+    uint32_t s_start;
+    uint32_t s_errno;
+    uint32_t s_feature_compat;
+    uint32_t s_feature_incompat;
+    uint32_t s_feature_ro_compat;
+    uint8_t s_uuid[16];
+    uint32_t s_nr_users;
+    uint32_t s_dynsuper;
+    uint32_t s_max_transaction;
+    uint32_t s_max_trans_data;
+    uint8_t s_checksum_type;
+    uint8_t s_padding2[3];
+    uint32_t s_padding[42];
+    uint32_t s_checksum;
+    uint8_t s_users[16 * 48];
+};
+
+/* Tag layout for journals without 64bit or csum features */
+struct jbd2_block_tag
+{
+    uint32_t t_blocknr;
+    uint16_t t_checksum;
+    uint16_t t_flags;
+};
+
+struct jbd2_commit_header
+{
+    struct jbd2_header h_header;
+    uint8_t h_chksum_type;
+    uint8_t h_chksum_size;
+    uint8_t h_padding[2];
+    uint32_t h_chksum[8];
+    uint64_t h_commit_sec;
+    uint32_t h_commit_nsec;
+};
+
+struct jbd2_revoke_header
+{
+    struct jbd2_header r_header;
+    /* Number of bytes used in the block, including the header */
+    uint32_t r_count;
+};
+
+typedef uint32_t ext2_tid_t;
+
+/* Transaction IDs wrap around, compare them like TCP sequence numbers */
+static inline bool ext2_tid_before(ext2_tid_t a, ext2_tid_t b)
+{
+    return (int32_t) (a - b) < 0;
+}
+
+struct ext2_transaction;
+
+#define EXT2_JBUF_REVOKE  (1 << 0)
+#define EXT2_JBUF_REVOKED (1 << 1)
+#define EXT2_JBUF_ESCAPED (1 << 2)
+
+/**
+ * @brief A metadata block (or a revoke record) that's part of a transaction
+ * Journaled blocks are never written in place by the buffer cache. We hold a reference to the
+ * page they live in (so it can't be reclaimed), take a frozen copy of it when the transaction
+ * starts committing, and write that copy to the journal and then to its home location.
+ */
+struct ext2_jbuf
+{
+    ext2_block_no block;
+    struct ext2_transaction *txn;
+    /* Live copy of the block */
+    struct page *page;
+    unsigned int page_off;
+    /* Frozen copy, valid once the transaction is committing */
+    struct page *frozen;
+    unsigned int frozen_off;
+    unsigned int flags;
+    struct list_head txn_node;
+    struct list_head hash_node;
+};
+
+#define EXT2_TXN_RUNNING    0
+#define EXT2_TXN_COMMITTING 1
+#define EXT2_TXN_COMMITTED  2
+
+struct ext2_journal;
+
+struct ext2_transaction
+{
+    struct ext2_journal *t_journal;
+    ext2_tid_t t_tid;
+    unsigned int t_state;
+    /* Number of handles currently open against this transaction */
+    unsigned long t_updates;
+    /* In-flight ordered data writes (blocks this transaction allocated) */
+    unsigned long t_ordered_io;
+    struct list_head t_buffers;
+    struct list_head t_revokes;
+    /* Inodes whose in-core metadata needs to get copied into the inode table at commit */
+    struct list_head t_inodes;
+    unsigned long t_nr_buffers;
+    unsigned long t_nr_revokes;
+    /* Pages holding frozen copies, descriptor, revoke and commit blocks */
+    cul::vector<struct page *> t_pages;
+    /* Where the transaction starts in the log, and how many blocks it takes up */
+    uint32_t t_log_start;
+    uint32_t t_log_blocks;
+    struct list_head t_checkpoint_node;
+};
+
+/* Physical extent of the journal inode */
+struct ext2_journal_extent
+{
+    uint32_t logical;
+    ext2_block_no physical;
+    uint32_t len;
+};
+
+#define EXT2_JOURNAL_HASH_SIZE 1024
+
+struct ext2_journal
+{
+    struct ext2_superblock *j_sb;
+    cul::vector<ext2_journal_extent> j_extents;
+
+    struct block_buf *j_sb_bb;
+    struct jbd2_superblock *j_jsb;
+    uint8_t j_uuid[16];
+
+    /* Log geometry, in journal blocks. The log lives in [j_first, j_last). */
+    uint32_t j_first;
+    uint32_t j_last;
+    /* Next block we're writing to, oldest block still needed for recovery and free blocks */
+    uint32_t j_head;
+    uint32_t j_tail;
+    uint32_t j_free;
+    ext2_tid_t j_tail_sequence;
+    /* Blocks per descriptor block, revoke records per revoke block */
+    unsigned int j_tags_per_desc;
+    unsigned int j_revokes_per_block;
+    unsigned long j_max_txn_buffers;
+
+    /* Protects the transaction state below */
+    struct spinlock j_lock;
+    struct ext2_transaction *j_running;
+    /* Set while a commit is waiting for handles to drain. Stops new handles from starting. */
+    bool j_barrier;
+    ext2_tid_t j_commit_request;
+    ext2_tid_t j_commit_done;
+    bool j_checkpointing;
+    bool j_stop;
+    bool j_thread_done;
+    int j_errno;
+    struct list_head j_checkpoint;
+    struct list_head j_hash[EXT2_JOURNAL_HASH_SIZE];
+    /* Inode the commit is currently writing to the inode table */
+    struct inode *j_flushing;
+
+    /* Serializes commits and checkpoints */
+    struct mutex j_commit_mutex;
+
+    struct wait_queue j_wait_updates;
+    struct wait_queue j_wait_barrier;
+    struct wait_queue j_wait_commit;
+    struct wait_queue j_wait_done;
+    struct wait_queue j_wait_ordered;
+    struct wait_queue j_wait_checkpoint;
+    struct thread *j_thread;
+
+    /* Journal and checkpoint I/O in flight, protected by j_commit_mutex */
+    unsigned long j_io_pending;
+    int j_io_error;
+    struct wait_queue j_wait_io;
+};
+
+/**
+ * @brief Load the journal, replay it if needed and start journaling
+ *
+ * @param sb Pointer to the ext2 superblock
+ * @return 0 on success (including when the fs has no usable journal), negative error code
+ */
+int ext2_journal_load(struct ext2_superblock *sb);
+
+/**
+ * @brief Commit and checkpoint everything, mark the journal clean and tear it down
+ *
+ * @param sb Pointer to the ext2 superblock
+ */
+void ext2_journal_destroy(struct ext2_superblock *sb);
+
+class ext2_handle;
+
+/**
+ * @brief Start a handle: every metadata change between start and stop goes into the same
+ * transaction. Handles nest.
+ *
+ * @param sb Pointer to the ext2 superblock
+ * @param handle Handle to start
+ */
+void ext2_journal_start(struct ext2_superblock *sb, ext2_handle *handle);
+
+/**
+ * @brief Stop a handle
+ *
+ * @param handle Handle to stop
+ */
+void ext2_journal_stop(ext2_handle *handle);
+
+/**
+ * @brief Add a metadata block to the running transaction
+ *
+ * @param sb Pointer to the ext2 superblock
+ * @param page Page the block lives in
+ * @param page_off Offset of the block inside the page
+ * @param block Block number
+ */
+void ext2_journal_dirty_block(struct ext2_superblock *sb, struct page *page,
+                              unsigned int page_off, ext2_block_no block);
+
+/**
+ * @brief Tell the journal blocks were freed
+ * Freed blocks are dropped from the running transaction and revoked, so neither checkpointing
+ * nor replay writes stale metadata over whatever reuses them.
+ *
+ * @param sb Pointer to the ext2 superblock
+ * @param block First block
+ * @param count Number of blocks
+ */
+void ext2_journal_revoke(struct ext2_superblock *sb, ext2_block_no block, unsigned int count);
+
+/**
+ * @brief Add an inode to the running transaction
+ * Its in-core metadata gets written to the inode table when the transaction commits.
+ *
+ * @param ino Pointer to the inode
+ */
+void ext2_journal_dirty_inode(struct inode *ino);
+
+/**
+ * @brief Drop an inode from whatever transaction it's on, when it goes away
+ * If the commit hadn't written it yet, it gets written into the running transaction now.
+ *
+ * @param ino Pointer to the inode
+ */
+void ext2_journal_forget_inode(struct inode *ino);
+
+/**
+ * @brief Get the transaction the current handle is running against
+ *
+ * @param sb Pointer to the ext2 superblock
+ * @return The transaction, or nullptr if not journaling
+ */
+struct ext2_transaction *ext2_journal_current(struct ext2_superblock *sb);
+
+/**
+ * @brief Account for an ordered data write
+ * The transaction won't commit until the data has hit the disk.
+ *
+ * @param txn Transaction the data blocks were allocated in
+ */
+void ext2_journal_ordered_start(struct ext2_transaction *txn);
+
+/**
+ * @brief End an ordered data write (called from I/O completion)
+ *
+ * @param txn Transaction the data blocks were allocated in
+ */
+void ext2_journal_ordered_end(struct ext2_transaction *txn);
+
+/**
+ * @brief Make an inode's metadata durable, by committing the last transaction that touched it
+ * Concurrent callers wait on the same commit.
+ *
+ * @param ino Pointer to the inode
+ * @return 0 on success, negative error code
+ */
+int ext2_journal_commit_inode(struct inode *ino);
+
+/**
+ * @brief Ask the commit thread to commit the running transaction soon
+ *
+ * @param sb Pointer to the ext2 superblock
+ */
+void ext2_journal_kick(struct ext2_superblock *sb);
+
+/**
+ * @brief A journal handle. Lives on the stack for the duration of a filesystem operation; the
+ * outermost handle of the thread is stashed in thread::journal_info, so nested operations (e.g.
+ * block allocation from inside a directory operation) join the same transaction.
+ */
+class ext2_handle
+{
+public:
+    struct ext2_journal *journal{nullptr};
+    struct ext2_transaction *txn{nullptr};
+    ext2_handle *prev{nullptr};
+    bool nested{false};
+
+    explicit ext2_handle(struct ext2_superblock *sb)
+    {
+        ext2_journal_start(sb, this);
+    }
+
+    /* Joins a transaction without accounting for it. Only for the commit itself. */
+    ext2_handle(struct ext2_journal *j, struct ext2_transaction *t)
+        : journal{j}, txn{t}, nested{true}
+    {
+    }
+
+    ~ext2_handle()
+    {
+        ext2_journal_stop(this);
+    }
+
+    ext2_handle(const ext2_handle &) = delete;
+    ext2_handle &operator=(const ext2_handle &) = delete;
+};
+
+#endif
@@ -18,6 +18,7 @@
 #include <uapi/fcntl.h>
 
 #include "ext2.h"
+#include "journal.h"
 
 /**
  * @brief Detects if a symlink is a fast symlink
@@ -110,8 +111,13 @@ int ext2_set_symlink(inode *ino, const char *dest)
     {
         unsigned long old = thread_change_addr_limit(VM_KERNEL_ADDR_LIMIT);
 
-        // TODO: Kind of dumb that it's not a const void *, fix?
-        ssize_t read = file_write_cache((void *) dest, length - 1, ino, 0);
+        ssize_t read;
+        {
+            /* Symlink blocks are metadata, write them like directory blocks */
+            scoped_rwlock<rw_lock::write> g{ino->i_rwlock};
+            // TODO: Kind of dumb that it's not a const void *, fix?
+            read = ext2_dir_write((void *) dest, length - 1, ino, 0);
+        }
 
         thread_change_addr_limit(old);
 
@@ -128,6 +134,7 @@ inode *ext2_symlink(struct dentry *dentry, const char *dest, struct dentry *dir)
 {
     struct inode *vfs_ino = dir->d_inode;
     struct ext2_superblock *fs = ext2_superblock_from_inode(vfs_ino);
+    ext2_handle handle{fs};
     uint32_t inumber = 0;
     struct inode *ino = nullptr;
     unsigned long old = 0;
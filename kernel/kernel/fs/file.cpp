@@ -396,7 +396,18 @@ static int dup_fdtable(struct ioctx *ctx, struct fd_table *table)
     return 0;
 }
 
-int copy_file_descriptors(struct process *process, struct ioctx *ctx)
+/**
+ * @brief Copy a file descriptor table
+ *
+ * @param process Process to copy it to
+ * @param ctx ioctx to copy from
+ * @param keep_cloexec If not null, O_CLOEXEC fds are only copied if keep_cloexec(fd, arg) says
+ * so. Used when the new process is going to exec right away, and those would just get closed.
+ * @param arg Argument for keep_cloexec
+ * @return 0 on success, negative error code
+ */
+int copy_file_descriptors_filter(struct process *process, struct ioctx *ctx,
+                                 bool (*keep_cloexec)(int fd, void *arg), void *arg)
 {
     int err;
     struct fd_table *oldt;
@@ -428,6 +439,15 @@ int copy_file_descriptors(struct process *process, struct ioctx *ctx)
 
     for (unsigned int i = 0; i < table->file_desc_entries; i++)
     {
+        if (keep_cloexec && fd_is_open(i, table) && fd_is_cloexec(i, table) &&
+            !keep_cloexec(i, arg))
+        {
+            fd_set_open(i, false, table);
+            fd_set_cloexec(i, false, table);
+            table->file_desc[i] = nullptr;
+            continue;
+        }
+
         rcu_assign_pointer(table->file_desc[i], oldt->file_desc[i]);
         if (fd_is_open(i, table))
             fd_get(table->file_desc[i]);
@@ -438,6 +458,11 @@ int copy_file_descriptors(struct process *process, struct ioctx *ctx)
     return 0;
 }
 
+int copy_file_descriptors(struct process *process, struct ioctx *ctx)
+{
+    return copy_file_descriptors_filter(process, ctx, nullptr, nullptr);
+}
+
 int allocate_file_descriptor_table(struct process *process)
 {
     fd_table *table = fdtable_alloc();
@@ -242,8 +242,9 @@ ssize_t filemap_read_iter(struct file *filp, size_t off, iovec_iter *iter, unsig
         size = bdev->nr_sectors * bdev->sector_size;
     }
 
+    /* O_DIRECT reads are what the latency sensitive stuff does, poll for those */
     if (filp->f_flags & O_DIRECT)
-        return filemap_do_direct(filp, off, iter, flags);
+        return filemap_do_direct(filp, off, iter, DIRECT_IO_READ | DIRECT_IO_POLL);
 
     ssize_t st = 0;
 
@@ -147,6 +147,20 @@ ssize_t inode_sync(struct inode *inode)
     return 0;
 }
 
+/**
+ * @brief Let the filesystem make the inode's metadata durable (e.g commit its journal)
+ *
+ * @param inode Inode to sync
+ * @return 0 on success, negative error code
+ */
+static int inode_fsync_metadata(struct inode *inode)
+{
+    struct superblock *sb = inode->i_sb;
+    if (sb && sb->fsync)
+        return sb->fsync(inode);
+    return 0;
+}
+
 bool inode_is_cacheable(struct inode *file);
 
 /**
@@ -213,6 +227,13 @@ void inode_release(struct inode *inode)
     inode->set_evicting();
 
     inode_wait_for_wb_and_remove(inode);
+
+    /* If the file is going away, don't bother writing back its data. This matters for
+     * filesystems that delay block allocation, where short-lived files then never touch the disk.
+     */
+    if (should_die && inode->i_pages && S_ISREG(inode->i_mode))
+        vmo_truncate(inode->i_pages, 0, 0);
+
     inode_sync(inode);
     {
         /* Clear dirty/writeback */
@@ -390,7 +411,7 @@ int sys_fsync(int fd)
     /* TODO: Same problem as inode_sync, return errors. */
     inode_sync(f.get_file()->f_ino);
 
-    return 0;
+    return inode_fsync_metadata(f.get_file()->f_ino);
 }
 
 int sys_fdatasync(int fd)
@@ -399,7 +420,7 @@ int sys_fdatasync(int fd)
     if (f.from_fd(fd) < 0)
         return -EBADF;
     inode_sync(f.get_file()->f_ino);
-    return 0;
+    return inode_fsync_metadata(f.get_file()->f_ino);
 }
 
 void inode_add_hole_in_page(struct page *page, size_t page_offset, size_t end_offset) REQUIRES(page)
@@ -563,6 +584,9 @@ void inode_mark_dirty(struct inode *ino, unsigned int flags)
 
     DCHECK(flags & I_DIRTYALL);
 
+    if (flags & I_DIRTY && ino->i_sb && ino->i_sb->dirty_inode)
+        ino->i_sb->dirty_inode(ino);
+
     /* Already dirty */
     if ((ino->i_flags & flags) == flags)
         return;
@@ -1151,7 +1151,8 @@ int link_vfs(struct file *target, int dirfd, const char *newpath)
 
     inode_ref(dest_ino);
     d_positiveize(dent, dest_ino);
-    inode_inc_nlink(dest_ino);
+    if (!(dest_ino->i_sb->s_flags & SB_FLAG_FS_NLINK))
+        inode_inc_nlink(dest_ino);
 
     inode_unlock(dir_ino);
     path_put(&parent);
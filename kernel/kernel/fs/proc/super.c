@@ -37,7 +37,7 @@ positive:
     return 0;
 }
 
-static int proc_root_open(struct dentry *dir, const char *name, struct dentry *dentry)
+static int proc_dir_open(struct dentry *dir, const char *name, struct dentry *dentry)
 {
     return proc_open_entry(dir, name, dentry);
 }
@@ -51,7 +51,7 @@ static off_t proc_root_pid_getdirent(struct dirent *buf, off_t off, struct procf
     return 0;
 }
 
-static off_t proc_root_getdirent(struct dirent *buf, off_t off, struct file *file)
+static off_t proc_dir_getdirent(struct dirent *buf, off_t off, struct file *file)
 {
     off_t i;
     struct procfs_entry *dir = I_PROC_ENTRY(file->f_dentry->d_inode), *entry;
@@ -90,16 +90,17 @@ int proc_stat(struct stat *buf, const struct path *path)
     return 0;
 }
 
-static const struct inode_operations proc_root_ino_ops = {
-    .open = proc_root_open,
+/* Used for the root and any other directory */
+static const struct inode_operations proc_dir_ino_ops = {
+    .open = proc_dir_open,
     .link = libfs_no_link,
     .unlink = libfs_no_unlink,
     .readlink = libfs_no_readlink,
     .stat = proc_stat,
 };
 
-static const struct file_ops proc_root_file_ops = {
-    .getdirent = proc_root_getdirent,
+static const struct file_ops proc_dir_file_ops = {
+    .getdirent = proc_dir_getdirent,
     .symlink = libfs_no_symlink,
 };
 
@@ -112,8 +113,8 @@ struct procfs_entry root_entry = {
     .children = LIST_HEAD_INIT(root_entry.children),
     .children_lock = __SPIN_LOCK_UNLOCKED(root_entry.children_lock),
     .inum = 2,
-    .iops = &proc_root_ino_ops,
-    .fops = &proc_root_file_ops,
+    .iops = &proc_dir_ino_ops,
+    .fops = &proc_dir_file_ops,
 };
 
 static struct superblock *proc_mount(struct vfs_mount_info *info)
@@ -155,7 +156,12 @@ static void procfs_init_entry(struct procfs_entry *entry, const char *name, mode
     entry->mode = mode;
     entry->name = name;
     if (S_ISDIR(entry->mode))
+    {
         entry->nlink = 2;
+        entry->iops = &proc_dir_ino_ops;
+        entry->fops = &proc_dir_file_ops;
+        __atomic_add_fetch(&parent->nlink, 1, __ATOMIC_RELAXED);
+    }
     else
         entry->nlink = 1;
 }
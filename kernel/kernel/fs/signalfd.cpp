@@ -0,0 +1,202 @@
+/*
+ * Copyright (c) 2025 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the GPLv2 License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <onyx/anon_inode.h>
+#include <onyx/file.h>
+#include <onyx/iovec_iter.h>
+#include <onyx/poll.h>
+#include <onyx/process.h>
+#include <onyx/scoped_lock.h>
+#include <onyx/signal.h>
+#include <onyx/user.h>
+#include <onyx/vfs.h>
+#include <onyx/wait_queue.h>
+
+#include <uapi/poll.h>
+#include <uapi/signalfd.h>
+
+/*
+ * signalfd: read the calling thread's pending signals (in the fd's mask) as signalfd_siginfos,
+ * instead of having them delivered. The signals are supposed to be blocked, else they'll usually
+ * get delivered first. Like on Linux, the fd always refers to whoever is reading or polling it, not
+ * to whoever created it.
+ */
+
+struct signalfd_ctx
+{
+    struct spinlock lock;
+    sigset_t mask;
+};
+
+static sigset_t signalfd_get_mask(struct signalfd_ctx *ctx)
+{
+    scoped_lock g{ctx->lock};
+    return ctx->mask;
+}
+
+static void signalfd_fill(struct signalfd_siginfo *ssi, int signo, const siginfo_t *info)
+{
+    memset(ssi, 0, sizeof(*ssi));
+    ssi->ssi_signo = signo;
+    ssi->ssi_errno = info->si_errno;
+    ssi->ssi_code = info->si_code;
+
+    switch (signo)
+    {
+        case SIGCHLD:
+            ssi->ssi_pid = info->si_pid;
+            ssi->ssi_uid = info->si_uid;
+            ssi->ssi_status = info->si_status;
+            ssi->ssi_utime = info->si_utime;
+            ssi->ssi_stime = info->si_stime;
+            break;
+        case SIGSEGV:
+        case SIGBUS:
+        case SIGILL:
+        case SIGFPE:
+        case SIGTRAP:
+            /* Faults have an address, kill() and friends have a sender */
+            if (info->si_code > 0)
+            {
+                ssi->ssi_addr = (unsigned long) info->si_addr;
+                break;
+            }
+            /* fallthrough */
+        default:
+            ssi->ssi_pid = info->si_pid;
+            ssi->ssi_uid = info->si_uid;
+            ssi->ssi_int = info->si_int;
+            ssi->ssi_ptr = (unsigned long) info->si_ptr;
+            break;
+    }
+}
+
+static ssize_t signalfd_read_iter(struct file *filp, size_t off, iovec_iter *iter,
+                                  unsigned int flags)
+{
+    struct signalfd_ctx *ctx = (struct signalfd_ctx *) filp->private_data;
+    struct signalfd_siginfo ssi;
+    ssize_t read = 0;
+    siginfo_t info;
+
+    if (iter->bytes < sizeof(ssi))
+        return -EINVAL;
+
+    sigset_t mask = signalfd_get_mask(ctx);
+
+    while (iter->bytes >= sizeof(ssi))
+    {
+        int sig = signal_dequeue_set(&mask, &info);
+        if (!sig)
+        {
+            if (read)
+                break;
+            if (filp->f_flags & O_NONBLOCK)
+                return -EAGAIN;
+
+            if (wait_for_event_interruptible(&get_current_process()->sig->signalfd_wq,
+                                             signal_pending_in_set(&mask)) == -ERESTARTSYS)
+                return -ERESTARTSYS;
+            continue;
+        }
+
+        signalfd_fill(&ssi, sig, &info);
+        if (copy_to_iter(iter, &ssi, sizeof(ssi)) != sizeof(ssi))
+            return read ?: -EFAULT;
+        read += sizeof(ssi);
+    }
+
+    return read;
+}
+
+static short signalfd_poll(void *poll_file, short events, struct file *filp)
+{
+    struct signalfd_ctx *ctx = (struct signalfd_ctx *) filp->private_data;
+    sigset_t mask = signalfd_get_mask(ctx);
+
+    if (signal_pending_in_set(&mask))
+        return (POLLIN | POLLRDNORM) & events;
+
+    poll_wait_helper(poll_file, &get_current_process()->sig->signalfd_wq);
+    return 0;
+}
+
+static void signalfd_release(struct file *filp)
+{
+    free(filp->private_data);
+}
+
+static const struct file_ops signalfd_ops = {
+    .poll = signalfd_poll,
+    .release = signalfd_release,
+    .read_iter = signalfd_read_iter,
+};
+
+#define SIGNALFD_SIGSETLEN 8
+
+int sys_signalfd4(int fd, const sigset_t *umask, size_t sizemask, int flags)
+{
+    struct signalfd_ctx *ctx;
+    struct file *filp;
+    sigset_t mask;
+
+    if (flags & ~(SFD_CLOEXEC | SFD_NONBLOCK))
+        return -EINVAL;
+    if (sizemask != SIGNALFD_SIGSETLEN)
+        return -EINVAL;
+    if (copy_from_user(&mask, umask, sizeof(mask)) < 0)
+        return -EFAULT;
+
+    /* These can't be caught, so they can't be read either */
+    sigdelset(&mask, SIGKILL);
+    sigdelset(&mask, SIGSTOP);
+
+    if (fd != -1)
+    {
+        /* Update the mask of an existing signalfd */
+        auto_file f = get_file_description(fd);
+        if (!f)
+            return -EBADF;
+        if (f.get_file()->f_ino->i_fops != &signalfd_ops)
+            return -EINVAL;
+
+        ctx = (struct signalfd_ctx *) f.get_file()->private_data;
+        {
+            scoped_lock g{ctx->lock};
+            ctx->mask = mask;
+        }
+
+        /* Someone might be waiting on signals that are now in the mask */
+        wait_queue_wake_all(&get_current_process()->sig->signalfd_wq);
+        return fd;
+    }
+
+    ctx = (struct signalfd_ctx *) malloc(sizeof(*ctx));
+    if (!ctx)
+        return -ENOMEM;
+
+    spinlock_init(&ctx->lock);
+    ctx->mask = mask;
+
+    filp = anon_inode_open(S_IFREG, (struct file_ops *) &signalfd_ops, "[signalfd]");
+    if (!filp)
+    {
+        free(ctx);
+        return -ENOMEM;
+    }
+
+    filp->f_ino->i_flags = INODE_FLAG_NO_SEEK;
+    filp->private_data = ctx;
+
+    fd = open_with_vnode(filp, O_RDONLY | flags);
+    fd_put(filp);
+    return fd;
+}
@@ -30,6 +30,8 @@ void superblock_init(struct superblock *sb)
 
     sb->umount = nullptr;
     sb->shutdown = sb_generic_shutdown;
+    sb->dirty_inode = nullptr;
+    sb->fsync = nullptr;
 }
 
 int sb_read_bio(struct superblock *sb, struct page_iov *vec, size_t nr_vecs, size_t block_number)
@@ -0,0 +1,286 @@
+/*
+ * Copyright (c) 2025 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the GPLv2 License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+#include <errno.h>
+
+#include <onyx/anon_inode.h>
+#include <onyx/clock.h>
+#include <onyx/file.h>
+#include <onyx/iovec_iter.h>
+#include <onyx/mutex.h>
+#include <onyx/new.h>
+#include <onyx/poll.h>
+#include <onyx/scoped_lock.h>
+#include <onyx/timer.h>
+#include <onyx/user.h>
+#include <onyx/vfs.h>
+#include <onyx/wait_queue.h>
+
+#include <uapi/poll.h>
+#include <uapi/time.h>
+#include <uapi/timerfd.h>
+
+/*
+ * timerfd: a clockevent behind a file descriptor. Expirations get counted, and read() returns (and
+ * resets) the count. The clockevent is ATOMIC, so expiring is just bumping the count and waking up
+ * the waiters from the timer interrupt. CLOCK_REALTIME timers get converted to the monotonic
+ * clock when armed; a later clock_settime doesn't move them.
+ */
+
+struct timerfd_ctx
+{
+    /* Serializes timerfd_settime, the clockevent can't be armed twice */
+    struct mutex settime_lock;
+    /* Protects ticks, interval and the deadline. Taken from the timer interrupt. */
+    struct spinlock lock;
+    struct wait_queue wq;
+    struct clockevent ev;
+    clockid_t clockid;
+    bool armed;
+    u64 ticks;
+    hrtime_t interval;
+};
+
+static void timerfd_expire(struct clockevent *ev)
+{
+    struct timerfd_ctx *ctx = (struct timerfd_ctx *) ev->priv;
+
+    spin_lock(&ctx->lock);
+
+    ctx->ticks++;
+    if (ctx->interval)
+    {
+        /* Catch up on any periods we slept through, so the next deadline is in the future */
+        hrtime_t now = clocksource_get_time();
+        ev->deadline += ctx->interval;
+        if (ev->deadline <= now)
+        {
+            u64 missed = (now - ev->deadline) / ctx->interval + 1;
+            ctx->ticks += missed;
+            ev->deadline += missed * ctx->interval;
+        }
+    }
+    else
+        ctx->armed = false;
+
+    spin_unlock(&ctx->lock);
+
+    wait_queue_wake_all(&ctx->wq);
+}
+
+static ssize_t timerfd_read_iter(struct file *filp, size_t off, iovec_iter *iter,
+                                 unsigned int flags)
+{
+    struct timerfd_ctx *ctx = (struct timerfd_ctx *) filp->private_data;
+    u64 ticks;
+
+    if (iter->bytes < sizeof(u64))
+        return -EINVAL;
+
+    for (;;)
+    {
+        {
+            scoped_lock<spinlock, true> g{ctx->lock};
+            ticks = ctx->ticks;
+            ctx->ticks = 0;
+        }
+
+        if (ticks)
+            break;
+
+        if (filp->f_flags & O_NONBLOCK)
+            return -EAGAIN;
+
+        if (wait_for_event_interruptible(&ctx->wq, READ_ONCE(ctx->ticks) != 0) == -ERESTARTSYS)
+            return -ERESTARTSYS;
+    }
+
+    if (copy_to_iter(iter, &ticks, sizeof(ticks)) != sizeof(ticks))
+        return -EFAULT;
+    return sizeof(ticks);
+}
+
+static short timerfd_poll(void *poll_file, short events, struct file *filp)
+{
+    struct timerfd_ctx *ctx = (struct timerfd_ctx *) filp->private_data;
+    short revents = 0;
+
+    if (READ_ONCE(ctx->ticks))
+        revents = (POLLIN | POLLRDNORM) & events;
+    else
+        poll_wait_helper(poll_file, &ctx->wq);
+
+    return revents;
+}
+
+static void timerfd_release(struct file *filp)
+{
+    struct timerfd_ctx *ctx = (struct timerfd_ctx *) filp->private_data;
+
+    /* Once cancelled, timerfd_expire can't be running (it runs with the event list locked) */
+    timer_cancel_event(&ctx->ev);
+    delete ctx;
+}
+
+static const struct file_ops timerfd_ops = {
+    .poll = timerfd_poll,
+    .release = timerfd_release,
+    .read_iter = timerfd_read_iter,
+};
+
+static bool timerfd_valid_clock(clockid_t clockid)
+{
+    return clockid == CLOCK_MONOTONIC || clockid == CLOCK_REALTIME || clockid == CLOCK_BOOTTIME;
+}
+
+int sys_timerfd_create(clockid_t clockid, int flags)
+{
+    struct timerfd_ctx *ctx;
+    struct file *filp;
+    int fd;
+
+    if (!timerfd_valid_clock(clockid))
+        return -EINVAL;
+    if (flags & ~(TFD_CLOEXEC | TFD_NONBLOCK))
+        return -EINVAL;
+
+    ctx = new timerfd_ctx;
+    if (!ctx)
+        return -ENOMEM;
+
+    mutex_init(&ctx->settime_lock);
+    spinlock_init(&ctx->lock);
+    init_wait_queue_head(&ctx->wq);
+    ctx->clockid = clockid;
+    ctx->armed = false;
+    ctx->ticks = 0;
+    ctx->interval = 0;
+    ctx->ev.priv = ctx;
+    ctx->ev.callback = timerfd_expire;
+
+    filp = anon_inode_open(S_IFREG, (struct file_ops *) &timerfd_ops, "[timerfd]");
+    if (!filp)
+    {
+        delete ctx;
+        return -ENOMEM;
+    }
+
+    filp->f_ino->i_flags = INODE_FLAG_NO_SEEK;
+    filp->private_data = ctx;
+
+    fd = open_with_vnode(filp, O_RDONLY | flags);
+    fd_put(filp);
+    return fd;
+}
+
+static auto_file timerfd_get(int fd)
+{
+    struct file *filp = get_file_description(fd);
+    if (!filp)
+        return errno = EBADF, nullptr;
+
+    if (filp->f_ino->i_fops != &timerfd_ops)
+    {
+        fd_put(filp);
+        return errno = EINVAL, nullptr;
+    }
+
+    return filp;
+}
+
+/* Called with ctx->lock held */
+static void timerfd_get_locked(struct timerfd_ctx *ctx, struct itimerspec *its)
+{
+    *its = {};
+
+    if (!ctx->armed)
+        return;
+
+    hrtime_t now = clocksource_get_time();
+    /* A timer that's expiring right now is still armed, don't report it as disarmed (0) */
+    hrtime_to_timespec(ctx->ev.deadline > now ? ctx->ev.deadline - now : 1, &its->it_value);
+    hrtime_to_timespec(ctx->interval, &its->it_interval);
+}
+
+int sys_timerfd_settime(int fd, int flags, const struct itimerspec *unew, struct itimerspec *uold)
+{
+    struct itimerspec its, old;
+    hrtime_t deadline = 0;
+
+    if (flags & ~TFD_TIMER_ABSTIME)
+        return -EINVAL;
+    if (copy_from_user(&its, unew, sizeof(its)) < 0)
+        return -EFAULT;
+    if (!timespec_valid(&its.it_value, false) || !timespec_valid(&its.it_interval, false))
+        return -EINVAL;
+
+    auto_file f = timerfd_get(fd);
+    if (!f)
+        return -errno;
+
+    struct timerfd_ctx *ctx = (struct timerfd_ctx *) f.get_file()->private_data;
+    hrtime_t value = timespec_to_hrtime(&its.it_value);
+    hrtime_t now = clocksource_get_time();
+
+    if (value)
+    {
+        deadline = now + value;
+
+        if (flags & TFD_TIMER_ABSTIME)
+        {
+            struct timespec ts;
+            /* Absolute times are in the timer's clock, convert them to our clocksource's */
+            clock_gettime_kernel(ctx->clockid, &ts);
+            hrtime_t clock_now = timespec_to_hrtime(&ts);
+            deadline = value > clock_now ? now + (value - clock_now) : now;
+        }
+    }
+
+    scoped_mutex g{ctx->settime_lock};
+
+    /* Cancel it first, and without ctx->lock: timerfd_expire runs with the event list locked, and
+     * takes ctx->lock */
+    timer_cancel_event(&ctx->ev);
+
+    {
+        scoped_lock<spinlock, true> g2{ctx->lock};
+        timerfd_get_locked(ctx, &old);
+
+        ctx->ticks = 0;
+        ctx->interval = timespec_to_hrtime(&its.it_interval);
+        ctx->armed = value != 0;
+        ctx->ev.deadline = deadline;
+        ctx->ev.flags = CLOCKEVENT_FLAG_ATOMIC | (ctx->interval ? CLOCKEVENT_FLAG_PULSE : 0);
+    }
+
+    if (value)
+        timer_queue_clockevent(&ctx->ev);
+
+    if (uold && copy_to_user(uold, &old, sizeof(old)) < 0)
+        return -EFAULT;
+    return 0;
+}
+
+int sys_timerfd_gettime(int fd, struct itimerspec *ucurr)
+{
+    struct itimerspec its;
+
+    auto_file f = timerfd_get(fd);
+    if (!f)
+        return -errno;
+
+    struct timerfd_ctx *ctx = (struct timerfd_ctx *) f.get_file()->private_data;
+
+    {
+        scoped_lock<spinlock, true> g{ctx->lock};
+        timerfd_get_locked(ctx, &its);
+    }
+
+    if (copy_to_user(ucurr, &its, sizeof(its)) < 0)
+        return -EFAULT;
+    return 0;
+}
@@ -11,17 +11,24 @@
 #include <stdlib.h>
 #include <time.h>
 
+#include <onyx/clock.h>
+#include <onyx/cpu.h>
 #include <onyx/fnv.h>
 #include <onyx/futex.h>
+#include <onyx/init.h>
 #include <onyx/list.h>
+#include <onyx/mm/slab.h>
 #include <onyx/pagecache.h>
+#include <onyx/panic.h>
 #include <onyx/process.h>
+#include <onyx/scheduler.h>
 #include <onyx/user.h>
+#include <onyx/vm.h>
 #include <onyx/wait_queue.h>
 
-#include <onyx/hashtable.hpp>
 #include <onyx/memory.hpp>
 #include <onyx/pair.hpp>
+#include <onyx/utility.hpp>
 
 /* This union describes the key used to match futexes with each other.
  * For private mappings, we use the mm_address_space address of the process and
@@ -92,19 +99,41 @@ struct futex_key
     }
 };
 
+struct futex_pi_state;
+
 class futex_queue
 {
 public:
     futex_key key;
     bool awaken;
+    /* Only wakes whose bitset intersects with this one wake us up */
+    uint32_t bitset;
     wait_queue wq;
     list_head_cpp<futex_queue> list_node;
 
-    futex_queue(futex_key key) : key(key), awaken(false), wq{}, list_node{this}
+    /* futex_waitv: every entry wakes up the first entry's wq and sets its woken flag */
+    futex_queue *group;
+    unsigned int index;
+    bool woken;
+
+    /* PI waiters: the waiting thread and its tid, which goes in the futex word when it gets the
+     * lock. owner_died is set if the lock was handed over by an exiting owner. */
+    struct thread *thread;
+    pid_t tid;
+    futex_pi_state *pi_state;
+    bool owner_died;
+
+    futex_queue(futex_key key, uint32_t bitset = FUTEX_BITSET_MATCH_ANY)
+        : key(key), awaken(false), bitset{bitset}, wq{}, list_node{this}, group{nullptr},
+          index{0}, woken{false}, thread{nullptr}, tid{0}, pi_state{nullptr}, owner_died{false}
     {
         init_wait_queue_head(&wq);
     }
 
+    futex_queue() : futex_queue(futex_key{})
+    {
+    }
+
     ~futex_queue()
     {
     }
@@ -121,6 +150,17 @@ public:
         return wait_for_event_locked_interruptible(&wq, awaken, s);
     }
 
+    /* futex_waitv waits, with nothing locked. Only called on the first entry of the group. */
+    int wait_group(hrtime_t _timeout)
+    {
+        return wait_for_event_timeout_interruptible(&wq, READ_ONCE(woken), _timeout);
+    }
+
+    int wait_group()
+    {
+        return wait_for_event_interruptible(&wq, READ_ONCE(woken));
+    }
+
     void wake()
     {
         list_remove(&list_node);
@@ -128,7 +168,13 @@ public:
 
         COMPILER_BARRIER();
 
-        wait_queue_wake_all(&wq);
+        if (group)
+        {
+            WRITE_ONCE(group->woken, true);
+            wait_queue_wake_all(&group->wq);
+        }
+        else
+            wait_queue_wake_all(&wq);
     }
 
     futex_key &get_key()
@@ -144,78 +190,118 @@ public:
     void requeue(const futex_key &new_key, struct list_head *new_head);
 };
 
-inline uint32_t __futex_hash(futex_key &key)
+/* PI futexes with waiters in the kernel get one of these. The owner runs at (at least) the
+ * priority of its highest priority waiter.
+ */
+struct futex_pi_state
 {
-    return fnv_hash(&key.both, sizeof(key.both));
-}
+    futex_key key;
+    /* Owner (holds a reference) and its tid */
+    struct thread *owner;
+    pid_t owner_tid;
+    /* futex_queues, highest priority first */
+    struct list_head waiters;
+    /* On the bucket's pi_states */
+    struct list_head bucket_node;
+    /* On owner->futex_pi_owned */
+    struct list_head owner_node;
+};
 
-uint32_t futex_hash(futex_queue &queue)
+inline uint32_t __futex_hash(const futex_key &key)
 {
-    return __futex_hash(queue.get_key());
+    return fnv_hash(&key.both, sizeof(key.both));
 }
 
 /* We're holding a system-wide hashtable for futexes. Each bucket has a separate
  * lock to encourage concurrency. Futexes are hashed by the fnv of the futex key, whose values
- * depend on the type of mapping.
+ * depend on the type of mapping. The table gets sized at boot, 256 buckets per CPU.
  */
 
-static constexpr size_t futex_hashtable_buckets = 1024;
-static cul::hashtable2<futex_queue, futex_hashtable_buckets, uint32_t, futex_hash> futex_hashtable;
-static struct spinlock futex_hashtable_locks[futex_hashtable_buckets];
+struct futex_bucket
+{
+    struct spinlock lock;
+    /* Waiters (futex_queue) */
+    struct list_head waiters;
+    /* futex_pi_states of PI futexes that hash here */
+    struct list_head pi_states;
+};
+
+static futex_bucket *futex_hashtable;
+static unsigned long futex_hashtable_mask;
+
+/* Protects every futex_pi_state's owner and waiters, and every thread's futex_pi_owned. Taken
+ * after the bucket locks. */
+static struct spinlock futex_pi_lock;
 
-uint32_t get_hashtable(futex_key &key)
+static void futex_init()
 {
-    auto hash = __futex_hash(key);
-    auto index = futex_hashtable.get_hashtable_index(hash);
+    unsigned long nr_buckets = 256UL * get_nr_cpus();
+    nr_buckets = 1UL << (ilog2(nr_buckets - 1) + 1);
 
-    spin_lock(&futex_hashtable_locks[index]);
+    futex_hashtable = (futex_bucket *) kcalloc(nr_buckets, sizeof(futex_bucket), GFP_KERNEL);
+    if (!futex_hashtable)
+        panic("futex: failed to allocate %lu hash buckets", nr_buckets);
+
+    for (unsigned long i = 0; i < nr_buckets; i++)
+    {
+        spinlock_init(&futex_hashtable[i].lock);
+        INIT_LIST_HEAD(&futex_hashtable[i].waiters);
+        INIT_LIST_HEAD(&futex_hashtable[i].pi_states);
+    }
 
-    return index;
+    futex_hashtable_mask = nr_buckets - 1;
 }
 
-cul::pair<uint32_t, uint32_t> lock_two_hashes(futex_key &key1, futex_key &key2)
+INIT_LEVEL_CORE_AFTER_SCHED_ENTRY(futex_init);
+
+static futex_bucket *lock_bucket(const futex_key &key)
 {
-    const auto hash1 = __futex_hash(key1);
-    const auto hash2 = __futex_hash(key2);
+    futex_bucket *b = &futex_hashtable[__futex_hash(key) & futex_hashtable_mask];
+    spin_lock(&b->lock);
+    return b;
+}
 
-    auto index1 = futex_hashtable.get_hashtable_index(hash1);
-    auto index2 = futex_hashtable.get_hashtable_index(hash2);
+cul::pair<futex_bucket *, futex_bucket *> lock_two_buckets(const futex_key &key1,
+                                                           const futex_key &key2)
+{
+    futex_bucket *b1 = &futex_hashtable[__futex_hash(key1) & futex_hashtable_mask];
+    futex_bucket *b2 = &futex_hashtable[__futex_hash(key2) & futex_hashtable_mask];
 
-    if (index1 < index2)
+    if (b1 < b2)
     {
-        spin_lock(&futex_hashtable_locks[index1]);
-        spin_lock(&futex_hashtable_locks[index2]);
+        spin_lock(&b1->lock);
+        spin_lock(&b2->lock);
     }
-    else if (index1 > index2)
+    else if (b1 > b2)
     {
-        spin_lock(&futex_hashtable_locks[index2]);
-        spin_lock(&futex_hashtable_locks[index1]);
+        spin_lock(&b2->lock);
+        spin_lock(&b1->lock);
     }
     else
     {
         /* Only lock once if it's the same bucket */
-        spin_lock(&futex_hashtable_locks[index1]);
+        spin_lock(&b1->lock);
     }
 
-    return {index1, index2};
+    return {b1, b2};
 }
 
-void unlock_two_hashes(uint32_t index1, uint32_t index2)
+void unlock_two_buckets(futex_bucket *b1, futex_bucket *b2)
 {
-    if (index1 > index2)
+    if (b1 > b2)
     {
-        spin_unlock(&futex_hashtable_locks[index1]);
-        spin_unlock(&futex_hashtable_locks[index2]);
+        spin_unlock(&b1->lock);
+        spin_unlock(&b2->lock);
     }
-    else if (index1 < index2)
+    else if (b1 < b2)
     {
-        spin_unlock(&futex_hashtable_locks[index2]);
-        spin_unlock(&futex_hashtable_locks[index1]);
+        spin_unlock(&b2->lock);
+        spin_unlock(&b1->lock);
     }
     else
     {
         /* Only lock once if it's the same bucket */
-        spin_unlock(&futex_hashtable_locks[index1]);
+        spin_unlock(&b1->lock);
     }
 }
 
@@ -277,34 +363,91 @@ static int get_user32_nofault(unsigned int *uaddr, unsigned int *val)
     return err;
 }
 
-int wait(int *uaddr, int val, int flags, const struct timespec *utimespec)
+static int cmpxchg_user32_nofault(unsigned int *uaddr, unsigned int *expected, unsigned int newval)
+{
+    int err;
+    pagefault_disable();
+    err = cmpxchg_user32(uaddr, expected, newval);
+    pagefault_enable();
+    return err;
+}
+
+/**
+ * @brief Fault in a futex for writing
+ * Used when an atomic update of the futex faulted with the bucket locked.
+ *
+ * @param uaddr User address
+ * @return 0 on success, -EFAULT
+ */
+static int fault_in_writeable(unsigned int *uaddr)
+{
+    struct page *page;
+    int st = get_phys_pages(uaddr, GPP_WRITE, &page, 1);
+
+    if (!(st & GPP_ACCESS_OK))
+        return -EFAULT;
+
+    if (!(st & GPP_ACCESS_PFNMAP))
+        page_unpin(page);
+    return 0;
+}
+
+/* Timeouts that aren't absolute */
+static constexpr clockid_t relative_timeout = -1;
+
+/**
+ * @brief Get a futex timeout from user space
+ *
+ * @param utimespec User timespec, or nullptr for no timeout
+ * @param clock Clock the (absolute) timeout is measured against, or relative_timeout
+ * @param timeout Out: the relative timeout, in ns
+ * @return 1 if there's a timeout, 0 if there's none, negative error codes
+ */
+static int get_timeout(const struct timespec *utimespec, clockid_t clock, hrtime_t *timeout)
 {
-    bool has_timeout = false;
-    struct timespec ts
+    struct timespec ts;
+
+    if (!utimespec)
+        return 0;
+
+    if (copy_from_user(&ts, utimespec, sizeof(ts)) < 0)
+        return -EFAULT;
+
+    if (!timespec_valid(&ts, false))
+        return -EINVAL;
+
+    *timeout = timespec_to_hrtime(&ts);
+
+    if (clock != relative_timeout)
     {
-    };
+        struct timespec now;
+        clock_gettime_kernel(clock, &now);
+        hrtime_t now_ns = timespec_to_hrtime(&now);
+        /* Already expired deadlines wait for 0ns and time out */
+        *timeout = *timeout > now_ns ? *timeout - now_ns : 0;
+    }
+
+    return 1;
+}
+
+int wait(int *uaddr, int val, int flags, const struct timespec *utimespec, uint32_t bitset,
+         clockid_t clock)
+{
     unsigned int curr_val = 0;
     hrtime_t timeout = 0;
+    int has_timeout;
     int st = 0;
 
-    if (utimespec != nullptr)
-    {
-        has_timeout = true;
-        if (copy_from_user(&ts, utimespec, sizeof(ts)) < 0)
-            return -EFAULT;
-
-        if (!timespec_valid(&ts, false))
-            return -EINVAL;
-    }
-
-    timeout = timespec_to_hrtime(&ts);
+    if ((has_timeout = get_timeout(utimespec, clock, &timeout)) < 0)
+        return has_timeout;
 
     futex_key key{};
 
     if ((st = calculate_key(uaddr, flags, key)) < 0)
         return st;
 
-    futex_queue queue{key};
+    futex_queue queue{key, bitset};
+    futex_bucket *bucket;
 
     /* Fault it in, if possible. If we EFAULT here, we know it's a bad address */
 fault_in:
@@ -314,14 +457,12 @@ fault_in:
      * we're going to atomically calculate a hash index and lock that hash index,
      * then check for the value(and if doesn't match, return -EAGAIN), and finally, sleep.
      */
-    auto hash_index = get_hashtable(key);
-    auto list_head = futex_hashtable.get_hashtable(hash_index);
-    auto lock = &futex_hashtable_locks[hash_index];
+    bucket = lock_bucket(key);
 
     if (get_user32_nofault((unsigned int *) uaddr, &curr_val) < 0)
     {
         /* We faulted here? go back up and try to fault it in */
-        spin_unlock(lock);
+        spin_unlock(&bucket->lock);
         goto fault_in;
     }
 
@@ -331,60 +472,46 @@ fault_in:
         goto out;
     }
 
-    list_add_tail(&queue.list_node, list_head);
+    list_add_tail(&queue.list_node, &bucket->waiters);
 
     if (has_timeout)
-        st = queue.wait(timeout, lock);
+        st = queue.wait(timeout, &bucket->lock);
     else
-        st = queue.wait(lock);
+        st = queue.wait(&bucket->lock);
 
-    MUST_HOLD_LOCK(lock);
+    MUST_HOLD_LOCK(&bucket->lock);
 
     if (!queue.was_awaken())
-    {
-        futex_hashtable.remove_element(queue);
-    }
+        list_remove(&queue.list_node);
 
 out:
-    spin_unlock(&futex_hashtable_locks[hash_index]);
+    spin_unlock(&bucket->lock);
     return st;
 }
 
-int wake(int *uaddr, int flags, int to_wake)
+/**
+ * @brief Wake up waiters of a futex, with its bucket locked
+ *
+ * @param bucket Locked bucket
+ * @param key Futex key
+ * @param to_wake Maximum number of waiters to wake up
+ * @param bitset Only wake waiters whose bitset intersects with this one
+ * @return Number of waiters woken up
+ */
+static int wake_locked(futex_bucket *bucket, const futex_key &key, int to_wake, uint32_t bitset)
 {
-    if (to_wake < 0)
-        return -EINVAL;
-
-    int st = 0;
-    futex_key key{};
-
-    if ((st = calculate_key(uaddr, flags, key)) < 0)
-        return st;
-
-        // printk("Shared: %s\n", key.both.offset & FUTEX_OFFSET_SHARED ? "yes" : "no");
-
-#if 0
-	auto hash = __futex_hash(key);
-	auto index = futex_hashtable.get_hashtable_index(hash);
-
-	printk("uaddr %p index %lu\n", uaddr, index);
-#endif
-
-    auto hash_index = get_hashtable(key);
-    auto list_head = futex_hashtable.get_hashtable(hash_index);
-
     int awaken = 0;
 
-    list_for_every_safe (list_head)
+    MUST_HOLD_LOCK(&bucket->lock);
+
+    list_for_every_safe (&bucket->waiters)
     {
         if (to_wake == 0)
             break;
 
         futex_queue *f = list_head_cpp<futex_queue>::self_from_list_head(l);
 
-        MUST_HOLD_LOCK(&futex_hashtable_locks[hash_index]);
-
-        if (f->get_key() == key)
+        if (f->get_key() == key && (f->bitset & bitset))
         {
             f->wake();
             to_wake--;
@@ -392,7 +519,23 @@ int wake(int *uaddr, int flags, int to_wake)
         }
     }
 
-    spin_unlock(&futex_hashtable_locks[hash_index]);
+    return awaken;
+}
+
+int wake(int *uaddr, int flags, int to_wake, uint32_t bitset = FUTEX_BITSET_MATCH_ANY)
+{
+    if (to_wake < 0)
+        return -EINVAL;
+
+    int st = 0;
+    futex_key key{};
+
+    if ((st = calculate_key(uaddr, flags, key)) < 0)
+        return st;
+
+    auto bucket = lock_bucket(key);
+    int awaken = wake_locked(bucket, key, to_wake, bitset);
+    spin_unlock(&bucket->lock);
 
     return awaken;
 }
@@ -407,8 +550,6 @@ void futex_queue::requeue(const futex_key &new_key, struct list_head *new_head)
 int cmp_requeue(int *uaddr, int flags, int to_wake, int to_requeue, int *uaddr2, int val3,
                 bool val3_valid = true)
 {
-    // printk("requeue %p, %d, %d, %p\n", uaddr, to_wake, to_requeue, uaddr2);
-
     if (to_wake < 0 || to_requeue < 0)
         return -EINVAL;
 
@@ -422,12 +563,10 @@ int cmp_requeue(int *uaddr, int flags, int to_wake, int to_requeue, int *uaddr2,
     if ((st = calculate_key(uaddr2, flags, key2)) < 0)
         return st;
 
-    // printk("Shared: %s\n", key.offset & FUTEX_OFFSET_SHARED ? "yes" : "no");
-
-    auto [hash_index1, hash_index2] = lock_two_hashes(key1, key2);
+    auto [bucket1, bucket2] = lock_two_buckets(key1, key2);
 
-    auto wake_list = futex_hashtable.get_hashtable(hash_index1);
-    auto requeue_list = futex_hashtable.get_hashtable(hash_index2);
+    auto wake_list = &bucket1->waiters;
+    auto requeue_list = &bucket2->waiters;
 
     int awaken = 0, requeued = 0;
 
@@ -455,6 +594,7 @@ int cmp_requeue(int *uaddr, int flags, int to_wake, int to_requeue, int *uaddr2,
 
         futex_queue *f = list_head_cpp<futex_queue>::self_from_list_head(l);
 
+        /* futex_waitv entries stay put, their group needs to find them where they were queued */
         if (f->get_key() == key1)
         {
             if (to_wake > 0)
@@ -463,7 +603,7 @@ int cmp_requeue(int *uaddr, int flags, int to_wake, int to_requeue, int *uaddr2,
                 to_wake--;
                 awaken++;
             }
-            else
+            else if (!f->group)
             {
                 f->requeue(key2, requeue_list);
                 to_requeue--;
@@ -484,7 +624,7 @@ int cmp_requeue(int *uaddr, int flags, int to_wake, int to_requeue, int *uaddr2,
         st = awaken;
 
 out:
-    unlock_two_hashes(hash_index1, hash_index2);
+    unlock_two_buckets(bucket1, bucket2);
     return st;
 }
 
@@ -493,6 +633,667 @@ int requeue(int *uaddr, int flags, int to_wake, int to_requeue, int *uaddr2)
     return cmp_requeue(uaddr, flags, to_wake, to_requeue, uaddr2, 0, false);
 }
 
+/**
+ * @brief Do the FUTEX_WAKE_OP operation on a futex
+ * Must be called with page faults disabled.
+ *
+ * @param uaddr User address
+ * @param encoded_op The encoded operation (see FUTEX_OP)
+ * @param oldval Out: the value before the operation
+ * @return 0 on success, -EFAULT
+ */
+static int do_atomic_op(unsigned int *uaddr, unsigned int encoded_op, unsigned int *oldval)
+{
+    unsigned int op = (encoded_op >> 28) & 7;
+    int oparg = (int) (encoded_op << 8) >> 20;
+    unsigned int curr, newval, expected;
+
+    if (encoded_op & (FUTEX_OP_OPARG_SHIFT << 28))
+        oparg = 1U << (oparg & 31);
+
+    if (get_user32(uaddr, &curr) < 0)
+        return -EFAULT;
+
+    for (;;)
+    {
+        switch (op)
+        {
+            case FUTEX_OP_SET:
+                newval = oparg;
+                break;
+            case FUTEX_OP_ADD:
+                newval = curr + oparg;
+                break;
+            case FUTEX_OP_OR:
+                newval = curr | oparg;
+                break;
+            case FUTEX_OP_ANDN:
+                newval = curr & ~oparg;
+                break;
+            default:
+                newval = curr ^ oparg;
+                break;
+        }
+
+        expected = curr;
+        if (cmpxchg_user32(uaddr, &expected, newval) < 0)
+            return -EFAULT;
+        if (expected == curr)
+            break;
+        curr = expected;
+    }
+
+    *oldval = curr;
+    return 0;
+}
+
+static bool atomic_op_cmp(unsigned int encoded_op, int oldval)
+{
+    int cmparg = (int) (encoded_op << 20) >> 20;
+
+    switch ((encoded_op >> 24) & 15)
+    {
+        case FUTEX_OP_CMP_EQ:
+            return oldval == cmparg;
+        case FUTEX_OP_CMP_NE:
+            return oldval != cmparg;
+        case FUTEX_OP_CMP_LT:
+            return oldval < cmparg;
+        case FUTEX_OP_CMP_LE:
+            return oldval <= cmparg;
+        case FUTEX_OP_CMP_GT:
+            return oldval > cmparg;
+        default:
+            return oldval >= cmparg;
+    }
+}
+
+int wake_op(int *uaddr, int flags, int to_wake, int to_wake2, int *uaddr2, unsigned int encoded_op)
+{
+    unsigned int oldval;
+    int st, awaken;
+    futex_key key1{};
+    futex_key key2{};
+
+    if (to_wake < 0 || to_wake2 < 0)
+        return -EINVAL;
+
+    if ((unsigned long) uaddr2 & (4 - 1))
+        return -EINVAL;
+
+    if (((encoded_op >> 28) & 7) > FUTEX_OP_XOR || ((encoded_op >> 24) & 15) > FUTEX_OP_CMP_GE)
+        return -ENOSYS;
+
+    if ((st = calculate_key(uaddr, flags, key1)) < 0)
+        return st;
+
+    if ((st = calculate_key(uaddr2, flags, key2)) < 0)
+        return st;
+
+retry:
+    auto [bucket1, bucket2] = lock_two_buckets(key1, key2);
+
+    pagefault_disable();
+    st = do_atomic_op((unsigned int *) uaddr2, encoded_op, &oldval);
+    pagefault_enable();
+
+    if (st < 0)
+    {
+        unlock_two_buckets(bucket1, bucket2);
+        if ((st = fault_in_writeable((unsigned int *) uaddr2)) < 0)
+            return st;
+        goto retry;
+    }
+
+    awaken = wake_locked(bucket1, key1, to_wake, FUTEX_BITSET_MATCH_ANY);
+
+    if (atomic_op_cmp(encoded_op, (int) oldval))
+        awaken += wake_locked(bucket2, key2, to_wake2, FUTEX_BITSET_MATCH_ANY);
+
+    unlock_two_buckets(bucket1, bucket2);
+    return awaken;
+}
+
+static futex_pi_state *lookup_pi_state(futex_bucket *bucket, const futex_key &key)
+{
+    futex_pi_state *state;
+
+    MUST_HOLD_LOCK(&bucket->lock);
+
+    list_for_each_entry (state, &bucket->pi_states, bucket_node)
+    {
+        if (state->key == key)
+            return state;
+    }
+
+    return nullptr;
+}
+
+/**
+ * @brief Recalculate a PI futex owner's priority
+ * The owner inherits the priority of the highest priority waiter of all the futexes it owns.
+ * Waiters' priorities are sampled when they start waiting, so boosts propagate one level deep.
+ *
+ * @param owner Owner thread
+ */
+static void pi_update_prio(struct thread *owner)
+{
+    futex_pi_state *state;
+    int prio = -1;
+
+    MUST_HOLD_LOCK(&futex_pi_lock);
+
+    list_for_each_entry (state, &owner->futex_pi_owned, owner_node)
+    {
+        if (list_is_empty(&state->waiters))
+            continue;
+
+        futex_queue *top =
+            list_head_cpp<futex_queue>::self_from_list_head(list_first_element(&state->waiters));
+        prio = cul::max(prio, top->thread->priority);
+    }
+
+    sched_set_inherited_prio(owner, prio);
+}
+
+static void pi_queue_waiter(futex_pi_state *state, futex_queue *queue)
+{
+    MUST_HOLD_LOCK(&futex_pi_lock);
+
+    list_for_every (&state->waiters)
+    {
+        futex_queue *f = list_head_cpp<futex_queue>::self_from_list_head(l);
+        if (f->thread->priority < queue->thread->priority)
+        {
+            /* Goes right before the first lower priority waiter */
+            list_add_tail(&queue->list_node, l);
+            return;
+        }
+    }
+
+    list_add_tail(&queue->list_node, &state->waiters);
+}
+
+/**
+ * @brief Give a PI futex's state to its top waiter, and wake it up
+ * The futex word is the caller's business. If there's no one else waiting, the state is freed.
+ *
+ * @param bucket Locked bucket
+ * @param state PI state
+ */
+static void pi_transfer_to_waiter(futex_bucket *bucket, futex_pi_state *state)
+{
+    MUST_HOLD_LOCK(&bucket->lock);
+    MUST_HOLD_LOCK(&futex_pi_lock);
+
+    futex_queue *next =
+        list_head_cpp<futex_queue>::self_from_list_head(list_first_element(&state->waiters));
+    struct thread *old_owner = state->owner;
+
+    list_remove(&state->owner_node);
+    thread_get(next->thread);
+    state->owner = next->thread;
+    state->owner_tid = next->tid;
+    list_add_tail(&state->owner_node, &state->owner->futex_pi_owned);
+
+    next->wake();
+
+    pi_update_prio(old_owner);
+    thread_put(old_owner);
+
+    if (list_is_empty(&state->waiters))
+    {
+        /* The futex word keeps FUTEX_WAITERS, so the new owner's unlock will come through the
+         * kernel and find no state. */
+        list_remove(&state->owner_node);
+        list_remove(&state->bucket_node);
+        pi_update_prio(state->owner);
+        thread_put(state->owner);
+        delete state;
+    }
+    else
+        pi_update_prio(state->owner);
+}
+
+/**
+ * @brief Stop waiting on a PI futex
+ *
+ * @param queue Our queue entry
+ */
+static void pi_dequeue_waiter(futex_bucket *bucket, futex_queue *queue)
+{
+    futex_pi_state *state = queue->pi_state;
+
+    MUST_HOLD_LOCK(&bucket->lock);
+    spin_lock(&futex_pi_lock);
+
+    list_remove(&queue->list_node);
+    pi_update_prio(state->owner);
+
+    if (list_is_empty(&state->waiters))
+    {
+        list_remove(&state->owner_node);
+        list_remove(&state->bucket_node);
+        pi_update_prio(state->owner);
+        thread_put(state->owner);
+        delete state;
+    }
+
+    spin_unlock(&futex_pi_lock);
+}
+
+/**
+ * @brief Find the owner of a PI futex from its tid
+ *
+ * @param tid Owner tid
+ * @param proc Out: owner process (holds a reference)
+ * @param thread Out: owner thread (holds a reference)
+ * @return 0 on success, -ESRCH if there's no such owner
+ */
+static int pi_get_owner(pid_t tid, struct process **proc, struct thread **thread)
+{
+    struct process *p = get_process_from_pid(tid);
+    if (!p)
+        return -ESRCH;
+
+    if (!p->thr)
+    {
+        process_put(p);
+        return -ESRCH;
+    }
+
+    thread_get(p->thr);
+    *proc = p;
+    *thread = p->thr;
+    return 0;
+}
+
+int lock_pi(int *uaddr, int flags, const struct timespec *utimespec, bool trylock)
+{
+    unsigned int *ptr = (unsigned int *) uaddr;
+    pid_t tid = get_current_process()->pid_;
+    futex_pi_state *new_state = nullptr, *state;
+    struct process *owner_proc = nullptr;
+    struct thread *owner = nullptr;
+    pid_t owner_tid = 0;
+    hrtime_t timeout = 0;
+    int has_timeout = 0;
+    unsigned int val, expected;
+    futex_bucket *bucket;
+    futex_key key{};
+    int st;
+
+    /* LOCK_PI timeouts are absolute, and always against CLOCK_REALTIME */
+    if (!trylock && (has_timeout = get_timeout(utimespec, CLOCK_REALTIME, &timeout)) < 0)
+        return has_timeout;
+
+    if ((st = calculate_key(uaddr, flags, key)) < 0)
+        return st;
+
+    futex_queue queue{key};
+    queue.thread = get_current_thread();
+    queue.tid = tid;
+
+retry:
+    if (get_user32(ptr, &val) < 0)
+    {
+        st = -EFAULT;
+        goto out;
+    }
+
+    bucket = lock_bucket(key);
+
+    if (get_user32_nofault(ptr, &val) < 0)
+    {
+        spin_unlock(&bucket->lock);
+        goto retry;
+    }
+
+    for (;;)
+    {
+        if ((val & FUTEX_TID_MASK) == (unsigned int) tid)
+        {
+            st = -EDEADLK;
+            goto out_unlock;
+        }
+
+        if (!(val & FUTEX_TID_MASK))
+        {
+            /* Unowned (maybe with FUTEX_OWNER_DIED, which we keep for user space to see), take it.
+             * There can't be a PI state without an owner. */
+            expected = val;
+            if (cmpxchg_user32_nofault(ptr, &expected, tid | (val & FUTEX_OWNER_DIED)) < 0)
+                goto fault;
+            if (expected != val)
+            {
+                val = expected;
+                continue;
+            }
+
+            st = 0;
+            goto out_unlock;
+        }
+
+        if (trylock)
+        {
+            st = -EAGAIN;
+            goto out_unlock;
+        }
+
+        if (val & FUTEX_WAITERS)
+            break;
+
+        /* Make the owner come to us when unlocking */
+        expected = val;
+        if (cmpxchg_user32_nofault(ptr, &expected, val | FUTEX_WAITERS) < 0)
+            goto fault;
+        if (expected == val)
+        {
+            val |= FUTEX_WAITERS;
+            break;
+        }
+
+        val = expected;
+    }
+
+    spin_lock(&futex_pi_lock);
+
+    state = lookup_pi_state(bucket, key);
+    if (state && state->owner_tid != (pid_t) (val & FUTEX_TID_MASK))
+    {
+        /* User space scribbled over the futex word */
+        spin_unlock(&futex_pi_lock);
+        st = -EINVAL;
+        goto out_unlock;
+    }
+
+    if (!state)
+    {
+        /* First waiter, we need to look up the owner and set up the PI state. That can't be done
+         * with locks held, so go do it and try again. */
+        if (!new_state || !owner || owner_tid != (pid_t) (val & FUTEX_TID_MASK))
+        {
+            spin_unlock(&futex_pi_lock);
+            spin_unlock(&bucket->lock);
+
+            if (!new_state && !(new_state = new futex_pi_state))
+            {
+                st = -ENOMEM;
+                goto out;
+            }
+
+            if (owner)
+            {
+                thread_put(owner);
+                process_put(owner_proc);
+                owner = nullptr;
+                owner_proc = nullptr;
+            }
+
+            owner_tid = val & FUTEX_TID_MASK;
+            if ((st = pi_get_owner(owner_tid, &owner_proc, &owner)) < 0)
+                goto out;
+            goto retry;
+        }
+
+        /* If the owner is past futex_exit_pi(), no one would ever give us the lock */
+        if (READ_ONCE(owner_proc->flags) & PROCESS_EXITING)
+        {
+            spin_unlock(&futex_pi_lock);
+            st = -ESRCH;
+            goto out_unlock;
+        }
+
+        state = new_state;
+        new_state = nullptr;
+        state->key = key;
+        state->owner = owner;
+        state->owner_tid = owner_tid;
+        /* The state keeps the thread reference. The process one gets dropped on the way out,
+         * with no locks held. */
+        owner = nullptr;
+        INIT_LIST_HEAD(&state->waiters);
+        list_add_tail(&state->bucket_node, &bucket->pi_states);
+        list_add_tail(&state->owner_node, &state->owner->futex_pi_owned);
+    }
+
+    queue.pi_state = state;
+    pi_queue_waiter(state, &queue);
+    pi_update_prio(state->owner);
+
+    spin_unlock(&futex_pi_lock);
+
+    if (has_timeout)
+        st = queue.wait(timeout, &bucket->lock);
+    else
+        st = queue.wait(&bucket->lock);
+
+    MUST_HOLD_LOCK(&bucket->lock);
+
+    if (!queue.was_awaken())
+    {
+        pi_dequeue_waiter(bucket, &queue);
+        goto out_unlock;
+    }
+
+    /* We own it now */
+    st = 0;
+
+    if (queue.owner_died)
+    {
+        /* The last owner exited and couldn't touch our futex word, so fix it up ourselves */
+        for (;;)
+        {
+            if (get_user32_nofault(ptr, &val) < 0)
+                goto fixup_fault;
+
+            expected = val;
+            if (cmpxchg_user32_nofault(ptr, &expected, tid | FUTEX_WAITERS | FUTEX_OWNER_DIED) < 0)
+                goto fixup_fault;
+            if (expected == val)
+                break;
+            continue;
+        fixup_fault:
+            spin_unlock(&bucket->lock);
+            if (fault_in_writeable(ptr) < 0)
+            {
+                st = -EFAULT;
+                goto out;
+            }
+            spin_lock(&bucket->lock);
+        }
+    }
+
+out_unlock:
+    spin_unlock(&bucket->lock);
+out:
+    if (owner)
+        thread_put(owner);
+    if (owner_proc)
+        process_put(owner_proc);
+
+    delete new_state;
+    return st;
+fault:
+    spin_unlock(&bucket->lock);
+    if ((st = fault_in_writeable(ptr)) < 0)
+        goto out;
+    goto retry;
+}
+
+int unlock_pi(int *uaddr, int flags)
+{
+    unsigned int *ptr = (unsigned int *) uaddr;
+    pid_t tid = get_current_process()->pid_;
+    unsigned int val, expected, newval;
+    futex_pi_state *state;
+    futex_bucket *bucket;
+    futex_key key{};
+    int st;
+
+    if ((st = calculate_key(uaddr, flags, key)) < 0)
+        return st;
+
+retry:
+    if (get_user32(ptr, &val) < 0)
+        return -EFAULT;
+
+    if ((val & FUTEX_TID_MASK) != (unsigned int) tid)
+        return -EPERM;
+
+    bucket = lock_bucket(key);
+
+    if (get_user32_nofault(ptr, &val) < 0)
+    {
+        spin_unlock(&bucket->lock);
+        goto retry;
+    }
+
+    if ((val & FUTEX_TID_MASK) != (unsigned int) tid)
+    {
+        st = -EPERM;
+        goto out;
+    }
+
+    spin_lock(&futex_pi_lock);
+
+    state = lookup_pi_state(bucket, key);
+
+    /* Hand it to the top waiter, or just release it if no one's waiting in the kernel */
+    newval = 0;
+    if (state)
+    {
+        newval = list_head_cpp<futex_queue>::self_from_list_head(list_first_element(&state->waiters))
+                     ->tid |
+                 FUTEX_WAITERS;
+    }
+
+    expected = val;
+    if (cmpxchg_user32_nofault(ptr, &expected, newval) < 0)
+    {
+        spin_unlock(&futex_pi_lock);
+        spin_unlock(&bucket->lock);
+        if (fault_in_writeable(ptr) < 0)
+            return -EFAULT;
+        goto retry;
+    }
+
+    if (expected != val)
+    {
+        /* Someone set FUTEX_WAITERS under us */
+        spin_unlock(&futex_pi_lock);
+        spin_unlock(&bucket->lock);
+        goto retry;
+    }
+
+    if (state)
+        pi_transfer_to_waiter(bucket, state);
+
+    spin_unlock(&futex_pi_lock);
+    st = 0;
+out:
+    spin_unlock(&bucket->lock);
+    return st;
+}
+
+/**
+ * @brief Dequeue futex_waitv entries
+ *
+ * @param queues Entries
+ * @param nr Number of entries to dequeue
+ * @return Lowest index that got woken up, or -1 if none did
+ */
+static int unqueue_multiple(futex_queue *queues, unsigned int nr)
+{
+    int woken = -1;
+
+    for (unsigned int i = 0; i < nr; i++)
+    {
+        auto bucket = lock_bucket(queues[i].key);
+
+        if (!queues[i].was_awaken())
+            list_remove(&queues[i].list_node);
+        else if (woken < 0)
+            woken = i;
+
+        spin_unlock(&bucket->lock);
+    }
+
+    return woken;
+}
+
+int waitv(const struct futex_waitv *waiters, unsigned int nr, const struct timespec *utimespec,
+          clockid_t clock)
+{
+    hrtime_t timeout = 0;
+    int has_timeout;
+    int st = 0, woken;
+
+    if ((has_timeout = get_timeout(utimespec, clock, &timeout)) < 0)
+        return has_timeout;
+
+    futex_queue *queues = new futex_queue[nr];
+    if (!queues)
+        return -ENOMEM;
+
+    for (unsigned int i = 0; i < nr; i++)
+    {
+        if ((st = calculate_key((int *) waiters[i].uaddr, waiters[i].flags, queues[i].key)) < 0)
+            goto out;
+        queues[i].group = &queues[0];
+        queues[i].index = i;
+    }
+
+    /* Queue them one by one. If any value doesn't match, undo it all. */
+    for (unsigned int i = 0; i < nr; i++)
+    {
+        unsigned int *uaddr = (unsigned int *) waiters[i].uaddr;
+        unsigned int curr_val;
+        futex_bucket *bucket;
+
+    fault_in:
+        if (get_user32(uaddr, &curr_val) < 0)
+        {
+            unqueue_multiple(queues, i);
+            st = -EFAULT;
+            goto out;
+        }
+
+        bucket = lock_bucket(queues[i].key);
+
+        if (get_user32_nofault(uaddr, &curr_val) < 0)
+        {
+            spin_unlock(&bucket->lock);
+            goto fault_in;
+        }
+
+        if (curr_val != (unsigned int) waiters[i].val)
+        {
+            spin_unlock(&bucket->lock);
+            /* Someone might've woken us up already, which wins over -EAGAIN */
+            st = unqueue_multiple(queues, i);
+            if (st < 0)
+                st = -EAGAIN;
+            goto out;
+        }
+
+        list_add_tail(&queues[i].list_node, &bucket->waiters);
+        spin_unlock(&bucket->lock);
+    }
+
+    if (has_timeout)
+        st = queues[0].wait_group(timeout);
+    else
+        st = queues[0].wait_group();
+
+    woken = unqueue_multiple(queues, nr);
+    if (woken >= 0)
+        st = woken;
+out:
+    delete[] queues;
+    return st;
+}
+
 }; // namespace futex
 
 int futex_wake(int *uaddr, int nr_waiters)
@@ -503,8 +1304,48 @@ int futex_wake(int *uaddr, int nr_waiters)
     return futex::wake(uaddr, 0, nr_waiters);
 }
 
-/* TODO: Add FUTEX_CLOCK_REALTIME support */
-#define FUTEX_KNOWN_FLAGS (FUTEX_PRIVATE_FLAG)
+/**
+ * @brief Give away the PI futexes the current thread owns, as it exits
+ * The top waiter of each gets it, with FUTEX_OWNER_DIED set.
+ */
+void futex_exit_pi(void)
+{
+    struct thread *curr = get_current_thread();
+
+    for (;;)
+    {
+        spin_lock(&futex::futex_pi_lock);
+
+        if (list_is_empty(&curr->futex_pi_owned))
+        {
+            spin_unlock(&futex::futex_pi_lock);
+            break;
+        }
+
+        futex::futex_key key = container_of(list_first_element(&curr->futex_pi_owned),
+                                            futex::futex_pi_state, owner_node)
+                                   ->key;
+        spin_unlock(&futex::futex_pi_lock);
+
+        /* Locks go bucket first, so look it up again */
+        auto bucket = futex::lock_bucket(key);
+        spin_lock(&futex::futex_pi_lock);
+
+        auto state = futex::lookup_pi_state(bucket, key);
+        if (state && state->owner == curr)
+        {
+            auto next = list_head_cpp<futex::futex_queue>::self_from_list_head(
+                list_first_element(&state->waiters));
+            next->owner_died = true;
+            futex::pi_transfer_to_waiter(bucket, state);
+        }
+
+        spin_unlock(&futex::futex_pi_lock);
+        spin_unlock(&bucket->lock);
+    }
+}
+
+#define FUTEX_KNOWN_FLAGS (FUTEX_PRIVATE_FLAG | FUTEX_CLOCK_REALTIME)
 
 static inline int get_val2(const struct timespec *t)
 {
@@ -515,27 +1356,85 @@ int sys_futex(int *uaddr, int futex_op, int val, const struct timespec *timeout,
               int val3)
 {
     int flags = (futex_op & ~FUTEX_OP_MASK);
+    int op = futex_op & FUTEX_OP_MASK;
 
     /* Error out on bad flags */
     if (flags & ~FUTEX_KNOWN_FLAGS)
         return -EINVAL;
 
+    /* Only WAIT_BITSET takes absolute timeouts against a choice of clock. FUTEX_WAIT's timeout is
+     * relative, so the clock doesn't matter there, but accept the flag like Linux does. */
+    if (flags & FUTEX_CLOCK_REALTIME && op != FUTEX_WAIT_BITSET && op != FUTEX_WAIT)
+        return -ENOSYS;
+
     /* Bad pointer */
     if ((unsigned long) uaddr & (4 - 1))
         return -EINVAL;
 
-    switch (futex_op & FUTEX_OP_MASK)
+    switch (op)
     {
         case FUTEX_WAIT:
-            return futex::wait(uaddr, val, flags, timeout);
+            return futex::wait(uaddr, val, flags, timeout, FUTEX_BITSET_MATCH_ANY,
+                               futex::relative_timeout);
+        case FUTEX_WAIT_BITSET:
+            if (!val3)
+                return -EINVAL;
+            return futex::wait(uaddr, val, flags, timeout, val3,
+                               flags & FUTEX_CLOCK_REALTIME ? CLOCK_REALTIME : CLOCK_MONOTONIC);
         case FUTEX_WAKE:
             return futex::wake(uaddr, flags, val);
+        case FUTEX_WAKE_BITSET:
+            if (!val3)
+                return -EINVAL;
+            return futex::wake(uaddr, flags, val, val3);
+        case FUTEX_WAKE_OP:
+            return futex::wake_op(uaddr, flags, val, get_val2(timeout), uaddr2, val3);
         case FUTEX_CMP_REQUEUE:
             return futex::cmp_requeue(uaddr, flags, val, get_val2(timeout), uaddr2, val3);
         case FUTEX_REQUEUE:
-            // printk("futex(%p, %d, %d)(op %d)\n", uaddr, futex_op, val, futex_op & FUTEX_OP_MASK);
             return futex::requeue(uaddr, flags, val, get_val2(timeout), uaddr2);
+        case FUTEX_LOCK_PI:
+            return futex::lock_pi(uaddr, flags, timeout, false);
+        case FUTEX_TRYLOCK_PI:
+            return futex::lock_pi(uaddr, flags, nullptr, true);
+        case FUTEX_UNLOCK_PI:
+            return futex::unlock_pi(uaddr, flags);
         default:
             return -ENOSYS;
     }
 }
+
+int sys_futex_waitv(const struct futex_waitv *uwaiters, unsigned int nr_futexes,
+                    unsigned int flags, const struct timespec *timeout, clockid_t clockid)
+{
+    int st;
+
+    if (flags || !uwaiters || !nr_futexes || nr_futexes > FUTEX_WAITV_MAX)
+        return -EINVAL;
+
+    if (timeout && clockid != CLOCK_MONOTONIC && clockid != CLOCK_REALTIME)
+        return -EINVAL;
+
+    struct futex_waitv *waiters = new struct futex_waitv[nr_futexes];
+    if (!waiters)
+        return -ENOMEM;
+
+    st = -EFAULT;
+    if (copy_from_user(waiters, uwaiters, nr_futexes * sizeof(struct futex_waitv)) < 0)
+        goto out;
+
+    st = -EINVAL;
+    for (unsigned int i = 0; i < nr_futexes; i++)
+    {
+        const auto &w = waiters[i];
+        if (w.__reserved || !(w.flags & FUTEX_32) || w.flags & ~(FUTEX_32 | FUTEX_PRIVATE_FLAG))
+            goto out;
+        if (w.uaddr & (4 - 1))
+            goto out;
+    }
+
+    st = futex::waitv(waiters, nr_futexes, timeout, timeout ? clockid : CLOCK_MONOTONIC);
+out:
+    delete[] waiters;
+    return st;
+}
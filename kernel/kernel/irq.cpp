@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2016 - 2023 Pedro Falcato
+ * Copyright (c) 2016 - 2024 Pedro Falcato
  * This file is part of Onyx, and is released under the terms of the GPLv2 License
  * check LICENSE at the root directory for more information
  *
@@ -11,18 +11,33 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#include <onyx/cpu.h>
 #include <onyx/dev.h>
 #include <onyx/dpc.h>
 #include <onyx/gen/trace_irq.h>
 #include <onyx/init.h>
+#include <onyx/iovec_iter.h>
 #include <onyx/irq.h>
+#include <onyx/mm/slab.h>
+#include <onyx/mutex.h>
 #include <onyx/percpu.h>
 #include <onyx/perf_probe.h>
 #include <onyx/platform.h>
+#include <onyx/proc.h>
+#include <onyx/seq_file.h>
 
 struct irq_line irq_lines[NR_IRQ] = {};
 unsigned long rogue_irqs = 0;
 
+struct irq_cpustat
+{
+    unsigned long count[NR_IRQ];
+};
+
+static PER_CPU_VAR(struct irq_cpustat irq_cpustat);
+
+static void irq_proc_add(unsigned int irq);
+
 static struct interrupt_handler *add_to_list(struct irq_line *line)
 {
     auto handler = new interrupt_handler;
@@ -70,6 +85,7 @@ int install_irq(unsigned int irq, irq_t handler, struct device *device, unsigned
     h->cookie = cookie;
 
     platform_install_irq(irq, h);
+    irq_proc_add(irq);
 
     printf("Installed handler (driver %s) for IRQ%u\n", device->driver_->name, irq);
 
@@ -125,6 +141,8 @@ void dispatch_irq(unsigned int irq, struct irq_context *context)
     struct irq_line *line = &irq_lines[irq];
 
     write_per_cpu(in_irq, true);
+    /* irqs are off, no need for atomics */
+    get_per_cpu_ptr(irq_cpustat)->count[irq]++;
 
     // if (perf_probe_is_enabled() && in_kernel_space_regs(context->registers))
     //    perf_probe_do(context->registers);
@@ -156,3 +174,320 @@ void irq_init()
 }
 
 INIT_LEVEL_CORE_AFTER_SCHED_ENTRY(irq_init);
+
+/**
+ * @brief Set up an interrupt line's affinity
+ * Called by whoever routed the line (e.g MSI-X setup) to record where it is routed to, and how it
+ * can be moved.
+ *
+ * @param irq IRQ number
+ * @param mask CPUs the line is meant to be delivered to
+ * @param cpu CPU it is currently routed to
+ * @param flags IRQ_AFFINITY_* flags
+ * @param set_affinity Callback that retargets the line, or NULL if it can't be moved
+ * @param data Data for set_affinity
+ */
+void irq_init_affinity(unsigned int irq, const struct cpumask *mask, unsigned int cpu,
+                       unsigned int flags, irq_set_affinity_t set_affinity, void *data)
+{
+    assert(irq < NR_IRQ);
+    struct irq_line *line = &irq_lines[irq];
+
+    scoped_lock<spinlock, true> g{line->list_lock};
+    line->affinity = *mask;
+    line->effective_cpu = cpu;
+    line->affinity_flags = flags;
+    line->set_affinity = set_affinity;
+    line->affinity_data = data;
+}
+
+/**
+ * @brief Move an interrupt line
+ * The line is routed to the first online cpu in mask.
+ *
+ * @param irq IRQ number
+ * @param mask New affinity
+ * @return 0 on success, -EIO if the line is managed or can't be moved, -EINVAL if mask has no
+ * online cpus
+ */
+int irq_set_affinity(unsigned int irq, const struct cpumask *mask)
+{
+    if (irq >= NR_IRQ)
+        return -EINVAL;
+
+    struct irq_line *line = &irq_lines[irq];
+    unsigned int nr_cpus = get_nr_cpus();
+    unsigned int target = -1U;
+
+    for (unsigned int cpu = 0; cpu < nr_cpus; cpu++)
+    {
+        if (mask->is_cpu_set(cpu))
+        {
+            target = cpu;
+            break;
+        }
+    }
+
+    if (target == -1U)
+        return -EINVAL;
+
+    scoped_lock<spinlock, true> g{line->list_lock};
+    if (!line->set_affinity || line->affinity_flags & IRQ_AFFINITY_MANAGED)
+        return -EIO;
+
+    if (int st = line->set_affinity(irq, target, line->affinity_data); st < 0)
+        return st;
+
+    line->affinity = *mask;
+    line->effective_cpu = target;
+    return 0;
+}
+
+/**
+ * @brief Get an interrupt line's affinity
+ *
+ * @param irq IRQ number
+ * @return The affinity mask, or NULL if it was never set up
+ */
+const struct cpumask *irq_get_affinity(unsigned int irq)
+{
+    if (irq >= NR_IRQ || irq_lines[irq].affinity.is_empty())
+        return nullptr;
+    return &irq_lines[irq].affinity;
+}
+
+/* Masks are printed like Linux does, as comma separated groups of 32 cpus, highest first */
+static void irq_print_mask(struct seq_file *m, const struct cpumask *mask)
+{
+    unsigned int nr_cpus = get_nr_cpus();
+    unsigned int groups = (nr_cpus + 31) / 32;
+
+    for (unsigned int i = groups; i > 0; i--)
+    {
+        u32 word = 0;
+        for (unsigned int bit = 0; bit < 32; bit++)
+        {
+            unsigned int cpu = (i - 1) * 32 + bit;
+            if (cpu < nr_cpus && mask->is_cpu_set(cpu))
+                word |= 1U << bit;
+        }
+
+        seq_printf(m, "%s%08x", i != groups ? "," : "", word);
+    }
+
+    seq_printf(m, "\n");
+}
+
+static int irq_parse_mask(const char *buf, size_t len, struct cpumask *mask)
+{
+    unsigned int bit = 0;
+    bool seen = false;
+
+    /* Walk it backwards, the last digit has the lowest cpus */
+    for (size_t i = len; i > 0; i--)
+    {
+        char c = buf[i - 1];
+        unsigned int val;
+
+        if (c == '\n' || c == ',' || c == ' ')
+            continue;
+        if (c >= '0' && c <= '9')
+            val = c - '0';
+        else if (c >= 'a' && c <= 'f')
+            val = c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F')
+            val = c - 'A' + 10;
+        else
+            return -EINVAL;
+
+        for (unsigned int j = 0; j < 4; j++, bit++)
+        {
+            if (!(val & (1U << j)))
+                continue;
+            if (bit >= CONFIG_SMP_NR_CPUS)
+                return -EINVAL;
+            mask->set_cpu(bit);
+        }
+
+        seen = true;
+    }
+
+    return seen ? 0 : -EINVAL;
+}
+
+static unsigned int irq_from_proc_entry(struct procfs_entry *entry)
+{
+    for (unsigned int irq = 0; irq < NR_IRQ; irq++)
+    {
+        if (irq_lines[irq].proc_affinity == entry || irq_lines[irq].proc_effective == entry)
+            return irq;
+    }
+
+    return -1U;
+}
+
+static int smp_affinity_show(struct seq_file *m, void *v)
+{
+    struct irq_line *line = &irq_lines[(unsigned long) m->private_];
+    struct cpumask mask;
+
+    spin_lock(&line->list_lock);
+    /* Lines no one routed explicitly can go anywhere, as far as we know */
+    mask = line->affinity.is_empty() ? cpumask::all() : line->affinity;
+    spin_unlock(&line->list_lock);
+
+    irq_print_mask(m, &mask);
+    return 0;
+}
+
+static int effective_affinity_show(struct seq_file *m, void *v)
+{
+    struct irq_line *line = &irq_lines[(unsigned long) m->private_];
+    struct cpumask mask = cpumask::one(line->effective_cpu);
+
+    irq_print_mask(m, &mask);
+    return 0;
+}
+
+static int smp_affinity_open(struct file *filp)
+{
+    unsigned long irq = irq_from_proc_entry(F_PROC_ENTRY(filp));
+    if (irq == -1U)
+        return -ENOENT;
+    return single_open(filp, smp_affinity_show, (void *) irq);
+}
+
+static int effective_affinity_open(struct file *filp)
+{
+    unsigned long irq = irq_from_proc_entry(F_PROC_ENTRY(filp));
+    if (irq == -1U)
+        return -ENOENT;
+    return single_open(filp, effective_affinity_show, (void *) irq);
+}
+
+static ssize_t smp_affinity_write(struct file *filp, size_t offset, struct iovec_iter *iter,
+                                  unsigned int flags)
+{
+    unsigned int irq = irq_from_proc_entry(F_PROC_ENTRY(filp));
+    char buf[64];
+    struct cpumask mask;
+
+    if (irq == -1U)
+        return -ENOENT;
+
+    size_t len = cul::min(iter->bytes, sizeof(buf));
+    ssize_t st = copy_from_iter(iter, buf, len);
+    if (st < 0)
+        return st;
+
+    if (int err = irq_parse_mask(buf, st, &mask); err < 0)
+        return err;
+    if (int err = irq_set_affinity(irq, &mask); err < 0)
+        return err;
+    return st;
+}
+
+const static struct proc_file_ops smp_affinity_proc_ops = {
+    .open = smp_affinity_open,
+    .release = single_release,
+    .read_iter = seq_read_iter,
+    .write_iter = smp_affinity_write,
+};
+
+const static struct proc_file_ops effective_affinity_proc_ops = {
+    .open = effective_affinity_open,
+    .release = single_release,
+    .read_iter = seq_read_iter,
+};
+
+static DECLARE_MUTEX(irq_proc_lock);
+static struct procfs_entry *irq_proc_root;
+
+/* Create /proc/irq/N/{smp_affinity, effective_affinity}, the first time a handler gets installed */
+static void irq_proc_add(unsigned int irq)
+{
+    struct irq_line *line = &irq_lines[irq];
+
+    scoped_mutex g{irq_proc_lock};
+    if (line->proc_dir)
+        return;
+
+    if (!irq_proc_root)
+    {
+        irq_proc_root = procfs_add_entry("irq", S_IFDIR | 0555, NULL, NULL);
+        if (!irq_proc_root)
+            return;
+    }
+
+    char *name = (char *) kmalloc(12, GFP_KERNEL);
+    if (!name)
+        return;
+    snprintf(name, 12, "%u", irq);
+
+    struct procfs_entry *dir = procfs_add_entry(name, S_IFDIR | 0555, irq_proc_root, NULL);
+    if (!dir)
+    {
+        kfree(name);
+        return;
+    }
+
+    line->proc_affinity = procfs_add_entry("smp_affinity", 0644, dir, &smp_affinity_proc_ops);
+    line->proc_effective =
+        procfs_add_entry("effective_affinity", 0444, dir, &effective_affinity_proc_ops);
+    line->proc_dir = dir;
+}
+
+/* interrupts: per-cpu counts for every line with a handler, like Linux's /proc/interrupts */
+static int interrupts_show(struct seq_file *m, void *v)
+{
+    unsigned int nr_cpus = get_nr_cpus();
+
+    seq_printf(m, "%4s", "");
+    for (unsigned int cpu = 0; cpu < nr_cpus; cpu++)
+        seq_printf(m, " %10s%u", "CPU", cpu);
+    seq_printf(m, "\n");
+
+    for (unsigned int irq = 0; irq < NR_IRQ; irq++)
+    {
+        struct irq_line *line = &irq_lines[irq];
+
+        spin_lock(&line->list_lock);
+        if (!line->irq_handlers)
+        {
+            spin_unlock(&line->list_lock);
+            continue;
+        }
+
+        seq_printf(m, "%3u:", irq);
+        for (unsigned int cpu = 0; cpu < nr_cpus; cpu++)
+            seq_printf(m, " %11lu", get_per_cpu_ptr_any(irq_cpustat, cpu)->count[irq]);
+
+        for (struct interrupt_handler *h = line->irq_handlers; h; h = h->next)
+        {
+            seq_printf(m, "%s%s", h == line->irq_handlers ? "  " : ", ",
+                       h->device->driver_->name);
+        }
+
+        seq_printf(m, "\n");
+        spin_unlock(&line->list_lock);
+    }
+
+    seq_printf(m, "ERR: %lu\n", rogue_irqs);
+    return 0;
+}
+
+static int interrupts_open(struct file *filp)
+{
+    return single_open(filp, interrupts_show, nullptr);
+}
+
+const static struct proc_file_ops interrupts_proc_ops = {
+    .open = interrupts_open,
+    .release = single_release,
+    .read_iter = seq_read_iter,
+};
+
+static __init void irq_setup_proc(void)
+{
+    procfs_add_entry("interrupts", 0444, NULL, &interrupts_proc_ops);
+}
@@ -228,50 +228,191 @@ void log_func_entry(unsigned long ip, unsigned long caller)
 
 }; // namespace ktrace
 
-void tracing_buffer::write(const u8 *buf, size_t len)
+// Our VMO ops are a noop, the VMO is filled with the buffer's pages on creation
+static const struct vm_object_ops tracing_buffer_vmo_ops = {};
+
+int tracing_buffer::init(size_t len, u32 mode, u32 cpu)
+{
+    // The data area gets mapped right after the header page, so it must be made of whole pages
+    len = cul::max(len, (size_t) PAGE_SIZE);
+    size_t size = PAGE_SIZE + len;
+    size_t off = 0;
+
+    mem_ = (u8 *) vmalloc(vm_size_to_pages(size), VM_TYPE_REGULAR, VM_READ | VM_WRITE, GFP_KERNEL);
+    if (!mem_)
+        return -ENOMEM;
+
+    vmo_ = vmo_create(size, nullptr);
+    if (!vmo_)
+    {
+        release();
+        return -ENOMEM;
+    }
+
+    for (struct page *p = vmalloc_to_pages(mem_); p;
+         p = p->next_un.next_allocation, off += PAGE_SIZE)
+    {
+        page_ref(p);
+        if (vmo_add_page(off, p, vmo_) < 0)
+        {
+            // The vmo didn't take our reference, the pages it has get released with it
+            page_unref(p);
+            release();
+            return -ENOMEM;
+        }
+    }
+
+    vmo_->ops = &tracing_buffer_vmo_ops;
+
+    buflen = len;
+    mask = len - 1;
+    hdr_ = (struct ktrace_ring_header *) mem_;
+    buf_ = mem_ + PAGE_SIZE;
+    memset(hdr_, 0, sizeof(*hdr_));
+    hdr_->data_offset = PAGE_SIZE;
+    hdr_->data_size = len;
+    hdr_->mode = mode;
+    hdr_->cpu = cpu;
+    return 0;
+}
+
+void tracing_buffer::release()
+{
+    if (vmo_)
+        vmo_unref(vmo_);
+    if (mem_)
+        vfree(mem_);
+    vmo_ = nullptr;
+    mem_ = nullptr;
+}
+
+tracing_buffer::~tracing_buffer()
+{
+    release();
+}
+
+void tracing_buffer::copy_in(u64 pos, const u8 *buf, size_t len)
+{
+    const size_t index = pos & mask;
+    const size_t first = cul::min(len, buflen - index);
+    memcpy(buf_ + index, buf, first);
+    memcpy(buf_, buf + first, len - first);
+}
+
+void tracing_buffer::copy_out(u64 pos, u8 *buf, size_t len) const
+{
+    const size_t index = pos & mask;
+    const size_t first = cul::min(len, buflen - index);
+    memcpy(buf, buf_ + index, first);
+    memcpy(buf + first, buf_, len - first);
+}
+
+/* How many times make_room retries when readers keep moving tail under it. We run with irqs off,
+ * and the readers may be userspace, so we can't wait for them forever. */
+#define TRACING_BUFFER_MAX_CAS_RETRIES 16
+
+/**
+ * @brief Make room for len bytes at head, by pushing tail forward (overwrite mode)
+ *
+ * @param head Current head
+ * @param len Length of the new record
+ * @return True if there's room, false if the record must be dropped
+ */
+bool tracing_buffer::make_room(u64 head, size_t len)
 {
-    while (len)
+    u64 tail = __atomic_load_n(&hdr_->tail, __ATOMIC_ACQUIRE);
+    unsigned int retries = 0;
+
+    while (head - tail + len > buflen)
     {
-        // printf("wr %zu rd %zu len %zu\n", wr, rd, buflen);
-        if (full())
+        if (retries++ == TRACING_BUFFER_MAX_CAS_RETRIES)
+            return false;
+
+        struct tracing_header h;
+        u64 next = head;
+
+        // A tail that's not in [head - buflen, head] was scribbled over by a reader. Restart
+        // from an empty buffer.
+        if (head - tail <= buflen)
         {
-            discard_next_record();
-            assert(!full());
+            if (hdr_->mode == KTRACE_RING_DROP)
+                return false;
+            copy_out(tail, (u8 *) &h, sizeof(h));
+            if (h.size >= sizeof(h) && h.size <= head - tail)
+                next = tail + h.size;
         }
 
-        const size_t wr_index = wr & mask;
-        const size_t rd_index = rd & mask;
-        // Write until the first obstacle
-        size_t may_write = rd_index > wr_index ? rd_index - wr_index : buflen - wr_index;
-        size_t copy_first = cul::min(may_write, len);
-        // printf("May write %lu bytes until falling off, copying %lu\n", may_write,
-        // copy_first);
-        memcpy(buf_ + wr_index, buf, copy_first);
-        len -= copy_first;
-        buf += copy_first;
-        wr += copy_first;
+        // Readers may be consuming this record right now. If they win, tail moved and we retry.
+        // If we win, their compare-and-swap fails and they discard their copy.
+        if (__atomic_compare_exchange_n(&hdr_->tail, &tail, next, false, __ATOMIC_ACQ_REL,
+                                        __ATOMIC_ACQUIRE))
+        {
+            __atomic_store_n(&hdr_->lost, ++lost_, __ATOMIC_RELAXED);
+            tail = next;
+        }
     }
+
+    return true;
 }
 
-void tracing_buffer::discard_next_record()
+void tracing_buffer::write(const u8 *buf, size_t len)
 {
-    struct tracing_header h;
-    read_no_consume((u8 *) &h, sizeof(h));
-    // printf("Discarding record with %u bytes\n", h.size);
-    rd += h.size;
-    overruns++;
+    // We're the only writer of head_
+    const u64 head = head_;
+
+    if (len > buflen || !make_room(head, len)) [[unlikely]]
+    {
+        __atomic_store_n(&hdr_->lost, ++lost_, __ATOMIC_RELAXED);
+        return;
+    }
+
+    copy_in(head, buf, len);
+    // Publish the record
+    __atomic_store_n(&head_, head + len, __ATOMIC_RELEASE);
+    __atomic_store_n(&hdr_->head, head + len, __ATOMIC_RELEASE);
 }
 
-size_t tracing_buffer::read(u8 *buf, size_t len)
+ssize_t tracing_buffer::read(u8 *ubuf, size_t len)
 {
-    struct tracing_header h;
-    read_no_consume((u8 *) &h, sizeof(h));
-    if (h.size > len)
-        return 0;
+    size_t done = 0;
+
+    while (done < len)
+    {
+        struct tracing_header h;
+        u64 tail = __atomic_load_n(&hdr_->tail, __ATOMIC_ACQUIRE);
+        u64 head = __atomic_load_n(&head_, __ATOMIC_ACQUIRE);
+
+        if (head == tail)
+            break;
+
+        copy_out(tail, (u8 *) &h, sizeof(h));
+        if (head - tail > buflen || h.size < sizeof(h) || h.size > head - tail)
+        {
+            // Either the record got overwritten under us (and tail moved), or the ring is
+            // garbage. Skip everything in the latter case.
+            __atomic_compare_exchange_n(&hdr_->tail, &tail, head, false, __ATOMIC_ACQ_REL,
+                                        __ATOMIC_ACQUIRE);
+            continue;
+        }
+
+        if (h.size > len - done)
+            break;
+
+        const size_t index = tail & mask;
+        const size_t first = cul::min((size_t) h.size, buflen - index);
+        if (copy_to_user(ubuf + done, buf_ + index, first) < 0 ||
+            copy_to_user(ubuf + done + first, buf_, h.size - first) < 0)
+            return done ?: -EFAULT;
+
+        // If the producer overwrote the record while we were copying it, tail already moved past
+        // it; drop our (possibly torn) copy.
+        if (!__atomic_compare_exchange_n(&hdr_->tail, &tail, tail + h.size, false, __ATOMIC_ACQ_REL,
+                                         __ATOMIC_ACQUIRE))
+            continue;
+        done += h.size;
+    }
 
-    read_no_consume(buf, cul::min((size_t) h.size, len));
-    rd += h.size;
-    return cul::min((size_t) h.size, len);
+    return done;
 }
 
 struct trace_state
@@ -279,7 +420,7 @@ struct trace_state
     u32 flags;
     tracing_buffer buffer;
 
-    trace_state(u32 flags, u32 buflen) : flags{flags}, buffer{buflen}
+    trace_state(u32 flags) : flags{flags}
     {
     }
 };
@@ -287,24 +428,47 @@ struct trace_state
 struct spinlock tracing_enable_lock;
 PER_CPU_VAR(static struct trace_state *tstate);
 
-#define KTRACE_ENABLE_SUPPORTED_FLAGS (TRACE_EVENT_TIME)
+#define KTRACE_ENABLE_SUPPORTED_FLAGS (TRACE_EVENT_TIME | KTRACE_ENABLE_DROP)
 
-void ktrace_enable_on_every_cpu(const ktrace_enable &en)
+int ktrace_enable_on_every_cpu(const ktrace_enable &en)
 {
     unsigned int ncpus = get_nr_cpus();
+    u32 mode = en.flags & KTRACE_ENABLE_DROP ? KTRACE_RING_DROP : KTRACE_RING_OVERWRITE;
+    trace_state *states[CONFIG_SMP_NR_CPUS] = {};
+    int st = 0;
+
+    // Allocate everything first, so we either enable tracing on every CPU or on none
     for (unsigned int cpu = 0; cpu < ncpus; cpu++)
     {
-        auto new_tstate = new trace_state{en.flags, en.buffer_size};
-        if (!new_tstate)
-            panic("out of memory allocating trace state"); /// XXX(heat): ENOMEM
+        states[cpu] = new trace_state{en.flags};
+        if (!states[cpu])
+        {
+            st = -ENOMEM;
+            break;
+        }
 
+        if (st = states[cpu]->buffer.init(en.buffer_size, mode, cpu); st < 0)
+            break;
+    }
+
+    if (st < 0)
+    {
+        for (unsigned int cpu = 0; cpu < ncpus; cpu++)
+            delete states[cpu];
+        return st;
+    }
+
+    for (unsigned int cpu = 0; cpu < ncpus; cpu++)
+    {
         smp::sync_call(
             [](void *context) {
                 trace_state *st = (trace_state *) context;
                 write_per_cpu(tstate, st);
             },
-            new_tstate, cpumask::one(cpu));
+            states[cpu], cpumask::one(cpu));
     }
+
+    return 0;
 }
 
 mutex global_tracing_lock;
@@ -336,15 +500,21 @@ int ktrace_do_enable(struct ktrace_enable *uen)
     if (!ev)
         return -ENOENT;
 
+    // Set up the buffers before the first event can come out
+    if (__tracing_enabled_counter == 0)
+    {
+        if (int st = ktrace_enable_on_every_cpu(en); st < 0)
+            return st;
+    }
+
+    __tracing_enabled_counter++;
+
     // Before setting the enabled flag, enable all static keys
     // so events all come out at the same time
     static_branch_enable(ev->key);
 
     ev->flags |= TRACE_EVENT_ENABLED;
-    ev->flags |= en.flags;
-
-    if (__tracing_enabled_counter++ == 0)
-        ktrace_enable_on_every_cpu(en);
+    ev->flags |= en.flags & TRACE_EVENT_TIME;
 
     return 0;
 }
@@ -358,57 +528,43 @@ void __trace_write(u8 *buf, size_t len)
     irq_restore(flags);
 }
 
+static struct trace_state *ktrace_buf_state(struct file *file)
+{
+    u32 cpunr = (u32) (unsigned long) file->f_ino->i_helper;
+    return READ_ONCE(other_cpu_get(tstate, cpunr));
+}
+
 size_t ktrace_buf_read(size_t offset, size_t len, void *buffer, struct file *file)
 {
-    struct inode *ino = file->f_ino;
-    u32 cpunr = (u32) (unsigned long) ino->i_helper;
-    void *ptr = vmalloc(vm_size_to_pages(len), VM_TYPE_REGULAR, VM_READ | VM_WRITE, GFP_KERNEL);
-    if (!ptr)
-        return -ENOMEM;
+    struct trace_state *st = ktrace_buf_state(file);
+    if (!st)
+        return 0;
 
-    struct state
-    {
-        u8 *ptr;
-        size_t len;
-    };
-
-    state s{(u8 *) ptr, len};
-
-    smp::sync_call(
-        [](void *context) {
-            state *s = (state *) context;
-            auto flags = irq_save_and_disable();
-            struct trace_state *st = get_per_cpu(tstate);
-            size_t to_read = s->len;
-            if (st) [[likely]]
-            {
-                s->len = 0;
-                while (to_read)
-                {
-                    if (st->buffer.empty())
-                        break;
-                    auto read = st->buffer.read(s->ptr, to_read);
-                    s->len += read;
-                    s->ptr += read;
-                    if (read == 0)
-                        break;
-                    to_read -= read;
-                }
-            }
-            else
-                s->len = 0;
-            irq_restore(flags);
-        },
-        &s, cpumask::one(cpunr));
-
-    s.len = copy_to_user(buffer, ptr, s.len) < 0 ? -EFAULT : s.len;
-    vfree(ptr);
-    return s.len;
+    // The buffer is safe to consume from any CPU, no need to go over there
+    return st->buffer.read((u8 *) buffer, len);
+}
+
+void *ktrace_buf_mmap(struct vm_area_struct *area, struct file *file)
+{
+    struct trace_state *st = ktrace_buf_state(file);
+
+    if (!st)
+        return errno = ENXIO, nullptr;
+    if (area->vm_offset != 0 || !vma_shared(area))
+        return errno = EINVAL, nullptr;
+    if (vma_pages(area) > vm_size_to_pages(st->buffer.vmo()->size))
+        return errno = EINVAL, nullptr;
+
+    area->vm_obj = st->buffer.vmo();
+    vmo_ref(area->vm_obj);
+    vmo_assign_mapping(area->vm_obj, area);
+
+    return (void *) area->vm_start;
 }
 
 static atomic<ino_t> current_inode_number;
 
-static const file_ops ktrace_buf_fops = {.read = ktrace_buf_read};
+static const file_ops ktrace_buf_fops = {.read = ktrace_buf_read, .mmap = ktrace_buf_mmap};
 
 static int buffd_create(struct file **pfd, u32 cpu_nr)
 {
@@ -423,7 +579,8 @@ static int buffd_create(struct file **pfd, u32 cpu_nr)
         return -ENOMEM;
 
     anon_ino->i_dev = 0;
-    anon_ino->i_mode = S_IFIFO;
+    // Character device, so mmap goes through our fops
+    anon_ino->i_mode = S_IFCHR;
     anon_ino->i_flags = INODE_FLAG_NO_SEEK;
     anon_ino->i_inode = current_inode_number++;
     anon_ino->i_fops = (struct file_ops *) &ktrace_buf_fops;
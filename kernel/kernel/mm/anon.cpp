@@ -43,7 +43,7 @@ int vm_anon_fault(struct vm_pf_context *ctx)
             return -ENOMEM;
 
         /* Allocate a brand-new, zero-filled page */
-        page = alloc_page(GFP_KERNEL);
+        page = alloc_page_vma(vma, ctx->vpage, GFP_KERNEL);
         if (!page)
             goto enomem;
         page_set_anon(page);
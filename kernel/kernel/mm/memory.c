@@ -387,7 +387,7 @@ struct unmap_info
     struct tlbi_tracker tlbi;
     struct mm_address_space *mm;
     struct vm_area_struct *vma;
-    int kernel : 1, full : 1, freepgtables : 1;
+    int kernel : 1, full : 1, freepgtables : 1, noflush : 1;
 };
 
 enum unmap_result
@@ -549,7 +549,8 @@ static enum unmap_result pte_unmap_range(struct unmap_info *uinfo, pte_t *pte, u
         if (pte_present(old) || pte_protnone(old))
             decrement_vm_stat(uinfo->mm, resident_set_size, PAGE_SIZE);
         set_pte(pte, __pte(0));
-        tlbi_remove_page(&uinfo->tlbi, start, page);
+        if (!uinfo->noflush)
+            tlbi_remove_page(&uinfo->tlbi, start, page);
     }
 
     /* If we *know* the page table is clear, tell it to the caller so we skip expensive checks */
@@ -749,6 +750,7 @@ int vm_mmu_unmap(struct mm_address_space *mm, void *addr, size_t pages, struct v
     unmap_info.kernel = mm == &kernel_address_space;
     unmap_info.full = 0;
     unmap_info.freepgtables = 1;
+    unmap_info.noflush = 0;
     tlbi_tracker_init(&unmap_info.tlbi);
 
     spin_lock(&mm->page_table_lock);
@@ -760,6 +762,33 @@ int vm_mmu_unmap(struct mm_address_space *mm, void *addr, size_t pages, struct v
     return 0;
 }
 
+/**
+ * @brief Clear a range of kernel PTEs, without flushing the TLB
+ * Page tables are left in place. The caller must flush the TLB (see mmu_invalidate_range) before
+ * the range gets mapped again.
+ *
+ * @param addr Start of the range
+ * @param pages Number of pages
+ */
+void vm_mmu_unmap_noflush(void *addr, size_t pages)
+{
+    struct mm_address_space *mm = &kernel_address_space;
+    unsigned long virt = (unsigned long) addr;
+    unsigned long end = virt + (pages << PAGE_SHIFT);
+    struct unmap_info unmap_info;
+    unmap_info.vma = NULL;
+    unmap_info.mm = mm;
+    unmap_info.kernel = 1;
+    unmap_info.full = 0;
+    unmap_info.freepgtables = 0;
+    unmap_info.noflush = 1;
+    tlbi_tracker_init(&unmap_info.tlbi);
+
+    spin_lock(&mm->page_table_lock);
+    pgd_unmap_range(&unmap_info, pgd_offset(mm, virt), virt, end);
+    spin_unlock(&mm->page_table_lock);
+}
+
 int zap_page_range(unsigned long start, unsigned long end, struct vm_area_struct *vma)
 {
     struct mm_address_space *mm = vma->vm_mm;
@@ -769,6 +798,7 @@ int zap_page_range(unsigned long start, unsigned long end, struct vm_area_struct
     unmap_info.kernel = 0;
     unmap_info.full = 0;
     unmap_info.freepgtables = 0;
+    unmap_info.noflush = 0;
     tlbi_tracker_init(&unmap_info.tlbi);
 
     spin_lock(&mm->page_table_lock);
@@ -905,7 +935,7 @@ void vm_do_mmu_mprotect(struct mm_address_space *mm, void *address, size_t nr_pg
         tlbi_end_batch(&tlbi);
 }
 
-static int pte_fork_range(struct tlbi_tracker *tlbi, pte_t *pte, pte_t *old_pte,
+static int pte_fork_range(struct mmu_fork_batch *batch, pte_t *pte, pte_t *old_pte,
                           unsigned long start, unsigned long end, struct mm_address_space *mm,
                           struct vm_area_struct *old_vma)
 {
@@ -932,10 +962,15 @@ static int pte_fork_range(struct tlbi_tracker *tlbi, pte_t *pte, pte_t *old_pte,
 
         if (!pte_protnone(old) && vma_private(old_vma))
         {
-            /* We must CoW MAP_PRIVATE */
+            /* We must CoW MAP_PRIVATE. Only ptes that were writable can be cached as such, read-only
+             * ones don't need a flush. */
             set_pte(old_pte, pte_wrprotect(old));
             set_pte(pte, *old_pte);
-            tlbi_update_page_prots(tlbi, start, old, *pte);
+            if (pte_write(old))
+            {
+                batch->start = min(batch->start, start);
+                batch->end = max(batch->end, start + PAGE_SIZE);
+            }
         }
         else
         {
@@ -949,7 +984,7 @@ static int pte_fork_range(struct tlbi_tracker *tlbi, pte_t *pte, pte_t *old_pte,
     return 0;
 }
 
-static int pmd_fork_range(struct tlbi_tracker *tlbi, pmd_t *pmd, pmd_t *old_pmd,
+static int pmd_fork_range(struct mmu_fork_batch *batch, pmd_t *pmd, pmd_t *old_pmd,
                           unsigned long start, unsigned long end, struct mm_address_space *mm,
                           struct vm_area_struct *old_vma)
 {
@@ -966,7 +1001,7 @@ static int pmd_fork_range(struct tlbi_tracker *tlbi, pmd_t *pmd, pmd_t *old_pmd,
         /* TODO: Huge page splitting not supported yet... */
         DCHECK(!pmd_huge(*pmd));
         int err =
-            pte_fork_range(tlbi, pte, pte_offset(old_pmd, start), start, next_start, mm, old_vma);
+            pte_fork_range(batch, pte, pte_offset(old_pmd, start), start, next_start, mm, old_vma);
         if (err < 0)
             return err;
     }
@@ -974,7 +1009,7 @@ static int pmd_fork_range(struct tlbi_tracker *tlbi, pmd_t *pmd, pmd_t *old_pmd,
     return 0;
 }
 
-static int pud_fork_range(struct tlbi_tracker *tlbi, pud_t *pud, pud_t *old_pud,
+static int pud_fork_range(struct mmu_fork_batch *batch, pud_t *pud, pud_t *old_pud,
                           unsigned long start, unsigned long end, struct mm_address_space *mm,
                           struct vm_area_struct *old_vma)
 {
@@ -990,7 +1025,7 @@ static int pud_fork_range(struct tlbi_tracker *tlbi, pud_t *pud, pud_t *old_pud,
         /* TODO: Huge page splitting not supported yet... */
         DCHECK(!pud_huge(*pud));
         int err =
-            pmd_fork_range(tlbi, pmd, pmd_offset(old_pud, start), start, next_start, mm, old_vma);
+            pmd_fork_range(batch, pmd, pmd_offset(old_pud, start), start, next_start, mm, old_vma);
         if (err < 0)
             return err;
     }
@@ -998,7 +1033,7 @@ static int pud_fork_range(struct tlbi_tracker *tlbi, pud_t *pud, pud_t *old_pud,
     return 0;
 }
 
-static int p4d_fork_range(struct tlbi_tracker *tlbi, p4d_t *p4d, p4d_t *old_p4d,
+static int p4d_fork_range(struct mmu_fork_batch *batch, p4d_t *p4d, p4d_t *old_p4d,
                           unsigned long start, unsigned long end, struct mm_address_space *mm,
                           struct vm_area_struct *old_vma)
 {
@@ -1015,7 +1050,7 @@ static int p4d_fork_range(struct tlbi_tracker *tlbi, p4d_t *p4d, p4d_t *old_p4d,
         /* TODO: Huge page splitting not supported yet... */
         DCHECK(!p4d_huge(*p4d));
         int err =
-            pud_fork_range(tlbi, pud, pud_offset(old_p4d, start), start, next_start, mm, old_vma);
+            pud_fork_range(batch, pud, pud_offset(old_p4d, start), start, next_start, mm, old_vma);
         if (err < 0)
             return -ENOMEM;
     }
@@ -1023,7 +1058,7 @@ static int p4d_fork_range(struct tlbi_tracker *tlbi, p4d_t *p4d, p4d_t *old_p4d,
     return 0;
 }
 
-static int pgd_fork_range(struct tlbi_tracker *tlbi, pgd_t *pgd, pgd_t *old_pgd,
+static int pgd_fork_range(struct mmu_fork_batch *batch, pgd_t *pgd, pgd_t *old_pgd,
                           unsigned long start, unsigned long end, struct mm_address_space *mm,
                           struct vm_area_struct *old_vma)
 {
@@ -1038,7 +1073,7 @@ static int pgd_fork_range(struct tlbi_tracker *tlbi, pgd_t *pgd, pgd_t *old_pgd,
             return -ENOMEM;
 
         int err =
-            p4d_fork_range(tlbi, p4d, p4d_offset(old_pgd, start), start, next_start, mm, old_vma);
+            p4d_fork_range(batch, p4d, p4d_offset(old_pgd, start), start, next_start, mm, old_vma);
         if (err < 0)
             return err;
     }
@@ -1051,25 +1086,34 @@ static int pgd_fork_range(struct tlbi_tracker *tlbi, pgd_t *pgd, pgd_t *old_pgd,
  *
  * @param old_vma Old vm_area_struct
  * @param mm Current address space
+ * @param batch Fork batch, for TLB invalidation of the old address space
  * @return 0 on success, negative error codes
  */
-int mmu_fork_tables(struct vm_area_struct *old_vma, struct mm_address_space *mm)
+int mmu_fork_tables(struct vm_area_struct *old_vma, struct mm_address_space *mm,
+                    struct mmu_fork_batch *batch)
 {
     unsigned long start = old_vma->vm_start;
     unsigned long end = old_vma->vm_end;
-    int err;
-    struct tlbi_tracker tlbi;
-    tlbi_tracker_init(&tlbi);
 
     /* Note: We can't take the page table spinlock here (hold time is too long, too many memory
      * allocations may happen). We'll rely on holding the mm lock exclusively. Page table lifetime
      * atm is a bit iffy, needs some solid rethinking. */
-    err = pgd_fork_range(&tlbi, pgd_offset(mm, start), pgd_offset(old_vma->vm_mm, start), start,
-                         end, mm, old_vma);
+    return pgd_fork_range(batch, pgd_offset(mm, start), pgd_offset(old_vma->vm_mm, start), start,
+                          end, mm, old_vma);
+}
 
-    if (tlbi_active(&tlbi))
-        tlbi_end_batch(&tlbi);
-    return err;
+/**
+ * @brief Finish a fork batch, and invalidate the TLB for every pte that got write-protected
+ *
+ * @param batch Fork batch
+ */
+void mmu_fork_batch_end(struct mmu_fork_batch *batch)
+{
+    /* One shootdown for the whole address space. Anything big enough ends up being a full flush
+     * anyway, which is way cheaper than a shootdown per VMA (or per PMD). */
+    if (batch->end > batch->start)
+        vm_invalidate_range(batch->start, (batch->end - batch->start) >> PAGE_SHIFT);
+    mmu_fork_batch_init(batch);
 }
 
 int try_to_unmap_one(struct page *page, struct vm_area_struct *vma,
@@ -1251,7 +1295,8 @@ int do_wp_page(struct vm_pf_context *context)
 
     spin_unlock(lock);
 
-    new_page = alloc_page(GFP_KERNEL | (was_zeropage ? 0 : PAGE_ALLOC_NO_ZERO));
+    new_page = alloc_page_vma(context->entry, context->vpage,
+                              GFP_KERNEL | (was_zeropage ? 0 : PAGE_ALLOC_NO_ZERO));
     if (!new_page)
         return -ENOMEM;
 
@@ -0,0 +1,279 @@
+/*
+ * Copyright (c) 2025 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the GPLv2 License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+
+#include <onyx/mm/mempolicy.h>
+#include <onyx/mm/numa.h>
+#include <onyx/mm/page_node.h>
+#include <onyx/page.h>
+#include <onyx/process.h>
+#include <onyx/types.h>
+#include <onyx/user.h>
+#include <onyx/vm.h>
+
+#include "vma_internal.h"
+
+/*
+ * NUMA memory policies. Mappings (mbind) and processes (set_mempolicy) may have a policy, and
+ * anonymous memory gets allocated according to the mapping's, else the process', else
+ * MPOL_LOCAL. Kernel allocations are always local.
+ */
+
+static int interleave_nid(const struct mempolicy *pol, struct vm_area_struct *vma,
+                          unsigned long addr)
+{
+    /* Interleave by the page's offset into the mapping, so the layout doesn't depend on what got
+     * touched first. */
+    unsigned long off = ((addr - vma->vm_start) >> PAGE_SHIFT) + (vma->vm_offset >> PAGE_SHIFT);
+    unsigned long nodes = pol->nodes;
+    unsigned int n = off % __builtin_popcountl(nodes);
+
+    while (n--)
+        nodes &= nodes - 1;
+    return __builtin_ctzl(nodes);
+}
+
+/**
+ * @brief Allocate a page for a user mapping, following the mapping's memory policy (or the
+ * process', if the mapping doesn't have one)
+ *
+ * @param vma Mapping
+ * @param addr Address the page is for
+ * @param flags GFP flags
+ * @return Allocated page, or NULL
+ */
+struct page *alloc_page_vma(struct vm_area_struct *vma, unsigned long addr, unsigned long flags)
+{
+    const struct mempolicy *pol = &vma->vm_policy;
+    struct process *p = get_current_process();
+
+    if (pol->mode == MPOL_DEFAULT && p)
+        pol = &p->mempolicy;
+
+    switch (pol->mode)
+    {
+        case MPOL_PREFERRED:
+            return alloc_pages_node(__builtin_ctzl(pol->nodes), 0, flags);
+        case MPOL_BIND:
+            return __alloc_pages_nodemask(0, flags, numa_node_id(), pol->nodes);
+        case MPOL_INTERLEAVE:
+            return alloc_pages_node(interleave_nid(pol, vma, addr), 0, flags);
+        default:
+            return alloc_page(flags);
+    }
+}
+
+static int get_nodes(unsigned long *nodes, const unsigned long *unodemask, unsigned long maxnode)
+{
+    *nodes = 0;
+    if (!unodemask || maxnode == 0)
+        return 0;
+
+    if (copy_from_user(nodes, unodemask, sizeof(*nodes)) < 0)
+        return -EFAULT;
+    if (maxnode < 64)
+        *nodes &= (1UL << maxnode) - 1;
+    return 0;
+}
+
+static int put_nodes(unsigned long nodes, unsigned long *unodemask, unsigned long maxnode)
+{
+    if (!unodemask || maxnode == 0)
+        return 0;
+    if (maxnode < 64)
+        nodes &= (1UL << maxnode) - 1;
+    return copy_to_user(unodemask, &nodes, sizeof(nodes));
+}
+
+static int mempolicy_make(struct mempolicy *pol, int mode, unsigned long nodes)
+{
+    if (mode < 0 || mode >= MPOL_MAX)
+        return -EINVAL;
+    if (nodes & ~numa_nodemask_valid())
+        return -EINVAL;
+
+    switch (mode)
+    {
+        case MPOL_DEFAULT:
+        case MPOL_LOCAL:
+            if (nodes)
+                return -EINVAL;
+            break;
+        case MPOL_PREFERRED:
+            /* An empty preferred policy means local, like Linux */
+            if (!nodes)
+                mode = MPOL_LOCAL;
+            break;
+        case MPOL_BIND:
+        case MPOL_INTERLEAVE:
+            if (!nodes)
+                return -EINVAL;
+            break;
+    }
+
+    /* Memoryless nodes can't satisfy an allocation, so keep them out of the policy (else PREFERRED
+     * and INTERLEAVE would pick them, and BIND would reclaim and fail). Like Linux, a mask with
+     * no memory node at all is invalid. */
+    if (nodes)
+    {
+        nodes &= numa_nodemask_memory();
+        if (!nodes)
+            return -EINVAL;
+    }
+
+    pol->mode = mode;
+    pol->nodes = nodes;
+    return 0;
+}
+
+int sys_set_mempolicy(int mode, const unsigned long *nodemask, unsigned long maxnode)
+{
+    struct mempolicy pol;
+    unsigned long nodes;
+    int st;
+
+    if ((st = get_nodes(&nodes, nodemask, maxnode)) < 0)
+        return st;
+    if ((st = mempolicy_make(&pol, mode, nodes)) < 0)
+        return st;
+
+    get_current_process()->mempolicy = pol;
+    return 0;
+}
+
+static int get_mempolicy_addr(unsigned long addr, struct mempolicy *pol)
+{
+    struct mm_address_space *mm = get_current_address_space();
+    struct vm_area_struct *vma;
+    int st = -EFAULT;
+    VMA_ITERATOR(vmi, mm, addr, addr + 1);
+
+    rw_lock_read(&mm->vm_lock);
+    vma = mas_find(&vmi.mas, vmi.end);
+    if (vma && vma->vm_start <= addr)
+    {
+        *pol = vma->vm_policy;
+        st = 0;
+    }
+
+    rw_unlock_read(&mm->vm_lock);
+    return st;
+}
+
+static int get_mempolicy_node(unsigned long addr)
+{
+    struct page *page;
+    int nid;
+
+    /* Fault it in, like Linux does */
+    if (!(get_phys_pages((void *) addr, GPP_READ | GPP_USER, &page, 1) & GPP_ACCESS_OK))
+        return -EFAULT;
+
+    nid = page_to_nid(page);
+    page_unpin(page);
+    return nid;
+}
+
+int sys_get_mempolicy(int *umode, unsigned long *nodemask, unsigned long maxnode, void *addr,
+                      unsigned long flags)
+{
+    struct mempolicy pol;
+    int mode;
+    int st;
+
+    if (flags & ~(MPOL_F_NODE | MPOL_F_ADDR))
+        return -EINVAL;
+
+    if (flags & MPOL_F_ADDR)
+    {
+        if ((st = get_mempolicy_addr((unsigned long) addr, &pol)) < 0)
+            return st;
+    }
+    else
+    {
+        /* We don't keep an interleave cursor for processes, so MPOL_F_NODE only works on
+         * addresses */
+        if (addr || flags & MPOL_F_NODE)
+            return -EINVAL;
+        pol = get_current_process()->mempolicy;
+    }
+
+    mode = pol.mode;
+    if (flags & MPOL_F_NODE)
+    {
+        if ((mode = get_mempolicy_node((unsigned long) addr)) < 0)
+            return mode;
+    }
+
+    if (umode && copy_to_user(umode, &mode, sizeof(mode)) < 0)
+        return -EFAULT;
+    return put_nodes(pol.nodes, nodemask, maxnode);
+}
+
+static int do_mbind_walk(struct mm_address_space *mm, unsigned long start, size_t len,
+                         const struct mempolicy *pol)
+{
+    unsigned long limit = start + len;
+    unsigned long next = start;
+    struct vm_area_struct *vma;
+    VMA_ITERATOR(vmi, mm, start, limit);
+
+    mas_for_each(&vmi.mas, vma, vmi.end)
+    {
+        if (vma->vm_start >= limit)
+            break;
+
+        /* Holes in the range are an error */
+        if (vma->vm_start > next)
+            return -EFAULT;
+
+        vma = vma_prepare_modify(&vmi, vma, max(vma->vm_start, start), min(limit, vma->vm_end));
+        if (!vma)
+            return -ENOMEM;
+
+        /* Pages that are already there stay where they are */
+        vma->vm_policy = *pol;
+        next = vma->vm_end;
+    }
+
+    return next < limit ? -EFAULT : 0;
+}
+
+int sys_mbind(void *addr, unsigned long len, int mode, const unsigned long *nodemask,
+              unsigned long maxnode, unsigned int flags)
+{
+    struct mm_address_space *mm = get_current_address_space();
+    unsigned long start = (unsigned long) addr;
+    struct mempolicy pol;
+    unsigned long nodes;
+    int st;
+
+    if (flags)
+        return -EINVAL;
+    if (start & (PAGE_SIZE - 1))
+        return -EINVAL;
+
+    len = ALIGN_TO(len, PAGE_SIZE);
+
+    if (start + len < start)
+        return -EINVAL;
+    if (len == 0)
+        return 0;
+
+    if ((st = get_nodes(&nodes, nodemask, maxnode)) < 0)
+        return st;
+    if ((st = mempolicy_make(&pol, mode, nodes)) < 0)
+        return st;
+
+    rw_lock_write(&mm->vm_lock);
+    st = do_mbind_walk(mm, start, len, &pol);
+    rw_unlock_write(&mm->vm_lock);
+    return st;
+}
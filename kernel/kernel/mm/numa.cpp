@@ -0,0 +1,276 @@
+/*
+ * Copyright (c) 2025 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the GPLv2 License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+#include <errno.h>
+#include <stdio.h>
+
+#include <onyx/cpu.h>
+#include <onyx/mm/numa.h>
+#include <onyx/panic.h>
+#include <onyx/preempt.h>
+#include <onyx/user.h>
+
+/*
+ * NUMA topology: which node every physical address and every CPU belong to, and how far apart the
+ * nodes are. The arch fills this in from firmware tables (SRAT and SLIT on x86) before page_init.
+ * Without that, everything is node 0.
+ */
+
+#define NUMA_MAX_MEMBLKS 128
+
+struct numa_memblk
+{
+    unsigned long start;
+    unsigned long end;
+    int nid;
+};
+
+/* Sorted by start, non-overlapping */
+static struct numa_memblk memblks[NUMA_MAX_MEMBLKS];
+static unsigned int nr_memblks;
+
+unsigned int nr_numa_nodes = 1;
+u8 numa_cpu_nodes[CONFIG_SMP_NR_CPUS];
+
+/* 0 means "not given", and gets filled in by numa_init */
+static u8 numa_distances[CONFIG_NUMA_NR_NODES][CONFIG_NUMA_NR_NODES];
+static u8 numa_orders[CONFIG_NUMA_NR_NODES][CONFIG_NUMA_NR_NODES];
+
+/**
+ * @brief Set the number of NUMA nodes (called by the arch topology parser, before numa_init)
+ *
+ * @param nr Number of nodes
+ */
+void numa_set_nr_nodes(unsigned int nr)
+{
+    CHECK(nr > 0 && nr <= CONFIG_NUMA_NR_NODES);
+    nr_numa_nodes = nr;
+}
+
+/**
+ * @brief Add a memory block to a node (called by the arch topology parser, before numa_init)
+ *
+ * @param nid Node
+ * @param start Start of the block (physical address)
+ * @param end End of the block (exclusive)
+ * @return 0 on success, -ENOSPC if we're out of memory blocks
+ */
+int numa_add_memblk(int nid, unsigned long start, unsigned long end)
+{
+    unsigned int i;
+
+    if (start >= end)
+        return 0;
+    if (nr_memblks == NUMA_MAX_MEMBLKS)
+        return -ENOSPC;
+
+    for (i = 0; i < nr_memblks; i++)
+    {
+        if (memblks[i].start > start)
+            break;
+    }
+
+    for (unsigned int j = nr_memblks; j > i; j--)
+        memblks[j] = memblks[j - 1];
+
+    memblks[i].start = start;
+    memblks[i].end = end;
+    memblks[i].nid = nid;
+    nr_memblks++;
+    return 0;
+}
+
+/**
+ * @brief Set the distance between two nodes, in ACPI SLIT units
+ */
+void numa_set_distance(int from, int to, u8 distance)
+{
+    numa_distances[from][to] = distance;
+}
+
+/**
+ * @brief Get the distance between two nodes, in ACPI SLIT units
+ */
+unsigned int numa_distance(int from, int to)
+{
+    return numa_distances[from][to];
+}
+
+/**
+ * @brief Set a CPU's node
+ *
+ * @param cpu CPU
+ * @param nid Node
+ */
+void numa_set_cpu_node(unsigned int cpu, int nid)
+{
+    numa_cpu_nodes[cpu] = nid;
+}
+
+/**
+ * @brief Get the nodes in order of distance from nid, nid first
+ *
+ * @param nid Node
+ * @return Array of nr_numa_nodes node ids
+ */
+const u8 *numa_node_order(int nid)
+{
+    return numa_orders[nid];
+}
+
+static const struct numa_memblk *numa_find_memblk(unsigned long phys)
+{
+    unsigned int lo = 0, hi = nr_memblks;
+
+    while (lo < hi)
+    {
+        unsigned int mid = lo + (hi - lo) / 2;
+        if (phys < memblks[mid].start)
+            hi = mid;
+        else if (phys >= memblks[mid].end)
+            lo = mid + 1;
+        else
+            return &memblks[mid];
+    }
+
+    return nullptr;
+}
+
+int __phys_to_nid(unsigned long phys)
+{
+    const struct numa_memblk *blk = numa_find_memblk(phys);
+    return blk ? blk->nid : 0;
+}
+
+/**
+ * @brief Split a physical range into per-node ranges
+ *
+ * @param start Start of the range
+ * @param size Size of the range
+ * @param cb Callback, called for every part of the range, in order
+ */
+void numa_for_each_range(unsigned long start, size_t size,
+                         void (*cb)(unsigned long start, size_t size, int nid))
+{
+    const unsigned long end = start + size;
+
+    while (start < end)
+    {
+        int nid = 0;
+        unsigned long part_end = end;
+        const struct numa_memblk *blk = numa_find_memblk(start);
+
+        if (blk)
+        {
+            nid = blk->nid;
+            part_end = cul::min(end, blk->end);
+        }
+        else
+        {
+            // Not covered by any block, goes to node 0 up until the next block
+            for (unsigned int i = 0; i < nr_memblks; i++)
+            {
+                if (memblks[i].start > start)
+                {
+                    part_end = cul::min(end, memblks[i].start);
+                    break;
+                }
+            }
+        }
+
+        cb(start, part_end - start, nid);
+        start = part_end;
+    }
+}
+
+static unsigned int numa_order_key(int nid, unsigned int n)
+{
+    // We always come first, then by distance, then by node id
+    if (n == (unsigned int) nid)
+        return 0;
+    return (numa_distances[nid][n] + 1U) << 8 | n;
+}
+
+static void numa_build_order(int nid)
+{
+    u8 *order = numa_orders[nid];
+
+    for (unsigned int i = 0; i < nr_numa_nodes; i++)
+    {
+        unsigned int j = i;
+        for (; j > 0 && numa_order_key(nid, order[j - 1]) > numa_order_key(nid, i); j--)
+            order[j] = order[j - 1];
+        order[j] = i;
+    }
+}
+
+/**
+ * @brief Validate the topology the arch gave us and set up fallback orders. Called by page_init,
+ * before any memory gets added.
+ */
+void numa_init()
+{
+    for (unsigned int i = 0; i < nr_memblks; i++)
+    {
+        if ((unsigned int) memblks[i].nid >= nr_numa_nodes ||
+            (i > 0 && memblks[i - 1].end > memblks[i].start))
+        {
+            pr_err("numa: Bad memory block [%016lx, %016lx] (node %d), ignoring NUMA topology\n",
+                   memblks[i].start, memblks[i].end - 1, memblks[i].nid);
+            nr_numa_nodes = 1;
+            nr_memblks = 0;
+            break;
+        }
+    }
+
+    for (unsigned int i = 0; i < nr_numa_nodes; i++)
+    {
+        for (unsigned int j = 0; j < nr_numa_nodes; j++)
+        {
+            if (numa_distances[i][j] == 0)
+                numa_distances[i][j] = i == j ? NUMA_LOCAL_DISTANCE : NUMA_REMOTE_DISTANCE;
+        }
+    }
+
+    for (unsigned int i = 0; i < nr_numa_nodes; i++)
+        numa_build_order(i);
+
+    if (nr_numa_nodes == 1)
+        return;
+
+    pr_info("numa: %u nodes\n", nr_numa_nodes);
+    for (unsigned int i = 0; i < nr_memblks; i++)
+    {
+        pr_info("numa: node %d: [%016lx, %016lx]\n", memblks[i].nid, memblks[i].start,
+                memblks[i].end - 1);
+    }
+
+    for (unsigned int i = 0; i < nr_numa_nodes; i++)
+    {
+        char buf[CONFIG_NUMA_NR_NODES * 4 + 1];
+        char *s = buf;
+        for (unsigned int j = 0; j < nr_numa_nodes; j++)
+            s += sprintf(s, " %3u", numa_distances[i][j]);
+        pr_info("numa: distances from node %u:%s\n", i, buf);
+    }
+}
+
+int sys_getcpu(unsigned int *ucpu, unsigned int *unode, void *tcache)
+{
+    unsigned int cpu, node;
+
+    sched_disable_preempt();
+    cpu = get_cpu_nr();
+    node = cpu_to_node(cpu);
+    sched_enable_preempt();
+
+    if (ucpu && copy_to_user(ucpu, &cpu, sizeof(cpu)) < 0)
+        return -EFAULT;
+    if (unode && copy_to_user(unode, &node, sizeof(node)) < 0)
+        return -EFAULT;
+    return 0;
+}
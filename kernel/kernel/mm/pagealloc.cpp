@@ -19,6 +19,7 @@
 #include <onyx/copy.h>
 #include <onyx/init.h>
 #include <onyx/mm/kasan.h>
+#include <onyx/mm/numa.h>
 #include <onyx/mm/page_lru.h>
 #include <onyx/mm/page_node.h>
 #include <onyx/mm/page_zone.h>
@@ -413,7 +414,7 @@ __always_inline struct page *get_buddy(struct page *page, unsigned int order, pa
     // Check if we can indeed merge with a buddy. if so
     // 1) the buddy is not past maxpfn (phys_to_page_mayfail)
     // 2) the buddy is free and the same order as us
-    // 3) the buddy is in the same zone
+    // 3) the buddy is in the same zone (and node)
 
     struct page *p = phys_to_page_mayfail(addr2);
     if (!p) [[unlikely]]
@@ -422,6 +423,8 @@ __always_inline struct page *get_buddy(struct page *page, unsigned int order, pa
         return nullptr;
     if (addr2 < zone->start || addr2 > zone->end)
         return nullptr;
+    if (phys_to_nid(addr2) != zone->nid)
+        return nullptr;
     return p;
 }
 
@@ -507,7 +510,7 @@ void page_zone_free(page_zone *zone, struct page *page, unsigned int order)
 
 static bool page_is_initialized = false;
 
-page_node main_node;
+page_node page_nodes[CONFIG_NUMA_NR_NODES];
 
 struct page_zone *page_node::pick_zone(unsigned long page)
 {
@@ -516,9 +519,15 @@ struct page_zone *page_node::pick_zone(unsigned long page)
     return &zones[ZONE_NORMAL];
 }
 
+static struct page_zone *page_to_zone(struct page *page)
+{
+    unsigned long phys = (unsigned long) page_to_phys(page);
+    return page_nodes[phys_to_nid(phys)].pick_zone(phys);
+}
+
 struct page_lru *page_to_page_lru(struct page *page)
 {
-    return &main_node.pick_zone((unsigned long) page_to_phys(page))->zone_lru;
+    return &page_to_zone(page)->zone_lru;
 }
 
 void page_node::add_region(uintptr_t base, size_t size)
@@ -541,11 +550,13 @@ void page_node::add_region(uintptr_t base, size_t size)
         unsigned long start = base;
         unsigned long end = cul::clamp(start + size, zone->end) + 1;
         unsigned long nr_pages = (end - start) >> PAGE_SHIFT;
-        printf("pagealloc: Adding [%016lx, %016lx] to zone %s\n", start, end - 1, zone->name);
+        printf("pagealloc: Adding [%016lx, %016lx] to node %d zone %s\n", start, end - 1, nid,
+               zone->name);
 #ifdef CONFIG_KASAN
         kasan_set_state((unsigned long *) PHYS_TO_VIRT(base), size, 1);
 #endif
         page_zone_add_region(start, nr_pages, zone);
+        total_pages += nr_pages;
         nr_global_pages.add_fetch(nr_pages, mem_order::release);
         start = end;
         size -= nr_pages << PAGE_SHIFT;
@@ -555,7 +566,13 @@ void page_node::add_region(uintptr_t base, size_t size)
 template <typename Callable>
 bool for_every_node(Callable c)
 {
-    return c(main_node);
+    for (unsigned int i = 0; i < nr_numa_nodes; i++)
+    {
+        if (!c(page_nodes[i]))
+            return false;
+    }
+
+    return true;
 }
 
 static bool page_has_low_memory()
@@ -585,7 +602,7 @@ unsigned long pages_under_high_watermark()
 
             if (freep <= zone->low_watermark)
                 result += zone->high_watermark - freep;
-            return false;
+            return true;
         });
     });
     return result;
@@ -601,7 +618,7 @@ static void page_set_watermarks()
                 (PAGE_SIZE / 1024);
             zone->low_watermark = zone->min_watermark * 8;
             zone->high_watermark = zone->low_watermark * 2;
-            printf("page: zone %s\n", zone->name);
+            printf("page: node %d zone %s\n", zone->nid, zone->name);
             printf("  min watermark %lu\n"
                    "  low watermark %lu\n"
                    "  high watermark %lu\n"
@@ -615,7 +632,9 @@ static void page_set_watermarks()
 
 void page_init(size_t memory_size, unsigned long maxpfn)
 {
-    main_node.init();
+    numa_init();
+    for (unsigned int i = 0; i < nr_numa_nodes; i++)
+        page_nodes[i].init(i);
 
     printf("page: Memory size: %lu\n", memory_size);
     page_memory_size = memory_size;
@@ -637,7 +656,9 @@ void page_init(size_t memory_size, unsigned long maxpfn)
         /* page_add_region can't return an error value since it halts
          * on failure
          */
-        main_node.add_region(start, size);
+        numa_for_each_range(start, size, [](unsigned long part, size_t part_size, int nid) {
+            page_nodes[nid].add_region(part, part_size);
+        });
     });
 
     min_free_kbytes =
@@ -762,7 +783,7 @@ void free_page(struct page *p)
 
     if (__page_unref(p) == 0)
     {
-        main_node.free_page(p);
+        page_nodes[page_to_nid(p)].free_page(p);
         // printf("free pages %p, %p\n", page_to_phys(p), __builtin_return_address(0));
     }
 #if 0
@@ -773,40 +794,6 @@ void free_page(struct page *p)
 #endif
 }
 
-struct page *page_node::allocate_pages(size_t nr_pgs, unsigned long flags)
-{
-    struct page *plist = NULL;
-    struct page *ptail = NULL;
-
-    for (size_t i = 0; i < nr_pgs; i++)
-    {
-        struct page *p = alloc_order(0, flags);
-
-        if (!p)
-        {
-            if (plist)
-                free_page_list(plist);
-
-            return nullptr;
-        }
-
-        if (!plist)
-        {
-            plist = ptail = p;
-        }
-        else
-        {
-            ptail->next_un.next_allocation = p;
-            ptail = p;
-        }
-    }
-
-    // printf("alloc pages %lu = %p, %p\n", nr_pgs, page_to_phys(plist),
-    // __builtin_return_address(0));
-
-    return plist;
-}
-
 __always_inline void prepare_pages_after_alloc(struct page *page, unsigned int order,
                                                unsigned long flags)
 {
@@ -843,9 +830,41 @@ __always_inline void prepare_pages_after_alloc(struct page *page, unsigned int o
 void stack_trace();
 
 struct page *page_node::alloc_order(unsigned int order, unsigned long flags)
+{
+    int zone = ZONE_NORMAL;
+
+    if (flags & PAGE_ALLOC_4GB_LIMIT)
+        zone = ZONE_DMA32;
+
+    for (; zone >= 0; zone--)
+    {
+        struct page *page = page_zone_alloc(&zones[zone], flags, order);
+        if (page)
+            return page;
+    }
+
+    return nullptr;
+}
+
+/**
+ * @brief Allocate pages from the nodes in nodemask, going through them in order of distance from
+ * nid. Only reclaims if none of them can satisfy the allocation.
+ *
+ * @param order Order of the allocation
+ * @param flags GFP flags
+ * @param nid Preferred node
+ * @param nodemask Nodes we may allocate from
+ * @return Allocated pages, or nullptr
+ */
+struct page *__alloc_pages_nodemask(unsigned int order, unsigned long flags, int nid,
+                                    unsigned long nodemask)
 {
     struct page *page = nullptr;
     unsigned int attempt = 0;
+    const u8 *node_order = numa_node_order(nid);
+
+    if (WARN_ON(order > PAGEALLOC_NR_ORDERS))
+        return nullptr;
 
     if (flags & __GFP_MAY_RECLAIM && !(flags & (__GFP_NOWAIT | __GFP_ATOMIC)))
     {
@@ -860,23 +879,16 @@ struct page *page_node::alloc_order(unsigned int order, unsigned long flags)
             goto failure;
         }
 
-        int zone = ZONE_NORMAL;
-
-        if (flags & PAGE_ALLOC_4GB_LIMIT)
-            zone = ZONE_DMA32;
-
-        while (zone >= 0)
+        for (unsigned int i = 0; i < nr_numa_nodes; i++)
         {
-            page = page_zone_alloc(&zones[zone], flags, order);
+            if (!(nodemask & (1UL << node_order[i])))
+                continue;
 
+            page = page_nodes[node_order[i]].alloc_order(order, flags);
             if (page)
                 goto out;
-            zone--;
         }
 
-        if (likely(page))
-            break;
-
         if (flags & __GFP_DIRECT_RECLAIM)
             do_direct_reclaim(order, attempt, flags);
         else if (flags & __GFP_WAKE_PAGEDAEMON)
@@ -895,9 +907,6 @@ struct page *page_node::alloc_order(unsigned int order, unsigned long flags)
         attempt++;
     }
 
-    if (unlikely(!page))
-        goto failure;
-
 out:
     prepare_pages_after_alloc(page, order, flags);
 
@@ -914,17 +923,26 @@ failure:
 
 struct page *alloc_pages(unsigned int order, unsigned long flags)
 {
-    auto &node = main_node;
-    if (WARN_ON(order > PAGEALLOC_NR_ORDERS))
-        return NULL;
+    return __alloc_pages_nodemask(order, flags, numa_node_id(), NUMA_NODEMASK_ALL);
+}
 
-    return node.alloc_order(order, flags);
+/**
+ * @brief Allocate pages, preferably from a given node. Falls back to other nodes, by distance.
+ *
+ * @param nid Node
+ * @param order Order of the allocation
+ * @param flags GFP flags
+ * @return Allocated pages, or nullptr
+ */
+struct page *alloc_pages_node(int nid, unsigned int order, unsigned long flags)
+{
+    return __alloc_pages_nodemask(order, flags, nid, NUMA_NODEMASK_ALL);
 }
 
 void __reclaim_page(struct page *new_page)
 {
     nr_global_pages.add_fetch(1, mem_order::release);
-    auto &node = main_node;
+    auto &node = page_nodes[page_to_nid(new_page)];
     node.add_region((unsigned long) page_to_phys(new_page), PAGE_SIZE);
 }
 
@@ -971,7 +989,33 @@ void page_node::free_page(struct page *p)
  */
 struct page *alloc_page_list(size_t nr_pages, unsigned int gfp_flags)
 {
-    return main_node.allocate_pages(nr_pages, gfp_flags);
+    struct page *plist = NULL;
+    struct page *ptail = NULL;
+
+    for (size_t i = 0; i < nr_pages; i++)
+    {
+        struct page *p = alloc_page(gfp_flags);
+
+        if (!p)
+        {
+            if (plist)
+                free_page_list(plist);
+
+            return nullptr;
+        }
+
+        if (!plist)
+        {
+            plist = ptail = p;
+        }
+        else
+        {
+            ptail->next_un.next_allocation = p;
+            ptail = p;
+        }
+    }
+
+    return plist;
 }
 
 /**
@@ -1014,11 +1058,6 @@ static void setup_pagedaemon()
 
 INIT_LEVEL_CORE_AFTER_SCHED_ENTRY(setup_pagedaemon);
 
-static struct page_zone *page_to_zone(struct page *page)
-{
-    return main_node.pick_zone((unsigned long) page_to_phys(page));
-}
-
 void inc_page_stat(struct page *page, enum page_stat stat)
 {
     struct page_zone *zone = page_to_zone(page);
@@ -1072,18 +1111,13 @@ unsigned long page_reclaim_target(gfp_t gfp, unsigned int order)
     /* Everything is over the high watermark. Check if we indeed can accomplish this allocation.
      * This does a slight emulation of alloc_page logic paths.
      */
-    int zone = ZONE_NORMAL;
+    const int top_zone = gfp & PAGE_ALLOC_4GB_LIMIT ? ZONE_DMA32 : ZONE_NORMAL;
 
-    if (gfp & PAGE_ALLOC_4GB_LIMIT)
-        zone = ZONE_DMA32;
-
-    while (zone >= 0)
-    {
-        may = page_zone_may_alloc(&main_node.zones[zone], gfp, order);
-        if (may)
-            break;
-        zone--;
-    }
+    for_every_node([&](page_node &node) -> bool {
+        for (int zone = top_zone; zone >= 0 && !may; zone--)
+            may = page_zone_may_alloc(&node.zones[zone], gfp, order);
+        return !may;
+    });
 
     if (may)
         return 0;
@@ -640,7 +640,8 @@ int page_do_reclaim(struct reclaim_data *data)
         /* Lets scale according to our desperation */
         if (nr_tries > 0)
             free_target *= nr_tries;
-        shrink_page_zones(data, &main_node);
+        for (unsigned int i = 0; i < nr_numa_nodes; i++)
+            shrink_page_zones(data, &page_nodes[i]);
         shrink_objects(data, free_target);
 #ifdef CONFIG_KASAN
         /* KASAN is likely to have a lot of objects under its wing, so flush it. */
@@ -10,6 +10,7 @@
 
 #include <onyx/cpu.h>
 #include <onyx/list.h>
+#include <onyx/mm/numa.h>
 #include <onyx/mm/slab.h>
 #include <onyx/modules.h>
 #include <onyx/page.h>
@@ -67,6 +68,7 @@ struct slab
     size_t active_objects;
     size_t nobjects;
     struct slab_cache *cache;
+    int nid;
 };
 
 #define SLAB_CANARY 0x00600DBAAE600DBA
@@ -164,8 +166,13 @@ struct slab_cache *kmem_cache_create(const char *name, size_t size, size_t align
 
     c->ctor = ctor;
 
-    INIT_LIST_HEAD(&c->free_slabs);
-    INIT_LIST_HEAD(&c->partial_slabs);
+    for (int i = 0; i < CONFIG_NUMA_NR_NODES; i++)
+    {
+        INIT_LIST_HEAD(&c->nodes[i].free_slabs);
+        INIT_LIST_HEAD(&c->nodes[i].partial_slabs);
+        c->nodes[i].npartialslabs = c->nodes[i].nfreeslabs = 0;
+    }
+
     INIT_LIST_HEAD(&c->full_slabs);
     spinlock_init(&c->lock);
     c->nr_objects = 0;
@@ -224,10 +231,15 @@ __noinline static void kmem_dump_cache_debug(struct slab_cache *cache)
     panic_start();
     mutex_lock(&dump_cache_lock);
     printk("slab: dumping cache %s - %p\n", cache->name, cache);
-    printk("      nfreeslabs %lu, calculated %lu\n", cache->nfreeslabs,
-           list_calc_len(&cache->free_slabs));
-    printk("      npartialslabs %lu, calculated %lu\n", cache->npartialslabs,
-           list_calc_len(&cache->partial_slabs));
+    printk("      nfreeslabs %lu, npartialslabs %lu\n", cache->nfreeslabs, cache->npartialslabs);
+    for (unsigned int i = 0; i < nr_numa_nodes; i++)
+    {
+        struct slab_cache_node *n = &cache->nodes[i];
+        printk("      node %u: nfreeslabs %lu, calculated %lu\n", i, n->nfreeslabs,
+               list_calc_len(&n->free_slabs));
+        printk("      node %u: npartialslabs %lu, calculated %lu\n", i, n->npartialslabs,
+               list_calc_len(&n->partial_slabs));
+    }
     printk("      nfullslabs %lu, calculated %lu\n", cache->nfullslabs,
            list_calc_len(&cache->full_slabs));
     panic("bah");
@@ -236,9 +248,19 @@ __noinline static void kmem_dump_cache_debug(struct slab_cache *cache)
 __attribute__((optimize("no-optimize-sibling-calls"))) __noinline static void
 kmem_assert_slab_count(struct slab_cache *cache)
 {
+    size_t nfree = 0, npartial = 0;
     DCHECK(spin_lock_held(&cache->lock));
-    KMEM_DCHECK(cache->nfreeslabs == list_calc_len(&cache->free_slabs), cache);
-    KMEM_DCHECK(cache->npartialslabs == list_calc_len(&cache->partial_slabs), cache);
+    for (unsigned int i = 0; i < nr_numa_nodes; i++)
+    {
+        struct slab_cache_node *n = &cache->nodes[i];
+        KMEM_DCHECK(n->nfreeslabs == list_calc_len(&n->free_slabs), cache);
+        KMEM_DCHECK(n->npartialslabs == list_calc_len(&n->partial_slabs), cache);
+        nfree += n->nfreeslabs;
+        npartial += n->npartialslabs;
+    }
+
+    KMEM_DCHECK(cache->nfreeslabs == nfree, cache);
+    KMEM_DCHECK(cache->npartialslabs == npartial, cache);
     KMEM_DCHECK(cache->nfullslabs == list_calc_len(&cache->full_slabs), cache);
 }
 
@@ -250,6 +272,24 @@ kmem_assert_slab_count(struct slab_cache *cache)
 // Note: We can simplify the below slab state transitions to free <-> partial <-> full
 // since each slab always has more than a single object.
 
+ALWAYS_INLINE static inline struct slab_cache_node *kmem_slab_node(struct slab *s)
+{
+    return &s->cache->nodes[s->nid];
+}
+
+/**
+ * @brief Add a new slab to its node's free list
+ * @pre cache is locked
+ * @param s Slab
+ */
+ALWAYS_INLINE static inline void kmem_add_free_slab(struct slab *s)
+{
+    struct slab_cache_node *n = kmem_slab_node(s);
+    list_add_tail(&s->slab_list_node, &n->free_slabs);
+    n->nfreeslabs++;
+    s->cache->nfreeslabs++;
+}
+
 /**
  * @brief Move a slab from its list to partial
  *
@@ -258,11 +298,16 @@ kmem_assert_slab_count(struct slab_cache *cache)
  */
 ALWAYS_INLINE static inline void kmem_move_slab_to_partial(struct slab *s, bool free)
 {
+    struct slab_cache_node *n = kmem_slab_node(s);
     list_remove(&s->slab_list_node);
-    list_add(&s->slab_list_node, &s->cache->partial_slabs);
+    list_add(&s->slab_list_node, &n->partial_slabs);
+    n->npartialslabs++;
     s->cache->npartialslabs++;
     if (free)
+    {
+        n->nfreeslabs--;
         s->cache->nfreeslabs--;
+    }
     else
         s->cache->nfullslabs--;
     ASSERT_SLAB_COUNT(s->cache);
@@ -275,12 +320,19 @@ ALWAYS_INLINE static inline void kmem_move_slab_to_partial(struct slab *s, bool
  */
 ALWAYS_INLINE static inline void kmem_move_slab_to_full(struct slab *s, bool free)
 {
+    struct slab_cache_node *n = kmem_slab_node(s);
     list_remove(&s->slab_list_node);
     list_add_tail(&s->slab_list_node, &s->cache->full_slabs);
     if (free)
+    {
+        n->nfreeslabs--;
         s->cache->nfreeslabs--;
+    }
     else
+    {
+        n->npartialslabs--;
         s->cache->npartialslabs--;
+    }
     s->cache->nfullslabs++;
     ASSERT_SLAB_COUNT(s->cache);
 }
@@ -292,8 +344,11 @@ ALWAYS_INLINE static inline void kmem_move_slab_to_full(struct slab *s, bool fre
  */
 ALWAYS_INLINE static inline void kmem_move_slab_to_free(struct slab *s)
 {
+    struct slab_cache_node *n = kmem_slab_node(s);
     list_remove(&s->slab_list_node);
-    list_add_tail(&s->slab_list_node, &s->cache->free_slabs);
+    list_add_tail(&s->slab_list_node, &n->free_slabs);
+    n->npartialslabs--;
+    n->nfreeslabs++;
     s->cache->npartialslabs--;
     s->cache->nfreeslabs++;
     ASSERT_SLAB_COUNT(s->cache);
@@ -336,36 +391,6 @@ static void *kmem_cache_alloc_from_slab(struct slab *s, unsigned int flags)
     return kmem_bufctl_to_ptr(s->cache, ret);
 }
 
-/**
- * @brief Allocate an object from the first slab on the partial list
- *
- * @param cache Slab cache
- * @param flags Flags
- * @return Allocated object
- */
-static inline void *kmem_cache_alloc_from_partial(struct slab_cache *cache, unsigned int flags)
-{
-    struct slab *s =
-        container_of(list_first_element(&cache->partial_slabs), struct slab, slab_list_node);
-
-    return kmem_cache_alloc_from_slab(s, flags);
-}
-
-/**
- * @brief Allocate an object from the first slab on the free list
- *
- * @param cache Slab cache
- * @param flags Flags
- * @return Allocated object
- */
-static inline void *kmem_cache_alloc_from_free(struct slab_cache *cache, unsigned int flags)
-{
-    struct slab *s =
-        container_of(list_first_element(&cache->free_slabs), struct slab, slab_list_node);
-
-    return kmem_cache_alloc_from_slab(s, flags);
-}
-
 /**
  * @brief Calculate the size of each slab for a given slab cache
  *
@@ -574,11 +599,11 @@ NO_ASAN static struct slab *kmem_cache_create_slab(struct slab_cache *cache, uns
         slab->start = start;
 
     slab->size = slab_size;
+    slab->nid = page_to_nid(kmem_pointer_to_page(start));
 
     if (!no_add)
     {
-        list_add_tail(&slab->slab_list_node, &cache->free_slabs);
-        cache->nfreeslabs++;
+        kmem_add_free_slab(slab);
         ASSERT_SLAB_COUNT(cache);
     }
 
@@ -616,8 +641,7 @@ static void *kmem_cache_alloc_noslab(struct slab_cache *cache, unsigned int flag
         return NULL;
 
     /* TODO: This is redundant but alloc_from_slab insists on *moving* us from/to lists */
-    list_add_tail(&s->slab_list_node, &cache->free_slabs);
-    cache->nfreeslabs++;
+    kmem_add_free_slab(s);
     ASSERT_SLAB_COUNT(cache);
     void *obj = kmem_cache_alloc_from_slab(s, flags);
     DCHECK(obj != NULL);
@@ -625,6 +649,37 @@ static void *kmem_cache_alloc_noslab(struct slab_cache *cache, unsigned int flag
     return obj;
 }
 
+/**
+ * @brief Pick a slab to allocate from
+ * Slabs on our node come first, then the ones on the closest nodes. New slabs will come from our
+ * node anyway, so this only goes remote if there's nothing local.
+ * @pre @cache is locked
+ * @param cache Slab cache
+ * @return Chosen slab, or NULL if there's no available slab
+ */
+static inline struct slab *kmem_pick_slab(struct slab_cache *cache)
+{
+    /* Pick out a slab from the partial list, or the free list. Prefer partial to reduce
+     * fragmentation. */
+    const u8 *order;
+
+    if (!cache->npartialslabs && !cache->nfreeslabs)
+        return NULL;
+
+    order = numa_node_order(numa_node_id());
+    for (unsigned int i = 0; i < nr_numa_nodes; i++)
+    {
+        struct slab_cache_node *n = &cache->nodes[order[i]];
+        if (n->npartialslabs)
+            return container_of(list_first_element(&n->partial_slabs), struct slab,
+                                slab_list_node);
+        if (n->nfreeslabs)
+            return container_of(list_first_element(&n->free_slabs), struct slab, slab_list_node);
+    }
+
+    return NULL;
+}
+
 /**
  * @brief Allocate an object from the slab
  * This function is used when slab caches opt out of percpu allocation.
@@ -635,13 +690,13 @@ static void *kmem_cache_alloc_noslab(struct slab_cache *cache, unsigned int flag
  */
 void *kmem_cache_alloc_nopcpu(struct slab_cache *cache, unsigned int flags)
 {
+    struct slab *slab;
     void *ptr;
 
     spin_lock(&cache->lock);
-    if (cache->npartialslabs != 0)
-        ptr = kmem_cache_alloc_from_partial(cache, flags);
-    else if (cache->nfreeslabs != 0)
-        ptr = kmem_cache_alloc_from_free(cache, flags);
+    slab = kmem_pick_slab(cache);
+    if (slab)
+        ptr = kmem_cache_alloc_from_slab(slab, flags);
     else
         ptr = kmem_cache_alloc_noslab(cache, flags);
 
@@ -651,26 +706,6 @@ void *kmem_cache_alloc_nopcpu(struct slab_cache *cache, unsigned int flags)
     return ptr;
 }
 
-/**
- * @brief Pick a slab to refill from
- * @pre @cache is locked
- * @param cache Slab cache
- * @return Chosen slab, or NULL if there's no available slab
- */
-static inline struct slab *kmem_pick_slab_for_refill(struct slab_cache *cache)
-{
-    /* Cache is locked */
-    /* Pick out a slab from the partial list, or the free list. Prefer partial to reduce
-     * fragmentation. */
-    struct slab *slab = NULL;
-    if (cache->npartialslabs)
-        slab = container_of(list_first_element(&cache->partial_slabs), struct slab, slab_list_node);
-    else if (cache->nfreeslabs)
-        slab = container_of(list_first_element(&cache->free_slabs), struct slab, slab_list_node);
-
-    return slab;
-}
-
 /**
  * @brief Add a slab's objects to the pcpu magazine
  *
@@ -728,7 +763,7 @@ static int kmem_cache_refill_mag_noalloc(struct slab_cache *cache,
     while (pcpu->size < batch_size)
     {
         bool is_partial;
-        struct slab *slab = kmem_pick_slab_for_refill(cache);
+        struct slab *slab = kmem_pick_slab(cache);
         if (!slab)
         {
             int to_alloc = (batch_size - pcpu->size) / objs_per_slab;
@@ -823,9 +858,12 @@ static int kmem_cache_alloc_refill_mag(struct slab_cache *cache,
     __atomic_store_n(&pcpu->touched, 1, __ATOMIC_RELAXED);
 
     spin_lock(&cache->lock);
-    /* Splice the allocated_slabs to free_slabs */
-    list_splice_tail(&allocated_slabs, &cache->free_slabs);
-    cache->nfreeslabs += nslabs;
+    /* Move the allocated_slabs to their nodes' free_slabs */
+    list_for_every_safe (&allocated_slabs)
+    {
+        list_remove(l);
+        kmem_add_free_slab(container_of(l, struct slab, slab_list_node));
+    }
 
     kmem_cache_refill_mag_noalloc(cache, pcpu);
     DCHECK(pcpu->size > 0);
@@ -1062,6 +1100,7 @@ static void kmem_free_to_slab(struct slab_cache *cache, struct slab *slab, void
             // Free the slab, since these objects are way too large
             // we may as well assume they're a one-off allocation, as they
             // usually are.
+            kmem_slab_node(slab)->npartialslabs--;
             kmem_cache_free_slab(slab);
             cache->npartialslabs--;
             ASSERT_SLAB_COUNT(cache);
@@ -1456,15 +1495,20 @@ static unsigned long kmem_cache_release_free_all(struct slab_cache *cache,
 
     unsigned long freed = 0;
 
-    list_for_every_safe (&cache->free_slabs)
+    for (unsigned int i = 0; i < nr_numa_nodes && freed < target_freep; i++)
     {
-        struct slab *s = container_of(l, struct slab, slab_list_node);
-        if (freed >= target_freep)
-            break;
-        size_t slab_pages = s->size >> PAGE_SHIFT;
-        kmem_cache_free_slab(s);
-        cache->nfreeslabs--;
-        freed += slab_pages;
+        struct slab_cache_node *n = &cache->nodes[i];
+        list_for_every_safe (&n->free_slabs)
+        {
+            struct slab *s = container_of(l, struct slab, slab_list_node);
+            if (freed >= target_freep)
+                break;
+            size_t slab_pages = s->size >> PAGE_SHIFT;
+            kmem_cache_free_slab(s);
+            n->nfreeslabs--;
+            cache->nfreeslabs--;
+            freed += slab_pages;
+        }
     }
 
     ASSERT_SLAB_COUNT(cache);
@@ -266,6 +266,8 @@ void vm_late_init()
 
     kmalloc_init();
 
+    /* vmalloc keeps its regions in a maple tree, so nothing may vmalloc before this (kmalloc_init
+     * only creates the caches) */
     maple_tree_init();
     vm_area_struct_cache =
         kmem_cache_create("vm_area_struct", sizeof(struct vm_area_struct), 0, 0, NULL);
@@ -408,27 +410,45 @@ int vm_clone_as(struct mm_address_space *addr_space, struct mm_address_space *or
     return err;
 }
 
+/**
+ * @brief Check if a forked VMA can start out with empty page tables
+ * Private file mappings that never got anonymous pages (nothing was ever CoW'd) can refault
+ * everything back in from the page cache. Not copying their page tables makes fork() cost
+ * proportional to the anonymous memory, and the child is likely to exec() anyway.
+ *
+ * @param vma Parent's VMA
+ * @return True if we can skip mmu_fork_tables()
+ */
+static bool fork_can_refault(struct vm_area_struct *vma)
+{
+    return vma_private(vma) && vma->vm_file && !vma->anon_vma && !vma_is_pfnmap(vma);
+}
+
 #define DEBUG_FORK_VM 0
-static bool fork_vm_area_struct(struct vm_area_struct *region, struct mm_address_space *mm)
+static int fork_vm_area_struct(struct vm_area_struct *region, struct mm_address_space *mm,
+                               struct ma_state *mas, struct mmu_fork_batch *batch)
 {
     bool is_private;
-    bool res;
 
     struct vm_area_struct *new_region = vma_alloc();
     if (!new_region)
-        return false;
+        return -ENOMEM;
 
     memcpy(new_region, region, sizeof(*region));
-    /* TODO: mtree dup */
 
 #if DEBUG_FORK_VM
     printk("Forking [%016lx, %016lx] perms %x\n", region->base,
            region->base + (region->pages << PAGE_SHIFT) - 1, region->rwx);
 #endif
 
-    res = vm_insert_region(mm, new_region);
-
-    assert(res == true);
+    /* The tree was duplicated wholesale, replace the parent's entry with ours. Same range, so
+     * this just overwrites the slot. */
+    mas_store(mas, new_region);
+    if (mas_is_err(mas))
+    {
+        vma_free(new_region);
+        return -ENOMEM;
+    }
 
     if (new_region->anon_vma)
         anon_vma_link(new_region->anon_vma, new_region);
@@ -455,12 +475,12 @@ static bool fork_vm_area_struct(struct vm_area_struct *region, struct mm_address
 
     new_region->vm_mm = mm;
 
-    if (mmu_fork_tables(region, mm) < 0)
-        return false;
+    if (!fork_can_refault(region) && mmu_fork_tables(region, mm, batch) < 0)
+        return -ENOMEM;
 #ifdef CONFIG_DEBUG_ADDRESS_SPACE_ACCT
     mmu_verify_address_space_accounting(mm);
 #endif
-    return true;
+    return 0;
 }
 
 static void addr_space_delete(struct vm_area_struct *region) NO_THREAD_SAFETY_ANALYSIS
@@ -484,9 +504,14 @@ static void tear_down_addr_space(struct mm_address_space *addr_space)
     mt_for_each (&addr_space->region_tree, entry_, index, -1UL)
     {
         entry = (struct vm_area_struct *) entry_;
+        /* Past the point where we failed, the duplicated tree still points to the parent's
+         * VMAs. Those are not ours to touch. */
+        if (entry->vm_mm != addr_space)
+            break;
         addr_space_delete(entry);
     }
 
+    mtree_destroy(&addr_space->region_tree);
     paging_free_page_tables(addr_space);
 }
 
@@ -516,20 +541,36 @@ int vm_fork_address_space(struct mm_address_space *addr_space) EXCLUDES(addr_spa
     addr_space->resident_set_size = 0;
     addr_space->virtual_memory_size = current_mm->virtual_memory_size;
 
+    /* Copy the whole maple tree in one go (node by node, instead of inserting every VMA and
+     * rebalancing as we go). Every entry then gets swapped for the child's copy of the VMA. */
+    if (__mt_dup(&current_mm->region_tree, &addr_space->region_tree, GFP_KERNEL) < 0)
+    {
+        paging_free_page_tables(addr_space);
+        err = -ENOMEM;
+        goto out;
+    }
+
     struct vm_area_struct *entry;
     void *entry_;
-    unsigned long index = 0;
-    mt_for_each (&current_mm->region_tree, entry_, index, -1UL)
+    struct mmu_fork_batch batch;
+    mmu_fork_batch_init(&batch);
+    MA_STATE(mas, &addr_space->region_tree, 0, 0);
+
+    mas_for_each(&mas, entry_, -1UL)
     {
         entry = (struct vm_area_struct *) entry_;
-        if (!fork_vm_area_struct(entry, addr_space))
+        if (fork_vm_area_struct(entry, addr_space, &mas, &batch) < 0)
         {
+            mmu_fork_batch_end(&batch);
             tear_down_addr_space(addr_space);
             err = -ENOMEM;
             goto out;
         }
     }
 
+    /* Everything is write-protected, flush the parent's TLB once */
+    mmu_fork_batch_end(&batch);
+
     addr_space->shared_set_size = current_mm->shared_set_size;
 
     /* We add the old ones here because rss will only be incremented by pages that were newly
@@ -593,7 +634,9 @@ static bool vma_can_merge_into(struct vm_area_struct *vma, size_t size, int vm_f
             return false;
     }
 
-    return vma->vm_flags == vm_flags && vma->vm_file == file;
+    /* New mappings get the default policy */
+    return vma->vm_flags == vm_flags && vma->vm_file == file &&
+           vma->vm_policy.mode == MPOL_DEFAULT;
 }
 
 static void vma_post_adjust(struct vm_area_struct *vma)
@@ -976,6 +1019,7 @@ static void vm_copy_region(const struct vm_area_struct *source, struct vm_area_s
         vmo_ref(dest->vm_obj);
     dest->anon_vma = source->anon_vma;
     dest->vm_ops = source->vm_ops;
+    dest->vm_policy = source->vm_policy;
 }
 
 static void vma_pre_adjust(struct vm_area_struct *vma)
@@ -6,162 +6,126 @@
  * SPDX-License-Identifier: GPL-2.0-only
  */
 
-#include <lib/binary_search_tree.h>
-
+#include <onyx/local_lock.h>
+#include <onyx/maple_tree.h>
 #include <onyx/mm/kasan.h>
+#include <onyx/paging.h>
+#include <onyx/percpu.h>
 #include <onyx/spinlock.h>
 #include <onyx/vm.h>
 
 #include <onyx/mm/pool.hpp>
 #include <onyx/utility.hpp>
 
+/* Freed ranges get their PTEs cleared right away, but stay reserved until we've parked this many
+ * pages worth of them. They're then flushed out of the TLB with a single shootdown. */
+#define VMALLOC_LAZY_MAX_PAGES ((32UL * 1024 * 1024) >> PAGE_SHIFT)
+
 struct vmalloc_tree
 {
-    struct bst_root root;
+    /* Regions, indexed by address range. Lookups are lockless (RCU), modifications go through
+     * the tree's own lock. */
+    struct maple_tree mt;
+    /* Protects the lazy list */
     struct spinlock lock;
+    struct list_head lazy_list;
+    unsigned long lazy_pages;
     unsigned long start;
     unsigned long length;
-} vmalloc_tree;
+} vmalloc_tree = {
+    .mt = MTREE_INIT(vmalloc_tree.mt, MT_FLAGS_ALLOC_RANGE | MT_FLAGS_USE_RCU),
+    .lazy_list = LIST_HEAD_INIT(vmalloc_tree.lazy_list),
+};
 
 struct vmalloc_region
 {
     unsigned long addr;
     size_t pages;
-    struct bst_node tree_node;
     int perms;
+    /* Set once the region is vfree'd and waiting to be purged */
+    bool lazy;
+    struct list_head lazy_node;
     page *backing_pgs;
 };
 
-/* Adapted from vm.cpp */
+static memory_pool<vmalloc_region> pool;
 
 /**
- * @brief Allocates a base for a new vmalloc region
- * Note that this function does not check if the base + size >= end of vmalloc.
- *
- * @param as Address space
- * @param min Minimum address
- * @param size Size of the region
- * @return New base
+ * @brief Flush every lazily freed region out of the TLB and release their address ranges
  */
-static unsigned long vmalloc_allocate_base(struct vmalloc_tree *as, unsigned long min, size_t size)
+static void vmalloc_purge_lazy()
 {
-    MUST_HOLD_LOCK(&as->lock);
-
-    min = cul::max(min, as->start);
-
-    struct a : bst_node
-    {
-        unsigned long min;
-    } priv;
-
-    priv.min = min;
-
-    auto compare = [](bst_node *node0, bst_node *fake) -> int {
-        struct a *priv = (a *) fake;
-        auto reg = container_of(node0, vmalloc_region, tree_node);
-        auto end = reg->addr + (reg->pages << PAGE_SHIFT) - 1;
-        if (check_for_overlap(reg->addr, end, priv->min, priv->min + PAGE_SIZE))
-            return 0;
-        else if (end >= priv->min)
-            return -1;
-        else // if (end < priv->min)
-            return 1;
-    };
-
-    struct bst_node *node = nullptr;
-    unsigned long last_end = min;
-    struct vmalloc_region *f = nullptr;
-
-    if (min != as->start)
-    {
-        node = bst_search(&as->root, &priv, compare);
-    }
-    else
-    {
-        node = bst_min(&as->root, nullptr);
-    }
+    DEFINE_LIST(purge);
+    unsigned long start = -1UL, end = 0;
 
-    if (!node)
-        goto done;
+    spin_lock(&vmalloc_tree.lock);
+    list_move(&purge, &vmalloc_tree.lazy_list);
+    vmalloc_tree.lazy_pages = 0;
+    spin_unlock(&vmalloc_tree.lock);
 
-    /* Check if there's a gap between the first node
-     * and the start of the address space
-     */
+    if (list_is_empty(&purge))
+        return;
 
-    f = container_of(node, vmalloc_region, tree_node);
-
-#if DEBUG_VM_1
-    printk("Tiniest node: %016lx\n", f->addr);
-#endif
-    if (f->addr - min >= size)
+    list_for_every (&purge)
     {
-#if DEBUG_VM_2
-        printk("gap [%016lx - %016lx]\n", min, f->addr);
-#endif
-        goto done;
+        struct vmalloc_region *reg = container_of(l, struct vmalloc_region, lazy_node);
+        start = cul::min(start, reg->addr);
+        end = cul::max(end, reg->addr + (reg->pages << PAGE_SHIFT));
     }
 
-    while (node)
-    {
-        f = container_of(node, vmalloc_region, tree_node);
-        last_end = f->addr + (f->pages << PAGE_SHIFT);
-
-        node = bst_next(&as->root, node);
-        if (!node)
-            break;
-
-        struct vmalloc_region *vm = container_of(node, vmalloc_region, tree_node);
+    /* A single shootdown for the whole span. Large ranges turn into a full flush anyway. */
+    mmu_invalidate_range(start, (end - start) >> PAGE_SHIFT, &kernel_address_space);
 
-        if (vm->addr - last_end >= size && min <= vm->addr)
-            break;
+    list_for_every_safe (&purge)
+    {
+        struct vmalloc_region *reg = container_of(l, struct vmalloc_region, lazy_node);
+        CHECK(mtree_erase(&vmalloc_tree.mt, reg->addr) == reg);
+        pool.free(reg);
     }
-
-done:
-    last_end = last_end < min ? min : last_end;
-
-    return last_end;
 }
 
-static memory_pool<vmalloc_region> pool;
-
 /**
- * @brief Create and insert a new vmalloc region to the tree
+ * @brief Reserve address space for a new region and insert it into the tree
  *
- * @param tree Tree
- * @param start Start of the region
+ * @param reg Region (addr is filled in)
  * @param pages Number of pages of the region
  * @param perms Permissions
  * @param gfp_flags GFP flags
- * @return Pointer to a vmalloc_region, or nullptr
+ * @return 0 on success, negative error code
  */
-static struct vmalloc_region *vmalloc_insert_region(struct vmalloc_tree *tree,
-                                                    struct vmalloc_region *reg, unsigned long start,
-                                                    size_t pages, int perms, unsigned int gfp_flags)
+static int vmalloc_insert_region(struct vmalloc_region *reg, size_t pages, int perms,
+                                 unsigned int gfp_flags)
 {
-    reg->addr = start;
+    unsigned long start;
+    bool purged = false;
+    int err;
+
     reg->pages = pages;
     reg->perms = perms;
-    bst_node_initialize(&reg->tree_node);
-    auto success = bst_insert(
-        &tree->root, &reg->tree_node, [](struct bst_node *lhs_, struct bst_node *rhs_) -> int {
-            auto lhs = container_of(lhs_, vmalloc_region, tree_node);
-            auto rhs = container_of(rhs_, vmalloc_region, tree_node);
-
-            if (check_for_overlap(lhs->addr, lhs->addr + (lhs->pages << PAGE_SHIFT) - 1, rhs->addr,
-                                  rhs->addr + (rhs->pages << PAGE_SHIFT) - 1))
-            {
-                panic("vmalloc: Region [%lx, %lx] and [%lx, %lx] overlap\n", lhs->addr,
-                      lhs->addr + (lhs->pages << PAGE_SHIFT), rhs->addr,
-                      rhs->addr + (rhs->pages << PAGE_SHIFT));
-                return 0;
-            }
-            else if (rhs->addr > lhs->addr)
-                return 1;
-            else
-                return -1;
-        });
-    assert(success == true);
-    return reg;
+    reg->lazy = false;
+    reg->backing_pgs = nullptr;
+
+retry:
+    err = mtree_alloc_range(&vmalloc_tree.mt, &start, reg, pages << PAGE_SHIFT, vmalloc_tree.start,
+                            vmalloc_tree.start + vmalloc_tree.length - 1, gfp_flags);
+    if (err == -EBUSY && !purged)
+    {
+        /* Out of address space, maybe lazily freed regions are holding some up */
+        vmalloc_purge_lazy();
+        purged = true;
+        goto retry;
+    }
+
+    if (err)
+        return err == -EBUSY ? -ENOMEM : err;
+    reg->addr = start;
+    return 0;
+}
+
+static void vmalloc_remove_region(struct vmalloc_region *reg)
+{
+    CHECK(mtree_erase(&vmalloc_tree.mt, reg->addr) == reg);
+    pool.free(reg);
 }
 
 /**
@@ -195,41 +159,25 @@ void *vmalloc(size_t pages, int type, int perms, unsigned int gfp_flags)
         alloc_off = PAGE_SIZE;
     }
 
-    scoped_lock g{vmalloc_tree.lock};
-    auto start = vmalloc_allocate_base(&vmalloc_tree, 0, (pages + guard_pages) << PAGE_SHIFT);
-
-    if (start + ((pages + guard_pages) << PAGE_SHIFT) > vmalloc_tree.start + vmalloc_tree.length)
+    int err = vmalloc_insert_region(reg, pages + guard_pages, perms, gfp_flags);
+    if (err)
     {
         free_page_list(pgs);
         pool.free(reg);
-        return errno = ENOMEM, nullptr;
+        return errno = -err, nullptr;
     }
 
-    auto vmal_reg = vmalloc_insert_region(&vmalloc_tree, reg, start, pages + guard_pages, perms,
-                                          gfp_flags | PAGE_ALLOC_NO_SANITIZER_SHADOW);
-    if (!vmal_reg)
-    {
-        free_page_list(pgs);
-        pool.free(reg);
-        return errno = ENOMEM, nullptr;
-    }
-
-    auto delvmr = [vmal_reg]() {
-        bst_delete(&vmalloc_tree.root, &vmal_reg->tree_node);
-        pool.free(vmal_reg);
-    };
-
 #ifdef CONFIG_KASAN
-    if (kasan_alloc_shadow(vmal_reg->addr, (pages + guard_pages) << PAGE_SHIFT, true) < 0)
+    if (kasan_alloc_shadow(reg->addr, (pages + guard_pages) << PAGE_SHIFT, true) < 0)
     {
-        delvmr();
+        vmalloc_remove_region(reg);
         free_page_list(pgs);
         return errno = ENOMEM, nullptr;
     }
     if (guard_pages)
     {
-        asan_poison_shadow(vmal_reg->addr, PAGE_SIZE, KASAN_LEFT_REDZONE);
-        asan_poison_shadow(vmal_reg->addr + (vmal_reg->pages << PAGE_SHIFT) - PAGE_SIZE, PAGE_SIZE,
+        asan_poison_shadow(reg->addr, PAGE_SIZE, KASAN_LEFT_REDZONE);
+        asan_poison_shadow(reg->addr + (reg->pages << PAGE_SHIFT) - PAGE_SIZE, PAGE_SIZE,
                            KASAN_REDZONE);
     }
 #endif
@@ -237,23 +185,22 @@ void *vmalloc(size_t pages, int type, int perms, unsigned int gfp_flags)
     page *it = pgs;
     for (size_t i = 0; i < pages; i++, it = it->next_un.next_allocation)
     {
-        bool success =
-            vm_map_page(&kernel_address_space, vmal_reg->addr + alloc_off + (i << PAGE_SHIFT),
-                        (uint64_t) page_to_phys(it), vmal_reg->perms, nullptr) != nullptr;
+        bool success = vm_map_page(&kernel_address_space, reg->addr + alloc_off + (i << PAGE_SHIFT),
+                                   (uint64_t) page_to_phys(it), reg->perms, nullptr) != nullptr;
         if (!success)
         {
             free_page_list(pgs);
-            vm_mmu_unmap(&kernel_address_space, (void *) vmal_reg->addr, i, nullptr);
-            delvmr();
+            vm_mmu_unmap(&kernel_address_space, (void *) reg->addr, reg->pages, nullptr);
+            vmalloc_remove_region(reg);
             return errno = ENOMEM, nullptr;
         }
 
-        *(char *) (vmal_reg->addr + alloc_off + (i << PAGE_SHIFT)) = 0;
+        *(char *) (reg->addr + alloc_off + (i << PAGE_SHIFT)) = 0;
     }
 
-    vmal_reg->backing_pgs = pgs;
+    reg->backing_pgs = pgs;
 
-    return (void *) (vmal_reg->addr + alloc_off);
+    return (void *) (reg->addr + alloc_off);
 }
 
 /**
@@ -264,30 +211,14 @@ void *vmalloc(size_t pages, int type, int perms, unsigned int gfp_flags)
  */
 static struct vmalloc_region *vfind(void *ptr)
 {
-    struct vmalloc_region fake;
-    fake.addr = (unsigned long) ptr;
-    fake.pages = 1;
-    bst_node_initialize(&fake.tree_node);
-
-    auto node =
-        bst_search(&vmalloc_tree.root, &fake.tree_node,
-                   [](struct bst_node *lhs_, struct bst_node *rhs_) -> int {
-                       auto lhs = container_of(lhs_, vmalloc_region, tree_node);
-                       auto rhs = container_of(rhs_, vmalloc_region, tree_node);
-
-                       if (check_for_overlap(lhs->addr, lhs->addr + (lhs->pages << PAGE_SHIFT) - 1,
-                                             rhs->addr, rhs->addr + (rhs->pages << PAGE_SHIFT) - 1))
-                           return 0;
-                       else if (rhs->addr > lhs->addr)
-                           return 1;
-                       else
-                           return -1;
-                   });
-    return !node ? nullptr : container_of(node, vmalloc_region, tree_node);
+    auto reg = (struct vmalloc_region *) mtree_load(&vmalloc_tree.mt, (unsigned long) ptr);
+    return reg && !reg->lazy ? reg : nullptr;
 }
 
 /**
  * @brief Frees a region of memory previously allocated by vmalloc or mmiomap.
+ * The PTEs are cleared and the pages freed right away, but the TLB flush is deferred: the address
+ * range is parked until enough of them pile up, and then flushed in one go.
  *
  * @param ptr A pointer to the allocation.
  * @param pages The number of pages it consists in.
@@ -295,7 +226,6 @@ static struct vmalloc_region *vfind(void *ptr)
  */
 static void __vfree(void *ptr, bool is_mmiounmap)
 {
-    scoped_lock g{vmalloc_tree.lock};
     if ((unsigned long) ptr & (PAGE_SIZE - 1))
         panic("vfree: Pointer %p not page aligned\n", ptr);
 
@@ -311,17 +241,24 @@ static void __vfree(void *ptr, bool is_mmiounmap)
     asan_poison_shadow((unsigned long) reg->addr, reg->pages << PAGE_SHIFT, KASAN_FREED);
 #endif
 
-    // First, free the pages, then unmap the memory, then finally unlink it
+    // Unmap the memory first, then free the pages. Stale TLB entries may still point at the pages
+    // until the purge, but no one may legitimately touch a freed range.
+    vm_mmu_unmap_noflush((void *) reg->addr, reg->pages);
+
     if (!is_mmiounmap && reg->backing_pgs)
         free_page_list(reg->backing_pgs);
-
-    vm_mmu_unmap(&kernel_address_space, (void *) reg->addr, reg->pages, nullptr);
-
-    // Remove the node from the tree
-    bst_delete(&vmalloc_tree.root, &reg->tree_node);
-
-    // and delete it
-    pool.free(reg);
+    reg->backing_pgs = nullptr;
+
+    bool purge;
+    spin_lock(&vmalloc_tree.lock);
+    reg->lazy = true;
+    list_add_tail(&reg->lazy_node, &vmalloc_tree.lazy_list);
+    vmalloc_tree.lazy_pages += reg->pages;
+    purge = vmalloc_tree.lazy_pages >= VMALLOC_LAZY_MAX_PAGES;
+    spin_unlock(&vmalloc_tree.lock);
+
+    if (purge)
+        vmalloc_purge_lazy();
 }
 
 /**
@@ -335,6 +272,82 @@ void vfree(void *ptr)
     return __vfree(ptr, false);
 }
 
+/* Threads come and go a lot (think fork + exit), keep a couple of their stacks around per cpu
+ * instead of going through vmalloc and vfree every time. */
+#define VMALLOC_STACK_CACHE_SIZE 2
+
+struct vmalloc_stack_cache
+{
+    void *stacks[VMALLOC_STACK_CACHE_SIZE];
+    size_t pages[VMALLOC_STACK_CACHE_SIZE];
+    unsigned int nr;
+};
+
+static PER_CPU_VAR(struct vmalloc_stack_cache stack_cache);
+static struct local_lock stack_cache_lock;
+
+/**
+ * @brief Allocate a kernel stack
+ * Stacks are surrounded by guard pages (see VM_TYPE_STACK), and recycled through a per-cpu cache.
+ *
+ * @param pages Size of the stack, in pages
+ * @param gfp_flags GFP flags
+ * @return A pointer to the base of the stack, or NULL with errno set on failure.
+ */
+void *vmalloc_stack(size_t pages, unsigned int gfp_flags)
+{
+    void *stack = nullptr;
+    unsigned long flags = local_lock_irqsave(&stack_cache_lock);
+    struct vmalloc_stack_cache *cache = get_per_cpu_ptr(stack_cache);
+
+    for (unsigned int i = 0; i < cache->nr; i++)
+    {
+        if (cache->pages[i] != pages)
+            continue;
+        stack = cache->stacks[i];
+        cache->nr--;
+        cache->stacks[i] = cache->stacks[cache->nr];
+        cache->pages[i] = cache->pages[cache->nr];
+        break;
+    }
+
+    local_unlock_irqrestore(&stack_cache_lock, flags);
+
+    if (!stack)
+        return vmalloc(pages, VM_TYPE_STACK, VM_READ | VM_WRITE, gfp_flags);
+
+#ifdef CONFIG_KASAN
+    /* The old thread's stack frames may have left redzones behind */
+    asan_unpoison_shadow((unsigned long) stack, pages << PAGE_SHIFT);
+#endif
+    return stack;
+}
+
+/**
+ * @brief Free a kernel stack allocated by vmalloc_stack
+ *
+ * @param stack Base of the stack
+ * @param pages Size of the stack, in pages
+ */
+void vfree_stack(void *stack, size_t pages)
+{
+    unsigned long flags = local_lock_irqsave(&stack_cache_lock);
+    struct vmalloc_stack_cache *cache = get_per_cpu_ptr(stack_cache);
+
+    if (cache->nr < VMALLOC_STACK_CACHE_SIZE)
+    {
+        cache->stacks[cache->nr] = stack;
+        cache->pages[cache->nr] = pages;
+        cache->nr++;
+        stack = nullptr;
+    }
+
+    local_unlock_irqrestore(&stack_cache_lock, flags);
+
+    if (stack)
+        vfree(stack);
+}
+
 /**
  * @brief Creates a mapping of MMIO memory.
  * Note: This function does not add any implicit caching behaviour by default.
@@ -351,43 +364,28 @@ void *mmiomap(void *phys, size_t size, size_t flags)
     if (!reg)
         return errno = ENOMEM, nullptr;
 
-    scoped_lock g{vmalloc_tree.lock};
-    auto start = vmalloc_allocate_base(&vmalloc_tree, 0, pages << PAGE_SHIFT);
-
-    if (start + (pages << PAGE_SHIFT) > vmalloc_tree.start + vmalloc_tree.length)
+    int err = vmalloc_insert_region(reg, pages, flags, GFP_KERNEL);
+    if (err)
     {
         pool.free(reg);
-        return errno = ENOMEM, nullptr;
+        return errno = -err, nullptr;
     }
 
-    auto vmal_reg = vmalloc_insert_region(&vmalloc_tree, reg, start, pages, flags,
-                                          GFP_KERNEL | PAGE_ALLOC_NO_SANITIZER_SHADOW);
-    if (!vmal_reg)
-    {
-        pool.free(reg);
-        return errno = ENOMEM, nullptr;
-    }
-
-    auto delvmr = [vmal_reg]() {
-        bst_delete(&vmalloc_tree.root, &vmal_reg->tree_node);
-        pool.free(vmal_reg);
-    };
-
 #ifdef CONFIG_KASAN
-    if (kasan_alloc_shadow(vmal_reg->addr, pages << PAGE_SHIFT, true) < 0)
+    if (kasan_alloc_shadow(reg->addr, pages << PAGE_SHIFT, true) < 0)
     {
-        delvmr();
+        vmalloc_remove_region(reg);
         return errno = ENOMEM, nullptr;
     }
 #endif
     unsigned long u = ((unsigned long) phys) & ~(PAGE_SIZE - 1);
     unsigned long p_off = ((unsigned long) phys) & (PAGE_SIZE - 1);
 
-    void *p = map_pages_to_vaddr((void *) vmal_reg->addr, (void *) u, size, flags | VM_NOFLUSH);
+    void *p = map_pages_to_vaddr((void *) reg->addr, (void *) u, size, flags | VM_NOFLUSH);
     if (!p)
     {
         printf("map_pages_to_vaddr: Could not map pages\n");
-        delvmr();
+        vmalloc_remove_region(reg);
         return errno = ENOMEM, nullptr;
     }
 
@@ -413,7 +411,6 @@ void mmiounmap(void *virt, size_t size)
  */
 void vmalloc_init(unsigned long start, unsigned long length)
 {
-    bst_root_initialize(&vmalloc_tree.root);
     vmalloc_tree.start = start;
     vmalloc_tree.length = length;
     spinlock_init(&vmalloc_tree.lock);
@@ -427,7 +424,6 @@ void vmalloc_init(unsigned long start, unsigned long length)
  */
 struct page *vmalloc_to_pages(void *ptr)
 {
-    scoped_lock g{vmalloc_tree.lock};
     auto reg = vfind(ptr);
     if (!reg)
         panic("vfree: Bad pointer %p not mapped\n", ptr);
@@ -0,0 +1,167 @@
+/*
+ * Copyright (c) 2024 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the GPLv2 License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#include <onyx/net/fib.h>
+#include <onyx/net/inet_route.h>
+
+unsigned long inet_route_gen;
+
+#ifdef CONFIG_KUNIT
+
+#include <onyx/byteswap.h>
+#include <onyx/clock.h>
+#include <onyx/kunit.h>
+#include <onyx/random.h>
+#include <onyx/vector.h>
+#include <onyx/vm.h>
+
+#define FIB_BENCH_PREFIXES 10000
+#define FIB_BENCH_LOOKUPS  1000000
+/* The linear scan is what we're replacing, don't spend forever timing it */
+#define FIB_BENCH_LINEAR_LOOKUPS 10000
+
+static bool fib_add_test_route(fib_trie<inet4_route, sizeof(in_addr_t)> &fib,
+                               cul::vector<inet4_route> &linear, in_addr_t dest, unsigned int plen,
+                               int metric)
+{
+    inet4_route *rt = (inet4_route *) kmalloc(sizeof(*rt), GFP_KERNEL);
+    if (!rt)
+        return false;
+
+    memset(rt, 0, sizeof(*rt));
+    rt->mask = plen ? htonl(~0U << (32 - plen)) : 0;
+    rt->dest = dest & rt->mask;
+    rt->metric = metric;
+    rt->nif = (netif *) (unsigned long) (linear.size() + 1);
+    if (!linear.push_back(*rt))
+    {
+        kfree(rt);
+        return false;
+    }
+
+    return fib.insert(rt, &rt->dest, plen) == 0;
+}
+
+static const inet4_route *fib_linear_lookup(cul::vector<inet4_route> &linear, in_addr_t dest)
+{
+    const inet4_route *best = nullptr;
+    int longest_prefix = -1;
+
+    for (auto &r : linear)
+    {
+        if ((dest & r.mask) != r.dest)
+            continue;
+        int mask_bits = count_bits(r.mask);
+        if (mask_bits > longest_prefix || (longest_prefix == mask_bits && r.metric > best->metric))
+        {
+            best = &r;
+            longest_prefix = mask_bits;
+        }
+    }
+
+    return best;
+}
+
+static bool fib_accept_any(const inet4_route *)
+{
+    return true;
+}
+
+TEST(fib, basic_lpm)
+{
+    fib_trie<inet4_route, sizeof(in_addr_t)> fib;
+    cul::vector<inet4_route> linear;
+
+    ASSERT_TRUE(fib_add_test_route(fib, linear, 0, 0, 1));
+    ASSERT_TRUE(fib_add_test_route(fib, linear, htonl(0x0a000000), 8, 1));
+    ASSERT_TRUE(fib_add_test_route(fib, linear, htonl(0x0a010000), 16, 1));
+    ASSERT_TRUE(fib_add_test_route(fib, linear, htonl(0x0a010200), 24, 1));
+    ASSERT_TRUE(fib_add_test_route(fib, linear, htonl(0x0a010200), 24, 5));
+
+    auto_rcu_lock g;
+    in_addr_t addr = htonl(0x0a010203);
+    const inet4_route *rt = fib.lookup(&addr, fib_accept_any);
+    ASSERT_NONNULL(rt);
+    EXPECT_EQ(rt->dest, htonl(0x0a010200));
+    EXPECT_EQ(rt->metric, 5);
+
+    addr = htonl(0x0a01ff01);
+    rt = fib.lookup(&addr, fib_accept_any);
+    ASSERT_NONNULL(rt);
+    EXPECT_EQ(rt->dest, htonl(0x0a010000));
+
+    addr = htonl(0x0b000001);
+    rt = fib.lookup(&addr, fib_accept_any);
+    ASSERT_NONNULL(rt);
+    EXPECT_EQ(rt->dest, 0U);
+}
+
+TEST(fib, bench_10k_prefixes)
+{
+    fib_trie<inet4_route, sizeof(in_addr_t)> fib;
+    cul::vector<inet4_route> linear;
+    ASSERT_TRUE(linear.reserve(FIB_BENCH_PREFIXES));
+
+    for (unsigned int i = 0; i < FIB_BENCH_PREFIXES; i++)
+    {
+        /* Mostly /16 - /24s, like a real table */
+        unsigned int plen = 16 + arc4random() % 9;
+        ASSERT_TRUE(fib_add_test_route(fib, linear, arc4random(), plen, arc4random() % 16));
+    }
+
+    /* Skew the addresses so a decent chunk of lookups actually hit something */
+    auto pick_addr = [&linear](unsigned int i) -> in_addr_t {
+        if (i & 1)
+            return arc4random();
+        return linear[arc4random() % linear.size()].dest | htonl(arc4random() & 0xff);
+    };
+
+    /* Check the trie against the linear scan first */
+    for (unsigned int i = 0; i < FIB_BENCH_LINEAR_LOOKUPS; i++)
+    {
+        in_addr_t addr = pick_addr(i);
+        const inet4_route *expected = fib_linear_lookup(linear, addr);
+        auto_rcu_lock g;
+        const inet4_route *rt = fib.lookup(&addr, fib_accept_any);
+        ASSERT_EQ(expected == nullptr, rt == nullptr);
+        if (rt)
+        {
+            EXPECT_EQ(expected->dest, rt->dest);
+            EXPECT_EQ(expected->mask, rt->mask);
+            EXPECT_EQ(expected->metric, rt->metric);
+        }
+    }
+
+    in_addr_t *addrs = (in_addr_t *) vmalloc(vm_size_to_pages(FIB_BENCH_LOOKUPS * sizeof(in_addr_t)),
+                                             VM_TYPE_REGULAR, VM_READ | VM_WRITE, GFP_KERNEL);
+    ASSERT_NONNULL(addrs);
+    for (unsigned int i = 0; i < FIB_BENCH_LOOKUPS; i++)
+        addrs[i] = pick_addr(i);
+
+    unsigned long hits = 0;
+    hrtime_t start = clocksource_get_time();
+    for (unsigned int i = 0; i < FIB_BENCH_LOOKUPS; i++)
+    {
+        auto_rcu_lock g;
+        hits += fib.lookup(&addrs[i], fib_accept_any) != nullptr;
+    }
+    hrtime_t trie_ns = clocksource_get_time() - start;
+
+    start = clocksource_get_time();
+    for (unsigned int i = 0; i < FIB_BENCH_LINEAR_LOOKUPS; i++)
+        hits += fib_linear_lookup(linear, addrs[i]) != nullptr;
+    hrtime_t linear_ns = clocksource_get_time() - start;
+
+    vfree(addrs);
+
+    pr_info("fib: %u prefixes: trie %lu lookups/s, linear scan %lu lookups/s (%lu hits)\n",
+            FIB_BENCH_PREFIXES, FIB_BENCH_LOOKUPS * NS_PER_SEC / (trie_ns ?: 1),
+            FIB_BENCH_LINEAR_LOOKUPS * NS_PER_SEC / (linear_ns ?: 1), hits);
+}
+
+#endif
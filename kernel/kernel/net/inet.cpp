@@ -6,6 +6,8 @@
  * SPDX-License-Identifier: GPL-2.0-only
  */
 
+#include <onyx/hybrid_lock.h>
+#include <onyx/net/fib.h>
 #include <onyx/net/icmp.h>
 #include <onyx/net/icmpv6.h>
 #include <onyx/net/ip.h>
@@ -148,6 +150,47 @@ void copy_msgname_to_user(struct msghdr *msg, packetbuf *buf, bool isv6, in_port
  * @param dst_addr Pointer to a destination sockaddr (should be sockaddr_storage wide)
  * @param len Pointer to wher eto put the length
  */
+/**
+ * @brief Cache a route to dest_addr
+ * Takes the socket lock, so senders never see a half-written route.
+ *
+ * @param route Route
+ * @param gen Routing table generation the route was looked up in
+ */
+void inet_socket::set_route_cache(const inet_route &route, unsigned long gen)
+{
+    scoped_hybrid_lock g{socket_lock, this};
+    route_cache = route;
+    route_cache_gen = gen;
+    route_cache_valid = 1;
+}
+
+/**
+ * @brief Get the cached route, looking it up again if the routing table changed since it was
+ * cached. The copy is done under the socket lock.
+ *
+ * @param route Where to copy the route to
+ * @return 0 on success, negative error code
+ */
+int inet_socket::revalidate_route_cache(inet_route &route)
+{
+    scoped_hybrid_lock g{socket_lock, this};
+    unsigned long gen = inet_route_generation();
+
+    if (route_cache_gen != gen) [[unlikely]]
+    {
+        auto result = get_proto_fam()->route(src_addr, dest_addr, effective_domain());
+        if (result.has_error())
+            return result.error();
+
+        route_cache = result.value();
+        route_cache_gen = gen;
+    }
+
+    route = route_cache;
+    return 0;
+}
+
 void inet_socket::copy_addr_to_sockaddr(const inet_sock_address &addr, sockaddr *dst_addr,
                                         socklen_t *len)
 {
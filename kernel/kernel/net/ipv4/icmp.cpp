@@ -14,6 +14,7 @@
 
 #include <onyx/byteswap.h>
 #include <onyx/cred.h>
+#include <onyx/net/fib.h>
 #include <onyx/net/icmp.h>
 #include <onyx/net/inet_proto.h>
 #include <onyx/net/ip.h>
@@ -205,6 +206,7 @@ int icmp_socket::connect(sockaddr *addr, socklen_t len, int flags)
 
     connected = true;
 
+    unsigned long gen = inet_route_generation();
     auto route_result = get_proto_fam()->route(src_addr, dest_addr, res.second);
 
     /* If we've got an error, ignore it. Is this correct/sane behavior? */
@@ -214,8 +216,7 @@ int icmp_socket::connect(sockaddr *addr, socklen_t len, int flags)
         return 0;
     }
 
-    route_cache = route_result.value();
-    route_cache_valid = 1;
+    set_route_cache(route_result.value(), gen);
 
     return 0;
 }
@@ -273,7 +274,8 @@ ssize_t icmp_socket::sendmsg(const struct msghdr *msg, int flags)
 
     if (connected && route_cache_valid)
     {
-        rt = route_cache;
+        if (int st = revalidate_route_cache(rt); st < 0)
+            return st;
     }
     else
     {
@@ -17,6 +17,7 @@
 #include <onyx/init.h>
 #include <onyx/net/arp.h>
 #include <onyx/net/ethernet.h>
+#include <onyx/net/fib.h>
 #include <onyx/net/icmp.h>
 #include <onyx/net/ip.h>
 #include <onyx/net/netif.h>
@@ -523,10 +524,9 @@ int bind_internal(sockaddr_in *in, inet_socket *sock)
 
         /* Check if there's any socket bound to this address yet, if we're not talking about ICMP.
          * ICMP allows you to bind multiple sockets, as they'll all receive the same packets.
+         * SO_REUSEPORT sockets may share it too.
          */
-        if (!proto_has_no_ports &&
-            sock_table->get_socket(id,
-                                   GET_SOCKET_CHECK_EXISTENCE | GET_SOCKET_UNLOCKED | extra_flags))
+        if (!proto_has_no_ports && sock_table->bind_conflicts(id, sock, extra_flags))
         {
             sock_table->unlock(hash);
             return -EADDRINUSE;
@@ -593,8 +593,7 @@ void unbind(inet_socket *sock)
     sock->proto_info->get_socket_table()->remove_socket(sock, 0);
 }
 
-rwslock routing_table_lock;
-cul::vector<shared_ptr<inet4_route>> routing_table;
+static fib_trie<inet4_route, sizeof(in_addr_t)> fib;
 
 expected<inet_route, int> route(const inet_sock_address &from, const inet_sock_address &to,
                                 int domain)
@@ -613,9 +612,6 @@ expected<inet_route, int> route(const inet_sock_address &from, const inet_sock_a
     /* Else, we're searching through the routing table to find the best interface to use in order
      * to reach our destination
      */
-    shared_ptr<inet4_route> best_route;
-    int highest_metric = 0;
-    int longest_prefix = -1;
     auto dest = to.in4.s_addr;
 
     // TODO: Multicast
@@ -635,52 +631,25 @@ expected<inet_route, int> route(const inet_sock_address &from, const inet_sock_a
         return r;
     }
 
-    routing_table_lock.lock_read();
+    inet_route r;
 
-    for (auto &r : routing_table)
     {
-        /* Do a bitwise and between the destination address and the mask
-         * If the result = r.dest, we can use this interface.
-         */
-        int mask_bits;
-#if 0
-        pr_info("dest %pI4, mask %pI4, supposed dest %pI4\n", &dest, &r->mask, &r->dest);
-#endif
-        if ((dest & r->mask) != r->dest)
-            continue;
-
-        if (required_netif && r->nif != required_netif)
-            continue;
-#if 0
-        pr_info("%s is good\n", r->nif->name);
-        pr_info("is loopback set %u\n", r->nif->flags & NETIF_LOOPBACK);
-        if (r->flags & INET4_ROUTE_FLAG_GATEWAY)
-            pr_info("gateway %pI4\n", &r->gateway);
-#endif
-        /* TODO: This can and should be computed beforehand */
-        mask_bits = count_bits(r->mask);
-
-        if (mask_bits > longest_prefix ||
-            (longest_prefix == mask_bits && r->metric > highest_metric))
-        {
-            best_route = r;
-            highest_metric = r->metric;
-            longest_prefix = mask_bits;
-        }
+        auto_rcu_lock g;
+        const inet4_route *best_route = fib.lookup(&dest, [required_netif](const inet4_route *rt) {
+            return !required_netif || rt->nif == required_netif;
+        });
+
+        if (!best_route)
+            return unexpected<int>{-ENETUNREACH};
+
+        r.nif = best_route->nif;
+        r.mask.in4.s_addr = best_route->mask;
+        r.flags = best_route->flags;
+        r.gateway_addr.in4.s_addr = best_route->gateway;
     }
 
-    routing_table_lock.unlock_read();
-
-    if (!best_route)
-        return unexpected<int>{-ENETUNREACH};
-
-    inet_route r;
     r.dst_addr.in4 = to.in4;
-    r.nif = best_route->nif;
-    r.mask.in4.s_addr = best_route->mask;
     r.src_addr.in4.s_addr = r.nif->local_ip.sin_addr.s_addr;
-    r.flags = best_route->flags;
-    r.gateway_addr.in4.s_addr = best_route->gateway;
 
     if (addr_is_broadcast(to.in4.s_addr, r))
         r.flags |= INET4_ROUTE_FLAG_BROADCAST;
@@ -700,15 +669,24 @@ expected<inet_route, int> route(const inet_sock_address &from, const inet_sock_a
 
 bool add_route(inet4_route &route)
 {
-    scoped_rwslock<rw_lock::write> g{routing_table_lock};
+    int plen = fib_mask_to_prefix(&route.mask, sizeof(route.mask));
+    if (plen < 0)
+        return false;
 
-    auto ptr = make_shared<inet4_route>();
+    auto ptr = (inet4_route *) kmalloc(sizeof(inet4_route), GFP_KERNEL);
     if (!ptr)
         return false;
 
-    memcpy(ptr.get(), &route, sizeof(route));
+    memcpy(ptr, &route, sizeof(route));
+    ptr->dest &= ptr->mask;
 
-    return routing_table.push_back(ptr);
+    if (fib.insert(ptr, &ptr->dest, plen) < 0)
+    {
+        kfree(ptr);
+        return false;
+    }
+
+    return true;
 }
 
 static const struct inet_proto_family v4_protocol = {
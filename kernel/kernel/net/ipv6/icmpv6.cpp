@@ -8,6 +8,7 @@
 #include <errno.h>
 
 #include <onyx/cred.h>
+#include <onyx/net/fib.h>
 #include <onyx/net/icmpv6.h>
 #include <onyx/net/inet_csum.h>
 #include <onyx/net/ip.h>
@@ -175,6 +176,7 @@ int icmp6_socket::connect(sockaddr *addr, socklen_t len, int flags)
 
     connected = true;
 
+    unsigned long gen = inet_route_generation();
     auto route_result = get_proto_fam()->route(src_addr, dest_addr, res.second);
 
     /* If we've got an error, ignore it. Is this correct/sane behavior? */
@@ -184,8 +186,7 @@ int icmp6_socket::connect(sockaddr *addr, socklen_t len, int flags)
         return 0;
     }
 
-    route_cache = route_result.value();
-    route_cache_valid = 1;
+    set_route_cache(route_result.value(), gen);
 
     return 0;
 }
@@ -245,7 +246,8 @@ ssize_t icmp6_socket::sendmsg(const struct msghdr *msg, int flags)
 
     if (connected && route_cache_valid)
     {
-        rt = route_cache;
+        if (int st = revalidate_route_cache(rt); st < 0)
+            return st;
     }
     else
     {
@@ -7,6 +7,7 @@
  */
 
 #include <onyx/err.h>
+#include <onyx/net/fib.h>
 #include <onyx/net/icmpv6.h>
 #include <onyx/net/ip.h>
 #include <onyx/net/ndp.h>
@@ -125,10 +126,9 @@ int bind_internal(sockaddr_in6 *in, inet_socket *sock)
 
         /* Check if there's any socket bound to this address yet, if we're not talking about ICMP.
          * ICMP allows you to bind multiple sockets, as they'll all receive the same packets.
+         * SO_REUSEPORT sockets may share it too.
          */
-        if (!proto_has_no_ports &&
-            sock_table->get_socket(id,
-                                   GET_SOCKET_CHECK_EXISTENCE | GET_SOCKET_UNLOCKED | extra_flags))
+        if (!proto_has_no_ports && sock_table->bind_conflicts(id, sock, extra_flags))
         {
             sock_table->unlock(hash);
             return -EADDRINUSE;
@@ -192,8 +192,7 @@ void unbind(inet_socket *sock)
     sock->proto_info->get_socket_table()->remove_socket(sock, 0);
 }
 
-rwslock routing_table_lock;
-cul::vector<shared_ptr<inet6_route>> routing_table;
+static fib_trie<inet6_route, sizeof(in6_addr)> fib;
 
 static void print_v6_addr(const in6_addr &addr)
 {
@@ -218,71 +217,31 @@ uint16_t flags_from_dest(const in6_addr &dst)
 expected<inet_route, int> route_from_routing_table(const inet_sock_address &to,
                                                    netif *required_netif)
 {
-    shared_ptr<inet6_route> best_route;
-    int highest_metric = 0;
     auto dest = to.in6;
-    int longest_prefix = -1;
+    inet_route r;
 
     {
-
-        scoped_rwslock<rw_lock::read> g{routing_table_lock};
-
-        for (auto &r : routing_table)
-        {
-            /* Do a bitwise and between the destination address and the mask
-             * If the result = r.dest, we can use this interface.
-             */
-            int mask_bits;
-            const auto masked = dest & r->mask;
-#if 0
-		print_v6_addr(dest);
-		print_v6_addr(r->mask);
-		print_v6_addr(r->dest);
-#endif
-            if (masked != r->dest)
-                continue;
-
-            if (required_netif && r->nif != required_netif)
-                continue;
-#if 0
-		printk("%s is good\n", r->nif->name);
-		printk("is loopback set %u\n", r->nif->flags & NETIF_LOOPBACK);
-#endif
-            /* TODO: This can and should be computed beforehand */
-            mask_bits = count_bits(r->mask.__in6_union.__s6_addr32[0]) +
-                        count_bits(r->mask.__in6_union.__s6_addr32[1]) +
-                        count_bits(r->mask.__in6_union.__s6_addr32[2]) +
-                        count_bits(r->mask.__in6_union.__s6_addr32[3]);
-
-#if 0
-            pr_warn("dest %pI6 mask %pI6 route dest %pI6 mask_bits %d\n", &dest, &r->mask, &r->dest,
-                    mask_bits);
-#endif
-            if (mask_bits > longest_prefix ||
-                (longest_prefix == mask_bits && r->metric > highest_metric))
-            {
-                best_route = r;
-                highest_metric = r->metric;
-                longest_prefix = mask_bits;
-            }
-        }
+        auto_rcu_lock g;
+        const inet6_route *best_route = fib.lookup(&dest, [required_netif](const inet6_route *rt) {
+            return !required_netif || rt->nif == required_netif;
+        });
+
+        if (!best_route)
+            return unexpected<int>{-ENETUNREACH};
+
+        r.nif = best_route->nif;
+        r.mask.in6 = best_route->mask;
+        r.flags = best_route->flags;
+        r.gateway_addr.in6 = best_route->gateway;
     }
 
-    if (!best_route)
-        return unexpected<int>{-ENETUNREACH};
-
     auto saddr_flags = flags_from_dest(to.in6);
 
-    inet_route r;
     r.dst_addr.in6 = to.in6;
-    r.nif = best_route->nif;
-    r.mask.in6 = best_route->mask;
     r.src_addr.in6 = netif_get_v6_address(r.nif, saddr_flags);
 #if 0
     print_v6_addr(r.src_addr.in6);
 #endif
-    r.flags = best_route->flags;
-    r.gateway_addr.in6 = best_route->gateway;
 
     return r;
 }
@@ -369,17 +328,24 @@ expected<inet_route, int> route(const inet_sock_address &from, const inet_sock_a
 
 bool add_route(inet6_route &route)
 {
-    scoped_rwslock<rw_lock::write> g{routing_table_lock};
+    int plen = fib_mask_to_prefix(&route.mask, sizeof(route.mask));
+    if (plen < 0)
+        return false;
 
-    auto ptr = make_shared<inet6_route>();
+    auto ptr = (inet6_route *) kmalloc(sizeof(inet6_route), GFP_KERNEL);
     if (!ptr)
         return false;
 
-    memcpy(ptr.get(), &route, sizeof(route));
+    memcpy(ptr, &route, sizeof(route));
+    ptr->dest = ptr->dest & ptr->mask;
 
-    bool st = routing_table.push_back(ptr);
+    if (fib.insert(ptr, &ptr->dest, plen) < 0)
+    {
+        kfree(ptr);
+        return false;
+    }
 
-    return st;
+    return true;
 }
 
 static const struct inet_proto_family v6_protocol = {
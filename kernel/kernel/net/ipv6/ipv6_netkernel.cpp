@@ -5,6 +5,7 @@
  */
 
 #include <onyx/init.h>
+#include <onyx/net/fib.h>
 #include <onyx/net/ip.h>
 #include <onyx/net/ipv6.h>
 #include <onyx/net/netkernel.h>
@@ -48,6 +49,10 @@ public:
         if (rt.flags & ~INET4_VALID_ROUTE_FLAGS)
             return unexpected<int>{-EINVAL};
 
+        /* The FIB only deals in prefixes */
+        if (fib_mask_to_prefix(&rt.mask, sizeof(rt.mask)) < 0)
+            return unexpected<int>{-EINVAL};
+
         if (!check_for_null_term(ra->iface, sizeof(ra->iface)))
             return unexpected<int>{-EINVAL};
 
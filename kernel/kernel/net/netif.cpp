@@ -16,6 +16,8 @@
 #include <onyx/net/ip.h>
 #include <onyx/net/netif.h>
 #include <onyx/net/netkernel.h>
+#include <onyx/net/qdisc.h>
+#include <onyx/rcupdate.h>
 #include <onyx/softirq.h>
 #include <onyx/spinlock.h>
 #include <onyx/vector.h>
@@ -82,6 +84,38 @@ unsigned int netif_ioctl(int request, void *argp, struct file *f)
                 return -EFAULT;
             return 0;
         }
+
+        case SIOSETDROPINJ: {
+            struct if_drop_inject inj;
+            if (copy_from_user(&inj, argp, sizeof(inj)) < 0)
+                return -EFAULT;
+            if (inj.every && inj.burst >= inj.every)
+                return -EINVAL;
+            WRITE_ONCE(netif->drop_every, 0);
+            WRITE_ONCE(netif->drop_burst, inj.burst);
+            __atomic_store_n(&netif->drop_counter, 0, __ATOMIC_RELAXED);
+            WRITE_ONCE(netif->drop_every, inj.every);
+            return 0;
+        }
+
+        case SIOSETQDISC: {
+            struct if_qdisc qd;
+            if (copy_from_user(&qd, argp, sizeof(qd)) < 0)
+                return -EFAULT;
+            qd.name[IF_QDISC_NAMESIZE - 1] = '\0';
+            return qdisc_attach(netif, qd.name);
+        }
+
+        case SIOGETQDISC: {
+            struct if_qdisc qd = {};
+            rcu_read_lock();
+            struct qdisc *q = rcu_dereference(netif->qdisc);
+            strlcpy(qd.name, q ? q->ops->name : "noqueue", sizeof(qd.name));
+            rcu_read_unlock();
+            if (copy_to_user(argp, &qd, sizeof(qd)) < 0)
+                return -EFAULT;
+            return 0;
+        }
     }
 
     return -ENOTTY;
@@ -149,6 +183,8 @@ void netif_register_if(struct netif *netif)
         netif_register_loopback_route4(netif);
         netif_register_loopback_route6(netif);
     }
+
+    qdisc_attach_default(netif);
 }
 
 int netif_unregister_if(struct netif *netif)
@@ -227,12 +263,36 @@ void netif_unlock_list(void)
     spin_unlock(&netif_list_lock);
 }
 
+static bool netif_should_drop(netif *netif)
+{
+    unsigned int every = READ_ONCE(netif->drop_every);
+    if (likely(!every))
+        return false;
+
+    unsigned long n = __atomic_fetch_add(&netif->drop_counter, 1, __ATOMIC_RELAXED);
+    return n % every < READ_ONCE(netif->drop_burst);
+}
+
 int netif_send_packet(netif *netif, packetbuf *buf)
 {
+    struct qdisc *q;
+    int st = -ENODEV;
+
     assert(netif != nullptr);
-    if (netif->sendpacket)
-        return netif->sendpacket(buf, netif);
-    return -ENODEV;
+    if (unlikely(netif_should_drop(netif)))
+    {
+        /* Pretend it went out */
+        return 0;
+    }
+
+    rcu_read_lock();
+    q = rcu_dereference(netif->qdisc);
+    if (q)
+        st = qdisc_xmit(q, buf);
+    else if (netif->sendpacket)
+        st = netif->sendpacket(buf, netif);
+    rcu_read_unlock();
+    return st;
 }
 
 void netif_get_ipv4_addr(struct sockaddr_in *s, struct netif *netif)
@@ -290,7 +350,15 @@ void netif_signal_rx(netif *nif)
     softirq_raise(softirq_vector::SOFTIRQ_VECTOR_NETRX);
 }
 
-void netif_do_rxpoll(netif *nif)
+/**
+ * @brief Poll an interface for received packets
+ *
+ * @param nif Network interface
+ * @param budget Pointer to the number of poll rounds we may still do, decremented as we go
+ * @return True if the interface still has packets and we ran out of budget. In that case, rx_end
+ * wasn't called and the interface needs to be polled again.
+ */
+static bool netif_do_rxpoll(netif *nif, unsigned int *budget)
 {
     unsigned int desired;
     atomic_or_relaxed(nif->flags, NETIF_DOING_RX_POLL);
@@ -300,31 +368,55 @@ void netif_do_rxpoll(netif *nif)
     retry:
         atomic_and_relaxed(nif->flags, ~NETIF_HAS_RX_AVAILABLE);
         nif->poll_rx(nif);
+        if (*budget)
+            (*budget)--;
         desired = READ_ONCE(nif->flags);
         if (desired & NETIF_HAS_RX_AVAILABLE)
+        {
+            /* Don't let a flooded interface hog the softirq */
+            if (*budget == 0)
+                return true;
             goto retry;
+        }
         nif->rx_end(nif);
     } while (cmpxchg(&nif->flags, desired, desired & ~NETIF_DOING_RX_POLL) != desired);
+
+    return false;
 }
 
-int netif_do_rx()
+/**
+ * @brief Poll every interface that signalled RX on this cpu (softirq routine)
+ *
+ * @param budget Maximum number of poll rounds
+ * @return True if there's still work left
+ */
+bool netif_do_rx(unsigned int budget)
 {
     auto queue = get_per_cpu_ptr(rx_queue);
+    bool more;
 
     unsigned long flags = spin_lock_irqsave(&queue->lock);
-    while (!list_is_empty(&queue->to_rx_list))
+    while (!list_is_empty(&queue->to_rx_list) && budget > 0)
     {
         struct netif *nif = list_first_entry(&queue->to_rx_list, struct netif, rx_queue_node);
         list_remove(&nif->rx_queue_node);
         spin_unlock_irqrestore(&queue->lock, flags);
-        netif_do_rxpoll(nif);
+        bool again = netif_do_rxpoll(nif, &budget);
         flags = spin_lock_irqsave(&queue->lock);
+        if (again)
+        {
+            /* Still scheduled, get back in line */
+            list_add_tail(&nif->rx_queue_node, &queue->to_rx_list);
+            continue;
+        }
+
         atomic_and_relaxed(nif->flags, ~NETIF_SCHEDULED);
     }
 
+    more = !list_is_empty(&queue->to_rx_list);
     spin_unlock_irqrestore(&queue->lock, flags);
 
-    return 0;
+    return more;
 }
 
 int netif_process_pbuf(netif *nif, packetbuf *buf)
@@ -184,10 +184,74 @@ packetbuf *packetbuf_clone(packetbuf *original)
     buf->tpi = original->tpi;
     buf->nr_vecs = original->nr_vecs;
     buf->total_len = original->total_len;
+    buf->gso_size = original->gso_size;
+    buf->gso_flags = original->gso_flags;
+    buf->cloned = original->cloned = 1;
 
     return buf.release();
 }
 
+static unsigned char *pbf_rebase(unsigned char *ptr, unsigned char *old, unsigned char *new_)
+{
+    return ptr ? new_ + (ptr - old) : nullptr;
+}
+
+/**
+ * @brief Clone a packetbuf, but give the clone its own copy of the linear area (the headers)
+ * The pages past the first one are still shared.
+ *
+ * @param original The original packetbuf.
+ * @param gfp GFP flags
+ * @return The new packetbuf, or NULL if we ran out of memory.
+ */
+struct packetbuf *pbf_copy_head(struct packetbuf *original, gfp_t gfp)
+{
+    struct packetbuf *buf;
+    unsigned char *old, *new_;
+    struct page *page;
+
+    /* The linear area sits in a single page (or page frag) */
+    DCHECK((unsigned long) original->end - (unsigned long) original->buffer_start <= PAGE_SIZE);
+
+    page = alloc_page(gfp | PAGE_ALLOC_NO_ZERO);
+    if (!page)
+        return nullptr;
+
+    buf = packetbuf_clone(original);
+    if (!buf)
+    {
+        free_page(page);
+        return nullptr;
+    }
+
+    /* Everything before data is unused headroom, and everything after tail is unused, so only
+     * copy [data, tail) but keep the layout, so every pointer moves by the same amount. */
+    old = (unsigned char *) original->buffer_start;
+    new_ = (unsigned char *) PAGE_TO_VIRT(page);
+    memcpy(new_ + (original->data - old), original->data, original->tail - original->data);
+
+    free_page(buf->page_vec[0].page);
+    buf->page_vec[0].page = page;
+    buf->page_vec[0].page_off = 0;
+
+    buf->buffer_start = new_;
+    buf->end = pbf_rebase(buf->end, old, new_);
+    buf->data = pbf_rebase(buf->data, old, new_);
+    buf->tail = pbf_rebase(buf->tail, old, new_);
+    buf->phy_header = pbf_rebase(buf->phy_header, old, new_);
+    buf->link_header = pbf_rebase(buf->link_header, old, new_);
+    buf->net_header = pbf_rebase(buf->net_header, old, new_);
+    buf->transport_header = pbf_rebase(buf->transport_header, old, new_);
+    buf->csum_start = pbf_rebase(original->csum_start, old, new_);
+    buf->csum_offset =
+        (uint16_t *) pbf_rebase((unsigned char *) original->csum_offset, old, new_);
+    buf->header_length = original->header_length;
+    buf->needs_csum = original->needs_csum;
+    /* Our head is private, only the data pages are shared, and no one writes to those */
+    buf->cloned = 0;
+    return buf;
+}
+
 static int allocate_page_vec(page_iov &v)
 {
     page *p = alloc_page(0);
@@ -0,0 +1,216 @@
+/*
+ * Copyright (c) 2025 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the GPLv2 License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+#include <errno.h>
+
+#include <onyx/clock.h>
+#include <onyx/net/netif.h>
+#include <onyx/net/qdisc.h>
+#include <onyx/packetbuf.h>
+
+/*
+ * fq: fair queueing with per-flow pacing. Flows get served round robin (new flows first, like
+ * fq_codel), and a flow whose socket has a pacing rate (SO_MAX_PACING_RATE) doesn't get to send
+ * its next packet before len / rate has gone by since the last one. Flows waiting on pacing sit on
+ * the throttled list (sorted by when they may send again), and the watchdog gets armed for the
+ * first one when there's nothing else to send.
+ */
+
+#define FQ_FLOWS      1024
+#define FQ_LIMIT      10000
+#define FQ_FLOW_LIMIT 100
+
+struct fq_flow
+{
+    struct list_head queue;
+    unsigned int qlen;
+    /* On new_flows, old_flows or throttled, if active */
+    struct list_head flow_node;
+    bool active;
+    int credit;
+    hrtime_t time_next_packet;
+};
+
+struct fq_priv
+{
+    struct list_head new_flows;
+    struct list_head old_flows;
+    struct list_head throttled;
+    unsigned int quantum;
+    struct fq_flow flows[FQ_FLOWS];
+};
+
+static int fq_init(struct qdisc *q)
+{
+    auto priv = qdisc_priv<fq_priv>(q);
+
+    INIT_LIST_HEAD(&priv->new_flows);
+    INIT_LIST_HEAD(&priv->old_flows);
+    INIT_LIST_HEAD(&priv->throttled);
+    priv->quantum = 2 * (q->nif->mtu + 14);
+    q->limit = FQ_LIMIT;
+
+    for (auto &flow : priv->flows)
+        INIT_LIST_HEAD(&flow.queue);
+    return 0;
+}
+
+static int fq_enqueue(struct qdisc *q, struct packetbuf *pbf)
+{
+    auto priv = qdisc_priv<fq_priv>(q);
+    struct fq_flow *flow = &priv->flows[pbf->tx_flow_hash % FQ_FLOWS];
+
+    if (q->qlen >= q->limit || flow->qlen >= FQ_FLOW_LIMIT)
+    {
+        qdisc_drop(q, pbf);
+        return -ENOBUFS;
+    }
+
+    list_add_tail(&pbf->list_node, &flow->queue);
+    flow->qlen++;
+    q->qlen++;
+    q->backlog += pbf->tx_len;
+
+    if (!flow->active)
+    {
+        flow->active = true;
+        flow->credit = priv->quantum;
+        list_add_tail(&flow->flow_node, &priv->new_flows);
+    }
+
+    return 0;
+}
+
+static void fq_throttle(struct fq_priv *priv, struct fq_flow *flow)
+{
+    struct fq_flow *pos;
+
+    list_remove(&flow->flow_node);
+
+    /* Keep it sorted by time_next_packet, the list is short (only paced flows end up here) */
+    list_for_each_entry (pos, &priv->throttled, flow_node)
+    {
+        if (pos->time_next_packet > flow->time_next_packet)
+        {
+            list_add_tail(&flow->flow_node, &pos->flow_node);
+            return;
+        }
+    }
+
+    list_add_tail(&flow->flow_node, &priv->throttled);
+}
+
+static void fq_unthrottle(struct fq_priv *priv, hrtime_t now)
+{
+    struct fq_flow *flow, *next;
+
+    list_for_each_entry_safe (flow, next, &priv->throttled, flow_node)
+    {
+        if (flow->time_next_packet > now)
+            break;
+        list_remove(&flow->flow_node);
+        list_add_tail(&flow->flow_node, &priv->old_flows);
+    }
+}
+
+static struct packetbuf *fq_dequeue(struct qdisc *q, hrtime_t now, hrtime_t *wakeup)
+{
+    auto priv = qdisc_priv<fq_priv>(q);
+    struct list_head *head;
+    struct packetbuf *pbf;
+    struct fq_flow *flow;
+
+    fq_unthrottle(priv, now);
+
+    for (;;)
+    {
+        head = &priv->new_flows;
+        if (list_is_empty(head))
+        {
+            head = &priv->old_flows;
+            if (list_is_empty(head))
+            {
+                if (!list_is_empty(&priv->throttled))
+                {
+                    flow = list_first_entry(&priv->throttled, struct fq_flow, flow_node);
+                    *wakeup = flow->time_next_packet;
+                }
+
+                return nullptr;
+            }
+        }
+
+        flow = list_first_entry(head, struct fq_flow, flow_node);
+        if (flow->credit <= 0)
+        {
+            flow->credit += priv->quantum;
+            list_remove(&flow->flow_node);
+            list_add_tail(&flow->flow_node, &priv->old_flows);
+            continue;
+        }
+
+        if (list_is_empty(&flow->queue))
+        {
+            list_remove(&flow->flow_node);
+            if (head == &priv->new_flows && !list_is_empty(&priv->old_flows))
+                list_add_tail(&flow->flow_node, &priv->old_flows);
+            else
+                flow->active = false;
+            continue;
+        }
+
+        if (flow->time_next_packet > now)
+        {
+            fq_throttle(priv, flow);
+            continue;
+        }
+
+        pbf = list_first_entry(&flow->queue, struct packetbuf, list_node);
+        list_remove(&pbf->list_node);
+        flow->qlen--;
+        flow->credit -= pbf->tx_len;
+        q->qlen--;
+        q->backlog -= pbf->tx_len;
+
+        if (pbf->tx_pacing_rate && pbf->tx_pacing_rate != ~0UL)
+            flow->time_next_packet = now + (u64) pbf->tx_len * NS_PER_SEC / pbf->tx_pacing_rate;
+        return pbf;
+    }
+}
+
+static void fq_reset(struct qdisc *q)
+{
+    auto priv = qdisc_priv<fq_priv>(q);
+    struct packetbuf *pbf, *next;
+
+    for (auto &flow : priv->flows)
+    {
+        list_for_each_entry_safe (pbf, next, &flow.queue, list_node)
+        {
+            list_remove(&pbf->list_node);
+            pbf_put_ref(pbf);
+        }
+
+        if (flow.active)
+            list_remove(&flow.flow_node);
+        flow.active = false;
+        flow.qlen = 0;
+    }
+
+    q->qlen = 0;
+    q->backlog = 0;
+}
+
+const struct qdisc_ops fq_qdisc_ops = {
+    .name = "fq",
+    .priv_size = sizeof(struct fq_priv),
+    .init = fq_init,
+    .enqueue = fq_enqueue,
+    .dequeue = fq_dequeue,
+    .reset = fq_reset,
+    .destroy = nullptr,
+};
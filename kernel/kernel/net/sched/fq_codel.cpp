@@ -0,0 +1,296 @@
+/*
+ * Copyright (c) 2025 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the GPLv2 License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+#include <errno.h>
+
+#include <onyx/clock.h>
+#include <onyx/net/netif.h>
+#include <onyx/net/qdisc.h>
+#include <onyx/packetbuf.h>
+
+/*
+ * fq_codel (RFC8290): packets get hashed into flow queues, which are served with deficit round
+ * robin, flows that just became active (new_flows) ahead of the rest (old_flows). Each flow queue
+ * runs its own CoDel (RFC8289), which drops from the head of the queue once packets have been
+ * sitting there for more than target, for at least interval. Sparse flows (ping-pong, DNS, ACKs)
+ * barely ever queue, and bulk flows can't build a standing queue in front of them.
+ */
+
+#define FQ_CODEL_FLOWS    1024
+#define FQ_CODEL_LIMIT    10240
+#define CODEL_TARGET      (5 * NS_PER_MS)
+#define CODEL_INTERVAL    (100 * NS_PER_MS)
+
+struct fq_codel_flow
+{
+    struct list_head queue;
+    /* On new_flows or old_flows, if active */
+    struct list_head flow_node;
+    bool active;
+    int deficit;
+    unsigned int backlog;
+
+    /* CoDel state */
+    bool dropping;
+    unsigned int count;
+    unsigned int lastcount;
+    hrtime_t first_above_time;
+    hrtime_t drop_next;
+};
+
+struct fq_codel_priv
+{
+    struct list_head new_flows;
+    struct list_head old_flows;
+    unsigned int quantum;
+    struct fq_codel_flow flows[FQ_CODEL_FLOWS];
+};
+
+static int fq_codel_init(struct qdisc *q)
+{
+    auto priv = qdisc_priv<fq_codel_priv>(q);
+
+    INIT_LIST_HEAD(&priv->new_flows);
+    INIT_LIST_HEAD(&priv->old_flows);
+    /* A full-sized frame, link header included */
+    priv->quantum = q->nif->mtu + 14;
+    q->limit = FQ_CODEL_LIMIT;
+
+    for (auto &flow : priv->flows)
+        INIT_LIST_HEAD(&flow.queue);
+    return 0;
+}
+
+static struct packetbuf *fq_codel_pop(struct qdisc *q, struct fq_codel_flow *flow)
+{
+    struct packetbuf *pbf;
+
+    if (list_is_empty(&flow->queue))
+        return nullptr;
+
+    pbf = list_first_entry(&flow->queue, struct packetbuf, list_node);
+    list_remove(&pbf->list_node);
+    flow->backlog -= pbf->tx_len;
+    q->qlen--;
+    q->backlog -= pbf->tx_len;
+    return pbf;
+}
+
+/* Over the limit, drop from the head of the flow with the largest backlog */
+static void fq_codel_drop_fattest(struct qdisc *q)
+{
+    auto priv = qdisc_priv<fq_codel_priv>(q);
+    struct fq_codel_flow *fattest = nullptr;
+
+    for (auto &flow : priv->flows)
+    {
+        if (!fattest || flow.backlog > fattest->backlog)
+            fattest = &flow;
+    }
+
+    if (struct packetbuf *pbf = fq_codel_pop(q, fattest); pbf)
+        qdisc_drop(q, pbf);
+}
+
+static int fq_codel_enqueue(struct qdisc *q, struct packetbuf *pbf)
+{
+    auto priv = qdisc_priv<fq_codel_priv>(q);
+    struct fq_codel_flow *flow = &priv->flows[pbf->tx_flow_hash % FQ_CODEL_FLOWS];
+
+    list_add_tail(&pbf->list_node, &flow->queue);
+    flow->backlog += pbf->tx_len;
+    q->qlen++;
+    q->backlog += pbf->tx_len;
+
+    if (!flow->active)
+    {
+        flow->active = true;
+        flow->deficit = priv->quantum;
+        list_add_tail(&flow->flow_node, &priv->new_flows);
+    }
+
+    if (q->qlen > q->limit)
+        fq_codel_drop_fattest(q);
+    return 0;
+}
+
+static u64 int_sqrt(u64 x)
+{
+    u64 res = 0, bit = 1ULL << 62;
+
+    while (bit > x)
+        bit >>= 2;
+
+    while (bit)
+    {
+        if (x >= res + bit)
+        {
+            x -= res + bit;
+            res = (res >> 1) + bit;
+        }
+        else
+            res >>= 1;
+        bit >>= 2;
+    }
+
+    return res;
+}
+
+static hrtime_t codel_control_law(hrtime_t t, unsigned int count)
+{
+    return t + CODEL_INTERVAL / int_sqrt(count);
+}
+
+static bool codel_should_drop(struct qdisc *q, struct fq_codel_flow *flow, struct packetbuf *pbf,
+                              hrtime_t now)
+{
+    hrtime_t sojourn = now - pbf->tx_enqueue_time;
+
+    /* Below target, or not even an MTU's worth queued: nothing to see here */
+    if (sojourn < CODEL_TARGET || flow->backlog <= q->nif->mtu)
+    {
+        flow->first_above_time = 0;
+        return false;
+    }
+
+    if (flow->first_above_time == 0)
+    {
+        flow->first_above_time = now + CODEL_INTERVAL;
+        return false;
+    }
+
+    return now >= flow->first_above_time;
+}
+
+static struct packetbuf *codel_dequeue(struct qdisc *q, struct fq_codel_flow *flow, hrtime_t now)
+{
+    struct packetbuf *pbf = fq_codel_pop(q, flow);
+    bool drop;
+
+    if (!pbf)
+    {
+        flow->dropping = false;
+        return nullptr;
+    }
+
+    drop = codel_should_drop(q, flow, pbf, now);
+    if (flow->dropping)
+    {
+        if (!drop)
+        {
+            flow->dropping = false;
+            return pbf;
+        }
+
+        while (flow->dropping && now >= flow->drop_next)
+        {
+            qdisc_drop(q, pbf);
+            flow->count++;
+            pbf = fq_codel_pop(q, flow);
+            if (!pbf)
+            {
+                flow->dropping = false;
+                return nullptr;
+            }
+
+            if (!codel_should_drop(q, flow, pbf, now))
+                flow->dropping = false;
+            else
+                flow->drop_next = codel_control_law(flow->drop_next, flow->count);
+        }
+    }
+    else if (drop)
+    {
+        qdisc_drop(q, pbf);
+        pbf = fq_codel_pop(q, flow);
+
+        flow->dropping = true;
+        /* If we were dropping not long ago, pick up where we left off */
+        unsigned int delta = flow->count - flow->lastcount;
+        if (delta > 1 && now - flow->drop_next < 16 * CODEL_INTERVAL)
+            flow->count = delta;
+        else
+            flow->count = 1;
+        flow->lastcount = flow->count;
+        flow->drop_next = codel_control_law(now, flow->count);
+
+        if (!pbf)
+            flow->dropping = false;
+    }
+
+    return pbf;
+}
+
+static struct packetbuf *fq_codel_dequeue(struct qdisc *q, hrtime_t now, hrtime_t *wakeup)
+{
+    auto priv = qdisc_priv<fq_codel_priv>(q);
+    struct fq_codel_flow *flow;
+    struct list_head *head;
+    struct packetbuf *pbf;
+
+    for (;;)
+    {
+        head = &priv->new_flows;
+        if (list_is_empty(head))
+        {
+            head = &priv->old_flows;
+            if (list_is_empty(head))
+                return nullptr;
+        }
+
+        flow = list_first_entry(head, struct fq_codel_flow, flow_node);
+        if (flow->deficit <= 0)
+        {
+            flow->deficit += priv->quantum;
+            list_remove(&flow->flow_node);
+            list_add_tail(&flow->flow_node, &priv->old_flows);
+            continue;
+        }
+
+        pbf = codel_dequeue(q, flow, now);
+        if (!pbf)
+        {
+            list_remove(&flow->flow_node);
+            /* A new flow that empties goes to the back of old_flows, so it can't come back as new
+             * right away and starve the old ones */
+            if (head == &priv->new_flows && !list_is_empty(&priv->old_flows))
+                list_add_tail(&flow->flow_node, &priv->old_flows);
+            else
+                flow->active = false;
+            continue;
+        }
+
+        flow->deficit -= pbf->tx_len;
+        return pbf;
+    }
+}
+
+static void fq_codel_reset(struct qdisc *q)
+{
+    auto priv = qdisc_priv<fq_codel_priv>(q);
+    struct packetbuf *pbf;
+
+    for (auto &flow : priv->flows)
+    {
+        while ((pbf = fq_codel_pop(q, &flow)))
+            pbf_put_ref(pbf);
+        if (flow.active)
+            list_remove(&flow.flow_node);
+        flow.active = false;
+        flow.dropping = false;
+    }
+}
+
+const struct qdisc_ops fq_codel_qdisc_ops = {
+    .name = "fq_codel",
+    .priv_size = sizeof(struct fq_codel_priv),
+    .init = fq_codel_init,
+    .enqueue = fq_codel_enqueue,
+    .dequeue = fq_codel_dequeue,
+    .reset = fq_codel_reset,
+    .destroy = nullptr,
+};
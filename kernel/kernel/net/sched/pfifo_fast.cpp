@@ -0,0 +1,125 @@
+/*
+ * Copyright (c) 2025 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the GPLv2 License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+#include <errno.h>
+
+#include <onyx/net/ip.h>
+#include <onyx/net/ipv6.h>
+#include <onyx/net/qdisc.h>
+#include <onyx/packetbuf.h>
+
+/* pfifo_fast: three FIFO bands picked from the packet's TOS, band 0 always goes out first. */
+
+#define PFIFO_FAST_BANDS 3
+
+#define IPTOS_LOWDELAY    0x10
+#define IPTOS_THROUGHPUT  0x08
+#define IPTOS_MINCOST     0x02
+
+struct pfifo_fast_priv
+{
+    struct list_head bands[PFIFO_FAST_BANDS];
+};
+
+static unsigned int pfifo_fast_band(struct packetbuf *pbf)
+{
+    const unsigned char *nh = pbf->net_header;
+    u8 tos;
+
+    if (!nh)
+        return 1;
+
+    switch (nh[0] >> 4)
+    {
+        case 4:
+            tos = ((const struct ip_header *) nh)->tos;
+            break;
+        case 6:
+            /* The traffic class straddles the first two bytes */
+            tos = (nh[0] << 4) | (nh[1] >> 4);
+            break;
+        default:
+            return 1;
+    }
+
+    if (tos & IPTOS_LOWDELAY)
+        return 0;
+    if (tos & (IPTOS_THROUGHPUT | IPTOS_MINCOST))
+        return 2;
+    return 1;
+}
+
+static int pfifo_fast_init(struct qdisc *q)
+{
+    auto priv = qdisc_priv<pfifo_fast_priv>(q);
+    for (auto &band : priv->bands)
+        INIT_LIST_HEAD(&band);
+    return 0;
+}
+
+static int pfifo_fast_enqueue(struct qdisc *q, struct packetbuf *pbf)
+{
+    auto priv = qdisc_priv<pfifo_fast_priv>(q);
+
+    if (q->qlen >= q->limit)
+    {
+        qdisc_drop(q, pbf);
+        return -ENOBUFS;
+    }
+
+    list_add_tail(&pbf->list_node, &priv->bands[pfifo_fast_band(pbf)]);
+    q->qlen++;
+    q->backlog += pbf->tx_len;
+    return 0;
+}
+
+static struct packetbuf *pfifo_fast_dequeue(struct qdisc *q, hrtime_t now, hrtime_t *wakeup)
+{
+    auto priv = qdisc_priv<pfifo_fast_priv>(q);
+
+    for (auto &band : priv->bands)
+    {
+        if (list_is_empty(&band))
+            continue;
+
+        struct packetbuf *pbf = list_first_entry(&band, struct packetbuf, list_node);
+        list_remove(&pbf->list_node);
+        q->qlen--;
+        q->backlog -= pbf->tx_len;
+        return pbf;
+    }
+
+    return nullptr;
+}
+
+static void pfifo_fast_reset(struct qdisc *q)
+{
+    auto priv = qdisc_priv<pfifo_fast_priv>(q);
+    struct packetbuf *pbf, *next;
+
+    for (auto &band : priv->bands)
+    {
+        list_for_each_entry_safe (pbf, next, &band, list_node)
+        {
+            list_remove(&pbf->list_node);
+            pbf_put_ref(pbf);
+        }
+    }
+
+    q->qlen = 0;
+    q->backlog = 0;
+}
+
+const struct qdisc_ops pfifo_fast_qdisc_ops = {
+    .name = "pfifo_fast",
+    .priv_size = sizeof(struct pfifo_fast_priv),
+    .init = pfifo_fast_init,
+    .enqueue = pfifo_fast_enqueue,
+    .dequeue = pfifo_fast_dequeue,
+    .reset = pfifo_fast_reset,
+    .destroy = nullptr,
+};
@@ -0,0 +1,328 @@
+/*
+ * Copyright (c) 2025 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the GPLv2 License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <onyx/byteswap.h>
+#include <onyx/cmdline.h>
+#include <onyx/fnv.h>
+#include <onyx/net/ip.h>
+#include <onyx/net/ipv6.h>
+#include <onyx/net/netif.h>
+#include <onyx/net/qdisc.h>
+#include <onyx/net/socket.h>
+#include <onyx/new.h>
+#include <onyx/packetbuf.h>
+
+/*
+ * The qdisc layer sits between netif_send_packet and the driver. Packets get queued in the
+ * interface's qdisc and whoever queued one tries to run the queue (qdisc_run). Only one cpu feeds
+ * the driver at a time (q->running); everyone else just queues and leaves, and the feeder picks
+ * their packets up. Disciplines that hold packets back (fq's pacing) arm the watchdog, which runs
+ * the queue again when the next packet may go out.
+ *
+ * Our drivers complete transmission synchronously (sendpacket returns once the NIC is done with
+ * the packet), so there's never more than one packet sitting in a driver's TX ring and the qdisc
+ * is where all the queueing happens. The single feeder plus the run budget is what keeps the
+ * driver's queue short (the job BQL does for drivers with real TX rings).
+ */
+
+static const struct qdisc_ops *const qdisc_ops_list[] = {
+    &pfifo_fast_qdisc_ops,
+    &fq_codel_qdisc_ops,
+    &fq_qdisc_ops,
+};
+
+static const struct qdisc_ops *default_qdisc_ops = &fq_codel_qdisc_ops;
+static struct spinlock qdisc_attach_lock;
+
+static const struct qdisc_ops *qdisc_find_ops(const char *name)
+{
+    for (auto ops : qdisc_ops_list)
+    {
+        if (!strcmp(ops->name, name))
+            return ops;
+    }
+
+    return nullptr;
+}
+
+static int default_qdisc_param(const char *str)
+{
+    if (!str)
+        return 0;
+
+    if (!strcmp(str, "noqueue"))
+    {
+        default_qdisc_ops = nullptr;
+        return 1;
+    }
+
+    const struct qdisc_ops *ops = qdisc_find_ops(str);
+    if (!ops)
+    {
+        pr_err("qdisc: unknown qdisc %s\n", str);
+        return 1;
+    }
+
+    default_qdisc_ops = ops;
+    return 1;
+}
+
+kernel_param("net.default_qdisc", default_qdisc_param);
+
+u32 qdisc_flow_hash(struct packetbuf *pbf)
+{
+    const unsigned char *nh = pbf->net_header;
+    const unsigned char *ports = nullptr;
+    fnv_hash_t hash;
+    u8 proto;
+
+    if (!nh)
+        return 0;
+
+    switch (nh[0] >> 4)
+    {
+        case 4: {
+            const struct ip_header *iph = (const struct ip_header *) nh;
+            proto = iph->proto;
+            hash = fnv_hash(&iph->source_ip, sizeof(u32) * 2);
+            /* Only the first fragment has the ports, keep every fragment in the same flow */
+            if (!(ntohs(iph->frag_info) & (IPV4_FRAG_INFO_MORE_FRAGMENTS | 0x1fff)))
+                ports = nh + ip_header_length(iph);
+            break;
+        }
+        case 6: {
+            const struct ip6hdr *ip6 = (const struct ip6hdr *) nh;
+            proto = ip6->next_header;
+            hash = fnv_hash(&ip6->src_addr, sizeof(in6_addr) * 2);
+            ports = nh + sizeof(struct ip6hdr);
+            break;
+        }
+        default:
+            return 0;
+    }
+
+    hash = fnv_hash_cont(&proto, sizeof(proto), hash);
+    if (ports && (proto == IPPROTO_TCP || proto == IPPROTO_UDP))
+        hash = fnv_hash_cont(ports, sizeof(u16) * 2, hash);
+    /* 0 is "not a flow" */
+    return hash ?: 1;
+}
+
+void qdisc_drop(struct qdisc *q, struct packetbuf *pbf)
+{
+    q->drops++;
+    pbf_put_ref(pbf);
+}
+
+static void qdisc_watchdog(struct clockevent *ev);
+
+/* Called with the qdisc lock held */
+static void qdisc_arm_watchdog(struct qdisc *q, hrtime_t deadline)
+{
+    timer_cancel_event(&q->watchdog);
+    q->watchdog.callback = qdisc_watchdog;
+    q->watchdog.flags = 0;
+    q->watchdog.deadline = deadline;
+    q->watchdog.priv = q;
+    timer_queue_clockevent(&q->watchdog);
+}
+
+/**
+ * @brief Feed the driver from the qdisc, if nobody else is
+ * Must be called in an RCU read-side section (that's what keeps the qdisc alive).
+ *
+ * @param q qdisc
+ */
+static void qdisc_run(struct qdisc *q)
+{
+    unsigned int budget = QDISC_RUN_BUDGET;
+    struct packetbuf *pbf;
+    hrtime_t wakeup = 0;
+    struct netif *nif = q->nif;
+
+    unsigned long flags = spin_lock_irqsave(&q->lock);
+    if (q->running || q->dead)
+    {
+        spin_unlock_irqrestore(&q->lock, flags);
+        return;
+    }
+
+    q->running = true;
+
+    while (budget > 0)
+    {
+        wakeup = 0;
+        pbf = q->ops->dequeue(q, clocksource_get_time(), &wakeup);
+        if (!pbf)
+            break;
+
+        spin_unlock_irqrestore(&q->lock, flags);
+        nif->sendpacket(pbf, nif);
+        pbf_put_ref(pbf);
+        budget--;
+        flags = spin_lock_irqsave(&q->lock);
+
+        if (q->dead)
+            break;
+    }
+
+    if (!q->dead)
+    {
+        /* Out of budget, let everyone else run and pick it up from the timer softirq */
+        if (budget == 0 && q->qlen > 0)
+            qdisc_arm_watchdog(q, clocksource_get_time());
+        else if (wakeup)
+            qdisc_arm_watchdog(q, wakeup);
+    }
+
+    q->running = false;
+    spin_unlock_irqrestore(&q->lock, flags);
+}
+
+static void qdisc_watchdog(struct clockevent *ev)
+{
+    struct qdisc *q = (struct qdisc *) ev->priv;
+    rcu_read_lock();
+    qdisc_run(q);
+    rcu_read_unlock();
+}
+
+/**
+ * @brief Get a packet we can hold on to
+ * If someone else holds a reference, or shares its pages (TCP transmits clones of the segments it
+ * keeps for retransmission, and pushes new headers into the same headroom on every retransmit),
+ * queue a copy with headers of its own. The payload pages stay shared, no one rewrites those.
+ */
+static struct packetbuf *qdisc_get_pbf(struct packetbuf *pbf)
+{
+    if (READ_ONCE(pbf->refcount) == 1 && !pbf->dtor && !pbf->cloned)
+    {
+        pbf_get(pbf);
+        return pbf;
+    }
+
+    return pbf_copy_head(pbf, GFP_ATOMIC);
+}
+
+int qdisc_xmit(struct qdisc *q, struct packetbuf *pbf)
+{
+    struct packetbuf *qpbf;
+    int st;
+
+    qpbf = qdisc_get_pbf(pbf);
+    if (!qpbf)
+        return -ENOMEM;
+
+    qpbf->tx_pacing_rate = pbf->sock ? READ_ONCE(pbf->sock->sk_pacing_rate) : ~0UL;
+    qpbf->tx_enqueue_time = clocksource_get_time();
+    qpbf->tx_len = pbf_length(qpbf);
+    qpbf->tx_flow_hash = qdisc_flow_hash(qpbf);
+
+    unsigned long flags = spin_lock_irqsave(&q->lock);
+    if (unlikely(q->dead))
+    {
+        qdisc_drop(q, qpbf);
+        st = -ENOBUFS;
+    }
+    else
+        st = q->ops->enqueue(q, qpbf);
+    spin_unlock_irqrestore(&q->lock, flags);
+
+    qdisc_run(q);
+    return st;
+}
+
+static struct qdisc *qdisc_create(struct netif *nif, const struct qdisc_ops *ops)
+{
+    void *mem = calloc(1, sizeof(struct qdisc) + ops->priv_size);
+    if (!mem)
+        return nullptr;
+
+    struct qdisc *q = new (mem) qdisc();
+    q->ops = ops;
+    q->nif = nif;
+    spinlock_init(&q->lock);
+    q->limit = 1000;
+
+    if (int st = ops->init(q); st < 0)
+    {
+        q->~qdisc();
+        free(mem);
+        errno = -st;
+        return nullptr;
+    }
+
+    return q;
+}
+
+/**
+ * @brief Tear down a qdisc that's no longer attached
+ * Waits for everyone that may still be using it, then drops whatever is still queued.
+ */
+static void qdisc_destroy(struct qdisc *q)
+{
+    /* No one can find it anymore, wait for the senders that did */
+    synchronize_rcu();
+
+    unsigned long flags = spin_lock_irqsave(&q->lock);
+    q->dead = true;
+    spin_unlock_irqrestore(&q->lock, flags);
+
+    /* It can't get re-armed now. Cancel it and wait for a callback that may be running. */
+    timer_cancel_event(&q->watchdog);
+    synchronize_rcu();
+
+    q->ops->reset(q);
+    if (q->ops->destroy)
+        q->ops->destroy(q);
+    q->~qdisc();
+    free(q);
+}
+
+int qdisc_attach(struct netif *nif, const char *name)
+{
+    const struct qdisc_ops *ops;
+    struct qdisc *q = nullptr, *old;
+
+    if (!nif->sendpacket)
+        return -ENODEV;
+
+    if (strcmp(name, "noqueue"))
+    {
+        ops = qdisc_find_ops(name);
+        if (!ops)
+            return -ENOENT;
+
+        q = qdisc_create(nif, ops);
+        if (!q)
+            return -errno;
+    }
+
+    unsigned long flags = spin_lock_irqsave(&qdisc_attach_lock);
+    old = nif->qdisc;
+    rcu_assign_pointer(nif->qdisc, q);
+    spin_unlock_irqrestore(&qdisc_attach_lock, flags);
+
+    if (old)
+        qdisc_destroy(old);
+    return 0;
+}
+
+void qdisc_attach_default(struct netif *nif)
+{
+    /* Nothing ever queues up on loopback, it's as fast as the receive side */
+    if (nif->flags & NETIF_LOOPBACK || !default_qdisc_ops)
+        return;
+
+    if (int st = qdisc_attach(nif, default_qdisc_ops->name); st < 0)
+        pr_err("qdisc: failed to attach %s to %s: %d\n", default_qdisc_ops->name, nif->name, st);
+}
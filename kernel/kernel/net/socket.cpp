@@ -8,6 +8,8 @@
 #include <errno.h>
 #include <net/if.h>
 
+#include <onyx/clock.h>
+#include <onyx/cred.h>
 #include <onyx/dentry.h>
 #include <onyx/file.h>
 #include <onyx/net/ip.h>
@@ -1023,11 +1025,24 @@ int socket::getsockopt_socket_level(int optname, void *optval, socklen_t *optlen
             return put_option<int>(raddr, optval, optlen);
         }
 
+        case SO_REUSEPORT: {
+            const int rport = (int) reuse_port;
+            return put_option<int>(rport, optval, optlen);
+        }
+
         case SO_BROADCAST: {
             const int bcast_allowed = (int) broadcast_allowed;
             return put_option<int>(bcast_allowed, optval, optlen);
         }
 
+        case SO_MAX_PACING_RATE: {
+            unsigned long rate = READ_ONCE(sk_pacing_rate);
+            /* The 32-bit version saturates */
+            if (*optlen < (socklen_t) sizeof(u64))
+                return put_option<u32>(rate > UINT32_MAX ? UINT32_MAX : rate, optval, optlen);
+            return put_option<u64>(rate, optval, optlen);
+        }
+
         default:
             return -ENOPROTOOPT;
     }
@@ -1073,6 +1088,28 @@ int socket::setsockopt_socket_level(int optname, const void *optval, socklen_t o
             return 0;
         }
 
+        case SO_REUSEPORT: {
+            auto ex = get_socket_option<int>(optval, optlen);
+
+            if (ex.has_error())
+                return ex.error();
+
+            /* Group membership gets looked up locklessly, so it can't change once we're in the
+             * socket table */
+            if (bound)
+                return -EINVAL;
+
+            reuse_port = ex.value() != 0;
+            if (reuse_port)
+            {
+                struct creds *c = creds_get();
+                reuseport_uid = c->euid;
+                creds_put(c);
+            }
+
+            return 0;
+        }
+
         case SO_BROADCAST: {
             auto ex = get_socket_option<int>(optval, optlen);
 
@@ -1082,6 +1119,28 @@ int socket::setsockopt_socket_level(int optname, const void *optval, socklen_t o
             broadcast_allowed = ex.value() != 0;
             return 0;
         }
+
+        case SO_MAX_PACING_RATE: {
+            /* Either a u32 or a u64, ~0U being unlimited in both cases */
+            unsigned long rate;
+            if (optlen == sizeof(u32))
+            {
+                auto ex = get_socket_option<u32>(optval, optlen);
+                if (ex.has_error())
+                    return ex.error();
+                rate = ex.value() == UINT32_MAX ? ~0UL : ex.value();
+            }
+            else
+            {
+                auto ex = get_socket_option<u64>(optval, optlen);
+                if (ex.has_error())
+                    return ex.error();
+                rate = ex.value();
+            }
+
+            WRITE_ONCE(sk_pacing_rate, rate);
+            return 0;
+        }
     }
 
     return -ENOPROTOOPT;
@@ -1343,6 +1402,124 @@ ssize_t sys_recvmsg(int sockfd, struct msghdr *msg, int flags)
     return socket_recvmsg(sock, msg, flags | fd_flags_to_msg_flags(f.get_file()));
 }
 
+/* Batches bigger than this get cut short, like with any other partial success */
+#define MMSG_MAX_VLEN 1024
+
+int sys_sendmmsg(int sockfd, struct mmsghdr *msgvec, unsigned int vlen, int flags)
+{
+    auto_file f = get_socket_fd(sockfd);
+    if (!f)
+        return -errno;
+
+    socket *sock = file_to_socket(f);
+    flags |= fd_flags_to_msg_flags(f.get_file());
+    vlen = min(vlen, (unsigned int) MMSG_MAX_VLEN);
+
+    unsigned int i;
+    for (i = 0; i < vlen; i++)
+    {
+        ssize_t st = socket_sendmsg(sock, &msgvec[i].msg_hdr, flags);
+        if (st < 0)
+            return i ? (int) i : (int) st;
+
+        unsigned int len = (unsigned int) st;
+        if (copy_to_user(&msgvec[i].msg_len, &len, sizeof(len)) < 0)
+            return i ? (int) i : -EFAULT;
+    }
+
+    return (int) i;
+}
+
+int sys_recvmmsg(int sockfd, struct mmsghdr *msgvec, unsigned int vlen, int flags,
+                 struct timespec *utimeout)
+{
+    hrtime_t deadline = 0;
+    struct timespec ts;
+
+    if (utimeout)
+    {
+        if (copy_from_user(&ts, utimeout, sizeof(ts)) < 0)
+            return -EFAULT;
+        if (!timespec_valid(&ts, false))
+            return -EINVAL;
+        deadline = clocksource_get_time() + timespec_to_hrtime(&ts);
+    }
+
+    auto_file f = get_socket_fd(sockfd);
+    if (!f)
+        return -errno;
+
+    socket *sock = file_to_socket(f);
+    flags |= fd_flags_to_msg_flags(f.get_file());
+    vlen = min(vlen, (unsigned int) MMSG_MAX_VLEN);
+
+    unsigned int i;
+    for (i = 0; i < vlen; i++)
+    {
+        ssize_t st = socket_recvmsg(sock, &msgvec[i].msg_hdr, flags & ~MSG_WAITFORONE);
+        if (st < 0)
+        {
+            /* Having gotten something, running out of datagrams (or getting an error) just ends
+             * the batch. */
+            if (i)
+                break;
+            return (int) st;
+        }
+
+        unsigned int len = (unsigned int) st;
+        if (copy_to_user(&msgvec[i].msg_len, &len, sizeof(len)) < 0)
+            return i ? (int) i : -EFAULT;
+
+        if (flags & MSG_WAITFORONE)
+            flags |= MSG_DONTWAIT;
+
+        /* Like everyone else, the timeout is only checked between datagrams */
+        if (utimeout && clocksource_get_time() >= deadline)
+        {
+            i++;
+            break;
+        }
+    }
+
+    if (utimeout)
+    {
+        hrtime_t now = clocksource_get_time();
+        hrtime_to_timespec(now < deadline ? deadline - now : 0, &ts);
+        if (copy_to_user(utimeout, &ts, sizeof(ts)) < 0)
+            return -EFAULT;
+    }
+
+    return (int) i;
+}
+
+/* msg_control and msg_controllen get advanced past the new cmsg, socket_recvmsg works out how much
+ * got used from what's left. */
+int put_cmsg(struct msghdr *msg, int level, int type, void *data, int len)
+{
+    socklen_t total_len = CMSG_LEN(len);
+    if (msg->msg_controllen < total_len)
+    {
+        /* Truncated... */
+        msg->msg_flags |= MSG_CTRUNC;
+        /* Bail early if we can't even fit a cmsghdr */
+        if (msg->msg_controllen < sizeof(cmsghdr))
+            return 0;
+        total_len = msg->msg_controllen;
+    }
+
+    struct cmsghdr *cmsg = (struct cmsghdr *) msg->msg_control;
+    cmsg->cmsg_level = level;
+    cmsg->cmsg_type = type;
+    cmsg->cmsg_len = total_len;
+    memcpy(CMSG_DATA(cmsg), data, total_len - CMSG_LEN(0));
+
+    /* Increment up to CMSG_SPACE() if possible */
+    total_len = min((socklen_t) CMSG_SPACE(len), msg->msg_controllen);
+    msg->msg_controllen -= total_len;
+    msg->msg_control = (char *) msg->msg_control + total_len;
+    return 0;
+}
+
 void sock_do_post_work(socket *sock)
 {
     return sock->sock_ops->handle_backlog(sock);
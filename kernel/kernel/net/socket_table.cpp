@@ -6,6 +6,64 @@
 #include <onyx/net/inet_socket.h>
 #include <onyx/net/socket_table.h>
 
+static fnv_hash_t reuseport_hash(const socket_id &id)
+{
+    fnv_hash_t hash;
+    if (id.domain == AF_INET)
+    {
+        hash = fnv_hash(&id.src_addr.in4, sizeof(id.src_addr.in4));
+        hash = fnv_hash_cont(&id.dst_addr.in4, sizeof(id.dst_addr.in4), hash);
+    }
+    else
+    {
+        hash = fnv_hash(&id.src_addr.in6, sizeof(id.src_addr.in6));
+        hash = fnv_hash_cont(&id.dst_addr.in6, sizeof(id.dst_addr.in6), hash);
+    }
+
+    hash = fnv_hash_cont(&id.src_addr.port, sizeof(in_port_t), hash);
+    return fnv_hash_cont(&id.dst_addr.port, sizeof(in_port_t), hash);
+}
+
+/**
+ * @brief Pick the socket out of a SO_REUSEPORT group that gets this 4-tuple
+ * Every packet of a given flow ends up on the same socket, as long as the group doesn't change.
+ *
+ * Group membership is read without the socket locks, so it may change under us (a UDP socket
+ * getting connected). If the group we see shifts between passes, fall back to the first member.
+ *
+ * @param list Hashtable bucket
+ * @param id Socket id we're looking up
+ * @param flags GET_SOCKET_* flags
+ * @param first First member of the group we found
+ * @return The chosen socket
+ */
+static inet_socket *reuseport_select(struct list_head *list, const socket_id &id,
+                                     unsigned int flags, inet_socket *first)
+{
+    unsigned int nr_members = 0;
+
+    list_for_every (list)
+    {
+        auto sock = list_head_cpp<inet_socket>::self_from_list_head(l);
+        if (sock->in_reuseport_group() && sock->is_id(id, flags))
+            nr_members++;
+    }
+
+    if (nr_members == 0) [[unlikely]]
+        return first;
+
+    unsigned int chosen = reuseport_hash(id) % nr_members;
+
+    list_for_every (list)
+    {
+        auto sock = list_head_cpp<inet_socket>::self_from_list_head(l);
+        if (sock->in_reuseport_group() && sock->is_id(id, flags) && chosen-- == 0)
+            return sock;
+    }
+
+    return first;
+}
+
 inet_socket *socket_table::get_socket(const socket_id &id, unsigned int flags, unsigned int inst)
 {
     auto hash = inet_socket::make_hash_from_id(id);
@@ -26,12 +84,25 @@ inet_socket *socket_table::get_socket(const socket_id &id, unsigned int flags, u
     auto list = socket_hashtable.get_hashtable(index);
 
     inet_socket *ret = nullptr;
+    inet_socket *reuseport_sock = nullptr;
 
     list_for_every (list)
     {
         auto sock = list_head_cpp<inet_socket>::self_from_list_head(l);
 
-        if (sock->is_id(id, flags) && inst-- == 0)
+        if (!sock->is_id(id, flags))
+            continue;
+
+        if (flags & GET_SOCKET_REUSEPORT && sock->in_reuseport_group())
+        {
+            /* Only one socket out of the group gets to match */
+            if (!reuseport_sock)
+                reuseport_sock = reuseport_select(list, id, flags, sock);
+            if (sock != reuseport_sock)
+                continue;
+        }
+
+        if (inst-- == 0)
         {
             ret = sock;
             break;
@@ -51,6 +122,27 @@ inet_socket *socket_table::get_socket(const socket_id &id, unsigned int flags, u
     return ret;
 }
 
+bool socket_table::bind_conflicts(const socket_id &id, const inet_socket *sock,
+                                  unsigned int flags)
+{
+    auto hash = inet_socket::make_hash_from_id(id);
+    auto list = socket_hashtable.get_hashtable(socket_hashtable.get_hashtable_index(hash));
+
+    list_for_every (list)
+    {
+        auto other = list_head_cpp<inet_socket>::self_from_list_head(l);
+
+        if (!other->is_id(id, flags))
+            continue;
+
+        if (!sock->reuse_port || !other->reuse_port ||
+            sock->reuseport_uid != other->reuseport_uid)
+            return true;
+    }
+
+    return false;
+}
+
 bool socket_table::add_socket(inet_socket *sock, unsigned int flags)
 {
     bool unlocked = flags & ADD_SOCKET_UNLOCKED;
@@ -131,9 +131,12 @@ static void tcp_init_sock(struct tcp_socket *sock)
     INIT_LIST_HEAD(&sock->conn_queue);
     INIT_LIST_HEAD(&sock->accept_queue);
     sock->connqueue_len = 0;
-    /* Default the send buf to 4MiB, and the rcv buf to 16MiB */
+    sock->acceptq_len = 0;
+    sock->last_syncookie = 0;
+    /* Default the send buf to 4MiB. The rcv buf starts small and gets autotuned as the application
+     * reads (see tcp_rcv_space_adjust). */
     sock->sk_sndbuf = 0x400000;
-    sock->sk_rcvbuf = 0x1000000;
+    sock->sk_rcvbuf = TCP_RCVBUF_INITIAL;
 }
 
 static __init void tcp_init()
@@ -177,6 +180,61 @@ u8 tcp_calculate_win_scale(u32 win)
     return (ilog2(win - 1) + 1) - 15;
 }
 
+/**
+ * @brief Pick the window scale we announce
+ * The window can only grow as far as the scale lets it, so unless the application fixed the
+ * buffer size with SO_RCVBUF, size it for what autotuning may grow the buffer to.
+ *
+ * @param tp TCP socket
+ * @return Window scale
+ */
+u8 tcp_select_wscale(struct tcp_socket *tp)
+{
+    u32 space = tp->rcvbuf_locked ? tp->sk_rcvbuf : cul::max(tp->sk_rcvbuf, (u32) TCP_RCVBUF_MAX);
+    if (space <= UINT16_MAX)
+        return 0;
+    return min<u8>(tcp_calculate_win_scale(space), 14);
+}
+
+/**
+ * @brief Get our current TSval
+ *
+ * @param sock TCP socket
+ * @return Millisecond timestamp clock, offset per connection (RFC7323, 5.4)
+ */
+u32 tcp_ts_now(struct tcp_socket *sock)
+{
+    return (u32) (clocksource_get_time() / NS_PER_MS) + sock->ts_offset;
+}
+
+static void tcp_write_timestamp(u8 *opt, u32 ts_val, u32 ts_ecr)
+{
+    ts_val = htonl(ts_val);
+    ts_ecr = htonl(ts_ecr);
+    opt[0] = TCP_OPTION_TIMESTAMP;
+    opt[1] = TCP_OPTION_TIMESTAMP_LEN;
+    memcpy(&opt[2], &ts_val, sizeof(u32));
+    memcpy(&opt[6], &ts_ecr, sizeof(u32));
+}
+
+/**
+ * @brief Push the timestamp option on a non-SYN segment, if we're doing timestamps
+ *
+ * @param sock TCP socket
+ * @param pbf Packetbuf
+ * @return Length of the options pushed
+ */
+static u16 tcp_push_timestamp(struct tcp_socket *sock, struct packetbuf *pbf)
+{
+    if (!sock->ts_ok)
+        return 0;
+
+    u8 *opt = (u8 *) pbf_push_header(pbf, TCP_TIMESTAMP_ALIGNED_LEN);
+    opt[0] = opt[1] = TCP_OPTION_NOP;
+    tcp_write_timestamp(&opt[2], tcp_ts_now(sock), sock->ts_recent);
+    return TCP_TIMESTAMP_ALIGNED_LEN;
+}
+
 static size_t tcp_push_options(struct tcp_socket *sock, struct packetbuf *pbf)
 {
     auto inet_hdr_len = sock->effective_domain() == AF_INET ? sizeof(ip_header) : sizeof(ip6hdr);
@@ -196,7 +254,7 @@ static size_t tcp_push_options(struct tcp_socket *sock, struct packetbuf *pbf)
     u8 *scale_opt = (u8 *) pbf_push_header(pbf, 3);
     scale_opt[0] = TCP_OPTION_WINDOW_SCALE;
     scale_opt[1] = 3;
-    scale_opt[2] = tcp_calculate_win_scale(sock->rcv_wnd);
+    scale_opt[2] = tcp_select_wscale(sock);
     options_len += 3;
     sock->rcv_wnd_shift = scale_opt[2];
 
@@ -205,6 +263,11 @@ static size_t tcp_push_options(struct tcp_socket *sock, struct packetbuf *pbf)
     sack_opt[1] = 2;
     options_len += 2;
 
+    /* Offer timestamps. TSecr is 0, we haven't heard from the peer. */
+    tcp_write_timestamp((u8 *) pbf_push_header(pbf, TCP_OPTION_TIMESTAMP_LEN), tcp_ts_now(sock),
+                        0);
+    options_len += TCP_OPTION_TIMESTAMP_LEN;
+
     if (options_len % 4)
     {
         unsigned int nops = ALIGN_TO(options_len, 4) - options_len;
@@ -239,6 +302,10 @@ static u16 tcp_select_wsize(struct tcp_socket *tp)
         new_win = old_win;
     }
 
+    /* Don't promise more than we can express */
+    if (new_win > (u32) UINT16_MAX << tp->rcv_wnd_shift)
+        new_win = (u32) UINT16_MAX << tp->rcv_wnd_shift;
+
     tp->rcv_wup = tp->rcv_next;
     tp->rcv_wnd = new_win;
     if (unlikely(tp->rcv_wnd_shift == 0 && tp->rcv_wnd > UINT16_MAX))
@@ -256,11 +323,15 @@ static int tcp_sendpbuf(struct tcp_socket *sock, struct packetbuf *pbf)
     u8 flags = 0;
 
     DCHECK(pbf->transport_header == NULL);
+    /* We send clones, which don't carry the socket. The qdisc needs it for the pacing rate. */
+    pbf->sock = sock;
     if (pbf->tpi.syn)
     {
         /* We send extra options as part of a syn or synack */
         header_length += tcp_push_options(sock, pbf);
     }
+    else
+        header_length += tcp_push_timestamp(sock, pbf);
 
 #if 0
     pr_warn("segment len %u\n", segment_len);
@@ -326,16 +397,19 @@ static void pbf_init_tcp(struct packetbuf *pbf)
 
 static u16 tcp_prepare_sacks(struct tcp_socket *sock, struct packetbuf *pbf)
 {
-    u16 len = 2 + sock->nr_sacks * 8;
+    /* With timestamps taking 12 bytes, only 3 blocks fit. Skip the oldest. */
+    unsigned int nr = min(sock->nr_sacks, sock->ts_ok ? 3U : 4U);
+    unsigned int first = sock->nr_sacks - nr;
+    u16 len = 2 + nr * 8;
     u32 *sack;
-    u8 *sack_opt = (u8 *) pbf_push_header(pbf, 2 + sock->nr_sacks * 8);
+    u8 *sack_opt = (u8 *) pbf_push_header(pbf, 2 + nr * 8);
     sack_opt[0] = TCP_OPTION_SACK;
-    sack_opt[1] = 2 + sock->nr_sacks * 8;
+    sack_opt[1] = 2 + nr * 8;
     sack = (u32 *) &sack_opt[2];
-    for (int i = sock->nr_sacks - 1; i >= 0; i--)
+    for (int i = nr - 1; i >= 0; i--)
     {
-        u32 start = htonl(sock->sacks[i].start);
-        u32 end = htonl(sock->sacks[i].end);
+        u32 start = htonl(sock->sacks[first + i].start);
+        u32 end = htonl(sock->sacks[first + i].end);
         memcpy(&sack[i * 2], &start, sizeof(u32));
         memcpy(&sack[i * 2 + 1], &end, sizeof(u32));
     }
@@ -359,6 +433,7 @@ static void tcp_prepare_nondata_header(struct tcp_socket *sock, struct packetbuf
     u16 header_len = sizeof(struct tcp_header);
     if (sock->sack_needs_send)
         header_len += tcp_prepare_sacks(sock, pbf);
+    header_len += tcp_push_timestamp(sock, pbf);
 
     hdr = (struct tcp_header *) pbf_push_header(pbf, sizeof(struct tcp_header));
     memset(hdr, 0, sizeof(struct tcp_header));
@@ -418,9 +493,48 @@ int tcp_send_ack(struct tcp_socket *sock)
     return err;
 }
 
-static void tcp_start_retransmit_timer(struct tcp_socket *sock, hrtime_t timeout);
+/**
+ * @brief Current retransmission timeout, with exponential backoff applied
+ */
+static hrtime_t tcp_rto(struct tcp_socket *sock)
+{
+    hrtime_t rto = sock->rto;
+    for (int i = 0; i < sock->retransmit_try && rto < TCP_RTO_MAX; i++)
+        rto *= 2;
+    return min(rto, TCP_RTO_MAX);
+}
 
-static void tcp_retransmit_segments(struct tcp_socket *sock)
+static int tcp_retransmit_pbf(struct tcp_socket *sock, struct packetbuf *pbf)
+{
+    struct packetbuf *clone = packetbuf_clone(pbf);
+    if (!clone)
+        return -ENOBUFS;
+
+    pbf->tpi.retrans = 1;
+    pbf->tpi.lost = 0;
+    pbf->tpi.xmit_time = clocksource_get_time();
+    return tcp_sendpbuf(sock, clone);
+}
+
+/**
+ * @brief Retransmit every segment marked lost
+ * Socket lock must be held.
+ *
+ * @param sock TCP socket
+ */
+void tcp_retransmit_lost(struct tcp_socket *sock)
+{
+    struct packetbuf *pbf;
+    list_for_each_entry (pbf, &sock->on_wire_queue, list_node)
+    {
+        if (!pbf->tpi.lost)
+            continue;
+        if (tcp_retransmit_pbf(sock, pbf) < 0)
+            break;
+    }
+}
+
+static void tcp_rto_expired(struct tcp_socket *sock)
 {
     struct packetbuf *pbf;
     if (sock->retransmit_try == tcp_retransmission_max)
@@ -434,21 +548,57 @@ static void tcp_retransmit_segments(struct tcp_socket *sock)
         return;
     }
 
-    /* Go through pending out, resubmit, and reschedule a new timer */
+    /* Everything the peer didn't SACK is presumed lost. Resubmit and back off. */
     list_for_each_entry (pbf, &sock->on_wire_queue, list_node)
     {
-        struct packetbuf *clone = packetbuf_clone(pbf);
-        if (!clone)
-            return;
-
-        tcp_sendpbuf(sock, clone);
+        if (!pbf->tpi.sacked)
+            pbf->tpi.lost = 1;
     }
 
-    hrtime_t timeout = 200 * NS_PER_MS;
+    tcp_retransmit_lost(sock);
+    sock->tlp_pending = 0;
     sock->retransmit_try++;
-    for (int i = 0; i < sock->retransmit_try; i++)
-        timeout *= 2;
-    tcp_start_retransmit_timer(sock, timeout);
+    tcp_arm_timer(sock, TCP_TIMER_RTO, tcp_rto(sock));
+}
+
+/**
+ * @brief Send a tail loss probe (RFC8985)
+ * New data if the window lets us, else the last segment again. Either way, the ACK it elicits
+ * (with SACK blocks) lets RACK find out about the losses at the tail, without waiting on an RTO.
+ */
+static void tcp_send_probe(struct tcp_socket *sock)
+{
+    struct packetbuf *last;
+
+    sock->retrans_active = false;
+    sock->tlp_pending = 1;
+    if (!list_is_empty(&sock->output_queue) && tcp_output(sock) == 0)
+        return;
+
+    if (!list_is_empty(&sock->on_wire_queue))
+    {
+        last = list_last_entry(&sock->on_wire_queue, struct packetbuf, list_node);
+        tcp_retransmit_pbf(sock, last);
+    }
+
+    tcp_arm_timer(sock, TCP_TIMER_RTO, tcp_rto(sock));
+}
+
+static void tcp_retransmit_segments(struct tcp_socket *sock)
+{
+    switch (sock->timer_mode)
+    {
+        case TCP_TIMER_RTO:
+            tcp_rto_expired(sock);
+            break;
+        case TCP_TIMER_REO:
+            sock->retrans_active = false;
+            tcp_rack_recover(sock);
+            break;
+        case TCP_TIMER_TLP:
+            tcp_send_probe(sock);
+            break;
+    }
 }
 
 static void tcp_do_retransmit(struct tcp_socket *sock)
@@ -470,13 +620,55 @@ static void tcp_out_timeout(clockevent *ev)
     tcp_do_retransmit(t);
 }
 
-void tcp_start_retransmit_timer(struct tcp_socket *sock, hrtime_t timeout)
+/**
+ * @brief (Re)arm the retransmit timer
+ * Socket lock must be held.
+ *
+ * @param sock TCP socket
+ * @param mode What to do when it fires
+ * @param timeout Timeout, relative to now
+ */
+void tcp_arm_timer(struct tcp_socket *sock, enum tcp_timer_mode mode, hrtime_t timeout)
 {
+    if (sock->retrans_active)
+        timer_cancel_event(&sock->retransmit_timer);
+    sock->timer_mode = mode;
     sock->retransmit_timer.callback = tcp_out_timeout;
     sock->retransmit_timer.flags = 0;
     sock->retransmit_timer.deadline = clocksource_get_time() + timeout;
     sock->retransmit_timer.priv = sock;
     timer_queue_clockevent(&sock->retransmit_timer);
+    sock->retrans_active = true;
+}
+
+/**
+ * @brief Re-arm the retransmit timer, after new data got ACK'd or the timer did its thing
+ * Picks a tail loss probe if we can (RTT estimate and SACK), else a plain RTO.
+ * Socket lock must be held.
+ *
+ * @param sock TCP socket
+ */
+void tcp_rearm_timer(struct tcp_socket *sock)
+{
+    hrtime_t pto;
+
+    if (list_is_empty(&sock->on_wire_queue))
+    {
+        tcp_stop_retransmit(sock);
+        return;
+    }
+
+    if (!sock->sacking || !sock->srtt || sock->tlp_pending)
+    {
+        tcp_arm_timer(sock, TCP_TIMER_RTO, tcp_rto(sock));
+        return;
+    }
+
+    pto = 2 * sock->srtt;
+    /* With a single segment out, the ACK may get delayed */
+    if (list_is_singular(&sock->on_wire_queue))
+        pto += TCP_WC_DELACK;
+    tcp_arm_timer(sock, TCP_TIMER_TLP, min(pto, tcp_rto(sock)));
 }
 
 void tcp_start_retransmit(struct tcp_socket *sock)
@@ -485,8 +677,7 @@ void tcp_start_retransmit(struct tcp_socket *sock)
     if (sock->retrans_active)
         return;
     sock->retransmit_try = 0;
-    tcp_start_retransmit_timer(sock, 200 * NS_PER_MS);
-    sock->retrans_active = true;
+    tcp_rearm_timer(sock);
 }
 
 void tcp_stop_retransmit(struct tcp_socket *sock)
@@ -524,6 +715,8 @@ int tcp_output(struct tcp_socket *sock)
 
         /* We're outputting this segment - assign snd_next and bump it */
         pbf->tpi.seq = sock->snd_next;
+        pbf->tpi.sacked = pbf->tpi.retrans = pbf->tpi.lost = 0;
+        pbf->tpi.xmit_time = clocksource_get_time();
         sock->snd_next += pbf->tpi.seq_len;
 
         struct packetbuf *clone = packetbuf_clone(pbf);
@@ -552,6 +745,7 @@ int tcp_start_connection(struct tcp_socket *sock, int flags)
 {
     int err;
     sock->snd_next = sock->snd_una = arc4random();
+    sock->ts_offset = arc4random();
 
     auto fam = sock->get_proto_fam();
     auto result = fam->route(sock->src_addr, sock->dest_addr, sock->domain);
@@ -1027,6 +1221,49 @@ static void tcp_update_rmem_window(struct tcp_socket *tp, size_t bytes_read)
         tcp_send_ack(tp);
 }
 
+/**
+ * @brief Grow the receive buffer to keep up with the application (dynamic right-sizing)
+ * Once per RTT, look at how much the application read in that RTT. To not be the bottleneck, the
+ * window needs to fit about twice that: one RTT's worth in flight, and one for the application to
+ * read while the ACKs make their way back. Socket lock must be held.
+ *
+ * @param tp TCP socket
+ * @param copied Bytes just read by the application
+ */
+static void tcp_rcv_space_adjust(struct tcp_socket *tp, size_t copied)
+{
+    hrtime_t now = clocksource_get_time();
+    hrtime_t rtt = tp->rcv_rtt ?: tp->srtt;
+    u64 want;
+
+    tp->rcvq_copied += copied;
+    if (!tp->rcvq_time)
+    {
+        tp->rcvq_time = now;
+        return;
+    }
+
+    if (!rtt || now - tp->rcvq_time < rtt)
+        return;
+
+    if (!tp->rcvbuf_locked && tp->rcvq_copied > tp->rcvq_space)
+    {
+        want = 2 * (u64) tp->rcvq_copied;
+        /* If the application is speeding up, assume it keeps doing so for another RTT */
+        if (tp->rcvq_space)
+            want += want * (tp->rcvq_copied - tp->rcvq_space) / tp->rcvq_space;
+        /* sk_rmem also counts headers and packetbuf slack, leave room for those */
+        want += want / 4 + 16 * tp->mss;
+        want = min<u64>(want, TCP_RCVBUF_MAX);
+        if (want > tp->sk_rcvbuf)
+            WRITE_ONCE(tp->sk_rcvbuf, (unsigned int) want);
+    }
+
+    tp->rcvq_space = tp->rcvq_copied;
+    tp->rcvq_copied = 0;
+    tp->rcvq_time = now;
+}
+
 static ssize_t tcp_recvmsg(struct socket *sock_, msghdr *msg, int flags)
 {
     size_t bytes_read = 0;
@@ -1088,6 +1325,7 @@ static ssize_t tcp_recvmsg(struct socket *sock_, msghdr *msg, int flags)
     if (bytes_read > 0 && !(flags & MSG_PEEK))
     {
         /* pbfs freed, communicate the new window if required */
+        tcp_rcv_space_adjust(sock, bytes_read);
         tcp_update_rmem_window(sock, bytes_read);
     }
 
@@ -1242,7 +1480,12 @@ void tcp_done_error(struct tcp_socket *sock, int err)
 static void tcp_close(struct socket *sock_)
 {
     struct tcp_socket *sock = TCP_SOCK(sock_);
+    struct list_head unaccepted;
+    bool listening;
+
+    INIT_LIST_HEAD(&unaccepted);
     sock->socket_lock.lock();
+    listening = sock->state == TCP_STATE_LISTEN;
 
     if (!list_is_empty(&sock->read_queue))
     {
@@ -1260,15 +1503,27 @@ static void tcp_close(struct socket *sock_)
         tcp_set_state(sock, post_wr_shutdown_states[sock->state]);
     }
 
-    if (sock->state == TCP_STATE_LISTEN)
+    if (listening)
     {
-        /* LISTEN -> CLOSED Just Works */
+        /* LISTEN -> CLOSED Just Works, as long as we drop the connections that never made it out
+         * of the queues. */
         tcp_set_state(sock, TCP_STATE_CLOSED);
+        tcp_listen_stop(sock);
+        list_move(&unaccepted, &sock->accept_queue);
+        sock->acceptq_len = 0;
     }
 
     sock->dead = true;
     sock->socket_lock.unlock_sock(sock_);
 
+    list_for_every_safe (&unaccepted)
+    {
+        struct tcp_socket *child = list_head_cpp<tcp_socket>::self_from_list_head(l);
+        list_remove(&child->conn_queue);
+        child->sock_ops->close(child);
+        child->unref();
+    }
+
     if (sock->state == TCP_STATE_CLOSED)
         tcp_destroy_sock(sock);
 }
@@ -1276,6 +1531,9 @@ static void tcp_close(struct socket *sock_)
 static int tcp_listen(struct socket *sock_)
 {
     struct tcp_socket *sock = TCP_SOCK(sock_);
+    /* listen() on a listening socket just updates the backlog */
+    if (sock->state == TCP_STATE_LISTEN)
+        return 0;
     if (sock->state != TCP_STATE_CLOSED)
         return -EINVAL;
 
@@ -1308,8 +1566,10 @@ struct socket *tcp_accept(struct socket *sock_, int flags)
     }
 
     CHECK(!list_is_empty(&sock->accept_queue));
-    new_sock = list_first_entry(&sock->accept_queue, struct tcp_socket, conn_queue);
+    new_sock =
+        list_head_cpp<tcp_socket>::self_from_list_head(list_first_element(&sock->accept_queue));
     list_remove(&new_sock->conn_queue);
+    sock->acceptq_len--;
     sock->socket_lock.unlock();
     return new_sock;
 }
@@ -1360,8 +1620,6 @@ struct socket *tcp_create_socket(int type)
 
 static size_t tcp_push_synack_options(struct tcp_connreq *conn, struct packetbuf *pbf)
 {
-    size_t inet_hdr_len = conn->tc_domain == AF_INET ? sizeof(ip_header) : sizeof(ip6hdr);
-    conn->tc_our_mss = conn->tc_route.nif->mtu - sizeof(tcp_header) - inet_hdr_len;
     uint16_t our_mss = htons(conn->tc_our_mss);
     size_t options_len = 0;
 
@@ -1376,10 +1634,18 @@ static size_t tcp_push_synack_options(struct tcp_connreq *conn, struct packetbuf
         u8 *scale_opt = (u8 *) pbf_push_header(pbf, 3);
         scale_opt[0] = TCP_OPTION_WINDOW_SCALE;
         scale_opt[1] = 3;
-        scale_opt[2] = 8;
+        scale_opt[2] = conn->tc_rcv_wscale;
         options_len += 3;
     }
 
+    if (conn->tc_opts.has_timestamp)
+    {
+        u32 now = (u32) (clocksource_get_time() / NS_PER_MS) + conn->tc_ts_offset;
+        tcp_write_timestamp((u8 *) pbf_push_header(pbf, TCP_OPTION_TIMESTAMP_LEN), now,
+                            conn->tc_opts.ts_val);
+        options_len += TCP_OPTION_TIMESTAMP_LEN;
+    }
+
     if (conn->tc_opts.sacking)
     {
         u8 *sack_opt = (u8 *) pbf_push_header(pbf, 2);
@@ -1399,16 +1665,38 @@ static size_t tcp_push_synack_options(struct tcp_connreq *conn, struct packetbuf
     return options_len;
 }
 
+/**
+ * @brief Route a connreq back to the peer, and work out our MSS
+ * Does nothing if the connreq was already routed.
+ *
+ * @param conn Connreq
+ * @return 0 on success, negative error codes
+ */
+int tcp_connreq_route(struct tcp_connreq *conn)
+{
+    size_t inet_hdr_len = conn->tc_domain == AF_INET ? sizeof(ip_header) : sizeof(ip6hdr);
+
+    if (conn->tc_route.nif)
+        return 0;
+
+    auto ex = ip::v6::get_v6_proto()->route(conn->tc_src, conn->tc_dst, conn->tc_domain);
+    if (ex.has_error())
+        return ex.error();
+    conn->tc_route = ex.value();
+    conn->tc_our_mss = conn->tc_route.nif->mtu - sizeof(tcp_header) - inet_hdr_len;
+    return 0;
+}
+
 int tcp_send_synack(struct tcp_connreq *conn)
 {
     int err;
     struct inet_route *route = &conn->tc_route;
     struct tcp_header *hdr;
     size_t header_len = sizeof(struct tcp_header);
-    auto ex = ip::v6::get_v6_proto()->route(conn->tc_src, conn->tc_dst, conn->tc_domain);
-    if (ex.has_error())
-        return ex.error();
-    conn->tc_route = ex.value();
+
+    err = tcp_connreq_route(conn);
+    if (err)
+        return err;
 
     struct packetbuf *pbf = pbf_alloc(GFP_ATOMIC);
     if (!pbf)
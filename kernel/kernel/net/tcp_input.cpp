@@ -7,6 +7,8 @@
  */
 #include <stdint.h>
 
+#include <onyx/clock.h>
+#include <onyx/fnv.h>
 #include <onyx/mm/slab.h>
 #include <onyx/net/tcp.h>
 #include <onyx/random.h>
@@ -14,21 +16,60 @@
 #include <onyx/rcupdate.h>
 
 static void tcp_reset(struct tcp_socket *sock);
+static int tcp_in_pbf(struct tcp_socket *sock, struct packetbuf *pbf);
 
-struct list_head connreq_table[64];
-static struct spinlock connreq_locks[64];
+#define CONNREQ_HASHTAB_SIZE 1024
+
+static struct list_head connreq_table[CONNREQ_HASHTAB_SIZE];
+static struct spinlock connreq_locks[CONNREQ_HASHTAB_SIZE];
+static u32 connreq_hash_seed;
+#ifdef CONFIG_TCP_SYNCOOKIES
+static u32 syncookie_secret[4];
+#endif
+
+/* How long a connreq may sit in the SYN queue before getting reaped */
+#define TCP_CONNREQ_TIMEOUT (30 * NS_PER_SEC)
 
 __init static void connreq_tab_init()
 {
-    for (int i = 0; i < 64; i++)
+    for (int i = 0; i < CONNREQ_HASHTAB_SIZE; i++)
         INIT_LIST_HEAD(&connreq_table[i]);
+    connreq_hash_seed = arc4random();
+#ifdef CONFIG_TCP_SYNCOOKIES
+    arc4random_buf(syncookie_secret, sizeof(syncookie_secret));
+#endif
+}
+
+static fnv_hash_t tcp_hash_tuple(const inet_sock_address &us, const inet_sock_address &remote,
+                                 int domain, fnv_hash_t hash)
+{
+    if (domain == AF_INET)
+    {
+        hash = fnv_hash_cont(&us.in4, sizeof(us.in4), hash);
+        hash = fnv_hash_cont(&remote.in4, sizeof(remote.in4), hash);
+    }
+    else
+    {
+        hash = fnv_hash_cont(&us.in6, sizeof(us.in6), hash);
+        hash = fnv_hash_cont(&remote.in6, sizeof(remote.in6), hash);
+    }
+
+    hash = fnv_hash_cont(&us.port, sizeof(us.port), hash);
+    return fnv_hash_cont(&remote.port, sizeof(remote.port), hash);
+}
+
+/* Hash the whole 4-tuple, seeded. The socket hash only looks at the local port, which would put
+ * every connreq for a listener in the same bucket. */
+static u32 tcp_connreq_hash(const inet_sock_address &us, const inet_sock_address &remote,
+                            int domain)
+{
+    fnv_hash_t hash = fnv_hash(&connreq_hash_seed, sizeof(connreq_hash_seed));
+    return tcp_hash_tuple(us, remote, domain, hash) & (CONNREQ_HASHTAB_SIZE - 1);
 }
 
 static void tcp_add_to_synacks(struct tcp_connreq *conn)
 {
-    const socket_id id(IPPROTO_TCP, AF_INET, conn->tc_src, conn->tc_dst);
-    u32 hash = inet_socket::make_hash_from_id(id);
-    u32 idx = hash & (64 - 1);
+    u32 idx = tcp_connreq_hash(conn->tc_src, conn->tc_dst, conn->tc_domain);
 
     spin_lock(&connreq_locks[idx]);
     list_add_tail_rcu(&conn->tc_hashtab_node, &connreq_table[idx]);
@@ -37,35 +78,35 @@ static void tcp_add_to_synacks(struct tcp_connreq *conn)
 
 static void tcp_remove_synack(struct tcp_connreq *conn)
 {
-    const socket_id id(IPPROTO_TCP, AF_INET, conn->tc_src, conn->tc_dst);
-    u32 hash = inet_socket::make_hash_from_id(id);
-    u32 idx = hash & (64 - 1);
+    u32 idx = tcp_connreq_hash(conn->tc_src, conn->tc_dst, conn->tc_domain);
 
     spin_lock(&connreq_locks[idx]);
     list_remove_rcu(&conn->tc_hashtab_node);
     spin_unlock(&connreq_locks[idx]);
 }
 
-static struct tcp_connreq *tcp4_find_synacks(in_addr_t src_ip, in_port_t src_port, in_addr_t dst_ip,
-                                             in_port_t dst_port)
+/**
+ * @brief Look up a live connreq
+ *
+ * @param us Local address
+ * @param remote Remote address
+ * @param domain AF_INET or AF_INET6
+ * @return Locked connreq, or NULL
+ */
+static struct tcp_connreq *tcp_find_synacks(const inet_sock_address &us,
+                                            const inet_sock_address &remote, int domain)
 {
     struct tcp_connreq *req = NULL;
-    const in_addr in = {src_ip};
-    const in_addr out = {dst_ip};
-    inet_sock_address remote{in, src_port};
-    inet_sock_address us{out, dst_port};
-    const socket_id id(IPPROTO_TCP, AF_INET, us, remote);
-
-    u32 hash = inet_socket::make_hash_from_id(id);
-    u32 idx = hash & (64 - 1);
+    u32 idx = tcp_connreq_hash(us, remote, domain);
 
     rcu_read_lock();
 
     list_for_each_entry_rcu (req, &connreq_table[idx], tc_hashtab_node)
     {
-        if (req->tc_domain != AF_INET)
+        if (req->tc_domain != domain)
             continue;
-        if (!req->tc_dst.equals(remote, true) || !req->tc_src.equals(us, true))
+        if (!req->tc_dst.equals(remote, domain == AF_INET) ||
+            !req->tc_src.equals(us, domain == AF_INET))
             continue;
         spin_lock(&req->tc_lock);
 
@@ -84,6 +125,69 @@ out:
     return req;
 }
 
+static void tcp_connreq_free(struct tcp_connreq *conn)
+{
+    if (conn->tc_syndata)
+        pbf_put_ref(conn->tc_syndata);
+    conn->tc_route.~inet_route();
+    kfree_rcu(conn, tc_rcu_head);
+}
+
+/**
+ * @brief Take a connreq off the listener's SYN queue and free it
+ * Must be called with the listener's socket lock held.
+ *
+ * @param sock Listening socket
+ * @param conn Connreq to kill
+ */
+static void tcp_connreq_kill(struct tcp_socket *sock, struct tcp_connreq *conn)
+{
+    bool converting;
+
+    spin_lock(&conn->tc_lock);
+    /* tc_dead without us having set it means tcp_input_conn is turning it into a socket. It'll
+     * see tc_sock != parent once it relocks, and free the connreq itself. */
+    converting = conn->tc_dead;
+    conn->tc_dead = 1;
+    conn->tc_sock = NULL;
+    spin_unlock(&conn->tc_lock);
+
+    list_remove(&conn->tc_list_node);
+    sock->connqueue_len--;
+    if (converting)
+        return;
+
+    tcp_remove_synack(conn);
+    tcp_connreq_free(conn);
+}
+
+static void tcp_prune_connreqs(struct tcp_socket *sock)
+{
+    struct tcp_connreq *conn, *next;
+    hrtime_t now = clocksource_get_time();
+
+    /* The SYN queue is kept in arrival order, so only the head can be expired */
+    list_for_each_entry_safe (conn, next, &sock->conn_queue, tc_list_node)
+    {
+        if (conn->tc_expires > now)
+            break;
+        tcp_connreq_kill(sock, conn);
+    }
+}
+
+/**
+ * @brief Tear down a listener's SYN queue
+ * Must be called with the socket lock held.
+ *
+ * @param sock Listening socket
+ */
+void tcp_listen_stop(struct tcp_socket *sock)
+{
+    struct tcp_connreq *conn, *next;
+    list_for_each_entry_safe (conn, next, &sock->conn_queue, tc_list_node)
+        tcp_connreq_kill(sock, conn);
+}
+
 static void tcp_eat_head(struct packetbuf *pbf, unsigned int len)
 {
     /* TODO: Support packetbufs larger than PAGE_SIZE */
@@ -101,11 +205,187 @@ static void tcp_eat_head(struct packetbuf *pbf, unsigned int len)
     CHECK(pbf->tpi.seq_len > 0);
 }
 
-static int tcp_ack(struct tcp_socket *sock, struct packetbuf *pbuf, struct tcp_header *tcphdr)
+/* Options of the segment being processed, from tcp_parse_options */
+struct tcp_rx_options
+{
+    struct tcp_sack_range sacks[4];
+    unsigned int nr_sacks;
+    bool has_ts;
+    u32 ts_val, ts_ecr;
+};
+
+/**
+ * @brief Take an RTT sample (RFC6298)
+ * Socket lock must be held.
+ *
+ * @param sock TCP socket
+ * @param rtt RTT sample, from a segment that was never retransmitted
+ */
+static void tcp_rtt_sample(struct tcp_socket *sock, hrtime_t rtt)
+{
+    if (!sock->srtt)
+    {
+        sock->srtt = rtt;
+        sock->rttvar = rtt / 2;
+    }
+    else
+    {
+        hrtime_t delta = sock->srtt > rtt ? sock->srtt - rtt : rtt - sock->srtt;
+        /* RTTVAR <- 3/4 * RTTVAR + 1/4 * |SRTT - R'|, SRTT <- 7/8 * SRTT + 1/8 * R' */
+        sock->rttvar = (3 * sock->rttvar + delta) / 4;
+        sock->srtt = (7 * sock->srtt + rtt) / 8;
+    }
+
+    sock->rto = sock->srtt + 4 * sock->rttvar;
+    if (sock->rto < TCP_RTO_MIN)
+        sock->rto = TCP_RTO_MIN;
+    if (sock->rto > TCP_RTO_MAX)
+        sock->rto = TCP_RTO_MAX;
+
+    if (!sock->min_rtt || rtt < sock->min_rtt)
+        sock->min_rtt = rtt;
+}
+
+/**
+ * @brief Work out an RTT from an echoed timestamp
+ * Our timestamp clock ticks in milliseconds, round up to one tick.
+ */
+static hrtime_t tcp_ts_rtt(struct tcp_socket *sock, u32 ts_ecr)
+{
+    u32 delta = tcp_ts_now(sock) - ts_ecr;
+    return (hrtime_t) (delta ?: 1) * NS_PER_MS;
+}
+
+static bool tcp_sent_after(hrtime_t t1, u32 seq1, hrtime_t t2, u32 seq2)
+{
+    return t1 > t2 || (t1 == t2 && after(seq1, seq2));
+}
+
+/**
+ * @brief Update RACK state with a newly delivered segment (RFC8985, 6.2)
+ */
+static void tcp_rack_update(struct tcp_socket *sock, struct packetbuf *pbf, hrtime_t now)
+{
+    hrtime_t rtt = now - pbf->tpi.xmit_time;
+    u32 end_seq = pbf->tpi.seq + pbf->tpi.seq_len;
+
+    /* If this was retransmitted, we don't know which transmission got delivered. An RTT below
+     * min_rtt means the ACK was for the original one, so it doesn't say anything. */
+    if (pbf->tpi.retrans && rtt < sock->min_rtt)
+        return;
+
+    sock->rack_rtt = rtt;
+    if (tcp_sent_after(pbf->tpi.xmit_time, end_seq, sock->rack_xmit_time, sock->rack_end_seq))
+    {
+        sock->rack_xmit_time = pbf->tpi.xmit_time;
+        sock->rack_end_seq = end_seq;
+    }
+}
+
+/**
+ * @brief Mark segments as lost, using RACK (RFC8985, 6.2)
+ * A segment is lost if something sent after it was delivered, and it has been outstanding for
+ * longer than an RTT plus a reordering window.
+ *
+ * @param sock TCP socket
+ * @return If not 0, the time we need to wait before (some) segment could be deemed lost.
+ */
+static hrtime_t tcp_rack_detect_loss(struct tcp_socket *sock)
+{
+    struct packetbuf *pbf;
+    hrtime_t now = clocksource_get_time();
+    hrtime_t reo_wnd = min(sock->min_rtt / 4, sock->srtt);
+    hrtime_t timeout = 0;
+
+    if (!sock->rack_xmit_time)
+        return 0;
+
+    list_for_each_entry (pbf, &sock->on_wire_queue, list_node)
+    {
+        if (pbf->tpi.sacked || pbf->tpi.lost)
+            continue;
+        /* The queue is in sequence order, not send order: a retransmitted segment may be newer
+         * than the ones after it, so keep looking */
+        if (!tcp_sent_after(sock->rack_xmit_time, sock->rack_end_seq, pbf->tpi.xmit_time,
+                            pbf->tpi.seq + pbf->tpi.seq_len))
+            continue;
+
+        hrtime_t deadline = pbf->tpi.xmit_time + sock->rack_rtt + reo_wnd;
+        if (deadline <= now)
+            pbf->tpi.lost = 1;
+        else
+            timeout = cul::max(timeout, deadline - now);
+    }
+
+    return timeout;
+}
+
+/**
+ * @brief Mark segments covered by SACK blocks (RFC2018)
+ * Socket lock must be held.
+ *
+ * @return True if something was newly SACK'd
+ */
+static bool tcp_sack_update(struct tcp_socket *sock, struct tcp_rx_options *opts, hrtime_t now)
+{
+    struct packetbuf *pbf;
+    bool progress = false;
+
+    for (unsigned int i = 0; i < opts->nr_sacks; i++)
+    {
+        struct tcp_sack_range *r = &opts->sacks[i];
+        /* Ignore blocks that don't make sense, or are below snd_una (DSACK) */
+        if (!after(r->end, r->start) || !after(r->start, sock->snd_una) ||
+            after(r->end, sock->snd_next))
+            continue;
+
+        list_for_each_entry (pbf, &sock->on_wire_queue, list_node)
+        {
+            u32 end_seq = pbf->tpi.seq + pbf->tpi.seq_len;
+            if (!before(pbf->tpi.seq, r->end))
+                break;
+            if (pbf->tpi.sacked || before(pbf->tpi.seq, r->start) || after(end_seq, r->end))
+                continue;
+
+            pbf->tpi.sacked = 1;
+            pbf->tpi.lost = 0;
+            tcp_rack_update(sock, pbf, now);
+            progress = true;
+        }
+    }
+
+    return progress;
+}
+
+/**
+ * @brief Detect losses, retransmit what was lost and re-arm the retransmit timer
+ * Socket lock must be held.
+ *
+ * @param sock TCP socket
+ */
+void tcp_rack_recover(struct tcp_socket *sock)
+{
+    hrtime_t reo_timeout = tcp_rack_detect_loss(sock);
+
+    tcp_retransmit_lost(sock);
+    if (reo_timeout)
+    {
+        /* Something may still turn out to be lost, come back when we know */
+        tcp_arm_timer(sock, TCP_TIMER_REO, reo_timeout);
+    }
+    else
+        tcp_rearm_timer(sock);
+}
+
+static int tcp_ack(struct tcp_socket *sock, struct packetbuf *pbuf, struct tcp_header *tcphdr,
+                   struct tcp_rx_options *opts)
 {
     u32 ack = tcphdr->ack_number;
     u32 seq = pbuf->tpi.seq;
     bool attempt_output = false;
+    hrtime_t now = clocksource_get_time();
+    bool sacked = false;
+    bool rtt_sampled = false;
 
     /* If the segment acks something not yet sent, send an ACK */
     if (after(ack, sock->snd_next))
@@ -129,9 +409,20 @@ static int tcp_ack(struct tcp_socket *sock, struct packetbuf *pbuf, struct tcp_h
         }
     }
 
+    if (opts && opts->nr_sacks)
+        sacked = tcp_sack_update(sock, opts, now);
+
     /* If SND.UNA < SEG.ACK =< SND.NXT, then set SND.UNA <- SEG.ACK */
     if (!after(ack, sock->snd_una))
+    {
+        /* Dup ACKs with new SACK info may tell us about losses */
+        if (sacked)
+        {
+            sock->tlp_pending = 0;
+            tcp_rack_recover(sock);
+        }
         return TCP_DROP_ACK_DUP;
+    }
 
     struct packetbuf *pbf, *next;
     list_for_each_entry_safe (pbf, next, &sock->on_wire_queue, list_node)
@@ -159,8 +450,19 @@ static int tcp_ack(struct tcp_socket *sock, struct packetbuf *pbuf, struct tcp_h
             }
         }
 
+        if (!pbf->tpi.sacked)
+        {
+            /* Karn's algorithm: no RTT samples from retransmitted segments */
+            if (!pbf->tpi.retrans)
+            {
+                tcp_rtt_sample(sock, now - pbf->tpi.xmit_time);
+                rtt_sampled = true;
+            }
+            tcp_rack_update(sock, pbf, now);
+        }
+
         if (after(pbf->tpi.seq + pbf->tpi.seq_len, ack))
-            tcp_eat_head(pbf, pbf->tpi.seq + pbf->tpi.seq_len - ack);
+            tcp_eat_head(pbf, ack - pbf->tpi.seq);
         else
         {
             list_remove(&pbf->list_node);
@@ -168,10 +470,19 @@ static int tcp_ack(struct tcp_socket *sock, struct packetbuf *pbuf, struct tcp_h
         }
     }
 
+    /* Only retransmitted segments got ACK'd. The echoed timestamp tells us which transmission
+     * made it, so we still get an RTT sample (RFC7323, 4). */
+    if (!rtt_sampled && opts && opts->has_ts && opts->ts_ecr)
+        tcp_rtt_sample(sock, tcp_ts_rtt(sock, opts->ts_ecr));
+
     sock->snd_una = ack;
+    sock->retransmit_try = 0;
+    sock->tlp_pending = 0;
 
     if (list_is_empty(&sock->on_wire_queue))
         tcp_stop_retransmit(sock);
+    else
+        tcp_rack_recover(sock);
 
     if (attempt_output)
         tcp_output(sock);
@@ -241,6 +552,15 @@ static int tcp_parse_synack_options(struct tcp_synack_options *opts, struct pack
                 opts->has_mss = 1;
                 opts->mss = ntohs(*data16);
                 break;
+            case TCP_OPTION_TIMESTAMP:
+                if (opt_len != TCP_OPTION_TIMESTAMP_LEN - 2)
+                    break;
+                memcpy(&opts->ts_val, data, sizeof(u32));
+                memcpy(&opts->ts_ecr, data + 4, sizeof(u32));
+                opts->ts_val = ntohl(opts->ts_val);
+                opts->ts_ecr = ntohl(opts->ts_ecr);
+                opts->has_timestamp = 1;
+                break;
         }
     }
 
@@ -290,10 +610,18 @@ static int tcp_input_syn_sent(struct tcp_socket *sock, struct packetbuf *pbf)
             sock->rcv_wnd_shift = 0;
         }
 
+        if (opts.has_timestamp)
+        {
+            sock->ts_ok = 1;
+            sock->ts_recent = opts.ts_val;
+            sock->ts_recent_stamp = clocksource_get_time();
+            sock->mss -= TCP_TIMESTAMP_ALIGNED_LEN;
+        }
+
         /* ACK is cromulent, and this is a SYN-ACK. Good. */
         sock->rcv_next = hdr->sequence_number + 1;
         sock->rcv_wup = sock->rcv_next;
-        tcp_ack(sock, pbf, hdr);
+        tcp_ack(sock, pbf, hdr, NULL);
         /* Window size on SYN and SYN ACK segments is never scaled. */
         sock->snd_wnd = ntohs(hdr->window_size);
         sock->snd_wl1 = hdr->sequence_number;
@@ -710,9 +1038,267 @@ static inline void tcp_connreq_init(struct tcp_socket *sock, struct tcp_connreq
     conn->tc_src = from;
     conn->tc_dst = to;
     conn->tc_iss = arc4random();
+    conn->tc_ts_offset = arc4random();
+    conn->tc_rcv_wscale = tcp_select_wscale(sock);
     conn->tc_rcv_nxt = hdr->sequence_number + 1;
 }
 
+/**
+ * @brief Create the socket for a connreq whose handshake just completed
+ * The socket gets bound, in SYN_RECEIVED.
+ *
+ * @param conn Connreq
+ * @param hdr TCP header of the segment that completes the handshake
+ * @return The new socket, or NULL
+ */
+static struct tcp_socket *tcp_connreq_to_sock(struct tcp_connreq *conn, struct tcp_header *hdr)
+{
+    struct tcp_socket *sock, *parent;
+
+    sock = (struct tcp_socket *) tcp_create_socket(SOCK_STREAM);
+    if (!sock)
+        return NULL;
+
+    parent = conn->tc_sock;
+    sock->rcv_mss = conn->tc_domain == AF_INET ? 536 : 1220;
+    sock->send_mss = conn->tc_our_mss;
+    sock->rcv_next = sock->rcv_wup = conn->tc_rcv_nxt;
+    sock->snd_una = conn->tc_iss;
+    sock->snd_next = sock->snd_una + 1;
+    sock->sk_rcvbuf = parent->sk_rcvbuf;
+    sock->sk_sndbuf = parent->sk_sndbuf;
+    sock->rcvbuf_locked = parent->rcvbuf_locked;
+    sock->sndbuf_locked = parent->sndbuf_locked;
+    /* Keep SO_REUSEPORT, so we don't stop the rest of the group from binding */
+    sock->reuse_port = parent->reuse_port;
+    sock->reuseport_uid = parent->reuseport_uid;
+
+    if (conn->tc_opts.has_mss)
+        sock->rcv_mss = conn->tc_opts.mss;
+    if (conn->tc_opts.has_window_scale)
+    {
+        sock->snd_wnd = (u32) ntohs(hdr->window_size) << conn->tc_opts.snd_wnd_shift;
+        sock->snd_wnd_shift = conn->tc_opts.snd_wnd_shift;
+        sock->rcv_wnd = tcp_select_initial_win(sock);
+        /* Must match what the SYN-ACK said */
+        sock->rcv_wnd_shift = conn->tc_rcv_wscale;
+    }
+    else
+    {
+        /* Remote host does not support window scaling, use the traditional defaults. */
+        sock->snd_wnd = ntohs(hdr->window_size);
+        sock->snd_wnd_shift = 0;
+        sock->rcv_wnd_shift = 0;
+    }
+
+    if (conn->tc_opts.sacking)
+        sock->sacking = 1;
+
+    if (conn->tc_opts.has_timestamp)
+    {
+        sock->ts_ok = 1;
+        sock->ts_offset = conn->tc_ts_offset;
+        sock->ts_recent = conn->tc_opts.ts_val;
+        sock->ts_recent_stamp = clocksource_get_time();
+    }
+
+    bool on_ipv4_mode = conn->tc_domain == AF_INET && parent->domain == AF_INET6;
+
+    sock->dest_addr = conn->tc_dst;
+    sock->src_addr = conn->tc_src;
+    sock->ipv4_on_inet6 = on_ipv4_mode;
+    sock->route_cache = cul::move(conn->tc_route);
+    sock->route_cache_valid = 1;
+    sock->proto_domain =
+        parent->domain == AF_INET ? ip::v4::get_v4_proto() : ip::v6::get_v6_proto();
+    sock->domain = parent->domain;
+    sock->proto = parent->proto;
+    sock->type = parent->type;
+
+    /* Note: We bind while holding tc_lock, so no segments may get lost. Others may observe the
+     * !dead connreq in the lists, or a bound socket, but never neither. */
+    if (WARN_ON(!inet_proto_family::add_socket(sock)))
+    {
+        /* This should not be possible... */
+        kfree(sock);
+        return NULL;
+    }
+
+    sock->mss = min(sock->send_mss, sock->rcv_mss);
+    if (sock->ts_ok)
+        sock->mss -= TCP_TIMESTAMP_ALIGNED_LEN;
+
+    /* We'll put our state as SYN_RECEIVED. The generic receive code will take care of moving our
+     * state forwards. */
+    /* TODO: https://datatracker.ietf.org/doc/html/rfc9293#section-3.10.7.4-2.5.2.2.2.2.2.2.1 */
+    tcp_set_state(sock, TCP_STATE_SYN_RECEIVED);
+    sock->connected = true;
+    sock->bound = true;
+    return sock;
+}
+
+#ifdef CONFIG_TCP_SYNCOOKIES
+/* SYN cookies: once the SYN queue is full, instead of keeping a connreq around we encode what we
+ * need of it in our ISN, and rebuild it from the ACK. The ISN looks like:
+ *  [31:27] time counter, in 64 second ticks
+ *  [26:25] index into syncookie_mss
+ *  [24]    SACK permitted
+ *  [23:20] peer's window scale (15 = no window scaling)
+ *  [19:0]  keyed hash of the bits above, the 4-tuple and the peer's ISN
+ * A cookie is good for the tick it was made in and the next one. */
+#define SYNCOOKIE_TICK_SHIFT   6
+#define SYNCOOKIE_T_SHIFT      27
+#define SYNCOOKIE_MSS_SHIFT    25
+#define SYNCOOKIE_SACK_SHIFT   24
+#define SYNCOOKIE_WSCALE_SHIFT 20
+#define SYNCOOKIE_NO_WSCALE    15
+#define SYNCOOKIE_HASH_MASK    ((1U << SYNCOOKIE_WSCALE_SHIFT) - 1)
+/* Only bother checking ACKs on the listener for cookies this long after we last sent one */
+#define SYNCOOKIE_CHECK_WINDOW ((2UL << SYNCOOKIE_TICK_SHIFT) * NS_PER_SEC)
+
+static const u16 syncookie_mss[] = {536, 1220, 1440, 8960};
+
+static u32 syncookie_tick()
+{
+    return (clocksource_get_time() / NS_PER_SEC) >> SYNCOOKIE_TICK_SHIFT;
+}
+
+static u32 syncookie_hash(const struct tcp_connreq *conn, u32 peer_isn, u32 bits)
+{
+    fnv_hash_t hash = fnv_hash(syncookie_secret, sizeof(syncookie_secret));
+    hash = tcp_hash_tuple(conn->tc_src, conn->tc_dst, conn->tc_domain, hash);
+    hash = fnv_hash_cont(&peer_isn, sizeof(peer_isn), hash);
+    hash = fnv_hash_cont(&bits, sizeof(bits), hash);
+    return hash & SYNCOOKIE_HASH_MASK;
+}
+
+static u32 syncookie_make(const struct tcp_connreq *conn, u32 peer_isn)
+{
+    const struct tcp_synack_options *opts = &conn->tc_opts;
+    u32 mss = opts->has_mss ? opts->mss : (conn->tc_domain == AF_INET ? 536 : 1220);
+    u32 mss_idx = sizeof(syncookie_mss) / sizeof(syncookie_mss[0]) - 1;
+    u32 wscale = SYNCOOKIE_NO_WSCALE;
+    u32 bits;
+
+    /* Round the MSS down, we can only ever promise the peer less */
+    while (mss_idx > 0 && syncookie_mss[mss_idx] > mss)
+        mss_idx--;
+    if (opts->has_window_scale)
+        wscale = min<u32>(opts->snd_wnd_shift, 14);
+
+    bits = (syncookie_tick() << SYNCOOKIE_T_SHIFT) | (mss_idx << SYNCOOKIE_MSS_SHIFT) |
+           (opts->sacking << SYNCOOKIE_SACK_SHIFT) | (wscale << SYNCOOKIE_WSCALE_SHIFT);
+    return bits | syncookie_hash(conn, peer_isn, bits);
+}
+
+/**
+ * @brief Check a cookie and, if good, decode the options it carries
+ *
+ * @param conn Connreq being rebuilt (addresses filled in)
+ * @param cookie Our ISN, as ACK'd by the peer
+ * @param peer_isn Peer's ISN
+ * @return True if the cookie is ours and recent enough
+ */
+static bool syncookie_check(struct tcp_connreq *conn, u32 cookie, u32 peer_isn)
+{
+    u32 bits = cookie & ~SYNCOOKIE_HASH_MASK;
+    u32 age = (syncookie_tick() - (cookie >> SYNCOOKIE_T_SHIFT)) & 31;
+    u32 wscale = (cookie >> SYNCOOKIE_WSCALE_SHIFT) & 15;
+
+    if (age > 1)
+        return false;
+    if (syncookie_hash(conn, peer_isn, bits) != (cookie & SYNCOOKIE_HASH_MASK))
+        return false;
+
+    conn->tc_opts.has_mss = 1;
+    conn->tc_opts.mss = syncookie_mss[(cookie >> SYNCOOKIE_MSS_SHIFT) & 3];
+    conn->tc_opts.sacking = (cookie >> SYNCOOKIE_SACK_SHIFT) & 1;
+    if (wscale != SYNCOOKIE_NO_WSCALE)
+    {
+        conn->tc_opts.has_window_scale = 1;
+        conn->tc_opts.snd_wnd_shift = wscale;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Answer a SYN with a cookie, without keeping any state
+ *
+ * @param sock Listening socket
+ * @param pbf The SYN
+ * @return 0 on success, negative error codes or drop reason
+ */
+static int tcp_send_syncookie(struct tcp_socket *sock, struct packetbuf *pbf)
+{
+    struct tcp_header *hdr = (struct tcp_header *) pbf->transport_header;
+    struct tcp_connreq conn;
+    int err;
+
+    tcp_connreq_init(sock, &conn, pbf);
+    err = tcp_parse_synack_options(&conn.tc_opts, pbf, hdr);
+    if (err)
+        return err;
+
+    /* The cookie has no room for timestamps, so don't negotiate them */
+    conn.tc_opts.has_timestamp = 0;
+    /* Any data on the SYN gets dropped, the peer will send it again */
+    conn.tc_iss = syncookie_make(&conn, hdr->sequence_number);
+    sock->last_syncookie = clocksource_get_time();
+    return tcp_send_synack(&conn);
+}
+
+/**
+ * @brief Complete a connection from the ACK to a cookie'd SYN-ACK
+ *
+ * @param sock Listening socket (locked)
+ * @param pbf The ACK
+ * @return 0 on success, TCP_DROP_BAD_COOKIE if this isn't a valid cookie, or some other error
+ */
+static int tcp_syncookie_accept(struct tcp_socket *sock, struct packetbuf *pbf)
+{
+    struct tcp_header *hdr = (struct tcp_header *) pbf->transport_header;
+    struct tcp_socket *child;
+    struct tcp_connreq conn;
+    int err;
+
+    if (!sock->last_syncookie ||
+        clocksource_get_time() - sock->last_syncookie > SYNCOOKIE_CHECK_WINDOW)
+        return TCP_DROP_BAD_COOKIE;
+    if (hdr->syn)
+        return TCP_DROP_BAD_COOKIE;
+
+    tcp_connreq_init(sock, &conn, pbf);
+    /* The ACK's sequence number is the peer's ISN + 1 */
+    conn.tc_rcv_nxt = hdr->sequence_number;
+    conn.tc_iss = hdr->ack_number - 1;
+    if (!syncookie_check(&conn, conn.tc_iss, hdr->sequence_number - 1))
+        return TCP_DROP_BAD_COOKIE;
+
+    if (sock->acceptq_len >= sock->backlog)
+        return TCP_DROP_LISTEN_OVERFLOW;
+
+    err = tcp_connreq_route(&conn);
+    if (err)
+        return err;
+
+    child = tcp_connreq_to_sock(&conn, hdr);
+    if (!child)
+        return -ENOMEM;
+
+    list_add_tail(&child->conn_queue, &sock->accept_queue);
+    sock->acceptq_len++;
+    wait_queue_wake_all(&sock->rx_wq);
+
+    /* Let the child take it from here (the ACK moves it to ESTABLISHED, and there may be data).
+     * tcp_input byteswapped these in place, undo it. */
+    hdr->ack_number = htonl(hdr->ack_number);
+    hdr->sequence_number = htonl(hdr->sequence_number);
+    tcp_in_pbf(child, pbf);
+    return 0;
+}
+#endif
+
 static int tcp_input_listen(struct tcp_socket *sock, struct packetbuf *pbf)
 {
     int err;
@@ -728,7 +1314,13 @@ static int tcp_input_listen(struct tcp_socket *sock, struct packetbuf *pbf)
      */
     if (hdr->ack)
     {
-        __tcp_send_rst(pbf, hdr->ack_number, 0, 0);
+#ifdef CONFIG_TCP_SYNCOOKIES
+        /* ...unless it's acking a SYN-ACK we sent with a cookie */
+        err = tcp_syncookie_accept(sock, pbf);
+        if (err != TCP_DROP_BAD_COOKIE)
+            return err;
+#endif
+        __tcp_send_rst(pbf, htonl(hdr->ack_number), 0, 0);
         return 0;
     }
 
@@ -736,6 +1328,20 @@ static int tcp_input_listen(struct tcp_socket *sock, struct packetbuf *pbf)
     if (!hdr->syn)
         return TCP_DROP_BAD_PACKET;
 
+    /* No point in taking more connections while nobody is accepting the ones we have */
+    if (sock->acceptq_len >= sock->backlog)
+        return TCP_DROP_LISTEN_OVERFLOW;
+
+    tcp_prune_connreqs(sock);
+    if (sock->connqueue_len >= sock->backlog)
+    {
+#ifdef CONFIG_TCP_SYNCOOKIES
+        return tcp_send_syncookie(sock, pbf);
+#else
+        return TCP_DROP_LISTEN_OVERFLOW;
+#endif
+    }
+
     /* This is a SYN. Parse it out and create a tcp_connreq for this */
     connreq = (struct tcp_connreq *) kmalloc(sizeof(*connreq), GFP_ATOMIC);
     if (!connreq)
@@ -746,10 +1352,12 @@ static int tcp_input_listen(struct tcp_socket *sock, struct packetbuf *pbf)
     if (err)
     {
         kfree(connreq);
-        return -ENOMEM;
+        return err;
     }
 
+    connreq->tc_expires = clocksource_get_time() + TCP_CONNREQ_TIMEOUT;
     list_add_tail(&connreq->tc_list_node, &sock->conn_queue);
+    sock->connqueue_len++;
 
     if (pbf_length(pbf) > 0)
     {
@@ -763,7 +1371,7 @@ static int tcp_input_listen(struct tcp_socket *sock, struct packetbuf *pbf)
     err = tcp_send_synack(connreq);
     if (err)
     {
-        kfree(connreq);
+        tcp_connreq_kill(sock, connreq);
         return err;
     }
 
@@ -775,78 +1383,53 @@ static int tcp_input_conn(struct tcp_connreq *conn, struct packetbuf *pbf)
     struct tcp_socket *sock, *parent;
     struct tcp_header *hdr = (struct tcp_header *) pbf->transport_header;
     CHECK(spin_lock_held(&conn->tc_lock));
-    /* Make this connreq into a real socket */
-
-    sock = (struct tcp_socket *) tcp_create_socket(SOCK_STREAM);
-    if (!sock)
-        return -ENOMEM;
-
     parent = conn->tc_sock;
-    sock->rcv_mss = conn->tc_domain == AF_INET ? 536 : 1220;
-    sock->send_mss = conn->tc_our_mss;
-    sock->rcv_next = sock->rcv_wup = conn->tc_rcv_nxt;
-    sock->snd_una = conn->tc_iss;
-    sock->snd_next = sock->snd_una + 1;
-    sock->sk_rcvbuf = parent->sk_rcvbuf;
-    sock->sk_sndbuf = parent->sk_sndbuf;
-    sock->rcvbuf_locked = parent->rcvbuf_locked;
-    sock->sndbuf_locked = parent->sndbuf_locked;
 
-    if (conn->tc_opts.has_mss)
-        sock->rcv_mss = conn->tc_opts.mss;
-    if (conn->tc_opts.has_window_scale)
+    if (hdr->rst)
     {
-        sock->snd_wnd = (u32) ntohs(hdr->window_size) << conn->tc_opts.snd_wnd_shift;
-        sock->snd_wnd_shift = conn->tc_opts.snd_wnd_shift;
-        sock->rcv_wnd = tcp_select_initial_win(sock);
-        sock->rcv_wnd_shift = tcp_calculate_win_scale(sock->rcv_wnd);
+        spin_unlock(&conn->tc_lock);
+        return TCP_DROP_RST_ON_LISTEN;
     }
-    else
+
+    if (hdr->syn)
     {
-        /* Remote host does not support window scaling, use the traditional defaults. */
-        sock->snd_wnd = ntohs(hdr->window_size);
-        sock->snd_wnd_shift = 0;
-        sock->rcv_wnd_shift = 0;
+        /* Retransmitted SYN, our SYN-ACK probably got lost */
+        tcp_send_synack(conn);
+        spin_unlock(&conn->tc_lock);
+        return TCP_DROP_BAD_SYN;
     }
 
-    if (conn->tc_opts.sacking)
-        sock->sacking = 1;
-
-    bool on_ipv4_mode = conn->tc_domain == AF_INET && conn->tc_sock->domain == AF_INET6;
-
-    sock->dest_addr = conn->tc_dst;
-    sock->src_addr = conn->tc_src;
-    sock->ipv4_on_inet6 = on_ipv4_mode;
-    sock->route_cache = cul::move(conn->tc_route);
-    sock->route_cache_valid = 1;
-    sock->proto_domain =
-        conn->tc_sock->domain == AF_INET ? ip::v4::get_v4_proto() : ip::v6::get_v6_proto();
-    sock->domain = conn->tc_sock->domain;
-    sock->proto = conn->tc_sock->proto;
-    sock->type = conn->tc_sock->type;
+    if (!hdr->ack)
+    {
+        spin_unlock(&conn->tc_lock);
+        return TCP_DROP_NOACK;
+    }
 
-    /* Note: We bind while holding tc_lock, so no segments may get lost. Others may observe the
-     * !dead connreq in the lists, or a bound socket, but never neither. */
-    if (WARN_ON(!inet_proto_family::add_socket(sock)))
+    if (ntohl(hdr->ack_number) != conn->tc_iss + 1)
     {
-        /* This should not be possible... */
-        kfree(sock);
-        return -EINVAL;
+        spin_unlock(&conn->tc_lock);
+        __tcp_send_rst(pbf, hdr->ack_number, 0, 0);
+        return TCP_DROP_SYN_BAD_ACK;
     }
 
-    sock->mss = min(sock->send_mss, sock->rcv_mss);
+    /* Accept queue is full. Drop the ACK and leave the connreq be, the peer will retransmit. */
+    if (READ_ONCE(parent->acceptq_len) >= READ_ONCE(parent->backlog))
+    {
+        spin_unlock(&conn->tc_lock);
+        return TCP_DROP_LISTEN_OVERFLOW;
+    }
 
-    /* We'll put our state as SYN_RECEIVED. The generic receive code will take care of moving our
-     * state forwards. */
-    /* TODO: https://datatracker.ietf.org/doc/html/rfc9293#section-3.10.7.4-2.5.2.2.2.2.2.2.1 */
-    tcp_set_state(sock, TCP_STATE_SYN_RECEIVED);
-    sock->connected = true;
-    sock->bound = true;
+    /* Make this connreq into a real socket */
+    sock = tcp_connreq_to_sock(conn, hdr);
+    if (!sock)
+    {
+        spin_unlock(&conn->tc_lock);
+        return -ENOMEM;
+    }
 
     /* Now that we're releasing the lock, we need to tell new segments to go for the proper bound
      * socket instead. */
     conn->tc_dead = 1;
-    parent = conn->tc_sock;
     rcu_read_lock();
 
     spin_unlock(&conn->tc_lock);
@@ -872,9 +1455,12 @@ static int tcp_input_conn(struct tcp_connreq *conn, struct packetbuf *pbf)
      **/
     if (!parent->ref_not_zero())
     {
-        spin_unlock(&conn->tc_lock);
+        /* The listener is gone, and it already took us off its SYN queue (see
+         * tcp_connreq_kill). */
         tcp_set_state(sock, TCP_STATE_CLOSED);
         sock->unref();
+        tcp_connreq_free(conn);
+        rcu_read_unlock();
         return 0;
     }
 
@@ -887,15 +1473,18 @@ static int tcp_input_conn(struct tcp_connreq *conn, struct packetbuf *pbf)
          */
         tcp_set_state(sock, TCP_STATE_CLOSED);
         sock->unref();
+        tcp_connreq_free(conn);
     }
     else
     {
         conn->tc_sock = NULL;
         list_remove(&conn->tc_list_node);
-        kfree_rcu(conn, tc_rcu_head);
+        parent->connqueue_len--;
+        tcp_connreq_free(conn);
         /* We can double up this conn_queue as a list node, because sock->conn_queue will never be
          * in a LISTEN state */
         list_add_tail(&sock->conn_queue, &parent->accept_queue);
+        parent->acceptq_len++;
         wait_queue_wake_all(&parent->rx_wq);
     }
 
@@ -907,7 +1496,50 @@ static int tcp_input_conn(struct tcp_connreq *conn, struct packetbuf *pbf)
     return 0;
 }
 
-static int tcp_parse_options(struct tcp_socket *sock, struct packetbuf *pbf)
+static bool tcp_paws_reject(struct tcp_socket *sock, u32 ts_val)
+{
+    if (!before(ts_val, sock->ts_recent))
+        return false;
+    /* TS.Recent is too old to mean anything */
+    return clocksource_get_time() - sock->ts_recent_stamp < TCP_PAWS_IDLE;
+}
+
+/**
+ * @brief Estimate the RTT from the receiving side, for receive buffer autotuning
+ * With timestamps, a data segment's TSecr gives us a sample directly. Without them, measure how long
+ * it takes the sender to get a window's worth of data to us.
+ *
+ * @param sock TCP socket
+ * @param opts Options of the data segment that just came in
+ */
+static void tcp_rcv_rtt_measure(struct tcp_socket *sock, struct tcp_rx_options *opts)
+{
+    hrtime_t now = clocksource_get_time();
+    hrtime_t sample;
+
+    if (opts->has_ts && opts->ts_ecr)
+        sample = tcp_ts_rtt(sock, opts->ts_ecr);
+    else if (!sock->rcv_rtt_time || !before(sock->rcv_next, sock->rcv_rtt_seq))
+    {
+        sample = sock->rcv_rtt_time ? now - sock->rcv_rtt_time : 0;
+        sock->rcv_rtt_seq = sock->rcv_next + sock->rcv_wnd;
+        sock->rcv_rtt_time = now;
+        if (!sample)
+            return;
+    }
+    else
+        return;
+
+    /* Samples tend to overestimate (the sender may have been application limited), so take lower
+     * ones right away and smooth the rest. */
+    if (!sock->rcv_rtt || sample < sock->rcv_rtt)
+        sock->rcv_rtt = sample;
+    else
+        sock->rcv_rtt = (7 * sock->rcv_rtt + sample) / 8;
+}
+
+static int tcp_parse_options(struct tcp_socket *sock, struct packetbuf *pbf,
+                             struct tcp_rx_options *opts)
 {
     struct tcp_header *hdr = (struct tcp_header *) pbf->transport_header;
     u16 options_len = tcp_header_data_off_to_length(hdr->doff) - sizeof(struct tcp_header);
@@ -946,9 +1578,28 @@ static int tcp_parse_options(struct tcp_socket *sock, struct packetbuf *pbf)
         switch (*opt)
         {
             case TCP_OPTION_SACK:
-                if (!sock->sacking)
+                if (!sock->sacking || opt_len % 8)
                     return TCP_DROP_BAD_PACKET;
-                /* TODO: Actually sack */
+                for (unsigned int i = 0; i < opt_len / 8u && opts->nr_sacks < 4; i++)
+                {
+                    struct tcp_sack_range *r = &opts->sacks[opts->nr_sacks++];
+                    memcpy(&r->start, data + i * 8, sizeof(u32));
+                    memcpy(&r->end, data + i * 8 + 4, sizeof(u32));
+                    r->start = ntohl(r->start);
+                    r->end = ntohl(r->end);
+                }
+                break;
+            case TCP_OPTION_TIMESTAMP:
+                if (opt_len != TCP_OPTION_TIMESTAMP_LEN - 2)
+                    return TCP_DROP_BAD_PACKET;
+                /* Not negotiated, ignore it (RFC7323, 3.2) */
+                if (!sock->ts_ok)
+                    break;
+                memcpy(&opts->ts_val, data, sizeof(u32));
+                memcpy(&opts->ts_ecr, data + 4, sizeof(u32));
+                opts->ts_val = ntohl(opts->ts_val);
+                opts->ts_ecr = ntohl(opts->ts_ecr);
+                opts->has_ts = true;
                 break;
             default:
                 /* Drop packets with options we don't recognize */
@@ -964,6 +1615,7 @@ int tcp_input(struct tcp_socket *sock, struct packetbuf *pbf)
     unsigned int seg_len;
     u32 seq;
     int err;
+    struct tcp_rx_options opts;
     struct tcp_header *hdr = (struct tcp_header *) pbf->transport_header;
     /* Byte swap fields before being used by the rest of the network stack - this will save us a
      * bunch of byteswaps and annoying code. */
@@ -1011,18 +1663,34 @@ int tcp_input(struct tcp_socket *sock, struct packetbuf *pbf)
             /* fallthrough */
     }
 
+    opts.nr_sacks = 0;
+    opts.has_ts = false;
     if (hdr->doff > 5)
     {
-        err = tcp_parse_options(sock, pbf);
+        err = tcp_parse_options(sock, pbf, &opts);
         if (err)
             goto not_acceptable;
     }
 
+    /* PAWS: an old timestamp means an old duplicate, from a wrapped around sequence space */
+    if (opts.has_ts && !hdr->rst && tcp_paws_reject(sock, opts.ts_val))
+    {
+        err = TCP_DROP_PAWS;
+        goto not_acceptable;
+    }
+
     /* There are four cases for the acceptability test for an incoming segment: - RFC9293 */
     err = tcp_sequence(sock, pbf->tpi.seq, pbf->tpi.seq + pbf->tpi.seq_len);
     if (err)
         goto not_acceptable;
 
+    /* If SEG.TSval >= TS.Recent and SEG.SEQ =< Last.ACK.sent, TS.Recent <- SEG.TSval (RFC7323) */
+    if (opts.has_ts && !after(seq, sock->rcv_wup) && !before(opts.ts_val, sock->ts_recent))
+    {
+        sock->ts_recent = opts.ts_val;
+        sock->ts_recent_stamp = clocksource_get_time();
+    }
+
     /* Second, check the RST bit: */
     if (unlikely(hdr->rst))
     {
@@ -1060,12 +1728,15 @@ int tcp_input(struct tcp_socket *sock, struct packetbuf *pbf)
          */
     }
 
-    err = tcp_ack(sock, pbf, hdr);
+    err = tcp_ack(sock, pbf, hdr, &opts);
     if (err && err != TCP_DROP_ACK_DUP)
         return err;
 
     if (seg_len > 0)
+    {
+        tcp_rcv_rtt_measure(sock, &opts);
         err = tcp_queue_data(sock, pbf);
+    }
     if (unlikely(hdr->fin))
         err = tcp_handle_fin(sock, pbf, hdr);
     return err;
@@ -1153,8 +1824,9 @@ int tcp_handle_packet(const inet_route &route, packetbuf *buf)
     if (route.flags & (INET4_ROUTE_FLAG_BROADCAST | INET4_ROUTE_FLAG_MULTICAST))
         return TCP_DROP_BAD_PACKET;
 
-    conn = tcp4_find_synacks(ip_header->source_ip, header->source_port, ip_header->dest_ip,
-                             header->dest_port);
+    conn = tcp_find_synacks(inet_sock_address{in_addr{ip_header->dest_ip}, header->dest_port},
+                            inet_sock_address{in_addr{ip_header->source_ip}, header->source_port},
+                            AF_INET);
     if (unlikely(conn))
     {
         err = tcp_input_conn(conn, buf);
@@ -1183,6 +1855,8 @@ int tcp_handle_packet(const inet_route &route, packetbuf *buf)
 
 int tcp6_handle_packet(const inet_route &route, packetbuf *buf)
 {
+    struct tcp_connreq *conn;
+    int err;
     auto ip_header = (struct ip6hdr *) buf->net_header;
     auto header = (struct tcp_header *) pbf_pull(buf, sizeof(struct tcp_header));
 
@@ -1196,6 +1870,16 @@ int tcp6_handle_packet(const inet_route &route, packetbuf *buf)
     if (route.flags & (INET4_ROUTE_FLAG_BROADCAST | INET4_ROUTE_FLAG_MULTICAST))
         return TCP_DROP_BAD_PACKET;
 
+    conn = tcp_find_synacks(
+        inet_sock_address{ip_header->dst_addr, header->dest_port, route.nif->if_id},
+        inet_sock_address{ip_header->src_addr, header->source_port, route.nif->if_id}, AF_INET6);
+    if (unlikely(conn))
+    {
+        err = tcp_input_conn(conn, buf);
+        if (err)
+            return err;
+    }
+
     ref_guard<tcp_socket> socket{inet6_resolve_socket_conn<tcp_socket>(
         ip_header->src_addr, header->source_port, ip_header->dst_addr, header->dest_port,
         IPPROTO_TCP, route.nif, &tcp_proto)};
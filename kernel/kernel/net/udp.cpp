@@ -16,6 +16,7 @@
 #include <onyx/byteswap.h>
 #include <onyx/compiler.h>
 #include <onyx/dev.h>
+#include <onyx/net/fib.h>
 #include <onyx/net/icmp.h>
 #include <onyx/net/inet_proto.h>
 #include <onyx/net/ip.h>
@@ -136,6 +137,7 @@ int udp_socket::connect(sockaddr *addr, socklen_t len, int flags)
 
     ipv4_on_inet6 = on_ipv4_mode;
 
+    unsigned long gen = inet_route_generation();
     auto route_result = get_proto_fam()->route(src_addr, dest_addr, res.second);
 
     if (route_result.has_error())
@@ -143,15 +145,13 @@ int udp_socket::connect(sockaddr *addr, socklen_t len, int flags)
         return route_result.error();
     }
 
-    route_cache = route_result.value();
-
-    if (route_cache.flags & (INET4_ROUTE_FLAG_BROADCAST | INET4_ROUTE_FLAG_MULTICAST) &&
+    if (route_result.value().flags & (INET4_ROUTE_FLAG_BROADCAST | INET4_ROUTE_FLAG_MULTICAST) &&
         !broadcast_allowed)
     {
         return -EACCES;
     }
 
-    route_cache_valid = 1;
+    set_route_cache(route_result.value(), gen);
 
     connected = true;
 
@@ -170,20 +170,12 @@ void udp_prepare_headers(packetbuf *buf, in_port_t sport, in_port_t dport, size_
     udp_header->checksum = 0;
 }
 
-static int udp_put_data(struct packetbuf *buf, struct iovec_iter *iter)
+static int udp_put_data(struct packetbuf *buf, struct iovec_iter *iter, size_t len)
 {
-    unsigned char *ptr = (unsigned char *) buf->put((unsigned int) iter->bytes);
-
-    while (!iter->empty())
-    {
-        const auto vec = iter->curiovec();
-        if (copy_from_user(ptr, vec.iov_base, vec.iov_len) < 0)
-            return -EFAULT;
-
-        ptr += vec.iov_len;
-        iter->advance(vec.iov_len);
-    }
+    unsigned char *ptr = (unsigned char *) buf->put((unsigned int) len);
 
+    if (len > 0 && copy_from_iter(iter, ptr, len) != (ssize_t) len)
+        return -EFAULT;
     return 0;
 }
 
@@ -226,6 +218,119 @@ int udp_do_send(packetbuf *buf, const inet_route &route)
     return ret;
 }
 
+/**
+ * @brief Build and send a single UDP packet
+ *
+ * @param sock Socket
+ * @param route Route
+ * @param sport Source port
+ * @param dport Destination port
+ * @param iter Payload, len bytes of it get consumed
+ * @param len Length of the payload
+ * @param gso_size If non-zero, the packet carries datagrams of gso_size and gets split up on
+ * the other side
+ * @return 0 on success, negative error codes
+ */
+template <int domain>
+static int udp_send_one(udp_socket *sock, const inet_route &route, in_port_t sport,
+                        in_port_t dport, iovec_iter *iter, size_t len, u16 gso_size)
+{
+    struct packetbuf *pbf;
+
+    /* XXX: UDP is currently simplified a lot because pbf_alloc_sk allocates a single fragment,
+     * thus we can do away with only using the data area instead of carefully and painfully
+     * handling fragments.
+     */
+    pbf = pbf_alloc_sk(GFP_KERNEL, sock, len + sizeof(udphdr) + PACKET_MAX_HEAD_LENGTH);
+    if (!pbf)
+        return -ENOBUFS;
+    pbf_reserve_headers(pbf, sizeof(udphdr) + PACKET_MAX_HEAD_LENGTH);
+
+    udp_prepare_headers(pbf, sport, dport, len);
+    if (udp_put_data(pbf, iter, len) < 0)
+    {
+        pbf_free(pbf);
+        return -EFAULT;
+    }
+
+    udp_do_csum<domain>(pbf, route);
+    if (gso_size)
+    {
+        pbf->gso_size = gso_size;
+        pbf->gso_flags = PACKETBUF_GSO_UFO;
+    }
+
+    if (int st = udp_do_send<domain>(pbf, route); st < 0)
+    {
+        pbf_free(pbf);
+        return st;
+    }
+
+    pbf_put_ref(pbf);
+    return 0;
+}
+
+/**
+ * @brief Send a UDP_SEGMENT'd buffer, as datagrams of gso_size (the last one may be shorter)
+ *
+ * @return Bytes sent, or negative error codes
+ */
+template <int domain>
+static ssize_t udp_send_segmented(udp_socket *sock, const inet_route &route, in_port_t sport,
+                                  in_port_t dport, iovec_iter *iter, size_t len, u16 gso_size)
+{
+    struct netif *nif = route.nif;
+    size_t hdr_len = sizeof(udphdr) + inet_header_size(domain);
+    size_t sent = 0;
+
+    if (gso_size + hdr_len > nif->mtu || (len + gso_size - 1) / gso_size > UDP_MAX_SEGMENTS)
+        return -EINVAL;
+
+    /* Loopback carries the whole thing in one packet. The receiving socket splits it back up, or
+     * takes it as is if it does UDP_GRO. */
+    if (nif->flags & NETIF_LOOPBACK && len + hdr_len <= nif->mtu)
+    {
+        int st = udp_send_one<domain>(sock, route, sport, dport, iter, len, gso_size);
+        return st < 0 ? st : (ssize_t) len;
+    }
+
+    /* None of our drivers do UDP segmentation offload, so segment here. This still saves the
+     * syscalls and the route lookups. */
+    while (sent < len)
+    {
+        size_t seg = min(len - sent, (size_t) gso_size);
+        if (int st = udp_send_one<domain>(sock, route, sport, dport, iter, seg, 0); st < 0)
+            return sent ? (ssize_t) sent : st;
+        sent += seg;
+    }
+
+    return len;
+}
+
+/**
+ * @brief Get the segment size for a send, from a UDP_SEGMENT cmsg or the socket option
+ *
+ * @param msg msghdr
+ * @param gso_size Segment size, defaults to the socket option
+ * @return 0 on success, negative error codes
+ */
+static int udp_cmsg_gso_size(const msghdr *msg, u16 *gso_size)
+{
+    if (!msg->msg_control)
+        return 0;
+
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg))
+    {
+        if (cmsg->cmsg_level != SOL_UDP || cmsg->cmsg_type != UDP_SEGMENT)
+            continue;
+        if (cmsg->cmsg_len != CMSG_LEN(sizeof(u16)))
+            return -EINVAL;
+        memcpy(gso_size, CMSG_DATA(cmsg), sizeof(u16));
+    }
+
+    return 0;
+}
+
 template <typename AddrType>
 ssize_t udp_socket::udp_sendmsg(const msghdr *msg, int flags, const inet_sock_address &dst)
 {
@@ -239,6 +344,12 @@ ssize_t udp_socket::udp_sendmsg(const msghdr *msg, int flags, const inet_sock_ad
     if (payload_size > UINT16_MAX)
         return -EMSGSIZE;
 
+    u16 segment = gso_size;
+    if (int st = udp_cmsg_gso_size(msg, &segment); st < 0)
+        return st;
+    if ((size_t) payload_size <= segment)
+        segment = 0;
+
     iovec_iter iter{{msg->msg_iov, (size_t) msg->msg_iovlen}, (size_t) payload_size, IOVEC_USER};
     inet_route route;
 
@@ -282,7 +393,9 @@ ssize_t udp_socket::udp_sendmsg(const msghdr *msg, int flags, const inet_sock_ad
 
     if (connected && route_cache_valid)
     {
-        route = route_cache;
+        /* Routing table changed since we connected? */
+        if (int st = revalidate_route_cache(route); st < 0)
+            return st;
     }
     else
     {
@@ -302,36 +415,21 @@ ssize_t udp_socket::udp_sendmsg(const msghdr *msg, int flags, const inet_sock_ad
      */
     if (!will_append) [[likely]]
     {
-        struct packetbuf *pbf;
+        if (segment)
+            return udp_send_segmented<our_domain>(this, route, src_addr.port, dst.port, &iter,
+                                                  payload_size, segment);
 
-        /* XXX: UDP is currently simplified a lot because pbf_alloc_sk allocates a single fragment,
-         * thus we can do away with only using the data area instead of carefully and painfully
-         * handling fragments.
-         */
-        pbf =
-            pbf_alloc_sk(GFP_KERNEL, this, payload_size + sizeof(udphdr) + PACKET_MAX_HEAD_LENGTH);
-        if (!pbf)
-            return -ENOBUFS;
-        pbf_reserve_headers(pbf, sizeof(udphdr) + PACKET_MAX_HEAD_LENGTH);
-
-        udp_prepare_headers(pbf, src_addr.port, dst.port, payload_size);
-        if (udp_put_data(pbf, &iter) < 0)
-        {
-            pbf_free(pbf);
-            return -EFAULT;
-        }
-
-        udp_do_csum<our_domain>(pbf, route);
-        if (int st = udp_do_send<our_domain>(pbf, route); st < 0)
-        {
-            pbf_free(pbf);
+        if (int st = udp_send_one<our_domain>(this, route, src_addr.port, dst.port, &iter,
+                                              payload_size, 0);
+            st < 0)
             return st;
-        }
-
-        pbf_put_ref(pbf);
         return payload_size;
     }
 
+    /* Corked sends can't be segmented */
+    if (segment)
+        return -EINVAL;
+
     scoped_hybrid_lock g{socket_lock, this};
 
     cork_pending = our_domain;
@@ -462,6 +560,37 @@ void udp_socket::rx_dgram(packetbuf *buf)
     append_inet_rx_pbuf(buf);
 }
 
+/**
+ * @brief Deliver a unicast datagram to the socket
+ * UDP_SEGMENT packets that came in whole (over loopback) get split back into their datagrams,
+ * unless the socket does UDP_GRO and wants them as they are.
+ *
+ * @param buf Packetbuf, with data pointing at the payload
+ */
+void udp_socket::deliver(packetbuf *buf)
+{
+    if (!buf->gso_size || gro_enabled)
+    {
+        rx_dgram(buf);
+        return;
+    }
+
+    for (unsigned char *seg = buf->data; seg < buf->tail; seg += buf->gso_size)
+    {
+        packetbuf *clone = packetbuf_clone(buf);
+        if (!clone)
+            return;
+
+        clone->data = seg;
+        clone->tail = cul::min(seg + buf->gso_size, buf->tail);
+        clone->gso_size = 0;
+        clone->gso_flags = 0;
+        clone->total_len = sizeof(struct packetbuf) + clone->length();
+        rx_dgram(clone);
+        clone->unref();
+    }
+}
+
 /**
  * @brief Handle UDP socket backlog
  *
@@ -510,7 +639,7 @@ int udp_handle_packet(const inet_route &route, packetbuf *buf)
     buf->transport_header = (unsigned char *) udp_header;
     buf->data += sizeof(struct udphdr);
 
-    socket->rx_dgram(buf);
+    socket->deliver(buf);
 
     socket->unref();
     return 0;
@@ -542,7 +671,7 @@ int udp_handle_packet_v6(netif *netif, packetbuf *buf)
     buf->transport_header = (unsigned char *) udp_header;
     buf->data += sizeof(struct udphdr);
 
-    socket->rx_dgram(buf);
+    socket->deliver(buf);
 
     socket->unref();
     return 0;
@@ -581,6 +710,9 @@ ssize_t udp_socket::recvmsg(msghdr *msg, int flags)
         return st.error();
 
     auto buf = st.value();
+    if (gro_enabled && !buf->gso_size && !(flags & MSG_PEEK))
+        return recvmsg_gro(msg, flags, iovlen, buf);
+
     ssize_t read = min(iovlen, (long) buf->length());
     ssize_t was_read = 0;
     ssize_t to_ret = read;
@@ -615,7 +747,11 @@ ssize_t udp_socket::recvmsg(msghdr *msg, int flags)
         ptr += to_copy;
     }
 
-    msg->msg_controllen = 0;
+    if (gro_enabled && buf->gso_size)
+    {
+        int segment = buf->gso_size;
+        put_cmsg(msg, SOL_UDP, UDP_GRO, &segment, sizeof(segment));
+    }
 
     if (!(flags & MSG_PEEK))
     {
@@ -631,6 +767,87 @@ ssize_t udp_socket::recvmsg(msghdr *msg, int flags)
     return to_ret;
 }
 
+/**
+ * @brief Check if two datagrams came from the same sender
+ */
+static bool udp_same_sender(packetbuf *a, packetbuf *b)
+{
+    auto ha = (udphdr *) a->transport_header;
+    auto hb = (udphdr *) b->transport_header;
+
+    if (ha->source_port != hb->source_port || (a->net_header[0] >> 4) != (b->net_header[0] >> 4))
+        return false;
+
+    if ((a->net_header[0] >> 4) == 4)
+        return ((ip_header *) a->net_header)->source_ip == ((ip_header *) b->net_header)->source_ip;
+    return !memcmp(&((ip6hdr *) a->net_header)->src_addr, &((ip6hdr *) b->net_header)->src_addr,
+                   sizeof(in6_addr));
+}
+
+/**
+ * @brief Receive a run of datagrams from the same sender as one buffer (UDP_GRO)
+ * Every datagram but the last one must be as large as the first, which then gets reported as
+ * the segment size. Called with the socket lock held.
+ *
+ * @param msg msghdr
+ * @param flags Flags
+ * @param iovlen Length of the iovecs
+ * @param buf First datagram
+ * @return Bytes read, or negative error codes
+ */
+ssize_t udp_socket::recvmsg_gro(msghdr *msg, int flags, ssize_t iovlen, packetbuf *buf)
+{
+    iovec_iter iter{{msg->msg_iov, (size_t) msg->msg_iovlen}, (size_t) iovlen, IOVEC_USER};
+    const size_t segment = buf->length();
+    size_t read = 0;
+    int segs = 0;
+
+    if (msg->msg_name)
+    {
+        auto hdr = (udphdr *) buf->transport_header;
+        ip::copy_msgname_to_user(msg, buf, domain == AF_INET6, hdr->source_port);
+    }
+
+    if ((size_t) iovlen < segment)
+        msg->msg_flags = MSG_TRUNC;
+
+    for (;;)
+    {
+        size_t len = buf->length();
+        size_t to_copy = min(len, (size_t) iovlen - read);
+        if (copy_to_iter(&iter, buf->data, to_copy) != (ssize_t) to_copy)
+            return read ? (ssize_t) read : -EFAULT;
+
+        read += to_copy;
+        segs++;
+
+        packetbuf *next = nullptr;
+        if (buf->list_node.next != &rx_packet_list)
+            next = container_of(buf->list_node.next, packetbuf, list_node);
+
+        list_remove(&buf->list_node);
+
+        /* Keep going while there's a full-sized datagram before this one (only the last one may
+         * be short), from the same sender, that fits whole */
+        bool more = next && len == segment && segs < UDP_MAX_SEGMENTS && !next->gso_size &&
+                    next->length() <= segment && read + next->length() <= (size_t) iovlen &&
+                    udp_same_sender(buf, next);
+        buf->unref();
+
+        if (!more)
+            break;
+        buf = next;
+    }
+
+    if (segs > 1)
+    {
+        int seg = segment;
+        put_cmsg(msg, SOL_UDP, UDP_GRO, &seg, sizeof(seg));
+    }
+
+    return flags & MSG_TRUNC && segs == 1 ? (ssize_t) segment : (ssize_t) read;
+}
+
 int udp_socket::getsockopt(int level, int optname, void *val, socklen_t *len)
 {
     if (is_inet_level(level))
@@ -645,6 +862,14 @@ int udp_socket::getsockopt(int level, int optname, void *val, socklen_t *len)
             case UDP_CORK: {
                 return put_option(truthy_to_int(wants_cork), val, len);
             }
+
+            case UDP_SEGMENT: {
+                return put_option((int) gso_size, val, len);
+            }
+
+            case UDP_GRO: {
+                return put_option(truthy_to_int(gro_enabled), val, len);
+            }
         }
     }
 
@@ -670,6 +895,26 @@ int udp_socket::setsockopt(int level, int optname, const void *val, socklen_t le
                 wants_cork = int_to_truthy(res.value());
                 return 0;
             }
+
+            case UDP_SEGMENT: {
+                auto res = get_socket_option<int>(val, len);
+                if (res.has_error())
+                    return res.error();
+
+                if (res.value() < 0 || res.value() > UINT16_MAX)
+                    return -EINVAL;
+                gso_size = res.value();
+                return 0;
+            }
+
+            case UDP_GRO: {
+                auto res = get_socket_option<int>(val, len);
+                if (res.has_error())
+                    return res.error();
+
+                gro_enabled = int_to_truthy(res.value());
+                return 0;
+            }
         }
     }
 
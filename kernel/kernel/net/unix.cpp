@@ -1206,32 +1206,6 @@ ssize_t un_socket::sendmsg(const struct msghdr *msg, int flags)
     return sendmsg_dgram(msg, flags);
 }
 
-static int put_cmsg(struct msghdr *msg, int level, int type, void *data, int len)
-{
-    socklen_t total_len = CMSG_LEN(len);
-    if (msg->msg_controllen < total_len)
-    {
-        /* Truncated... */
-        msg->msg_flags |= MSG_CTRUNC;
-        /* Bail early if we can't even fit a cmsghdr */
-        if (msg->msg_controllen < sizeof(cmsghdr))
-            return 0;
-        total_len = msg->msg_controllen;
-    }
-
-    struct cmsghdr *cmsg = (struct cmsghdr *) msg->msg_control;
-    cmsg->cmsg_level = level;
-    cmsg->cmsg_type = type;
-    cmsg->cmsg_len = total_len;
-    memcpy(CMSG_DATA(cmsg), data, len);
-
-    /* Increment up to CMSG_SPACE() if possible */
-    total_len = min((socklen_t) CMSG_SPACE(len), msg->msg_controllen);
-    msg->msg_controllen -= total_len;
-    msg->msg_control = (char *) msg->msg_control + total_len;
-    return 0;
-}
-
 static int unix_put_cmsg(struct unix_pbf_info *pbf, struct msghdr *msg)
 {
     socklen_t len = msg->msg_controllen;
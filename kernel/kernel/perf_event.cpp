@@ -0,0 +1,298 @@
+/*
+ * Copyright (c) 2025 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the GPLv2 License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+#include <errno.h>
+#include <string.h>
+
+#include <onyx/anon_inode.h>
+#include <onyx/cpu.h>
+#include <onyx/cred.h>
+#include <onyx/file.h>
+#include <onyx/iovec_iter.h>
+#include <onyx/new.h>
+#include <onyx/perf_event.h>
+#include <onyx/perf_probe.h>
+#include <onyx/preempt.h>
+#include <onyx/registers.h>
+#include <onyx/scoped_lock.h>
+#include <onyx/smp.h>
+#include <onyx/user.h>
+#include <onyx/vfs.h>
+#include <onyx/vm.h>
+
+/*
+ * perf events: hardware counters behind file descriptors, a la perf_event_open. Events count on a
+ * single CPU (system-wide, there's no per-task counting). A counting event reads as its count,
+ * while a sampling event takes a sample (the ip and the kernel call chain) every sample_period
+ * events, from the PMU's overflow interrupt, and reads as the samples it took.
+ */
+
+static struct pmu *sys_pmu;
+
+/* Samples each sampling event can hold before dropping new ones, a power of 2 */
+#define PERF_EVENT_NR_SAMPLES 8192
+
+#define PERF_ATTR_VALID_FLAGS \
+    (PERF_ATTR_DISABLED | PERF_ATTR_EXCLUDE_USER | PERF_ATTR_EXCLUDE_KERNEL)
+
+/**
+ * @brief Register the system's PMU
+ *
+ * @param pmu PMU
+ */
+void perf_register_pmu(struct pmu *pmu)
+{
+    sys_pmu = pmu;
+}
+
+/**
+ * @brief Run c on the event's CPU, with irqs disabled
+ */
+template <typename Callable>
+static void perf_event_on_cpu(struct perf_event *ev, Callable c)
+{
+    // Don't let us migrate between deciding if we're ev->cpu and running c
+    sched_disable_preempt();
+    smp::sync_call(
+        [](void *ctx) {
+            auto flags = irq_save_and_disable();
+            (*(Callable *) ctx)();
+            irq_restore(flags);
+        },
+        &c, cpumask::one(ev->cpu));
+    sched_enable_preempt();
+}
+
+/**
+ * @brief Account for a period's worth of events and take a sample, if it's a sampling event.
+ * Called by PMU drivers from the overflow interrupt (possibly an NMI).
+ *
+ * @param ev Event that overflowed
+ * @param regs Registers at the time of the overflow
+ */
+void perf_event_overflow(struct perf_event *ev, struct registers *regs)
+{
+    ev->count += ev->period;
+
+    if (!ev->samples)
+        return;
+
+    // We're the only producer. If the reader hasn't caught up, drop the sample.
+    const unsigned long head = ev->head;
+    if (head - __atomic_load_n(&ev->tail, __ATOMIC_ACQUIRE) == ev->nr_samples)
+    {
+        __atomic_store_n(&ev->lost, ev->lost + 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    struct perf_sample *s = &ev->samples[head & (ev->nr_samples - 1)];
+    s->period = ev->period;
+    s->cpu = ev->cpu;
+    s->nr_ips = 0;
+#ifdef __x86_64__
+    s->ips[s->nr_ips++] = regs->rip;
+    if (in_kernel_space_regs(regs))
+        s->nr_ips += stack_trace_get((unsigned long *) regs->rbp, s->ips + 1,
+                                     PERF_SAMPLE_MAX_STACK - 1);
+#endif
+
+    __atomic_store_n(&ev->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static u64 perf_event_count(struct perf_event *ev)
+{
+    u64 val;
+
+    perf_event_on_cpu(ev, [ev, &val]() {
+        u64 count;
+        // The overflow NMI can come in between the two reads, and move count forward while
+        // restarting the period.
+        do
+        {
+            count = READ_ONCE(ev->count);
+            val = count + sys_pmu->read(ev);
+        } while (count != READ_ONCE(ev->count));
+    });
+
+    return val;
+}
+
+static ssize_t perf_event_read_iter(struct file *filp, size_t off, iovec_iter *iter,
+                                    unsigned int flags)
+{
+    struct perf_event *ev = (struct perf_event *) filp->private_data;
+    ssize_t read = 0;
+
+    scoped_mutex g{ev->lock};
+
+    if (!ev->samples)
+    {
+        if (iter->bytes < sizeof(u64))
+            return -EINVAL;
+
+        u64 val = perf_event_count(ev);
+        if (copy_to_iter(iter, &val, sizeof(val)) != sizeof(val))
+            return -EFAULT;
+        return sizeof(val);
+    }
+
+    if (iter->bytes < sizeof(struct perf_sample))
+        return -EINVAL;
+
+    while (iter->bytes >= sizeof(struct perf_sample))
+    {
+        const unsigned long tail = ev->tail;
+        if (tail == __atomic_load_n(&ev->head, __ATOMIC_ACQUIRE))
+            break;
+
+        // The sample stays put until we move tail past it
+        struct perf_sample *s = &ev->samples[tail & (ev->nr_samples - 1)];
+        if (copy_to_iter(iter, s, sizeof(*s)) != sizeof(*s))
+            return read ?: -EFAULT;
+
+        __atomic_store_n(&ev->tail, tail + 1, __ATOMIC_RELEASE);
+        read += sizeof(*s);
+    }
+
+    return read;
+}
+
+static unsigned int perf_event_ioctl(int request, void *argp, struct file *filp)
+{
+    struct perf_event *ev = (struct perf_event *) filp->private_data;
+    u64 val;
+
+    scoped_mutex g{ev->lock};
+
+    switch (request)
+    {
+        case PERF_EVENT_IOC_ENABLE:
+            if (!ev->enabled)
+                perf_event_on_cpu(ev, [ev]() { sys_pmu->start(ev); });
+            ev->enabled = true;
+            return 0;
+        case PERF_EVENT_IOC_DISABLE:
+            if (ev->enabled)
+                perf_event_on_cpu(ev, [ev]() { sys_pmu->stop(ev); });
+            ev->enabled = false;
+            return 0;
+        case PERF_EVENT_IOC_RESET:
+            // Restart the period first, so it can't overflow between the two
+            perf_event_on_cpu(ev, [ev]() {
+                sys_pmu->reset(ev);
+                ev->count = 0;
+            });
+            return 0;
+        case PERF_EVENT_IOC_COUNT:
+            val = perf_event_count(ev);
+            return copy_to_user(argp, &val, sizeof(val));
+        case PERF_EVENT_IOC_LOST:
+            val = __atomic_load_n(&ev->lost, __ATOMIC_RELAXED);
+            return copy_to_user(argp, &val, sizeof(val));
+    }
+
+    return -ENOTTY;
+}
+
+static void perf_event_free(struct perf_event *ev)
+{
+    if (ev->hwc >= 0)
+        perf_event_on_cpu(ev, [ev]() { sys_pmu->del(ev); });
+    if (ev->samples)
+        vfree(ev->samples);
+    delete ev;
+}
+
+static void perf_event_release(struct file *filp)
+{
+    perf_event_free((struct perf_event *) filp->private_data);
+}
+
+static const struct file_ops perf_event_ops = {
+    .ioctl = perf_event_ioctl,
+    .release = perf_event_release,
+    .read_iter = perf_event_read_iter,
+};
+
+int sys_perf_event_open(struct perf_event_attr *uattr, pid_t pid, int cpu, int group_fd,
+                        unsigned long flags)
+{
+    struct perf_event_attr attr;
+    struct perf_event *ev;
+    struct file *filp;
+    int st = 0;
+    int fd;
+
+    if (!sys_pmu)
+        return -ENODEV;
+    if (!is_root_user())
+        return -EACCES;
+    if (copy_from_user(&attr, uattr, sizeof(attr)) < 0)
+        return -EFAULT;
+    if (attr.size != sizeof(attr) || flags & ~PERF_FLAG_FD_CLOEXEC)
+        return -EINVAL;
+    // Only per-CPU events, and no groups
+    if (pid != -1 || group_fd != -1 || cpu < 0 || (unsigned int) cpu >= get_nr_cpus())
+        return -EINVAL;
+    if (attr.type != PERF_TYPE_HARDWARE || attr.config >= PERF_COUNT_HW_MAX ||
+        !sys_pmu->has_event(attr.config))
+        return -ENOENT;
+    if (attr.flags & ~PERF_ATTR_VALID_FLAGS || attr.sample_period > sys_pmu->max_period)
+        return -EINVAL;
+
+    ev = new perf_event{};
+    if (!ev)
+        return -ENOMEM;
+
+    ev->attr = attr;
+    ev->cpu = cpu;
+    ev->hwc = -1;
+    // Counting events just count in the largest periods we can do
+    ev->period = attr.sample_period ?: sys_pmu->max_period;
+
+    if (attr.sample_period)
+    {
+        ev->nr_samples = PERF_EVENT_NR_SAMPLES;
+        ev->samples = (struct perf_sample *) vmalloc(
+            vm_size_to_pages(sizeof(struct perf_sample) * PERF_EVENT_NR_SAMPLES), VM_TYPE_REGULAR,
+            VM_READ | VM_WRITE, GFP_KERNEL);
+        if (!ev->samples)
+        {
+            delete ev;
+            return -ENOMEM;
+        }
+    }
+
+    perf_event_on_cpu(ev, [ev, &st]() {
+        st = sys_pmu->add(ev);
+        if (st == 0 && !(ev->attr.flags & PERF_ATTR_DISABLED))
+        {
+            sys_pmu->start(ev);
+            ev->enabled = true;
+        }
+    });
+
+    if (st < 0)
+    {
+        perf_event_free(ev);
+        return st;
+    }
+
+    filp = anon_inode_open(S_IFREG, (struct file_ops *) &perf_event_ops, "[perf_event]");
+    if (!filp)
+    {
+        perf_event_free(ev);
+        return -ENOMEM;
+    }
+
+    filp->f_ino->i_flags = INODE_FLAG_NO_SEEK;
+    filp->private_data = ev;
+
+    fd = open_with_vnode(filp, O_RDONLY | (flags & PERF_FLAG_FD_CLOEXEC ? O_CLOEXEC : 0));
+    fd_put(filp);
+    return fd;
+}
@@ -89,6 +89,7 @@ process::process() : pgrp_node{this}, session_node{this}, thread_list_node{this}
     vdso = nullptr;
     exit_code = 0;
     personality = 0;
+    mempolicy = {};
     parent = nullptr;
     spinlock_init(&sub_queue_lock);
     sub_queue = nullptr;
@@ -204,6 +205,7 @@ process *process_create(const std::string_view &cmd_line, ioctx *ctx, process *p
     sigqueue_init(&proc->sig->shared_signals);
     list_add_tail_rcu(&proc->thread_list_node, &proc->sig->thread_list);
     init_wait_queue_head(&proc->sig->wait_child_event);
+    init_wait_queue_head(&proc->sig->signalfd_wq);
     spinlock_init(&proc->sig->pgrp_lock);
 
     itimer_init(proc);
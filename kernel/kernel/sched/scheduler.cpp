@@ -27,6 +27,7 @@
 #include <onyx/gen/trace_sched.h>
 #include <onyx/irq.h>
 #include <onyx/kcov.h>
+#include <onyx/kunit.h>
 #include <onyx/mm/kasan.h>
 #include <onyx/panic.h>
 #include <onyx/percpu.h>
@@ -243,7 +244,7 @@ static thread_t *sched_steal_job(unsigned int cpu)
             if (thread_queues[j])
             {
                 thread_t *ret = thread_queues[j];
-                if (ret->entry == sched_idle)
+                if (ret->entry == sched_idle || ret->flags & THREAD_PINNED)
                     continue;
                 /* Advance the queue by one */
                 thread_queues[j] = ret->next_prio;
@@ -975,6 +976,70 @@ void sched_try_to_resched(thread *thread)
     }
 }
 
+/* Change the running priority and requeue the thread if needed. Drops the sched lock. */
+static void __sched_set_prio(struct thread *thread, int prio, unsigned long cpu_flags)
+{
+    unsigned int cpu = thread->cpu;
+    bool queued = false;
+
+    if (prio != thread->priority)
+    {
+        queued = __sched_remove_thread_from_execution(thread, cpu) == 0;
+        thread->priority = prio;
+        if (queued)
+            ___sched_append_to_queue(prio, cpu, thread);
+    }
+
+    sched_unlock(thread, cpu_flags);
+
+    if (queued)
+        sched_try_to_resched(thread);
+}
+
+/**
+ * @brief Set the priority a thread inherits from the threads it's blocking
+ * Used by priority-inheriting futexes. The thread runs at the highest of its own priority and
+ * the inherited one, and gets requeued if it's sitting on a runqueue.
+ *
+ * @param thread Thread
+ * @param prio Inherited priority, or -1 to go back to the thread's own priority
+ */
+void sched_set_inherited_prio(struct thread *thread, int prio)
+{
+    unsigned long cpu_flags = sched_lock(thread);
+
+    if (thread->pi_normal_prio < 0)
+        thread->pi_normal_prio = thread->priority;
+
+    int new_prio = cul::max(prio, thread->pi_normal_prio);
+    if (prio < 0)
+        thread->pi_normal_prio = -1;
+    thread->pi_inherited_prio = prio;
+
+    __sched_set_prio(thread, new_prio, cpu_flags);
+}
+
+/**
+ * @brief Set a thread's own priority
+ * If the thread is boosted by a PI futex, it keeps running at the inherited priority (if higher)
+ * and goes back to this one when the boost ends.
+ *
+ * @param thread Thread
+ * @param prio New priority
+ */
+void sched_set_priority(struct thread *thread, int prio)
+{
+    unsigned long cpu_flags = sched_lock(thread);
+
+    if (thread->pi_normal_prio >= 0)
+    {
+        thread->pi_normal_prio = prio;
+        prio = cul::max(prio, thread->pi_inherited_prio);
+    }
+
+    __sched_set_prio(thread, prio, cpu_flags);
+}
+
 void thread_set_state(thread_t *thread, int state)
 {
     bool try_resched = false;
@@ -1015,7 +1080,7 @@ void __thread_wake_up(thread *thread, unsigned int cpu)
     if (thread->status == THREAD_RUNNABLE)
         return;
 
-    new_cpu = sched_allocate_processor();
+    new_cpu = thread->flags & THREAD_PINNED ? cpu : sched_allocate_processor();
     thread->status = THREAD_RUNNABLE;
     if (new_cpu != cpu)
     {
@@ -1350,3 +1415,50 @@ int sys_sched_getaffinity(pid_t pid, size_t cpusetsize, void *cpu_set)
 
     return 0;
 }
+
+#ifdef CONFIG_KUNIT
+
+TEST(sched, pi_boost_raises_priority)
+{
+    struct thread *curr = get_current_thread();
+    int old_prio = curr->priority;
+
+    sched_set_priority(curr, SCHED_PRIO_NORMAL);
+    sched_set_inherited_prio(curr, SCHED_PRIO_HIGH);
+    EXPECT_EQ(SCHED_PRIO_HIGH, curr->priority);
+
+    /* A lower inherited priority doesn't take ours away */
+    sched_set_inherited_prio(curr, SCHED_PRIO_LOW);
+    EXPECT_EQ(SCHED_PRIO_NORMAL, curr->priority);
+
+    sched_set_inherited_prio(curr, -1);
+    EXPECT_EQ(SCHED_PRIO_NORMAL, curr->priority);
+    EXPECT_EQ(-1, curr->pi_normal_prio);
+    sched_set_priority(curr, old_prio);
+}
+
+TEST(sched, priority_change_survives_pi_boost)
+{
+    struct thread *curr = get_current_thread();
+    int old_prio = curr->priority;
+
+    sched_set_priority(curr, SCHED_PRIO_NORMAL);
+    sched_set_inherited_prio(curr, SCHED_PRIO_HIGH);
+
+    /* Changing our own priority while boosted must not drop the boost... */
+    sched_set_priority(curr, SCHED_PRIO_LOW);
+    EXPECT_EQ(SCHED_PRIO_HIGH, curr->priority);
+    /* ...nor get lost when it ends */
+    sched_set_inherited_prio(curr, -1);
+    EXPECT_EQ(SCHED_PRIO_LOW, curr->priority);
+
+    /* A new priority above the inherited one takes effect right away */
+    sched_set_inherited_prio(curr, SCHED_PRIO_NORMAL);
+    sched_set_priority(curr, SCHED_PRIO_HIGH);
+    EXPECT_EQ(SCHED_PRIO_HIGH, curr->priority);
+    sched_set_inherited_prio(curr, -1);
+    EXPECT_EQ(SCHED_PRIO_HIGH, curr->priority);
+    sched_set_priority(curr, old_prio);
+}
+
+#endif
@@ -116,7 +116,7 @@ static inline int sigffs(sigset_t *set)
 {
     if (set->__bits[0] == 0)
         return -1;
-    return __builtin_ffs(set->__bits[0]);
+    return __builtin_ffsl(set->__bits[0]);
 }
 
 int signal_find(thread_t *unsed)
@@ -639,6 +639,8 @@ static int __send_signal_to_task(int signal, struct process *task, unsigned int
         signal_set_pending(task, signal, type);
     }
 
+    /* signalfd readers want to know about it, blocked or not */
+    wait_queue_wake_all(&task->sig->signalfd_wq);
     return 0;
 failure_oom:
 
@@ -1197,6 +1199,62 @@ int sys_rt_sigtimedwait(const sigset_t *set, siginfo_t *info, const struct times
     return st;
 }
 
+/**
+ * @brief Check if any of the signals in set are pending for the current thread
+ * Blocked signals count, this is meant for signalfd.
+ *
+ * @param set Set of signals
+ * @return True if one of them is pending, else false
+ */
+bool signal_pending_in_set(const sigset_t *set)
+{
+    sigset_t pending;
+
+    spin_lock(&current->sighand->signal_lock);
+    pending = task_pending_sigs();
+    spin_unlock(&current->sighand->signal_lock);
+
+    sigandset(&pending, &pending, (sigset_t *) set);
+    return !sigisemptyset(&pending);
+}
+
+/**
+ * @brief Dequeue a pending signal that's in set, for the current thread
+ * Blocked signals count, this is meant for signalfd. Thread-directed signals go first, then
+ * process-wide ones.
+ *
+ * @param set Set of signals
+ * @param info Filled with the signal's siginfo
+ * @return Signal number, or 0 if none of them are pending
+ */
+int signal_dequeue_set(const sigset_t *set, siginfo_t *info)
+{
+    struct sigqueue *queues[2] = {&current->sigqueue, &current->sig->shared_signals};
+    struct sigpending *pend = NULL;
+    sigset_t pending;
+    int sig;
+
+    spin_lock(&current->sighand->signal_lock);
+
+    for (int i = 0; i < 2 && !pend; i++)
+    {
+        sigandset(&pending, &queues[i]->pending, (sigset_t *) set);
+        sig = sigffs(&pending);
+        if (sig > 0)
+            pend = __signal_query_pending(sig, SIGNAL_QUERY_POP, queues[i]);
+    }
+
+    spin_unlock(&current->sighand->signal_lock);
+
+    if (!pend)
+        return 0;
+
+    sig = pend->signum;
+    memcpy(info, pend->info, sizeof(siginfo_t));
+    free_sigpending(pend);
+    return sig;
+}
+
 int sys_rt_sigpending(sigset_t *uset, size_t sigsetlen)
 {
     if (sigsetlen != CURRENT_SIGSETLEN)
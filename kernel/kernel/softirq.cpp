@@ -7,18 +7,52 @@
  */
 
 #include <onyx/block.h>
+#include <onyx/clock.h>
+#include <onyx/cpu.h>
+#include <onyx/init.h>
 #include <onyx/irq.h>
 #include <onyx/net/netif.h>
 #include <onyx/panic.h>
 #include <onyx/percpu.h>
+#include <onyx/proc.h>
 #include <onyx/rcupdate.h>
+#include <onyx/scheduler.h>
+#include <onyx/seq_file.h>
 #include <onyx/softirq.h>
 #include <onyx/tasklet.h>
 #include <onyx/timer.h>
 
+/* Per-pass budgets, in whatever unit of work the vector deals in */
+#define SOFTIRQ_NETRX_BUDGET   64  /* poll rounds */
+#define SOFTIRQ_TASKLET_BUDGET 64  /* tasklets */
+#define SOFTIRQ_BLOCK_BUDGET   256 /* requests */
+
+/* softirq_handle() goes around again while vectors keep getting raised, but only up to
+ * SOFTIRQ_MAX_RESTART times and for SOFTIRQ_MAX_TIME_NS. After that, ksoftirqd takes over, so a
+ * flood gets scheduled against everything else instead of starving it. */
+#define SOFTIRQ_MAX_RESTART 10
+#define SOFTIRQ_MAX_TIME_NS (2 * NS_PER_MS)
+
 PER_CPU_VAR(unsigned int pending_vectors);
 PER_CPU_VAR(bool handling_softirq);
 
+struct softirq_stats
+{
+    unsigned long count[SOFTIRQ_VECTOR_NR];
+    hrtime_t time_ns[SOFTIRQ_VECTOR_NR];
+    /* Times we went around again, and times we gave up and woke ksoftirqd */
+    unsigned long restarts;
+    unsigned long deferred;
+};
+
+static PER_CPU_VAR(struct softirq_stats softirq_stats);
+static PER_CPU_VAR(struct thread *ksoftirqd);
+/* Set while softirqs are deferred to ksoftirqd. Interrupt exits leave them alone meanwhile. */
+static PER_CPU_VAR(bool ksoftirqd_active);
+
+static const char *softirq_names[SOFTIRQ_VECTOR_NR] = {"TIMER", "NET_RX", "TASKLET", "BLOCK",
+                                                       "RCU"};
+
 bool softirq_may_handle()
 {
     auto irqs_enabled = !irq_is_disabled();
@@ -32,53 +66,106 @@ bool softirq_pending()
     return get_per_cpu(pending_vectors) != 0;
 }
 
+/**
+ * @brief Run a softirq vector
+ *
+ * @param vec Vector
+ * @return True if the vector ran out of budget and has work left
+ */
+static bool softirq_do_vector(unsigned int vec)
+{
+    switch (vec)
+    {
+        case SOFTIRQ_VECTOR_TIMER:
+            timer_handle_events(platform_get_timer());
+            return false;
+#ifdef CONFIG_NET
+        case SOFTIRQ_VECTOR_NETRX:
+            return netif_do_rx(SOFTIRQ_NETRX_BUDGET);
+#endif
+        case SOFTIRQ_VECTOR_TASKLET:
+            return tasklet_run(SOFTIRQ_TASKLET_BUDGET);
+        case SOFTIRQ_VECTOR_BLOCK:
+            return block_handle_completion(SOFTIRQ_BLOCK_BUDGET);
+        case SOFTIRQ_VECTOR_RCU:
+            rcu_work();
+            return false;
+    }
+
+    return false;
+}
+
+static void ksoftirqd_wake()
+{
+    struct thread *t = get_per_cpu(ksoftirqd);
+    if (!t)
+        return;
+    write_per_cpu(ksoftirqd_active, true);
+    thread_wake_up(t);
+}
+
 void softirq_handle()
 {
+    /* Work was handed off to ksoftirqd, let it do its thing */
+    if (get_per_cpu(ksoftirqd_active) && get_current_thread() != get_per_cpu(ksoftirqd))
+        return;
+
     write_per_cpu(handling_softirq, true);
 
     sched_disable_preempt();
 
+    struct softirq_stats *stats = get_per_cpu_ptr(softirq_stats);
+    unsigned int restarts = SOFTIRQ_MAX_RESTART;
+    hrtime_t deadline = clocksource_get_time() + SOFTIRQ_MAX_TIME_NS;
+    unsigned int pending;
+
     bool is_disabled = irq_is_disabled();
     /* Disable irqs, get a snapshot of the pending vectors, and clear them. Then reenable irqs. This
      * deals with races, because no one can interrupt us between us getting and us clearing the
      * softirq pending vectors.
      */
     irq_disable();
-    auto pending = get_per_cpu(pending_vectors);
+    pending = get_per_cpu(pending_vectors);
     write_per_cpu(pending_vectors, 0);
 
+restart:
     irq_enable();
-    if (pending & (1 << SOFTIRQ_VECTOR_TIMER))
-    {
-        timer_handle_events(platform_get_timer());
-        pending &= ~(1 << SOFTIRQ_VECTOR_TIMER);
-    }
 
-#ifdef CONFIG_NET
-    if (pending & (1 << SOFTIRQ_VECTOR_NETRX))
+    unsigned int left = 0;
+    for (unsigned int vec = 0; vec < SOFTIRQ_VECTOR_NR; vec++)
     {
-        netif_do_rx();
-        pending &= ~(1 << SOFTIRQ_VECTOR_NETRX);
-    }
-#endif
+        if (!(pending & (1U << vec)))
+            continue;
 
-    if (pending & (1 << SOFTIRQ_VECTOR_TASKLET))
-    {
-        tasklet_run();
-        pending &= ~(1 << SOFTIRQ_VECTOR_TASKLET);
+        hrtime_t start = clocksource_get_time();
+        if (softirq_do_vector(vec))
+            left |= 1U << vec;
+        stats->time_ns[vec] += clocksource_get_time() - start;
+        stats->count[vec]++;
     }
 
-    if (pending & (1 << SOFTIRQ_VECTOR_BLOCK))
-        block_handle_completion();
+    irq_disable();
+    pending = get_per_cpu(pending_vectors) | left;
+    write_per_cpu(pending_vectors, 0);
 
-    if (pending & (1 << SOFTIRQ_VECTOR_RCU))
+    if (pending)
     {
-        rcu_work();
-        pending &= ~(1 << SOFTIRQ_VECTOR_RCU);
+        struct thread *curr = get_current_thread();
+        if (--restarts && clocksource_get_time() < deadline &&
+            !(curr && sched_needs_resched(curr)))
+        {
+            stats->restarts++;
+            goto restart;
+        }
+
+        /* Vectors keep coming back, punt the rest to ksoftirqd */
+        write_per_cpu(pending_vectors, pending);
+        stats->deferred++;
+        ksoftirqd_wake();
     }
 
-    if (is_disabled)
-        irq_disable();
+    if (!is_disabled)
+        irq_enable();
 
     sched_enable_preempt_no_softirq();
 
@@ -107,3 +194,120 @@ void softirq_raise(enum softirq_vector vec)
     if (pending && softirq_may_handle())
         softirq_handle();
 }
+
+static void ksoftirqd_main(void *arg)
+{
+    for (;;)
+    {
+        set_current_state(THREAD_UNINTERRUPTIBLE);
+
+        if (!softirq_pending())
+        {
+            /* Caught up, interrupt exits can run softirqs again */
+            write_per_cpu(ksoftirqd_active, false);
+            sched_yield();
+            continue;
+        }
+
+        set_current_state(THREAD_RUNNABLE);
+        softirq_handle();
+
+        /* We're a normal priority thread, give way if someone else needs the cpu */
+        if (sched_needs_resched(get_current_thread()))
+            sched_yield();
+    }
+}
+
+static void ksoftirqd_init()
+{
+    for (unsigned int cpu = 0; cpu < get_nr_cpus(); cpu++)
+    {
+        struct thread *t = sched_create_thread(ksoftirqd_main, THREAD_KERNEL, nullptr);
+        if (!t)
+            panic("softirq: Failed to create ksoftirqd for cpu%u\n", cpu);
+        t->priority = SCHED_PRIO_NORMAL;
+        t->flags |= THREAD_PINNED;
+        write_per_cpu_any(ksoftirqd, t, cpu);
+        sched_start_thread_for_cpu(t, cpu);
+    }
+}
+
+INIT_LEVEL_CORE_AFTER_SCHED_ENTRY(ksoftirqd_init);
+
+/* softirqs: times every vector ran, per cpu, like Linux's /proc/softirqs. softirq_time has the
+ * time spent in them (us), and how often we restarted and deferred to ksoftirqd. */
+static void softirq_print_header(struct seq_file *m, unsigned int nr_cpus)
+{
+    seq_printf(m, "%-10s", "");
+    for (unsigned int cpu = 0; cpu < nr_cpus; cpu++)
+        seq_printf(m, " %10s%u", "CPU", cpu);
+    seq_printf(m, "\n");
+}
+
+static int softirqs_show(struct seq_file *m, void *v)
+{
+    unsigned int nr_cpus = get_nr_cpus();
+
+    softirq_print_header(m, nr_cpus);
+    for (unsigned int vec = 0; vec < SOFTIRQ_VECTOR_NR; vec++)
+    {
+        seq_printf(m, "%9s:", softirq_names[vec]);
+        for (unsigned int cpu = 0; cpu < nr_cpus; cpu++)
+            seq_printf(m, " %11lu", get_per_cpu_ptr_any(softirq_stats, cpu)->count[vec]);
+        seq_printf(m, "\n");
+    }
+
+    return 0;
+}
+
+static int softirq_time_show(struct seq_file *m, void *v)
+{
+    unsigned int nr_cpus = get_nr_cpus();
+
+    softirq_print_header(m, nr_cpus);
+    for (unsigned int vec = 0; vec < SOFTIRQ_VECTOR_NR; vec++)
+    {
+        seq_printf(m, "%9s:", softirq_names[vec]);
+        for (unsigned int cpu = 0; cpu < nr_cpus; cpu++)
+            seq_printf(m, " %11lu",
+                       get_per_cpu_ptr_any(softirq_stats, cpu)->time_ns[vec] / NS_PER_US);
+        seq_printf(m, "\n");
+    }
+
+    seq_printf(m, "%9s:", "RESTART");
+    for (unsigned int cpu = 0; cpu < nr_cpus; cpu++)
+        seq_printf(m, " %11lu", get_per_cpu_ptr_any(softirq_stats, cpu)->restarts);
+    seq_printf(m, "\n%9s:", "DEFERRED");
+    for (unsigned int cpu = 0; cpu < nr_cpus; cpu++)
+        seq_printf(m, " %11lu", get_per_cpu_ptr_any(softirq_stats, cpu)->deferred);
+    seq_printf(m, "\n");
+    return 0;
+}
+
+static int softirqs_open(struct file *filp)
+{
+    return single_open(filp, softirqs_show, nullptr);
+}
+
+static int softirq_time_open(struct file *filp)
+{
+    return single_open(filp, softirq_time_show, nullptr);
+}
+
+const static struct proc_file_ops softirqs_proc_ops = {
+    .open = softirqs_open,
+    .release = single_release,
+    .read_iter = seq_read_iter,
+};
+
+const static struct proc_file_ops softirq_time_proc_ops = {
+    .open = softirq_time_open,
+    .release = single_release,
+    .read_iter = seq_read_iter,
+};
+
+static __init void softirq_setup_proc(void)
+{
+    procfs_add_entry("softirqs", 0444, NULL, &softirqs_proc_ops);
+    procfs_add_entry("softirq_time", 0444, NULL, &softirq_time_proc_ops);
+}
@@ -0,0 +1,217 @@
+/*
+ * Copyright (c) 2025 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the GPLv2 License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#define DEFINE_CURRENT
+#include <errno.h>
+#include <string.h>
+
+#include <onyx/file.h>
+#include <onyx/mm/slab.h>
+#include <onyx/process.h>
+#include <onyx/scheduler.h>
+#include <onyx/signal.h>
+#include <onyx/user.h>
+#include <onyx/vm.h>
+
+#include <uapi/fcntl.h>
+#include <uapi/spawn.h>
+
+#include <onyx/utility.hpp>
+
+int sys_open(const char *ufilename, int flags, mode_t mode);
+int sys_close(int fd);
+int sys_dup2(int oldfd, int newfd);
+int sys_fcntl(int fd, int cmd, unsigned long arg);
+int sys_chdir(const char *upath);
+int sys_fchdir(int fildes);
+int sys_execve(const char *p, const char **argv, const char **envp);
+
+extern "C" {
+int sys_setpgid(pid_t pid, pid_t pgid);
+pid_t sys_setsid(void);
+pid_t sys_wait4(pid_t pid, int *wstatus, int options, struct rusage *usage);
+void sys_exit(int value);
+}
+
+struct spawn_state
+{
+    struct spawn_args args;
+    struct spawn_file_action *actions;
+    /* Set by the child if it failed before exec */
+    int error;
+};
+
+static bool spawn_keep_cloexec(int fd, void *arg)
+{
+    struct spawn_state *state = (struct spawn_state *) arg;
+
+    /* O_CLOEXEC fds can still be used by the file actions, before exec closes them */
+    for (unsigned int i = 0; i < state->args.nr_actions; i++)
+    {
+        struct spawn_file_action *fa = &state->actions[i];
+        if (fa->type == SPAWN_FA_DUP2 && fa->srcfd == fd)
+            return true;
+        if (fa->type == SPAWN_FA_FCHDIR && fa->fd == fd)
+            return true;
+    }
+
+    return false;
+}
+
+static int spawn_do_file_action(struct spawn_file_action *fa)
+{
+    int fd;
+
+    switch (fa->type)
+    {
+        case SPAWN_FA_CLOSE:
+            /* The fd may not exist anymore (e.g it was O_CLOEXEC), that's fine */
+            sys_close(fa->fd);
+            return 0;
+        case SPAWN_FA_DUP2:
+            /* dup2 to the same fd is a no-op, but the fd needs to survive exec */
+            if (fa->srcfd == fa->fd)
+                return sys_fcntl(fa->fd, F_SETFD, 0);
+            fd = sys_dup2(fa->srcfd, fa->fd);
+            return fd < 0 ? fd : 0;
+        case SPAWN_FA_OPEN:
+            fd = sys_open(fa->path, fa->oflag, fa->mode);
+            if (fd < 0)
+                return fd;
+            if (fd != fa->fd)
+            {
+                int st = sys_dup2(fd, fa->fd);
+                sys_close(fd);
+                if (st < 0)
+                    return st;
+            }
+            return 0;
+        case SPAWN_FA_CHDIR:
+            return sys_chdir(fa->path);
+        case SPAWN_FA_FCHDIR:
+            return sys_fchdir(fa->fd);
+    }
+
+    return -EINVAL;
+}
+
+static int spawn_do_attrs(struct spawn_state *state)
+{
+    struct spawn_args *args = &state->args;
+    int st;
+
+    if (args->flags & SPAWN_SETSID)
+    {
+        if ((st = sys_setsid()) < 0)
+            return st;
+    }
+
+    if (args->flags & SPAWN_SETPGROUP)
+    {
+        if ((st = sys_setpgid(0, args->pgroup)) < 0)
+            return st;
+    }
+
+    if (args->flags & SPAWN_SETSIGDEF)
+    {
+        spin_lock(&current->sighand->signal_lock);
+        for (int i = 1; i < _NSIG; i++)
+        {
+            if (args->sigdefault & (1ULL << (i - 1)))
+                current->sighand->sigtable[i].sa_handler = SIG_DFL;
+        }
+        spin_unlock(&current->sighand->signal_lock);
+    }
+
+    if (args->flags & SPAWN_SETSIGMASK)
+    {
+        sigset_t mask;
+        memset(&mask, 0, sizeof(mask));
+        memcpy(&mask, &args->sigmask, cul::min(sizeof(mask), sizeof(args->sigmask)));
+        signal_setmask(&mask);
+    }
+
+    return 0;
+}
+
+static void spawn_child_main(void *arg)
+{
+    struct spawn_state *state = (struct spawn_state *) arg;
+    int st;
+
+    /* We're a kernel thread in a brand new process, sharing the parent's address space (which is
+     * blocked until we exec or exit, just like vfork). Become a user thread, and run the file
+     * actions and attributes on our own fd table, fs and signal state. */
+    st = sched_transition_to_user_thread(get_current_thread());
+    if (st < 0)
+        goto err;
+
+    thread_change_addr_limit(VM_USER_ADDR_LIMIT);
+
+    if ((st = spawn_do_attrs(state)) < 0)
+        goto err;
+
+    for (unsigned int i = 0; i < state->args.nr_actions; i++)
+    {
+        if ((st = spawn_do_file_action(&state->actions[i])) < 0)
+            goto err;
+    }
+
+    /* Only returns if it failed before the point of no return */
+    st = sys_execve(state->args.path, (const char **) state->args.argv,
+                    (const char **) state->args.envp);
+err:
+    state->error = st;
+    sys_exit(127);
+}
+
+/**
+ * @brief Create a new process running an executable
+ * Like posix_spawn, minus the address space copy: the child borrows our address space (like
+ * vfork) only until it execs, and it runs its file actions in the kernel. O_CLOEXEC fds the
+ * actions don't use are never copied.
+ *
+ * @param uargs Spawn arguments
+ * @return The child's pid, or a negative error code (errors in the child, before exec, are
+ * reported here, and the child is reaped)
+ */
+pid_t sys_spawn(const struct spawn_args *uargs)
+{
+    struct spawn_state state = {};
+    pid_t pid;
+
+    if (copy_from_user(&state.args, uargs, sizeof(state.args)) < 0)
+        return -EFAULT;
+
+    if (state.args.nr_actions > SPAWN_MAX_FILE_ACTIONS)
+        return -EINVAL;
+
+    if (state.args.nr_actions)
+    {
+        size_t size = state.args.nr_actions * sizeof(struct spawn_file_action);
+        state.actions = (struct spawn_file_action *) kmalloc(size, GFP_KERNEL);
+        if (!state.actions)
+            return -ENOMEM;
+        if (copy_from_user(state.actions, state.args.actions, size) < 0)
+        {
+            kfree(state.actions);
+            return -EFAULT;
+        }
+    }
+
+    /* By the time this returns, the child either exec'd or exited */
+    pid = process_spawn_clone(spawn_child_main, &state, spawn_keep_cloexec);
+    if (pid >= 0 && state.error < 0)
+    {
+        sys_wait4(pid, nullptr, 0, nullptr);
+        pid = state.error;
+    }
+
+    kfree(state.actions);
+    return pid;
+}
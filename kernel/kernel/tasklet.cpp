@@ -41,9 +41,15 @@ void tasklet_schedule(tasklet *t)
     softirq_raise(SOFTIRQ_VECTOR_TASKLET);
 }
 
-void tasklet_run()
+/**
+ * @brief Run pending tasklets (softirq routine)
+ *
+ * @param budget Maximum number of tasklets to run
+ * @return True if there are still tasklets pending
+ */
+bool tasklet_run(unsigned int budget)
 {
-    struct list_head to_run;
+    DEFINE_LIST(to_run);
     // Disable IRQs for a bit, while we copy the list
     // We copy it so we hold the noirq context for as little time as possible
     auto flags = irq_save_and_disable();
@@ -56,12 +62,24 @@ void tasklet_run()
 
     list_for_every_safe (&to_run)
     {
+        if (budget == 0)
+            break;
         tasklet *t = container_of(l, tasklet, list_node);
         t->flags.or_fetch(TASKLET_RUNNING, mem_order::acquire);
         t->func(t->context);
         list_remove(&t->list_node);
         t->flags.store(0, mem_order::release);
+        budget--;
     }
+
+    if (list_is_empty(&to_run))
+        return false;
+
+    /* Out of budget, put the rest back at the front of the line */
+    flags = irq_save_and_disable();
+    list_splice(&to_run, get_per_cpu_ptr(pending_tasklet_list));
+    irq_restore(flags);
+    return true;
 }
 
 INIT_LEVEL_CORE_PERCPU_CTOR(tasklet_ctor);
@@ -0,0 +1,167 @@
+#!/bin/python3
+# Copyright (c) 2024 Pedro Falcato
+# This file is part of Onyx, and is released under the terms of the MIT License
+# check LICENSE at the root directory for more information
+#
+# SPDX-License-Identifier: MIT
+#
+# ext2 journal crash-consistency test: boot Onyx with an ext3 image on a virtio-blk disk, run a
+# metadata heavy workload on it, kill the VM mid-workload, then boot again and let the kernel
+# replay the journal. The image must come out of e2fsck clean.
+#
+# Environment:
+#  CRASH_TEST_DEV: block device the image shows up as in the guest (default /dev/sda)
+#  CRASH_TEST_ITERATIONS: how many crash/replay cycles to run (default 3)
+#  USE_KVM: set to 0 to disable KVM
+#
+import subprocess
+import os
+import time
+import sys
+import signal
+import random
+
+IMAGE = 'crash-test.img'
+MOUNTPOINT = '/mnt'
+
+def ispanic(line: str):
+    return line.startswith('panic: ')
+
+def qemu_cmdline():
+    cmd = ['qemu-system-x86_64', '-cdrom', 'Onyx.iso', '-m', '1G', '-boot', 'd',
+           '-drive', f'file={IMAGE},format=raw,if=none,id=crashdisk,cache=writeback',
+           '-device', 'virtio-blk-pci,drive=crashdisk',
+           '-cpu', 'Haswell', '-smp', '4', '-machine', 'q35', '-nographic', '--no-reboot']
+
+    if os.environ.get('USE_KVM', '1') != '0':
+        cmd += ['--enable-kvm']
+    return cmd
+
+class Guest:
+    def __init__(self):
+        self.p = subprocess.Popen(qemu_cmdline(), stdout=subprocess.PIPE, stdin=subprocess.PIPE)
+
+    def readline(self):
+        line = self.p.stdout.readline().decode('utf-8', errors='replace')
+        if len(line) == 0:
+            print('crash-test: qemu exited unexpectedly')
+            exit(1)
+        print(line, end='')
+        if ispanic(line):
+            time.sleep(1)
+            self.p.kill()
+            exit(1)
+        return line
+
+    def wait_for(self, marker: str):
+        while True:
+            line = self.readline()
+            if line.find(marker) != -1 and not line.startswith('echo '):
+                return line
+
+    def boot(self):
+        self.wait_for('Welcome to Onyx')
+        # Ugh, hate this.
+        time.sleep(10)
+
+    def run(self, cmd: str):
+        self.p.stdin.write(f'{cmd}\n'.encode('utf-8'))
+        self.p.stdin.flush()
+
+    def run_checked(self, cmd: str):
+        self.run(f'{cmd}; echo CMD-STATUS $?')
+        line = self.wait_for('CMD-STATUS')
+        status = int(line[line.find('CMD-STATUS'):].split()[1])
+        if status != 0:
+            print(f'crash-test: "{cmd}" failed with status {status}')
+            self.p.kill()
+            exit(1)
+
+    def kill(self):
+        # SIGKILL, so nothing gets flushed on the way out
+        self.p.kill()
+        self.p.wait()
+
+def host(cmd: list, ok=(0,)):
+    r = subprocess.run(cmd, stdout=subprocess.PIPE, stderr=subprocess.STDOUT)
+    out = r.stdout.decode('utf-8', errors='replace')
+    if r.returncode not in ok:
+        print(out)
+        print(f'crash-test: {" ".join(cmd)} failed with status {r.returncode}')
+        exit(1)
+    return out
+
+def needs_recovery():
+    out = host(['dumpe2fs', '-h', IMAGE])
+    for line in out.splitlines():
+        if line.startswith('Filesystem features:'):
+            return 'needs_recovery' in line.split()
+    return False
+
+# Lots of creates, renames, (hard) links, unlinks and directory growth, plus some data for
+# ordered mode
+WORKLOAD = ('i=0; while true; do mkdir -p {m}/d$((i % 16)); '
+            'echo data-$i > {m}/d$((i % 16))/f$i; '
+            'mv {m}/d$((i % 16))/f$i {m}/d$(((i + 1) % 16))/g$i; '
+            'ln -s g$i {m}/d$(((i + 1) % 16))/l$i; '
+            'ln {m}/d$(((i + 1) % 16))/g$i {m}/d$((i % 16))/h$i; '
+            'if [ $((i % 3)) -eq 0 ]; then rm -f {m}/d$(((i + 1) % 16))/g$((i - 2)); fi; '
+            'if [ $((i % 4)) -eq 0 ]; then rm -f {m}/d$(((i + 15) % 16))/h$((i - 1)); fi; '
+            'i=$((i + 1)); done')
+
+def crash_cycle(dev: str, iteration: int):
+    print(f'crash-test: iteration {iteration}: running the workload')
+    g = Guest()
+    g.boot()
+    g.run_checked(f'mkdir -p {MOUNTPOINT}')
+    g.run_checked(f'mount -t ext2 {dev} {MOUNTPOINT}')
+    g.run(WORKLOAD.format(m=MOUNTPOINT))
+
+    # Let it run for a while, past a few commits
+    time.sleep(random.randint(8, 20))
+    g.kill()
+
+    if not needs_recovery():
+        print('crash-test: needs_recovery not set after the crash, was the journal loaded?')
+        exit(1)
+
+    print(f'crash-test: iteration {iteration}: replaying the journal')
+    g = Guest()
+    g.boot()
+    g.run_checked(f'mkdir -p {MOUNTPOINT}')
+    # Mounting replays the journal
+    g.run_checked(f'mount -t ext2 {dev} {MOUNTPOINT}')
+    g.run_checked(f'ls {MOUNTPOINT} > /dev/null')
+    g.run_checked(f'umount {MOUNTPOINT}')
+    g.kill()
+
+    if needs_recovery():
+        print('crash-test: needs_recovery still set after a clean unmount')
+        exit(1)
+
+    # 0: clean, 1: errors corrected (e.g free counts, which aren't journaled precisely)
+    out = host(['e2fsck', '-fp', IMAGE], ok=(0, 1))
+    print(out)
+
+def main():
+    # Set timeout to 30 minutes
+    signal.alarm(30 * 60)
+
+    if os.environ.get('ONYX_ARCH', 'x86_64') != 'x86_64':
+        print('crash-test: only x86_64 is supported, returning success. This does not mean it works!')
+        exit(0)
+
+    dev = os.environ.get('CRASH_TEST_DEV', '/dev/sda')
+    iterations = int(os.environ.get('CRASH_TEST_ITERATIONS', '3'))
+
+    host(['rm', '-f', IMAGE])
+    host(['mke2fs', '-q', '-t', 'ext3', '-b', '4096', IMAGE, '256M'])
+
+    for i in range(iterations):
+        crash_cycle(dev, i)
+
+    print('crash-test: OK')
+    exit(0)
+
+if __name__ == "__main__":
+    main()
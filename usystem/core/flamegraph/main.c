@@ -14,13 +14,30 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <symbolize/symbolize.h>
+#include <uapi/perf_event.h>
 #include <uapi/perf_probe.h>
 
 bool tracing_wait = false;
 
+struct pmu_event
+{
+    const char *name;
+    unsigned long config;
+    unsigned long default_period;
+};
+
+static const struct pmu_event pmu_events[] = {
+    {"cycles", PERF_COUNT_HW_CPU_CYCLES, 1000000},
+    {"instructions", PERF_COUNT_HW_INSTRUCTIONS, 1000000},
+    {"llc-misses", PERF_COUNT_HW_CACHE_MISSES, 1000},
+    {"branch-misses", PERF_COUNT_HW_BRANCH_MISSES, 10000},
+};
+
 struct flame_graph_entry_freq
 {
     struct flame_graph_entry e;
@@ -53,7 +70,8 @@ bool is_same_stack(struct flame_graph_entry *e, struct flame_graph_entry *e2)
     return true;
 }
 
-void add_to_freqmap(struct flame_graph_entry_freqmap *freqmap, struct flame_graph_entry *e)
+void add_to_freqmap(struct flame_graph_entry_freqmap *freqmap, struct flame_graph_entry *e,
+                    size_t weight)
 {
     size_t i;
     for (i = 0; i < freqmap->wpos; i++)
@@ -62,20 +80,26 @@ void add_to_freqmap(struct flame_graph_entry_freqmap *freqmap, struct flame_grap
         {
             if (is_same_stack(&freqmap->freqmap[i].e, e))
             {
-                if (tracing_wait)
-                {
-                    freqmap->freqmap[i].freq += e->rips[31];
-                }
-                else
-                    freqmap->freqmap[i].freq++;
+                freqmap->freqmap[i].freq += weight;
                 return;
             }
         }
     }
 
+    if (freqmap->wpos == freqmap->nr_freqs)
+    {
+        size_t nr = freqmap->nr_freqs ? freqmap->nr_freqs * 2 : 1024;
+        struct flame_graph_entry_freq *freqs =
+            reallocarray(freqmap->freqmap, nr, sizeof(struct flame_graph_entry_freq));
+        if (!freqs)
+            err(1, "error growing freqmap");
+        freqmap->freqmap = freqs;
+        freqmap->nr_freqs = nr;
+    }
+
     struct flame_graph_entry_freq *f = &freqmap->freqmap[freqmap->wpos++];
     memcpy(&f->e, e, sizeof(*e));
-    f->freq = tracing_wait ? e->rips[31] : 1;
+    f->freq = weight;
 }
 
 struct symbolize_ctx ctx;
@@ -112,24 +136,116 @@ void print_fmap(struct flame_graph_entry_freqmap *fmap)
 
 static void print_usage(void)
 {
-    printf("Usage: flamegraph [-w]\n");
+    printf("Usage: flamegraph [-w] [-e event [-p period]]\n");
     printf("Collects kernel flamegraphs and prints them to stdout.\n"
            "The format may then be collected by FlameGraph's stackcollapse.pl"
            " and processed to create a .svg\n");
-    printf("\n  -w       Collect a wait flamegraph instead of a CPU one\n");
+    printf("\n  -w         Collect a wait flamegraph instead of a CPU one\n");
+    printf("  -e event   Sample on a hardware event instead of the timer, weighting stacks by\n"
+           "             event count. One of cycles, instructions, llc-misses, branch-misses\n");
+    printf("  -p period  Take a sample every period events\n");
+}
+
+static const struct pmu_event *find_pmu_event(const char *name)
+{
+    for (size_t i = 0; i < sizeof(pmu_events) / sizeof(pmu_events[0]); i++)
+    {
+        if (!strcmp(pmu_events[i].name, name))
+            return &pmu_events[i];
+    }
+
+    return NULL;
+}
+
+static void drain_samples(int fd, struct flame_graph_entry_freqmap *fmap)
+{
+    static struct perf_sample samples[64];
+    ssize_t len;
+
+    while ((len = read(fd, samples, sizeof(samples))) > 0)
+    {
+        for (size_t i = 0; i < len / sizeof(struct perf_sample); i++)
+        {
+            struct perf_sample *s = &samples[i];
+            struct flame_graph_entry e = {};
+            memcpy(e.rips, s->ips, s->nr_ips * sizeof(unsigned long));
+            add_to_freqmap(fmap, &e, s->period);
+        }
+    }
+
+    if (len < 0)
+        err(1, "error reading samples");
+}
+
+/* Sample every CPU's kernel stacks on a hardware event, for 10 seconds */
+static void collect_pmu(const struct pmu_event *ev, unsigned long period,
+                        struct flame_graph_entry_freqmap *fmap)
+{
+    long nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int *fds = calloc(nr_cpus, sizeof(int));
+    if (!fds)
+        err(1, "calloc");
+
+    struct perf_event_attr attr = {};
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = ev->config;
+    attr.sample_period = period;
+    /* We only symbolize the kernel */
+    attr.flags = PERF_ATTR_EXCLUDE_USER;
+
+    for (long i = 0; i < nr_cpus; i++)
+    {
+        fds[i] = syscall(SYS_perf_event_open, &attr, -1, (int) i, -1, PERF_FLAG_FD_CLOEXEC);
+        if (fds[i] < 0)
+            err(1, "error opening %s event on cpu%ld", ev->name, i);
+    }
+
+    /* The per-event sample buffers are small, so drain them as we go */
+    const struct timespec interval = {.tv_sec = 0, .tv_nsec = 100000000};
+    for (int i = 0; i < 100; i++)
+    {
+        nanosleep(&interval, NULL);
+        for (long j = 0; j < nr_cpus; j++)
+            drain_samples(fds[j], fmap);
+    }
+
+    for (long i = 0; i < nr_cpus; i++)
+    {
+        unsigned long lost;
+        if (ioctl(fds[i], PERF_EVENT_IOC_LOST, &lost) < 0)
+            err(1, "error getting lost samples");
+        if (lost)
+            fprintf(stderr, "flamegraph: cpu%ld lost %lu samples\n", i, lost);
+        close(fds[i]);
+    }
+
+    free(fds);
 }
 
 int main(int argc, char **argv)
 {
+    const struct pmu_event *ev = NULL;
+    unsigned long period = 0;
     int c;
 
-    while ((c = getopt(argc, argv, "w")) != -1)
+    while ((c = getopt(argc, argv, "we:p:")) != -1)
     {
         switch (c)
         {
             case 'w':
                 tracing_wait = true;
                 break;
+            case 'e':
+                ev = find_pmu_event(optarg);
+                if (!ev)
+                    errx(1, "unknown event %s", optarg);
+                break;
+            case 'p':
+                period = strtoul(optarg, NULL, 0);
+                if (!period)
+                    errx(1, "bad period %s", optarg);
+                break;
             case 'h':
             case '?':
                 print_usage();
@@ -144,6 +260,17 @@ int main(int argc, char **argv)
     if (symbolize_exec(kfd, &ctx) < 0)
         err(1, "error initializing symbolization");
 
+    if (ev)
+    {
+        if (tracing_wait)
+            errx(1, "-w and -e are mutually exclusive");
+
+        struct flame_graph_entry_freqmap fmap = {};
+        collect_pmu(ev, period ?: ev->default_period, &fmap);
+        print_fmap(&fmap);
+        return 0;
+    }
+
     signal(SIGALRM, stub);
 
     int fd = open("/dev/perf-probe", O_RDONLY | O_CLOEXEC);
@@ -193,7 +320,7 @@ int main(int argc, char **argv)
     {
         if (buf[i].rips[0] == 0)
             continue;
-        add_to_freqmap(&fmap, &buf[i]);
+        add_to_freqmap(&fmap, &buf[i], tracing_wait ? buf[i].rips[31] : 1);
     }
 
     print_fmap(&fmap);
@@ -511,12 +511,86 @@ void add_traced_event(int fd, const char *name)
         err(1, "KTRACEENABLE");
 }
 
+struct trace_ring
+{
+    struct ktrace_ring_header *hdr;
+    u8 *data;
+    // Bytes we threw away to get back in sync with a ring that had garbage in it
+    u64 skipped;
+};
+
+static void trace_ring_map(struct trace_ring *ring, int fd)
+{
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    struct ktrace_ring_header *hdr;
+
+    // Map the header first, to find out how big the ring is
+    hdr = mmap(NULL, page_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (hdr == MAP_FAILED)
+        err(1, "mmap ktrace ring");
+    size_t size = hdr->data_offset + hdr->data_size;
+    munmap(hdr, page_size);
+
+    ring->hdr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (ring->hdr == MAP_FAILED)
+        err(1, "mmap ktrace ring");
+    ring->data = (u8 *) ring->hdr + ring->hdr->data_offset;
+    ring->skipped = 0;
+}
+
+static void trace_ring_copy(struct trace_ring *ring, u64 pos, u8 *buf, size_t len)
+{
+    size_t size = ring->hdr->data_size;
+    size_t index = pos & (size - 1);
+    size_t first = len < size - index ? len : size - index;
+    memcpy(buf, ring->data + index, first);
+    memcpy(buf + first, ring->data, len - first);
+}
+
+/* Consume every record in the ring, see struct ktrace_ring_header */
+static u8 *trace_ring_drain(struct trace_ring *ring, u8 *bufp, u8 *end)
+{
+    struct ktrace_ring_header *hdr = ring->hdr;
+
+    for (;;)
+    {
+        struct tracing_header h;
+        u64 tail = __atomic_load_n(&hdr->tail, __ATOMIC_ACQUIRE);
+        u64 head = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+
+        if (head == tail)
+            break;
+
+        trace_ring_copy(ring, tail, (u8 *) &h, sizeof(h));
+        if (head - tail > hdr->data_size || h.size < sizeof(h) || h.size > head - tail)
+        {
+            // Either the record got overwritten under us (and tail moved), or the ring is
+            // garbage. In the latter case, skip everything, else we'd never get past it.
+            if (__atomic_compare_exchange_n(&hdr->tail, &tail, head, 0, __ATOMIC_ACQ_REL,
+                                            __ATOMIC_ACQUIRE))
+                ring->skipped += head - tail;
+            continue;
+        }
+
+        if (h.size > end - bufp)
+            errx(1, "out of space for trace records");
+
+        trace_ring_copy(ring, tail, bufp, h.size);
+        if (!__atomic_compare_exchange_n(&hdr->tail, &tail, tail + h.size, 0, __ATOMIC_ACQ_REL,
+                                         __ATOMIC_ACQUIRE))
+            continue;
+        bufp += h.size;
+    }
+
+    return bufp;
+}
+
 int main(int argc, char **argv, char **envp)
 {
     u8 *endbuf;
     u8 *bufp;
     u8 *end;
-    int cpufds[256];
+    struct trace_ring rings[256];
     int ncpus = 0;
     int fd = open("/dev/ktrace", O_RDWR | O_CLOEXEC);
     if (fd < 0)
@@ -544,7 +618,7 @@ int main(int argc, char **argv, char **envp)
 
     while ((buffd = ioctl(fd, KTRACEGETBUFFD, &ncpus)) >= 0)
     {
-        cpufds[ncpus++] = buffd;
+        trace_ring_map(&rings[ncpus++], buffd);
     }
 
     pid_t pid = fork();
@@ -558,20 +632,25 @@ int main(int argc, char **argv, char **envp)
     int keep_running = 1;
     while (keep_running)
     {
-        usleep(500000);
+        // Draining the rings doesn't take a syscall, so we can afford to do it often
+        usleep(100000);
 
         if (waitpid(pid, NULL, WNOHANG) > 0)
             keep_running = 0;
         for (int i = 0; i < ncpus; i++)
-        {
-            ssize_t len = read(cpufds[i], bufp, end - bufp);
-            if (len < 0)
-                err(1, "read");
-            bufp += len;
-        }
+            bufp = trace_ring_drain(&rings[i], bufp, end);
     }
 
     printf("Read %zu bytes\n", bufp - endbuf);
+    for (int i = 0; i < ncpus; i++)
+    {
+        u64 lost = __atomic_load_n(&rings[i].hdr->lost, __ATOMIC_RELAXED);
+        if (lost)
+            fprintf(stderr, "cpu%d: lost %lu events\n", i, (unsigned long) lost);
+        if (rings[i].skipped)
+            fprintf(stderr, "cpu%d: skipped %lu bytes of corrupted records\n", i,
+                    (unsigned long) rings[i].skipped);
+    }
 
     output_json(endbuf, bufp, stdout);
 
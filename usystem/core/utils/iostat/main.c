@@ -0,0 +1,321 @@
+/*
+ * Copyright (c) 2024 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_DEVS 64
+#define NR_OPS   3
+/* Must match the kernel's BLK_LAT_BUCKETS */
+#define LAT_BUCKETS 24
+
+struct op_stats
+{
+    unsigned long ios;
+    unsigned long merges;
+    unsigned long sectors;
+    unsigned long time_ms;
+};
+
+struct dev_stats
+{
+    char name[64];
+    struct op_stats ops[NR_OPS];
+    unsigned long in_flight;
+    unsigned long busy_ms;
+    unsigned long weighted_ms;
+};
+
+static const char *op_names[NR_OPS] = {"read", "write", "other"};
+
+static int read_diskstats(struct dev_stats *devs)
+{
+    FILE *f = fopen("/proc/diskstats", "r");
+    if (!f)
+    {
+        perror("iostat: /proc/diskstats");
+        return -1;
+    }
+
+    int nr = 0;
+    char line[512];
+    while (nr < MAX_DEVS && fgets(line, sizeof(line), f))
+    {
+        struct dev_stats *d = &devs[nr];
+        unsigned int major, minor;
+        struct op_stats *r = &d->ops[0], *w = &d->ops[1], *o = &d->ops[2];
+        memset(d, 0, sizeof(*d));
+
+        /* Older layouts without the trailing "other" fields are fine, those stay at 0 */
+        if (sscanf(line, "%u %u %63s %lu %lu %lu %lu %lu %lu %lu %lu %lu %lu %lu %lu %lu %lu %lu",
+                   &major, &minor, d->name, &r->ios, &r->merges, &r->sectors, &r->time_ms, &w->ios,
+                   &w->merges, &w->sectors, &w->time_ms, &d->in_flight, &d->busy_ms,
+                   &d->weighted_ms, &o->ios, &o->merges, &o->sectors, &o->time_ms) < 14)
+            continue;
+        nr++;
+    }
+
+    fclose(f);
+    return nr;
+}
+
+static const struct dev_stats *find_dev(const struct dev_stats *devs, int nr, const char *name)
+{
+    for (int i = 0; i < nr; i++)
+    {
+        if (!strcmp(devs[i].name, name))
+            return &devs[i];
+    }
+
+    return NULL;
+}
+
+static double per_sec(unsigned long val, double secs)
+{
+    return secs > 0 ? val / secs : 0;
+}
+
+static double await_ms(const struct op_stats *now, const struct op_stats *old)
+{
+    unsigned long ios = now->ios - old->ios;
+    return ios ? (double) (now->time_ms - old->time_ms) / ios : 0;
+}
+
+/* Print a report for the interval between old and now. With old == NULL, report totals since
+ * boot, which is what the first report always is. */
+static void report(const struct dev_stats *now, int nr_now, const struct dev_stats *old,
+                   int nr_old, double secs)
+{
+    static const struct dev_stats zero;
+
+    printf("%-10s %9s %9s %10s %10s %8s %8s %8s %8s %7s %6s\n", "Device", "r/s", "w/s", "rkB/s",
+           "wkB/s", "rrqm/s", "wrqm/s", "r_await", "w_await", "aqu-sz", "%util");
+
+    for (int i = 0; i < nr_now; i++)
+    {
+        const struct dev_stats *d = &now[i];
+        const struct dev_stats *o = old ? find_dev(old, nr_old, d->name) : NULL;
+        if (!o)
+            o = &zero;
+
+        const struct op_stats *r = &d->ops[0], *w = &d->ops[1];
+        const struct op_stats *or = &o->ops[0], *ow = &o->ops[1];
+        double ms = secs * 1000;
+
+        printf("%-10s %9.2f %9.2f %10.2f %10.2f %8.2f %8.2f %8.2f %8.2f %7.2f %6.2f\n", d->name,
+               per_sec(r->ios - or->ios, secs), per_sec(w->ios - ow->ios, secs),
+               per_sec(r->sectors - or->sectors, secs) / 2,
+               per_sec(w->sectors - ow->sectors, secs) / 2,
+               per_sec(r->merges - or->merges, secs), per_sec(w->merges - ow->merges, secs),
+               await_ms(r, or), await_ms(w, ow),
+               ms > 0 ? (d->weighted_ms - o->weighted_ms) / ms : 0,
+               ms > 0 ? 100.0 * (d->busy_ms - o->busy_ms) / ms : 0);
+    }
+
+    printf("\n");
+}
+
+static const char *bucket_label(unsigned int bucket, char *buf, size_t len)
+{
+    unsigned long us = 1UL << bucket;
+
+    if (bucket == 0)
+        snprintf(buf, len, "<2us");
+    else if (bucket == LAT_BUCKETS - 1)
+        snprintf(buf, len, ">=%lums", us / 1000);
+    else if (us < 1000)
+        snprintf(buf, len, "%luus", us);
+    else
+        snprintf(buf, len, "%lums", us / 1000);
+    return buf;
+}
+
+static int print_latency(void)
+{
+    FILE *f = fopen("/proc/blklat", "r");
+    if (!f)
+    {
+        perror("iostat: /proc/blklat");
+        return 1;
+    }
+
+    char line[1024];
+    while (fgets(line, sizeof(line), f))
+    {
+        char name[64], op[16];
+        unsigned long hist[LAT_BUCKETS] = {};
+        unsigned long total = 0;
+        int off;
+
+        if (sscanf(line, "%63s %15s%n", name, op, &off) != 2)
+            continue;
+
+        const char *p = line + off;
+        for (unsigned int i = 0; i < LAT_BUCKETS; i++)
+        {
+            int n;
+            if (sscanf(p, "%lu%n", &hist[i], &n) != 1)
+                break;
+            p += n;
+            total += hist[i];
+        }
+
+        /* Skip empty histograms, they're just noise */
+        if (!total)
+            continue;
+
+        printf("%s %s (%lu requests):\n", name, op, total);
+        for (unsigned int i = 0; i < LAT_BUCKETS; i++)
+        {
+            char label[32];
+            if (!hist[i])
+                continue;
+            /* Bar scaled to 50 columns */
+            int bar = (int) (hist[i] * 50 / total);
+            printf("  %10s %10lu |", bucket_label(i, label, sizeof(label)), hist[i]);
+            for (int j = 0; j < bar; j++)
+                putchar('#');
+            putchar('\n');
+        }
+    }
+
+    fclose(f);
+    return 0;
+}
+
+static int print_queues(void)
+{
+    FILE *f = fopen("/proc/blkqueues", "r");
+    if (!f)
+    {
+        perror("iostat: /proc/blkqueues");
+        return 1;
+    }
+
+    printf("%-6s %-10s %6s %8s %10s", "Queue", "Device", "Depth", "Inflight", "Busy(ms)");
+    for (int i = 0; i < NR_OPS; i++)
+        printf(" %10s %8s", op_names[i], "await");
+    printf("\n");
+
+    char line[512];
+    while (fgets(line, sizeof(line), f))
+    {
+        unsigned int id, depth;
+        char owner[64];
+        unsigned long in_flight, busy;
+        unsigned long ios[NR_OPS], sectors[NR_OPS], time_ms[NR_OPS];
+
+        if (sscanf(line, "%u %63s %u %lu %lu %lu %lu %lu %lu %lu %lu %lu %lu %lu", &id, owner,
+                   &depth, &in_flight, &busy, &ios[0], &sectors[0], &time_ms[0], &ios[1],
+                   &sectors[1], &time_ms[1], &ios[2], &sectors[2], &time_ms[2]) != 14)
+            continue;
+
+        printf("%-6u %-10s %6u %8lu %10lu", id, owner, depth, in_flight, busy);
+        for (int i = 0; i < NR_OPS; i++)
+            printf(" %10lu %8.2f", ios[i], ios[i] ? (double) time_ms[i] / ios[i] : 0);
+        printf("\n");
+    }
+
+    fclose(f);
+    return 0;
+}
+
+static void usage(void)
+{
+    printf("Usage: iostat [options] [interval [count]]\n"
+           "Report block device I/O statistics.\n"
+           "Options:\n"
+           "   -l    print latency histograms and exit\n"
+           "   -q    print per hardware queue statistics and exit\n"
+           "   -h    print help and exit\n");
+}
+
+static double now_secs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+    int opt;
+    int latency = 0, queues = 0;
+
+    while ((opt = getopt(argc, argv, "lqh")) != -1)
+    {
+        switch (opt)
+        {
+        case 'l':
+            latency = 1;
+            break;
+        case 'q':
+            queues = 1;
+            break;
+        case 'h':
+            usage();
+            return 0;
+        default:
+            usage();
+            return 1;
+        }
+    }
+
+    if (latency || queues)
+    {
+        int st = 0;
+        if (queues)
+            st |= print_queues();
+        if (latency)
+            st |= print_latency();
+        return st;
+    }
+
+    unsigned long interval = 0;
+    long count = 1;
+
+    if (optind < argc)
+    {
+        interval = strtoul(argv[optind++], NULL, 0);
+        count = -1;
+    }
+
+    if (optind < argc)
+        count = strtol(argv[optind++], NULL, 0);
+
+    static struct dev_stats bufs[2][MAX_DEVS];
+    int nr[2] = {};
+    int cur = 0;
+    double last = now_secs();
+
+    nr[cur] = read_diskstats(bufs[cur]);
+    if (nr[cur] < 0)
+        return 1;
+
+    /* The first report covers everything since boot. CLOCK_MONOTONIC starts at boot. */
+    report(bufs[cur], nr[cur], NULL, 0, last);
+
+    for (long i = 1; interval && (count < 0 || i < count); i++)
+    {
+        sleep(interval);
+        int prev = cur;
+        cur ^= 1;
+        nr[cur] = read_diskstats(bufs[cur]);
+        if (nr[cur] < 0)
+            return 1;
+
+        double t = now_secs();
+        report(bufs[cur], nr[cur], bufs[prev], nr[prev], t - last);
+        last = t;
+    }
+
+    return 0;
+}
@@ -0,0 +1,157 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/* Copyright (c) 2024 Pedro Falcato */
+#include <err.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/statfs.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/fs.h>
+#elif defined(__onyx__)
+#include <uapi/fs.h>
+#endif
+
+static void usage(void)
+{
+    printf("Usage: fragtest DIRECTORY [NR_FILES] [FILE_SIZE_KB] [CHUNK_KB] [MIN_AVG_EXTENT]\n"
+           "       fragtest writes NR_FILES files in DIRECTORY, interleaving CHUNK_KB writes\n"
+           "       between them, and reports how fragmented they ended up on disk.\n"
+           "       If MIN_AVG_EXTENT is given, fail if the average extent (in blocks) is smaller.\n"
+           "       Needs FIBMAP (and thus root).\n");
+}
+
+struct frag_file
+{
+    int fd;
+    char name[64];
+    unsigned long extents;
+    unsigned long blocks;
+};
+
+static void write_chunk(int fd, const char *buf, size_t len)
+{
+    ssize_t res = write(fd, buf, len);
+    if (res < 0)
+        err(1, "write");
+    if ((size_t) res != len)
+        errx(1, "write: short write (%zu bytes out of %zu)", (size_t) res, len);
+}
+
+static unsigned int map_block(int fd, unsigned int blk)
+{
+#ifdef FIBMAP
+    unsigned int fibmap_blk = blk;
+    if (ioctl(fd, FIBMAP, &fibmap_blk) < 0)
+        err(1, "FIBMAP");
+    return fibmap_blk;
+#else
+    errx(1, "FIBMAP is not supported");
+#endif
+}
+
+static void count_extents(struct frag_file *f, unsigned long nr_blocks)
+{
+    unsigned int last = 0;
+
+    for (unsigned long i = 0; i < nr_blocks; i++)
+    {
+        unsigned int blk = map_block(f->fd, i);
+        if (blk == 0)
+            errx(1, "%s: logical block %lu is not mapped after fsync", f->name, i);
+        if (i == 0 || blk != last + 1)
+            f->extents++;
+        last = blk;
+    }
+
+    f->blocks = nr_blocks;
+}
+
+int main(int argc, char **argv)
+{
+    unsigned long nr_files = 4, file_size_kb = 8192, chunk_kb = 64;
+    double min_avg_extent = 0;
+
+    if (argc < 2)
+    {
+        usage();
+        return 1;
+    }
+
+    if (argc > 2)
+        nr_files = strtoul(argv[2], NULL, 0);
+    if (argc > 3)
+        file_size_kb = strtoul(argv[3], NULL, 0);
+    if (argc > 4)
+        chunk_kb = strtoul(argv[4], NULL, 0);
+    if (argc > 5)
+        min_avg_extent = strtod(argv[5], NULL);
+
+    if (!nr_files || !chunk_kb || file_size_kb < chunk_kb)
+    {
+        usage();
+        return 1;
+    }
+
+    if (chdir(argv[1]) < 0)
+        err(1, "chdir %s", argv[1]);
+
+    struct frag_file *files = calloc(nr_files, sizeof(*files));
+    char *buf = malloc(chunk_kb * 1024);
+    if (!files || !buf)
+        err(1, "malloc");
+    memset(buf, 0xa5, chunk_kb * 1024);
+
+    for (unsigned long i = 0; i < nr_files; i++)
+    {
+        snprintf(files[i].name, sizeof(files[i].name), "fragtest-%lu", i);
+        files[i].fd = open(files[i].name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (files[i].fd < 0)
+            err(1, "open %s", files[i].name);
+    }
+
+    /* Interleave the writers, so the allocator has to keep the streams apart */
+    for (unsigned long off = 0; off < file_size_kb; off += chunk_kb)
+    {
+        for (unsigned long i = 0; i < nr_files; i++)
+            write_chunk(files[i].fd, buf, chunk_kb * 1024);
+    }
+
+    struct statfs stafs;
+    if (fstatfs(files[0].fd, &stafs) < 0)
+        err(1, "fstatfs");
+
+    unsigned long nr_blocks = (file_size_kb / chunk_kb) * chunk_kb * 1024 / stafs.f_bsize;
+    unsigned long total_extents = 0;
+
+    for (unsigned long i = 0; i < nr_files; i++)
+    {
+        if (fsync(files[i].fd) < 0)
+            err(1, "fsync %s", files[i].name);
+        count_extents(&files[i], nr_blocks);
+        total_extents += files[i].extents;
+        printf("%s: %lu blocks in %lu extents\n", files[i].name, files[i].blocks,
+               files[i].extents);
+    }
+
+    double avg = (double) (nr_blocks * nr_files) / total_extents;
+    printf("%lu files, block size %lu: average extent is %.2f blocks\n", nr_files,
+           (unsigned long) stafs.f_bsize, avg);
+
+    for (unsigned long i = 0; i < nr_files; i++)
+    {
+        close(files[i].fd);
+        unlink(files[i].name);
+    }
+
+    free(buf);
+    free(files);
+
+    if (avg < min_avg_extent)
+        errx(1, "average extent of %.2f blocks is below %.2f", avg, min_avg_extent);
+    return 0;
+}
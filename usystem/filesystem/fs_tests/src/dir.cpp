@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) 2024 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ */
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <string>
+
+#include <gtest/gtest.h>
+
+static std::string entry_name(unsigned int i)
+{
+    // Vary the length so entries straddle leaf blocks in interesting ways
+    std::string name = "dirent-test-";
+    name.append(std::to_string(i));
+    name.append(i % 37, 'x');
+    return name;
+}
+
+static unsigned int count_entries(const char *path)
+{
+    DIR *dir = opendir(path);
+    if (!dir)
+        return 0;
+
+    unsigned int n = 0;
+    while (struct dirent *d = readdir(dir))
+    {
+        if (!strcmp(d->d_name, ".") || !strcmp(d->d_name, ".."))
+            continue;
+        n++;
+    }
+
+    closedir(dir);
+    return n;
+}
+
+TEST(FsTest, LargeDirectory)
+{
+    // Enough entries to make the directory go indexed and grow more than one index level
+    // on small block sizes.
+    constexpr unsigned int nr_entries = 20000;
+    char dirname[] = "dir-testXXXXXX";
+    ASSERT_NE(mkdtemp(dirname), nullptr);
+    ASSERT_EQ(chdir(dirname), 0);
+
+    for (unsigned int i = 0; i < nr_entries; i++)
+    {
+        int fd = open(entry_name(i).c_str(), O_CREAT | O_EXCL | O_WRONLY, 0644);
+        ASSERT_GE(fd, 0) << "entry " << i;
+        close(fd);
+    }
+
+    struct stat buf;
+    for (unsigned int i = 0; i < nr_entries; i++)
+        ASSERT_EQ(stat(entry_name(i).c_str(), &buf), 0) << "entry " << i;
+
+    EXPECT_EQ(stat("dirent-test-notthere", &buf), -1);
+    EXPECT_EQ(errno, ENOENT);
+    EXPECT_EQ(count_entries("."), nr_entries);
+
+    // Remove every other entry and check the rest are still reachable
+    for (unsigned int i = 0; i < nr_entries; i += 2)
+        ASSERT_EQ(unlink(entry_name(i).c_str()), 0) << "entry " << i;
+
+    for (unsigned int i = 0; i < nr_entries; i++)
+        ASSERT_EQ(stat(entry_name(i).c_str(), &buf), (i & 1) ? 0 : -1) << "entry " << i;
+
+    EXPECT_EQ(count_entries("."), nr_entries / 2);
+
+    for (unsigned int i = 1; i < nr_entries; i += 2)
+        ASSERT_EQ(unlink(entry_name(i).c_str()), 0) << "entry " << i;
+
+    ASSERT_EQ(chdir(".."), 0);
+    ASSERT_EQ(rmdir(dirname), 0);
+}
@@ -16,6 +16,7 @@
 #include <pthread.h>
 #include <signal.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -27,6 +28,7 @@ static int direct_io;
 static int do_fsync;
 static int do_fsync_dir;
 static int sync_io;
+static int read_percent;
 
 static int prepare_file(const char *filename, size_t size)
 {
@@ -96,6 +98,91 @@ struct stress_options
     int fd;
 };
 
+/* Latencies go in a log-linear histogram: values under LAT_SUB get a bucket each, then every power
+ * of two is split into LAT_SUB buckets. That's a worst case error of 1/LAT_SUB (~6%) per sample,
+ * which is plenty for percentiles, and merging threads is just adding up buckets. */
+#define LAT_SUB_BITS 4
+#define LAT_SUB      (1U << LAT_SUB_BITS)
+#define LAT_BUCKETS  (64 * LAT_SUB)
+
+struct stress_stats
+{
+    unsigned long reads;
+    unsigned long writes;
+    uint64_t bytes;
+    uint64_t lat_min;
+    uint64_t lat_max;
+    uint64_t lat_total;
+    uint64_t lat_hist[LAT_BUCKETS];
+};
+
+static unsigned int lat_bucket(uint64_t ns)
+{
+    if (ns < LAT_SUB)
+        return ns;
+    unsigned int shift = 63 - __builtin_clzll(ns) - LAT_SUB_BITS;
+    return (shift + 1) * LAT_SUB + ((ns >> shift) & (LAT_SUB - 1));
+}
+
+/* Midpoint of the values that end up in a bucket */
+static uint64_t lat_bucket_value(unsigned int bucket)
+{
+    if (bucket < LAT_SUB)
+        return bucket;
+    unsigned int shift = bucket / LAT_SUB - 1;
+    return ((uint64_t) (LAT_SUB + bucket % LAT_SUB) << shift) + ((1UL << shift) >> 1);
+}
+
+static void stats_add_sample(struct stress_stats *stats, uint64_t ns)
+{
+    if (ns < stats->lat_min)
+        stats->lat_min = ns;
+    if (ns > stats->lat_max)
+        stats->lat_max = ns;
+    stats->lat_total += ns;
+    stats->lat_hist[lat_bucket(ns)]++;
+}
+
+static void stats_merge(struct stress_stats *to, const struct stress_stats *from)
+{
+    to->reads += from->reads;
+    to->writes += from->writes;
+    to->bytes += from->bytes;
+    if (from->lat_min < to->lat_min)
+        to->lat_min = from->lat_min;
+    if (from->lat_max > to->lat_max)
+        to->lat_max = from->lat_max;
+    to->lat_total += from->lat_total;
+    for (unsigned int i = 0; i < LAT_BUCKETS; i++)
+        to->lat_hist[i] += from->lat_hist[i];
+}
+
+static uint64_t stats_percentile(const struct stress_stats *stats, double pct)
+{
+    unsigned long nr = stats->reads + stats->writes;
+    unsigned long target = (unsigned long) (nr * pct / 100.0);
+    unsigned long seen = 0;
+
+    if (target >= nr)
+        return stats->lat_max;
+
+    for (unsigned int i = 0; i < LAT_BUCKETS; i++)
+    {
+        seen += stats->lat_hist[i];
+        if (seen > target)
+            return lat_bucket_value(i);
+    }
+
+    return stats->lat_max;
+}
+
+static uint64_t time_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
 static volatile sig_atomic_t test_done = 0;
 
 static void test_alrm(int sig)
@@ -104,7 +191,7 @@ static void test_alrm(int sig)
     test_done = 1;
 }
 
-static void stress(int fd, struct stress_options *opts)
+static void stress(int fd, struct stress_options *opts, struct stress_stats *stats)
 {
     void *block = aligned_alloc(opts->io_chunk_size, opts->io_chunk_size);
     if (!block)
@@ -117,43 +204,95 @@ static void stress(int fd, struct stress_options *opts)
     if (fstat(fd, &buf0) < 0)
         err(1, "fstat");
 
-    signal(SIGALRM, test_alrm);
-    alarm(opts->time_secs);
+    stats->lat_min = UINT64_MAX;
 
     while (!test_done)
     {
         ssize_t st;
+        bool is_read = read_percent && (rand() % 100) < read_percent;
+        uint64_t start = time_ns();
+
         if (opts->sequential)
-            st = write(fd, block, opts->io_chunk_size);
+        {
+            if (is_read)
+            {
+                st = read(fd, block, opts->io_chunk_size);
+                if (st == 0)
+                {
+                    /* Hit EOF, start over */
+                    if (lseek(fd, 0, SEEK_SET) < 0)
+                        err(1, "lseek");
+                    off = 0;
+                    continue;
+                }
+            }
+            else
+                st = write(fd, block, opts->io_chunk_size);
+        }
         else
         {
             /* Calculate the number of blocks */
             size_t nr_blocks = opts->file_size / opts->io_chunk_size;
             off = (rand() % nr_blocks) * opts->io_chunk_size;
-            st = pwrite(fd, block, opts->io_chunk_size, off);
+            if (is_read)
+                st = pread(fd, block, opts->io_chunk_size, off);
+            else
+                st = pwrite(fd, block, opts->io_chunk_size, off);
         }
 
+        uint64_t end = time_ns();
+
         if (st < 0)
-            err(1, "write");
+            err(1, is_read ? "read" : "write");
 
         if (st != opts->io_chunk_size)
         {
-            fprintf(stderr, "stress: partial write (supposedly, offset %ld size %d, written %zd)\n",
-                    off, opts->io_chunk_size, st);
+            fprintf(stderr, "stress: partial %s (supposedly, offset %ld size %d, done %zd)\n",
+                    is_read ? "read" : "write", off, opts->io_chunk_size, st);
             exit(1);
         }
 
+        if (is_read)
+            stats->reads++;
+        else
+            stats->writes++;
+        stats->bytes += st;
+        stats_add_sample(stats, end - start);
+
         off += opts->io_chunk_size;
     }
 }
 
+static void report(const struct stress_stats *stats, uint64_t elapsed_ns)
+{
+    unsigned long nr = stats->reads + stats->writes;
+    double secs = elapsed_ns / 1e9;
+
+    if (!nr)
+    {
+        printf("iostress: no I/O done\n");
+        return;
+    }
+
+    printf("iostress: %lu ops in %.2f s (%lu reads, %lu writes)\n", nr, secs, stats->reads,
+           stats->writes);
+    printf("  %.0f IOPS, %.2f MiB/s\n", nr / secs, stats->bytes / secs / (1024 * 1024));
+    printf("  latency (us): min %.2f avg %.2f max %.2f\n", stats->lat_min / 1000.0,
+           (double) stats->lat_total / nr / 1000.0, stats->lat_max / 1000.0);
+    printf("  percentiles (us): p50 %.2f p90 %.2f p99 %.2f p99.9 %.2f p99.99 %.2f\n",
+           stats_percentile(stats, 50) / 1000.0, stats_percentile(stats, 90) / 1000.0,
+           stats_percentile(stats, 99) / 1000.0, stats_percentile(stats, 99.9) / 1000.0,
+           stats_percentile(stats, 99.99) / 1000.0);
+}
+
 static int sequential = 0;
 
 enum options
 {
     OPT_FILESIZE = 1,
     OPT_TIME,
-    OPT_IO_BLOCK_SIZE
+    OPT_IO_BLOCK_SIZE,
+    OPT_READ_PERCENT
 };
 
 const static struct option options[] = {
@@ -168,6 +307,8 @@ const static struct option options[] = {
     {"fsync", no_argument, &do_fsync, 1},
     {"fsync-dir", no_argument, &do_fsync_dir, 1},
     {"sync", no_argument, &sync_io, 1},
+    {"read", no_argument, &read_percent, 100},
+    {"read-percent", required_argument, NULL, OPT_READ_PERCENT},
     {}};
 
 static int threads = 1;
@@ -175,10 +316,17 @@ static unsigned long file_size = 0x400000;
 static int timeout = 10;
 static int io_block_size = 4096;
 
+struct stress_thread
+{
+    pthread_t id;
+    struct stress_options *opts;
+    struct stress_stats stats;
+};
+
 static void *stress_thread_start(void *arg)
 {
-    struct stress_options *opts = arg;
-    stress(opts->fd, opts);
+    struct stress_thread *t = arg;
+    stress(t->opts->fd, t->opts, &t->stats);
     return NULL;
 }
 
@@ -196,10 +344,13 @@ void usage(void)
            "    --file-size SIZE        Size of the file to create, in bytes (default = 4 MiB)\n"
            "    --time TIME             Time to run the test for (default = 10 seconds)\n"
            "    --io-block-size BLKSIZE Set the block size for I/O operations\n"
+           "    --read                  Only read, don't write\n"
+           "    --read-percent PERCENT  Percentage of I/O operations that are reads (default = 0)\n"
            "    --direct                Use O_DIRECT to do direct I/O and bypass the page cache\n"
            "    --sync                  Use O_SYNC to wait for IO to complete\n"
            "    --fsync                 Do fsync() after writing the file\n"
            "    --fsync-dir             Do fsync() on the directory after creating the file\n\n"
+           "When done, IOPS, bandwidth and latency percentiles (for all threads) are printed.\n"
            "If anything went wrong, exits with exit status 1.\n"
            "If everything looks to completed successfully, exits with 0.\n");
 }
@@ -268,6 +419,16 @@ int main(int argc, char **argv)
                     return 1;
                 }
 
+                break;
+            case OPT_READ_PERCENT:
+                errno = 0;
+                read_percent = strtoul(optarg, NULL, 0);
+                if (errno == ERANGE || read_percent < 0 || read_percent > 100)
+                {
+                    printf("iostress: Read percentage out of range [0, 100]\n");
+                    return 1;
+                }
+
                 break;
         }
     }
@@ -305,11 +466,19 @@ int main(int argc, char **argv)
     opts.time_secs = timeout;
     opts.fd = fd;
 
-    pthread_t ids[threads - 1];
+    /* The histograms are big-ish, don't put them on the stack */
+    struct stress_thread *thr = calloc(threads, sizeof(*thr));
+    if (!thr)
+        err(1, "calloc");
+
+    signal(SIGALRM, test_alrm);
+    alarm(timeout);
+    uint64_t start = time_ns();
 
     for (int i = 1; i < threads; i++)
     {
-        int st = pthread_create(&ids[i - 1], NULL, stress_thread_start, &opts);
+        thr[i].opts = &opts;
+        int st = pthread_create(&thr[i].id, NULL, stress_thread_start, &thr[i]);
         if (st)
         {
             errno = st;
@@ -317,13 +486,17 @@ int main(int argc, char **argv)
         }
     }
 
-    stress(fd, &opts);
+    stress(fd, &opts, &thr[0].stats);
 
-    for (int i = 0; i < threads - 1; i++)
+    for (int i = 1; i < threads; i++)
     {
-        pthread_join(ids[i], NULL);
+        pthread_join(thr[i].id, NULL);
+        stats_merge(&thr[0].stats, &thr[i].stats);
     }
 
+    report(&thr[0].stats, time_ns() - start);
+    free(thr);
+
     if (do_fsync)
     {
         if (fsync(fd) < 0)
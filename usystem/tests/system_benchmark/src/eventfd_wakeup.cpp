@@ -0,0 +1,165 @@
+/*
+ * Copyright (c) 2025 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <poll.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+#include <benchmark/benchmark.h>
+
+/* Wakeup latency of an event loop: a thread sleeps on a wakeup fd (in read(), or in poll() like an
+ * event loop would), another one wakes it up and waits to be woken up back. The time per iteration
+ * is a round trip, i.e two wakeups. The wakeup fd is either a self-pipe (write a byte, read it) or an
+ * eventfd. timerfd_bench measures how late a timerfd wakes us up after a short timeout. */
+
+struct wakeup_fd
+{
+    int rfd;
+    int wfd;
+    bool is_eventfd;
+};
+
+static wakeup_fd wakeup_fd_create(bool eventfd_)
+{
+    wakeup_fd w;
+    w.is_eventfd = eventfd_;
+
+    if (eventfd_)
+    {
+        w.rfd = w.wfd = eventfd(0, 0);
+        if (w.rfd < 0)
+            throw std::runtime_error("eventfd failed");
+        return w;
+    }
+
+    int fds[2];
+    if (pipe(fds) < 0)
+        throw std::runtime_error("pipe failed");
+    w.rfd = fds[0];
+    w.wfd = fds[1];
+    return w;
+}
+
+static void wakeup_fd_close(wakeup_fd& w)
+{
+    close(w.rfd);
+    if (!w.is_eventfd)
+        close(w.wfd);
+}
+
+static bool wakeup_signal(wakeup_fd& w)
+{
+    if (w.is_eventfd)
+    {
+        uint64_t val = 1;
+        return write(w.wfd, &val, sizeof(val)) == sizeof(val);
+    }
+
+    char c = 0;
+    return write(w.wfd, &c, 1) == 1;
+}
+
+static bool wakeup_wait(wakeup_fd& w, bool use_poll)
+{
+    if (use_poll)
+    {
+        struct pollfd pfd = {w.rfd, POLLIN, 0};
+        if (poll(&pfd, 1, -1) != 1)
+            return false;
+    }
+
+    if (w.is_eventfd)
+    {
+        uint64_t val;
+        return read(w.rfd, &val, sizeof(val)) == sizeof(val);
+    }
+
+    char c;
+    return read(w.rfd, &c, 1) == 1;
+}
+
+static void wakeup_echo(wakeup_fd& ping, wakeup_fd& pong, bool use_poll, std::atomic<bool>& stop)
+{
+    while (wakeup_wait(ping, use_poll) && !stop.load(std::memory_order_relaxed))
+    {
+        if (!wakeup_signal(pong))
+            break;
+    }
+}
+
+static void wakeup_bench(benchmark::State& state)
+{
+    const bool use_eventfd = state.range(0);
+    const bool use_poll = state.range(1);
+    wakeup_fd ping = wakeup_fd_create(use_eventfd);
+    wakeup_fd pong = wakeup_fd_create(use_eventfd);
+    std::atomic<bool> stop{false};
+
+    state.SetLabel(std::string(use_eventfd ? "eventfd" : "pipe") + (use_poll ? "/poll" : "/read"));
+    std::thread echo{wakeup_echo, std::ref(ping), std::ref(pong), use_poll, std::ref(stop)};
+
+    for (auto _ : state)
+    {
+        if (!wakeup_signal(ping) || !wakeup_wait(pong, use_poll))
+            throw std::runtime_error("wakeup failed");
+    }
+
+    /* One last wakeup, for the echo thread to see stop */
+    stop.store(true);
+    wakeup_signal(ping);
+    echo.join();
+    wakeup_fd_close(ping);
+    wakeup_fd_close(pong);
+}
+
+BENCHMARK(wakeup_bench)->ArgsProduct({{0, 1}, {0, 1}})->UseRealTime();
+
+static uint64_t timespec_ns(const struct timespec& ts)
+{
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void timerfd_bench(benchmark::State& state)
+{
+    const long timeout_us = state.range(0);
+    struct itimerspec its = {};
+    uint64_t late = 0;
+    uint64_t ticks;
+
+    int fd = timerfd_create(CLOCK_MONOTONIC, 0);
+    if (fd < 0)
+    {
+        state.SkipWithError("timerfd_create failed");
+        return;
+    }
+
+    its.it_value.tv_nsec = timeout_us * 1000;
+
+    for (auto _ : state)
+    {
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (timerfd_settime(fd, 0, &its, nullptr) < 0 || read(fd, &ticks, sizeof(ticks)) < 0)
+            throw std::runtime_error("timerfd failed");
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        late += timespec_ns(end) - timespec_ns(start) - timeout_us * 1000;
+    }
+
+    close(fd);
+    state.counters["late_ns"] = benchmark::Counter(late, benchmark::Counter::kAvgIterations);
+}
+
+BENCHMARK(timerfd_bench)->Arg(50)->Arg(500)->UseRealTime();
@@ -6,6 +6,10 @@
  * SPDX-License-Identifier: MIT
  */
 
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
@@ -55,3 +59,71 @@ static void vfork_bench(benchmark::State& state)
 }
 
 BENCHMARK(vfork_bench)->ThreadRange(1, 16);
+
+static void fork_and_wait()
+{
+    pid_t pid = fork();
+    if (pid < 0)
+        throw std::runtime_error("Failed to fork");
+    else if (pid == 0)
+        _exit(0);
+
+    if (waitpid(pid, nullptr, 0) < 0)
+        throw std::runtime_error("Failed to wait");
+}
+
+/* fork() with a big resident heap: every pte gets copied and write-protected */
+static void fork_large_rss_bench(benchmark::State& state)
+{
+    size_t size = state.range(0) << 20;
+    void* ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (ptr == MAP_FAILED)
+        throw std::runtime_error("Failed to mmap");
+    memset(ptr, 0xaa, size);
+
+    for (auto _ : state)
+        fork_and_wait();
+
+    munmap(ptr, size);
+    state.counters["rss_mb"] = state.range(0);
+}
+
+BENCHMARK(fork_large_rss_bench)
+    ->RangeMultiplier(4)
+    ->Range(16, 1024)
+    ->Unit(benchmark::kMicrosecond);
+
+/* Same, but with a private file mapping that's fully faulted in. The child refaults it from the
+ * page cache, so this should cost about the same as an empty fork. */
+static void fork_large_file_rss_bench(benchmark::State& state)
+{
+    size_t size = state.range(0) << 20;
+    char path[] = "/tmp/fork_bench.XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0)
+        throw std::runtime_error("Failed to create a temporary file");
+    unlink(path);
+
+    if (ftruncate(fd, size) < 0)
+        throw std::runtime_error("Failed to ftruncate");
+
+    void* ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (ptr == MAP_FAILED)
+        throw std::runtime_error("Failed to mmap");
+
+    volatile char* p = (volatile char*) ptr;
+    for (size_t i = 0; i < size; i += 4096)
+        benchmark::DoNotOptimize(p[i]);
+
+    for (auto _ : state)
+        fork_and_wait();
+
+    munmap(ptr, size);
+    close(fd);
+    state.counters["rss_mb"] = state.range(0);
+}
+
+BENCHMARK(fork_large_file_rss_bench)
+    ->RangeMultiplier(4)
+    ->Range(16, 1024)
+    ->Unit(benchmark::kMicrosecond);
@@ -0,0 +1,202 @@
+/*
+ * Copyright (c) 2025 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include <uapi/ktrace.h>
+
+/* Overhead of ktrace on a tracepoint-heavy workload: open + close of a file (every path walk step
+ * hits dentry.dget/dput). With Arg(1), those events get enabled and a thread drains the per-cpu
+ * rings through their mmaps, like trace(1) does. Tracing can't be turned off again, so the traced
+ * run must come last. Needs root. */
+
+struct ktrace_record_header
+{
+    uint32_t evtype;
+    uint16_t size;
+    uint32_t cpu;
+    uint64_t ts;
+} __attribute__((packed));
+
+struct ktrace_ring
+{
+    ktrace_ring_header* hdr;
+    uint8_t* data;
+    size_t size;
+};
+
+#define KTRACE_BENCH_BUFSIZE (1 << 20)
+
+static void ktrace_enable_event(int fd, const char* name)
+{
+    struct ktrace_getevid_format evid = {};
+    strcpy(evid.name, name);
+    if (ioctl(fd, KTRACEGETEVID, &evid) < 0)
+        throw std::runtime_error("KTRACEGETEVID failed");
+
+    struct ktrace_enable en = {};
+    en.status = KTRACE_ENABLE_STATUS_ENABLED;
+    en.flags = TRACE_EVENT_TIME;
+    en.buffer_size = KTRACE_BENCH_BUFSIZE;
+    en.evid = evid.evid;
+    if (ioctl(fd, KTRACEENABLE, &en) < 0)
+        throw std::runtime_error("KTRACEENABLE failed");
+}
+
+static std::vector<ktrace_ring> ktrace_map_rings(int fd)
+{
+    std::vector<ktrace_ring> rings;
+    uint32_t cpu = 0;
+    int buffd;
+
+    while ((buffd = ioctl(fd, KTRACEGETBUFFD, &cpu)) >= 0)
+    {
+        ktrace_ring ring;
+        size_t page_size = sysconf(_SC_PAGESIZE);
+
+        /* The buffers might have been set up (with a different size) by someone else, so look at
+         * the header first */
+        auto hdr = (ktrace_ring_header*) mmap(nullptr, page_size, PROT_READ, MAP_SHARED, buffd, 0);
+        if (hdr == MAP_FAILED)
+            throw std::runtime_error("mmap of the ktrace ring failed");
+        ring.size = hdr->data_offset + hdr->data_size;
+        munmap(hdr, page_size);
+
+        void* ptr = mmap(nullptr, ring.size, PROT_READ | PROT_WRITE, MAP_SHARED, buffd, 0);
+        close(buffd);
+        if (ptr == MAP_FAILED)
+            throw std::runtime_error("mmap of the ktrace ring failed");
+
+        ring.hdr = (ktrace_ring_header*) ptr;
+        ring.data = (uint8_t*) ptr + ring.hdr->data_offset;
+        rings.push_back(ring);
+        cpu++;
+    }
+
+    return rings;
+}
+
+static void ktrace_ring_copy(const ktrace_ring& ring, uint64_t pos, void* buf, size_t len)
+{
+    size_t index = pos & (ring.hdr->data_size - 1);
+    size_t first = std::min(len, (size_t) ring.hdr->data_size - index);
+    memcpy(buf, ring.data + index, first);
+    memcpy((uint8_t*) buf + first, ring.data, len - first);
+}
+
+static void ktrace_consumer(std::vector<ktrace_ring>& rings, std::atomic<bool>& stop,
+                            std::atomic<unsigned long>& records)
+{
+    static uint8_t buf[UINT16_MAX];
+    unsigned long got = 0;
+
+    while (!stop.load(std::memory_order_relaxed))
+    {
+        for (auto& ring : rings)
+        {
+            uint64_t tail = __atomic_load_n(&ring.hdr->tail, __ATOMIC_ACQUIRE);
+            uint64_t head = __atomic_load_n(&ring.hdr->head, __ATOMIC_ACQUIRE);
+
+            while (tail != head)
+            {
+                ktrace_record_header h;
+                ktrace_ring_copy(ring, tail, &h, sizeof(h));
+                if (h.size >= sizeof(h) && h.size <= head - tail)
+                {
+                    ktrace_ring_copy(ring, tail, buf, h.size);
+                    if (__atomic_compare_exchange_n(&ring.hdr->tail, &tail, tail + h.size, false,
+                                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+                    {
+                        tail += h.size;
+                        got++;
+                    }
+                }
+                else
+                    tail = __atomic_load_n(&ring.hdr->tail, __ATOMIC_ACQUIRE);
+                head = __atomic_load_n(&ring.hdr->head, __ATOMIC_ACQUIRE);
+            }
+        }
+
+        std::this_thread::yield();
+    }
+
+    records.store(got);
+}
+
+static void ktrace_overhead_bench(benchmark::State& state)
+{
+    const bool traced = state.range(0);
+    std::vector<ktrace_ring> rings;
+    std::atomic<unsigned long> records{0};
+    std::atomic<bool> stop{false};
+    std::thread consumer;
+    uint64_t lost = 0;
+
+    if (traced)
+    {
+        int fd = open("/dev/ktrace", O_RDWR | O_CLOEXEC);
+        if (fd < 0)
+        {
+            state.SkipWithError("/dev/ktrace not available");
+            return;
+        }
+
+        if (geteuid() != 0)
+        {
+            close(fd);
+            state.SkipWithError("ktrace needs root");
+            return;
+        }
+
+        ktrace_enable_event(fd, "dentry.dget");
+        ktrace_enable_event(fd, "dentry.dput");
+        rings = ktrace_map_rings(fd);
+        close(fd);
+
+        for (auto& ring : rings)
+            lost -= __atomic_load_n(&ring.hdr->lost, __ATOMIC_RELAXED);
+        consumer = std::thread{ktrace_consumer, std::ref(rings), std::ref(stop), std::ref(records)};
+    }
+
+    for (auto _ : state)
+    {
+        int fd = open("/etc/passwd", O_RDONLY);
+        if (fd < 0)
+            throw std::runtime_error("open failed");
+        close(fd);
+    }
+
+    if (traced)
+    {
+        stop.store(true);
+        consumer.join();
+
+        for (auto& ring : rings)
+        {
+            lost += __atomic_load_n(&ring.hdr->lost, __ATOMIC_RELAXED);
+            munmap(ring.hdr, ring.size);
+        }
+
+        state.counters["records"] = benchmark::Counter(records.load(), benchmark::Counter::kIsRate);
+        state.counters["lost"] = lost;
+    }
+}
+
+BENCHMARK(ktrace_overhead_bench)->Arg(0)->Arg(1)->UseRealTime();
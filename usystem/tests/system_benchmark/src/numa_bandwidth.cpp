@@ -0,0 +1,149 @@
+/*
+ * Copyright (c) 2025 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <sched.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include <uapi/mempolicy.h>
+
+/* Memory bandwidth between every pair of NUMA nodes: pin ourselves to a CPU on one node, bind a
+ * buffer to another (first-touch under MPOL_BIND) and stream through it. Try it with something
+ * like qemu -numa node,cpus=0-1,memdev=m0 -numa node,cpus=2-3,memdev=m1 -numa dist,... */
+
+#define NUMA_BENCH_BUFSIZE (64UL << 20)
+
+/* First CPU of every node */
+static std::vector<int> numa_node_cpus;
+
+static int numa_pin(int cpu)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return sched_setaffinity(0, sizeof(set), &set);
+}
+
+static void numa_discover()
+{
+    long nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    cpu_set_t old;
+
+    if (sched_getaffinity(0, sizeof(old), &old) < 0)
+        return;
+
+    for (int cpu = 0; cpu < nr_cpus && cpu < CPU_SETSIZE; cpu++)
+    {
+        unsigned int node;
+        if (numa_pin(cpu) < 0 || syscall(SYS_getcpu, nullptr, &node, nullptr) < 0)
+            continue;
+        if (node >= numa_node_cpus.size())
+            numa_node_cpus.resize(node + 1, -1);
+        if (numa_node_cpus[node] < 0)
+            numa_node_cpus[node] = cpu;
+    }
+
+    sched_setaffinity(0, sizeof(old), &old);
+}
+
+static void numa_bandwidth_args(benchmark::internal::Benchmark* b)
+{
+    numa_discover();
+    /* If getcpu doesn't work, still measure node 0 against itself */
+    if (numa_node_cpus.empty())
+        numa_node_cpus.push_back(0);
+
+    for (int write = 0; write < 2; write++)
+    {
+        for (size_t cpu_node = 0; cpu_node < numa_node_cpus.size(); cpu_node++)
+        {
+            for (size_t mem_node = 0; mem_node < numa_node_cpus.size(); mem_node++)
+                b->Args({(long) cpu_node, (long) mem_node, write});
+        }
+    }
+
+    b->ArgNames({"cpu_node", "mem_node", "write"});
+}
+
+static void* numa_alloc_on(int node)
+{
+    unsigned long mask = 1UL << node;
+    int mapped_node = -1;
+    void* buf;
+
+    buf = mmap(nullptr, NUMA_BENCH_BUFSIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+               -1, 0);
+    if (buf == MAP_FAILED)
+        return nullptr;
+
+    if (syscall(SYS_mbind, buf, NUMA_BENCH_BUFSIZE, MPOL_BIND, &mask, sizeof(mask) * 8, 0) < 0)
+        goto err;
+
+    /* First touch, which places the pages */
+    memset(buf, 0xaa, NUMA_BENCH_BUFSIZE);
+
+    if (syscall(SYS_get_mempolicy, &mapped_node, nullptr, 0, buf, MPOL_F_NODE | MPOL_F_ADDR) < 0 ||
+        mapped_node != node)
+        goto err;
+    return buf;
+err:
+    munmap(buf, NUMA_BENCH_BUFSIZE);
+    return nullptr;
+}
+
+static void numa_bandwidth_bench(benchmark::State& state)
+{
+    const int cpu_node = state.range(0);
+    const int mem_node = state.range(1);
+    const bool write = state.range(2);
+    cpu_set_t old;
+
+    if (sched_getaffinity(0, sizeof(old), &old) < 0 || numa_node_cpus[cpu_node] < 0 ||
+        numa_pin(numa_node_cpus[cpu_node]) < 0)
+    {
+        state.SkipWithError("could not pin to the node");
+        return;
+    }
+
+    auto buf = (uint64_t*) numa_alloc_on(mem_node);
+    if (!buf)
+    {
+        sched_setaffinity(0, sizeof(old), &old);
+        state.SkipWithError("could not bind memory to the node");
+        return;
+    }
+
+    for (auto _ : state)
+    {
+        if (write)
+        {
+            memset(buf, state.iterations() & 0xff, NUMA_BENCH_BUFSIZE);
+            benchmark::ClobberMemory();
+        }
+        else
+        {
+            uint64_t sum = 0;
+            for (size_t i = 0; i < NUMA_BENCH_BUFSIZE / sizeof(uint64_t); i += 4)
+                sum += buf[i] + buf[i + 1] + buf[i + 2] + buf[i + 3];
+            benchmark::DoNotOptimize(sum);
+        }
+    }
+
+    state.SetBytesProcessed(state.iterations() * NUMA_BENCH_BUFSIZE);
+    munmap(buf, NUMA_BENCH_BUFSIZE);
+    sched_setaffinity(0, sizeof(old), &old);
+}
+
+BENCHMARK(numa_bandwidth_bench)->Apply(numa_bandwidth_args)->UseRealTime();
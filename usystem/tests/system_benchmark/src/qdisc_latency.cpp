@@ -0,0 +1,186 @@
+/*
+ * Copyright (c) 2025 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+/* Latency of a ping-pong flow (1 byte each way, TCP_NODELAY) over loopback while other flows
+ * push bulk data as fast as they can, under each of the loopback device's qdiscs. The time per
+ * iteration is the ping-pong round trip. Arguments are (qdisc, bulk flows, pacing rate of the
+ * bulk flows in MB/s, 0 for unpaced); pacing only makes a difference under fq. Gets skipped if the
+ * kernel can't set qdiscs. */
+
+#define QDISC_LOOPBACK_DEV "/dev/lo"
+#define QDISC_BULK_CHUNK   (64 * 1024)
+
+#ifdef SIOSETQDISC
+static const char* const qdisc_names[] = {"noqueue", "pfifo_fast", "fq_codel", "fq"};
+
+static int qdisc_set(const char* name)
+{
+    struct if_qdisc qd = {};
+    strncpy(qd.name, name, sizeof(qd.name) - 1);
+    int fd = open(QDISC_LOOPBACK_DEV, O_RDWR);
+    if (fd < 0)
+        return -1;
+    int st = ioctl(fd, SIOSETQDISC, &qd);
+    close(fd);
+    return st;
+}
+
+static int qdisc_listener(sockaddr_in* addr)
+{
+    socklen_t len = sizeof(*addr);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+        throw std::runtime_error("Failed to create socket");
+
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(fd, (sockaddr*) addr, sizeof(*addr)) < 0)
+        throw std::runtime_error("Failed to bind");
+    if (listen(fd, 16) < 0)
+        throw std::runtime_error("Failed to listen");
+    if (getsockname(fd, (sockaddr*) addr, &len) < 0)
+        throw std::runtime_error("Failed to getsockname");
+    return fd;
+}
+
+/* Connect to lfd's address, returns the connected fd and the accepted one in *afd */
+static int qdisc_connect(int lfd, const sockaddr_in& addr, int* afd)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+        throw std::runtime_error("Failed to create socket");
+    if (connect(fd, (const sockaddr*) &addr, sizeof(addr)) < 0)
+        throw std::runtime_error("Failed to connect");
+    *afd = accept(lfd, nullptr, nullptr);
+    if (*afd < 0)
+        throw std::runtime_error("Failed to accept");
+    return fd;
+}
+
+static void bulk_sink(int fd)
+{
+    static char buf[QDISC_BULK_CHUNK];
+    while (read(fd, buf, sizeof(buf)) > 0)
+        ;
+    close(fd);
+}
+
+static void bulk_source(int fd, std::atomic<bool>& stop, std::atomic<unsigned long>& bytes)
+{
+    static char buf[QDISC_BULK_CHUNK];
+    while (!stop.load(std::memory_order_relaxed))
+    {
+        ssize_t st = write(fd, buf, sizeof(buf));
+        if (st <= 0)
+            break;
+        bytes.fetch_add(st, std::memory_order_relaxed);
+    }
+
+    close(fd);
+}
+
+static void pingpong_echo(int fd)
+{
+    char c;
+    while (read(fd, &c, 1) == 1)
+    {
+        if (write(fd, &c, 1) != 1)
+            break;
+    }
+
+    close(fd);
+}
+
+static void qdisc_latency_run(benchmark::State& state)
+{
+    std::atomic<unsigned long> bytes{0};
+    std::atomic<bool> stop{false};
+    std::vector<std::thread> threads;
+    unsigned long pacing_rate = state.range(2) * 1000000UL;
+    int one = 1;
+    sockaddr_in addr;
+    int lfd = qdisc_listener(&addr);
+    int afd;
+
+    for (int64_t i = 0; i < state.range(1); i++)
+    {
+        int fd = qdisc_connect(lfd, addr, &afd);
+        if (pacing_rate)
+            setsockopt(fd, SOL_SOCKET, SO_MAX_PACING_RATE, &pacing_rate, sizeof(pacing_rate));
+        threads.emplace_back(bulk_sink, afd);
+        threads.emplace_back(bulk_source, fd, std::ref(stop), std::ref(bytes));
+    }
+
+    int pfd = qdisc_connect(lfd, addr, &afd);
+    close(lfd);
+    setsockopt(pfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    setsockopt(afd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    threads.emplace_back(pingpong_echo, afd);
+
+    for (auto _ : state)
+    {
+        char c = 0;
+        if (write(pfd, &c, 1) != 1 || read(pfd, &c, 1) != 1)
+            throw std::runtime_error("ping-pong failed");
+    }
+
+    stop.store(true);
+    close(pfd);
+    for (auto& t : threads)
+        t.join();
+
+    state.counters["bulk"] = benchmark::Counter(bytes.load(), benchmark::Counter::kIsRate);
+}
+
+static void qdisc_latency_bench(benchmark::State& state)
+{
+    const char* name = qdisc_names[state.range(0)];
+    if (qdisc_set(name) < 0)
+    {
+        state.SkipWithError("can't set the qdisc on " QDISC_LOOPBACK_DEV);
+        return;
+    }
+
+    state.SetLabel(name);
+
+    try
+    {
+        qdisc_latency_run(state);
+    }
+    catch (...)
+    {
+        qdisc_set("noqueue");
+        throw;
+    }
+
+    qdisc_set("noqueue");
+}
+
+BENCHMARK(qdisc_latency_bench)
+    ->ArgsProduct({{0, 1, 2, 3}, {0, 1, 4}, {0}})
+    ->Args({3, 4, 100})
+    ->Args({3, 4, 1000})
+    ->UseRealTime();
+#endif
@@ -0,0 +1,142 @@
+/*
+ * Copyright (c) 2025 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <stdexcept>
+
+#include <benchmark/benchmark.h>
+#include <uapi/spawn.h>
+
+/* Process creation, for things that launch lots of short-lived processes. Reported as spawns/s,
+ * each iteration being a full spawn + exec + exit + wait of a trivial program. */
+
+#define SPAWN_BENCH_PROG "/bin/true"
+
+extern char** environ;
+
+static void wait_for(pid_t pid)
+{
+    if (waitpid(pid, nullptr, 0) < 0)
+        throw std::runtime_error("Failed to wait");
+}
+
+static void spawn_set_rate(benchmark::State& state)
+{
+    state.counters["spawns"] = benchmark::Counter(state.iterations(), benchmark::Counter::kIsRate);
+}
+
+static void fork_exec_bench(benchmark::State& state)
+{
+    char* const argv[] = {(char*) SPAWN_BENCH_PROG, nullptr};
+
+    for (auto _ : state)
+    {
+        pid_t pid = fork();
+        if (pid < 0)
+            throw std::runtime_error("Failed to fork");
+        else if (pid == 0)
+        {
+            execve(SPAWN_BENCH_PROG, argv, environ);
+            _exit(127);
+        }
+
+        wait_for(pid);
+    }
+
+    spawn_set_rate(state);
+}
+
+BENCHMARK(fork_exec_bench);
+
+static void vfork_exec_bench(benchmark::State& state)
+{
+    char* const argv[] = {(char*) SPAWN_BENCH_PROG, nullptr};
+
+    for (auto _ : state)
+    {
+        pid_t pid = vfork();
+        if (pid < 0)
+            throw std::runtime_error("Failed to vfork");
+        else if (pid == 0)
+        {
+            execve(SPAWN_BENCH_PROG, argv, environ);
+            _exit(127);
+        }
+
+        wait_for(pid);
+    }
+
+    spawn_set_rate(state);
+}
+
+BENCHMARK(vfork_exec_bench);
+
+/* posix_spawn with a couple of file actions, like a job launcher redirecting stdio */
+static void posix_spawn_bench(benchmark::State& state)
+{
+    char* const argv[] = {(char*) SPAWN_BENCH_PROG, nullptr};
+    posix_spawn_file_actions_t fa;
+
+    posix_spawn_file_actions_init(&fa);
+    posix_spawn_file_actions_addopen(&fa, 0, "/dev/null", O_RDONLY, 0);
+    posix_spawn_file_actions_addopen(&fa, 1, "/dev/null", O_WRONLY, 0);
+
+    for (auto _ : state)
+    {
+        pid_t pid;
+        if (posix_spawn(&pid, SPAWN_BENCH_PROG, &fa, nullptr, argv, environ) != 0)
+            throw std::runtime_error("Failed to posix_spawn");
+        wait_for(pid);
+    }
+
+    posix_spawn_file_actions_destroy(&fa);
+    spawn_set_rate(state);
+}
+
+BENCHMARK(posix_spawn_bench);
+
+#ifdef SYS_spawn
+/* The spawn(2) syscall directly, same file actions as above */
+static void spawn_syscall_bench(benchmark::State& state)
+{
+    char* const argv[] = {(char*) SPAWN_BENCH_PROG, nullptr};
+    struct spawn_file_action fa[2] = {};
+
+    fa[0].type = fa[1].type = SPAWN_FA_OPEN;
+    fa[0].fd = 0;
+    fa[0].oflag = O_RDONLY;
+    fa[0].path = "/dev/null";
+    fa[1].fd = 1;
+    fa[1].oflag = O_WRONLY;
+    fa[1].path = "/dev/null";
+
+    struct spawn_args args = {};
+    args.path = SPAWN_BENCH_PROG;
+    args.argv = argv;
+    args.envp = environ;
+    args.actions = fa;
+    args.nr_actions = 2;
+
+    for (auto _ : state)
+    {
+        pid_t pid = syscall(SYS_spawn, &args);
+        if (pid < 0)
+            throw std::runtime_error("Failed to spawn");
+        wait_for(pid);
+    }
+
+    spawn_set_rate(state);
+}
+
+BENCHMARK(spawn_syscall_bench);
+#endif
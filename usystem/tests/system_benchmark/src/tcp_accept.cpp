@@ -0,0 +1,282 @@
+/*
+ * Copyright (c) 2025 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <random>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+/* Connection setup rate over loopback, reported as accepts/s. Each iteration is a full
+ * connect + accept + close. The flood variant runs the same loop while another thread sprays the
+ * listener with SYNs from made up addresses that never complete the handshake, which fills the
+ * SYN queue and (if the kernel has them) pushes the listener into SYN cookies. Flooding needs raw
+ * sockets; the benchmark gets skipped if we can't open one. */
+
+#define TCP_ACCEPT_BACKLOG 128
+
+/* Binds to addr->sin_port, or to any port if 0 (then written back to addr) */
+static int make_listener(sockaddr_in* addr, bool reuseport = false)
+{
+    socklen_t len = sizeof(*addr);
+    in_port_t port = addr->sin_port;
+    int one = 1;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+        throw std::runtime_error("Failed to create socket");
+
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (reuseport && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0)
+        throw std::runtime_error("Failed to set SO_REUSEPORT");
+
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr->sin_port = port;
+    if (bind(fd, (sockaddr*) addr, sizeof(*addr)) < 0)
+        throw std::runtime_error("Failed to bind");
+    if (listen(fd, TCP_ACCEPT_BACKLOG) < 0)
+        throw std::runtime_error("Failed to listen");
+    if (getsockname(fd, (sockaddr*) addr, &len) < 0)
+        throw std::runtime_error("Failed to getsockname");
+    return fd;
+}
+
+static void connect_accept_one(int lfd, const sockaddr_in& addr)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+        throw std::runtime_error("Failed to create socket");
+    if (connect(fd, (const sockaddr*) &addr, sizeof(addr)) < 0)
+        throw std::runtime_error("Failed to connect");
+
+    int afd = accept(lfd, nullptr, nullptr);
+    if (afd < 0)
+        throw std::runtime_error("Failed to accept");
+
+    close(afd);
+    close(fd);
+}
+
+static void tcp_accept_set_rate(benchmark::State& state)
+{
+    state.counters["accepts"] = benchmark::Counter(state.iterations(), benchmark::Counter::kIsRate);
+}
+
+static void tcp_accept_bench(benchmark::State& state)
+{
+    sockaddr_in addr = {};
+    int lfd = make_listener(&addr);
+
+    for (auto _ : state)
+        connect_accept_one(lfd, addr);
+
+    close(lfd);
+    tcp_accept_set_rate(state);
+}
+
+BENCHMARK(tcp_accept_bench);
+
+static uint16_t csum_fold(uint32_t sum)
+{
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+    return ~sum;
+}
+
+static uint32_t csum_add(uint32_t sum, const void* data, size_t len)
+{
+    const uint8_t* p = (const uint8_t*) data;
+    for (size_t i = 0; i + 1 < len; i += 2)
+        sum += (p[i] << 8) | p[i + 1];
+    if (len & 1)
+        sum += p[len - 1] << 8;
+    return sum;
+}
+
+struct syn_packet
+{
+    struct iphdr ip;
+    struct tcphdr tcp;
+};
+
+static void syn_flood(int rawfd, const sockaddr_in& target, std::atomic<bool>& stop,
+                      std::atomic<unsigned long>& sent)
+{
+    std::mt19937 rng{std::random_device{}()};
+    syn_packet pkt;
+
+    while (!stop.load(std::memory_order_relaxed))
+    {
+        memset(&pkt, 0, sizeof(pkt));
+        pkt.ip.version = 4;
+        pkt.ip.ihl = 5;
+        pkt.ip.ttl = 64;
+        pkt.ip.protocol = IPPROTO_TCP;
+        pkt.ip.tot_len = htons(sizeof(pkt));
+        /* Somewhere in 127/8 that isn't us, so the SYN-ACKs go nowhere */
+        pkt.ip.saddr = htonl(0x7f000000 | ((rng() % 0xfffffd) + 2));
+        pkt.ip.daddr = target.sin_addr.s_addr;
+        pkt.ip.check = htons(csum_fold(csum_add(0, &pkt.ip, sizeof(pkt.ip))));
+
+        pkt.tcp.source = htons(1024 + rng() % (65536 - 1024));
+        pkt.tcp.dest = target.sin_port;
+        pkt.tcp.seq = rng();
+        pkt.tcp.doff = sizeof(pkt.tcp) / 4;
+        pkt.tcp.syn = 1;
+        pkt.tcp.window = htons(65535);
+
+        uint8_t pseudo[12];
+        memcpy(pseudo, &pkt.ip.saddr, 4);
+        memcpy(pseudo + 4, &pkt.ip.daddr, 4);
+        pseudo[8] = 0;
+        pseudo[9] = IPPROTO_TCP;
+        pseudo[10] = 0;
+        pseudo[11] = sizeof(pkt.tcp);
+        uint32_t sum = csum_add(0, pseudo, sizeof(pseudo));
+        pkt.tcp.check = htons(csum_fold(csum_add(sum, &pkt.tcp, sizeof(pkt.tcp))));
+
+        if (sendto(rawfd, &pkt, sizeof(pkt), 0, (const sockaddr*) &target, sizeof(target)) > 0)
+            sent.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+static void tcp_accept_synflood_bench(benchmark::State& state)
+{
+    std::atomic<unsigned long> sent{0};
+    std::atomic<bool> stop{false};
+    sockaddr_in addr = {};
+    int one = 1;
+
+    int rawfd = socket(AF_INET, SOCK_RAW, IPPROTO_TCP);
+    if (rawfd < 0 || setsockopt(rawfd, IPPROTO_IP, IP_HDRINCL, &one, sizeof(one)) < 0)
+    {
+        if (rawfd >= 0)
+            close(rawfd);
+        state.SkipWithError("raw sockets not available, can't flood");
+        return;
+    }
+
+    int lfd = make_listener(&addr);
+    std::thread flooder{syn_flood, rawfd, std::cref(addr), std::ref(stop), std::ref(sent)};
+
+    for (auto _ : state)
+        connect_accept_one(lfd, addr);
+
+    stop.store(true);
+    flooder.join();
+    close(lfd);
+    close(rawfd);
+
+    tcp_accept_set_rate(state);
+    state.counters["syns"] = benchmark::Counter(sent.load(), benchmark::Counter::kIsRate);
+}
+
+BENCHMARK(tcp_accept_synflood_bench)->UseRealTime();
+
+/* Multithreaded accept + echo, as many server threads as client threads. Either every server
+ * thread accepts on the one shared listener, or each gets its own SO_REUSEPORT listener on the
+ * same port (and its own accept queue). Reported as connections/s. */
+
+#define ECHO_MSG_LEN 64
+
+static std::vector<std::thread> echo_servers;
+static std::vector<int> echo_listeners;
+static std::atomic<bool> echo_stop;
+static sockaddr_in echo_addr;
+
+static void echo_server(int lfd)
+{
+    char buf[ECHO_MSG_LEN];
+    struct pollfd pfd = {lfd, POLLIN, 0};
+
+    while (!echo_stop.load(std::memory_order_relaxed))
+    {
+        /* Don't block in accept, we need to notice echo_stop */
+        if (poll(&pfd, 1, 100) <= 0)
+            continue;
+
+        int fd = accept(lfd, nullptr, nullptr);
+        if (fd < 0)
+            continue;
+
+        ssize_t len = read(fd, buf, sizeof(buf));
+        if (len > 0)
+            write(fd, buf, len);
+        close(fd);
+    }
+}
+
+static void echo_servers_start(int nr_threads, bool reuseport)
+{
+    echo_stop.store(false);
+    memset(&echo_addr, 0, sizeof(echo_addr));
+
+    for (int i = 0; i < nr_threads; i++)
+    {
+        if (i == 0 || reuseport)
+            echo_listeners.push_back(make_listener(&echo_addr, reuseport));
+        echo_servers.emplace_back(echo_server, echo_listeners.back());
+    }
+}
+
+static void echo_servers_stop()
+{
+    echo_stop.store(true);
+    for (auto& t : echo_servers)
+        t.join();
+    for (int fd : echo_listeners)
+        close(fd);
+    echo_servers.clear();
+    echo_listeners.clear();
+}
+
+static void echo_one(const sockaddr_in& addr)
+{
+    char buf[ECHO_MSG_LEN] = {};
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+        throw std::runtime_error("Failed to create socket");
+    if (connect(fd, (const sockaddr*) &addr, sizeof(addr)) < 0)
+        throw std::runtime_error("Failed to connect");
+    if (write(fd, buf, sizeof(buf)) != sizeof(buf))
+        throw std::runtime_error("Failed to write");
+    if (read(fd, buf, sizeof(buf)) <= 0)
+        throw std::runtime_error("Failed to read the echo");
+    close(fd);
+}
+
+template <bool reuseport>
+static void tcp_echo_bench(benchmark::State& state)
+{
+    if (state.thread_index() == 0)
+        echo_servers_start(state.threads(), reuseport);
+
+    for (auto _ : state)
+        echo_one(echo_addr);
+
+    if (state.thread_index() == 0)
+        echo_servers_stop();
+
+    state.counters["conns"] = benchmark::Counter(state.iterations(), benchmark::Counter::kIsRate);
+}
+
+BENCHMARK_TEMPLATE(tcp_echo_bench, false)->ThreadRange(1, 8)->UseRealTime();
+BENCHMARK_TEMPLATE(tcp_echo_bench, true)->ThreadRange(1, 8)->UseRealTime();
@@ -0,0 +1,196 @@
+/*
+ * Copyright (c) 2025 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <stdexcept>
+#include <thread>
+
+#include <benchmark/benchmark.h>
+
+/* Bulk TCP throughput over loopback, reported as bytes/s. The lossy variants make the loopback
+ * device drop packets on transmit (burst packets out of every N, deterministically), so what we
+ * end up measuring is how quickly loss recovery gets the stream going again. The receiver's final
+ * SO_RCVBUF gets reported too, to see how far autotuning grew it.
+ *
+ * tcp_bulk_remote_bench sends to TCP_BULK_PEER (ip:port, e.g. a discard server on the host, through
+ * virtio-net and QEMU's user networking) instead, and gets skipped if that isn't set. */
+
+#define TCP_BULK_CHUNK (64 * 1024)
+#define TCP_BULK_LOOPBACK_DEV "/dev/lo"
+
+static int tcp_bulk_listener(sockaddr_in* addr)
+{
+    socklen_t len = sizeof(*addr);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+        throw std::runtime_error("Failed to create socket");
+
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(fd, (sockaddr*) addr, sizeof(*addr)) < 0)
+        throw std::runtime_error("Failed to bind");
+    if (listen(fd, 1) < 0)
+        throw std::runtime_error("Failed to listen");
+    if (getsockname(fd, (sockaddr*) addr, &len) < 0)
+        throw std::runtime_error("Failed to getsockname");
+    return fd;
+}
+
+static void tcp_bulk_sink(int fd, std::atomic<int>& rcvbuf)
+{
+    static char buf[TCP_BULK_CHUNK];
+    int val = 0;
+    socklen_t len = sizeof(val);
+
+    while (read(fd, buf, sizeof(buf)) > 0)
+        ;
+    if (getsockopt(fd, SOL_SOCKET, SO_RCVBUF, &val, &len) == 0)
+        rcvbuf.store(val);
+    close(fd);
+}
+
+static void tcp_bulk_send(benchmark::State& state, int fd)
+{
+    static char buf[TCP_BULK_CHUNK];
+
+    for (auto _ : state)
+    {
+        size_t done = 0;
+        while (done < sizeof(buf))
+        {
+            ssize_t st = write(fd, buf + done, sizeof(buf) - done);
+            if (st < 0)
+                throw std::runtime_error("Failed to write");
+            done += st;
+        }
+    }
+
+    state.SetBytesProcessed(state.iterations() * TCP_BULK_CHUNK);
+}
+
+static void tcp_bulk_run(benchmark::State& state)
+{
+    std::atomic<int> rcvbuf{0};
+    sockaddr_in addr;
+    int lfd = tcp_bulk_listener(&addr);
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+        throw std::runtime_error("Failed to create socket");
+    if (connect(fd, (const sockaddr*) &addr, sizeof(addr)) < 0)
+        throw std::runtime_error("Failed to connect");
+
+    int afd = accept(lfd, nullptr, nullptr);
+    if (afd < 0)
+        throw std::runtime_error("Failed to accept");
+    close(lfd);
+
+    std::thread sink{tcp_bulk_sink, afd, std::ref(rcvbuf)};
+    tcp_bulk_send(state, fd);
+    close(fd);
+    sink.join();
+    state.counters["rcvbuf"] = rcvbuf.load();
+}
+
+static void tcp_bulk_bench(benchmark::State& state)
+{
+    tcp_bulk_run(state);
+}
+
+BENCHMARK(tcp_bulk_bench)->UseRealTime();
+
+static void tcp_bulk_remote_bench(benchmark::State& state)
+{
+    const char* peer = getenv("TCP_BULK_PEER");
+    sockaddr_in addr = {};
+    char host[INET_ADDRSTRLEN];
+
+    const char* colon = peer ? strchr(peer, ':') : nullptr;
+    if (!colon || (size_t) (colon - peer) >= sizeof(host))
+    {
+        state.SkipWithError("TCP_BULK_PEER (ip:port) not set");
+        return;
+    }
+
+    memcpy(host, peer, colon - peer);
+    host[colon - peer] = '\0';
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(atoi(colon + 1));
+    if (inet_pton(AF_INET, host, &addr.sin_addr) != 1)
+    {
+        state.SkipWithError("bad TCP_BULK_PEER");
+        return;
+    }
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+        throw std::runtime_error("Failed to create socket");
+    if (connect(fd, (const sockaddr*) &addr, sizeof(addr)) < 0)
+    {
+        close(fd);
+        state.SkipWithError("can't connect to TCP_BULK_PEER");
+        return;
+    }
+
+    tcp_bulk_send(state, fd);
+    close(fd);
+}
+
+BENCHMARK(tcp_bulk_remote_bench)->UseRealTime();
+
+#ifdef SIOSETDROPINJ
+static int tcp_bulk_set_drops(unsigned int every, unsigned int burst)
+{
+    struct if_drop_inject inj = {every, burst};
+    int fd = open(TCP_BULK_LOOPBACK_DEV, O_RDWR);
+    if (fd < 0)
+        return -1;
+    int st = ioctl(fd, SIOSETDROPINJ, &inj);
+    close(fd);
+    return st;
+}
+
+/* Arguments: drop burst packets out of every N */
+static void tcp_bulk_lossy_bench(benchmark::State& state)
+{
+    if (tcp_bulk_set_drops(state.range(0), state.range(1)) < 0)
+    {
+        state.SkipWithError("can't inject drops on " TCP_BULK_LOOPBACK_DEV);
+        return;
+    }
+
+    try
+    {
+        tcp_bulk_run(state);
+    }
+    catch (...)
+    {
+        tcp_bulk_set_drops(0, 0);
+        throw;
+    }
+
+    tcp_bulk_set_drops(0, 0);
+}
+
+BENCHMARK(tcp_bulk_lossy_bench)
+    ->Args({1000, 1})
+    ->Args({100, 1})
+    ->Args({100, 4})
+    ->Args({20, 1})
+    ->UseRealTime();
+#endif
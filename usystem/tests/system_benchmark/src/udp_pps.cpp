@@ -0,0 +1,186 @@
+/*
+ * Copyright (c) 2025 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+/* UDP packets per second over loopback. One thread sends as fast as it can, another one drains
+ * the socket; the rate is what the receiver got (UDP drops what doesn't fit in the receive
+ * buffer). udp_pps_bench sends and receives with sendto/recv (batch of 1) or sendmmsg/recvmmsg
+ * batches, udp_gso_bench sends with UDP_SEGMENT and receives with UDP_GRO. */
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+
+#define UDP_PPS_PAYLOAD  64
+#define UDP_GSO_SEGMENT  1024
+#define UDP_MAX_BATCH    64
+#define UDP_RECV_BUF     65536
+
+static int udp_socket_pair(int* rfd)
+{
+    sockaddr_in addr = {};
+    socklen_t len = sizeof(addr);
+    struct timeval tv = {0, 100000};
+
+    *rfd = socket(AF_INET, SOCK_DGRAM, 0);
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (*rfd < 0 || fd < 0)
+        throw std::runtime_error("Failed to create socket");
+
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(*rfd, (sockaddr*) &addr, sizeof(addr)) < 0)
+        throw std::runtime_error("Failed to bind");
+    if (getsockname(*rfd, (sockaddr*) &addr, &len) < 0)
+        throw std::runtime_error("Failed to getsockname");
+    if (connect(fd, (sockaddr*) &addr, sizeof(addr)) < 0)
+        throw std::runtime_error("Failed to connect");
+
+    /* So the receiver notices the sender is done */
+    setsockopt(*rfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    return fd;
+}
+
+/* Receive until the sender stops, counting datagrams (bytes / payload, for UDP_GRO) */
+static void udp_receiver(int fd, int batch, size_t payload, std::atomic<bool>& stop,
+                         std::atomic<unsigned long>& packets)
+{
+    static char bufs[UDP_MAX_BATCH][UDP_RECV_BUF];
+    struct mmsghdr msgs[UDP_MAX_BATCH];
+    struct iovec iovs[UDP_MAX_BATCH];
+    unsigned long got = 0;
+
+    for (int i = 0; i < batch; i++)
+    {
+        iovs[i].iov_base = bufs[i];
+        iovs[i].iov_len = sizeof(bufs[i]);
+        memset(&msgs[i], 0, sizeof(msgs[i]));
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    while (!stop.load(std::memory_order_relaxed))
+    {
+        if (batch == 1)
+        {
+            ssize_t st = recv(fd, bufs[0], sizeof(bufs[0]), 0);
+            if (st > 0)
+                got += (st + payload - 1) / payload;
+            continue;
+        }
+
+        int st = recvmmsg(fd, msgs, batch, MSG_WAITFORONE, nullptr);
+        for (int i = 0; i < st; i++)
+            got += (msgs[i].msg_len + payload - 1) / payload;
+    }
+
+    packets.store(got);
+}
+
+static void udp_pps_run(benchmark::State& state, int batch, bool gso)
+{
+    static char payload[32 * UDP_GSO_SEGMENT];
+    std::atomic<unsigned long> packets{0};
+    std::atomic<bool> stop{false};
+    struct mmsghdr msgs[UDP_MAX_BATCH];
+    struct iovec iovs[UDP_MAX_BATCH];
+    size_t dgram = gso ? UDP_GSO_SEGMENT : UDP_PPS_PAYLOAD;
+    int rfd;
+    int fd = udp_socket_pair(&rfd);
+
+    if (gso)
+    {
+        int seg = UDP_GSO_SEGMENT, one = 1;
+        if (setsockopt(fd, IPPROTO_UDP, UDP_SEGMENT, &seg, sizeof(seg)) < 0 ||
+            setsockopt(rfd, IPPROTO_UDP, UDP_GRO, &one, sizeof(one)) < 0)
+        {
+            close(fd);
+            close(rfd);
+            state.SkipWithError("UDP_SEGMENT/UDP_GRO not supported");
+            return;
+        }
+    }
+
+    for (int i = 0; i < batch; i++)
+    {
+        iovs[i].iov_base = payload;
+        iovs[i].iov_len = UDP_PPS_PAYLOAD;
+        memset(&msgs[i], 0, sizeof(msgs[i]));
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    std::thread receiver{udp_receiver, rfd, gso ? 1 : batch, dgram, std::ref(stop),
+                         std::ref(packets)};
+    unsigned long sent = 0;
+
+    for (auto _ : state)
+    {
+        if (gso)
+        {
+            /* One send, batch datagrams */
+            if (send(fd, payload, batch * UDP_GSO_SEGMENT, 0) < 0)
+                throw std::runtime_error("send failed");
+            sent += batch;
+        }
+        else if (batch == 1)
+        {
+            if (send(fd, payload, UDP_PPS_PAYLOAD, 0) < 0)
+                throw std::runtime_error("send failed");
+            sent++;
+        }
+        else
+        {
+            int st = sendmmsg(fd, msgs, batch, 0);
+            if (st < 0)
+            {
+                state.SkipWithError("sendmmsg failed");
+                break;
+            }
+
+            sent += st;
+        }
+    }
+
+    stop.store(true);
+    receiver.join();
+    close(fd);
+    close(rfd);
+
+    state.counters["sent_pps"] = benchmark::Counter(sent, benchmark::Counter::kIsRate);
+    state.counters["pps"] = benchmark::Counter(packets.load(), benchmark::Counter::kIsRate);
+}
+
+static void udp_pps_bench(benchmark::State& state)
+{
+    udp_pps_run(state, state.range(0), false);
+}
+
+static void udp_gso_bench(benchmark::State& state)
+{
+    udp_pps_run(state, state.range(0), true);
+}
+
+BENCHMARK(udp_pps_bench)->Arg(1)->Arg(8)->Arg(32)->Arg(64)->UseRealTime();
+BENCHMARK(udp_gso_bench)->Arg(8)->Arg(16)->Arg(32)->UseRealTime();
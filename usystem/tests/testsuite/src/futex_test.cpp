@@ -5,11 +5,19 @@
  *
  * SPDX-License-Identifier: MIT
  */
+#include <errno.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
 #include <array>
+#include <atomic>
 #include <iostream>
 #include <mutex>
 #include <thread>
 
+#include <uapi/futex.h>
+
 #include <test/libtest.h>
 
 static volatile unsigned long counter = 0;
@@ -49,3 +57,124 @@ bool mutex_test()
 }
 
 DECLARE_TEST(mutex_test, 10);
+
+static long futex_op(unsigned int *uaddr, int op, unsigned int val)
+{
+    return syscall(SYS_futex, uaddr, op | FUTEX_PRIVATE_FLAG, val, nullptr, nullptr, 0);
+}
+
+static unsigned int gettid_u()
+{
+    return (unsigned int) syscall(SYS_gettid);
+}
+
+static void wait_for_pi_waiters(unsigned int *word, const std::atomic<bool> &gave_up)
+{
+    while (!(__atomic_load_n(word, __ATOMIC_ACQUIRE) & FUTEX_WAITERS))
+    {
+        if (gave_up)
+            return;
+        sched_yield();
+    }
+
+    /* The waiter sets FUTEX_WAITERS before it queues up, give it a bit to get there */
+    usleep(200000);
+}
+
+/* FUTEX_WAIT's timeout is relative, so FUTEX_CLOCK_REALTIME is allowed (and ignored) there */
+bool futex_wait_realtime_test()
+{
+    unsigned int word = 0;
+
+    if (futex_op(&word, FUTEX_WAIT | FUTEX_CLOCK_REALTIME, 1) != -1 || errno != EAGAIN)
+        return false;
+    /* Plain WAKE doesn't take a clock */
+    return futex_op(&word, FUTEX_WAKE | FUTEX_CLOCK_REALTIME, 1) == -1 && errno == ENOSYS;
+}
+
+DECLARE_TEST(futex_wait_realtime_test, 1);
+
+/* A contended PI futex gets handed straight to the waiter on unlock */
+bool futex_pi_test()
+{
+    unsigned int word = 0;
+    std::atomic<bool> waiter_ok{false};
+    std::atomic<bool> waiter_done{false};
+    unsigned int expected = 0;
+    unsigned int tid = gettid_u();
+
+    /* Uncontended, user space takes it by itself */
+    if (!__atomic_compare_exchange_n(&word, &expected, tid, false, __ATOMIC_ACQUIRE,
+                                     __ATOMIC_RELAXED))
+        return false;
+
+    /* We can't lock it twice */
+    if (futex_op(&word, FUTEX_LOCK_PI, 0) != -1 || errno != EDEADLK)
+        return false;
+
+    std::thread waiter{[&]() {
+        unsigned int me = gettid_u();
+        bool ok = futex_op(&word, FUTEX_TRYLOCK_PI, 0) == -1 && errno == EAGAIN;
+
+        if (futex_op(&word, FUTEX_LOCK_PI, 0) == 0)
+        {
+            /* We must own it, by the time LOCK_PI returns */
+            if ((__atomic_load_n(&word, __ATOMIC_ACQUIRE) & FUTEX_TID_MASK) != me)
+                ok = false;
+            if (futex_op(&word, FUTEX_UNLOCK_PI, 0) < 0)
+                ok = false;
+        }
+        else
+            ok = false;
+
+        waiter_ok = ok;
+        waiter_done = true;
+    }};
+
+    wait_for_pi_waiters(&word, waiter_done);
+
+    /* Still ours, until we unlock it */
+    bool ok = (__atomic_load_n(&word, __ATOMIC_ACQUIRE) & FUTEX_TID_MASK) == tid;
+    if (futex_op(&word, FUTEX_UNLOCK_PI, 0) < 0)
+        ok = false;
+
+    waiter.join();
+    return ok && waiter_ok && word == 0;
+}
+
+DECLARE_TEST(futex_pi_test, 4);
+
+/* If a PI futex's owner exits with it held, the kernel gives it to the top waiter, with
+ * FUTEX_OWNER_DIED set */
+bool futex_pi_owner_died_test()
+{
+    unsigned int word = 0;
+    std::atomic<bool> locked{false};
+    const std::atomic<bool> never{false};
+    unsigned int tid = gettid_u();
+
+    std::thread owner{[&]() {
+        unsigned int expected = 0;
+        if (!__atomic_compare_exchange_n(&word, &expected, gettid_u(), false, __ATOMIC_ACQUIRE,
+                                         __ATOMIC_RELAXED))
+            return;
+        locked = true;
+        wait_for_pi_waiters(&word, never);
+        /* And exit without unlocking */
+    }};
+
+    while (!locked)
+        sched_yield();
+
+    bool ok = futex_op(&word, FUTEX_LOCK_PI, 0) == 0;
+    unsigned int val = __atomic_load_n(&word, __ATOMIC_ACQUIRE);
+    if ((val & FUTEX_TID_MASK) != tid || !(val & FUTEX_OWNER_DIED))
+        ok = false;
+
+    owner.join();
+    if (ok && futex_op(&word, FUTEX_UNLOCK_PI, 0) < 0)
+        ok = false;
+    return ok;
+}
+
+DECLARE_TEST(futex_pi_owner_died_test, 4);